@@ -6,6 +6,10 @@ from memray import AllocatorType
 from memray import FileReader
 from memray import MemoryAllocator
 from memray import Tracker
+from memray._test import benchmark_live_throughput
+from memray._test import benchmark_look_up_traces
+from memray._test import benchmark_track_allocations
+from memray._test import benchmark_write_allocation_records
 
 MAX_ITERS = 100000
 
@@ -98,6 +102,73 @@ class AllocatorBenchmarks:
                     mmap_obj[0:100] = b"a" * 100
 
 
+class NativeHotPathBenchmarks:
+    """Time the parts of the tracking hot path in native loops.
+
+    These report the nanoseconds that an iteration took from the point of view
+    of one of the threads, which stays the same as threads are added for the
+    parts that don't contend with each other.
+    """
+
+    params = [1, 4]
+    param_names = ["threads"]
+    unit = "ns"
+
+    def setup(self, threads):
+        self.tempfile = tempfile.NamedTemporaryFile()
+
+    def track_allocation(self, threads):
+        with Tracker("/dev/null"):
+            return benchmark_track_allocations(threads, MAX_ITERS)
+
+    def track_allocation_with_native_traces(self, threads):
+        with Tracker("/dev/null", native_traces=True):
+            return benchmark_track_allocations(threads, MAX_ITERS)
+
+    def track_write_record_to_null_sink(self, threads):
+        return benchmark_write_allocation_records(None, threads, MAX_ITERS)
+
+    def track_write_record_to_file_sink(self, threads):
+        return benchmark_write_allocation_records(
+            self.tempfile.name, threads, MAX_ITERS
+        )
+
+    def track_frame_tree_lookup(self, threads):
+        return benchmark_look_up_traces(threads, MAX_ITERS, 1000, 30, False)
+
+    def track_frame_tree_lookup_with_trace_cache(self, threads):
+        return benchmark_look_up_traces(threads, MAX_ITERS, 1000, 30, True)
+
+
+class LiveBenchmarks:
+    """Send records through a socket to a live reader, like ``memray live``.
+
+    The writer drains its buffers every 10 milliseconds like the tracker does,
+    so the lag can't be much lower than that.
+    """
+
+    params = [1, 4]
+    param_names = ["threads"]
+
+    def setup(self, threads):
+        self.result = benchmark_live_throughput(threads, 10 * MAX_ITERS)
+
+    def track_events_per_second(self, threads):
+        return self.result["events_per_second"]
+
+    track_events_per_second.unit = "events/s"
+
+    def track_max_lag(self, threads):
+        return self.result["max_lag_ns"] / 1e6
+
+    track_max_lag.unit = "ms"
+
+    def track_sender_blocked_time(self, threads):
+        return self.result["sender_blocked_ns"] / 1e6
+
+    track_sender_blocked_time.unit = "ms"
+
+
 class ParserBenchmarks:
     def setup(self):
         self.tempfile = tempfile.NamedTemporaryFile()
@@ -113,6 +184,42 @@ class ParserBenchmarks:
         list(FileReader(self.tempfile.name).get_allocation_records())
 
 
+def make_many_frames(n_functions, n_calls):
+    """Make functions whose calls register many distinct (function, line) frames"""
+    calls = "\n".join("    allocator.valloc(1234); allocator.free()" for _ in range(n_calls))
+    source = "\n".join(
+        f"def func_{i}(allocator):\n{calls}\n" for i in range(n_functions)
+    )
+    namespace = {}
+    exec(compile(source, "many_frames.py", "exec"), namespace)
+    return [namespace[f"func_{i}"] for i in range(n_functions)]
+
+
+class FrameRegistrationBenchmarks:
+    def setup(self):
+        self.tempfile = tempfile.NamedTemporaryFile()
+        self.allocator = MemoryAllocator()
+        self.functions = make_many_frames(500, 40)
+        self.recorded_file = tempfile.NamedTemporaryFile()
+        os.unlink(self.recorded_file.name)
+        with Tracker(self.recorded_file.name):
+            self.call_all()
+
+    def call_all(self):
+        for _ in range(5):
+            for function in self.functions:
+                function(self.allocator)
+
+    def time_tracking_many_frames(self):
+        os.unlink(self.tempfile.name)
+        with Tracker(self.tempfile.name):
+            self.call_all()
+
+    def time_parsing_many_frames(self):
+        for record in FileReader(self.recorded_file.name).get_allocation_records():
+            record.stack_trace()
+
+
 def recursive(n, chunk_size):
     """Mimics generally-increasing but spiky usage"""
     if not n:
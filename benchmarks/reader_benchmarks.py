@@ -0,0 +1,141 @@
+"""Benchmarks of reading captures and reporting on them.
+
+The captures are made up by ``write_synthetic_capture``, which writes records
+much faster than a tracked program could make them. They have 1M records by
+default, and ``MEMRAY_BENCHMARK_RECORDS`` sets how many, so that the readers
+can also be tracked on captures of 10M to 500M records::
+
+    MEMRAY_BENCHMARK_RECORDS=100000000 asv run --bench reader_benchmarks
+
+The ``peakmem_`` benchmarks track the peak RSS of the same operations.
+"""
+
+import os
+
+from memray import FileReader
+from memray import MemoryAllocator
+from memray import Tracker
+from memray._memray import resolve_stack_traces
+from memray._test import SnapshotBenchmark
+from memray._test import benchmark_read_records
+from memray._test import write_synthetic_capture
+from memray.reporters.flamegraph import FlameGraphReporter
+from memray.reporters.stats import StatsReporter
+from memray.reporters.summary import SummaryReporter
+from memray.reporters.table import TableReporter
+from memray.reporters.tree import TreeReporter
+
+N_RECORDS = int(os.environ.get("MEMRAY_BENCHMARK_RECORDS", 1_000_000))
+STACK_DEPTH = 64
+SYNTHETIC_CAPTURE = "synthetic.bin"
+NATIVE_CAPTURE = "native.bin"
+
+
+def make_captures():
+    write_synthetic_capture(SYNTHETIC_CAPTURE, N_RECORDS, STACK_DEPTH)
+
+    allocator = MemoryAllocator()
+
+    def recurse(n):
+        if n:
+            recurse(n - 1)
+        for _ in range(10):
+            allocator.valloc(1234)
+            allocator.free()
+
+    if os.path.exists(NATIVE_CAPTURE):
+        os.unlink(NATIVE_CAPTURE)
+    with Tracker(NATIVE_CAPTURE, native_traces=True):
+        for depth in range(200):
+            recurse(depth)
+
+
+class CaptureBenchmarks:
+    # asv makes the captures once for all the classes that share this method.
+    timeout = 600
+
+    def setup_cache(self):
+        make_captures()
+
+
+class RecordReaderBenchmarks(CaptureBenchmarks):
+    def time_next_record(self):
+        benchmark_read_records(SYNTHETIC_CAPTURE)
+
+    def peakmem_next_record(self):
+        benchmark_read_records(SYNTHETIC_CAPTURE)
+
+    def time_streaming_high_watermark_records(self):
+        reader = FileReader(SYNTHETIC_CAPTURE, streaming=True)
+        list(reader.get_high_watermark_allocation_records())
+
+    def peakmem_streaming_high_watermark_records(self):
+        reader = FileReader(SYNTHETIC_CAPTURE, streaming=True)
+        list(reader.get_high_watermark_allocation_records())
+
+    def peakmem_high_watermark_records(self):
+        reader = FileReader(SYNTHETIC_CAPTURE)
+        list(reader.get_high_watermark_allocation_records())
+
+
+class SnapshotBenchmarks(CaptureBenchmarks):
+    def setup(self):
+        self.snapshots = SnapshotBenchmark(SYNTHETIC_CAPTURE)
+
+    def time_high_watermark(self):
+        self.snapshots.high_watermark()
+
+    def time_snapshot_at_the_end(self):
+        self.snapshots.snapshot_allocations(self.snapshots.num_records)
+
+    def time_snapshot_halfway(self):
+        self.snapshots.snapshot_allocations(self.snapshots.num_records // 2)
+
+
+class SymbolResolutionBenchmarks(CaptureBenchmarks):
+    # Resolved symbols are kept by the reader, so every sample needs a new one.
+    number = 1
+
+    def setup(self):
+        reader = FileReader(NATIVE_CAPTURE)
+        self.records = list(reader.get_allocation_records())
+
+    def time_resolve_native_stacks(self):
+        resolve_stack_traces(self.records, native=True)
+
+    def peakmem_resolve_native_stacks(self):
+        resolve_stack_traces(self.records, native=True)
+
+
+class ReporterBenchmarks(CaptureBenchmarks):
+    # Stack traces are kept by the records, so every sample needs new ones.
+    number = 1
+
+    def setup(self):
+        self.reader = FileReader(SYNTHETIC_CAPTURE)
+        self.records = list(self.reader.get_high_watermark_allocation_records())
+        self.memory_records = list(self.reader.get_memory_records())
+
+    def time_flamegraph(self):
+        FlameGraphReporter.from_snapshot(
+            self.records, memory_records=self.memory_records, native_traces=False
+        )
+
+    def peakmem_flamegraph(self):
+        FlameGraphReporter.from_snapshot(
+            self.records, memory_records=self.memory_records, native_traces=False
+        )
+
+    def time_table(self):
+        TableReporter.from_snapshot(
+            self.records, memory_records=self.memory_records, native_traces=False
+        )
+
+    def time_tree(self):
+        TreeReporter.from_snapshot(self.records, native_traces=False)
+
+    def time_summary(self):
+        SummaryReporter.from_snapshot(self.records)
+
+    def time_stats(self):
+        StatsReporter.from_snapshot(self.records, num_largest=5)
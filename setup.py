@@ -190,14 +190,28 @@ MEMRAY_EXTENSION = Extension(
         "src/memray/_memray/record_reader.cpp",
         "src/memray/_memray/record_writer.cpp",
         "src/memray/_memray/snapshot.cpp",
+        "src/memray/_memray/read_progress.cpp",
+        "src/memray/_memray/capture_family.cpp",
+        "src/memray/_memray/capture_diff.cpp",
+        "src/memray/_memray/profile_export.cpp",
         "src/memray/_memray/socket_reader_thread.cpp",
+        "src/memray/_memray/socket_collector.cpp",
         "src/memray/_memray/native_resolver.cpp",
+        "src/memray/_memray/flamegraph.cpp",
+        "src/memray/_memray/benchmark.cpp",
     ],
-    libraries=["unwind"],
+    libraries=["unwind", "zstd", "rt"],
     library_dirs=[str(LIBBACKTRACE_LIBDIR)],
     include_dirs=["src", str(LIBBACKTRACE_INCLUDEDIRS)],
     language="c++",
-    extra_compile_args=["-std=c++17", "-Wall", *EXTRA_COMPILE_ARGS],
+    # Keep frame pointers in our own hooks, so that the frame pointer unwinder
+    # can walk through them.
+    extra_compile_args=[
+        "-std=c++17",
+        "-Wall",
+        "-fno-omit-frame-pointer",
+        *EXTRA_COMPILE_ARGS,
+    ],
     extra_link_args=["-std=c++17", "-l:libbacktrace.a"],
     define_macros=DEFINE_MACROS,
     undef_macros=UNDEF_MACROS,
@@ -1,16 +1,27 @@
 from ._memray import AllocationRecord
 from ._memray import AllocatorType
+from ._memray import CaptureDiff
+from ._memray import CaptureFamilyReader
+from ._memray import CollectorDestination
 from ._memray import Destination
 from ._memray import FileDestination
+from ._memray import FileFormat
 from ._memray import FileReader
+from ._memray import FlightRecorderDestination
 from ._memray import MemoryRecord
+from ._memray import SharedMemoryDestination
+from ._memray import SocketCollector
 from ._memray import SocketDestination
 from ._memray import SocketReader
 from ._memray import Tracker
 from ._memray import dump_all_records
 from ._memray import set_log_level
 from ._memray import start_thread_trace
+from ._metadata import CaptureSummary
+from ._metadata import LiveStats
 from ._metadata import Metadata
+from ._metadata import ReadProgress
+from ._metadata import StackDelta
 from ._version import __version__
 
 __all__ = [
@@ -21,11 +32,22 @@ __all__ = [
     "start_thread_trace",
     "Tracker",
     "FileReader",
+    "CaptureFamilyReader",
+    "CaptureDiff",
+    "FileFormat",
     "SocketReader",
+    "SocketCollector",
     "Destination",
     "FileDestination",
+    "FlightRecorderDestination",
     "SocketDestination",
+    "CollectorDestination",
+    "SharedMemoryDestination",
     "Metadata",
+    "CaptureSummary",
+    "LiveStats",
+    "ReadProgress",
+    "StackDelta",
     "__version__",
     "set_log_level",
 ]
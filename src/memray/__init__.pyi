@@ -2,6 +2,7 @@ from memray._destination import Destination as Destination
 from memray._destination import FileDestination as FileDestination
 from memray._destination import SocketDestination as SocketDestination
 from memray._metadata import Metadata as Metadata
+from memray._metadata import ReadProgress as ReadProgress
 
 from ._memray import AllocationRecord as AllocationRecord
 from ._memray import AllocatorType as AllocatorType
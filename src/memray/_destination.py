@@ -12,9 +12,32 @@ class Destination:
 class FileDestination(Destination):
     path: typing.Union[pathlib.Path, str]
     exist_ok: bool = False
+    io_uring: bool = False
+
+
+@dataclass(frozen=True)
+class FlightRecorderDestination(Destination):
+    path: typing.Union[pathlib.Path, str]
+    capacity: int = 64 * 1024 * 1024
+    exist_ok: bool = False
+    dump_rss: int = 0
 
 
 @dataclass(frozen=True)
 class SocketDestination(Destination):
     port: int
     host: typing.Optional[str] = "127.0.0.1"
+    buffer_size: int = 256 * 1024
+
+
+@dataclass(frozen=True)
+class CollectorDestination(Destination):
+    port: int
+    host: str = "127.0.0.1"
+    buffer_size: int = 256 * 1024
+
+
+@dataclass(frozen=True)
+class SharedMemoryDestination(Destination):
+    name: str
+    capacity: int = 8 * 1024 * 1024
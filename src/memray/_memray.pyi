@@ -1,26 +1,64 @@
 import enum
+from datetime import datetime
 from pathlib import Path
 from types import TracebackType
 from typing import Any
 from typing import Callable
+from typing import Dict
 from typing import Iterable
 from typing import Iterator
 from typing import List
+from typing import Literal
 from typing import NamedTuple
 from typing import Optional
+from typing import Sequence
 from typing import Tuple
 from typing import Type
 from typing import Union
 from typing import overload
 
+from memray._destination import CollectorDestination as CollectorDestination
+from memray._destination import FlightRecorderDestination as FlightRecorderDestination
+from memray._destination import SharedMemoryDestination as SharedMemoryDestination
 from memray._destination import SocketDestination as SocketDestination
+from memray._metadata import CaptureSummary
+from memray._metadata import LiveStats
 from memray._metadata import Metadata
+from memray._metadata import ReadProgress
+from memray._metadata import StackDelta
+from memray._metadata import TrackerOverhead
 
 from . import Destination
 
 PythonStackElement = Tuple[str, str, int]
 NativeStackElement = Tuple[str, str, int]
-MemoryRecord = NamedTuple("MemoryRecord", [("time", int), ("rss", int)])
+
+class MemoryRecord(NamedTuple):
+    time: int
+    rss: int
+    heap_size: Optional[int] = None
+    heap_in_use: Optional[int] = None
+    pymalloc_arenas: Optional[int] = None
+    tracked_bytes: Optional[int] = None
+
+class MemoryTimelinePoint(NamedTuple):
+    start_time: int
+    end_time: int
+    min_rss: int
+    max_rss: int
+    min_heap: int
+    max_heap: int
+    peak_index: Optional[int]
+    n_memory_records: int
+
+StackTable = NamedTuple(
+    "StackTable",
+    [
+        ("frames", List[Union[PythonStackElement, NativeStackElement]]),
+        ("stacks", List[Tuple[int, ...]]),
+        ("record_stacks", List[Optional[int]]),
+    ],
+)
 
 def set_log_level(level: int) -> None: ...
 
@@ -57,6 +95,64 @@ class AllocationRecord:
     def __lt__(self, other: Any) -> Any: ...
     def __ne__(self, other: Any) -> Any: ...
 
+class AllocationColumns:
+    tid: memoryview
+    address: memoryview
+    size: memoryview
+    allocator: memoryview
+    stack_id: memoryview
+    native_stack_id: memoryview
+    native_segment_generation: memoryview
+    n_allocations: memoryview
+    realloc_old_address: memoryview
+    def record(self, index: int) -> AllocationRecord: ...
+    def __len__(self) -> int: ...
+
+class AllocationStats:
+    def __init__(self, num_largest: int) -> None: ...
+    @property
+    def num_largest(self) -> int: ...
+    @property
+    def total_memory_allocated(self) -> int: ...
+    @property
+    def total_num_allocations(self) -> int: ...
+    @property
+    def allocator_type_counts(self) -> Dict[AllocatorType, int]: ...
+    def largest_by_size(self) -> List[AllocationRecord]: ...
+    def largest_by_count(self) -> List[AllocationRecord]: ...
+    @property
+    def num_sized_allocations(self) -> int: ...
+    @property
+    def min_size(self) -> int: ...
+    @property
+    def max_size(self) -> int: ...
+    def size_histogram(self, bins: int) -> List[Tuple[int, int]]: ...
+    def size_percentile(self, percentile: float) -> int: ...
+
+def resolve_stack_traces(
+    records: Iterable[Any],
+    *,
+    native: bool = False,
+    max_stacks: Optional[int] = None,
+) -> StackTable: ...
+
+class FlameGraphBuilder:
+    def __init__(
+        self,
+        frame_key: Callable[[PythonStackElement], int],
+        thread_key: Callable[[str], int],
+        max_stacks: int,
+    ) -> None: ...
+    def add(self, record: AllocationRecord) -> None: ...
+    def to_json(
+        self,
+        root_properties: str,
+        frame_properties: List[str],
+        frame_is_interesting: List[bool],
+        thread_properties: List[str],
+        too_deep_properties: str,
+    ) -> str: ...
+
 class AllocatorType(enum.IntEnum):
     MALLOC: int
     FREE: int
@@ -68,21 +164,66 @@ class AllocatorType(enum.IntEnum):
     PVALLOC: int
     MMAP: int
     MUNMAP: int
+    PYMALLOC_MALLOC: int
+    PYMALLOC_CALLOC: int
+    PYMALLOC_REALLOC: int
+    PYMALLOC_FREE: int
+
+class FileFormat(enum.IntEnum):
+    ALL_ALLOCATIONS: int
+    AGGREGATED_ALLOCATIONS: int
+    ALLOCATION_COUNTS: int
 
 class FileReader:
     @property
     def has_native_traces(self) -> bool: ...
     @property
     def metadata(self) -> Metadata: ...
-    def __init__(self, file_name: Union[str, Path]) -> None: ...
+    @property
+    def file_format(self) -> FileFormat: ...
+    def __init__(
+        self,
+        file_name: Union[str, Path],
+        *,
+        max_workers: Optional[int] = None,
+        streaming: bool = False,
+        symbol_cache_dir: Union[str, Path, None] = None,
+        high_watermark_index: bool = False,
+        progress_callback: Optional[Callable[[ReadProgress], None]] = None,
+        memory_budget: Optional[int] = None,
+        spill_directory: Union[str, Path, None] = None,
+        threads: Optional[Iterable[int]] = None,
+        start_time: Optional[datetime] = None,
+        end_time: Optional[datetime] = None,
+    ) -> None: ...
     def get_allocation_records(self) -> Iterable[AllocationRecord]: ...
+    def get_allocation_columns(self) -> AllocationColumns: ...
     def get_high_watermark_allocation_records(
         self, merge_threads: bool
     ) -> Iterable[AllocationRecord]: ...
     def get_leaked_allocation_records(
         self, merge_threads: bool
     ) -> Iterable[AllocationRecord]: ...
+    def get_allocation_counts(
+        self, merge_threads: bool = True
+    ) -> Iterable[AllocationRecord]: ...
+    def get_leaked_allocation_ages(
+        self, merge_threads: bool = True
+    ) -> List[Tuple[AllocationRecord, List[Tuple[int, int, int, int]]]]: ...
+    def get_snapshot_at(
+        self, index_or_time: Union[int, datetime], *, merge_threads: bool = True
+    ) -> Iterable[AllocationRecord]: ...
+    def get_allocation_stats(
+        self,
+        num_largest: int,
+        *,
+        include_all_allocations: bool = False,
+        merge_threads: bool = True,
+    ) -> AllocationStats: ...
     def get_memory_records(self) -> Iterable[MemoryRecord]: ...
+    def get_memory_timeline(
+        self, n_points: int = 1000
+    ) -> List[MemoryTimelinePoint]: ...
     def __enter__(self) -> Any: ...
     def __exit__(
         self,
@@ -94,10 +235,61 @@ class FileReader:
     def closed(self) -> bool: ...
     def close(self) -> None: ...
 
-def dump_all_records(file_name: Union[str, Path]) -> None: ...
+def dump_all_records(
+    file_name: Union[str, Path],
+    *,
+    progress_callback: Optional[Callable[[ReadProgress], None]] = None,
+) -> None: ...
+
+class CaptureFamilyReader:
+    def __init__(
+        self,
+        file_names: Iterable[Union[str, Path]],
+        *,
+        max_workers: Optional[int] = None,
+        symbol_cache_dir: Union[str, Path, None] = None,
+    ) -> None: ...
+    @classmethod
+    def from_parent(
+        cls,
+        file_name: Union[str, Path],
+        *,
+        max_workers: Optional[int] = None,
+        symbol_cache_dir: Union[str, Path, None] = None,
+    ) -> "CaptureFamilyReader": ...
+    @property
+    def processes(self) -> List[CaptureSummary]: ...
+    @property
+    def peak_memory(self) -> int: ...
+    @property
+    def has_native_traces(self) -> bool: ...
+    def get_high_watermark_allocation_records(
+        self, merge_threads: bool = True, *, pid: Optional[int] = None
+    ) -> Iterator[AllocationRecord]: ...
+    def get_leaked_allocation_records(
+        self, merge_threads: bool = True, *, pid: Optional[int] = None
+    ) -> Iterator[AllocationRecord]: ...
+
+class CaptureDiff:
+    def __init__(
+        self,
+        before: Union[str, Path],
+        after: Union[str, Path],
+        *,
+        max_workers: Optional[int] = None,
+        symbol_cache_dir: Union[str, Path, None] = None,
+    ) -> None: ...
+    @property
+    def before(self) -> CaptureSummary: ...
+    @property
+    def after(self) -> CaptureSummary: ...
+    def get_stack_deltas(self, *, leaks: bool = False) -> List[StackDelta]: ...
 
 class SocketReader:
+    @overload
     def __init__(self, port: int) -> None: ...
+    @overload
+    def __init__(self, *, shared_memory_name: str) -> None: ...
     def __enter__(self) -> "SocketReader": ...
     def __exit__(
         self,
@@ -108,6 +300,9 @@ class SocketReader:
     def get_current_snapshot(
         self, *, merge_threads: bool
     ) -> Iterator[AllocationRecord]: ...
+    def get_snapshot_changes(
+        self, *, since: int = 0
+    ) -> Tuple[int, List[AllocationRecord]]: ...
     @property
     def command_line(self) -> Optional[str]: ...
     @property
@@ -116,6 +311,27 @@ class SocketReader:
     def pid(self) -> Optional[int]: ...
     @property
     def has_native_traces(self) -> bool: ...
+    @property
+    def symbols_version(self) -> int: ...
+    @property
+    def live_stats(self) -> LiveStats: ...
+
+class SocketCollector:
+    def __init__(self, port: int = 0, *, host: str = "127.0.0.1") -> None: ...
+    def __enter__(self) -> "SocketCollector": ...
+    def __exit__(
+        self,
+        exc_type: Optional[Type[BaseException]],
+        exc_value: Optional[BaseException],
+        exc_traceback: Optional[TracebackType],
+    ) -> Any: ...
+    @property
+    def port(self) -> int: ...
+    @property
+    def pids(self) -> List[int]: ...
+    def get_current_snapshot(
+        self, *, merge_threads: bool, pid: Optional[int] = None
+    ) -> Iterator[AllocationRecord]: ...
 
 class Tracker:
     @property
@@ -125,14 +341,40 @@ class Tracker:
         self,
         file_name: Union[Path, str],
         *,
-        native_traces: bool = False,
+        native_traces: Union[bool, Literal["fp"]] = False,
+        sample_rate: int = 0,
+        file_format: FileFormat = FileFormat.ALL_ALLOCATIONS,
+        cancel_short_lived_allocations: bool = False,
+        compression: Optional[Literal["zstd"]] = None,
+        backpressure: Literal["block", "drop"] = "block",
+        lazy_python_stacks: bool = False,
+        max_python_frames: int = 0,
+        max_native_frames: int = 0,
+        excluded_filenames: Sequence[str] = (),
+        trigger_rss: int = 0,
+        trigger_rss_growth: int = 0,
+        memory_gauges: bool = False,
+        trace_python_allocators: bool = False,
     ) -> None: ...
     @overload
     def __init__(
         self,
         *,
         destination: Destination,
-        native_traces: bool = False,
+        native_traces: Union[bool, Literal["fp"]] = False,
+        sample_rate: int = 0,
+        file_format: FileFormat = FileFormat.ALL_ALLOCATIONS,
+        cancel_short_lived_allocations: bool = False,
+        compression: Optional[Literal["zstd"]] = None,
+        backpressure: Literal["block", "drop"] = "block",
+        lazy_python_stacks: bool = False,
+        max_python_frames: int = 0,
+        max_native_frames: int = 0,
+        excluded_filenames: Sequence[str] = (),
+        trigger_rss: int = 0,
+        trigger_rss_growth: int = 0,
+        memory_gauges: bool = False,
+        trace_python_allocators: bool = False,
     ) -> None: ...
     def __enter__(self) -> Any: ...
     def __exit__(
@@ -141,6 +383,7 @@ class Tracker:
         excinst: Optional[BaseException],
         exctb: Optional[TracebackType],
     ) -> bool: ...
+    def get_overhead(self) -> TrackerOverhead: ...
 
 class MemoryAllocator:
     def __init__(self) -> None: ...
@@ -160,8 +403,45 @@ class MmapAllocator:
     def address(self) -> int: ...
     def munmap(self, length: int, offset: int = 0) -> None: ...
 
+class PymallocMemoryAllocator:
+    def __init__(self, domain: Literal["mem", "object"]) -> None: ...
+    def free(self) -> None: ...
+    def malloc(self, size: int) -> None: ...
+    def calloc(self, size: int) -> None: ...
+    def realloc(self, size: int) -> None: ...
+
 def _cython_nested_allocation(
     allocator_fn: Callable[[int], None], size: int
 ) -> None: ...
 def size_fmt(num: int, suffix: str = "B") -> str: ...
+def export_profile(
+    file_name: Union[str, Path],
+    profile_format: str,
+    *,
+    leaks: bool = False,
+    symbol_cache_dir: Union[str, Path, None] = None,
+) -> bytes: ...
 def set_thread_name(name: str) -> int: ...
+def benchmark_track_allocations(n_threads: int, n_iterations: int) -> float: ...
+def benchmark_write_allocation_records(
+    file_name: Union[str, Path, None], n_threads: int, n_iterations: int
+) -> float: ...
+def benchmark_look_up_traces(
+    n_threads: int, n_iterations: int, n_stacks: int, depth: int, use_cache: bool
+) -> float: ...
+def write_synthetic_capture(
+    file_name: Union[str, Path], n_records: int, stack_depth: int
+) -> None: ...
+def benchmark_read_records(file_name: Union[str, Path]) -> int: ...
+def benchmark_live_throughput(
+    n_threads: int, n_iterations: int
+) -> Dict[str, Union[int, float]]: ...
+
+class SnapshotBenchmark:
+    def __init__(self, file_name: Union[str, Path]) -> None: ...
+    @property
+    def num_records(self) -> int: ...
+    def high_watermark(self) -> int: ...
+    def snapshot_allocations(
+        self, n_records: int, merge_threads: bool = True
+    ) -> int: ...
@@ -1,42 +1,121 @@
 import collections
 import contextlib
+import glob
+import operator
 import os
 import pathlib
 import sys
+import tempfile
 
 cimport cython
+from cython.operator cimport dereference as deref
+from cython.operator cimport preincrement as inc
 
 import threading
 from datetime import datetime
 
+from _memray.allocation_store cimport Allocator as StoredAllocator
+from _memray.allocation_store cimport AllocationStore
+from _memray.benchmark cimport LiveThroughput
+from _memray.benchmark cimport SnapshotBenchmark as NativeSnapshotBenchmark
+from _memray.benchmark cimport liveThroughput
+from _memray.benchmark cimport lookUpTraces
+from _memray.benchmark cimport readRecords
+from _memray.benchmark cimport trackAllocations
+from _memray.benchmark cimport writeAllocationRecords
+from _memray.benchmark cimport writeSyntheticCapture
+from _memray.capture_diff cimport CaptureDiff as NativeCaptureDiff
+from _memray.capture_diff cimport StackDelta as _StackDelta
+from _memray.capture_family cimport CaptureFamily
+from _memray.flamegraph cimport FlameGraph
 from _memray.logging cimport setLogThreshold
+from _memray.profile_export cimport ProfileExporter
+from _memray.read_progress cimport ProgressUpdate
+from _memray.read_progress cimport ReadPhaseHighWatermark
+from _memray.read_progress cimport ReadPhaseParse
+from _memray.read_progress cimport ReadPhaseSymbolization
+from _memray.read_progress cimport ReadProgress as NativeReadProgress
+from _memray.record_reader cimport RecordFilter
 from _memray.record_reader cimport RecordReader
 from _memray.record_reader cimport RecordResult
+from _memray.record_writer cimport BACKPRESSURE_BLOCK
+from _memray.record_writer cimport BACKPRESSURE_DROP
+from _memray.record_writer cimport BackpressurePolicy
 from _memray.record_writer cimport RecordWriter
+from _memray.records cimport Allocation
+from _memray.records cimport Allocator as RecordAllocator
+from _memray.records cimport FileFormat as _FileFormat
+from _memray.records cimport MemoryGauges
+from _memray.records cimport MemoryRecord as _MemoryRecord
+from _memray.sink cimport CompressedFileSink
 from _memray.sink cimport FileSink
+from _memray.sink cimport FlightRecorderSink
 from _memray.sink cimport NullSink
+from _memray.sink cimport SharedMemorySink
 from _memray.sink cimport Sink
 from _memray.sink cimport SocketSink
+from _memray.sink cimport UringFileSink
+from _memray.snapshot cimport Allocator
+from _memray.snapshot cimport AllocationStatsAggregator
+from _memray.snapshot cimport HeapCheckpoints
 from _memray.snapshot cimport HighWatermark
-from _memray.snapshot cimport Py_GetSnapshotAllocationRecords
+from _memray.snapshot cimport HighWatermarkFinder
+from _memray.snapshot cimport HighWatermarkIndex
+from _memray.snapshot cimport LeakAgeAggregator
+from _memray.snapshot cimport MemoryTimelineAggregator
+from _memray.snapshot cimport MemoryTimelinePoint as _MemoryTimelinePoint
+from _memray.snapshot cimport SnapshotAllocationAggregator
+from _memray.snapshot cimport StackAges
+from _memray.snapshot cimport getAggregatedHighWatermark
+from _memray.snapshot cimport getAggregatedSnapshotAllocations
+from _memray.snapshot cimport getAllocationCounts
 from _memray.snapshot cimport getHighWatermark
+from _memray.snapshot cimport getSnapshotAllocations
+from _memray.snapshot cimport reduced_snapshot_map_t
+from _memray.socket_collector cimport SocketCollector as NativeSocketCollector
 from _memray.socket_reader_thread cimport BackgroundSocketReader
+from _memray.socket_reader_thread cimport LiveStats as NativeLiveStats
 from _memray.source cimport FileSource
+from _memray.source cimport SharedMemorySource
 from _memray.source cimport SocketSource
+from _memray.source cimport Source
+from _memray.tracking_api cimport NativeUnwinder
+from _memray.tracking_api cimport NativeUnwinderFramePointer
+from _memray.tracking_api cimport NativeUnwinderLibunwind
 from _memray.tracking_api cimport Tracker as NativeTracker
 from _memray.tracking_api cimport install_trace_function
+from cpython.buffer cimport PyBUF_FORMAT
+from cpython.buffer cimport PyBUF_ND
+from cpython.buffer cimport PyBUF_STRIDES
+from cpython.buffer cimport PyBUF_WRITABLE
+from cpython.ref cimport Py_DECREF
+from cpython.ref cimport Py_INCREF
+from libc.stdint cimport SIZE_MAX
+from libc.stdint cimport uint32_t
+from libc.stdint cimport uint64_t
+from libc.stdint cimport uintptr_t
 from libcpp cimport bool
 from libcpp.memory cimport make_shared
 from libcpp.memory cimport make_unique
 from libcpp.memory cimport shared_ptr
 from libcpp.memory cimport unique_ptr
 from libcpp.string cimport string as cppstring
+from libcpp.unordered_map cimport unordered_map
 from libcpp.utility cimport move
+from libcpp.utility cimport pair
 from libcpp.vector cimport vector
 
+from ._destination import CollectorDestination
 from ._destination import FileDestination
+from ._destination import FlightRecorderDestination
+from ._destination import SharedMemoryDestination
 from ._destination import SocketDestination
+from ._metadata import CaptureSummary
+from ._metadata import LiveStats
 from ._metadata import Metadata
+from ._metadata import ReadProgress
+from ._metadata import StackDelta
+from ._metadata import TrackerOverhead
 
 include "_memray_test_utils.pyx"
 
@@ -65,6 +144,10 @@ cpdef enum AllocatorType:
     PVALLOC = 8
     MMAP = 9
     MUNMAP = 10
+    PYMALLOC_MALLOC = 11
+    PYMALLOC_CALLOC = 12
+    PYMALLOC_REALLOC = 13
+    PYMALLOC_FREE = 14
 
 cpdef enum PythonAllocatorType:
     PYTHON_ALLOCATOR_PYMALLOC = 1
@@ -72,6 +155,11 @@ cpdef enum PythonAllocatorType:
     PYTHON_ALLOCATOR_MALLOC = 3
     PYTHON_ALLOCATOR_OTHER = 4
 
+cpdef enum FileFormat:
+    ALL_ALLOCATIONS = 1
+    AGGREGATED_ALLOCATIONS = 2
+    ALLOCATION_COUNTS = 3
+
 def size_fmt(num, suffix='B'):
     for unit in ['','K','M','G','T','P','E','Z']:
         if abs(num) < 1024.0:
@@ -85,48 +173,72 @@ PYTHON_VERSION = (sys.version_info.major, sys.version_info.minor)
 
 @cython.freelist(1024)
 cdef class AllocationRecord:
-    cdef object _tuple
+    # The fields are only turned into Python objects when they are asked for.
+    cdef Allocation _allocation
     cdef object _stack_trace
     cdef object _native_stack_trace
     cdef shared_ptr[RecordReader] _reader
 
     def __init__(self, record):
-        self._tuple = record
+        # A tuple with the tid, address, size, allocator, stack id and number
+        # of allocations, and optionally the native stack id and segment
+        # generation.
+        self._allocation.record.tid = record[0]
+        self._allocation.record.address = record[1]
+        self._allocation.record.size = record[2]
+        self._allocation.record.allocator = <RecordAllocator> <int> record[3]
+        self._allocation.frame_index = record[4]
+        self._allocation.n_allocations = record[5]
+        if len(record) > 6:
+            self._allocation.record.native_frame_id = record[6]
+            self._allocation.native_segment_generation = record[7]
         self._stack_trace = None
 
+    cdef tuple _fields(self):
+        return (
+            self._allocation.record.tid,
+            self._allocation.record.address,
+            self._allocation.record.size,
+            <int> self._allocation.record.allocator,
+            self._allocation.frame_index,
+            self._allocation.n_allocations,
+            self._allocation.record.native_frame_id,
+            self._allocation.native_segment_generation,
+        )
+
     def __eq__(self, other):
         cdef AllocationRecord _other
         if isinstance(other, AllocationRecord):
             _other = other
-            return self._tuple == _other._tuple
+            return self._fields() == _other._fields()
         return NotImplemented
 
     def __hash__(self):
-        return hash(self._tuple)
+        return hash(self._fields())
 
     @property
     def tid(self):
-        return self._tuple[0]
+        return self._allocation.record.tid
 
     @property
     def address(self):
-        return self._tuple[1]
+        return self._allocation.record.address
 
     @property
     def size(self):
-        return self._tuple[2]
+        return self._allocation.record.size
 
     @property
     def allocator(self):
-        return self._tuple[3]
+        return <int> self._allocation.record.allocator
 
     @property
     def stack_id(self):
-        return self._tuple[4]
+        return self._allocation.frame_index
 
     @property
     def n_allocations(self):
-        return self._tuple[5]
+        return self._allocation.n_allocations
 
     @property
     def thread_name(self):
@@ -141,9 +253,11 @@ cdef class AllocationRecord:
         assert self._reader.get() != NULL, "Cannot get stack trace without reader."
         if self._stack_trace is None:
             if max_stacks is None:
-                self._stack_trace = self._reader.get().Py_GetStackFrame(self._tuple[4])
+                self._stack_trace = self._reader.get().Py_GetStackFrame(
+                        self._allocation.frame_index)
             else:
-                self._stack_trace = self._reader.get().Py_GetStackFrame(self._tuple[4], max_stacks)
+                self._stack_trace = self._reader.get().Py_GetStackFrame(
+                        self._allocation.frame_index, max_stacks)
         return self._stack_trace
 
     def native_stack_trace(self, max_stacks=None):
@@ -151,36 +265,27 @@ cdef class AllocationRecord:
         if self._native_stack_trace is None:
             if max_stacks is None:
                 self._native_stack_trace = self._reader.get().Py_GetNativeStackFrame(
-                        self._tuple[6], self._tuple[7])
+                        self._allocation.record.native_frame_id,
+                        self._allocation.native_segment_generation)
             else:
                 self._native_stack_trace = self._reader.get().Py_GetNativeStackFrame(
-                        self._tuple[6], self._tuple[7], max_stacks)
+                        self._allocation.record.native_frame_id,
+                        self._allocation.native_segment_generation,
+                        max_stacks)
         return self._native_stack_trace
 
-    cdef _is_eval_frame(self, object symbol):
-        return "_PyEval_EvalFrameDefault" in symbol
-
-    def _pure_python_stack_trace(self, max_stacks):
-        for frame in self.stack_trace(max_stacks):
-            _, file, _ = frame
-            if file.endswith(".pyx"):
-                continue
-            yield frame
-
     def hybrid_stack_trace(self, max_stacks=None):
-        python_stack = tuple(self._pure_python_stack_trace(max_stacks))
-        n_python_frames_left = len(python_stack) if python_stack else None
-        python_stack = iter(python_stack)
-        for native_frame in self.native_stack_trace(max_stacks):
-            if n_python_frames_left == 0:
-                break
-            symbol, *_ = native_frame
-            if self._is_eval_frame(symbol):
-                python_frame =  next(python_stack)
-                n_python_frames_left -= 1
-                yield python_frame
-            else:
-                yield native_frame
+        assert self._reader.get() != NULL, "Cannot get stack trace without reader."
+        if max_stacks is None:
+            return self._reader.get().Py_GetHybridStackFrame(
+                    self._allocation.frame_index,
+                    self._allocation.record.native_frame_id,
+                    self._allocation.native_segment_generation)
+        return self._reader.get().Py_GetHybridStackFrame(
+                self._allocation.frame_index,
+                self._allocation.record.native_frame_id,
+                self._allocation.native_segment_generation,
+                max_stacks)
 
     def __repr__(self):
         return (f"AllocationRecord<tid={hex(self.tid)}, address={hex(self.address)}, "
@@ -188,12 +293,418 @@ cdef class AllocationRecord:
                 f"allocations={self.n_allocations}>")
 
 
-MemoryRecord = collections.namedtuple("MemoryRecord", "time rss")
+cdef AllocationRecord _make_allocation_record(
+    const Allocation& allocation, shared_ptr[RecordReader] reader
+):
+    cdef AllocationRecord record = AllocationRecord.__new__(AllocationRecord)
+    record._allocation = allocation
+    record._reader = reader
+    return record
+
+
+cdef list _snapshot_records(
+    const reduced_snapshot_map_t& snapshot, shared_ptr[RecordReader] reader
+):
+    cdef list records = []
+    cdef reduced_snapshot_map_t.const_iterator it = snapshot.begin()
+    while it != snapshot.end():
+        records.append(_make_allocation_record(deref(it).second, reader))
+        inc(it)
+    return records
+
+
+cdef class _Column:
+    # A column of an AllocationColumns, exported read-only through the buffer
+    # protocol. The array belongs to its owner, which this keeps alive.
+    cdef object _owner
+    cdef const void* _data
+    cdef const char* _format
+    cdef Py_ssize_t _shape[1]
+    cdef Py_ssize_t _strides[1]
+
+    def __getbuffer__(self, Py_buffer* buffer, int flags):
+        if flags & PyBUF_WRITABLE:
+            raise BufferError("The columns of a capture are read-only")
+        buffer.buf = <void*> self._data
+        buffer.obj = self
+        buffer.len = self._shape[0] * self._strides[0]
+        buffer.readonly = 1
+        buffer.itemsize = self._strides[0]
+        buffer.format = <char*> self._format if flags & PyBUF_FORMAT else NULL
+        buffer.ndim = 1
+        buffer.shape = self._shape if flags & PyBUF_ND else NULL
+        buffer.strides = self._strides if flags & PyBUF_STRIDES else NULL
+        buffer.suboffsets = NULL
+        buffer.internal = NULL
+
+    def __releasebuffer__(self, Py_buffer* buffer):
+        pass
+
+
+cdef object _make_column(
+    object owner, const void* data, size_t n_items, size_t itemsize, const char* format
+):
+    cdef _Column column = _Column.__new__(_Column)
+    column._owner = owner
+    column._data = data
+    column._format = format
+    column._shape[0] = n_items
+    column._strides[0] = itemsize
+    return memoryview(column)
+
+
+cdef const char* _unsigned_format(size_t itemsize):
+    if itemsize == 1:
+        return b"B"
+    if itemsize == 2:
+        return b"H"
+    if itemsize == 4:
+        return b"I"
+    return b"Q"
+
+
+cdef class AllocationColumns:
+    """The allocations of a capture, with an array for each of their fields.
+
+    The columns are read-only `memoryview` objects over the reader's own
+    arrays, so `numpy.asarray` and the like use them without copying them,
+    and no `AllocationRecord` is created for any allocation. There is a row
+    for each allocation that the reader keeps: a reallocation is a single
+    row, whose ``realloc_old_address`` is the address that it freed (0 for
+    the rest). Allocations that the tracker only counted, because they were
+    freed right after being made, aren't in the columns.
+    """
+    cdef shared_ptr[RecordReader] _reader
+    # Only used by streaming readers, which don't keep their allocations.
+    cdef AllocationStore _streamed_allocations
+    cdef readonly object tid
+    cdef readonly object address
+    cdef readonly object size
+    cdef readonly object allocator
+    cdef readonly object stack_id
+    cdef readonly object native_stack_id
+    cdef readonly object native_segment_generation
+    cdef readonly object n_allocations
+    cdef readonly object realloc_old_address
+
+    cdef void _export(self, const AllocationStore& store) except *:
+        cdef size_t n = store.size()
+        self.tid = _make_column(
+            self, store.tids().const_data(), n, sizeof(unsigned long),
+            _unsigned_format(sizeof(unsigned long)))
+        self.address = _make_column(
+            self, store.addresses().const_data(), n, sizeof(uintptr_t),
+            _unsigned_format(sizeof(uintptr_t)))
+        self.size = _make_column(
+            self, store.sizes().const_data(), n, sizeof(size_t),
+            _unsigned_format(sizeof(size_t)))
+        self.allocator = _make_column(
+            self, store.allocators().const_data(), n, sizeof(StoredAllocator), b"i")
+        self.stack_id = _make_column(
+            self, store.frameIndexes().const_data(), n, sizeof(uint32_t),
+            _unsigned_format(sizeof(uint32_t)))
+        self.native_stack_id = _make_column(
+            self, store.nativeFrameIds().const_data(), n, sizeof(size_t),
+            _unsigned_format(sizeof(size_t)))
+        self.native_segment_generation = _make_column(
+            self, store.nativeSegmentGenerations().const_data(), n, sizeof(size_t),
+            _unsigned_format(sizeof(size_t)))
+        self.n_allocations = _make_column(
+            self, store.nAllocations().const_data(), n, sizeof(size_t),
+            _unsigned_format(sizeof(size_t)))
+        self.realloc_old_address = _make_column(
+            self, store.reallocOldAddresses().const_data(), n, sizeof(uintptr_t),
+            _unsigned_format(sizeof(uintptr_t)))
+
+    def __len__(self):
+        return len(self.address)
+
+    def record(self, Py_ssize_t index):
+        """The `AllocationRecord` of one row, to get its stack traces."""
+        if index < 0:
+            index += len(self)
+        if not 0 <= index < len(self):
+            raise IndexError("allocation index out of range")
+        alloc = AllocationRecord(
+            (
+                <long> self.tid[index],
+                self.address[index],
+                self.size[index],
+                self.allocator[index],
+                self.stack_id[index],
+                self.n_allocations[index],
+                self.native_stack_id[index],
+                self.native_segment_generation[index],
+            )
+        )
+        (<AllocationRecord> alloc)._reader = self._reader
+        return alloc
+
+
+MemoryRecord = collections.namedtuple(
+    "MemoryRecord",
+    "time rss heap_size heap_in_use pymalloc_arenas tracked_bytes",
+    defaults=(None, None, None, None),
+)
+
+StackTable = collections.namedtuple("StackTable", "frames stacks record_stacks")
+
+MemoryTimelinePoint = collections.namedtuple(
+    "MemoryTimelinePoint",
+    "start_time end_time min_rss max_rss min_heap max_heap peak_index n_memory_records",
+)
+
+
+cdef class AllocationStats:
+    """Summary statistics of a snapshot, or of all the allocations of a capture.
+
+    They are gathered as the allocations are read, so no `AllocationRecord`
+    is created for them except for the largest ones. Sizes of 0 are left out
+    of the histogram and the percentiles.
+    """
+    cdef unique_ptr[AllocationStatsAggregator] _aggregator
+    cdef shared_ptr[RecordReader] _reader
+    cdef readonly size_t num_largest
+
+    def __cinit__(self, size_t num_largest):
+        self.num_largest = num_largest
+        self._aggregator = make_unique[AllocationStatsAggregator](num_largest)
+
+    @property
+    def total_memory_allocated(self):
+        return self._aggregator.get().totalMemoryAllocated()
+
+    @property
+    def total_num_allocations(self):
+        return self._aggregator.get().totalNumAllocations()
+
+    @property
+    def allocator_type_counts(self):
+        """How many allocations each allocator made, without the deallocators."""
+        cdef pair[Allocator, size_t] entry
+        counts = {}
+        for entry in self._aggregator.get().allocatorCounts():
+            counts[AllocatorType(<int> entry.first)] = entry.second
+        return counts
+
+    cdef list _to_records(self, const vector[Allocation]& allocations):
+        cdef Allocation allocation
+        cdef list records = []
+        for allocation in allocations:
+            records.append(_make_allocation_record(allocation, self._reader))
+        return records
+
+    def largest_by_size(self):
+        """The ``num_largest`` records with the most bytes, from the largest."""
+        return self._to_records(self._aggregator.get().largestBySize())
+
+    def largest_by_count(self):
+        """The ``num_largest`` records with the most allocations, from the largest."""
+        return self._to_records(self._aggregator.get().largestByCount())
+
+    @property
+    def num_sized_allocations(self):
+        return self._aggregator.get().numSizedAllocations()
+
+    @property
+    def min_size(self):
+        return self._aggregator.get().minSize()
+
+    @property
+    def max_size(self):
+        return self._aggregator.get().maxSize()
+
+    def size_histogram(self, size_t bins):
+        """The sizes in log-scale bins, as (upper bound, count) pairs.
+
+        These are the same bins that ``get_histogram_databins`` makes for
+        the sizes of the same records.
+        """
+        return self._aggregator.get().sizeHistogram(bins)
+
+    def size_percentile(self, double percentile):
+        """The smallest size that at least ``percentile`` percent of the sizes are at most."""
+        return self._aggregator.get().sizePercentile(percentile)
+
+
+def resolve_stack_traces(records, *, native=False, max_stacks=None):
+    """Resolve the stack traces of many allocation records at once.
+
+    Records that share a stack are resolved together, and each distinct frame
+    is only converted to Python once. The traces are also kept in the records,
+    so their ``stack_trace()`` (or ``native_stack_trace()``, when ``native``
+    is true) returns them without going back to the reader.
+
+    Only records that come from the same reader as the first one are
+    resolved. The returned table has the list of the distinct frames, the
+    list of the distinct stacks as tuples of positions in the frames, and
+    for each record the position of its stack, or None if it wasn't resolved.
+    """
+    cdef shared_ptr[RecordReader] reader
+    cdef vector[unsigned int] indexes
+    cdef vector[size_t] generations
+    cdef size_t c_max_stacks = SIZE_MAX if max_stacks is None else max_stacks
+    cdef AllocationRecord record
+    cdef list positions = []
+    cdef list resolved = []
+    cdef size_t n_records = 0
+    for obj in records:
+        position = n_records
+        n_records += 1
+        if not isinstance(obj, AllocationRecord):
+            continue
+        record = obj
+        if reader.get() == NULL:
+            reader = record._reader
+        if reader.get() == NULL or record._reader.get() != reader.get():
+            continue
+        positions.append(position)
+        resolved.append(record)
+        if native:
+            indexes.push_back(record._allocation.record.native_frame_id)
+            generations.push_back(record._allocation.native_segment_generation)
+        else:
+            indexes.push_back(record._allocation.frame_index)
+
+    if reader.get() == NULL:
+        frames, stacks, resolved_stacks = [], [], []
+    elif native:
+        table = reader.get().Py_GetNativeStackTable(indexes, generations, c_max_stacks)
+        _raise_read_progress_error(reader.get())
+        frames, stacks, resolved_stacks = table
+    else:
+        frames, stacks, resolved_stacks = reader.get().Py_GetStackTable(
+            indexes, c_max_stacks
+        )
+
+    traces = [[frames[frame] for frame in stack] for stack in stacks]
+    record_stacks = [None] * n_records
+    for position, record, stack in zip(positions, resolved, resolved_stacks):
+        record_stacks[position] = stack
+        if native:
+            record._native_stack_trace = list(traces[stack])
+        else:
+            record._stack_trace = list(traces[stack])
+    return StackTable(frames, stacks, record_stacks)
+
+
+cdef class FlameGraphBuilder:
+    """Build the tree of a flame graph out of allocation records.
+
+    The stacks of the records are walked without creating a Python object per
+    frame: each frame is only given to ``frame_key`` the first time that it is
+    found, and that returns the key of the node that it goes in, or -1 for
+    frames that must be left out of the graph. In the same way,
+    ``thread_key`` is called once per thread, with its name. Frames that are
+    more than ``max_stacks`` calls deep end their stack in a node standing for
+    the rest of it.
+    """
+    cdef FlameGraph _graph
+    cdef shared_ptr[RecordReader] _reader
+    cdef object _frame_key
+    cdef object _thread_key
+    cdef size_t _max_stacks
+    cdef unordered_map[size_t, long] _frame_keys
+    cdef unordered_map[long, unsigned int] _thread_keys
+    cdef vector[size_t] _frame_ids
+    cdef vector[unsigned int] _stack
+
+    def __init__(self, frame_key, thread_key, size_t max_stacks):
+        self._frame_key = frame_key
+        self._thread_key = thread_key
+        self._max_stacks = max_stacks
+
+    def add(self, AllocationRecord record):
+        if self._reader.get() == NULL:
+            self._reader = record._reader
+        elif self._reader.get() != record._reader.get():
+            raise ValueError("All the records must come from the same capture file")
+        assert self._reader.get() != NULL, "Cannot get stack trace without reader."
+
+        cdef RecordReader* reader = self._reader.get()
+        reader.getStackFrameIds(record._allocation.frame_index, self._frame_ids)
+        self._stack.clear()
+
+        cdef bool too_deep = False
+        cdef size_t n_frames = self._frame_ids.size()
+        cdef size_t index
+        cdef size_t frame_id
+        cdef long key
+        cdef unordered_map[size_t, long].iterator it
+        for index in range(n_frames):
+            frame_id = self._frame_ids[n_frames - 1 - index]
+            it = self._frame_keys.find(frame_id)
+            if it != self._frame_keys.end():
+                key = deref(it).second
+            else:
+                key = self._frame_key(reader.Py_GetFrame(frame_id))
+                self._frame_keys[frame_id] = key
+            if key < 0:
+                continue
+            self._stack.push_back(key)
+            if index > self._max_stacks:
+                too_deep = True
+                break
+
+        cdef long tid = record._allocation.record.tid
+        cdef unsigned int thread = 0
+        cdef unordered_map[long, unsigned int].iterator thread_it
+        if not self._stack.empty():
+            thread_it = self._thread_keys.find(tid)
+            if thread_it != self._thread_keys.end():
+                thread = deref(thread_it).second
+            else:
+                thread = self._thread_key(record.thread_name)
+                self._thread_keys[tid] = thread
+
+        self._graph.addStack(
+            self._stack,
+            thread,
+            record._allocation.record.size,
+            record._allocation.n_allocations,
+            too_deep,
+        )
+
+    def to_json(
+        self,
+        root_properties,
+        frame_properties,
+        frame_is_interesting,
+        thread_properties,
+        too_deep_properties,
+    ):
+        """Write the tree as JSON, given the JSON properties of its nodes.
+
+        Every node gets the properties of its frame and thread, found by
+        their keys in the lists of them, and its value, number of allocations
+        and children. Nodes standing for the rest of a stack that is too deep
+        take the name and location in ``too_deep_properties`` instead.
+        """
+        return self._graph.toJson(
+            root_properties,
+            frame_properties,
+            frame_is_interesting,
+            thread_properties,
+            too_deep_properties,
+        )
 
 cdef class Tracker:
     cdef bool _native_traces
+    cdef NativeUnwinder _native_unwinder
     cdef unsigned int _memory_interval_ms
     cdef bool _follow_fork
+    cdef size_t _sample_rate
+    cdef bool _lazy_python_stacks
+    cdef size_t _max_python_frames
+    cdef size_t _max_native_frames
+    cdef vector[cppstring] _excluded_filenames
+    cdef size_t _trigger_rss
+    cdef size_t _trigger_rss_growth
+    cdef size_t _dump_rss
+    cdef bool _memory_gauges
+    cdef bool _trace_python_allocators
+    cdef FileFormat _file_format
+    cdef object _compression
     cdef object _previous_profile_func
     cdef object _previous_thread_profile_func
     cdef shared_ptr[RecordReader] _reader
@@ -210,33 +721,110 @@ cdef class Tracker:
 
             if is_dev_null:
                 return unique_ptr[Sink](new NullSink())
+            if self._compression == "zstd":
+                return unique_ptr[Sink](
+                    new CompressedFileSink(os.fsencode(destination.path), destination.exist_ok))
+            if destination.io_uring:
+                return unique_ptr[Sink](
+                    new UringFileSink(os.fsencode(destination.path), destination.exist_ok))
             return unique_ptr[Sink](new FileSink(os.fsencode(destination.path), destination.exist_ok))
 
+        elif isinstance(destination, FlightRecorderDestination):
+            return unique_ptr[Sink](
+                new FlightRecorderSink(
+                    os.fsencode(destination.path), destination.exist_ok, destination.capacity
+                )
+            )
+
         elif isinstance(destination, SocketDestination):
-            return unique_ptr[Sink](new SocketSink(destination.host, destination.port))
+            return unique_ptr[Sink](
+                new SocketSink(destination.host, destination.port, destination.buffer_size))
+        elif isinstance(destination, CollectorDestination):
+            return unique_ptr[Sink](
+                new SocketSink(destination.host, destination.port, destination.buffer_size, True))
+        elif isinstance(destination, SharedMemoryDestination):
+            return unique_ptr[Sink](new SharedMemorySink(destination.name, destination.capacity))
         else:
-            raise TypeError("destination must be a SocketDestination or FileDestination")
+            raise TypeError(
+                "destination must be a SocketDestination, CollectorDestination, "
+                "SharedMemoryDestination, FlightRecorderDestination or FileDestination"
+            )
 
 
     def __cinit__(self, object file_name=None, *, object destination=None,
-                  bool native_traces=False, unsigned int memory_interval_ms = 10,
-                  bool follow_fork=False):
+                  object native_traces=False, unsigned int memory_interval_ms = 10,
+                  bool follow_fork=False, size_t sample_rate=0,
+                  FileFormat file_format=FileFormat.ALL_ALLOCATIONS,
+                  bool cancel_short_lived_allocations=False, object compression=None,
+                  object backpressure="block", bool lazy_python_stacks=False,
+                  size_t max_python_frames=0, size_t max_native_frames=0,
+                  object excluded_filenames=(), size_t trigger_rss=0,
+                  size_t trigger_rss_growth=0, bool memory_gauges=False,
+                  bool trace_python_allocators=False):
         if (file_name, destination).count(None) != 1:
             raise TypeError("Exactly one of 'file_name' or 'destination' argument must be specified")
 
         cdef cppstring command_line = " ".join(sys.argv)
+        self._native_unwinder = NativeUnwinderLibunwind
+        if isinstance(native_traces, str):
+            if native_traces != "fp":
+                raise ValueError("native_traces must be a bool or 'fp'")
+            self._native_unwinder = NativeUnwinderFramePointer
         self._native_traces = native_traces
         self._memory_interval_ms = memory_interval_ms
         self._follow_fork = follow_fork
+        self._sample_rate = sample_rate
+        if lazy_python_stacks and sys.version_info >= (3, 11):
+            raise RuntimeError("lazy_python_stacks is only supported before Python 3.11")
+        self._lazy_python_stacks = lazy_python_stacks
+        self._max_python_frames = max_python_frames
+        self._max_native_frames = max_native_frames
+        if isinstance(excluded_filenames, (str, bytes)):
+            raise TypeError("excluded_filenames must be a sequence of patterns")
+        for pattern in excluded_filenames:
+            self._excluded_filenames.push_back(os.fsencode(pattern))
+        self._trigger_rss = trigger_rss
+        self._trigger_rss_growth = trigger_rss_growth
+        self._memory_gauges = memory_gauges
+        self._trace_python_allocators = trace_python_allocators
+        self._file_format = file_format
+        if compression not in (None, "zstd"):
+            raise ValueError("compression must be None or 'zstd'")
+        self._compression = compression
+        cdef BackpressurePolicy backpressure_policy
+        if backpressure == "block":
+            backpressure_policy = BACKPRESSURE_BLOCK
+        elif backpressure == "drop":
+            backpressure_policy = BACKPRESSURE_DROP
+        else:
+            raise ValueError("backpressure must be 'block' or 'drop'")
 
         if file_name is not None:
             destination = FileDestination(path=file_name)
 
-        if follow_fork and not isinstance(destination, FileDestination):
-            raise RuntimeError("follow_fork requires an output file")
+        if follow_fork and not isinstance(
+                destination, (FileDestination, FlightRecorderDestination, CollectorDestination)):
+            raise RuntimeError("follow_fork requires an output file or a CollectorDestination")
+
+        if isinstance(destination, FlightRecorderDestination):
+            if destination.capacity <= 0:
+                raise ValueError("The capacity of a FlightRecorderDestination must be positive")
+            self._dump_rss = destination.dump_rss
+
+        if (file_format == FileFormat.AGGREGATED_ALLOCATIONS
+                and not isinstance(destination, FileDestination)):
+            raise RuntimeError("FileFormat.AGGREGATED_ALLOCATIONS requires an output file")
+
+        if (file_format == FileFormat.ALLOCATION_COUNTS
+                and not isinstance(destination, FileDestination)):
+            raise RuntimeError("FileFormat.ALLOCATION_COUNTS requires an output file")
+
+        if compression is not None and not isinstance(destination, FileDestination):
+            raise RuntimeError("compression requires an output file")
 
         self._writer = make_unique[RecordWriter](
-                move(self._make_writer(destination)), command_line, native_traces
+                move(self._make_writer(destination)), command_line, self._native_traces, sample_rate,
+                <_FileFormat>file_format, cancel_short_lived_allocations, backpressure_policy
             )
 
     @cython.profile(False)
@@ -252,13 +840,25 @@ cdef class Tracker:
 
         self._previous_profile_func = sys.getprofile()
         self._previous_thread_profile_func = threading._profile_hook
-        threading.setprofile(start_thread_trace)
+        if not self._lazy_python_stacks:
+            threading.setprofile(start_thread_trace)
 
         NativeTracker.createTracker(
             move(writer),
             self._native_traces,
             self._memory_interval_ms,
             self._follow_fork,
+            self._sample_rate,
+            self._native_unwinder,
+            self._lazy_python_stacks,
+            self._max_python_frames,
+            self._max_native_frames,
+            self._excluded_filenames,
+            self._trigger_rss,
+            self._trigger_rss_growth,
+            self._dump_rss,
+            self._memory_gauges,
+            self._trace_python_allocators,
         )
         return self
 
@@ -271,6 +871,68 @@ cdef class Tracker:
         sys.setprofile(self._previous_profile_func)
         threading.setprofile(self._previous_thread_profile_func)
 
+    def get_overhead(self):
+        """Return what tracking has cost the process so far.
+
+        The counters are kept by every thread and summed up when this is
+        called. Once the tracker exits, the final counts are in the capture
+        file's metadata instead.
+        """
+        cdef NativeTracker* tracker = NativeTracker.getTracker()
+        if tracker == NULL:
+            raise RuntimeError("The overhead is only known while a Tracker is active")
+        return _tracker_overhead(tracker.getOverhead())
+
+
+# Indexed by the value of each RecordType.
+_RECORD_TYPE_NAMES = (
+    "uninitialized",
+    "allocation",
+    "frame_index",
+    "frame_push",
+    "native_trace_index",
+    "memory_map_start",
+    "segment_header",
+    "segment",
+    "frame_pop",
+    "thread_record",
+    "memory_record",
+    "thread_chunk",
+    "chunk_barrier",
+    "reallocation",
+    "aggregated_allocation",
+    "python_trace_index",
+    "cancelled_allocations",
+    "checkpoint",
+    "checkpoint_index",
+    "memory_map_update",
+    "segments_removed",
+    "frame_line_update",
+    "memory_gauges_record",
+    "allocation_counts",
+    "sink_stats",
+)
+
+
+cdef object _tracker_overhead(dict overhead):
+    records_by_type = {}
+    bytes_by_type = {}
+    for name, n_records, n_bytes in zip(
+        _RECORD_TYPE_NAMES, overhead["n_records"], overhead["n_bytes"]
+    ):
+        if n_records:
+            records_by_type[name] = n_records
+            bytes_by_type[name] = n_bytes
+    return TrackerOverhead(
+        n_hook_calls=overhead["n_hook_calls"],
+        hooks_time_ns=overhead["hooks_ns"],
+        unwind_time_ns=overhead["unwind_ns"],
+        lock_wait_time_ns=overhead["lock_wait_ns"],
+        deactivated_records=overhead["deactivated_records"],
+        records_by_type=records_by_type,
+        bytes_by_type=bytes_by_type,
+    )
+
 
 def start_thread_trace(frame, event, arg):
     if event in {"call", "c_call"}:
@@ -278,28 +940,236 @@ def start_thread_trace(frame, event, arg):
     return start_thread_trace
 
 
+# How often a reader reports its progress, at most.
+PROGRESS_INTERVAL_SECONDS = 0.1
+
+_READ_PHASE_NAMES = {
+    <int> ReadPhaseParse: "parse",
+    <int> ReadPhaseHighWatermark: "high_watermark",
+    <int> ReadPhaseSymbolization: "symbolization",
+}
+
+
+cdef class _ProgressReporter:
+    # The callback of a ReadProgress, and the exception it raised, if any,
+    # which cancels the read and is raised once the reader is back in Python.
+    cdef object callback
+    cdef object error
+
+    def __init__(self, callback):
+        self.callback = callback
+
+
+cdef bool _report_read_progress(const ProgressUpdate& update, void* data) noexcept with gil:
+    cdef _ProgressReporter reporter = <_ProgressReporter> data
+    if reporter.error is not None:
+        return False
+    try:
+        reporter.callback(
+            ReadProgress(
+                phase=_READ_PHASE_NAMES[<int> update.phase],
+                completed=update.completed,
+                total=update.total,
+                records=update.n_records,
+                elapsed_time=update.elapsed_seconds,
+                finished=update.finished,
+            )
+        )
+    except BaseException as exc:
+        reporter.error = exc
+        return False
+    return True
+
+
+cdef void _release_read_progress(void* data) noexcept with gil:
+    Py_DECREF(<object> data)
+
+
+cdef shared_ptr[NativeReadProgress] _make_read_progress(object callback) except *:
+    cdef _ProgressReporter reporter = _ProgressReporter(callback)
+    Py_INCREF(reporter)
+    return shared_ptr[NativeReadProgress](
+        new NativeReadProgress(
+            _report_read_progress,
+            _release_read_progress,
+            <void*> reporter,
+            PROGRESS_INTERVAL_SECONDS,
+        )
+    )
+
+
+cdef void _raise_read_progress_error(RecordReader* reader) except *:
+    cdef NativeReadProgress* progress = reader.progress()
+    if progress == NULL:
+        return
+    cdef _ProgressReporter reporter = <_ProgressReporter> progress.data()
+    if reporter.error is not None:
+        raise reporter.error
+
+
 cdef class FileReader:
     cdef cppstring _path
 
     cdef shared_ptr[RecordReader] _reader
     cdef unique_ptr[HighWatermark] _high_watermark
+    cdef unique_ptr[HighWatermarkIndex] _high_watermark_index
+    cdef bool _records_streamed
     cdef bool _closed
     cdef object _header
-
-    def __init__(self, object file_name):
+    cdef size_t _max_workers
+    cdef cppstring _symbol_cache_dir
+    cdef bool _streaming
+    cdef size_t _memory_budget
+    cdef cppstring _spill_directory
+    cdef RecordFilter _filter
+    cdef bool _filtered
+    cdef unique_ptr[HeapCheckpoints] _heap_checkpoints
+
+    def __init__(
+        self,
+        object file_name,
+        *,
+        max_workers=None,
+        streaming=False,
+        symbol_cache_dir=None,
+        high_watermark_index=False,
+        progress_callback=None,
+        memory_budget=None,
+        spill_directory=None,
+        threads=None,
+        start_time=None,
+        end_time=None,
+    ):
         self._path = str(file_name)
         if not pathlib.Path(self._path).exists():
             raise IOError(f"No such file: {self._path}")
-        self._reader = make_shared[RecordReader](unique_ptr[FileSource](new FileSource(self._path)))
+        if max_workers is None:
+            max_workers = len(os.sched_getaffinity(0))
+        if max_workers < 1:
+            raise ValueError("max_workers must be at least 1")
+        self._max_workers = max_workers
+        if symbol_cache_dir is not None:
+            self._symbol_cache_dir = os.fspath(symbol_cache_dir)
+        # A reader with a memory budget streams its allocations, and spills
+        # the live ones to disk if there could be too many of them.
+        if memory_budget is not None:
+            if memory_budget < 1:
+                raise ValueError("memory_budget must be positive")
+            self._memory_budget = memory_budget
+            if spill_directory is None:
+                spill_directory = tempfile.gettempdir()
+            self._spill_directory = os.fspath(spill_directory)
+            streaming = True
+        # Only the allocations of the given threads and times are kept, as
+        # RecordFilter describes, and the rest are dropped as they are read.
+        if threads is not None:
+            self._filter.thread_ids = list(threads)
+            self._filtered = True
+        if start_time is not None:
+            self._filter.start_time = int(start_time.timestamp() * 1000)
+            self._filtered = True
+        if end_time is not None:
+            self._filter.end_time = int(end_time.timestamp() * 1000)
+            self._filtered = True
+        self._reader = self._new_reader()
+        if progress_callback is not None:
+            self._reader.get().setProgress(_make_read_progress(progress_callback))
         self._header: dict = self._reader.get().getHeader()
+        if self._filtered and (self._is_aggregated or self._is_counts):
+            raise NotImplementedError(
+                "Only capture files written with FileFormat.ALL_ALLOCATIONS"
+                " can be filtered by thread or by time"
+            )
+        # The aggregated allocations, like the counts, are already small
+        # enough to keep.
+        self._streaming = streaming and not self._is_aggregated and not self._is_counts
+        # The index has the high water mark of the whole capture.
+        if (
+            high_watermark_index
+            and not self._filtered
+            and not self._is_aggregated
+            and not self._is_counts
+        ):
+            self._load_high_watermark_index()
         self._populate_allocations()
 
-    cdef void _populate_allocations(self):
+    cdef void _load_high_watermark_index(self) except *:
+        cdef HighWatermark watermark
+        self._high_watermark_index.reset(new HighWatermarkIndex(self._path))
+        if self._high_watermark_index.get().read(watermark):
+            self._high_watermark = make_unique[HighWatermark](watermark)
+
+    cdef void _set_high_watermark(self, HighWatermark watermark) except *:
+        self._high_watermark = make_unique[HighWatermark](watermark)
+        if self._high_watermark_index != NULL:
+            self._high_watermark_index.get().write(watermark)
+
+    cdef void _populate_allocations(self) except *:
         cdef RecordReader* reader = self._get_reader()
-        while reader.nextRecord() not in (
-                RecordResult.RecordResultEndOfFile,
-                RecordResult.RecordResultError):
-            continue
+        if self._streaming:
+            # With the high water mark known from the index, the first pass
+            # is only made for what else it reads.
+            if self._high_watermark == NULL:
+                self._stream_high_watermark()
+            return
+        # The records read so far can be looked up while the rest are read.
+        reader.startReadingWithoutGil()
+        try:
+            with nogil:
+                reader.readAllRecords(self._path, self._max_workers)
+        finally:
+            reader.finishReadingWithoutGil()
+        _raise_read_progress_error(reader)
+
+    cdef void _read_all_records(self) except *:
+        # Memory records are only read along with everything else.
+        if self._streaming:
+            self._stream_high_watermark()
+        else:
+            self._populate_allocations()
+
+    cdef void _stream_high_watermark(self) except *:
+        # The first of the two passes that a streaming reader makes to get a
+        # snapshot: this one only finds where the high water mark is, and
+        # reads everything else that isn't an allocation on the way.
+        cdef RecordReader* reader = self._get_reader()
+        cdef HighWatermarkFinder finder
+        cdef const Allocation* allocation
+        if self._records_streamed:
+            return
+        self._records_streamed = True
+        if self._memory_budget:
+            finder.spillTo(
+                self._spill_directory,
+                self._memory_budget,
+                self._header["stats"]["n_allocations"],
+            )
+        reader.startReadingWithoutGil()
+        try:
+            with nogil:
+                while True:
+                    allocation = reader.nextAllocation()
+                    if allocation == NULL:
+                        break
+                    finder.processAllocation(allocation[0])
+        finally:
+            reader.finishReadingWithoutGil()
+        _raise_read_progress_error(reader)
+        if self._high_watermark == NULL:
+            self._set_high_watermark(finder.getHighWatermark())
+
+    cdef shared_ptr[RecordReader] _new_reader(self) except *:
+        cdef shared_ptr[RecordReader] reader = make_shared[RecordReader](
+            unique_ptr[FileSource](new FileSource(self._path))
+        )
+        reader.get().configureSymbolResolution(self._max_workers, self._symbol_cache_dir)
+        if self._filtered:
+            reader.get().setFilter(self._filter)
+        return reader
+
+    cdef shared_ptr[RecordReader] _new_stream_reader(self) except *:
+        self._ensure_reader_is_open()
+        return self._new_reader()
 
     cdef RecordReader* _get_reader(self) except *:
         if self._reader.get() == NULL:
@@ -328,44 +1198,502 @@ cdef class FileReader:
         self._reader.reset()
     
     def _yield_allocations(self, size_t index, merge_threads):
-        for elem in Py_GetSnapshotAllocationRecords(
-            self._get_reader().allocationRecords(), index, merge_threads):
-            alloc = AllocationRecord(elem)
-            (<AllocationRecord> alloc)._reader = self._reader
+        for alloc in _snapshot_records(
+            getSnapshotAllocations(
+                self._get_reader().allocationRecords(), index, merge_threads, self._max_workers),
+            self._reader,
+        ):
+            yield alloc
+            self._ensure_reader_is_open()
+
+    cdef void _stream_snapshot(
+        self,
+        RecordReader* reader,
+        size_t n_records,
+        size_t n_events,
+        SnapshotAllocationAggregator* aggregator,
+    ) except *:
+        # The second pass of a streaming reader: only the allocations up to
+        # the snapshot are read again, and they are reduced as they are read.
+        # It stops after n_records records or once n_events events (counting
+        # reallocations twice) have been seen, whichever comes first.
+        cdef const Allocation* allocation
+        cdef size_t records_read = 0
+        cdef size_t events_read = 0
+        if self._memory_budget:
+            aggregator.spillTo(
+                self._spill_directory,
+                self._memory_budget,
+                min(n_records, self._header["stats"]["n_allocations"]),
+            )
+        with nogil:
+            while records_read < n_records and events_read < n_events:
+                allocation = reader.nextAllocation()
+                if allocation == NULL:
+                    break
+                aggregator.addAllocation(allocation[0])
+                records_read += 1
+                events_read += 2 if allocation.realloc_old_address else 1
+
+    cdef list _reduce_streamed_allocations(
+        self, shared_ptr[RecordReader] reader, size_t n_records, size_t n_events,
+        bool merge_threads
+    ):
+        cdef SnapshotAllocationAggregator aggregator
+        self._stream_snapshot(reader.get(), n_records, n_events, &aggregator)
+        return _snapshot_records(aggregator.getSnapshotAllocations(merge_threads), reader)
+
+    def _yield_streamed_allocations(self, size_t n_records, size_t n_events, merge_threads):
+        cdef shared_ptr[RecordReader] reader = self._new_stream_reader()
+        for alloc in self._reduce_streamed_allocations(
+            reader, n_records, n_events, merge_threads
+        ):
+            yield alloc
+            self._ensure_reader_is_open()
+
+    def _yield_aggregated_allocations(self, bool high_water_mark, merge_threads):
+        for alloc in _snapshot_records(
+            getAggregatedSnapshotAllocations(
+                self._get_reader().aggregatedAllocationRecords(), high_water_mark, merge_threads),
+            self._reader,
+        ):
+            yield alloc
+            self._ensure_reader_is_open()
+
+    @property
+    def _is_aggregated(self):
+        return self._header["file_format"] == FileFormat.AGGREGATED_ALLOCATIONS
+
+    @property
+    def _is_counts(self):
+        return self._header["file_format"] == FileFormat.ALLOCATION_COUNTS
+
+    cdef void _check_heap_is_known(self) except *:
+        if self._is_counts:
+            raise NotImplementedError(
+                "Capture files written with FileFormat.ALLOCATION_COUNTS"
+                " only count the allocations made from each location"
+            )
+
+    @property
+    def file_format(self):
+        return FileFormat(self._header["file_format"])
+
+    def get_allocation_counts(self, merge_threads=True):
+        """Yield what each location allocated over the whole capture.
+
+        This is only available for capture files written with
+        `FileFormat.ALLOCATION_COUNTS`. Each of the `AllocationRecord`
+        objects is for one location and allocator, with the number of calls
+        to that allocator as its ``n_allocations`` and the bytes they asked
+        for as its ``size``. Frees are never counted.
+        """
+        self._ensure_reader_is_open()
+        if not self._is_counts:
+            raise NotImplementedError(
+                "Only capture files written with FileFormat.ALLOCATION_COUNTS"
+                " contain allocation counts"
+            )
+        self._populate_allocations()
+        for alloc in self._to_count_records(merge_threads):
             yield alloc
             self._ensure_reader_is_open()
 
+    cdef list _to_count_records(self, bool merge_threads):
+        cdef Allocation allocation
+        cdef list records = []
+        for allocation in getAllocationCounts(self._get_reader().allocationCounts(), merge_threads):
+            records.append(_make_allocation_record(allocation, self._reader))
+        return records
+
     cdef inline HighWatermark* _get_high_watermark(self) except*:
+        cdef RecordReader* reader
+        cdef HighWatermark watermark
         if self._high_watermark == NULL:
             self._populate_allocations()
-            self._high_watermark = make_unique[HighWatermark](
-                getHighWatermark(self._get_reader().allocationRecords()))
+        if self._high_watermark == NULL:
+            if self._is_aggregated:
+                self._high_watermark = make_unique[HighWatermark](
+                    getAggregatedHighWatermark(self._get_reader().aggregatedAllocationRecords()))
+            else:
+                reader = self._get_reader()
+                watermark = getHighWatermark(reader.allocationRecords(), reader.progress())
+                _raise_read_progress_error(reader)
+                self._set_high_watermark(watermark)
         return self._high_watermark.get()
 
     def get_high_watermark_allocation_records(self, merge_threads=True):
         self._ensure_reader_is_open()
+        self._check_heap_is_known()
         self._populate_allocations()
+        if self._is_aggregated:
+            yield from self._yield_aggregated_allocations(True, merge_threads)
+            return
         cdef HighWatermark* watermark = self._get_high_watermark()
+        if self._streaming:
+            yield from self._yield_streamed_allocations(
+                watermark.index + 1, SIZE_MAX, merge_threads)
+            return
         yield from self._yield_allocations(watermark.index, merge_threads)
 
+    def get_allocation_stats(
+        self, size_t num_largest, *, include_all_allocations=False, merge_threads=True
+    ):
+        """Summarize the high water mark snapshot, or every allocation event.
+
+        This returns what `StatsReporter` shows for the records that
+        ``get_high_watermark_allocation_records()`` (or
+        ``get_allocation_records()``, with ``include_all_allocations``)
+        would yield, without creating a record for each of them.
+        """
+        self._ensure_reader_is_open()
+        self._check_heap_is_known()
+        self._populate_allocations()
+        cdef AllocationStats stats = AllocationStats(num_largest)
+        cdef AllocationStatsAggregator* aggregator = stats._aggregator.get()
+        stats._reader = self._reader
+        if include_all_allocations:
+            if self._is_aggregated:
+                raise NotImplementedError(
+                    "Capture files written with FileFormat.AGGREGATED_ALLOCATIONS"
+                    " don't contain the individual allocations"
+                )
+            if self._streaming:
+                stats._reader = self._new_stream_reader()
+                self._aggregate_streamed_events(stats._reader.get(), aggregator)
+            else:
+                self._aggregate_events(aggregator)
+            return stats
+
+        if self._is_aggregated:
+            aggregator.addSnapshot(getAggregatedSnapshotAllocations(
+                self._get_reader().aggregatedAllocationRecords(), True, merge_threads))
+            return stats
+        cdef HighWatermark* watermark = self._get_high_watermark()
+        cdef SnapshotAllocationAggregator snapshot_aggregator
+        if self._streaming:
+            stats._reader = self._new_stream_reader()
+            self._stream_snapshot(
+                stats._reader.get(), watermark.index + 1, SIZE_MAX, &snapshot_aggregator)
+            aggregator.addSnapshot(snapshot_aggregator.getSnapshotAllocations(merge_threads))
+        else:
+            aggregator.addSnapshot(getSnapshotAllocations(
+                self._get_reader().allocationRecords(), watermark.index, merge_threads,
+                self._max_workers))
+        return stats
+
+    cdef void _aggregate_events(self, AllocationStatsAggregator* aggregator) except *:
+        # The same events that _yield_all_allocations() yields, in the same order.
+        cdef RecordReader* reader = self._get_reader()
+        cdef Allocation record
+        cdef size_t i
+        for i in range(reader.allocationRecords().size()):
+            aggregator.addAllocationEvents(reader.allocationRecords()[i])
+        for record in reader.cancelledAllocationRecords():
+            aggregator.addAllocation(record)
+            aggregator.addAllocation(record.cancelledDeallocation())
+
+    cdef void _aggregate_streamed_events(
+        self, RecordReader* reader, AllocationStatsAggregator* aggregator
+    ) except *:
+        cdef const Allocation* allocation
+        cdef Allocation record
+        with nogil:
+            while True:
+                allocation = reader.nextAllocation()
+                if allocation == NULL:
+                    break
+                aggregator.addAllocationEvents(allocation[0])
+        for record in reader.cancelledAllocationRecords():
+            aggregator.addAllocation(record)
+            aggregator.addAllocation(record.cancelledDeallocation())
+
     def get_leaked_allocation_records(self, merge_threads=True):
         self._ensure_reader_is_open()
+        self._check_heap_is_known()
         self._populate_allocations()
+        if self._is_aggregated:
+            yield from self._yield_aggregated_allocations(False, merge_threads)
+            return
+        if self._streaming:
+            yield from self._yield_streamed_allocations(SIZE_MAX, SIZE_MAX, merge_threads)
+            return
         cdef size_t snapshot_index = self._get_reader().allocationRecords().size() - 1
         yield from self._yield_allocations(snapshot_index, merge_threads)
 
+    def get_leaked_allocation_ages(self, merge_threads=True):
+        """How long the allocations left at exit had been alive, by location.
+
+        Returns a list with an `AllocationRecord` for every location that
+        leaked, like `get_leaked_allocation_records` yields, paired with a
+        list of ``(min_age_ms, max_age_ms, n_allocations, size)`` tuples for
+        the ages that its leaked allocations fall into. Allocations don't have
+        timestamps, so each one is dated by the last memory record written
+        before it, and the ages are made of ranges that double in width.
+        """
+        self._ensure_reader_is_open()
+        self._check_heap_is_known()
+        self._populate_allocations()
+        if self._is_aggregated:
+            raise NotImplementedError(
+                "Capture files written with FileFormat.AGGREGATED_ALLOCATIONS"
+                " don't keep the order of the allocations"
+            )
+        stats = self._header["stats"]
+        cdef LeakAgeAggregator* aggregator = new LeakAgeAggregator(stats["start_time"])
+        cdef shared_ptr[RecordReader] reader = (
+            self._new_stream_reader() if self._streaming else self._reader
+        )
+        # The reader appends to these as it finds more memory records.
+        cdef vector[_MemoryRecord]* memory_records = &reader.get().memoryRecords()
+        cdef const vector[size_t]* memory_record_allocations = (
+            &reader.get().memoryRecordAllocations()
+        )
+        cdef const Allocation* allocation
+        cdef size_t i
+        cdef vector[StackAges] stack_ages
+        try:
+            if self._streaming:
+                with nogil:
+                    while True:
+                        allocation = reader.get().nextAllocation()
+                        if allocation == NULL:
+                            break
+                        aggregator.addAllocation(
+                            deref(allocation), deref(memory_records), deref(memory_record_allocations)
+                        )
+            else:
+                for i in range(reader.get().allocationRecords().size()):
+                    aggregator.addAllocation(
+                        reader.get().allocationRecords()[i],
+                        deref(memory_records),
+                        deref(memory_record_allocations),
+                    )
+            end_time = stats["end_time"]
+            if memory_records.size():
+                end_time = max(end_time, memory_records.back().ms_since_epoch)
+            stack_ages = aggregator.getStackAges(end_time, merge_threads)
+        finally:
+            del aggregator
+
+        ret = []
+        for stack in stack_ages:
+            alloc = _make_allocation_record(stack.allocation, reader)
+            buckets = []
+            for i in range(stack.buckets.size()):
+                if stack.buckets[i].n_allocations == 0:
+                    continue
+                min_age = 0 if i == 0 else 1 << (i - 1)
+                buckets.append(
+                    (min_age, 1 << i, stack.buckets[i].n_allocations, stack.buckets[i].bytes)
+                )
+            ret.append((alloc, buckets))
+        return ret
+
+    def get_memory_timeline(self, size_t n_points=1000):
+        """The resident size and the tracked heap over time, in up to n_points.
+
+        The memory records are put in n_points spans of time of the same
+        length, and each span that has any becomes a `MemoryTimelinePoint`
+        with the lowest and the highest resident size of its memory records
+        (with their times in milliseconds since the epoch) and the lowest and
+        highest the heap got in that time. Its ``peak_index`` can be given to
+        `get_snapshot_at` to see the heap at its highest, and is None if
+        nothing had been allocated yet.
+        """
+        self._ensure_reader_is_open()
+        self._check_heap_is_known()
+        self._populate_allocations()
+        if self._is_aggregated:
+            raise NotImplementedError(
+                "Capture files written with FileFormat.AGGREGATED_ALLOCATIONS"
+                " don't keep the order of the allocations"
+            )
+        cdef MemoryTimelineAggregator aggregator
+        cdef shared_ptr[RecordReader] reader = (
+            self._new_stream_reader() if self._streaming else self._reader
+        )
+        # The reader appends to these as it finds more memory records.
+        cdef vector[_MemoryRecord]* memory_records = &reader.get().memoryRecords()
+        cdef const vector[size_t]* memory_record_allocations = (
+            &reader.get().memoryRecordAllocations()
+        )
+        cdef const Allocation* allocation
+        cdef size_t i
+        if self._streaming:
+            with nogil:
+                while True:
+                    allocation = reader.get().nextAllocation()
+                    if allocation == NULL:
+                        break
+                    aggregator.addAllocation(
+                        deref(allocation), deref(memory_records), deref(memory_record_allocations)
+                    )
+        else:
+            for i in range(reader.get().allocationRecords().size()):
+                aggregator.addAllocation(
+                    reader.get().allocationRecords()[i],
+                    deref(memory_records),
+                    deref(memory_record_allocations),
+                )
+        cdef vector[_MemoryTimelinePoint] points = aggregator.getTimeline(
+            deref(memory_records), deref(memory_record_allocations), n_points
+        )
+        ret = []
+        for point in points:
+            ret.append(
+                MemoryTimelinePoint(
+                    point.start_time,
+                    point.end_time,
+                    point.min_rss,
+                    point.max_rss,
+                    point.min_heap,
+                    point.max_heap,
+                    point.peak_events - 1 if point.peak_events else None,
+                    point.n_memory_records,
+                )
+            )
+        return ret
+
+    def get_snapshot_at(self, object index_or_time, *, merge_threads=True):
+        self._ensure_reader_is_open()
+        self._check_heap_is_known()
+        self._populate_allocations()
+        if self._is_aggregated:
+            raise NotImplementedError(
+                "Capture files written with FileFormat.AGGREGATED_ALLOCATIONS"
+                " only have snapshots at the high water mark and at the end"
+            )
+        cdef size_t n_records = SIZE_MAX
+        cdef size_t n_events = SIZE_MAX
+        if isinstance(index_or_time, datetime):
+            n_records = self._records_before(index_or_time)
+        else:
+            # An index into what get_allocation_records() yields.
+            index = operator.index(index_or_time)
+            if index < 0:
+                raise IndexError("snapshot index out of range")
+            n_events = index + 1
+        return self._yield_snapshot_at(n_records, n_events, merge_threads)
+
+    cdef size_t _records_before(self, object time) except *:
+        # Allocations don't have timestamps, but memory records do, and they
+        # tell how many allocations had been read before each of them.
+        self._read_all_records()
+        cdef RecordReader* reader = self._get_reader()
+        cdef unsigned long ms_since_epoch = int(time.timestamp() * 1000)
+        cdef size_t n_records = 0
+        for i in range(reader.memoryRecords().size()):
+            if reader.memoryRecords()[i].ms_since_epoch > ms_since_epoch:
+                break
+            n_records = reader.memoryRecordAllocations()[i]
+        return n_records
+
+    def _yield_snapshot_at(self, size_t n_records, size_t n_events, merge_threads):
+        if self._streaming:
+            yield from self._yield_streamed_allocations(n_records, n_events, merge_threads)
+            return
+        if self._heap_checkpoints == NULL:
+            self._heap_checkpoints.reset(
+                new HeapCheckpoints(self._get_reader().allocationRecords()))
+        if n_events != SIZE_MAX:
+            n_records = self._heap_checkpoints.get().recordsForEvents(n_events)
+        snapshot = _snapshot_records(
+            self._heap_checkpoints.get().getSnapshotAllocations(n_records, merge_threads),
+            self._reader)
+        for alloc in snapshot:
+            yield alloc
+            self._ensure_reader_is_open()
+
     def get_allocation_records(self):
+        self._check_heap_is_known()
+        if self._is_aggregated:
+            raise NotImplementedError(
+                "Capture files written with FileFormat.AGGREGATED_ALLOCATIONS"
+                " don't contain the individual allocations"
+            )
+        if self._streaming:
+            return self._yield_streamed_all_allocations()
+        return self._yield_all_allocations()
+
+    def get_allocation_columns(self):
+        cdef AllocationColumns columns = AllocationColumns.__new__(AllocationColumns)
+        cdef shared_ptr[RecordReader] reader
+        cdef const Allocation* allocation
+        self._ensure_reader_is_open()
+        self._check_heap_is_known()
+        if self._is_aggregated:
+            raise NotImplementedError(
+                "Capture files written with FileFormat.AGGREGATED_ALLOCATIONS"
+                " don't contain the individual allocations"
+            )
+        if not self._streaming:
+            columns._reader = self._reader
+            columns._export(self._get_reader().allocationRecords())
+            return columns
+        reader = self._new_stream_reader()
+        with nogil:
+            while True:
+                allocation = reader.get().nextAllocation()
+                if allocation == NULL:
+                    break
+                columns._streamed_allocations.push_back(allocation[0])
+        _raise_read_progress_error(reader.get())
+        columns._reader = reader
+        columns._export(columns._streamed_allocations)
+        return columns
+
+    def _yield_all_allocations(self):
         for record in self._get_reader().allocationRecords():
-            alloc = AllocationRecord(record.toPythonObject())
-            (<AllocationRecord> alloc)._reader = self._reader
-            yield alloc
+            if record.realloc_old_address:
+                # Reallocations are stored as a single event, but they are
+                # reported as the deallocation followed by the allocation.
+                yield _make_allocation_record(record.oldAddressDeallocation(), self._reader)
+            yield _make_allocation_record(record, self._reader)
+        # Allocations freed so soon after being made that the tracker only
+        # counted them. They never show up in the heap, so they don't need to
+        # be in order with the rest.
+        for record in self._get_reader().cancelledAllocationRecords():
+            yield _make_allocation_record(record, self._reader)
+            yield _make_allocation_record(record.cancelledDeallocation(), self._reader)
+
+    def _yield_streamed_all_allocations(self):
+        cdef shared_ptr[RecordReader] reader = self._new_stream_reader()
+        cdef const Allocation* allocation
+        while True:
+            allocation = reader.get().nextAllocation()
+            if allocation == NULL:
+                break
+            if allocation.realloc_old_address:
+                yield _make_allocation_record(allocation.oldAddressDeallocation(), reader)
+            yield _make_allocation_record(allocation[0], reader)
+            self._ensure_reader_is_open()
+        for record in reader.get().cancelledAllocationRecords():
+            yield _make_allocation_record(record, reader)
+            yield _make_allocation_record(record.cancelledDeallocation(), reader)
     
     def get_memory_records(self):
         # First, parse the entire file to get all possible memory records
-        self._populate_allocations()
+        self._read_all_records()
         # Now, yield all available memory records 
-        for record in self._get_reader().memoryRecords():
-            yield MemoryRecord(record.ms_since_epoch, record.rss)
+        cdef RecordReader* reader = self._get_reader()
+        cdef _MemoryRecord record
+        cdef MemoryGauges gauges
+        cdef size_t i
+        for i in range(reader.memoryRecords().size()):
+            record = reader.memoryRecords()[i]
+            if i >= reader.memoryGauges().size():
+                yield MemoryRecord(record.ms_since_epoch, record.rss)
+                continue
+            gauges = reader.memoryGauges()[i]
+            yield MemoryRecord(
+                record.ms_since_epoch,
+                record.rss,
+                gauges.heap_size,
+                gauges.heap_in_use,
+                gauges.pymalloc_arenas,
+                gauges.tracked_bytes,
+            )
 
     @property
     def metadata(self):
@@ -381,6 +1709,9 @@ cdef class FileReader:
             PythonAllocatorType.PYTHON_ALLOCATOR_OTHER: "unknown",
         }
         python_allocator = allocator_id_to_name[self._header["python_allocator"]]
+        overhead = None
+        if self._header["version"] >= 7:
+            overhead = _tracker_overhead(self._header["overhead"])
         return Metadata(start_time=millis_to_dt(stats["start_time"]),
                         end_time=millis_to_dt(stats["end_time"]),
                         total_allocations=stats["n_allocations"],
@@ -388,21 +1719,339 @@ cdef class FileReader:
                         peak_memory=self._get_high_watermark().peak_memory,
                         command_line=self._header["command_line"],
                         pid=self._header["pid"],
-                        python_allocator=python_allocator)
+                        python_allocator=python_allocator,
+                        sample_rate=self._header["sample_rate"],
+                        dropped_records=self._header["dropped_records"],
+                        overhead=overhead)
 
     @property
     def has_native_traces(self):
         return self._header["native_traces"]
 
 
-def dump_all_records(object file_name):
+def dump_all_records(object file_name, *, progress_callback=None):
     cdef str path = str(file_name)
     if not pathlib.Path(path).exists():
         raise IOError(f"No such file: {path}")
 
     cdef shared_ptr[RecordReader] _reader = make_shared[RecordReader](
             unique_ptr[FileSource](new FileSource(path)))
+    if progress_callback is not None:
+        _reader.get().setProgress(_make_read_progress(progress_callback))
     _reader.get().dumpAllRecords()
+    _raise_read_progress_error(_reader.get())
+
+
+def export_profile(
+    object file_name, str profile_format, *, bool leaks=False, symbol_cache_dir=None
+):
+    """Convert the high water mark snapshot of a capture, or its leaks.
+
+    ``profile_format`` is either ``"pprof"``, for an uncompressed pprof
+    profile, or ``"collapsed"``, for the collapsed stacks that flame graph
+    tools read. The capture is streamed, and the profile is written without
+    creating a Python object for any of its allocations.
+    """
+    if profile_format not in {"pprof", "collapsed"}:
+        raise ValueError(f"Unknown profile format: {profile_format}")
+    cdef cppstring path = str(file_name)
+    if not pathlib.Path(path).exists():
+        raise IOError(f"No such file: {path}")
+    cdef cppstring c_symbol_cache_dir
+    if symbol_cache_dir is not None:
+        c_symbol_cache_dir = os.fspath(symbol_cache_dir)
+    cdef unique_ptr[ProfileExporter] exporter = make_unique[ProfileExporter](
+        path, c_symbol_cache_dir)
+    cdef bool pprof = profile_format == "pprof"
+    cdef cppstring profile
+    with nogil:
+        exporter.get().readAll()
+        if pprof:
+            profile = exporter.get().pprofProfile(not leaks)
+        else:
+            profile = exporter.get().collapsedStacks(not leaks)
+    return profile
+
+
+cdef class CaptureFamilyReader:
+    """Read the capture files of a process and of the children that it forked.
+
+    A tracker that follows forks writes the allocations of each child to a
+    file of its own, named after the parent's file and the pid of the child.
+    The files are read at the same time, by up to ``max_workers`` threads,
+    and the allocations of each one are aggregated by location while it's
+    read, so they never all have to be kept in memory at once.
+
+    Snapshots can be taken of one process, or of all of them at once. The
+    combined high water mark puts together the high water mark of every
+    process, as there is no telling which of them happened at the same time.
+    """
+    cdef unique_ptr[CaptureFamily] _impl
+    cdef list _file_names
+    cdef list _headers
+
+    def __init__(self, file_names, *, max_workers=None, symbol_cache_dir=None):
+        self._file_names = [str(file_name) for file_name in file_names]
+        for file_name in self._file_names:
+            if not pathlib.Path(file_name).exists():
+                raise IOError(f"No such file: {file_name}")
+        if max_workers is None:
+            max_workers = len(os.sched_getaffinity(0))
+        if max_workers < 1:
+            raise ValueError("max_workers must be at least 1")
+        cdef vector[cppstring] c_file_names = self._file_names
+        cdef cppstring c_symbol_cache_dir
+        if symbol_cache_dir is not None:
+            c_symbol_cache_dir = os.fspath(symbol_cache_dir)
+        self._impl.reset(new CaptureFamily(c_file_names, max_workers, c_symbol_cache_dir))
+        self._headers = [
+            self._impl.get().capture(index).reader.get().getHeader()
+            for index in range(self._impl.get().size())
+        ]
+        with nogil:
+            self._impl.get().readAll()
+
+    @classmethod
+    def from_parent(cls, file_name, **kwargs):
+        """Read the capture file of a process, and the ones of its children."""
+        path = pathlib.Path(file_name)
+        children = sorted(
+            (
+                child
+                for child in path.parent.glob(f"{glob.escape(path.name)}.*")
+                if child.suffix[1:].isdigit()
+            ),
+            key=lambda child: int(child.suffix[1:]),
+        )
+        return cls([path, *children], **kwargs)
+
+    @property
+    def processes(self):
+        """A summary of the capture of each process, in the order of the files."""
+        cdef CaptureFamily* family = self._impl.get()
+        summaries = []
+        for index, (file_name, header) in enumerate(zip(self._file_names, self._headers)):
+            summaries.append(
+                CaptureSummary(
+                    file_name=file_name,
+                    pid=header["pid"],
+                    command_line=header["command_line"],
+                    peak_memory=family.capture(index).high_watermark.peak_memory,
+                    leaked_memory=family.capture(index).leaked_memory,
+                    leaked_allocations=family.capture(index).n_leaked_allocations,
+                )
+            )
+        return summaries
+
+    @property
+    def peak_memory(self):
+        """The sum of the peak memory of every process."""
+        return sum(summary.peak_memory for summary in self.processes)
+
+    @property
+    def has_native_traces(self):
+        return any(header["native_traces"] for header in self._headers)
+
+    def _indexes(self, pid):
+        if pid is None:
+            return range(len(self._headers))
+        indexes = [
+            index for index, header in enumerate(self._headers) if header["pid"] == pid
+        ]
+        if not indexes:
+            raise ValueError(f"No capture of a process with pid {pid}")
+        return indexes
+
+    def _yield_allocations(self, bool high_water_mark, merge_threads, pid):
+        cdef size_t c_index
+        for index in self._indexes(pid):
+            c_index = index
+            yield from _snapshot_records(
+                self._impl.get().getSnapshotAllocations(c_index, high_water_mark, merge_threads),
+                self._impl.get().capture(c_index).reader,
+            )
+
+    def get_high_watermark_allocation_records(self, merge_threads=True, *, pid=None):
+        """The allocations at the high water mark of one process, or of all of them.
+
+        Records from different processes never share a location, even when
+        their stacks are the same.
+        """
+        return self._yield_allocations(True, merge_threads, pid)
+
+    def get_leaked_allocation_records(self, merge_threads=True, *, pid=None):
+        """The allocations left at exit by one process, or by all of them."""
+        return self._yield_allocations(False, merge_threads, pid)
+
+
+cdef class CaptureDiff:
+    """Compare the snapshots of two capture files, stack by stack.
+
+    Both files are read at the same time, and the allocations of each one
+    are aggregated by location as they are read, like `CaptureFamilyReader`
+    does. Locations are then matched by the function, file and line of every
+    frame of their Python stacks, so the two captures don't need to share
+    anything but their source code. Threads aren't told apart.
+    """
+    cdef unique_ptr[NativeCaptureDiff] _impl
+    cdef list _file_names
+    cdef list _headers
+
+    def __init__(self, before, after, *, max_workers=None, symbol_cache_dir=None):
+        self._file_names = [str(before), str(after)]
+        for file_name in self._file_names:
+            if not pathlib.Path(file_name).exists():
+                raise IOError(f"No such file: {file_name}")
+        if max_workers is None:
+            max_workers = len(os.sched_getaffinity(0))
+        if max_workers < 1:
+            raise ValueError("max_workers must be at least 1")
+        cdef cppstring c_symbol_cache_dir
+        if symbol_cache_dir is not None:
+            c_symbol_cache_dir = os.fspath(symbol_cache_dir)
+        self._impl.reset(new NativeCaptureDiff(
+            self._file_names[0], self._file_names[1], max_workers, c_symbol_cache_dir))
+        self._headers = [
+            self._impl.get().capture(index).reader.get().getHeader() for index in range(2)
+        ]
+        with nogil:
+            self._impl.get().readAll()
+
+    cdef object _summary(self, size_t index):
+        header = self._headers[index]
+        return CaptureSummary(
+            file_name=self._file_names[index],
+            pid=header["pid"],
+            command_line=header["command_line"],
+            peak_memory=self._impl.get().capture(index).high_watermark.peak_memory,
+            leaked_memory=self._impl.get().capture(index).leaked_memory,
+            leaked_allocations=self._impl.get().capture(index).n_leaked_allocations,
+        )
+
+    @property
+    def before(self):
+        """A summary of the capture that is compared against."""
+        return self._summary(0)
+
+    @property
+    def after(self):
+        """A summary of the capture that is compared with the first one."""
+        return self._summary(1)
+
+    def get_stack_deltas(self, *, leaks=False):
+        """The stacks whose usage changed, from the largest change of size down.
+
+        The usage is the one at the high water mark of each capture, or the
+        one left at the end of it with ``leaks``. Stacks are tuples of
+        (function, file, line) tuples, from the most recent call on.
+        """
+        cdef NativeCaptureDiff* diff = self._impl.get()
+        cdef _StackDelta delta
+        deltas = []
+        for delta in diff.getDeltas(not leaks):
+            deltas.append(
+                StackDelta(
+                    stack=diff.Py_GetStack(delta.stack),
+                    size_before=delta.size_before,
+                    size_after=delta.size_after,
+                    n_allocations_before=delta.n_allocations_before,
+                    n_allocations_after=delta.n_allocations_after,
+                )
+            )
+        return deltas
+
+
+cdef class SocketCollector:
+    """Collect the allocations of any number of processes over TCP.
+
+    Processes tracked with a ``CollectorDestination`` connect to the collector
+    while it's in its context, and so do their children when they are
+    tracked with ``follow_fork=True``. The allocations of each process are
+    read in the background, and its current snapshot can be taken on its own
+    or merged with the ones of the other processes.
+    """
+    cdef NativeSocketCollector* _impl
+    cdef object _host
+    cdef object _port
+
+    def __cinit__(self, object port=0, *, object host="127.0.0.1"):
+        self._impl = NULL
+
+    def __init__(self, port=0, *, host="127.0.0.1"):
+        self._host = host
+        self._port = port
+
+    cdef _teardown(self):
+        with nogil:
+            del self._impl
+        self._impl = NULL
+
+    def __enter__(self):
+        if self._impl is not NULL:
+            raise ValueError(
+                "Can not enter the context of a SocketCollector object more than "
+                "once, at the same time."
+            )
+        self._impl = new NativeSocketCollector(self._host, self._port)
+        self._impl.start()
+        return self
+
+    def __exit__(self, exc_type, exc_value, exc_traceback):
+        assert self._impl is not NULL
+        self._teardown()
+
+    def __dealloc__(self):
+        if self._impl is not NULL:
+            self._teardown()
+
+    @property
+    def port(self):
+        """The port that the collector listens on, once it's in its context."""
+        if self._impl is NULL:
+            return self._port
+        return self._impl.port()
+
+    def _connections(self, pid=None):
+        # The connections of the processes that are still running, or the
+        # last connection of the given process, whether it's running or not.
+        if self._impl is NULL:
+            return []
+        connections = []
+        for connection in range(self._impl.numConnections()):
+            header = self._impl.reader(connection).get().getHeader()
+            if pid is None and self._impl.isActive(connection):
+                connections.append((connection, header["pid"]))
+            elif pid is not None and header["pid"] == pid:
+                connections = [(connection, pid)]
+        return connections
+
+    @property
+    def pids(self):
+        """The pids of the connected processes that are still running."""
+        return [pid for _, pid in self._connections()]
+
+    def get_current_snapshot(self, *, bool merge_threads, pid=None):
+        """Get the allocations of one process, or of all running processes.
+
+        Without a ``pid``, the snapshots of every connected process that is
+        still running are merged. Records from different processes never
+        share a location, and each one resolves its stack with the reader of
+        its own process.
+        """
+        cdef shared_ptr[RecordReader] reader
+        cdef size_t c_connection
+        # Take every snapshot before yielding anything, as the caller may
+        # leave the collector's context in between.
+        records = []
+        for connection, _ in self._connections(pid):
+            c_connection = connection
+            reader = self._impl.reader(c_connection)
+            records.extend(
+                _snapshot_records(
+                    self._impl.getSnapshotAllocations(c_connection, merge_threads), reader
+                )
+            )
+        yield from records
 
 
 cdef class SocketReader:
@@ -410,25 +2059,35 @@ cdef class SocketReader:
     cdef shared_ptr[RecordReader] _reader
     cdef object _header
     cdef object _port
+    cdef object _shared_memory_name
 
-    def __cinit__(self, int port):
+    def __cinit__(self, object port=None, *, object shared_memory_name=None):
         self._impl = NULL
 
-    def __init__(self, port: int):
+    def __init__(self, port=None, *, shared_memory_name=None):
+        if (port, shared_memory_name).count(None) != 1:
+            raise TypeError(
+                "Exactly one of 'port' or 'shared_memory_name' argument must be specified"
+            )
         self._header = {}
         self._port = port
+        self._shared_memory_name = shared_memory_name
 
     cdef _teardown(self):
         with nogil:
             del self._impl
         self._impl = NULL
 
-    cdef unique_ptr[SocketSource] _make_source(self) except*:
+    cdef unique_ptr[Source] _make_source(self) except*:
         # Creating a SocketSource can raise Python exceptions (if is interrupted by signal
         # handlers). If this happens, this method will propagate the appropriate exception.
         # We cannot use make_unique or C++ exceptions from SocketSource() won't be caught.
-        cdef SocketSource* source = new SocketSource(self._port)
-        return unique_ptr[SocketSource](source)
+        cdef Source* source
+        if self._shared_memory_name is not None:
+            source = new SharedMemorySource(self._shared_memory_name)
+        else:
+            source = new SocketSource(self._port)
+        return unique_ptr[Source](source)
 
     def __enter__(self):
         if self._impl is not NULL:
@@ -479,12 +2138,66 @@ cdef class SocketReader:
             return False
         return self._header["native_traces"]
 
+    @property
+    def symbols_version(self):
+        """A counter of how many times symbols were resolved in the background.
+
+        Native frames are resolved as they arrive, and frames whose symbols
+        aren't known yet are shown as the binary they belong to and the
+        offset into it. Whenever this changes, more of those frames now
+        resolve to their symbols.
+        """
+        if self._impl is NULL:
+            return 0
+        return self._impl.symbolsVersion()
+
+    @property
+    def live_stats(self):
+        """How well this reader keeps up with the tracked process.
+
+        Returns a `LiveStats` with the allocations read so far, the time the
+        tracked process has spent waiting for this reader to take its
+        records, and how long the records take to reach it.
+        """
+        if self._impl is NULL:
+            return LiveStats(
+                n_allocations=0,
+                n_reports=0,
+                sender_blocked_time_ns=0,
+                lag_ns=0,
+                max_lag_ns=0,
+            )
+        cdef NativeLiveStats stats = self._impl.getLiveStats()
+        return LiveStats(
+            n_allocations=stats.n_allocations,
+            n_reports=stats.sink.n_reports,
+            sender_blocked_time_ns=stats.sink.sender_blocked_ns,
+            lag_ns=stats.sink.lag_ns,
+            max_lag_ns=stats.sink.max_lag_ns,
+        )
+
     def get_current_snapshot(self, *, bool merge_threads):
         if self._impl is NULL:
             return
 
-        snapshot_allocations = self._impl.Py_GetSnapshotAllocationRecords(merge_threads=merge_threads)
-        for elem in snapshot_allocations:
-            alloc = AllocationRecord(elem)
-            (<AllocationRecord> alloc)._reader = self._reader
-            yield alloc
+        yield from _snapshot_records(
+            self._impl.getSnapshotAllocations(merge_threads), self._reader
+        )
+
+    def get_snapshot_changes(self, *, since=0):
+        """Get the locations whose allocations changed since an earlier call.
+
+        Returns a version token and the records of the locations (stack and
+        thread) that changed after the version ``since``, with their current
+        totals. A location whose allocations were all freed is returned with
+        no allocations and a size of 0. Passing the token in the next call
+        only returns what changed after this one, and passing 0 returns every
+        location that currently has allocations.
+        """
+        if self._impl is NULL:
+            return since, []
+
+        cdef pair[uint64_t, reduced_snapshot_map_t] changes = self._impl.getSnapshotChanges(
+            since
+        )
+        return changes.first, _snapshot_records(changes.second, self._reader)
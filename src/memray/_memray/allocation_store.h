@@ -0,0 +1,259 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <iterator>
+#include <vector>
+
+#include "frame_tree.h"
+#include "hooks.h"
+#include "records.h"
+
+namespace memray::api {
+
+using namespace tracking_api;
+
+/**
+ * A sequence of allocations stored column by column.
+ *
+ * A capture can have hundreds of millions of allocations, and the scans that
+ * go over all of them (like finding the high water mark) only look at a few
+ * of their fields. Keeping each field in an array of its own means that these
+ * only bring the columns that they use into the cache.
+ *
+ * Elements are rebuilt from the columns when they are accessed, so they are
+ * returned by value.
+ **/
+class AllocationStore
+{
+  public:
+    class const_iterator
+    {
+      public:
+        using iterator_category = std::forward_iterator_tag;
+        using value_type = Allocation;
+        using difference_type = std::ptrdiff_t;
+        using pointer = void;
+        using reference = Allocation;
+
+        const_iterator() = default;
+        const_iterator(const AllocationStore* store, size_t index)
+        : d_store(store)
+        , d_index(index)
+        {
+        }
+
+        Allocation operator*() const
+        {
+            return (*d_store)[d_index];
+        }
+
+        const_iterator& operator++()
+        {
+            ++d_index;
+            return *this;
+        }
+
+        const_iterator operator++(int)
+        {
+            const_iterator result = *this;
+            ++d_index;
+            return result;
+        }
+
+        bool operator==(const const_iterator& other) const
+        {
+            return d_index == other.d_index;
+        }
+
+        bool operator!=(const const_iterator& other) const
+        {
+            return d_index != other.d_index;
+        }
+
+      private:
+        const AllocationStore* d_store{nullptr};
+        size_t d_index{0};
+    };
+
+    // Methods
+    size_t size() const noexcept
+    {
+        return d_addresses.size();
+    }
+
+    bool empty() const noexcept
+    {
+        return d_addresses.empty();
+    }
+
+    size_t capacity() const noexcept
+    {
+        return d_addresses.capacity();
+    }
+
+    void reserve(size_t n)
+    {
+        d_tids.reserve(n);
+        d_addresses.reserve(n);
+        d_sizes.reserve(n);
+        d_allocators.reserve(n);
+        d_native_frame_ids.reserve(n);
+        d_frame_indexes.reserve(n);
+        d_native_segment_generations.reserve(n);
+        d_n_allocations.reserve(n);
+        d_realloc_old_addresses.reserve(n);
+    }
+
+    void clear() noexcept
+    {
+        d_tids.clear();
+        d_addresses.clear();
+        d_sizes.clear();
+        d_allocators.clear();
+        d_native_frame_ids.clear();
+        d_frame_indexes.clear();
+        d_native_segment_generations.clear();
+        d_n_allocations.clear();
+        d_realloc_old_addresses.clear();
+    }
+
+    // Drop every allocation after the first n.
+    void truncate(size_t n)
+    {
+        if (n >= size()) {
+            return;
+        }
+        d_tids.resize(n);
+        d_addresses.resize(n);
+        d_sizes.resize(n);
+        d_allocators.resize(n);
+        d_native_frame_ids.resize(n);
+        d_frame_indexes.resize(n);
+        d_native_segment_generations.resize(n);
+        d_n_allocations.resize(n);
+        d_realloc_old_addresses.resize(n);
+    }
+
+    void push_back(const Allocation& allocation)
+    {
+        d_tids.push_back(allocation.record.tid);
+        d_addresses.push_back(allocation.record.address);
+        d_sizes.push_back(allocation.record.size);
+        d_allocators.push_back(allocation.record.allocator);
+        d_native_frame_ids.push_back(allocation.record.native_frame_id);
+        d_frame_indexes.push_back(allocation.frame_index);
+        d_native_segment_generations.push_back(allocation.native_segment_generation);
+        d_n_allocations.push_back(allocation.n_allocations);
+        d_realloc_old_addresses.push_back(allocation.realloc_old_address);
+    }
+
+    // Append the allocations of another store, from its index `begin` on.
+    void append(const AllocationStore& other, size_t begin = 0)
+    {
+        auto append_column = [begin](auto& column, const auto& other_column) {
+            column.insert(column.end(), other_column.begin() + begin, other_column.end());
+        };
+        append_column(d_tids, other.d_tids);
+        append_column(d_addresses, other.d_addresses);
+        append_column(d_sizes, other.d_sizes);
+        append_column(d_allocators, other.d_allocators);
+        append_column(d_native_frame_ids, other.d_native_frame_ids);
+        append_column(d_frame_indexes, other.d_frame_indexes);
+        append_column(d_native_segment_generations, other.d_native_segment_generations);
+        append_column(d_n_allocations, other.d_n_allocations);
+        append_column(d_realloc_old_addresses, other.d_realloc_old_addresses);
+    }
+
+    Allocation operator[](size_t index) const
+    {
+        return Allocation{
+                .record =
+                        {.tid = d_tids[index],
+                         .address = d_addresses[index],
+                         .size = d_sizes[index],
+                         .allocator = d_allocators[index],
+                         .native_frame_id = d_native_frame_ids[index]},
+                .frame_index = d_frame_indexes[index],
+                .native_segment_generation = d_native_segment_generations[index],
+                .n_allocations = d_n_allocations[index],
+                .realloc_old_address = d_realloc_old_addresses[index]};
+    }
+
+    const_iterator begin() const
+    {
+        return const_iterator(this, 0);
+    }
+
+    const_iterator end() const
+    {
+        return const_iterator(this, size());
+    }
+
+    // Columns
+    const std::vector<thread_id_t>& tids() const noexcept
+    {
+        return d_tids;
+    }
+
+    const std::vector<uintptr_t>& addresses() const noexcept
+    {
+        return d_addresses;
+    }
+
+    const std::vector<size_t>& sizes() const noexcept
+    {
+        return d_sizes;
+    }
+
+    const std::vector<hooks::Allocator>& allocators() const noexcept
+    {
+        return d_allocators;
+    }
+
+    const std::vector<frame_id_t>& nativeFrameIds() const noexcept
+    {
+        return d_native_frame_ids;
+    }
+
+    const std::vector<FrameTree::index_t>& frameIndexes() const noexcept
+    {
+        return d_frame_indexes;
+    }
+
+    std::vector<FrameTree::index_t>& frameIndexes() noexcept
+    {
+        return d_frame_indexes;
+    }
+
+    const std::vector<size_t>& nativeSegmentGenerations() const noexcept
+    {
+        return d_native_segment_generations;
+    }
+
+    const std::vector<size_t>& nAllocations() const noexcept
+    {
+        return d_n_allocations;
+    }
+
+    const std::vector<uintptr_t>& reallocOldAddresses() const noexcept
+    {
+        return d_realloc_old_addresses;
+    }
+
+  private:
+    // Data members
+    std::vector<thread_id_t> d_tids;
+    std::vector<uintptr_t> d_addresses;
+    std::vector<size_t> d_sizes;
+    std::vector<hooks::Allocator> d_allocators;
+    std::vector<frame_id_t> d_native_frame_ids;
+    std::vector<FrameTree::index_t> d_frame_indexes;
+    std::vector<size_t> d_native_segment_generations;
+    std::vector<size_t> d_n_allocations;
+    std::vector<uintptr_t> d_realloc_old_addresses;
+};
+
+using allocations_t = AllocationStore;
+
+}  // namespace memray::api
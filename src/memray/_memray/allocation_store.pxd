@@ -0,0 +1,35 @@
+from _memray.records cimport Allocation
+from libc.stdint cimport uint32_t
+from libc.stdint cimport uintptr_t
+from libcpp cimport bool
+from libcpp.vector cimport vector
+
+
+cdef extern from "hooks.h":
+    cdef enum Allocator 'memray::hooks::Allocator':
+        AllocatorMalloc 'memray::hooks::Allocator::MALLOC'
+
+
+cdef extern from "allocation_store.h" namespace "memray::api":
+    cdef cppclass AllocationStore:
+        cppclass const_iterator:
+            Allocation operator*()
+            const_iterator operator++()
+            bool operator==(const_iterator)
+            bool operator!=(const_iterator)
+
+        size_t size()
+        Allocation operator[](size_t index)
+        const_iterator begin()
+        const_iterator end()
+        void push_back(const Allocation& allocation) nogil except+
+
+        const vector[unsigned long]& tids()
+        const vector[uintptr_t]& addresses()
+        const vector[size_t]& sizes()
+        const vector[Allocator]& allocators()
+        const vector[size_t]& nativeFrameIds()
+        const vector[uint32_t]& frameIndexes()
+        const vector[size_t]& nativeSegmentGenerations()
+        const vector[size_t]& nAllocations()
+        const vector[uintptr_t]& reallocOldAddresses()
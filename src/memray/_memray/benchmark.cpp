@@ -0,0 +1,451 @@
+#include <algorithm>
+#include <arpa/inet.h>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <netinet/in.h>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <sys/socket.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+#include "benchmark.h"
+#include "frame_tree.h"
+#include "hooks.h"
+#include "record_writer.h"
+#include "records.h"
+#include "sink.h"
+#include "snapshot.h"
+#include "socket_reader_thread.h"
+#include "source.h"
+#include "tracking_api.h"
+
+namespace memray::benchmark {
+
+using namespace tracking_api;
+
+namespace {
+
+// Call body(thread_index, iteration) from n_threads threads, which are all
+// created before any of them starts, and return the nanoseconds per iteration.
+template<typename Body>
+double
+runThreads(size_t n_threads, size_t n_iterations, const Body& body)
+{
+    if (n_threads == 0 || n_iterations == 0) {
+        throw std::invalid_argument("benchmarks need at least one thread and one iteration");
+    }
+
+    std::atomic<size_t> n_ready{0};
+    std::atomic<bool> start{false};
+    std::vector<std::thread> threads;
+    threads.reserve(n_threads);
+    for (size_t thread_index = 0; thread_index < n_threads; ++thread_index) {
+        threads.emplace_back([&, thread_index] {
+            n_ready.fetch_add(1, std::memory_order_acq_rel);
+            while (!start.load(std::memory_order_acquire)) {
+                std::this_thread::yield();
+            }
+            for (size_t iteration = 0; iteration < n_iterations; ++iteration) {
+                body(thread_index, iteration);
+            }
+        });
+    }
+    while (n_ready.load(std::memory_order_acquire) < n_threads) {
+        std::this_thread::yield();
+    }
+
+    auto started = std::chrono::steady_clock::now();
+    start.store(true, std::memory_order_release);
+    for (auto& thread : threads) {
+        thread.join();
+    }
+    std::chrono::duration<double, std::nano> elapsed = std::chrono::steady_clock::now() - started;
+    return elapsed.count() / n_iterations;
+}
+
+// Every thread gets addresses of its own, so that the records of different
+// threads never refer to the same allocation.
+inline uintptr_t
+fakeAddress(size_t thread_index, size_t iteration)
+{
+    return (static_cast<uintptr_t>(thread_index + 1) << 40) + (iteration % 4096) * 16;
+}
+
+}  // namespace
+
+double
+trackAllocations(size_t n_threads, size_t n_iterations)
+{
+    if (!Tracker::getTracker()) {
+        throw std::runtime_error("trackAllocations needs an active tracker");
+    }
+    return runThreads(n_threads, n_iterations, [](size_t thread_index, size_t iteration) {
+        void* ptr = reinterpret_cast<void*>(fakeAddress(thread_index, iteration));
+        Tracker::trackAllocation(ptr, 64, hooks::Allocator::MALLOC);
+        Tracker::trackDeallocation(ptr, 0, hooks::Allocator::FREE);
+    });
+}
+
+double
+writeAllocationRecords(const std::string& file_name, size_t n_threads, size_t n_iterations)
+{
+    std::unique_ptr<io::Sink> sink;
+    if (file_name.empty()) {
+        sink = std::make_unique<io::NullSink>();
+    } else {
+        sink = std::make_unique<io::FileSink>(file_name, true);
+    }
+    // Thread buffers only hand themselves back to a writer that is shared.
+    auto writer = std::make_shared<RecordWriter>(std::move(sink), "memray benchmark", false, 0);
+    if (!writer->writeHeader(false)) {
+        throw std::runtime_error("Failed to write the header");
+    }
+
+    std::atomic<bool> failed{false};
+    auto started = std::chrono::steady_clock::now();
+    runThreads(n_threads, n_iterations, [&](size_t thread_index, size_t iteration) {
+        AllocationRecord record{
+                thread_index + 1,
+                fakeAddress(thread_index, iteration),
+                64,
+                hooks::Allocator::MALLOC,
+                0};
+        if (!writer->writeThreadSpecificRecord(RecordType::ALLOCATION, record)) {
+            failed.store(true, std::memory_order_relaxed);
+        }
+    });
+    if (failed || !writer->drainThreadBuffers() || !writer->writeTrailer()) {
+        throw std::runtime_error("Failed to write the records");
+    }
+    std::chrono::duration<double, std::nano> elapsed = std::chrono::steady_clock::now() - started;
+    return elapsed.count() / n_iterations;
+}
+
+double
+lookUpTraces(size_t n_threads, size_t n_iterations, size_t n_stacks, size_t depth, bool use_cache)
+{
+    if (n_stacks == 0 || depth == 0) {
+        throw std::invalid_argument("benchmarks need at least one stack of one frame");
+    }
+
+    // Every stack starts with some of the outer frames of an earlier one
+    // and calls frames of its own from there, so the stacks make a tree whose
+    // branches are as deep as the stacks are.
+    std::mt19937_64 random(42);
+    std::vector<std::vector<frame_id_t>> stacks(n_stacks);
+    frame_id_t next_frame = 1;
+    for (size_t i = 0; i < n_stacks; ++i) {
+        std::vector<frame_id_t>& stack = stacks[i];
+        if (i) {
+            const std::vector<frame_id_t>& parent = stacks[random() % i];
+            stack.assign(parent.begin(), parent.begin() + random() % depth);
+        }
+        while (stack.size() < depth) {
+            stack.push_back(next_frame++);
+        }
+    }
+
+    FrameTree tree;
+    std::vector<FrameTree::TraceCache> caches(n_threads);
+    std::atomic<bool> failed{false};
+    double result = runThreads(n_threads, n_iterations, [&](size_t thread_index, size_t iteration) {
+        // Each thread goes through the stacks from a different one.
+        const auto& stack = stacks[(thread_index * 7919 + iteration) % n_stacks];
+        size_t index;
+        if (use_cache) {
+            index = tree.getTraceIndex(stack, FrameTree::tracecallback_t(), caches[thread_index]);
+        } else {
+            index = tree.getTraceIndex(stack, FrameTree::tracecallback_t());
+        }
+        if (!index) {
+            failed.store(true, std::memory_order_relaxed);
+        }
+    });
+    if (failed) {
+        throw std::runtime_error("The frame tree ran out of indexes");
+    }
+    return result;
+}
+
+void
+writeSyntheticCapture(const std::string& file_name, size_t n_records, size_t stack_depth)
+{
+    if (stack_depth == 0) {
+        throw std::invalid_argument("synthetic stacks need at least one frame");
+    }
+    auto writer = std::make_shared<RecordWriter>(
+            std::make_unique<io::FileSink>(file_name, true),
+            "memray synthetic capture",
+            false,
+            0);
+    if (!writer->writeHeader(false)) {
+        throw std::runtime_error("Failed to write the header");
+    }
+    auto check = [](bool ok) {
+        if (!ok) {
+            throw std::runtime_error("Failed to write the synthetic capture");
+        }
+    };
+
+    // Each level of the stack calls one of a few functions, so that stacks
+    // diverge and meet again like the ones of a real program.
+    constexpr size_t FUNCTIONS_PER_LEVEL = 4;
+    const size_t max_depth = 2 * stack_depth;
+    std::vector<std::string> function_names;
+    for (size_t i = 0; i < max_depth * FUNCTIONS_PER_LEVEL; ++i) {
+        function_names.push_back("function_" + std::to_string(i));
+    }
+    const char* filename = "synthetic.py";
+    for (size_t i = 0; i < function_names.size(); ++i) {
+        RawFrame frame{function_names[i].c_str(), filename, static_cast<int>(i + 1)};
+        check(writer->writeRecord(RecordType::FRAME_INDEX, pyrawframe_map_val_t{i + 1, frame}));
+    }
+
+    const thread_id_t tid = 1;
+    std::mt19937_64 random(42);
+    std::vector<frame_id_t> stack;
+    std::vector<std::pair<uintptr_t, size_t>> heap;
+    std::vector<std::pair<uintptr_t, size_t>> mappings;
+    uintptr_t next_heap_address = uintptr_t(1) << 32;
+    uintptr_t next_mapping_address = uintptr_t(1) << 44;
+    size_t live_bytes = 0;
+    auto millis = std::chrono::duration_cast<std::chrono::milliseconds>(
+            std::chrono::system_clock::now().time_since_epoch());
+
+    auto write_allocation = [&](uintptr_t address, size_t size, hooks::Allocator allocator) {
+        AllocationRecord record{tid, address, size, allocator, 0};
+        check(writer->writeThreadSpecificRecord(RecordType::ALLOCATION, record));
+    };
+
+    for (size_t n = 0; n < n_records; ++n) {
+        if (n % 4 == 0) {
+            size_t target = stack_depth / 2 + random() % (stack_depth + 1);
+            size_t to_pop = std::min<size_t>(stack.size(), random() % 8);
+            while (stack.size() > target + to_pop) {
+                ++to_pop;
+            }
+            for (size_t remaining = to_pop; remaining;) {
+                uint8_t count = std::min<size_t>(remaining, 255);
+                check(writer->writeThreadSpecificRecord(RecordType::FRAME_POP, FramePop{tid, count}));
+                remaining -= count;
+            }
+            stack.resize(stack.size() - to_pop);
+            while (stack.size() < target) {
+                frame_id_t frame =
+                        1 + stack.size() * FUNCTIONS_PER_LEVEL + random() % FUNCTIONS_PER_LEVEL;
+                check(writer->writeThreadSpecificRecord(RecordType::FRAME_PUSH, FramePush{frame, tid}));
+                stack.push_back(frame);
+            }
+        }
+
+        if (n % 16 == 0) {
+            // Unmap all of a mapping, or a prefix of it, which splits what
+            // the reader keeps track of.
+            if (!mappings.empty() && random() % 2) {
+                size_t index = random() % mappings.size();
+                auto& [address, size] = mappings[index];
+                size_t unmapped = random() % 2 ? size : size / 2;
+                write_allocation(address, unmapped, hooks::Allocator::MUNMAP);
+                live_bytes -= unmapped;
+                address += unmapped;
+                size -= unmapped;
+                if (!size) {
+                    mappings[index] = mappings.back();
+                    mappings.pop_back();
+                }
+            } else {
+                size_t size = (1 + random() % 64) * 16384;
+                mappings.emplace_back(next_mapping_address, size);
+                write_allocation(next_mapping_address, size, hooks::Allocator::MMAP);
+                next_mapping_address += size;
+                live_bytes += size;
+            }
+        } else if (!heap.empty() && (heap.size() > 100000 || random() % 2)) {
+            size_t index = random() % heap.size();
+            write_allocation(heap[index].first, 0, hooks::Allocator::FREE);
+            live_bytes -= heap[index].second;
+            heap[index] = heap.back();
+            heap.pop_back();
+        } else {
+            size_t size = 16 + random() % 4096;
+            heap.emplace_back(next_heap_address, size);
+            write_allocation(next_heap_address, size, hooks::Allocator::MALLOC);
+            next_heap_address += size;
+            live_bytes += size;
+        }
+
+        if (n % 10000 == 9999) {
+            // Like the tracker, put out the allocations before the memory
+            // record that comes after them.
+            millis += std::chrono::milliseconds(10);
+            check(writer->drainThreadBuffers());
+            check(writer->writeRecord(
+                    RecordType::MEMORY_RECORD,
+                    MemoryRecord{static_cast<unsigned long>(millis.count()), live_bytes}));
+        }
+    }
+
+    check(writer->drainThreadBuffers());
+    check(writer->writeTrailer());
+    check(writer->writeHeader(true));
+}
+
+size_t
+readRecords(const std::string& file_name)
+{
+    api::RecordReader reader(std::make_unique<io::FileSource>(file_name));
+    size_t n_allocations = 0;
+    while (true) {
+        switch (reader.nextRecord()) {
+            case api::RecordReader::RecordResult::ALLOCATION_RECORD:
+            case api::RecordReader::RecordResult::AGGREGATED_ALLOCATION_RECORD:
+                ++n_allocations;
+                break;
+            case api::RecordReader::RecordResult::ALLOCATION_COUNTS_RECORD:
+            case api::RecordReader::RecordResult::MEMORY_RECORD:
+                break;
+            case api::RecordReader::RecordResult::ERROR:
+                throw std::runtime_error("Failed to read the capture");
+            case api::RecordReader::RecordResult::END_OF_FILE:
+                return n_allocations;
+        }
+    }
+}
+
+LiveThroughput
+liveThroughput(size_t n_threads, size_t n_iterations)
+{
+    // Listen on a port of the kernel's choosing, and have the sink connect to
+    // it like it connects to a collector.
+    int listener = ::socket(AF_INET, SOCK_STREAM, 0);
+    if (listener == -1) {
+        throw std::runtime_error("Failed to create a socket");
+    }
+    sockaddr_in address{};
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t address_length = sizeof(address);
+    if (::bind(listener, reinterpret_cast<sockaddr*>(&address), sizeof(address)) == -1
+        || ::listen(listener, 1) == -1
+        || ::getsockname(listener, reinterpret_cast<sockaddr*>(&address), &address_length) == -1)
+    {
+        ::close(listener);
+        throw std::runtime_error("Failed to listen on the loopback interface");
+    }
+    std::unique_ptr<io::Sink> sink;
+    try {
+        sink = std::make_unique<io::SocketSink>(
+                "127.0.0.1",
+                ntohs(address.sin_port),
+                io::SocketSink::DEFAULT_BUFFER_SIZE,
+                true);
+    } catch (...) {
+        ::close(listener);
+        throw;
+    }
+    int connection = ::accept(listener, nullptr, nullptr);
+    ::close(listener);
+    if (connection == -1) {
+        throw std::runtime_error("Failed to accept the connection");
+    }
+    auto source = io::SocketSource::fromConnectedSocket(connection);
+
+    auto writer = std::make_shared<RecordWriter>(std::move(sink), "memray benchmark", false, 0);
+    if (!writer->writeHeader(false)) {
+        throw std::runtime_error("Failed to write the header");
+    }
+    auto reader = std::make_shared<api::RecordReader>(std::move(source));
+    socket_thread::BackgroundSocketReader live_reader(reader);
+    live_reader.start();
+
+    std::atomic<bool> failed{false};
+    std::atomic<bool> done{false};
+    auto report = [&] {
+        if (!writer->writeSinkStats() || !writer->drainThreadBuffers()) {
+            failed.store(true, std::memory_order_relaxed);
+        }
+    };
+    std::thread reporter([&] {
+        while (!done.load(std::memory_order_acquire)) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+            report();
+        }
+    });
+
+    auto started = std::chrono::steady_clock::now();
+    runThreads(n_threads, n_iterations, [&](size_t thread_index, size_t iteration) {
+        uintptr_t address = fakeAddress(thread_index, iteration);
+        AllocationRecord allocation{thread_index + 1, address, 64, hooks::Allocator::MALLOC, 0};
+        AllocationRecord deallocation{thread_index + 1, address, 0, hooks::Allocator::FREE, 0};
+        if (!writer->writeThreadSpecificRecord(RecordType::ALLOCATION, allocation)
+            || !writer->writeThreadSpecificRecord(RecordType::ALLOCATION, deallocation))
+        {
+            failed.store(true, std::memory_order_relaxed);
+        }
+    });
+    done.store(true, std::memory_order_release);
+    reporter.join();
+    report();
+    if (failed || !writer->writeTrailer()) {
+        throw std::runtime_error("Failed to write the records");
+    }
+    // Closing the sink makes the reader see the end of the stream once it
+    // has caught up with everything that was written.
+    writer.reset();
+    while (live_reader.is_active()) {
+        std::this_thread::sleep_for(std::chrono::microseconds(100));
+    }
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - started;
+
+    socket_thread::LiveStats stats = live_reader.getLiveStats();
+    const uint64_t n_events = 2 * n_threads * n_iterations;
+    if (stats.n_allocations != n_events) {
+        throw std::runtime_error("The reader didn't get every record that was written");
+    }
+    LiveThroughput result;
+    result.events_per_second = n_events / elapsed.count();
+    result.mean_lag_ns = stats.sink.n_reports
+                                 ? static_cast<double>(stats.sink.total_lag_ns) / stats.sink.n_reports
+                                 : 0.0;
+    result.max_lag_ns = stats.sink.max_lag_ns;
+    result.sender_blocked_ns = stats.sink.sender_blocked_ns;
+    return result;
+}
+
+SnapshotBenchmark::SnapshotBenchmark(const std::string& file_name)
+: d_reader(std::make_shared<api::RecordReader>(std::make_unique<io::FileSource>(file_name)))
+{
+    if (d_reader->readAllRecords(file_name, 1) == api::RecordReader::RecordResult::ERROR) {
+        throw std::runtime_error("Failed to read the capture");
+    }
+}
+
+size_t
+SnapshotBenchmark::numRecords() const
+{
+    return d_reader->allocationRecords().size();
+}
+
+size_t
+SnapshotBenchmark::highWatermark() const
+{
+    return api::getHighWatermark(d_reader->allocationRecords()).peak_memory;
+}
+
+size_t
+SnapshotBenchmark::snapshotAllocations(size_t n_records, bool merge_threads) const
+{
+    const auto& records = d_reader->allocationRecords();
+    if (records.size() == 0 || n_records == 0) {
+        return 0;
+    }
+    size_t index = std::min(n_records, records.size()) - 1;
+    return api::getSnapshotAllocations(records, index, merge_threads).size();
+}
+
+}  // namespace memray::benchmark
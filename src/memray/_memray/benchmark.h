@@ -0,0 +1,102 @@
+#pragma once
+
+#include <cstddef>
+#include <memory>
+#include <string>
+
+#include "record_reader.h"
+
+namespace memray::benchmark {
+
+/**
+ * Native loops over the parts of the tracking hot path, run without the
+ * interpreter in between so that the cost of each part can be told apart.
+ *
+ * Each benchmark starts n_threads threads at once, every one of which does
+ * n_iterations operations, and returns the nanoseconds that an operation
+ * took on average from the point of view of one thread: the wall time that
+ * all of them needed divided by n_iterations. A part that scales perfectly
+ * takes as long with many threads as with one, and contention shows up as
+ * that time growing with the number of threads.
+ **/
+
+// Tracker::trackAllocation followed by Tracker::trackDeallocation, with the
+// tracker that is currently active, which decides whether native traces are
+// captured and where the records go. The addresses are never dereferenced.
+double
+trackAllocations(size_t n_threads, size_t n_iterations);
+
+// RecordWriter::writeThreadSpecificRecord of an allocation record, with a
+// FileSink writing to file_name, or a NullSink if it's empty. The header is
+// written before the clock starts, and draining the thread buffers and
+// writing the trailer is timed.
+double
+writeAllocationRecords(const std::string& file_name, size_t n_threads, size_t n_iterations);
+
+// FrameTree::getTraceIndex of n_stacks stacks of the given depth, shared by
+// all the threads, which look them up over and over. The stacks share their
+// outer frames like the stacks of a real program do, and with use_cache each
+// thread keeps a TraceCache like the tracker does.
+double
+lookUpTraces(size_t n_threads, size_t n_iterations, size_t n_stacks, size_t depth, bool use_cache);
+
+/**
+ * Synthetic captures and the analysis of them, to time the reading side as
+ * the captures grow far beyond what a benchmark can afford to record.
+ **/
+
+// Write a capture of n_records allocation and deallocation records, made by
+// a single thread whose Python stack wanders around stack_depth frames deep.
+// One in sixteen records maps or unmaps memory, often only part of a mapping,
+// and a memory record is written every 10000 records. Native traces can't be
+// made up, because resolving them needs the objects that they point into.
+void
+writeSyntheticCapture(const std::string& file_name, size_t n_records, size_t stack_depth);
+
+// Parse every record of a capture with RecordReader::nextRecord, and return
+// how many allocations were found.
+size_t
+readRecords(const std::string& file_name);
+
+/**
+ * The live path, from a RecordWriter through a SocketSink and a SocketSource
+ * to a BackgroundSocketReader, all in this process over a loopback
+ * connection.
+ **/
+
+struct LiveThroughput
+{
+    // Allocations and deallocations per second, from the moment the first
+    // one is written until the reader has read the last one.
+    double events_per_second;
+    // How long before being read the SinkStats records were written, on
+    // average and at most.
+    double mean_lag_ns;
+    uint64_t max_lag_ns;
+    // The time the writer spent waiting for the reader to take its records.
+    uint64_t sender_blocked_ns;
+};
+
+// n_threads threads write an allocation and its deallocation n_iterations
+// times each, as fast as they can, while a background thread drains their
+// buffers and writes SinkStats every 10 milliseconds, like the tracker does.
+LiveThroughput
+liveThroughput(size_t n_threads, size_t n_iterations);
+
+// The allocations of a capture, read once, to time what's computed from them.
+class SnapshotBenchmark
+{
+  public:
+    explicit SnapshotBenchmark(const std::string& file_name);
+
+    size_t numRecords() const;
+    // The peak memory that getHighWatermark finds.
+    size_t highWatermark() const;
+    // The number of locations with live memory after the first n_records.
+    size_t snapshotAllocations(size_t n_records, bool merge_threads) const;
+
+  private:
+    std::shared_ptr<api::RecordReader> d_reader;
+};
+
+}  // namespace memray::benchmark
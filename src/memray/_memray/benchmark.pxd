@@ -0,0 +1,24 @@
+from libc.stdint cimport uint64_t
+from libcpp cimport bool
+from libcpp.string cimport string
+
+
+cdef extern from "benchmark.h" namespace "memray::benchmark":
+    cdef struct LiveThroughput:
+        double events_per_second
+        double mean_lag_ns
+        uint64_t max_lag_ns
+        uint64_t sender_blocked_ns
+
+    double trackAllocations(size_t n_threads, size_t n_iterations) nogil except+
+    double writeAllocationRecords(const string& file_name, size_t n_threads, size_t n_iterations) nogil except+
+    double lookUpTraces(size_t n_threads, size_t n_iterations, size_t n_stacks, size_t depth, bool use_cache) nogil except+
+    void writeSyntheticCapture(const string& file_name, size_t n_records, size_t stack_depth) nogil except+
+    size_t readRecords(const string& file_name) nogil except+
+    LiveThroughput liveThroughput(size_t n_threads, size_t n_iterations) nogil except+
+
+    cdef cppclass SnapshotBenchmark:
+        SnapshotBenchmark(const string& file_name) nogil except+
+        size_t numRecords()
+        size_t highWatermark() nogil except+
+        size_t snapshotAllocations(size_t n_records, bool merge_threads) nogil except+
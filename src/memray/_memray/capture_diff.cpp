@@ -0,0 +1,168 @@
+#include <algorithm>
+#include <stdexcept>
+
+#include "capture_diff.h"
+
+namespace memray::api {
+
+namespace {
+
+size_t
+sizeChange(const CaptureDiff::StackDelta& delta)
+{
+    return delta.size_after > delta.size_before ? delta.size_after - delta.size_before
+                                                : delta.size_before - delta.size_after;
+}
+
+}  // unnamed namespace
+
+CaptureDiff::CaptureDiff(
+        const std::string& before_file_name,
+        const std::string& after_file_name,
+        size_t max_workers,
+        const std::string& symbol_cache_dir)
+: d_family({before_file_name, after_file_name}, max_workers, symbol_cache_dir)
+{
+}
+
+void
+CaptureDiff::readAll()
+{
+    d_family.readAll();
+    addCapture(0);
+    addCapture(1);
+}
+
+const CaptureFamily::Capture&
+CaptureDiff::capture(size_t index) const
+{
+    return d_family.capture(index);
+}
+
+void
+CaptureDiff::addCapture(size_t index)
+{
+    const CaptureFamily::Capture& capture = d_family.capture(index);
+    const bool before = index == 0;
+    // What the frames and the stacks of this capture are in the tree.
+    containers::FlatHashMap<frame_id_t, frame_id_t> frames;
+    containers::FlatHashMap<size_t, FrameTree::index_t> stacks;
+    for (const auto& allocation : capture.allocations) {
+        FrameTree::index_t stack = getStack(*capture.reader, allocation.frame_index, frames, stacks);
+        if (allocation.n_allocations_in_high_water_mark) {
+            StackDelta& delta = d_high_water_mark[stack];
+            delta.stack = stack;
+            (before ? delta.size_before : delta.size_after) += allocation.bytes_in_high_water_mark;
+            (before ? delta.n_allocations_before : delta.n_allocations_after) +=
+                    allocation.n_allocations_in_high_water_mark;
+        }
+        if (allocation.n_allocations_leaked) {
+            StackDelta& delta = d_leaks[stack];
+            delta.stack = stack;
+            (before ? delta.size_before : delta.size_after) += allocation.bytes_leaked;
+            (before ? delta.n_allocations_before : delta.n_allocations_after) +=
+                    allocation.n_allocations_leaked;
+        }
+    }
+}
+
+FrameTree::index_t
+CaptureDiff::getStack(
+        RecordReader& reader,
+        size_t frame_index,
+        containers::FlatHashMap<frame_id_t, frame_id_t>& frames,
+        containers::FlatHashMap<size_t, FrameTree::index_t>& stacks)
+{
+    auto [stack_it, inserted] = stacks.try_emplace(frame_index, 0);
+    if (!inserted) {
+        return stack_it->second;
+    }
+
+    std::vector<frame_id_t> frame_ids;
+    reader.getStackFrameIds(frame_index, frame_ids);
+    FrameTree::index_t stack = 0;
+    for (auto it = frame_ids.rbegin(); it != frame_ids.rend(); ++it) {
+        auto [frame_it, new_frame] = frames.try_emplace(*it, 0);
+        if (new_frame) {
+            std::string_view function_name;
+            std::string_view filename;
+            int lineno;
+            reader.getFrameInfo(*it, function_name, filename, lineno);
+            ResolvedFrame frame{
+                    d_strings.internString(function_name),
+                    d_strings.internString(filename),
+                    lineno};
+            auto [id_it, new_id] = d_frame_ids.try_emplace(frame, d_frames.size());
+            if (new_id) {
+                d_frames.push_back(frame);
+            }
+            frame_it->second = id_it->second;
+        }
+        FrameTree::index_t child = d_tree.getTraceIndex(stack, frame_it->second);
+        if (!child) {
+            // The tree ran out of indexes, so the rest of the stack is left out.
+            break;
+        }
+        stack = child;
+    }
+    stack_it->second = stack;
+    return stack;
+}
+
+std::vector<CaptureDiff::StackDelta>
+CaptureDiff::getDeltas(bool high_water_mark) const
+{
+    const auto& by_stack = high_water_mark ? d_high_water_mark : d_leaks;
+    std::vector<StackDelta> deltas;
+    for (const auto& [stack, delta] : by_stack) {
+        if (delta.size_before != delta.size_after
+            || delta.n_allocations_before != delta.n_allocations_after)
+        {
+            deltas.push_back(delta);
+        }
+    }
+    std::sort(deltas.begin(), deltas.end(), [](const StackDelta& lhs, const StackDelta& rhs) {
+        size_t lhs_change = sizeChange(lhs);
+        size_t rhs_change = sizeChange(rhs);
+        return lhs_change != rhs_change ? lhs_change > rhs_change : lhs.stack < rhs.stack;
+    });
+    return deltas;
+}
+
+PyObject*
+CaptureDiff::Py_GetStack(FrameTree::index_t stack) const
+{
+    if (stack >= d_tree.size()) {
+        throw std::out_of_range("Invalid stack index");
+    }
+    PyObject* list = PyList_New(0);
+    if (list == nullptr) {
+        return nullptr;
+    }
+    for (FrameTree::index_t current = stack; current != 0;) {
+        auto [frame_id, parent] = d_tree.nextNode(current);
+        current = parent;
+        const ResolvedFrame& frame = d_frames[frame_id];
+        PyObject* function_name = d_pystring_cache.getUnicodeObject(
+                frame.function_name,
+                d_strings.resolveString(frame.function_name));
+        PyObject* filename = d_pystring_cache.getUnicodeObject(
+                frame.filename,
+                d_strings.resolveString(frame.filename));
+        PyObject* tuple = nullptr;
+        if (function_name != nullptr && filename != nullptr) {
+            tuple = Py_BuildValue("(OOi)", function_name, filename, frame.lineno);
+        }
+        if (tuple == nullptr || PyList_Append(list, tuple) != 0) {
+            Py_XDECREF(tuple);
+            Py_DECREF(list);
+            return nullptr;
+        }
+        Py_DECREF(tuple);
+    }
+    PyObject* result = PyList_AsTuple(list);
+    Py_DECREF(list);
+    return result;
+}
+
+}  // namespace memray::api
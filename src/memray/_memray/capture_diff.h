@@ -0,0 +1,110 @@
+#pragma once
+
+#include <cstddef>
+#include <string>
+#include <vector>
+
+#include "Python.h"
+
+#include "capture_family.h"
+#include "flat_hash_map.h"
+#include "frame_tree.h"
+#include "native_resolver.h"
+#include "python_helpers.h"
+#include "record_reader.h"
+#include "records.h"
+
+namespace memray::api {
+
+/**
+ * How the snapshots of two captures differ, stack by stack.
+ *
+ * The two files are read at the same time, the way a CaptureFamily reads
+ * them, and their locations are then matched by their Python stacks. The
+ * frame ids of a file mean nothing in the other one, so frames are matched
+ * by their function name, file name and line, as interned by the reader of
+ * each file, and the stacks are put into a tree of their own whose nodes
+ * are those frames. Each frame and each stack of a file is only looked up
+ * once, however many locations share it. Threads, allocators and native
+ * stacks are not told apart.
+ **/
+class CaptureDiff
+{
+  public:
+    struct StackDelta
+    {
+        FrameTree::index_t stack{0};
+        size_t size_before{0};
+        size_t size_after{0};
+        size_t n_allocations_before{0};
+        size_t n_allocations_after{0};
+    };
+
+    // The captures are 0 for the one before and 1 for the one after.
+    CaptureDiff(
+            const std::string& before_file_name,
+            const std::string& after_file_name,
+            size_t max_workers,
+            const std::string& symbol_cache_dir);
+
+    // Read both files to their end and match their stacks. This doesn't need
+    // the GIL.
+    void readAll();
+
+    const CaptureFamily::Capture& capture(size_t index) const;
+    // The stacks whose usage differs at the high water mark, or at the end,
+    // ordered from the largest change of size to the smallest one.
+    std::vector<StackDelta> getDeltas(bool high_water_mark) const;
+    // A stack of the diff as a tuple of (function, file, line) tuples, from
+    // the most recent call on.
+    PyObject* Py_GetStack(FrameTree::index_t stack) const;
+
+  private:
+    // Aliases and helpers
+    using string_id_t = native_resolver::StringStorage::id_t;
+
+    struct ResolvedFrame
+    {
+        string_id_t function_name;
+        string_id_t filename;
+        int lineno;
+
+        bool operator==(const ResolvedFrame& other) const
+        {
+            return function_name == other.function_name && filename == other.filename
+                   && lineno == other.lineno;
+        }
+
+        struct Hash
+        {
+            size_t operator()(const ResolvedFrame& frame) const noexcept
+            {
+                uint64_t hash = frame.function_name;
+                hash = containers::combineHash(hash, frame.filename);
+                hash = containers::combineHash(hash, static_cast<uint32_t>(frame.lineno));
+                return containers::mixHash(hash);
+            }
+        };
+    };
+
+    // Methods
+    void addCapture(size_t index);
+    FrameTree::index_t getStack(
+            RecordReader& reader,
+            size_t frame_index,
+            containers::FlatHashMap<frame_id_t, frame_id_t>& frames,
+            containers::FlatHashMap<size_t, FrameTree::index_t>& stacks);
+
+    // Data members
+    CaptureFamily d_family;
+    native_resolver::StringStorage d_strings;
+    // Indexed by the ids of the frames of the tree, starting at 1.
+    std::vector<ResolvedFrame> d_frames{ResolvedFrame{}};
+    containers::FlatHashMap<ResolvedFrame, frame_id_t, ResolvedFrame::Hash> d_frame_ids{};
+    FrameTree d_tree{};
+    containers::FlatHashMap<FrameTree::index_t, StackDelta> d_high_water_mark{};
+    containers::FlatHashMap<FrameTree::index_t, StackDelta> d_leaks{};
+    mutable python_helpers::PyUnicode_Cache d_pystring_cache{};
+};
+
+}  // namespace memray::api
@@ -0,0 +1,25 @@
+from _memray.capture_family cimport Capture
+from libcpp cimport bool
+from libcpp.string cimport string
+from libcpp.vector cimport vector
+
+
+cdef extern from "capture_diff.h" namespace "memray::api":
+    cdef cppclass StackDelta "memray::api::CaptureDiff::StackDelta":
+        unsigned int stack
+        size_t size_before
+        size_t size_after
+        size_t n_allocations_before
+        size_t n_allocations_after
+
+    cdef cppclass CaptureDiff:
+        CaptureDiff(
+            string before_file_name,
+            string after_file_name,
+            size_t max_workers,
+            string symbol_cache_dir,
+        ) except+
+        void readAll() nogil except+
+        const Capture& capture(size_t index) except+
+        vector[StackDelta] getDeltas(bool high_water_mark) except+
+        object Py_GetStack(unsigned int stack) except+
@@ -0,0 +1,104 @@
+#include <algorithm>
+#include <atomic>
+#include <exception>
+#include <thread>
+
+#include "capture_family.h"
+#include "source.h"
+
+namespace memray::api {
+
+CaptureFamily::CaptureFamily(
+        const std::vector<std::string>& file_names,
+        size_t max_workers,
+        const std::string& symbol_cache_dir)
+: d_max_workers(std::max<size_t>(max_workers, 1))
+{
+    d_captures.reserve(file_names.size());
+    for (const auto& file_name : file_names) {
+        auto reader = std::make_shared<RecordReader>(std::make_unique<io::FileSource>(file_name));
+        reader->configureSymbolResolution(d_max_workers, symbol_cache_dir);
+        d_captures.push_back(Capture{std::move(reader)});
+    }
+}
+
+void
+CaptureFamily::readAll()
+{
+    // Files are handed out one at a time, so that a few large ones don't
+    // keep a worker busy while the others have nothing left to do.
+    std::atomic<size_t> next_capture{0};
+    std::vector<std::exception_ptr> errors(d_captures.size());
+    auto read_captures = [&] {
+        for (size_t i = next_capture++; i < d_captures.size(); i = next_capture++) {
+            try {
+                readCapture(d_captures[i]);
+            } catch (...) {
+                errors[i] = std::current_exception();
+            }
+        }
+    };
+
+    std::vector<std::thread> threads;
+    size_t n_threads = std::min(d_max_workers, d_captures.size());
+    for (size_t i = 1; i < n_threads; ++i) {
+        threads.emplace_back(read_captures);
+    }
+    read_captures();
+    for (auto& thread : threads) {
+        thread.join();
+    }
+
+    for (const auto& error : errors) {
+        if (error) {
+            std::rethrow_exception(error);
+        }
+    }
+}
+
+void
+CaptureFamily::readCapture(Capture& capture)
+{
+    RecordReader& reader = *capture.reader;
+    HighWaterMarkAggregator aggregator;
+    while (const Allocation* allocation = reader.nextAllocation()) {
+        aggregator.addAllocation(*allocation);
+    }
+
+    // Files that the tracker aggregated itself already have the totals of
+    // every location, and nothing else to aggregate.
+    if (reader.getHeader().file_format == FileFormat::FILEFORMAT_AGGREGATED_ALLOCATIONS) {
+        capture.allocations = std::move(reader.aggregatedAllocationRecords());
+    } else {
+        capture.allocations = aggregator.getAggregatedAllocations();
+    }
+
+    capture.high_watermark = getAggregatedHighWatermark(capture.allocations);
+    for (const auto& allocation : capture.allocations) {
+        capture.leaked_memory += allocation.bytes_leaked;
+        capture.n_leaked_allocations += allocation.n_allocations_leaked;
+    }
+}
+
+size_t
+CaptureFamily::size() const noexcept
+{
+    return d_captures.size();
+}
+
+const CaptureFamily::Capture&
+CaptureFamily::capture(size_t index) const
+{
+    return d_captures.at(index);
+}
+
+reduced_snapshot_map_t
+CaptureFamily::getSnapshotAllocations(size_t index, bool high_water_mark, bool merge_threads) const
+{
+    return getAggregatedSnapshotAllocations(
+            capture(index).allocations,
+            high_water_mark,
+            merge_threads);
+}
+
+}  // namespace memray::api
@@ -0,0 +1,69 @@
+#pragma once
+
+#include <cstddef>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "Python.h"
+
+#include "record_reader.h"
+#include "records.h"
+#include "snapshot.h"
+
+namespace memray::api {
+
+/**
+ * The capture files of a process and of the children that it forked, read
+ * all at once.
+ *
+ * A tracker that follows forks leaves a file per process, and each one of
+ * them is read by a thread of its own, up to max_workers at the same time.
+ * The allocations of a file are aggregated by location as they are read,
+ * like a HighWaterMarkAggregator does, so only the live allocations of each
+ * process are ever kept in memory, and never the history of all of them.
+ * What is left of each process is its reader, to resolve the stacks of its
+ * locations, and what each location had at its peak and at its end.
+ *
+ * The processes don't share a clock, so there is no telling which of their
+ * peaks happened at the same time. The combined high water mark is the one
+ * of each process put together, which is as much as the whole family could
+ * have ever had allocated at once.
+ **/
+class CaptureFamily
+{
+  public:
+    struct Capture
+    {
+        std::shared_ptr<RecordReader> reader;
+        std::vector<AggregatedAllocation> allocations;
+        HighWatermark high_watermark;
+        size_t leaked_memory{0};
+        size_t n_leaked_allocations{0};
+    };
+
+    // The readers are created right away, so that a file that can't be
+    // opened is reported before anything is read.
+    CaptureFamily(
+            const std::vector<std::string>& file_names,
+            size_t max_workers,
+            const std::string& symbol_cache_dir);
+
+    // Read every file to its end. This doesn't need the GIL.
+    void readAll();
+
+    size_t size() const noexcept;
+    const Capture& capture(size_t index) const;
+    reduced_snapshot_map_t
+    getSnapshotAllocations(size_t index, bool high_water_mark, bool merge_threads) const;
+
+  private:
+    // Methods
+    void readCapture(Capture& capture);
+
+    // Data members
+    size_t d_max_workers;
+    std::vector<Capture> d_captures;
+};
+
+}  // namespace memray::api
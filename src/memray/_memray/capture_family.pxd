@@ -0,0 +1,28 @@
+from _memray.record_reader cimport RecordReader
+from _memray.snapshot cimport HighWatermark
+from _memray.snapshot cimport reduced_snapshot_map_t
+from libcpp cimport bool
+from libcpp.memory cimport shared_ptr
+from libcpp.string cimport string
+from libcpp.vector cimport vector
+
+
+cdef extern from "capture_family.h" namespace "memray::api":
+    cdef cppclass Capture "memray::api::CaptureFamily::Capture":
+        shared_ptr[RecordReader] reader
+        HighWatermark high_watermark
+        size_t leaked_memory
+        size_t n_leaked_allocations
+
+    cdef cppclass CaptureFamily:
+        CaptureFamily(
+            const vector[string]& file_names,
+            size_t max_workers,
+            string symbol_cache_dir,
+        ) except+
+        void readAll() nogil except+
+        size_t size()
+        const Capture& capture(size_t index) except+
+        reduced_snapshot_map_t getSnapshotAllocations(
+            size_t index, bool high_water_mark, bool merge_threads
+        ) except+
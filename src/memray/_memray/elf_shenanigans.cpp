@@ -1,6 +1,7 @@
 #include <cstring>
 #include <set>
 #include <string>
+#include <vector>
 #include <sys/mman.h>
 #include <unistd.h>
 
@@ -11,19 +12,29 @@
 
 #include <link.h>
 
+namespace memray::elf {
+
+enum class HookedFunction : uint8_t {
+#define FOR_EACH_HOOKED_FUNCTION(hookname) hookname,
+    MEMRAY_HOOKED_FUNCTIONS
+#undef FOR_EACH_HOOKED_FUNCTION
+};
+
 namespace {
 
+using PatchedSlot = SymbolPatcher::PatchedSlot;
+using patched_objects_t = std::map<SymbolPatcher::object_key_t, std::vector<PatchedSlot>>;
+
 /* Private struct to pass data to to phdrs_callback. */
 struct elf_patcher_context_t
 {
     bool restore_original;
-    std::set<std::string> patched;
+    patched_objects_t* patched;
+    std::set<SymbolPatcher::object_key_t> loaded;
 };
 
 }  // namespace
 
-namespace memray::elf {
-
 /* Patching functions */
 
 static inline int
@@ -57,13 +68,31 @@ patch_symbol(
     LOG(DEBUG) << symname << " intercepted!";
 }
 
+static void
+patch_slot(const PatchedSlot& slot, bool restore_original) noexcept
+{
+    switch (slot.function) {
+#define FOR_EACH_HOOKED_FUNCTION(hookname)                                                              \
+    case HookedFunction::hookname:                                                                      \
+        patch_symbol(                                                                                   \
+                hooks::hookname,                                                                        \
+                &intercept::hookname,                                                                   \
+                hooks::hookname.d_symbol,                                                               \
+                slot.address,                                                                           \
+                restore_original);                                                                      \
+        break;
+        MEMRAY_HOOKED_FUNCTIONS
+#undef FOR_EACH_HOOKED_FUNCTION
+    }
+}
+
 template<typename Table>
 static void
-overwrite_elf_table(
+find_elf_table_slots(
         const Table& table,
         const SymbolTable& symbols,
         const Addr base_addr,
-        bool restore_original) noexcept
+        std::vector<PatchedSlot>& slots)
 {
     for (const auto& relocation : table) {
         /* Every element contains relocation entries that look like this:
@@ -84,7 +113,7 @@ overwrite_elf_table(
         auto symbol_addr = relocation.r_offset + base_addr;
 #define FOR_EACH_HOOKED_FUNCTION(hookname)                                                              \
     if (strcmp(hooks::hookname.d_symbol, symname) == 0) {                                               \
-        patch_symbol(hooks::hookname, &intercept::hookname, symname, symbol_addr, restore_original);    \
+        slots.push_back({symbol_addr, HookedFunction::hookname});                                       \
         continue;                                                                                       \
     }
         MEMRAY_HOOKED_FUNCTIONS
@@ -109,10 +138,11 @@ get_jump_table_type(const Dyn* dynamic_section)
     return 0;
 }
 
-static void
-patch_symbols(const Dyn* dyn_info_struct, const Addr base, bool restore_original) noexcept
+static std::vector<PatchedSlot>
+find_slots(const Dyn* dyn_info_struct, const Addr base)
 {
     SymbolTable symbols(base, dyn_info_struct);
+    std::vector<PatchedSlot> slots;
 
     /* There are three collections of symbols we want to override:
      *
@@ -127,44 +157,52 @@ patch_symbols(const Dyn* dyn_info_struct, const Addr base, bool restore_original
      *
      */
 
-    LOG(DEBUG) << "Patching symbols with RELS relocation type";
+    LOG(DEBUG) << "Finding symbols with RELS relocation type";
     RelTable rels_relocations_table(dyn_info_struct);
-    overwrite_elf_table(rels_relocations_table, symbols, base, restore_original);
+    find_elf_table_slots(rels_relocations_table, symbols, base, slots);
 
-    LOG(DEBUG) << "Patching symbols with RELAS relocation type";
+    LOG(DEBUG) << "Finding symbols with RELAS relocation type";
     RelaTable relas_relocations_table(dyn_info_struct);
-    overwrite_elf_table(relas_relocations_table, symbols, base, restore_original);
+    find_elf_table_slots(relas_relocations_table, symbols, base, slots);
 
-    LOG(DEBUG) << "Patching symbols with JMPRELS relocation type";
+    LOG(DEBUG) << "Finding symbols with JMPRELS relocation type";
     switch (get_jump_table_type(dyn_info_struct)) {
         case DT_REL: {
             JmpRelTable jmp_relocations_table(dyn_info_struct);
-            overwrite_elf_table(jmp_relocations_table, symbols, base, restore_original);
+            find_elf_table_slots(jmp_relocations_table, symbols, base, slots);
         } break;
         case DT_RELA: {
             JmpRelaTable jmp_relocations_table(dyn_info_struct);
-            overwrite_elf_table(jmp_relocations_table, symbols, base, restore_original);
+            find_elf_table_slots(jmp_relocations_table, symbols, base, slots);
         } break;
         default: {
             LOG(DEBUG) << "Unknown JMPRELS relocation table type";
         } break;
     }
+    return slots;
 }
 
-static int
-phdrs_callback(dl_phdr_info* info, [[maybe_unused]] size_t size, void* data) noexcept
+static std::vector<PatchedSlot>
+find_object_slots(const dl_phdr_info* info)
 {
-    elf_patcher_context_t context = *reinterpret_cast<elf_patcher_context_t*>(data);
-    std::set<std::string> patched = context.patched;
-
-    if (context.restore_original) {
-        patched.clear();
-    } else {
-        if (patched.find(info->dlpi_name) != patched.end()) {
-            return 0;
+    std::vector<PatchedSlot> slots;
+    for (auto phdr = info->dlpi_phdr, end = phdr + info->dlpi_phnum; phdr != end; ++phdr) {
+        // The information of all the symbols that we want to overwrite are in the PT_DYNAMIC program
+        // header, that contains the dynamic linking information.
+        if (phdr->p_type != PT_DYNAMIC) {
+            continue;
         }
-        patched.insert(info->dlpi_name);
+        const auto* dyn_info_struct = reinterpret_cast<const Dyn*>(phdr->p_vaddr + info->dlpi_addr);
+        auto dynamic_slots = find_slots(dyn_info_struct, info->dlpi_addr);
+        slots.insert(slots.end(), dynamic_slots.begin(), dynamic_slots.end());
     }
+    return slots;
+}
+
+static int
+phdrs_callback(dl_phdr_info* info, [[maybe_unused]] size_t size, void* data) noexcept
+{
+    auto& context = *reinterpret_cast<elf_patcher_context_t*>(data);
 
     if (strstr(info->dlpi_name, "/ld-linux") || strstr(info->dlpi_name, "linux-vdso.so.1")) {
         // Avoid chaos by not overwriting the symbols in the linker.
@@ -172,16 +210,27 @@ phdrs_callback(dl_phdr_info* info, [[maybe_unused]] size_t size, void* data) noe
         return 0;
     }
 
-    LOG(INFO) << "Patching symbols for " << info->dlpi_name;
-
-    for (auto phdr = info->dlpi_phdr, end = phdr + info->dlpi_phnum; phdr != end; ++phdr) {
-        // The information of all the symbols that we want to overwrite are in the PT_DYNAMIC program
-        // header, that contains the dynamic linking information.
-        if (phdr->p_type != PT_DYNAMIC) {
-            continue;
+    SymbolPatcher::object_key_t key{info->dlpi_addr, info->dlpi_name};
+    context.loaded.insert(key);
+    auto it = context.patched->find(key);
+    if (it != context.patched->end()) {
+        if (context.restore_original) {
+            for (const auto& slot : it->second) {
+                patch_slot(slot, true);
+            }
         }
-        const auto* dyn_info_struct = reinterpret_cast<const Dyn*>(phdr->p_vaddr + info->dlpi_addr);
-        patch_symbols(dyn_info_struct, info->dlpi_addr, context.restore_original);
+        return 0;
+    }
+
+    // An object that isn't in the index yet has its relocations resolved
+    // now. When restoring, that covers objects loaded behind our back too.
+    LOG(INFO) << "Patching symbols for " << info->dlpi_name;
+    auto slots = find_object_slots(info);
+    for (const auto& slot : slots) {
+        patch_slot(slot, context.restore_original);
+    }
+    if (!context.restore_original) {
+        context.patched->emplace(std::move(key), std::move(slots));
     }
     return 0;
 }
@@ -191,15 +240,50 @@ phdrs_callback(dl_phdr_info* info, [[maybe_unused]] size_t size, void* data) noe
 void
 SymbolPatcher::overwrite_symbols() noexcept
 {
-    elf_patcher_context_t context{false, symbols};
+    std::lock_guard<std::mutex> lock(d_mutex);
+    elf_patcher_context_t context{false, &d_patched_objects, {}};
     dl_iterate_phdr(&phdrs_callback, (void*)&context);
+
+    // Forget about the objects that were unloaded, so that another object
+    // loaded with the same name at the same address is patched again.
+    for (auto it = d_patched_objects.begin(); it != d_patched_objects.end();) {
+        if (context.loaded.find(it->first) == context.loaded.end()) {
+            it = d_patched_objects.erase(it);
+        } else {
+            ++it;
+        }
+    }
 }
 
 void
 SymbolPatcher::restore_symbols() noexcept
 {
-    elf_patcher_context_t context{true, symbols};
+    std::lock_guard<std::mutex> lock(d_mutex);
+    elf_patcher_context_t context{true, &d_patched_objects, {}};
     dl_iterate_phdr(&phdrs_callback, (void*)&context);
+    d_patched_objects.clear();
+}
+
+void
+SymbolPatcher::lockForFork() noexcept
+{
+    d_mutex.lock();
+}
+
+void
+SymbolPatcher::unlockAfterFork() noexcept
+{
+    d_mutex.unlock();
+}
+
+void
+SymbolPatcher::inheritPatchedObjects(SymbolPatcher& parent) noexcept
+{
+    // The parent's mutex is held by lockForFork(), by the thread that became
+    // the child's only thread.
+    std::lock_guard<std::mutex> lock(d_mutex);
+    d_patched_objects = std::move(parent.d_patched_objects);
+    parent.d_patched_objects.clear();
 }
 
 }  // namespace memray::elf
@@ -1,17 +1,50 @@
 #pragma once
 
-#include <set>
+#include <cstdint>
+#include <map>
+#include <mutex>
 #include <string>
+#include <utility>
+#include <vector>
 
 namespace memray::elf {
 
+// One of the functions in MEMRAY_HOOKED_FUNCTIONS.
+enum class HookedFunction : uint8_t;
+
+/**
+ * Overwrites the relocations of the hooked functions in every loaded object.
+ *
+ * The relocations of an object are resolved once, when it's first seen, into
+ * the addresses of the slots that must be overwritten, and objects that were
+ * already patched are skipped when the symbols are overwritten again after a
+ * dlopen. The same slots are used to restore the original symbols.
+ **/
 class SymbolPatcher
 {
-  private:
-    std::set<std::string> symbols;
-
   public:
+    struct PatchedSlot
+    {
+        uintptr_t address;
+        HookedFunction function;
+    };
+
+    // Objects are told apart by their load address and their name.
+    using object_key_t = std::pair<uintptr_t, std::string>;
+
     void overwrite_symbols() noexcept;
     void restore_symbols() noexcept;
+
+    // Around a fork, no other thread may be patching while the child takes
+    // over the objects that the parent already patched: their slots still
+    // hold our hooks in the child's copy of the address space, so the child
+    // only needs to patch whatever the parent hadn't seen yet.
+    void lockForFork() noexcept;
+    void unlockAfterFork() noexcept;
+    void inheritPatchedObjects(SymbolPatcher& parent) noexcept;
+
+  private:
+    std::mutex d_mutex;
+    std::map<object_key_t, std::vector<PatchedSlot>> d_patched_objects;
 };
 }  // namespace memray::elf
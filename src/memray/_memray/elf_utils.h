@@ -1,9 +1,11 @@
 #pragma once
 
+#include <algorithm>
 #include <cstdint>
 #include <cstring>
 #include <iostream>
 #include <string>
+#include <string_view>
 #include <sys/mman.h>
 #include <unistd.h>
 
@@ -254,3 +256,52 @@ struct SymbolTable
         return 0;
     }
 };
+
+// The GNU build id in the notes of a PT_NOTE segment, as a hex string, or an
+// empty string if they don't have one. The notes are aligned to 8 bytes in
+// the segments that say so, and to 4 bytes otherwise.
+inline std::string
+findGnuBuildId(const char* notes, size_t size, size_t alignment)
+{
+    const size_t padding = alignment == 8 ? 7 : 3;
+    size_t offset = 0;
+    while (offset + sizeof(ElfW(Nhdr)) <= size) {
+        const auto* note = reinterpret_cast<const ElfW(Nhdr)*>(notes + offset);
+        const size_t name_offset = offset + sizeof(ElfW(Nhdr));
+        const size_t desc_offset = name_offset + ((note->n_namesz + padding) & ~padding);
+        const size_t next_offset = desc_offset + ((note->n_descsz + padding) & ~padding);
+        if (next_offset > size) {
+            break;
+        }
+        if (note->n_type == NT_GNU_BUILD_ID && note->n_namesz == 4
+            && memcmp(notes + name_offset, "GNU", 4) == 0)
+        {
+            static const char hex_digits[] = "0123456789abcdef";
+            std::string build_id;
+            build_id.reserve(2 * note->n_descsz);
+            for (size_t i = 0; i < note->n_descsz; ++i) {
+                auto byte = static_cast<unsigned char>(notes[desc_offset + i]);
+                build_id += hex_digits[byte >> 4U];
+                build_id += hex_digits[byte & 0xFU];
+            }
+            return build_id;
+        }
+        offset = next_offset;
+    }
+    return {};
+}
+
+// Whether build_id looks like what findGnuBuildId returns: the lowercase hex
+// of at most 64 bytes. Build ids read from a capture are used in the paths of
+// the symbol cache, so anything else is treated as if there were none.
+inline bool
+isValidBuildId(std::string_view build_id)
+{
+    constexpr size_t MAX_BUILD_ID_SIZE = 64;
+    if (build_id.empty() || build_id.size() % 2 || build_id.size() > 2 * MAX_BUILD_ID_SIZE) {
+        return false;
+    }
+    return std::all_of(build_id.begin(), build_id.end(), [](char c) {
+        return (c >= '0' && c <= '9') || (c >= 'a' && c <= 'f');
+    });
+}
@@ -0,0 +1,114 @@
+#include "flamegraph.h"
+
+namespace memray::api {
+
+void
+FlameGraph::addStack(
+        const std::vector<key_t>& frames,
+        key_t thread,
+        size_t size,
+        size_t n_allocations,
+        bool too_deep)
+{
+    uint32_t current = 0;
+    d_nodes[current].value += size;
+    d_nodes[current].n_allocations += n_allocations;
+
+    for (key_t frame : frames) {
+        auto [it, inserted] = d_children.try_emplace(ChildKey{current, frame, thread}, d_nodes.size());
+        uint32_t child = it->second;
+        if (inserted) {
+            d_nodes.push_back(Node{frame, thread});
+            d_nodes[current].children.push_back(child);
+        }
+        current = child;
+        d_nodes[current].value += size;
+        d_nodes[current].n_allocations += n_allocations;
+    }
+
+    if (too_deep && current != 0) {
+        Node& node = d_nodes[current];
+        node.too_deep = true;
+        // The nodes below are left behind, and the next stack going through
+        // this one starts over with new nodes for its children.
+        for (uint32_t child : node.children) {
+            d_children.erase(ChildKey{current, d_nodes[child].frame, thread});
+        }
+        node.children.clear();
+    }
+}
+
+std::string
+FlameGraph::toJson(
+        const std::string& root_properties,
+        const std::vector<std::string>& frame_properties,
+        const std::vector<bool>& frame_is_interesting,
+        const std::vector<std::string>& thread_properties,
+        const std::string& too_deep_properties) const
+{
+    std::string out;
+    out.reserve(d_nodes.size() * 128);
+    out += "{";
+    out += root_properties;
+    out += ", \"value\": ";
+    out += std::to_string(d_nodes[0].value);
+    out += ", \"n_allocations\": ";
+    out += std::to_string(d_nodes[0].n_allocations);
+    out += ", \"children\": [";
+    bool first = true;
+    for (uint32_t child : d_nodes[0].children) {
+        if (!first) {
+            out += ", ";
+        }
+        first = false;
+        writeNode(
+                out,
+                child,
+                frame_properties,
+                frame_is_interesting,
+                thread_properties,
+                too_deep_properties);
+    }
+    out += "]}";
+    return out;
+}
+
+void
+FlameGraph::writeNode(
+        std::string& out,
+        uint32_t index,
+        const std::vector<std::string>& frame_properties,
+        const std::vector<bool>& frame_is_interesting,
+        const std::vector<std::string>& thread_properties,
+        const std::string& too_deep_properties) const
+{
+    const Node& node = d_nodes[index];
+    out += "{";
+    out += node.too_deep ? too_deep_properties : frame_properties[node.frame];
+    out += ", \"interesting\": ";
+    out += frame_is_interesting[node.frame] ? "true" : "false";
+    out += ", \"thread_id\": ";
+    out += thread_properties[node.thread];
+    out += ", \"value\": ";
+    out += std::to_string(node.value);
+    out += ", \"n_allocations\": ";
+    out += std::to_string(node.n_allocations);
+    out += ", \"children\": [";
+    bool first = true;
+    for (uint32_t child : node.children) {
+        if (!first) {
+            out += ", ";
+        }
+        first = false;
+        writeNode(
+                out,
+                child,
+                frame_properties,
+                frame_is_interesting,
+                thread_properties,
+                too_deep_properties);
+    }
+    out += "]}";
+}
+
+}  // namespace memray::api
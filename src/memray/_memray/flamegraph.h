@@ -0,0 +1,95 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "flat_hash_map.h"
+
+namespace memray::api {
+
+/**
+ * The tree of a flame graph, built out of the stacks of a snapshot.
+ *
+ * Stacks are added from their outermost frame in, and each frame is looked
+ * up among the children of the node of the frame before it, so stacks that
+ * share a prefix share their nodes. Frames and threads are only known by
+ * the keys that the caller gives them, and the caller also provides the
+ * JSON properties that describe each of them when the tree is written out.
+ **/
+class FlameGraph
+{
+  public:
+    using key_t = uint32_t;
+
+    // Add the memory of one snapshot location to every node of its stack.
+    // If the stack is too deep to be shown, its last node stands for the
+    // rest of it and loses any children that it had.
+    void addStack(
+            const std::vector<key_t>& frames,
+            key_t thread,
+            size_t size,
+            size_t n_allocations,
+            bool too_deep);
+
+    // Write the tree as the JSON object that the flame graph template
+    // expects. The properties are JSON fragments that go into the objects of
+    // the nodes: the root's, each frame's name and location, each thread's
+    // id, and the name and location of the nodes of stacks that are too deep.
+    std::string toJson(
+            const std::string& root_properties,
+            const std::vector<std::string>& frame_properties,
+            const std::vector<bool>& frame_is_interesting,
+            const std::vector<std::string>& thread_properties,
+            const std::string& too_deep_properties) const;
+
+  private:
+    struct Node
+    {
+        key_t frame;
+        key_t thread;
+        bool too_deep{false};
+        size_t value{0};
+        size_t n_allocations{0};
+        std::vector<uint32_t> children{};
+    };
+
+    struct ChildKey
+    {
+        uint32_t parent;
+        key_t frame;
+        key_t thread;
+
+        bool operator==(const ChildKey& other) const
+        {
+            return parent == other.parent && frame == other.frame && thread == other.thread;
+        }
+
+        struct Hash
+        {
+            size_t operator()(const ChildKey& key) const noexcept
+            {
+                uint64_t hash = key.parent;
+                hash = containers::combineHash(hash, key.frame);
+                hash = containers::combineHash(hash, key.thread);
+                return containers::mixHash(hash);
+            }
+        };
+    };
+
+    // Methods
+    void writeNode(
+            std::string& out,
+            uint32_t index,
+            const std::vector<std::string>& frame_properties,
+            const std::vector<bool>& frame_is_interesting,
+            const std::vector<std::string>& thread_properties,
+            const std::string& too_deep_properties) const;
+
+    // Data members
+    std::vector<Node> d_nodes{Node{0, 0}};
+    containers::FlatHashMap<ChildKey, uint32_t, ChildKey::Hash> d_children{};
+};
+
+}  // namespace memray::api
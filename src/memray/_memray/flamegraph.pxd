@@ -0,0 +1,21 @@
+from libcpp cimport bool
+from libcpp.string cimport string
+from libcpp.vector cimport vector
+
+
+cdef extern from "flamegraph.h" namespace "memray::api":
+    cdef cppclass FlameGraph:
+        void addStack(
+            const vector[unsigned int]& frames,
+            unsigned int thread,
+            size_t size,
+            size_t n_allocations,
+            bool too_deep
+        ) except+
+        string toJson(
+            const string& root_properties,
+            const vector[string]& frame_properties,
+            const vector[bool]& frame_is_interesting,
+            const vector[string]& thread_properties,
+            const string& too_deep_properties
+        ) except+
@@ -0,0 +1,422 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <stdexcept>
+#include <tuple>
+#include <utility>
+#include <vector>
+
+namespace memray::containers {
+
+// Finalizer of MurmurHash3: spreads every input bit over the whole output.
+inline uint64_t
+mixHash(uint64_t value)
+{
+    value ^= value >> 33U;
+    value *= 0xFF51AFD7ED558CCDULL;
+    value ^= value >> 33U;
+    value *= 0xC4CEB33FA4B2B5A3ULL;
+    value ^= value >> 33U;
+    return value;
+}
+
+// Combine the hash of one more field into the hash of the previous ones.
+// Unlike XOR, the result depends on the order of the fields. This is cheap
+// but doesn't mix much, so pass the final result through mixHash().
+inline uint64_t
+combineHash(uint64_t seed, uint64_t value)
+{
+    return seed ^ (value + 0x9E3779B97F4A7C15ULL + (seed << 6U) + (seed >> 2U));
+}
+
+/**
+ * Hash map storing its entries in a single flat array, using open addressing.
+ *
+ * The layout follows the one of SwissTable: besides the array of entries
+ * there is an array with one control byte per slot, telling whether the slot
+ * is empty, deleted, or full, and in the latter case holding 7 bits of the
+ * hash of its key. Slots are probed in groups of 8 and the control bytes of
+ * a group are checked all at once as a single 64-bit word, so a lookup
+ * usually compares one key and touches two cache lines, instead of chasing
+ * a pointer to a separately allocated node per entry like std::unordered_map
+ * does. The position of an entry is derived from a Fibonacci scrambling of
+ * its hash, so identity hashes of aligned pointers or even integers still
+ * spread over the whole table.
+ *
+ * The interface is the subset of std::unordered_map that we need. Note that,
+ * unlike with std::unordered_map, any insertion invalidates all iterators and
+ * references to the entries.
+ **/
+template<typename Key, typename Value, typename Hash = std::hash<Key>, typename KeyEqual = std::equal_to<Key>>
+class FlatHashMap
+{
+  private:
+    using ctrl_t = uint8_t;
+    static constexpr ctrl_t EMPTY = 0x80;
+    static constexpr ctrl_t DELETED = 0xFE;
+    static constexpr size_t GROUP_SIZE = 8;
+    static constexpr size_t MIN_CAPACITY = 16;
+
+    template<typename MapType, typename EntryType>
+    class Iterator
+    {
+      public:
+        Iterator(MapType* map, size_t index)
+        : d_map(map)
+        , d_index(index)
+        {
+            skipFreeSlots();
+        }
+
+        EntryType& operator*() const
+        {
+            return d_map->d_slots[d_index];
+        }
+
+        EntryType* operator->() const
+        {
+            return &d_map->d_slots[d_index];
+        }
+
+        Iterator& operator++()
+        {
+            ++d_index;
+            skipFreeSlots();
+            return *this;
+        }
+
+        bool operator==(const Iterator& other) const
+        {
+            return d_index == other.d_index;
+        }
+
+        bool operator!=(const Iterator& other) const
+        {
+            return d_index != other.d_index;
+        }
+
+      private:
+        friend class FlatHashMap;
+
+        void skipFreeSlots()
+        {
+            while (d_index < d_map->d_ctrl.size() && !isFull(d_map->d_ctrl[d_index])) {
+                ++d_index;
+            }
+        }
+
+        MapType* d_map;
+        size_t d_index;
+    };
+
+  public:
+    using key_type = Key;
+    using mapped_type = Value;
+    using value_type = std::pair<Key, Value>;
+    using iterator = Iterator<FlatHashMap, value_type>;
+    using const_iterator = Iterator<const FlatHashMap, const value_type>;
+
+    iterator begin()
+    {
+        return iterator(this, 0);
+    }
+
+    iterator end()
+    {
+        return iterator(this, d_ctrl.size());
+    }
+
+    const_iterator begin() const
+    {
+        return const_iterator(this, 0);
+    }
+
+    const_iterator end() const
+    {
+        return const_iterator(this, d_ctrl.size());
+    }
+
+    size_t size() const
+    {
+        return d_size;
+    }
+
+    bool empty() const
+    {
+        return d_size == 0;
+    }
+
+    void clear()
+    {
+        d_ctrl.clear();
+        d_slots.clear();
+        d_size = 0;
+        d_growth_left = 0;
+        d_shift = 64;
+    }
+
+    void reserve(size_t count)
+    {
+        size_t capacity = MIN_CAPACITY;
+        while (maxLoad(capacity) < count) {
+            capacity *= 2;
+        }
+        if (capacity > d_ctrl.size()) {
+            rehash(capacity);
+        }
+    }
+
+    iterator find(const Key& key)
+    {
+        return iterator(this, findIndex(key));
+    }
+
+    const_iterator find(const Key& key) const
+    {
+        return const_iterator(this, findIndex(key));
+    }
+
+    size_t count(const Key& key) const
+    {
+        return findIndex(key) != d_ctrl.size() ? 1 : 0;
+    }
+
+    Value& at(const Key& key)
+    {
+        size_t index = findIndex(key);
+        if (index == d_ctrl.size()) {
+            throw std::out_of_range("FlatHashMap::at");
+        }
+        return d_slots[index].second;
+    }
+
+    const Value& at(const Key& key) const
+    {
+        return const_cast<FlatHashMap*>(this)->at(key);
+    }
+
+    Value& operator[](const Key& key)
+    {
+        return try_emplace(key).first->second;
+    }
+
+    template<typename K, typename... Args>
+    std::pair<iterator, bool> try_emplace(K&& key, Args&&... args)
+    {
+        size_t index = findIndex(key);
+        if (index != d_ctrl.size()) {
+            return {iterator(this, index), false};
+        }
+        index = prepareInsert(key);
+        d_slots[index] = value_type(
+                std::piecewise_construct,
+                std::forward_as_tuple(std::forward<K>(key)),
+                std::forward_as_tuple(std::forward<Args>(args)...));
+        return {iterator(this, index), true};
+    }
+
+    template<typename K, typename V>
+    std::pair<iterator, bool> emplace(K&& key, V&& value)
+    {
+        return try_emplace(std::forward<K>(key), std::forward<V>(value));
+    }
+
+    std::pair<iterator, bool> insert(const value_type& entry)
+    {
+        return try_emplace(entry.first, entry.second);
+    }
+
+    std::pair<iterator, bool> insert(value_type&& entry)
+    {
+        return try_emplace(std::move(entry.first), std::move(entry.second));
+    }
+
+    size_t erase(const Key& key)
+    {
+        size_t index = findIndex(key);
+        if (index == d_ctrl.size()) {
+            return 0;
+        }
+        eraseIndex(index);
+        return 1;
+    }
+
+    void erase(iterator it)
+    {
+        eraseIndex(it.d_index);
+    }
+
+  private:
+    static bool isFull(ctrl_t ctrl)
+    {
+        return (ctrl & 0x80U) == 0;
+    }
+
+    static size_t maxLoad(size_t capacity)
+    {
+        return capacity - capacity / 8;
+    }
+
+    // Helpers operating on the control bytes of a whole group at once. The
+    // result has the high bit of the byte of every matching slot set.
+    static uint64_t loadGroup(const ctrl_t* ctrl)
+    {
+        uint64_t group;
+        std::memcpy(&group, ctrl, sizeof(group));
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+        group = __builtin_bswap64(group);
+#endif
+        return group;
+    }
+
+    static uint64_t matchFragment(uint64_t group, ctrl_t fragment)
+    {
+        constexpr uint64_t lsbs = 0x0101010101010101ULL;
+        uint64_t x = group ^ (lsbs * fragment);
+        // This may report a false positive in the byte after a true match,
+        // which is fine as the key of every candidate is compared anyway.
+        return (x - lsbs) & ~x & (lsbs << 7U);
+    }
+
+    static uint64_t matchEmpty(uint64_t group)
+    {
+        return group & ~(group << 6U) & 0x8080808080808080ULL;
+    }
+
+    static uint64_t matchFree(uint64_t group)
+    {
+        return group & ~(group << 7U) & 0x8080808080808080ULL;
+    }
+
+    static size_t firstMatch(uint64_t matches)
+    {
+        return static_cast<size_t>(__builtin_ctzll(matches)) / 8;
+    }
+
+    uint64_t scrambledHash(const Key& key) const
+    {
+        return static_cast<uint64_t>(d_hash(key)) * 0x9E3779B97F4A7C15ULL;
+    }
+
+    size_t firstGroup(uint64_t hash) const
+    {
+        return static_cast<size_t>(hash >> d_shift) & ~(GROUP_SIZE - 1);
+    }
+
+    ctrl_t fragment(uint64_t hash) const
+    {
+        return static_cast<ctrl_t>((hash >> (d_shift - 7U)) & 0x7FU);
+    }
+
+    size_t findIndex(const Key& key) const
+    {
+        if (d_size == 0) {
+            return d_ctrl.size();
+        }
+        uint64_t hash = scrambledHash(key);
+        ctrl_t frag = fragment(hash);
+        size_t mask = d_ctrl.size() - 1;
+        size_t base = firstGroup(hash);
+        for (size_t step = GROUP_SIZE;; step += GROUP_SIZE) {
+            uint64_t group = loadGroup(&d_ctrl[base]);
+            for (uint64_t matches = matchFragment(group, frag); matches; matches &= matches - 1) {
+                size_t index = base + firstMatch(matches);
+                if (d_equal(d_slots[index].first, key)) {
+                    return index;
+                }
+            }
+            if (matchEmpty(group)) {
+                return d_ctrl.size();
+            }
+            // Triangular probing over the groups visits each of them once.
+            base = (base + step) & mask;
+        }
+    }
+
+    size_t findFreeIndex(uint64_t hash) const
+    {
+        size_t mask = d_ctrl.size() - 1;
+        size_t base = firstGroup(hash);
+        for (size_t step = GROUP_SIZE;; step += GROUP_SIZE) {
+            uint64_t matches = matchFree(loadGroup(&d_ctrl[base]));
+            if (matches) {
+                return base + firstMatch(matches);
+            }
+            base = (base + step) & mask;
+        }
+    }
+
+    size_t prepareInsert(const Key& key)
+    {
+        uint64_t hash = scrambledHash(key);
+        size_t index = d_ctrl.empty() ? 0 : findFreeIndex(hash);
+        if (d_ctrl.empty() || (d_growth_left == 0 && d_ctrl[index] == EMPTY)) {
+            // Grow, unless most of the used up slots are just tombstones that
+            // rebuilding the table at the same size would get rid of.
+            size_t capacity = d_ctrl.size();
+            if (capacity == 0) {
+                capacity = MIN_CAPACITY;
+            } else if (d_size * 2 >= maxLoad(capacity)) {
+                capacity *= 2;
+            }
+            rehash(capacity);
+            hash = scrambledHash(key);
+            index = findFreeIndex(hash);
+        }
+        if (d_ctrl[index] == EMPTY) {
+            --d_growth_left;
+        }
+        d_ctrl[index] = fragment(hash);
+        ++d_size;
+        return index;
+    }
+
+    void eraseIndex(size_t index)
+    {
+        // If the group still has an empty slot, every probe sequence going
+        // through it already stops here, so no tombstone is needed.
+        size_t base = index & ~(GROUP_SIZE - 1);
+        if (matchEmpty(loadGroup(&d_ctrl[base]))) {
+            d_ctrl[index] = EMPTY;
+            ++d_growth_left;
+        } else {
+            d_ctrl[index] = DELETED;
+        }
+        d_slots[index] = value_type{};
+        --d_size;
+    }
+
+    void rehash(size_t capacity)
+    {
+        std::vector<ctrl_t> old_ctrl(capacity, EMPTY);
+        std::vector<value_type> old_slots(capacity);
+        old_ctrl.swap(d_ctrl);
+        old_slots.swap(d_slots);
+        d_shift = 64;
+        for (size_t bits = capacity; bits > 1; bits >>= 1) {
+            --d_shift;
+        }
+        d_growth_left = maxLoad(capacity) - d_size;
+        for (size_t i = 0; i < old_ctrl.size(); ++i) {
+            if (isFull(old_ctrl[i])) {
+                uint64_t hash = scrambledHash(old_slots[i].first);
+                size_t index = findFreeIndex(hash);
+                d_ctrl[index] = fragment(hash);
+                d_slots[index] = std::move(old_slots[i]);
+            }
+        }
+    }
+
+    std::vector<ctrl_t> d_ctrl{};
+    std::vector<value_type> d_slots{};
+    size_t d_size{0};
+    size_t d_growth_left{0};
+    unsigned int d_shift{64};
+    Hash d_hash{};
+    KeyEqual d_equal{};
+};
+
+}  // namespace memray::containers
@@ -1,21 +1,66 @@
 #pragma once
+#include <cassert>
+#include <functional>
 #include <iostream>
+#include <limits>
 #include <mutex>
+#include <shared_mutex>
 #include <vector>
 
+#include "flat_hash_map.h"
 #include "records.h"
 
 namespace memray::tracking_api {
-class FrameTree
+
+/**
+ * Tree of the stacks seen so far, where every node is a frame whose parent is
+ * the frame that called it, so that a stack is known by the index of its
+ * innermost node.
+ *
+ * The nodes are kept in flat arrays indexed by the node's index, instead of
+ * each node owning a vector of its children. The children of a node are
+ * linked in a list through those arrays, which is the fastest to search for
+ * the few children that most nodes have, and those of the nodes that get
+ * more children are also put in a hash map keyed by the parent and the frame.
+ * The index type is a parameter so that trees that may outgrow 32 bit indexes
+ * can use wider ones. Once an index type runs out, no more nodes are added
+ * and looking up a new stack fails.
+ **/
+template<typename Index>
+class BasicFrameTree
 {
   public:
-    using index_t = uint32_t;
+    using index_t = Index;
+
+    // The last trace looked up by a thread, ordered from its outermost frame,
+    // together with the index of each of its prefixes. Consecutive traces of
+    // the same thread tend to share most of their frames, and those don't need
+    // to be looked up in the tree again.
+    struct TraceCache
+    {
+        std::vector<frame_id_t> frames;
+        std::vector<index_t> indexes;
+
+        void clear()
+        {
+            frames.clear();
+            indexes.clear();
+        }
+    };
 
     inline std::pair<frame_id_t, index_t> nextNode(index_t index) const
     {
-        std::lock_guard<std::mutex> lock(d_mutex);
-        assert(1 <= index && index <= d_graph.size());
-        return std::make_pair(d_graph[index].frame_id, d_graph[index].parent_index);
+        std::shared_lock<std::shared_mutex> lock(d_mutex);
+        assert(1 <= index && index <= d_frame_ids.size());
+        return std::make_pair(d_frame_ids[index], d_parents[index]);
+    }
+
+    // The number of nodes, counting the root. They are numbered from 0 in
+    // the order in which they were created, so a parent comes before its children.
+    inline index_t size() const
+    {
+        std::shared_lock<std::shared_mutex> lock(d_mutex);
+        return d_frame_ids.size();
     }
 
     using tracecallback_t = std::function<bool(frame_id_t, index_t)>;
@@ -23,54 +68,155 @@ class FrameTree
     template<typename T>
     size_t getTraceIndex(const T& stack_trace, const tracecallback_t& callback)
     {
-        std::lock_guard<std::mutex> lock(d_mutex);
+        std::unique_lock<std::shared_mutex> lock(d_mutex);
         index_t index = 0;
         for (const auto& frame : stack_trace) {
             index = getTraceIndexUnsafe(index, frame, callback);
+            if (!index) {
+                return 0;
+            }
+        }
+        return index;
+    }
+
+    template<typename T>
+    size_t getTraceIndex(const T& stack_trace, const tracecallback_t& callback, TraceCache& cache)
+    {
+        auto it = stack_trace.begin();
+        auto end = stack_trace.end();
+        size_t common = 0;
+        while (common < cache.frames.size() && it != end && *it == cache.frames[common]) {
+            ++common;
+            ++it;
+        }
+        cache.frames.resize(common);
+        cache.indexes.resize(common);
+        index_t index = common ? cache.indexes.back() : 0;
+        if (it == end) {
+            return index;
+        }
+
+        // Most of the time the rest of the trace is already in the tree, and
+        // many threads can look it up at the same time. Only inserting new
+        // nodes needs exclusive access.
+        {
+            std::shared_lock<std::shared_mutex> lock(d_mutex);
+            for (; it != end; ++it) {
+                index_t child_index = findChildUnsafe(index, *it);
+                if (!child_index) {
+                    break;
+                }
+                index = child_index;
+                cache.frames.push_back(*it);
+                cache.indexes.push_back(index);
+            }
+        }
+        if (it != end) {
+            std::unique_lock<std::shared_mutex> lock(d_mutex);
+            for (; it != end; ++it) {
+                index = getTraceIndexUnsafe(index, *it, callback);
+                if (!index) {
+                    cache.clear();
+                    return 0;
+                }
+                cache.frames.push_back(*it);
+                cache.indexes.push_back(index);
+            }
         }
         return index;
     }
 
     size_t getTraceIndex(index_t parent_index, frame_id_t frame)
     {
-        std::lock_guard<std::mutex> lock(d_mutex);
+        std::unique_lock<std::shared_mutex> lock(d_mutex);
         return getTraceIndexUnsafe(parent_index, frame, tracecallback_t());
     }
 
   private:
-    size_t getTraceIndexUnsafe(index_t parent_index, frame_id_t frame, const tracecallback_t& callback)
-    {
-        Node& parent = d_graph[parent_index];
-        auto it = std::lower_bound(parent.children.begin(), parent.children.end(), frame);
-        if (it == parent.children.end() || it->frame_id != frame) {
-            index_t new_index = d_graph.size();
-            it = parent.children.insert(it, {frame, new_index});
-            if (callback && !callback(frame, parent_index)) {
-                return 0;
-            }
-            d_graph.push_back({frame, parent_index});
-        }
-        return it->child_index;
-    }
+    // Nodes with more children than this find them through the hash map.
+    // Their count stops right above it.
+    static constexpr uint8_t MAX_LISTED_CHILDREN = 8;
 
-    struct DescendentEdge
+    struct ChildKey
     {
-        frame_id_t frame_id;
-        index_t child_index;
+        index_t parent;
+        frame_id_t frame;
 
-        bool operator<(frame_id_t frame_id)
+        bool operator==(const ChildKey& other) const
         {
-            return this->frame_id < frame_id;
+            return parent == other.parent && frame == other.frame;
         }
+
+        struct Hash
+        {
+            size_t operator()(const ChildKey& key) const noexcept
+            {
+                uint64_t hash = key.parent;
+                hash = containers::combineHash(hash, key.frame);
+                return containers::mixHash(hash);
+            }
+        };
     };
 
-    struct Node
+    index_t findChildUnsafe(index_t parent_index, frame_id_t frame) const
     {
-        frame_id_t frame_id;
-        index_t parent_index;
-        std::vector<DescendentEdge> children;
-    };
-    mutable std::mutex d_mutex;
-    std::vector<Node> d_graph{{0, 0, {}}};
+        if (d_n_children[parent_index] > MAX_LISTED_CHILDREN) {
+            auto it = d_children.find({parent_index, frame});
+            return it != d_children.end() ? it->second : 0;
+        }
+        for (index_t child = d_first_child[parent_index]; child; child = d_next_sibling[child]) {
+            if (d_frame_ids[child] == frame) {
+                return child;
+            }
+        }
+        return 0;
+    }
+
+    index_t getTraceIndexUnsafe(index_t parent_index, frame_id_t frame, const tracecallback_t& callback)
+    {
+        index_t child_index = findChildUnsafe(parent_index, frame);
+        if (child_index) {
+            return child_index;
+        }
+        if (d_frame_ids.size() >= std::numeric_limits<index_t>::max()) {
+            return 0;
+        }
+        if (callback && !callback(frame, parent_index)) {
+            return 0;
+        }
+        child_index = d_frame_ids.size();
+        d_frame_ids.push_back(frame);
+        d_parents.push_back(parent_index);
+        d_first_child.push_back(0);
+        d_next_sibling.push_back(d_first_child[parent_index]);
+        d_n_children.push_back(0);
+        d_first_child[parent_index] = child_index;
+        uint8_t& n_children = d_n_children[parent_index];
+        if (n_children < MAX_LISTED_CHILDREN) {
+            ++n_children;
+        } else if (n_children == MAX_LISTED_CHILDREN) {
+            ++n_children;
+            for (index_t child = child_index; child; child = d_next_sibling[child]) {
+                d_children.emplace(ChildKey{parent_index, d_frame_ids[child]}, child);
+            }
+        } else {
+            d_children.emplace(ChildKey{parent_index, frame}, child_index);
+        }
+        return child_index;
+    }
+
+    mutable std::shared_mutex d_mutex;
+    // Indexed by node, starting with the root. Children are listed from the
+    // most recently added one, and 0 ends a list.
+    std::vector<frame_id_t> d_frame_ids{0};
+    std::vector<index_t> d_parents{0};
+    std::vector<index_t> d_first_child{0};
+    std::vector<index_t> d_next_sibling{0};
+    std::vector<uint8_t> d_n_children{0};
+    containers::FlatHashMap<ChildKey, index_t, typename ChildKey::Hash> d_children{};
 };
+
+// The indexes of the stacks in capture files are 32 bit.
+using FrameTree = BasicFrameTree<uint32_t>;
+
 }  // namespace memray::tracking_api
@@ -6,6 +6,8 @@
 
 namespace memray::hooks {
 
+MEMRAY_FAST_TLS thread_local bool RecursionGuard::isActive = false;
+
 int
 phdr_symfind_callback(dl_phdr_info* info, [[maybe_unused]] size_t size, void* data) noexcept
 {
@@ -51,10 +53,14 @@ allocatorKind(const Allocator& allocator)
         case Allocator::POSIX_MEMALIGN:
         case Allocator::PVALLOC:
         case Allocator::REALLOC:
-        case Allocator::VALLOC: {
+        case Allocator::VALLOC:
+        case Allocator::PYMALLOC_MALLOC:
+        case Allocator::PYMALLOC_CALLOC:
+        case Allocator::PYMALLOC_REALLOC: {
             return AllocatorKind::SIMPLE_ALLOCATOR;
         }
-        case Allocator::FREE: {
+        case Allocator::FREE:
+        case Allocator::PYMALLOC_FREE: {
             return AllocatorKind::SIMPLE_DEALLOCATOR;
         }
         case Allocator::MMAP: {
@@ -67,6 +73,20 @@ allocatorKind(const Allocator& allocator)
     __builtin_unreachable();
 }
 
+bool
+isPythonAllocator(const Allocator& allocator)
+{
+    switch (allocator) {
+        case Allocator::PYMALLOC_MALLOC:
+        case Allocator::PYMALLOC_CALLOC:
+        case Allocator::PYMALLOC_REALLOC:
+        case Allocator::PYMALLOC_FREE:
+            return true;
+        default:
+            return false;
+    }
+}
+
 #define FOR_EACH_HOOKED_FUNCTION(f) SymbolHook<decltype(&::f)> f(#f, &::f);
 MEMRAY_HOOKED_FUNCTIONS
 #undef FOR_EACH_HOOKED_FUNCTION
@@ -136,10 +156,13 @@ realloc(void* ptr, size_t size) noexcept
 {
     assert(hooks::realloc);
 
+    size_t old_size = 0;
+    if (ptr && tracking_api::Tracker::countsTrackedBytes()) {
+        old_size = malloc_usable_size(ptr);
+    }
     void* ret = hooks::realloc(ptr, size);
     if (ret) {
-        tracking_api::Tracker::trackDeallocation(ptr, 0, hooks::Allocator::FREE);
-        tracking_api::Tracker::trackAllocation(ret, size, hooks::Allocator::REALLOC);
+        tracking_api::Tracker::trackReallocation(ptr, ret, size, old_size, hooks::Allocator::REALLOC);
     }
     return ret;
 }
@@ -254,4 +277,66 @@ PyGILState_Ensure() noexcept
     return ret;
 }
 
+// What the Python allocators do to get their memory happens with the guard
+// set, so that the malloc() or the arena that it comes from isn't recorded a
+// second time.
+
+void*
+pymalloc_malloc(void* ctx, size_t size) noexcept
+{
+    auto* allocator = static_cast<PyMemAllocatorEx*>(ctx);
+    void* ptr;
+    {
+        hooks::RecursionGuard guard;
+        ptr = allocator->malloc(allocator->ctx, size);
+    }
+    if (ptr) {
+        tracking_api::Tracker::trackAllocation(ptr, size, hooks::Allocator::PYMALLOC_MALLOC);
+    }
+    return ptr;
+}
+
+void*
+pymalloc_calloc(void* ctx, size_t nelem, size_t elsize) noexcept
+{
+    auto* allocator = static_cast<PyMemAllocatorEx*>(ctx);
+    void* ptr;
+    {
+        hooks::RecursionGuard guard;
+        ptr = allocator->calloc(allocator->ctx, nelem, elsize);
+    }
+    if (ptr) {
+        tracking_api::Tracker::trackAllocation(ptr, nelem * elsize, hooks::Allocator::PYMALLOC_CALLOC);
+    }
+    return ptr;
+}
+
+void*
+pymalloc_realloc(void* ctx, void* ptr, size_t size) noexcept
+{
+    auto* allocator = static_cast<PyMemAllocatorEx*>(ctx);
+    void* ret;
+    {
+        hooks::RecursionGuard guard;
+        ret = allocator->realloc(allocator->ctx, ptr, size);
+    }
+    if (ret) {
+        tracking_api::Tracker::trackReallocation(ptr, ret, size, 0, hooks::Allocator::PYMALLOC_REALLOC);
+    }
+    return ret;
+}
+
+void
+pymalloc_free(void* ctx, void* ptr) noexcept
+{
+    auto* allocator = static_cast<PyMemAllocatorEx*>(ctx);
+    // Like free(), this is recorded first so that the memory can't be reused
+    // in between.
+    tracking_api::Tracker::trackDeallocation(ptr, 0, hooks::Allocator::PYMALLOC_FREE);
+    {
+        hooks::RecursionGuard guard;
+        allocator->free(allocator->ctx, ptr);
+    }
+}
+
 }  // namespace memray::intercept
@@ -16,6 +16,12 @@
 
 #include "logging.h"
 
+#ifdef MEMRAY_TLS_MODEL
+#    define MEMRAY_FAST_TLS __attribute__((tls_model(MEMRAY_TLS_MODEL)))
+#else
+#    define MEMRAY_FAST_TLS
+#endif
+
 #define MEMRAY_HOOKED_FUNCTIONS                                                                         \
     FOR_EACH_HOOKED_FUNCTION(malloc)                                                                    \
     FOR_EACH_HOOKED_FUNCTION(free)                                                                      \
@@ -99,6 +105,12 @@ enum class Allocator {
     PVALLOC = 8,
     MMAP = 9,
     MUNMAP = 10,
+    // The Python allocators of the PYMEM_DOMAIN_MEM and PYMEM_DOMAIN_OBJ
+    // domains, which hand out memory from pymalloc's arenas.
+    PYMALLOC_MALLOC = 11,
+    PYMALLOC_CALLOC = 12,
+    PYMALLOC_REALLOC = 13,
+    PYMALLOC_FREE = 14,
 };
 
 enum class AllocatorKind {
@@ -111,6 +123,28 @@ enum class AllocatorKind {
 AllocatorKind
 allocatorKind(const Allocator& allocator);
 
+// Whether the memory of the allocator comes from the Python allocators
+// instead of straight from malloc.
+bool
+isPythonAllocator(const Allocator& allocator);
+
+struct RecursionGuard
+{
+    RecursionGuard()
+    : wasLocked(isActive)
+    {
+        isActive = true;
+    }
+
+    ~RecursionGuard()
+    {
+        isActive = wasLocked;
+    }
+
+    const bool wasLocked;
+    MEMRAY_FAST_TLS static thread_local bool isActive;
+};
+
 #define FOR_EACH_HOOKED_FUNCTION(f) extern SymbolHook<decltype(&::f)> f;
 MEMRAY_HOOKED_FUNCTIONS
 #undef FOR_EACH_HOOKED_FUNCTION
@@ -163,6 +197,20 @@ prctl(int option, ...) noexcept;
 PyGILState_STATE
 PyGILState_Ensure() noexcept;
 
+// The hooks of the Python allocators. Their context is the PyMemAllocatorEx
+// that they wrap.
+void*
+pymalloc_malloc(void* ctx, size_t size) noexcept;
+
+void*
+pymalloc_calloc(void* ctx, size_t nelem, size_t elsize) noexcept;
+
+void*
+pymalloc_realloc(void* ctx, void* ptr, size_t size) noexcept;
+
+void
+pymalloc_free(void* ctx, void* ptr) noexcept;
+
 }  // namespace memray::intercept
 
 #endif  //_MEMRAY_HOOKS_H
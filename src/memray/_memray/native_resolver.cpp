@@ -1,48 +1,87 @@
+#include <array>
+#include <atomic>
+#include <cerrno>
+#include <cinttypes>
+#include <cstdio>
 #include <cstring>
+#include <fcntl.h>
 #include <iostream>
+#include <link.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <thread>
+#include <unistd.h>
+#include <unordered_set>
 #include <utility>
 
 #include "native_resolver.h"
 
+#include "elf_utils.h"
 #include "logging.h"
 
 namespace memray::native_resolver {
 
 StringStorage::StringStorage()
 {
-    d_interned_data.reserve(4096);
-    d_interned_data_storage.reserve(4096);
+    d_ids.reserve(4096);
+    d_strings.reserve(4096);
 }
 
-size_t
-StringStorage::internString(const std::string& str, const char** interned_string)
+const char*
+StringStorage::copyToArena(std::string_view str)
+{
+    const size_t size = str.size() + 1;
+    if (size > d_block_remaining) {
+        // Strings that don't fit in a block get one of their own, which
+        // leaves the current block to the strings after them.
+        if (size > ARENA_BLOCK_SIZE / 4) {
+            d_blocks.emplace_back(new char[size]);
+            char* copy = d_blocks.back().get();
+            memcpy(copy, str.data(), str.size());
+            copy[str.size()] = '\0';
+            return copy;
+        }
+        d_blocks.emplace_back(new char[ARENA_BLOCK_SIZE]);
+        d_block_cursor = d_blocks.back().get();
+        d_block_remaining = ARENA_BLOCK_SIZE;
+    }
+    char* copy = d_block_cursor;
+    memcpy(copy, str.data(), str.size());
+    copy[str.size()] = '\0';
+    d_block_cursor += size;
+    d_block_remaining -= size;
+    return copy;
+}
+
+StringStorage::id_t
+StringStorage::internString(std::string_view str, const char** interned_string)
 {
     if (str.empty()) {
+        if (interned_string) {
+            *interned_string = "";
+        }
         return 0;
     }
 
-    const size_t id = d_interned_data.size() + 1;
-    auto inserted = d_interned_data.insert({str, id});
-    if (interned_string) {
-        *interned_string = inserted.first->first.c_str();
+    auto it = d_ids.find(str);
+    if (it == d_ids.end()) {
+        std::string_view copy(copyToArena(str), str.size());
+        d_strings.push_back(copy);
+        it = d_ids.emplace(copy, static_cast<id_t>(d_strings.size())).first;
     }
-
-    if (!inserted.second) {
-        return inserted.first->second;
+    if (interned_string) {
+        *interned_string = it->first.data();
     }
-    //  C++11 standard § 23.2.5/8: Rehashing the elements of an unordered associative container
-    //  invalidates iterators, changes ordering between elements, and changes which buckets elements
-    //  appear in, but does not invalidate pointers or references to elements.
-    d_interned_data_storage.push_back(&inserted.first->first);
-
-    return id;
+    return it->second;
 }
 
-const std::string&
-StringStorage::resolveString(size_t index) const
+std::string_view
+StringStorage::resolveString(id_t id) const
 {
-    assert(index != 0);
-    return *d_interned_data_storage.at(index - 1);
+    if (id == 0) {
+        return {};
+    }
+    return d_strings.at(id - 1);
 }
 
 MemorySegment::MemorySegment(
@@ -50,12 +89,16 @@ MemorySegment::MemorySegment(
         uintptr_t start,
         uintptr_t end,
         backtrace_state* state,
-        size_t filename_index)
+        size_t filename_index,
+        uintptr_t load_address,
+        std::string_view build_id)
 : d_filename(std::move(filename))
 , d_start(start)
 , d_end(end)
 , d_index(filename_index)
 , d_state(state)
+, d_load_address(load_address)
+, d_build_id(build_id)
 {
 }
 
@@ -191,26 +234,354 @@ MemorySegment::filename() const
     return d_filename;
 }
 
-ResolvedFrame::ResolvedFrame(
-        const MemorySegment::Frame& frame,
-        std::shared_ptr<StringStorage> d_string_storage)
-: d_string_storage(d_string_storage)
-, d_symbol_index(d_string_storage->internString(frame.symbol))
-, d_file_index(d_string_storage->internString(frame.filename))
-, d_line(frame.lineno)
+uintptr_t
+MemorySegment::loadAddress() const
 {
+    return d_load_address;
 }
 
-const std::string&
-ResolvedFrame::Symbol() const
+backtrace_state*
+MemorySegment::state() const
+{
+    return d_state;
+}
+
+std::string_view
+MemorySegment::buildId() const
+{
+    return d_build_id;
+}
+
+namespace {  // unnamed
+
+// The GNU build id of an ELF file, in hex, or an empty string if it has none.
+std::string
+readBuildId(const std::string& filename)
+{
+    int fd = open(filename.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return {};
+    }
+    struct stat st;
+    void* mapping = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && static_cast<size_t>(st.st_size) >= sizeof(ElfW(Ehdr))) {
+        mapping = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    }
+    close(fd);
+    if (mapping == MAP_FAILED) {
+        return {};
+    }
+
+    std::string build_id;
+    const size_t size = st.st_size;
+    const auto* data = static_cast<const char*>(mapping);
+    const auto* header = reinterpret_cast<const ElfW(Ehdr)*>(data);
+    const int native_class = sizeof(void*) == 8 ? ELFCLASS64 : ELFCLASS32;
+    const bool valid_header = memcmp(header->e_ident, ELFMAG, SELFMAG) == 0
+                              && header->e_ident[EI_CLASS] == native_class
+                              && header->e_phentsize == sizeof(ElfW(Phdr))
+                              && header->e_phoff + header->e_phnum * sizeof(ElfW(Phdr)) <= size;
+    for (size_t i = 0; valid_header && build_id.empty() && i < header->e_phnum; ++i) {
+        const auto* phdr = reinterpret_cast<const ElfW(Phdr)*>(data + header->e_phoff) + i;
+        if (phdr->p_type != PT_NOTE || phdr->p_offset + phdr->p_filesz > size) {
+            continue;
+        }
+        build_id = findGnuBuildId(data + phdr->p_offset, phdr->p_filesz, phdr->p_align);
+    }
+    munmap(mapping, size);
+    return build_id;
+}
+
+template<typename T>
+void
+appendValue(std::string& buffer, T value)
+{
+    buffer.append(reinterpret_cast<const char*>(&value), sizeof(value));
+}
+
+void
+appendString(std::string& buffer, const std::string& value)
+{
+    appendValue(buffer, static_cast<uint32_t>(value.size()));
+    buffer.append(value);
+}
+
+template<typename T>
+bool
+readValue(const std::string& buffer, size_t& offset, T& value)
+{
+    if (buffer.size() - offset < sizeof(value)) {
+        return false;
+    }
+    memcpy(&value, buffer.data() + offset, sizeof(value));
+    offset += sizeof(value);
+    return true;
+}
+
+bool
+readString(const std::string& buffer, size_t& offset, std::string& value)
+{
+    uint32_t length;
+    if (!readValue(buffer, offset, length) || buffer.size() - offset < length) {
+        return false;
+    }
+    value.assign(buffer, offset, length);
+    offset += length;
+    return true;
+}
+
+bool
+readFile(const std::string& path, std::string& contents)
+{
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return false;
+    }
+    char buffer[65536];
+    ssize_t n_read;
+    while ((n_read = read(fd, buffer, sizeof(buffer))) > 0) {
+        contents.append(buffer, n_read);
+    }
+    close(fd);
+    return n_read == 0;
+}
+
+// Entries are an offset and its frames: their count, and the symbol, file
+// and line of each one.
+void
+appendEntry(std::string& buffer, uint64_t offset, const MemorySegment::ExpandedFrame& frames)
+{
+    appendValue(buffer, offset);
+    appendValue(buffer, static_cast<uint32_t>(frames.size()));
+    for (const auto& frame : frames) {
+        appendString(buffer, frame.symbol);
+        appendString(buffer, frame.filename);
+        appendValue(buffer, static_cast<int32_t>(frame.lineno));
+    }
+}
+
+// Call callback(offset, frames) for each of the complete entries at the start
+// of contents, and return how many bytes they take up.
+template<typename Callback>
+size_t
+readEntries(const std::string& contents, const Callback& callback)
 {
-    return d_string_storage->resolveString(d_symbol_index);
+    size_t offset = 0;
+    while (true) {
+        const size_t entry_start = offset;
+        uint64_t address;
+        uint32_t n_frames;
+        if (!readValue(contents, offset, address) || !readValue(contents, offset, n_frames)
+            || n_frames > contents.size() - offset)
+        {
+            return entry_start;
+        }
+        MemorySegment::ExpandedFrame frames(n_frames);
+        for (auto& frame : frames) {
+            int32_t lineno;
+            if (!readString(contents, offset, frame.symbol)
+                || !readString(contents, offset, frame.filename)
+                || !readValue(contents, offset, lineno))
+            {
+                return entry_start;
+            }
+            frame.lineno = lineno;
+        }
+        callback(address, std::move(frames));
+    }
+}
+
+// Write contents to a temporary file next to path, and rename that to path
+// once it has all been written.
+bool
+replaceFile(const std::string& path, const std::string& contents)
+{
+    static std::atomic<unsigned> counter{0};
+    const std::string temporary_path =
+            path + ".tmp." + std::to_string(getpid()) + "." + std::to_string(counter++);
+    int fd = open(temporary_path.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        return false;
+    }
+    const char* data = contents.data();
+    size_t remaining = contents.size();
+    while (remaining) {
+        ssize_t written = write(fd, data, remaining);
+        if (written < 0 && errno == EINTR) {
+            continue;
+        }
+        if (written <= 0) {
+            break;
+        }
+        data += written;
+        remaining -= written;
+    }
+    if (close(fd) != 0 || remaining || rename(temporary_path.c_str(), path.c_str()) != 0) {
+        int saved_errno = errno;
+        unlink(temporary_path.c_str());
+        errno = saved_errno;
+        return false;
+    }
+    return true;
+}
+
+bool
+makeDirectories(const std::string& path)
+{
+    for (size_t slash = path.find('/', 1); slash != std::string::npos; slash = path.find('/', slash + 1))
+    {
+        if (mkdir(path.substr(0, slash).c_str(), 0755) != 0 && errno != EEXIST) {
+            return false;
+        }
+    }
+    return mkdir(path.c_str(), 0755) == 0 || errno == EEXIST;
+}
+
+}  // unnamed namespace
+
+SymbolCache::~SymbolCache()
+{
+    flush();
+}
+
+void
+SymbolCache::setDirectory(std::string directory)
+{
+    flush();
+    d_binaries.clear();
+    d_file_build_ids.clear();
+    d_directory = std::move(directory);
+    if (enabled() && !makeDirectories(d_directory)) {
+        LOG(WARNING) << "Failed to create the symbol cache directory " << d_directory << ": "
+                     << strerror(errno);
+        d_directory.clear();
+    }
+}
+
+bool
+SymbolCache::enabled() const
+{
+    return !d_directory.empty();
 }
 
 const std::string&
-ResolvedFrame::File() const
+SymbolCache::fileBuildId(const MemorySegment& segment)
+{
+    auto [it, inserted] = d_file_build_ids.try_emplace(segment.filenameIndex());
+    if (inserted) {
+        it->second = readBuildId(segment.filename());
+    }
+    return it->second;
+}
+
+SymbolCache::BinarySymbols&
+SymbolCache::symbolsFor(const MemorySegment& segment)
+{
+    std::string_view build_id = segment.buildId();
+    if (build_id.empty()) {
+        build_id = fileBuildId(segment);
+    }
+    if (!isValidBuildId(build_id)) {
+        build_id = {};
+    }
+    auto [it, inserted] = d_binaries.try_emplace(std::string(build_id));
+    BinarySymbols& symbols = it->second;
+    if (!inserted || build_id.empty()) {
+        return symbols;
+    }
+    symbols.path = d_directory + "/" + it->first + ".symbols";
+
+    std::string contents;
+    readFile(symbols.path, contents);
+    readEntries(contents, [&](uint64_t address, MemorySegment::ExpandedFrame&& frames) {
+        symbols.frames.emplace(address, std::move(frames));
+    });
+    return symbols;
+}
+
+const MemorySegment::ExpandedFrame*
+SymbolCache::find(const MemorySegment& segment, uintptr_t address)
+{
+    if (!enabled()) {
+        return nullptr;
+    }
+    BinarySymbols& symbols = symbolsFor(segment);
+    auto it = symbols.frames.find(address - segment.loadAddress());
+    return it != symbols.frames.end() ? &it->second : nullptr;
+}
+
+void
+SymbolCache::add(
+        const MemorySegment& segment,
+        uintptr_t address,
+        const MemorySegment::ExpandedFrame& frames)
+{
+    if (!enabled()) {
+        return;
+    }
+    // The frames were resolved from the file that is at the path of the
+    // segment now, which may be another build than the one that the capture
+    // recorded. Its symbols must not be kept under the recorded build id.
+    if (!segment.buildId().empty() && fileBuildId(segment) != segment.buildId()) {
+        return;
+    }
+    BinarySymbols& symbols = symbolsFor(segment);
+    if (symbols.path.empty()) {
+        return;
+    }
+    const uint64_t offset = address - segment.loadAddress();
+    if (symbols.frames.emplace(offset, frames).second) {
+        symbols.pending.push_back(offset);
+    }
+}
+
+void
+SymbolCache::flush()
 {
-    return d_string_storage->resolveString(d_file_index);
+    for (auto& [build_id, symbols] : d_binaries) {
+        if (symbols.pending.empty()) {
+            continue;
+        }
+        // Start from what the file has now, which may include entries that
+        // other processes added since we read it. Whatever follows its last
+        // complete entry is dropped, so that a damaged file doesn't hide the
+        // entries written after the damage.
+        std::string contents;
+        readFile(symbols.path, contents);
+        std::unordered_set<uint64_t> in_file;
+        contents.resize(readEntries(contents, [&](uint64_t address, MemorySegment::ExpandedFrame&&) {
+            in_file.insert(address);
+        }));
+        for (uintptr_t offset : symbols.pending) {
+            if (!in_file.count(offset)) {
+                appendEntry(contents, offset, symbols.frames.at(offset));
+            }
+        }
+        symbols.pending.clear();
+        if (!replaceFile(symbols.path, contents)) {
+            LOG(DEBUG) << "Failed to write the symbol cache file " << symbols.path << ": "
+                       << strerror(errno);
+        }
+    }
+}
+
+ResolvedFrame::ResolvedFrame(const MemorySegment::Frame& frame, StringStorage& string_storage)
+: d_symbol_id(string_storage.internString(frame.symbol))
+, d_file_id(string_storage.internString(frame.filename))
+, d_line(frame.lineno)
+{
+}
+
+StringStorage::id_t
+ResolvedFrame::symbolId() const
+{
+    return d_symbol_id;
+}
+
+StringStorage::id_t
+ResolvedFrame::fileId() const
+{
+    return d_file_id;
 }
 
 int
@@ -219,13 +590,17 @@ ResolvedFrame::Line() const
     return d_line;
 }
 PyObject*
-ResolvedFrame::toPythonObject(python_helpers::PyUnicode_Cache& pystring_cache) const
+ResolvedFrame::toPythonObject(
+        const StringStorage& string_storage,
+        python_helpers::PyUnicode_Cache& pystring_cache) const
 {
-    PyObject* pyfunction_name = pystring_cache.getUnicodeObject(Symbol());  // Borrowed
+    PyObject* pyfunction_name =
+            pystring_cache.getUnicodeObject(d_symbol_id, string_storage.resolveString(d_symbol_id));
     if (pyfunction_name == nullptr) {
         return nullptr;
     }
-    PyObject* pyfilename = pystring_cache.getUnicodeObject(File());  // Borrowed
+    PyObject* pyfilename =
+            pystring_cache.getUnicodeObject(d_file_id, string_storage.resolveString(d_file_id));
     if (pyfilename == nullptr) {
         return nullptr;
     }
@@ -246,10 +621,10 @@ ResolvedFrame::toPythonObject(python_helpers::PyUnicode_Cache& pystring_cache) c
     return tuple;
 }
 
-const std::string&
+std::string_view
 ResolvedFrames::memoryMap() const
 {
-    return d_string_storage->resolveString(d_memory_map_index);
+    return d_string_storage->resolveString(d_memory_map_id);
 }
 
 const std::vector<ResolvedFrame>&
@@ -258,6 +633,18 @@ ResolvedFrames::frames() const
     return d_frames;
 }
 
+const StringStorage&
+ResolvedFrames::strings() const
+{
+    return *d_string_storage;
+}
+
+bool
+ResolvedFrames::isProvisional() const
+{
+    return d_provisional;
+}
+
 SymbolResolver::SymbolResolver()
 {
     d_backtrace_states.reserve(PREALLOCATED_BACKTRACE_STATES);
@@ -281,6 +668,9 @@ SymbolResolver::resolve(uintptr_t ip, size_t generation)
     // Check if we have resolved this frame previously
     auto it = d_resolved_ips_cache.find({ip, generation});
     if (it == d_resolved_ips_cache.end()) {
+        if (d_defer_resolution) {
+            return deferResolution(ip, generation);
+        }
         // This is the first time we resolved this frame, do the actual resolution
         // work and insert it into the cache.
         auto resolved_frames = resolveFromSegments(ip, generation);
@@ -289,33 +679,279 @@ SymbolResolver::resolve(uintptr_t ip, size_t generation)
     return it->second;
 }
 
+void
+SymbolResolver::resolveAll(
+        const std::vector<std::pair<uintptr_t, size_t>>& ips,
+        size_t max_workers,
+        api::ReadProgress* progress)
+{
+    // The libbacktrace states are not thread safe, so the instruction
+    // pointers are split by the state that resolves them, and each worker
+    // takes whole groups. This also means that the debug information of each
+    // binary is still only parsed once.
+    struct Group
+    {
+        const MemorySegment* segment;
+        std::vector<uintptr_t> ips;
+        std::vector<MemorySegment::ExpandedFrame> frames;
+    };
+    std::vector<Group> groups;
+    std::unordered_map<backtrace_state*, size_t> group_by_state;
+    std::unordered_map<ips_cache_pair_t, std::pair<size_t, size_t>, ips_cache_pair_hash> pending;
+    std::unordered_map<std::pair<size_t, uintptr_t>, size_t, ips_cache_pair_hash> position_in_group;
+
+    if (d_defer_resolution) {
+        for (const auto& [ip, generation] : ips) {
+            requestResolution(ip, generation);
+        }
+        return;
+    }
+
+    for (const auto& [ip, generation] : ips) {
+        ips_cache_pair_t key(ip, generation);
+        if (d_resolved_ips_cache.count(key) || pending.count(key)) {
+            continue;
+        }
+        const MemorySegment* segment = findSegment(ip, generation);
+        if (segment == nullptr) {
+            d_resolved_ips_cache.emplace(key, nullptr);
+            continue;
+        }
+        if (const auto* cached = d_symbol_cache.find(*segment, ip)) {
+            d_resolved_ips_cache.emplace(key, makeResolvedFrames(*segment, *cached));
+            continue;
+        }
+        auto [group_it, new_group] = group_by_state.try_emplace(segment->state(), groups.size());
+        if (new_group) {
+            groups.push_back(Group{segment, {}, {}});
+        }
+        Group& group = groups[group_it->second];
+        // The same address can show up in several generations of the maps.
+        auto [position_it, new_ip] =
+                position_in_group.try_emplace(std::make_pair(group_it->second, ip), group.ips.size());
+        if (new_ip) {
+            group.ips.push_back(ip);
+        }
+        pending.emplace(key, std::make_pair(group_it->second, position_it->second));
+    }
+
+    // Only the calling thread reports the progress. The workers just count
+    // it, and stop when it's cancelled.
+    const size_t n_workers = std::min(max_workers, groups.size());
+    auto resolve_group = [&](Group& group) {
+        group.frames.reserve(group.ips.size());
+        for (uintptr_t ip : group.ips) {
+            if (progress) {
+                if (progress->cancelled() || (n_workers < 2 && !progress->update())) {
+                    return;
+                }
+                progress->advance(1);
+            }
+            group.frames.push_back(group.segment->resolveIp(ip));
+        }
+    };
+    if (progress && !groups.empty()) {
+        size_t n_ips = 0;
+        for (const auto& group : groups) {
+            n_ips += group.ips.size();
+        }
+        progress->startPhase(api::ReadPhase::SYMBOLIZATION, n_ips);
+    }
+    if (n_workers < 2) {
+        std::for_each(groups.begin(), groups.end(), resolve_group);
+    } else {
+        // Groups are handed out in order of size, so that a worker doesn't
+        // start on one of the largest ones once the others have finished.
+        std::vector<Group*> work;
+        for (auto& group : groups) {
+            work.push_back(&group);
+        }
+        std::sort(work.begin(), work.end(), [](const Group* lhs, const Group* rhs) {
+            return lhs->ips.size() > rhs->ips.size();
+        });
+        std::atomic<size_t> next_group{0};
+        std::vector<std::thread> workers;
+        for (size_t i = 0; i < n_workers; ++i) {
+            workers.emplace_back([&] {
+                for (size_t index = next_group++; index < work.size(); index = next_group++) {
+                    resolve_group(*work[index]);
+                }
+                if (progress) {
+                    progress->threadFinished();
+                }
+            });
+        }
+        if (progress) {
+            progress->waitForThreads(workers.size());
+        }
+        for (auto& worker : workers) {
+            worker.join();
+        }
+    }
+
+    if (progress && !groups.empty()) {
+        progress->finishPhase();
+    }
+
+    for (const auto& [key, position] : pending) {
+        const Group& group = groups[position.first];
+        if (position.second >= group.frames.size()) {
+            // Left unresolved by a cancelled progress.
+            continue;
+        }
+        const auto& frames = group.frames[position.second];
+        d_symbol_cache.add(*group.segment, key.first, frames);
+        d_resolved_ips_cache.emplace(key, makeResolvedFrames(*group.segment, frames));
+    }
+    d_symbol_cache.flush();
+}
+
+void
+SymbolResolver::setCacheDirectory(const std::string& directory)
+{
+    d_symbol_cache.setDirectory(directory);
+}
+
+void
+SymbolResolver::setDeferResolution(bool defer)
+{
+    d_defer_resolution = defer;
+}
+
+void
+SymbolResolver::requestResolution(uintptr_t ip, size_t generation)
+{
+    if (!d_resolved_ips_cache.count({ip, generation})) {
+        deferResolution(ip, generation);
+    }
+}
+
+bool
+SymbolResolver::takeDeferred(std::vector<DeferredIp>& work)
+{
+    work.clear();
+    std::swap(work, d_deferred);
+    return !work.empty();
+}
+
+void
+SymbolResolver::addDeferred(
+        const std::vector<DeferredIp>& work,
+        const std::vector<MemorySegment::ExpandedFrame>& frames)
+{
+    // There are fewer frames than addresses if the resolution was stopped
+    // half way, and what's left stays provisional.
+    for (size_t i = 0; i < std::min(work.size(), frames.size()); ++i) {
+        const DeferredIp& deferred = work[i];
+        ips_cache_pair_t key(deferred.ip, deferred.generation);
+        d_symbol_cache.add(deferred.segment, deferred.ip, frames[i]);
+        d_resolved_ips_cache[key] = makeResolvedFrames(deferred.segment, frames[i]);
+        d_provisional_ips_cache.erase(key);
+    }
+    d_symbol_cache.flush();
+}
+
 SymbolResolver::resolved_frames_t
-SymbolResolver::resolveFromSegments(uintptr_t ip, size_t generation)
+SymbolResolver::deferResolution(uintptr_t ip, size_t generation)
 {
-    if (d_are_segments_dirty) {
-        // Sort the segments so the binary search below works
-        sort(currentSegments().begin(), currentSegments().end());
-        d_are_segments_dirty = false;
+    ips_cache_pair_t key(ip, generation);
+    auto provisional = d_provisional_ips_cache.find(key);
+    if (provisional != d_provisional_ips_cache.end()) {
+        return provisional->second;
+    }
+    const MemorySegment* segment = findSegment(ip, generation);
+    if (segment == nullptr) {
+        return d_resolved_ips_cache.emplace(key, nullptr).first->second;
     }
+    if (const auto* cached = d_symbol_cache.find(*segment, ip)) {
+        return d_resolved_ips_cache.emplace(key, makeResolvedFrames(*segment, *cached)).first->second;
+    }
+    d_deferred.push_back(DeferredIp{ip, generation, *segment});
+    auto frames = makeProvisionalFrames(*segment, ip);
+    d_provisional_ips_cache.emplace(key, frames);
+    return frames;
+}
+
+SymbolResolver::resolved_frames_t
+SymbolResolver::makeProvisionalFrames(const MemorySegment& segment, uintptr_t ip)
+{
+    const std::string& filename = segment.filename();
+    auto slash = filename.rfind('/');
+    std::string module = slash == std::string::npos ? filename : filename.substr(slash + 1);
+    char offset[32];
+    std::snprintf(offset, sizeof(offset), "+0x%" PRIxPTR, ip - segment.loadAddress());
+    std::vector<ResolvedFrame> frames;
+    frames.emplace_back(MemorySegment::Frame{module + offset, filename, 0}, *d_string_storage);
+    return std::make_shared<ResolvedFrames>(
+            segment.filenameIndex(),
+            std::move(frames),
+            d_string_storage,
+            true);
+}
+
+const MemorySegment*
+SymbolResolver::findSegment(uintptr_t ip, size_t generation)
+{
+    sortCurrentGeneration();
+
+    // Look for the address from the newest overlay down, skipping the
+    // segments of the objects that an overlay above them removed. The
+    // segments of a generation never overlap the ones that it can see below
+    // it, so the first segment with the address is the only one.
+    std::array<const SegmentGeneration*, MAX_OVERLAY_DEPTH + 1> overlays_above{};
+    size_t n_overlays_above = 0;
+    const SegmentGeneration* layer = &d_generations.at(generation);
+    while (true) {
+        auto segment = findModule(ip, layer->segments);
+        if (segment != layer->segments.end() && segment->isAddressInRange(ip)) {
+            object_key_t key(segment->loadAddress(), segment->filenameIndex());
+            for (size_t i = 0; i < n_overlays_above; ++i) {
+                const auto& removed = overlays_above[i]->removed;
+                if (std::binary_search(removed.begin(), removed.end(), key)) {
+                    return nullptr;
+                }
+            }
+            return &*segment;
+        }
+        if (layer->base == 0) {
+            return nullptr;
+        }
+        overlays_above[n_overlays_above++] = layer;
+        layer = &d_generations.at(layer->base);
+    }
+}
 
-    const auto& segments = d_segments.at(generation);
-    auto segment = findModule(ip, segments);
-    if (segment == segments.end() || !segment->isAddressInRange(ip)) {
+SymbolResolver::resolved_frames_t
+SymbolResolver::resolveFromSegments(uintptr_t ip, size_t generation)
+{
+    const MemorySegment* segment = findSegment(ip, generation);
+    if (segment == nullptr) {
         return nullptr;
     }
+    if (const auto* cached = d_symbol_cache.find(*segment, ip)) {
+        return makeResolvedFrames(*segment, *cached);
+    }
+    const auto expanded_frame = segment->resolveIp(ip);
+    d_symbol_cache.add(*segment, ip, expanded_frame);
+    return makeResolvedFrames(*segment, expanded_frame);
+}
 
+SymbolResolver::resolved_frames_t
+SymbolResolver::makeResolvedFrames(
+        const MemorySegment& segment,
+        const MemorySegment::ExpandedFrame& expanded_frame)
+{
     std::vector<ResolvedFrame> frames;
-    const auto expanded_frame = segment->resolveIp(ip);
     if (expanded_frame.empty()) {
         return nullptr;
     }
-    auto segment_index = segment->filenameIndex();
+    auto segment_index = segment.filenameIndex();
     std::transform(
             expanded_frame.begin(),
             expanded_frame.end(),
             std::back_inserter(frames),
             [this](const auto& frame) {
-                return ResolvedFrame{frame, d_string_storage};
+                return ResolvedFrame{frame, *d_string_storage};
             });
     return std::make_shared<ResolvedFrames>(segment_index, std::move(frames), d_string_storage);
 }
@@ -326,10 +962,18 @@ SymbolResolver::addSegment(
         backtrace_state* backtrace_state,
         const size_t filename_index,
         const uintptr_t address_start,
-        const uintptr_t address_end)
+        const uintptr_t address_end,
+        const uintptr_t load_address,
+        std::string_view build_id)
 {
-    currentSegments()
-            .emplace_back(filename, address_start, address_end, backtrace_state, filename_index);
+    currentGeneration().segments.emplace_back(
+            filename,
+            address_start,
+            address_end,
+            backtrace_state,
+            filename_index,
+            load_address,
+            build_id);
     d_are_segments_dirty = true;
 }
 
@@ -337,7 +981,8 @@ void
 SymbolResolver::addSegments(
         const std::string& filename,
         uintptr_t addr,
-        const std::vector<tracking_api::Segment>& segments)
+        const std::vector<tracking_api::Segment>& segments,
+        const std::string& build_id)
 {
     // We use a char* for the filename to reduce the memory footprint and
     // because the libbacktrace callback in findBacktraceState operates on char*
@@ -349,25 +994,64 @@ SymbolResolver::addSegments(
         return;
     }
 
+    std::string_view interned_build_id = d_string_storage->resolveString(
+            d_string_storage->internString(build_id));
     for (const auto& segment : segments) {
         const uintptr_t segment_start = addr + segment.vaddr;
         const uintptr_t segment_end = addr + segment.vaddr + segment.memsz;
-        addSegment(filename, state, filename_index, segment_start, segment_end);
+        addSegment(filename, state, filename_index, segment_start, segment_end, addr, interned_build_id);
     }
 }
 
 void
-SymbolResolver::clearSegments()
+SymbolResolver::removeSegments(const std::string& filename, uintptr_t addr)
 {
-    if (d_are_segments_dirty) {
-        // Sort the segments so the binary search in resolve() works
-        sort(currentSegments().begin(), currentSegments().end());
+    object_key_t key(addr, d_string_storage->internString(filename));
+    SegmentGeneration& generation = currentGeneration();
+    auto& segments = generation.segments;
+    segments.erase(
+            std::remove_if(
+                    segments.begin(),
+                    segments.end(),
+                    [&](const MemorySegment& segment) {
+                        return segment.loadAddress() == key.first
+                               && segment.filenameIndex() == key.second;
+                    }),
+            segments.end());
+    if (generation.base != 0) {
+        generation.removed.push_back(key);
+        d_are_segments_dirty = true;
     }
+}
+
+void
+SymbolResolver::clearSegments()
+{
+    sortCurrentGeneration();
     size_t reserve_size = 256;
     if (currentSegmentGeneration() > 0) {
-        reserve_size = currentSegments().size();
+        reserve_size = currentGeneration().segments.size();
+    }
+    d_generations[currentSegmentGeneration() + 1].segments.reserve(reserve_size);
+}
+
+void
+SymbolResolver::updateSegments()
+{
+    sortCurrentGeneration();
+    const size_t base = currentSegmentGeneration();
+    if (base == 0) {
+        clearSegments();
+        return;
+    }
+    const size_t depth = d_generations.at(base).depth + 1;
+    SegmentGeneration& generation = d_generations[base + 1];
+    if (depth > MAX_OVERLAY_DEPTH) {
+        generation.segments = visibleSegments(base);
+    } else {
+        generation.base = base;
+        generation.depth = depth;
     }
-    d_segments[currentSegmentGeneration() + 1].reserve(reserve_size);
 }
 
 backtrace_state*
@@ -427,16 +1111,55 @@ SymbolResolver::findBacktraceState(const char* filename, uintptr_t address_start
     return state;
 }
 
-std::vector<MemorySegment>&
-SymbolResolver::currentSegments()
+SymbolResolver::SegmentGeneration&
+SymbolResolver::currentGeneration()
+{
+    return d_generations.at(d_generations.size());
+}
+
+void
+SymbolResolver::sortCurrentGeneration()
+{
+    // Only the current generation can change, and it's sorted before it's
+    // searched or another one starts on top of it.
+    if (!d_are_segments_dirty) {
+        return;
+    }
+    SegmentGeneration& generation = currentGeneration();
+    std::sort(generation.segments.begin(), generation.segments.end());
+    std::sort(generation.removed.begin(), generation.removed.end());
+    d_are_segments_dirty = false;
+}
+
+std::vector<MemorySegment>
+SymbolResolver::visibleSegments(size_t generation) const
 {
-    return d_segments.at(d_segments.size());
+    std::vector<MemorySegment> result;
+    std::vector<const SegmentGeneration*> overlays_above;
+    for (const SegmentGeneration* layer = &d_generations.at(generation); layer != nullptr;) {
+        for (const auto& segment : layer->segments) {
+            object_key_t key(segment.loadAddress(), segment.filenameIndex());
+            bool removed = std::any_of(
+                    overlays_above.begin(),
+                    overlays_above.end(),
+                    [&](const SegmentGeneration* overlay) {
+                        return std::binary_search(overlay->removed.begin(), overlay->removed.end(), key);
+                    });
+            if (!removed) {
+                result.push_back(segment);
+            }
+        }
+        overlays_above.push_back(layer);
+        layer = layer->base != 0 ? &d_generations.at(layer->base) : nullptr;
+    }
+    std::sort(result.begin(), result.end());
+    return result;
 }
 
 size_t
 SymbolResolver::currentSegmentGeneration() const
 {
-    return d_segments.size();
+    return d_generations.size();
 }
 
 }  // namespace memray::native_resolver
@@ -3,6 +3,7 @@
 #include <algorithm>
 #include <memory>
 #include <string>
+#include <string_view>
 #include <tuple>
 #include <unistd.h>
 #include <unordered_map>
@@ -16,6 +17,7 @@
 #include <libbacktrace/internal.h>
 
 #include "python_helpers.h"
+#include "read_progress.h"
 #include "records.h"
 
 namespace memray::native_resolver {
@@ -23,9 +25,21 @@ namespace memray::native_resolver {
 static constexpr int PREALLOCATED_BACKTRACE_STATES = 64;
 static constexpr int PREALLOCATED_IPS_CACHE_ITEMS = 32768;
 
+/**
+ * Interned strings, identified by small integer ids.
+ *
+ * The characters of the strings are copied one after the other into large
+ * blocks that are never freed or moved until the storage goes away, so the
+ * lookup table can key them by views into those blocks, and each string only
+ * costs its characters plus its entries in the table and in the list of ids.
+ * Strings are NUL terminated in the blocks, and the pointers to them stay
+ * valid for the lifetime of the storage. The id of the empty string is 0.
+ **/
 class StringStorage
 {
   public:
+    using id_t = uint32_t;
+
     // Constructors
     StringStorage();
     StringStorage(StringStorage& other) = delete;
@@ -34,13 +48,20 @@ class StringStorage
     void operator=(StringStorage&&) = delete;
 
     // Methods
-    size_t internString(const std::string& str, const char** interned_string = nullptr);
-    const std::string& resolveString(size_t index) const;
+    id_t internString(std::string_view str, const char** interned_string = nullptr);
+    std::string_view resolveString(id_t id) const;
 
   private:
+    // Methods
+    const char* copyToArena(std::string_view str);
+
     // Data members
-    std::unordered_map<std::string, size_t> d_interned_data;
-    std::vector<const std::string*> d_interned_data_storage;
+    static constexpr size_t ARENA_BLOCK_SIZE = 64 * 1024;
+    std::vector<std::unique_ptr<char[]>> d_blocks;
+    char* d_block_cursor{nullptr};
+    size_t d_block_remaining{0};
+    std::unordered_map<std::string_view, id_t> d_ids;
+    std::vector<std::string_view> d_strings;
 };
 
 class MemorySegment
@@ -62,7 +83,9 @@ class MemorySegment
             uintptr_t start,
             uintptr_t end,
             backtrace_state* state,
-            size_t filename_index);
+            size_t filename_index,
+            uintptr_t load_address,
+            std::string_view build_id = {});
     ExpandedFrame resolveIp(uintptr_t address) const;
     bool operator<(const MemorySegment& segment) const;
     bool operator!=(const MemorySegment& segment) const;
@@ -73,6 +96,11 @@ class MemorySegment
     uintptr_t end() const;
     size_t filenameIndex() const;
     const std::string& filename() const;
+    uintptr_t loadAddress() const;
+    backtrace_state* state() const;
+    // The build id that the capture recorded for the binary, if any. It's
+    // interned by the resolver, so it lives as long as the resolver does.
+    std::string_view buildId() const;
 
   private:
     // Methods
@@ -85,27 +113,94 @@ class MemorySegment
     uintptr_t d_end;
     size_t d_index;
     backtrace_state* d_state;
+    uintptr_t d_load_address;
+    std::string_view d_build_id;
+};
+
+/**
+ * Symbols resolved by previous runs, kept on disk.
+ *
+ * There is one file per ELF build id in the cache directory, which maps the
+ * offsets of instruction pointers from the load address of the binary to the
+ * frames that they resolved to. The files are replaced with a rename when
+ * entries are added, so several processes can share the cache, and readers
+ * never see a file that is only partly written. One process may replace the
+ * entries that another one just added, which only means resolving those
+ * frames again. Binaries without a build id are never cached, since
+ * nothing tells us that they didn't change between runs.
+ *
+ * The build id of a binary is the one that the capture recorded for it, or
+ * the one of the file at its path for captures that don't record them. So
+ * the captures of a binary share its symbols even if they were taken on
+ * other hosts, where it had other paths, or if it's gone from where it's
+ * read. Frames are only added when the file that resolved them has the
+ * build id that they are kept under.
+ **/
+class SymbolCache
+{
+  public:
+    // Constructors
+    SymbolCache() = default;
+    SymbolCache(const SymbolCache&) = delete;
+    SymbolCache& operator=(const SymbolCache&) = delete;
+    ~SymbolCache();
+
+    // Methods
+    // An empty directory disables the cache, which is the default.
+    void setDirectory(std::string directory);
+    bool enabled() const;
+    // The frames that the address of the segment resolved to, if known.
+    const MemorySegment::ExpandedFrame* find(const MemorySegment& segment, uintptr_t address);
+    void
+    add(const MemorySegment& segment, uintptr_t address, const MemorySegment::ExpandedFrame& frames);
+    // Writes the entries added since the last call to their files.
+    void flush();
+
+  private:
+    // Aliases and helpers
+    struct BinarySymbols
+    {
+        std::string path;
+        std::unordered_map<uintptr_t, MemorySegment::ExpandedFrame> frames;
+        // The offsets of the frames that aren't in the file yet.
+        std::vector<uintptr_t> pending;
+    };
+
+    // Methods
+    // The build id of the file at the path of the segment, read only once.
+    const std::string& fileBuildId(const MemorySegment& segment);
+    BinarySymbols& symbolsFor(const MemorySegment& segment);
+
+    // Data members
+    std::string d_directory;
+    // By build id, with the ones without any under an empty one.
+    std::unordered_map<std::string, BinarySymbols> d_binaries;
+    // The build ids of the files of the segments that didn't come with one.
+    std::unordered_map<size_t, std::string> d_file_build_ids;
 };
 
+// A frame that an instruction pointer resolved to, with its strings in the
+// StringStorage of the ResolvedFrames that it belongs to.
 class ResolvedFrame
 {
   public:
     // Constructors
-    ResolvedFrame(const MemorySegment::Frame& frame, std::shared_ptr<StringStorage> string_storage);
+    ResolvedFrame(const MemorySegment::Frame& frame, StringStorage& string_storage);
 
     // Methods
-    PyObject* toPythonObject(python_helpers::PyUnicode_Cache& pystring_cache) const;
+    PyObject* toPythonObject(
+            const StringStorage& string_storage,
+            python_helpers::PyUnicode_Cache& pystring_cache) const;
 
     // Getters
-    const std::string& Symbol() const;
-    const std::string& File() const;
+    StringStorage::id_t symbolId() const;
+    StringStorage::id_t fileId() const;
     int Line() const;
 
   private:
     // Data members
-    std::shared_ptr<StringStorage> d_string_storage;
-    size_t d_symbol_index;
-    size_t d_file_index;
+    StringStorage::id_t d_symbol_id;
+    StringStorage::id_t d_file_id;
     int d_line;
 };
 
@@ -114,39 +209,101 @@ class ResolvedFrames
   public:
     // Constructors
     template<typename T>
-    ResolvedFrames(size_t memory_map_index, T&& frames, std::shared_ptr<StringStorage> strings_storage)
-    : d_memory_map_index(memory_map_index)
+    ResolvedFrames(
+            StringStorage::id_t memory_map_id,
+            T&& frames,
+            std::shared_ptr<StringStorage> strings_storage,
+            bool provisional = false)
+    : d_memory_map_id(memory_map_id)
     , d_frames(std::forward<T>(frames))
     , d_string_storage(std::move(strings_storage))
+    , d_provisional(provisional)
     {
     }
 
     // Getters
-    const std::string& memoryMap() const;
+    std::string_view memoryMap() const;
     const std::vector<ResolvedFrame>& frames() const;
+    const StringStorage& strings() const;
+    // Whether these frames only stand in for the symbols of the address
+    // until they are resolved in the background.
+    bool isProvisional() const;
 
   private:
     // Data members
-    size_t d_memory_map_index{0};
+    StringStorage::id_t d_memory_map_id{0};
     std::vector<ResolvedFrame> d_frames{};
     std::shared_ptr<StringStorage> d_string_storage{nullptr};
+    bool d_provisional{false};
 };
 
+/**
+ * Resolves instruction pointers to the frames that they belong to, with the
+ * memory maps that the process had when they were captured.
+ *
+ * Every time the memory maps change a new generation of them starts. One
+ * that starts from scratch has all of the segments, but one that only
+ * updates the previous generation is an overlay on top of it: it only has
+ * the segments that were added, and the objects that were removed from the
+ * generations below, so loading many objects one at a time doesn't copy all
+ * of those that were loaded before every time. Overlays are squashed into a
+ * generation with everything once there are too many of them stacked up.
+ **/
 class SymbolResolver
 {
   public:
     using resolved_frames_t = std::shared_ptr<const ResolvedFrames>;
 
+    // An address whose symbols are left for someone else to resolve, with a
+    // copy of the segment that it belongs to, so that it can be resolved
+    // without the resolver.
+    struct DeferredIp
+    {
+        uintptr_t ip;
+        size_t generation;
+        MemorySegment segment;
+    };
+
     // Constructors
     SymbolResolver();
 
     // Methods
     resolved_frames_t resolve(uintptr_t ip, size_t generation);
+    // Resolves all of the given instruction pointers ahead of the calls to
+    // resolve() that will need them, using up to max_workers threads. The
+    // progress made is reported as the SYMBOLIZATION phase, if there's
+    // somewhere to report it to, and what's left once it's cancelled is
+    // only resolved when resolve() needs it.
+    void resolveAll(
+            const std::vector<std::pair<uintptr_t, size_t>>& ips,
+            size_t max_workers,
+            api::ReadProgress* progress = nullptr);
+    // Keeps the symbols that are resolved in the given directory, and looks
+    // them up there before resolving them again.
+    void setCacheDirectory(const std::string& directory);
+    // Once deferred, addresses whose symbols aren't known yet aren't
+    // resolved anymore: they are queued for takeDeferred(), and resolve()
+    // returns provisional frames that only name the binary and the offset
+    // into it until the frames resolved elsewhere are given to addDeferred().
+    // The resolver must not be used while the queued addresses are being
+    // resolved, but what they are resolved with is not used by the resolver
+    // itself anymore, so that can happen without holding whatever guards it.
+    void setDeferResolution(bool defer);
+    void requestResolution(uintptr_t ip, size_t generation);
+    bool takeDeferred(std::vector<DeferredIp>& work);
+    void addDeferred(
+            const std::vector<DeferredIp>& work,
+            const std::vector<MemorySegment::ExpandedFrame>& frames);
     void addSegments(
             const std::string& filename,
             uintptr_t addr,
-            const std::vector<tracking_api::Segment>& segments);
+            const std::vector<tracking_api::Segment>& segments,
+            const std::string& build_id = {});
+    void removeSegments(const std::string& filename, uintptr_t addr);
+    // Start a new generation of the memory maps, either empty or with what
+    // the current one has.
     void clearSegments();
+    void updateSegments();
     backtrace_state* findBacktraceState(const char* filename, uintptr_t address_start);
 
     // Getters
@@ -164,22 +321,53 @@ class SymbolResolver
         }
     };
 
+    // An object is known by its load address and the id of its file name.
+    using object_key_t = std::pair<uintptr_t, size_t>;
+
+    struct SegmentGeneration
+    {
+        // The generation that this one is an overlay on, or 0 if it has all
+        // of its segments itself, and how many overlays there are down to
+        // that one.
+        size_t base{0};
+        size_t depth{0};
+        std::vector<MemorySegment> segments;
+        // The objects whose segments in the generations below are gone.
+        std::vector<object_key_t> removed;
+    };
+
+    static constexpr size_t MAX_OVERLAY_DEPTH = 16;
+
     // Methods
     void addSegment(
             const std::string& filename,
             backtrace_state* backtrace_state,
             size_t filename_index,
             uintptr_t address_start,
-            uintptr_t address_end);
-    std::vector<MemorySegment>& currentSegments();
+            uintptr_t address_end,
+            uintptr_t load_address,
+            std::string_view build_id);
+    SegmentGeneration& currentGeneration();
+    void sortCurrentGeneration();
+    std::vector<MemorySegment> visibleSegments(size_t generation) const;
+    const MemorySegment* findSegment(uintptr_t ip, size_t generation);
     resolved_frames_t resolveFromSegments(uintptr_t ip, size_t generation);
+    resolved_frames_t
+    makeResolvedFrames(const MemorySegment& segment, const MemorySegment::ExpandedFrame& expanded_frame);
+    resolved_frames_t deferResolution(uintptr_t ip, size_t generation);
+    resolved_frames_t makeProvisionalFrames(const MemorySegment& segment, uintptr_t ip);
 
     // Data members
-    std::unordered_map<size_t, std::vector<MemorySegment>> d_segments;
+    std::unordered_map<size_t, SegmentGeneration> d_generations;
     bool d_are_segments_dirty = false;
     std::unordered_map<const char*, backtrace_state*> d_backtrace_states;
     std::shared_ptr<StringStorage> d_string_storage{std::make_shared<StringStorage>()};
     mutable std::unordered_map<ips_cache_pair_t, resolved_frames_t, ips_cache_pair_hash>
             d_resolved_ips_cache;
+    SymbolCache d_symbol_cache;
+    bool d_defer_resolution{false};
+    std::vector<DeferredIp> d_deferred;
+    // The provisional frames of the addresses that are still deferred.
+    std::unordered_map<ips_cache_pair_t, resolved_frames_t, ips_cache_pair_hash> d_provisional_ips_cache;
 };
 }  // namespace memray::native_resolver
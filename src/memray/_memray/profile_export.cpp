@@ -0,0 +1,308 @@
+#include <algorithm>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+#include "flat_hash_map.h"
+#include "profile_export.h"
+
+namespace memray::api {
+
+namespace {
+
+struct StackUsage
+{
+    size_t stack_index;
+    size_t bytes;
+    size_t n_allocations;
+};
+
+// What the locations of a capture had at its high water mark, or at its end,
+// put together by stack and ordered by the index of the stack.
+std::vector<StackUsage>
+usageByStack(const CaptureFamily::Capture& capture, bool high_water_mark)
+{
+    containers::FlatHashMap<size_t, size_t> positions;
+    std::vector<StackUsage> usage;
+    for (const auto& allocation : capture.allocations) {
+        size_t n_allocations = high_water_mark ? allocation.n_allocations_in_high_water_mark
+                                               : allocation.n_allocations_leaked;
+        if (!n_allocations) {
+            continue;
+        }
+        auto [it, inserted] = positions.try_emplace(allocation.frame_index, usage.size());
+        if (inserted) {
+            usage.push_back(StackUsage{allocation.frame_index, 0, 0});
+        }
+        StackUsage& stack_usage = usage[it->second];
+        stack_usage.bytes += high_water_mark ? allocation.bytes_in_high_water_mark
+                                             : allocation.bytes_leaked;
+        stack_usage.n_allocations += n_allocations;
+    }
+    std::sort(usage.begin(), usage.end(), [](const StackUsage& lhs, const StackUsage& rhs) {
+        return lhs.stack_index < rhs.stack_index;
+    });
+    return usage;
+}
+
+// The numbers of the fields of the messages of profile.proto that are used.
+enum ProfileField : uint32_t {
+    PROFILE_SAMPLE_TYPE = 1,
+    PROFILE_SAMPLE = 2,
+    PROFILE_LOCATION = 4,
+    PROFILE_FUNCTION = 5,
+    PROFILE_STRING_TABLE = 6,
+    PROFILE_TIME_NANOS = 9,
+    PROFILE_DURATION_NANOS = 10,
+    PROFILE_DEFAULT_SAMPLE_TYPE = 14,
+};
+enum ValueTypeField : uint32_t {
+    VALUE_TYPE_TYPE = 1,
+    VALUE_TYPE_UNIT = 2,
+};
+enum SampleField : uint32_t {
+    SAMPLE_LOCATION_ID = 1,
+    SAMPLE_VALUE = 2,
+};
+enum LocationField : uint32_t {
+    LOCATION_ID = 1,
+    LOCATION_LINE = 4,
+};
+enum LineField : uint32_t {
+    LINE_FUNCTION_ID = 1,
+    LINE_LINE = 2,
+};
+enum FunctionField : uint32_t {
+    FUNCTION_ID = 1,
+    FUNCTION_NAME = 2,
+    FUNCTION_SYSTEM_NAME = 3,
+    FUNCTION_FILENAME = 4,
+};
+
+void
+appendVarint(std::string& data, uint64_t value)
+{
+    while (value >= 0x80) {
+        data.push_back(static_cast<char>(value | 0x80));
+        value >>= 7;
+    }
+    data.push_back(static_cast<char>(value));
+}
+
+// A protocol buffers message, encoded as its fields are added. Only the wire
+// types that a pprof profile needs are supported.
+class ProtobufMessage
+{
+  public:
+    void addVarint(uint32_t field, uint64_t value)
+    {
+        appendKey(field, 0);
+        appendVarint(d_data, value);
+    }
+
+    void addBytes(uint32_t field, std::string_view bytes)
+    {
+        appendKey(field, 2);
+        appendVarint(d_data, bytes.size());
+        d_data.append(bytes);
+    }
+
+    void addMessage(uint32_t field, const ProtobufMessage& message)
+    {
+        addBytes(field, message.d_data);
+    }
+
+    template<typename T>
+    void addPacked(uint32_t field, const T& values)
+    {
+        d_packed.clear();
+        for (uint64_t value : values) {
+            appendVarint(d_packed, value);
+        }
+        addBytes(field, d_packed);
+    }
+
+    void clear()
+    {
+        d_data.clear();
+    }
+
+    std::string& data()
+    {
+        return d_data;
+    }
+
+  private:
+    void appendKey(uint32_t field, uint8_t wire_type)
+    {
+        appendVarint(d_data, static_cast<uint64_t>(field) << 3 | wire_type);
+    }
+
+    std::string d_data;
+    std::string d_packed;
+};
+
+// The strings of a profile, which the other messages refer to by their index.
+// The views must outlive the table.
+class StringTable
+{
+  public:
+    uint64_t id(std::string_view str)
+    {
+        auto [it, inserted] = d_ids.try_emplace(str, d_strings.size());
+        if (inserted) {
+            d_strings.push_back(str);
+        }
+        return it->second;
+    }
+
+    void write(ProtobufMessage& profile) const
+    {
+        for (const auto& str : d_strings) {
+            profile.addBytes(PROFILE_STRING_TABLE, str);
+        }
+    }
+
+  private:
+    // The first string of the table is always the empty one.
+    std::unordered_map<std::string_view, uint64_t> d_ids{{"", 0}};
+    std::vector<std::string_view> d_strings{""};
+};
+
+}  // unnamed namespace
+
+ProfileExporter::ProfileExporter(const std::string& file_name, const std::string& symbol_cache_dir)
+: d_family({file_name}, 1, symbol_cache_dir)
+{
+}
+
+void
+ProfileExporter::readAll()
+{
+    d_family.readAll();
+}
+
+const CaptureFamily::Capture&
+ProfileExporter::capture() const
+{
+    return d_family.capture(0);
+}
+
+std::string
+ProfileExporter::pprofProfile(bool high_water_mark) const
+{
+    RecordReader& reader = *capture().reader;
+    StringTable strings;
+    ProtobufMessage profile;
+    ProtobufMessage message;
+    ProtobufMessage line;
+
+    const uint64_t count_type = strings.id("inuse_objects");
+    const uint64_t bytes_type = strings.id("inuse_space");
+    for (auto [type, unit] : {std::make_pair(count_type, strings.id("count")),
+                              std::make_pair(bytes_type, strings.id("bytes"))})
+    {
+        message.clear();
+        message.addVarint(VALUE_TYPE_TYPE, type);
+        message.addVarint(VALUE_TYPE_UNIT, unit);
+        profile.addMessage(PROFILE_SAMPLE_TYPE, message);
+    }
+    profile.addVarint(PROFILE_DEFAULT_SAMPLE_TYPE, bytes_type);
+
+    const TrackerStats stats = reader.getHeader().stats;
+    constexpr uint64_t nanos_per_milli = 1000000;
+    profile.addVarint(PROFILE_TIME_NANOS, stats.start_time * nanos_per_milli);
+    if (stats.end_time > stats.start_time) {
+        profile.addVarint(PROFILE_DURATION_NANOS, (stats.end_time - stats.start_time) * nanos_per_milli);
+    }
+
+    // Each frame of the capture is a location, and each function, which is
+    // told apart by its name and its file, is shared by its locations.
+    containers::FlatHashMap<frame_id_t, uint64_t> location_ids;
+    containers::FlatHashMap<uint64_t, uint64_t> function_ids;
+    std::vector<frame_id_t> frame_ids;
+    std::vector<uint64_t> sample_location_ids;
+    for (const auto& usage : usageByStack(capture(), high_water_mark)) {
+        reader.getStackFrameIds(usage.stack_index, frame_ids);
+        sample_location_ids.clear();
+        for (frame_id_t frame_id : frame_ids) {
+            auto [location_it, new_location] =
+                    location_ids.try_emplace(frame_id, location_ids.size() + 1);
+            sample_location_ids.push_back(location_it->second);
+            if (!new_location) {
+                continue;
+            }
+
+            std::string_view function_name;
+            std::string_view filename;
+            int lineno;
+            reader.getFrameInfo(frame_id, function_name, filename, lineno);
+            const uint64_t name_id = strings.id(function_name);
+            const uint64_t filename_id = strings.id(filename);
+            auto [function_it, new_function] =
+                    function_ids.try_emplace(name_id << 32 | filename_id, function_ids.size() + 1);
+            if (new_function) {
+                message.clear();
+                message.addVarint(FUNCTION_ID, function_it->second);
+                message.addVarint(FUNCTION_NAME, name_id);
+                message.addVarint(FUNCTION_SYSTEM_NAME, name_id);
+                message.addVarint(FUNCTION_FILENAME, filename_id);
+                profile.addMessage(PROFILE_FUNCTION, message);
+            }
+
+            line.clear();
+            line.addVarint(LINE_FUNCTION_ID, function_it->second);
+            line.addVarint(LINE_LINE, lineno);
+            message.clear();
+            message.addVarint(LOCATION_ID, location_it->second);
+            message.addMessage(LOCATION_LINE, line);
+            profile.addMessage(PROFILE_LOCATION, message);
+        }
+
+        message.clear();
+        message.addPacked(SAMPLE_LOCATION_ID, sample_location_ids);
+        message.addPacked(SAMPLE_VALUE, std::vector<uint64_t>{usage.n_allocations, usage.bytes});
+        profile.addMessage(PROFILE_SAMPLE, message);
+    }
+
+    strings.write(profile);
+    return std::move(profile.data());
+}
+
+std::string
+ProfileExporter::collapsedStacks(bool high_water_mark) const
+{
+    RecordReader& reader = *capture().reader;
+    std::string output;
+    containers::FlatHashMap<frame_id_t, std::string> frame_names;
+    std::vector<frame_id_t> frame_ids;
+    for (const auto& usage : usageByStack(capture(), high_water_mark)) {
+        reader.getStackFrameIds(usage.stack_index, frame_ids);
+        if (frame_ids.empty()) {
+            output += "[unknown]";
+        }
+        for (auto it = frame_ids.rbegin(); it != frame_ids.rend(); ++it) {
+            auto [name_it, inserted] = frame_names.try_emplace(*it);
+            if (inserted) {
+                std::string_view function_name;
+                std::string_view filename;
+                int lineno;
+                reader.getFrameInfo(*it, function_name, filename, lineno);
+                name_it->second.append(function_name)
+                        .append(" (")
+                        .append(filename)
+                        .append(":")
+                        .append(std::to_string(lineno))
+                        .append(")");
+            }
+            if (it != frame_ids.rbegin()) {
+                output += ';';
+            }
+            output += name_it->second;
+        }
+        output.append(" ").append(std::to_string(usage.bytes)).append("\n");
+    }
+    return output;
+}
+
+}  // namespace memray::api
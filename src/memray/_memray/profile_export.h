@@ -0,0 +1,42 @@
+#pragma once
+
+#include <cstddef>
+#include <string>
+
+#include "capture_family.h"
+
+namespace memray::api {
+
+/**
+ * Write the snapshot of a capture in the formats that other tools read.
+ *
+ * The capture is read like a CaptureFamily reads each of its files, so it's
+ * reduced by location as it's read and the history of the allocations is
+ * never kept. The locations are then put together by their Python stacks,
+ * whatever thread made them, and written out without ever creating a Python
+ * object for them. The frames are the ones of the Python stacks only.
+ **/
+class ProfileExporter
+{
+  public:
+    ProfileExporter(const std::string& file_name, const std::string& symbol_cache_dir);
+
+    // Read the file to its end. This doesn't need the GIL.
+    void readAll();
+
+    const CaptureFamily::Capture& capture() const;
+    // A pprof profile, serialized but not compressed, with the number of
+    // allocations and the bytes that each stack had at the high water mark
+    // or at the end.
+    std::string pprofProfile(bool high_water_mark) const;
+    // A line for each stack, with its frames from the outermost one on,
+    // separated by semicolons, and the bytes that it had, which is the
+    // format that flamegraph.pl and most other flame graph tools read.
+    std::string collapsedStacks(bool high_water_mark) const;
+
+  private:
+    // Data members
+    CaptureFamily d_family;
+};
+
+}  // namespace memray::api
@@ -0,0 +1,12 @@
+from _memray.capture_family cimport Capture
+from libcpp cimport bool
+from libcpp.string cimport string
+
+
+cdef extern from "profile_export.h" namespace "memray::api":
+    cdef cppclass ProfileExporter:
+        ProfileExporter(string file_name, string symbol_cache_dir) except+
+        void readAll() nogil except+
+        const Capture& capture() except+
+        string pprofProfile(bool high_water_mark) nogil except+
+        string collapsedStacks(bool high_water_mark) nogil except+
@@ -1,18 +1,26 @@
 #include "python_helpers.h"
 
 namespace memray::python_helpers {
+
+PyUnicode_Cache::~PyUnicode_Cache()
+{
+    for (PyObject* pystring : d_objects) {
+        Py_XDECREF(pystring);
+    }
+}
+
 PyObject*
-PyUnicode_Cache::getUnicodeObject(const std::string& str)
+PyUnicode_Cache::createUnicodeObject(id_t id, std::string_view str)
 {
-    auto it = d_cache.find(str);
-    if (it == d_cache.end()) {
-        PyObject* pystring = PyUnicode_FromString(str.c_str());
-        if (pystring == nullptr) {
-            return nullptr;
-        }
-        auto pystring_capsule = py_capsule_t(pystring, [](auto obj) { Py_DECREF(obj); });
-        it = d_cache.emplace(str, std::move(pystring_capsule)).first;
+    PyObject* pystring = PyUnicode_FromStringAndSize(str.data(), str.size());
+    if (pystring == nullptr) {
+        return nullptr;
+    }
+    if (id >= d_objects.size()) {
+        d_objects.resize(static_cast<size_t>(id) + 1, nullptr);
     }
-    return it->second.get();
+    d_objects[id] = pystring;
+    return pystring;
 }
+
 }  // namespace memray::python_helpers
@@ -1,20 +1,95 @@
 #pragma once
 
-#include <functional>
-#include <memory>
-#include <string>
-#include <unordered_map>
+#include <cstdint>
+#include <string_view>
+#include <vector>
 
 #include "Python.h"
 
+#include "flat_hash_map.h"
+
 namespace memray::python_helpers {
+
+/**
+ * Python string objects for strings that were already given ids.
+ *
+ * The ids are the ones of an interning table, like the StringStorage of the
+ * symbol resolver, so they are small and dense and the cache is a vector
+ * indexed by them. Each string is only turned into a Python object the first
+ * time its id is seen, and finding it afterwards doesn't have to look at its
+ * characters at all. A cache must only be used with the ids of one table.
+ **/
 class PyUnicode_Cache
 {
   public:
-    PyObject* getUnicodeObject(const std::string& str);
+    using id_t = uint32_t;
+
+    // Constructors
+    PyUnicode_Cache() = default;
+    PyUnicode_Cache(const PyUnicode_Cache&) = delete;
+    PyUnicode_Cache& operator=(const PyUnicode_Cache&) = delete;
+    ~PyUnicode_Cache();
+
+    // Methods
+
+    // Return a borrowed reference to the string with the given id, or
+    // nullptr with an exception set if it can't be created.
+    PyObject* getUnicodeObject(id_t id, std::string_view str)
+    {
+        if (id < d_objects.size() && d_objects[id] != nullptr) {
+            return d_objects[id];
+        }
+        return createUnicodeObject(id, str);
+    }
 
   private:
-    using py_capsule_t = std::unique_ptr<PyObject, std::function<void(PyObject*)>>;
-    std::unordered_map<std::string, py_capsule_t> d_cache{};
+    // Methods
+    PyObject* createUnicodeObject(id_t id, std::string_view str);
+
+    // Data members
+    std::vector<PyObject*> d_objects{};
 };
+
+/**
+ * Python objects that took some work to build, kept by a key that they can
+ * be built again from. The cache owns a reference to each of them.
+ **/
+template<typename Key, typename Hash = std::hash<Key>>
+class PyObject_Cache
+{
+  public:
+    // Constructors
+    PyObject_Cache() = default;
+    PyObject_Cache(const PyObject_Cache&) = delete;
+    PyObject_Cache& operator=(const PyObject_Cache&) = delete;
+
+    ~PyObject_Cache()
+    {
+        for (auto& entry : d_objects) {
+            Py_DECREF(entry.second);
+        }
+    }
+
+    // Methods
+
+    // Return a borrowed reference to the object kept for the key, or nullptr.
+    PyObject* find(const Key& key) const
+    {
+        auto it = d_objects.find(key);
+        return it != d_objects.end() ? it->second : nullptr;
+    }
+
+    void insert(const Key& key, PyObject* object)
+    {
+        auto [it, inserted] = d_objects.try_emplace(key, object);
+        if (inserted) {
+            Py_INCREF(object);
+        }
+    }
+
+  private:
+    // Data members
+    containers::FlatHashMap<Key, PyObject*, Hash> d_objects{};
+};
+
 }  // namespace memray::python_helpers
@@ -0,0 +1,124 @@
+#include "read_progress.h"
+
+namespace memray::api {
+
+ReadProgress::ReadProgress(callback_t callback, release_t release, void* data, double interval_seconds)
+: d_callback(callback)
+, d_release(release)
+, d_data(data)
+, d_interval(std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+          std::chrono::duration<double>(interval_seconds)))
+{
+}
+
+ReadProgress::~ReadProgress()
+{
+    if (d_release) {
+        d_release(d_data);
+    }
+}
+
+void*
+ReadProgress::data() const noexcept
+{
+    return d_data;
+}
+
+void
+ReadProgress::startPhase(ReadPhase phase, uint64_t total)
+{
+    d_phase = phase;
+    d_in_phase = true;
+    d_total = total;
+    d_completed.store(0, std::memory_order_relaxed);
+    d_n_records.store(0, std::memory_order_relaxed);
+    d_phase_start = d_last_report = std::chrono::steady_clock::now();
+    report(false);
+}
+
+void
+ReadProgress::advance(uint64_t completed, uint64_t n_records) noexcept
+{
+    d_completed.fetch_add(completed, std::memory_order_relaxed);
+    if (n_records) {
+        d_n_records.fetch_add(n_records, std::memory_order_relaxed);
+    }
+}
+
+bool
+ReadProgress::update()
+{
+    if (!d_cancelled.load(std::memory_order_relaxed)
+        && std::chrono::steady_clock::now() - d_last_report >= d_interval)
+    {
+        report(false);
+    }
+    return !cancelled();
+}
+
+void
+ReadProgress::finishPhase()
+{
+    if (!d_in_phase) {
+        return;
+    }
+    report(true);
+    d_in_phase = false;
+}
+
+bool
+ReadProgress::cancelled() const noexcept
+{
+    return d_cancelled.load(std::memory_order_relaxed);
+}
+
+void
+ReadProgress::waitForThreads(size_t n_threads)
+{
+    std::unique_lock<std::mutex> lock(d_threads_mutex);
+    while (d_n_finished_threads < n_threads) {
+        auto all_finished = [&] { return d_n_finished_threads >= n_threads; };
+        if (d_threads_done.wait_for(lock, d_interval, all_finished)) {
+            break;
+        }
+        lock.unlock();
+        update();
+        lock.lock();
+    }
+    d_n_finished_threads = 0;
+}
+
+void
+ReadProgress::threadFinished()
+{
+    {
+        std::lock_guard<std::mutex> lock(d_threads_mutex);
+        ++d_n_finished_threads;
+    }
+    d_threads_done.notify_one();
+}
+
+bool
+ReadProgress::report(bool finished)
+{
+    if (cancelled() || !d_in_phase) {
+        return false;
+    }
+    auto now = std::chrono::steady_clock::now();
+    d_last_report = now;
+    uint64_t completed = d_completed.load(std::memory_order_relaxed);
+    ProgressUpdate progress_update{
+            d_phase,
+            d_total ? std::min(completed, d_total) : completed,
+            d_total,
+            d_n_records.load(std::memory_order_relaxed),
+            std::chrono::duration<double>(now - d_phase_start).count(),
+            finished};
+    if (!d_callback(progress_update, d_data)) {
+        d_cancelled.store(true, std::memory_order_relaxed);
+        return false;
+    }
+    return true;
+}
+
+}  // namespace memray::api
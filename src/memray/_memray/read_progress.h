@@ -0,0 +1,86 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+
+namespace memray::api {
+
+// What a long read is busy with. Each phase counts its progress in its own
+// units: bytes of the file when parsing, allocations when looking for the
+// high water mark, and instruction pointers when symbolizing.
+enum class ReadPhase {
+    PARSE = 1,
+    HIGH_WATERMARK = 2,
+    SYMBOLIZATION = 3,
+};
+
+struct ProgressUpdate
+{
+    ReadPhase phase;
+    uint64_t completed;
+    // 0 if it isn't known.
+    uint64_t total;
+    // The records parsed so far, in the parse phase.
+    uint64_t n_records;
+    double elapsed_seconds;
+    // Set on the last update of the phase.
+    bool finished;
+};
+
+// Periodic reports of the progress of a read, given to a callback at most
+// once per interval. The work can be split among threads, which only add to
+// the counters, and the updates are only ever made from the thread that
+// owns the read, so the callback doesn't need to be thread safe. Returning
+// false from it cancels what's left of the read.
+class ReadProgress
+{
+  public:
+    using callback_t = bool (*)(const ProgressUpdate& update, void* data);
+    // Called when the progress is destroyed, to let go of the data.
+    using release_t = void (*)(void* data);
+
+    ReadProgress(callback_t callback, release_t release, void* data, double interval_seconds);
+    ~ReadProgress();
+    ReadProgress(const ReadProgress&) = delete;
+    ReadProgress& operator=(const ReadProgress&) = delete;
+
+    void* data() const noexcept;
+    void startPhase(ReadPhase phase, uint64_t total);
+    // Safe to call from any thread.
+    void advance(uint64_t completed, uint64_t n_records = 0) noexcept;
+    // Report what's been done, if the interval has passed since the last
+    // report. Returns false once the read has been cancelled.
+    bool update();
+    void finishPhase();
+    bool cancelled() const noexcept;
+
+    // Wait for n_threads threads that call threadFinished() when they're
+    // done, reporting their progress meanwhile.
+    void waitForThreads(size_t n_threads);
+    void threadFinished();
+
+  private:
+    bool report(bool finished);
+
+    callback_t d_callback;
+    release_t d_release;
+    void* d_data;
+    std::chrono::steady_clock::duration d_interval;
+    ReadPhase d_phase{ReadPhase::PARSE};
+    bool d_in_phase{false};
+    uint64_t d_total{0};
+    std::chrono::steady_clock::time_point d_phase_start{};
+    std::chrono::steady_clock::time_point d_last_report{};
+    std::atomic<uint64_t> d_completed{0};
+    std::atomic<uint64_t> d_n_records{0};
+    std::atomic<bool> d_cancelled{false};
+
+    std::mutex d_threads_mutex;
+    std::condition_variable d_threads_done;
+    size_t d_n_finished_threads{0};
+};
+
+}  // namespace memray::api
@@ -0,0 +1,30 @@
+from libc.stdint cimport uint64_t
+from libcpp cimport bool
+
+
+cdef extern from "read_progress.h" namespace "memray::api":
+    cdef enum ReadPhase 'memray::api::ReadPhase':
+        ReadPhaseParse 'memray::api::ReadPhase::PARSE'
+        ReadPhaseHighWatermark 'memray::api::ReadPhase::HIGH_WATERMARK'
+        ReadPhaseSymbolization 'memray::api::ReadPhase::SYMBOLIZATION'
+
+    struct ProgressUpdate:
+        ReadPhase phase
+        uint64_t completed
+        uint64_t total
+        uint64_t n_records
+        double elapsed_seconds
+        bool finished
+
+    ctypedef bool (*progress_callback_t)(const ProgressUpdate& update, void* data) noexcept
+    ctypedef void (*progress_release_t)(void* data) noexcept
+
+    cdef cppclass ReadProgress:
+        ReadProgress(
+            progress_callback_t callback,
+            progress_release_t release,
+            void* data,
+            double interval_seconds,
+        )
+        void* data()
+        bool cancelled()
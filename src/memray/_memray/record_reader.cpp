@@ -1,12 +1,17 @@
 #define __STDC_FORMAT_MACROS
 #include <algorithm>
+#include <chrono>
+#include <cstddef>
 #include <cstdio>
+#include <cstring>
 #include <inttypes.h>
 #include <stdexcept>
+#include <thread>
 #include <unordered_map>
 
 #include "Python.h"
 
+#include "elf_utils.h"
 #include "exceptions.h"
 #include "hooks.h"
 #include "logging.h"
@@ -22,6 +27,9 @@ using namespace exception;
 
 namespace {  // unnamed
 
+// How many records are read between reports of the progress.
+constexpr size_t PROGRESS_BATCH_SIZE = 4096;
+
 const char*
 allocatorName(hooks::Allocator allocator)
 {
@@ -46,11 +54,114 @@ allocatorName(hooks::Allocator allocator)
             return "mmap";
         case hooks::Allocator::MUNMAP:
             return "munmap";
+        case hooks::Allocator::PYMALLOC_MALLOC:
+            return "pymalloc_malloc";
+        case hooks::Allocator::PYMALLOC_CALLOC:
+            return "pymalloc_calloc";
+        case hooks::Allocator::PYMALLOC_REALLOC:
+            return "pymalloc_realloc";
+        case hooks::Allocator::PYMALLOC_FREE:
+            return "pymalloc_free";
     }
 
     return nullptr;
 }
 
+void
+printAllocationRecord(const AllocationRecord& record)
+{
+    const char* allocator = allocatorName(record.allocator);
+
+    std::string unknownAllocator;
+    if (!allocator) {
+        unknownAllocator = "<unknown allocator " + std::to_string((int)record.allocator) + ">";
+        allocator = unknownAllocator.c_str();
+    }
+
+    printf("tid=%lu address=%p size=%zd allocator=%s native_frame_id=%zd\n",
+           record.tid,
+           (void*)record.address,
+           record.size,
+           allocator,
+           record.native_frame_id);
+}
+
+struct PairHash
+{
+    template<typename First, typename Second>
+    size_t operator()(const std::pair<First, Second>& pair) const noexcept
+    {
+        return containers::mixHash(containers::combineHash(pair.first, pair.second));
+    }
+};
+
+// Build the (frames, stacks, record_stacks) tuple returned by the methods
+// that resolve stacks in bulk. The records with the same key share a stack,
+// and add_frames is only called for the first of them: it appends the
+// positions in the list of frames of the frames of its stack to the vector
+// that it gets, adding the frames not seen before to the list, and returns
+// false if a Python exception is raised.
+template<typename Key, typename Hash, typename GetKey, typename AddFrames>
+PyObject*
+makeStackTable(size_t n_records, GetKey get_key, AddFrames add_frames)
+{
+    PyObject* frames = PyList_New(0);
+    PyObject* stacks = PyList_New(0);
+    PyObject* record_stacks = PyList_New(static_cast<Py_ssize_t>(n_records));
+
+    auto fill = [&]() -> bool {
+        if (frames == nullptr || stacks == nullptr || record_stacks == nullptr) {
+            return false;
+        }
+        containers::FlatHashMap<Key, size_t, Hash> stack_positions;
+        std::vector<size_t> positions;
+        for (size_t i = 0; i < n_records; ++i) {
+            auto [it, inserted] = stack_positions.try_emplace(get_key(i), stack_positions.size());
+            if (inserted) {
+                positions.clear();
+                if (!add_frames(i, frames, positions)) {
+                    return false;
+                }
+                PyObject* stack = PyTuple_New(static_cast<Py_ssize_t>(positions.size()));
+                if (stack == nullptr) {
+                    return false;
+                }
+                for (size_t j = 0; j < positions.size(); ++j) {
+                    PyObject* position = PyLong_FromSize_t(positions[j]);
+                    if (position == nullptr) {
+                        Py_DECREF(stack);
+                        return false;
+                    }
+                    PyTuple_SET_ITEM(stack, j, position);
+                }
+                int ret = PyList_Append(stacks, stack);
+                Py_DECREF(stack);
+                if (ret != 0) {
+                    return false;
+                }
+            }
+            PyObject* stack_position = PyLong_FromSize_t(it->second);
+            if (stack_position == nullptr) {
+                return false;
+            }
+            PyList_SET_ITEM(record_stacks, i, stack_position);
+        }
+        return true;
+    };
+
+    PyObject* table = fill() ? PyTuple_New(3) : nullptr;
+    if (table == nullptr) {
+        Py_XDECREF(frames);
+        Py_XDECREF(stacks);
+        Py_XDECREF(record_stacks);
+        return nullptr;
+    }
+    PyTuple_SET_ITEM(table, 0, frames);
+    PyTuple_SET_ITEM(table, 1, stacks);
+    PyTuple_SET_ITEM(table, 2, record_stacks);
+    return table;
+}
+
 }  // unnamed namespace
 
 void
@@ -62,7 +173,7 @@ RecordReader::readHeader(HeaderRecord& header)
                 "The provided input file does not look like a binary generated by memray.");
     }
     d_input->read(reinterpret_cast<char*>(&header.version), sizeof(header.version));
-    if (header.version != CURRENT_HEADER_VERSION) {
+    if (header.version < OLDEST_SUPPORTED_HEADER_VERSION || header.version > CURRENT_HEADER_VERSION) {
         throw std::ios_base::failure(
                 "The provided input file is incompatible with this version of memray.");
     }
@@ -82,6 +193,69 @@ RecordReader::readHeader(HeaderRecord& header)
                 sizeof(header.python_allocator))) {
         throw std::ios_base::failure("Failed to read Python allocator type from input file.");
     }
+    if (header.version >= 7
+        && !d_input->read(reinterpret_cast<char*>(&header.sample_rate), sizeof(header.sample_rate)))
+    {
+        throw std::ios_base::failure("Failed to read sample rate from input file.");
+    }
+    if (header.version >= 7
+        && !d_input->read(reinterpret_cast<char*>(&header.file_format), sizeof(header.file_format)))
+    {
+        throw std::ios_base::failure("Failed to read file format from input file.");
+    }
+    if (header.version >= 7
+        && !d_input->read(
+                reinterpret_cast<char*>(&header.dropped_records),
+                sizeof(header.dropped_records)))
+    {
+        throw std::ios_base::failure("Failed to read dropped records count from input file.");
+    }
+    if (header.version >= 7
+        && !d_input->read(
+                reinterpret_cast<char*>(&header.checkpoint_index_offset),
+                sizeof(header.checkpoint_index_offset)))
+    {
+        throw std::ios_base::failure("Failed to read checkpoint index offset from input file.");
+    }
+    if (header.version >= 7 && !readOverhead(header.overhead)) {
+        throw std::ios_base::failure("Failed to read tracker overhead from input file.");
+    }
+}
+
+bool
+RecordReader::readOverhead(TrackerOverhead& overhead)
+{
+    // The records are counted by type, for every type that the writer knew
+    // about. The tokens are a single byte, so there can't be more than 256.
+    uint32_t n_types;
+    if (!d_input->read(reinterpret_cast<char*>(&overhead), offsetof(TrackerOverhead, n_records))
+        || !d_input->read(reinterpret_cast<char*>(&n_types), sizeof(n_types)) || n_types > 256)
+    {
+        return false;
+    }
+    std::vector<uint64_t> counts(2 * n_types);
+    if (!d_input->read(reinterpret_cast<char*>(counts.data()), counts.size() * sizeof(counts[0]))) {
+        return false;
+    }
+    const size_t n_known = std::min<size_t>(n_types, N_RECORD_TYPES);
+    std::copy_n(counts.begin(), n_known, overhead.n_records);
+    std::copy_n(counts.begin() + n_types, n_known, overhead.n_bytes);
+    return true;
+}
+
+bool
+RecordReader::readRecordType(RecordType& record_type)
+{
+    if (d_header.version < 7) {
+        // Older versions used a full int for every token.
+        int token;
+        if (!d_input->read(reinterpret_cast<char*>(&token), sizeof(token))) {
+            return false;
+        }
+        record_type = static_cast<RecordType>(token);
+        return true;
+    }
+    return d_input->read(reinterpret_cast<char*>(&record_type), sizeof(record_type));
 }
 
 RecordReader::RecordReader(std::unique_ptr<Source> source)
@@ -103,6 +277,17 @@ RecordReader::RecordReader(std::unique_ptr<Source> source)
     d_native_frames.reserve(d_header.native_traces ? 2048 : 0);
 }
 
+RecordReader::RecordReader(std::unique_ptr<Source> source, const HeaderRecord& header, bool skip_header)
+: d_input(std::move(source))
+, d_header(header)
+, d_reading_range(true)
+{
+    if (skip_header) {
+        HeaderRecord ignored;
+        readHeader(ignored);
+    }
+}
+
 void
 RecordReader::close() noexcept
 {
@@ -115,39 +300,79 @@ RecordReader::isOpen() const noexcept
     return d_input->is_open();
 }
 
+thread_id_t
+RecordReader::legacyThreadId(thread_id_t tid)
+{
+    // Files from before version 7 identify threads by their pthread_t. Map
+    // those to small integers, as the tracker does now.
+    return d_legacy_thread_ids.emplace(tid, d_legacy_thread_ids.size() + 1).first->second;
+}
+
+RecordReader::stack_t&
+RecordReader::stackForThread(thread_id_t tid)
+{
+    // A thread stays where its stack was first kept, even once the vector
+    // has grown to cover its id.
+    if (!d_sparse_stack_traces.empty()) {
+        auto it = d_sparse_stack_traces.find(tid);
+        if (it != d_sparse_stack_traces.end()) {
+            return it->second;
+        }
+    }
+    if (tid >= d_stack_traces.size()) {
+        if (tid - d_stack_traces.size() >= MAX_THREAD_ID_GAP) {
+            return d_sparse_stack_traces[tid];
+        }
+        d_stack_traces.resize(tid + 1);
+    }
+    return d_stack_traces[tid];
+}
+
+void
+RecordReader::pushFrame(thread_id_t tid, frame_id_t frame_id)
+{
+    auto& stack = stackForThread(tid);
+    FrameTree::index_t current_stack_id = stack.empty() ? 0 : stack.back();
+    FrameTree::index_t new_stack_id = d_tree.getTraceIndex(current_stack_id, frame_id);
+    stack.push_back(new_stack_id);
+}
+
+void
+RecordReader::popFrames(thread_id_t tid, uint8_t count)
+{
+    auto& stack = stackForThread(tid);
+    assert(stack.size() >= count);
+    stack.resize(stack.size() - count);
+}
+
+void
+RecordReader::updateFrameLine(thread_id_t tid, frame_id_t frame_id)
+{
+    popFrames(tid, 1);
+    pushFrame(tid, frame_id);
+}
+
 bool
 RecordReader::parseFramePush()
 {
+    // Only files from before version 7 have this record outside of a chunk.
     FramePush record{};
     if (!d_input->read(reinterpret_cast<char*>(&record), sizeof(record))) {
         return false;
     }
-    thread_id_t tid = record.tid;
-    auto [it, inserted] = d_stack_traces.emplace(tid, stack_t{});
-    auto& stack = it->second;
-    if (inserted) {
-        stack.reserve(1024);
-    }
-    FrameTree::index_t current_stack_id = stack.empty() ? 0 : stack.back();
-    FrameTree::index_t new_stack_id = d_tree.getTraceIndex(current_stack_id, record.frame_id);
-    stack.push_back(new_stack_id);
+    pushFrame(legacyThreadId(record.tid), record.frame_id);
     return true;
 }
 
 bool
 RecordReader::parseFramePop()
 {
+    // Only files from before version 7 have this record outside of a chunk.
     FramePop record{};
     if (!d_input->read(reinterpret_cast<char*>(&record), sizeof(record))) {
         return false;
     }
-    thread_id_t tid = record.tid;
-
-    assert(!d_stack_traces[tid].empty());
-    while (record.count) {
-        --record.count;
-        d_stack_traces[tid].pop_back();
-    }
+    popFrames(legacyThreadId(record.tid), record.count);
     return true;
 }
 
@@ -155,23 +380,51 @@ bool
 RecordReader::parseFrameIndex()
 {
     tracking_api::pyframe_map_val_t pyframe_val;
+    std::string_view function_name;
+    std::string_view filename;
     if (!d_input->read(reinterpret_cast<char*>(&pyframe_val.first), sizeof(pyframe_val.first))
-        || !d_input->getline(pyframe_val.second.function_name, '\0')
-        || !d_input->getline(pyframe_val.second.filename, '\0')
+        || !d_input->getlineView(function_name, '\0'))
+    {
+        return false;
+    }
+    pyframe_val.second.function_name = function_name;
+    if (!d_input->getlineView(filename, '\0')
         || !d_input->read(
                 reinterpret_cast<char*>(&pyframe_val.second.lineno),
                 sizeof(pyframe_val.second.lineno)))
     {
         return false;
     }
-    std::lock_guard<std::mutex> lock(d_mutex);
-    auto iterator = d_frame_map.insert(pyframe_val);
-    if (!iterator.second) {
+    pyframe_val.second.filename = filename;
+    auto lock = lockIfShared();
+    if (!addFrame(pyframe_val)) {
         throw std::runtime_error("Two entries with the same ID found!");
     }
     return true;
 }
 
+bool
+RecordReader::addFrame(const pyframe_map_val_t& entry)
+{
+    if (!d_frame_map.insert(entry).second) {
+        return false;
+    }
+    const Frame& frame = entry.second;
+    d_frame_string_ids.try_emplace(
+            entry.first,
+            std::make_pair(
+                    d_python_strings.internString(frame.function_name),
+                    d_python_strings.internString(frame.filename)));
+    return true;
+}
+
+PyObject*
+RecordReader::frameToPythonObject(frame_id_t frame_id) const
+{
+    const auto& [function_name_id, filename_id] = d_frame_string_ids.at(frame_id);
+    return d_frame_map.at(frame_id).toPythonObject(d_pystring_cache, function_name_id, filename_id);
+}
+
 bool
 RecordReader::parseNativeFrameIndex()
 {
@@ -179,39 +432,329 @@ RecordReader::parseNativeFrameIndex()
     if (!d_input->read(reinterpret_cast<char*>(&frame), sizeof(UnresolvedNativeFrame))) {
         return false;
     }
-    std::lock_guard<std::mutex> lock(d_mutex);
+    auto lock = lockIfShared();
     d_native_frames.emplace_back(frame);
+    if (d_defer_symbol_resolution) {
+        d_symbol_resolver.requestResolution(frame.ip, d_segment_generation);
+        d_deferred_symbols_cv.notify_one();
+    }
     return true;
 }
 
 bool
 RecordReader::parseAllocationRecord()
 {
+    // Only files from before version 7 have this record outside of a chunk.
+    // Those were written in order and have no sequence numbers.
     AllocationRecord record;
-    if (!d_input->read(reinterpret_cast<char*>(&record), sizeof(AllocationRecord))) {
+    if (!d_input->read(reinterpret_cast<char*>(&record), sizeof(record))) {
         return false;
     }
+    record.tid = legacyThreadId(record.tid);
+    addAllocation(d_next_sequence, record);
+    return true;
+}
+
+void
+RecordReader::addAllocation(
+        sequence_t sequence,
+        const AllocationRecord& record,
+        uintptr_t realloc_old_address)
+{
+    if (d_filtered && !filterKeeps(record, realloc_old_address)) {
+        skipAllocation(sequence);
+        return;
+    }
 
-    auto& stack = d_stack_traces[record.tid];
-    d_allocation_records.emplace_back(Allocation{
+    auto& stack = stackForThread(record.tid);
+    Allocation allocation{
             .record = record,
             .frame_index = stack.empty() ? 0 : stack.back(),
-            .native_segment_generation = d_symbol_resolver.currentSegmentGeneration()});
+            .native_segment_generation = d_segment_generation,
+            .realloc_old_address = realloc_old_address};
+    if (d_filtered && realloc_old_address && !d_filter.includesThread(record.tid)) {
+        allocation = allocation.oldAddressDeallocation();
+    }
+
+    // Make each sampled allocation stand for all the memory that it represents.
+    scaleSampledAllocation(allocation, d_header.sample_rate);
+
+    if (sequence == d_next_sequence && d_pending_allocations.empty()) {
+        // Fast path: nothing that happened before this allocation is missing.
+        d_allocation_records.push_back(allocation);
+        d_n_released_allocations += 1;
+        if (d_reading_range) {
+            d_allocation_sequences.push_back(sequence);
+        }
+        d_next_sequence += 1;
+        d_unreported_allocations += 1;
+    } else {
+        if (d_pending_allocations.empty() || d_pending_allocations.back().first > sequence) {
+            d_pending_runs.push_back(d_pending_allocations.size());
+        }
+        d_pending_allocations.emplace_back(sequence, allocation);
+    }
+}
+
+bool
+RecordReader::filterKeeps(const AllocationRecord& record, uintptr_t realloc_old_address) const
+{
+    if (d_current_time < d_filter.start_time || d_current_time >= d_filter.end_time) {
+        return false;
+    }
+    if (d_filter.includesThread(record.tid) || realloc_old_address) {
+        return true;
+    }
+    auto kind = hooks::allocatorKind(record.allocator);
+    return kind == hooks::AllocatorKind::SIMPLE_DEALLOCATOR
+           || kind == hooks::AllocatorKind::RANGED_DEALLOCATOR;
+}
+
+void
+RecordReader::skipAllocation(sequence_t sequence)
+{
+    // Barriers release the allocations after the ones that are missing, but
+    // there's no need to wait for one if nothing else is missing.
+    if (sequence == d_next_sequence && d_pending_allocations.empty()) {
+        d_next_sequence += 1;
+    }
+}
+
+void
+RecordReader::addCancelledAllocations(const CancelledAllocations& record)
+{
+    // These never were part of the heap at any point that the file tells us
+    // about, so they are kept apart from the allocations that were.
+    auto& stack = stackForThread(record.tid);
+    Allocation allocation{
+            .record = {record.tid, 0, record.bytes, record.allocator, record.native_frame_id},
+            .frame_index = stack.empty() ? 0 : stack.back(),
+            .native_segment_generation = d_segment_generation,
+            .n_allocations = record.count};
+    d_cancelled_allocation_records.emplace_back(allocation);
+}
+
+bool
+RecordReader::parseThreadChunk()
+{
+    ThreadChunk chunk{};
+    if (!d_input->read(reinterpret_cast<char*>(&chunk), sizeof(chunk))) {
+        return false;
+    }
+    d_chunk_data.resize(chunk.size);
+    if (!d_input->read(d_chunk_data.data(), chunk.size)) {
+        return false;
+    }
+
+    // None of the allocations after the end of the filter's time range are
+    // kept, so there's no need to decode them, and the stacks of the threads
+    // that it doesn't select are never needed.
+    if (d_filtered && d_current_time >= d_filter.end_time) {
+        return true;
+    }
+    const bool keep_stack = !d_filtered || d_filter.includesThread(chunk.tid);
+
+    ChunkDecoder decoder(chunk.tid, d_chunk_data.data(), chunk.size);
+    while (true) {
+        RecordType record_type;
+        switch (decoder.next(record_type)) {
+            case ChunkDecoder::Status::END_OF_CHUNK:
+                return true;
+            case ChunkDecoder::Status::ERROR:
+                return false;
+            case ChunkDecoder::Status::RECORD:
+                // The records of the chunk count towards the progress too.
+                ++d_unreported_records;
+                break;
+        }
+        switch (record_type) {
+            case RecordType::ALLOCATION:
+                addAllocation(decoder.sequence(), decoder.allocation());
+                break;
+            case RecordType::REALLOCATION:
+                addAllocation(
+                        decoder.sequence(),
+                        decoder.reallocation().allocation,
+                        decoder.reallocation().old_address);
+                break;
+            case RecordType::CANCELLED_ALLOCATIONS:
+                if (keep_stack) {
+                    addCancelledAllocations(decoder.cancelledAllocations());
+                }
+                break;
+            case RecordType::FRAME_PUSH:
+                if (keep_stack) {
+                    pushFrame(chunk.tid, decoder.framePush().frame_id);
+                }
+                break;
+            case RecordType::FRAME_POP:
+                if (keep_stack) {
+                    popFrames(chunk.tid, decoder.framePop().count);
+                }
+                break;
+            case RecordType::FRAME_LINE_UPDATE:
+                if (keep_stack) {
+                    updateFrameLine(chunk.tid, decoder.frameLineUpdate().frame_id);
+                }
+                break;
+            default:
+                return false;
+        }
+    }
+}
+
+bool
+RecordReader::parseChunkBarrier()
+{
+    ChunkBarrier barrier{};
+    if (!d_input->read(reinterpret_cast<char*>(&barrier), sizeof(barrier))) {
+        return false;
+    }
+    releasePendingAllocations(barrier.next_sequence);
     return true;
 }
 
+bool
+RecordReader::parseCheckpoint()
+{
+    Checkpoint checkpoint{};
+    if (!d_input->read(reinterpret_cast<char*>(&checkpoint), sizeof(checkpoint))) {
+        return false;
+    }
+
+    // When reading from the start, this is what we already have. The threads
+    // that aren't listed have nothing on their stack.
+    d_next_sequence = std::max(d_next_sequence, checkpoint.next_sequence);
+    d_segment_generation = checkpoint.native_segment_generation;
+    for (auto& stack : d_stack_traces) {
+        stack.clear();
+    }
+    d_sparse_stack_traces.clear();
+    std::vector<frame_id_t> frame_ids;
+    for (size_t i = 0; i < checkpoint.n_threads; ++i) {
+        CheckpointStack record{};
+        if (!d_input->read(reinterpret_cast<char*>(&record), sizeof(record))) {
+            return false;
+        }
+        frame_ids.resize(record.depth);
+        if (!d_input->read(
+                    reinterpret_cast<char*>(frame_ids.data()),
+                    record.depth * sizeof(frame_id_t)))
+        {
+            return false;
+        }
+        for (frame_id_t frame_id : frame_ids) {
+            pushFrame(record.tid, frame_id);
+        }
+    }
+    return true;
+}
+
+bool
+RecordReader::parseCheckpointIndex()
+{
+    CheckpointIndex index{};
+    if (!d_input->read(reinterpret_cast<char*>(&index), sizeof(index))) {
+        return false;
+    }
+    d_checkpoint_offsets.resize(index.n_checkpoints);
+    return d_input->read(
+            reinterpret_cast<char*>(d_checkpoint_offsets.data()),
+            index.n_checkpoints * sizeof(uint64_t));
+}
+
+void
+RecordReader::releasePendingAllocations(sequence_t next_sequence)
+{
+    // Allocations from different threads are written in the order in which
+    // their thread buffers were drained. Once we know that no allocation with
+    // a sequence number lower than next_sequence is still to come, all of the
+    // pending ones below it can be released in the order they happened.
+    //
+    // The records of each thread arrive in order, so the pending allocations
+    // are made of a handful of sorted runs that we can merge cheaply.
+    auto& pending = d_pending_allocations;
+    if (pending.empty()) {
+        d_next_sequence = std::max(d_next_sequence, next_sequence);
+        return;
+    }
+
+    struct Run
+    {
+        size_t begin;
+        size_t end;
+    };
+    auto run_is_after = [&](const Run& lhs, const Run& rhs) {
+        return pending[lhs.begin].first > pending[rhs.begin].first;
+    };
+    std::vector<Run> runs;
+    runs.reserve(d_pending_runs.size());
+    for (size_t i = 0; i < d_pending_runs.size(); ++i) {
+        size_t end = i + 1 < d_pending_runs.size() ? d_pending_runs[i + 1] : pending.size();
+        runs.push_back({d_pending_runs[i], end});
+    }
+    std::make_heap(runs.begin(), runs.end(), run_is_after);
+
+    size_t released = 0;
+    while (!runs.empty()) {
+        std::pop_heap(runs.begin(), runs.end(), run_is_after);
+        Run& run = runs.back();
+        sequence_t sequence = pending[run.begin].first;
+        if (sequence >= next_sequence && sequence != d_next_sequence) {
+            std::push_heap(runs.begin(), runs.end(), run_is_after);
+            break;
+        }
+        d_allocation_records.push_back(pending[run.begin].second);
+        if (d_reading_range) {
+            d_allocation_sequences.push_back(sequence);
+        }
+        d_next_sequence = sequence + 1;
+        ++released;
+        if (++run.begin == run.end) {
+            runs.pop_back();
+        } else {
+            std::push_heap(runs.begin(), runs.end(), run_is_after);
+        }
+    }
+    d_unreported_allocations += released;
+    d_n_released_allocations += released;
+    d_next_sequence = std::max(d_next_sequence, next_sequence);
+
+    // Keep whatever is left for the next barrier, reusing the same storage.
+    std::sort(runs.begin(), runs.end(), [](const Run& lhs, const Run& rhs) {
+        return lhs.begin < rhs.begin;
+    });
+    d_pending_runs.clear();
+    size_t kept = 0;
+    for (const auto& run : runs) {
+        d_pending_runs.push_back(kept);
+        if (kept != run.begin) {
+            std::move(pending.begin() + run.begin, pending.begin() + run.end, pending.begin() + kept);
+        }
+        kept += run.end - run.begin;
+    }
+    pending.erase(pending.begin() + kept, pending.end());
+}
+
 bool
 RecordReader::parseSegmentHeader()
 {
+    // Not a view, since the build id is read after it.
     std::string filename;
     uintptr_t addr;
     size_t num_segments;
+    std::string build_id;
     if (!d_input->getline(filename, '\0')
         || !d_input->read(reinterpret_cast<char*>(&num_segments), sizeof(num_segments))
-        || !d_input->read(reinterpret_cast<char*>(&addr), sizeof(addr)))
+        || !d_input->read(reinterpret_cast<char*>(&addr), sizeof(addr))
+        || (d_header.version >= 7 && !d_input->getline(build_id, '\0')))
     {
         return false;
     }
+    if (!build_id.empty() && !isValidBuildId(build_id)) {
+        LOG(DEBUG) << "Ignoring the malformed build id of " << filename;
+        build_id.clear();
+    }
 
     std::vector<Segment> segments(num_segments);
     for (size_t i = 0; i < num_segments; i++) {
@@ -221,8 +764,17 @@ RecordReader::parseSegmentHeader()
         }
         segments.emplace_back(segment);
     }
-    std::lock_guard<std::mutex> lock(d_mutex);
-    d_symbol_resolver.addSegments(filename, addr, segments);
+    if (d_reading_range) {
+        d_deferred_segments.push_back(
+                {RecordType::SEGMENT_HEADER,
+                 std::move(filename),
+                 addr,
+                 std::move(segments),
+                 std::move(build_id)});
+        return true;
+    }
+    auto lock = lockIfShared();
+    d_symbol_resolver.addSegments(filename, addr, segments, build_id);
     return true;
 }
 
@@ -230,7 +782,7 @@ bool
 RecordReader::parseSegment(Segment& segment)
 {
     RecordType record_type;
-    if (!d_input->read(reinterpret_cast<char*>(&record_type), sizeof(record_type))) {
+    if (!readRecordType(record_type)) {
         return false;
     }
     assert(record_type == RecordType::SEGMENT);
@@ -240,38 +792,185 @@ RecordReader::parseSegment(Segment& segment)
     return true;
 }
 
+bool
+RecordReader::parseSegmentsRemoved()
+{
+    std::string_view filename;
+    uintptr_t addr;
+    if (!d_input->getlineView(filename, '\0')
+        || !d_input->read(reinterpret_cast<char*>(&addr), sizeof(addr))) {
+        return false;
+    }
+    if (d_reading_range) {
+        d_deferred_segments.push_back({RecordType::SEGMENTS_REMOVED, std::string(filename), addr, {}});
+        return true;
+    }
+    auto lock = lockIfShared();
+    d_symbol_resolver.removeSegments(std::string(filename), addr);
+    return true;
+}
+
+void
+RecordReader::startMemoryMap(RecordType type)
+{
+    ++d_segment_generation;
+    if (d_reading_range) {
+        d_deferred_segments.push_back({type, {}, 0, {}});
+        return;
+    }
+    auto lock = lockIfShared();
+    if (type == RecordType::MEMORY_MAP_UPDATE) {
+        d_symbol_resolver.updateSegments();
+    } else {
+        d_symbol_resolver.clearSegments();
+    }
+}
+
 bool
 RecordReader::parseThreadRecord()
 {
     thread_id_t tid;
-    std::string name;
+    std::string_view name;
     if (!d_input->read(reinterpret_cast<char*>(&tid), sizeof(thread_id_t))
-        || !d_input->getline(name, '\0')) {
+        || !d_input->getlineView(name, '\0')) {
         return false;
     }
+    if (d_header.version < 7) {
+        tid = legacyThreadId(tid);
+    }
     d_thread_names[tid] = name;
     return true;
 }
 
 bool
-RecordReader::parseMemoryRecord()
+RecordReader::parseMemoryRecord(RecordType type)
 {
     MemoryRecord record;
     if (!d_input->read(reinterpret_cast<char*>(&record), sizeof(record))) {
         return false;
     }
+    if (type == RecordType::MEMORY_GAUGES_RECORD) {
+        MemoryGauges gauges;
+        if (!d_input->read(reinterpret_cast<char*>(&gauges), sizeof(gauges))) {
+            return false;
+        }
+        d_memory_gauges.push_back(gauges);
+    }
+    d_current_time = static_cast<millis_t>(record.ms_since_epoch);
     d_memory_records.emplace_back(std::move(record));
+    d_memory_record_allocations.push_back(d_n_released_allocations);
+    return true;
+}
+
+bool
+RecordReader::parsePythonTraceIndex()
+{
+    PythonTraceIndex record;
+    if (!d_input->read(reinterpret_cast<char*>(&record), sizeof(record))) {
+        return false;
+    }
+    auto lock = lockIfShared();
+    d_tree.getTraceIndex(record.parent_index, record.frame_id);
+    return true;
+}
+
+bool
+RecordReader::parseAggregatedAllocation()
+{
+    AggregatedAllocation record;
+    if (!d_input->read(reinterpret_cast<char*>(&record), sizeof(record))) {
+        return false;
+    }
+    d_aggregated_allocation_records.emplace_back(record);
+    return true;
+}
+
+bool
+RecordReader::parseAllocationCounts()
+{
+    AllocationCounts record;
+    if (!d_input->read(reinterpret_cast<char*>(&record), sizeof(record))) {
+        return false;
+    }
+    d_allocation_counts.emplace_back(record);
+    return true;
+}
+
+bool
+RecordReader::parseSinkStats()
+{
+    SinkStats record;
+    if (!d_input->read(reinterpret_cast<char*>(&record), sizeof(record))) {
+        return false;
+    }
+    uint64_t now = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                           std::chrono::system_clock::now().time_since_epoch())
+                           .count();
+    auto lock = lockIfShared();
+    d_sink_lag.n_reports += 1;
+    d_sink_lag.sender_blocked_ns = record.blocked_ns;
+    // The clocks of both ends may not agree to the nanosecond.
+    d_sink_lag.lag_ns = now > record.ns_since_epoch ? now - record.ns_since_epoch : 0;
+    d_sink_lag.max_lag_ns = std::max(d_sink_lag.max_lag_ns, d_sink_lag.lag_ns);
+    d_sink_lag.total_lag_ns += d_sink_lag.lag_ns;
     return true;
 }
 
 RecordReader::RecordResult
 RecordReader::nextRecord()
+{
+    if (!d_progress) {
+        return parseNextRecord();
+    }
+    startReportingProgress();
+    RecordResult result = parseNextRecord();
+    if (result == RecordResult::END_OF_FILE || result == RecordResult::ERROR) {
+        finishReportingProgress();
+    }
+    return result;
+}
+
+RecordReader::RecordResult
+RecordReader::nextRecords(size_t max_records, size_t& n_records)
+{
+    assert(max_records > 0);
+    if (d_progress) {
+        startReportingProgress();
+    }
+    RecordResult result;
+    n_records = 0;
+    do {
+        result = parseNextRecord();
+        if (result == RecordResult::END_OF_FILE || result == RecordResult::ERROR) {
+            if (d_progress) {
+                finishReportingProgress();
+            }
+            break;
+        }
+    } while (++n_records < max_records);
+    return result;
+}
+
+RecordReader::RecordResult
+RecordReader::parseNextRecord()
 {
     while (true) {
+        if (d_unreported_allocations) {
+            d_unreported_allocations -= 1;
+            return RecordResult::ALLOCATION_RECORD;
+        }
+
         RecordType record_type;
-        if (!d_input->read(reinterpret_cast<char*>(&record_type), sizeof(RecordType))) {
+        if (!readRecordType(record_type)) {
+            if (!d_pending_allocations.empty()) {
+                releasePendingAllocations(std::numeric_limits<sequence_t>::max());
+                continue;
+            }
             return RecordResult::END_OF_FILE;
         }
+        if (d_progress && ++d_unreported_records >= PROGRESS_BATCH_SIZE && !reportProgress()) {
+            return RecordResult::ERROR;
+        }
 
         switch (record_type) {
             case RecordType::UNINITIALIZED: {
@@ -282,10 +981,11 @@ RecordReader::nextRecord()
                     if (d_input->is_open()) LOG(ERROR) << "Failed to parse allocation record";
                     return RecordResult::ERROR;
                 }
-                return RecordResult::ALLOCATION_RECORD;
+                break;
             }
-            case RecordType::MEMORY_RECORD: {
-                if (!parseMemoryRecord()) {
+            case RecordType::MEMORY_RECORD:
+            case RecordType::MEMORY_GAUGES_RECORD: {
+                if (!parseMemoryRecord(record_type)) {
                     if (d_input->is_open()) LOG(ERROR) << "Failed to parse memory record";
                     return RecordResult::ERROR;
                 }
@@ -315,29 +1015,422 @@ RecordReader::nextRecord()
                     return RecordResult::ERROR;
                 }
                 break;
-            case RecordType::MEMORY_MAP_START: {
-                std::lock_guard<std::mutex> lock(d_mutex);
+            case RecordType::MEMORY_MAP_START:
+            case RecordType::MEMORY_MAP_UPDATE:
+                startMemoryMap(record_type);
+                break;
+            case RecordType::SEGMENT_HEADER:
+                if (!parseSegmentHeader()) {
+                    if (d_input->is_open()) LOG(ERROR) << "Failed to parse segment header";
+                    return RecordResult::ERROR;
+                }
+                break;
+            case RecordType::SEGMENTS_REMOVED:
+                if (!parseSegmentsRemoved()) {
+                    if (d_input->is_open()) LOG(ERROR) << "Failed to parse removed segments";
+                    return RecordResult::ERROR;
+                }
+                break;
+            case RecordType::THREAD_RECORD: {
+                if (!parseThreadRecord()) {
+                    if (d_input->is_open()) LOG(ERROR) << "Failed to parse thread record";
+                    return RecordResult::ERROR;
+                }
+                break;
+            }
+            case RecordType::THREAD_CHUNK: {
+                if (!parseThreadChunk()) {
+                    if (d_input->is_open()) LOG(ERROR) << "Failed to parse thread chunk";
+                    return RecordResult::ERROR;
+                }
+                break;
+            }
+            case RecordType::CHUNK_BARRIER: {
+                if (!parseChunkBarrier()) {
+                    if (d_input->is_open()) LOG(ERROR) << "Failed to parse chunk barrier";
+                    return RecordResult::ERROR;
+                }
+                break;
+            }
+            case RecordType::CHECKPOINT: {
+                if (!parseCheckpoint()) {
+                    if (d_input->is_open()) LOG(ERROR) << "Failed to parse checkpoint";
+                    return RecordResult::ERROR;
+                }
+                break;
+            }
+            case RecordType::CHECKPOINT_INDEX: {
+                if (!parseCheckpointIndex()) {
+                    if (d_input->is_open()) LOG(ERROR) << "Failed to parse checkpoint index";
+                    return RecordResult::ERROR;
+                }
+                break;
+            }
+            case RecordType::PYTHON_TRACE_INDEX: {
+                if (!parsePythonTraceIndex()) {
+                    if (d_input->is_open()) LOG(ERROR) << "Failed to parse Python trace index";
+                    return RecordResult::ERROR;
+                }
+                break;
+            }
+            case RecordType::AGGREGATED_ALLOCATION: {
+                if (!parseAggregatedAllocation()) {
+                    if (d_input->is_open()) LOG(ERROR) << "Failed to parse aggregated allocation";
+                    return RecordResult::ERROR;
+                }
+                return RecordResult::AGGREGATED_ALLOCATION_RECORD;
+            }
+            case RecordType::ALLOCATION_COUNTS: {
+                if (!parseAllocationCounts()) {
+                    if (d_input->is_open()) LOG(ERROR) << "Failed to parse allocation counts";
+                    return RecordResult::ERROR;
+                }
+                return RecordResult::ALLOCATION_COUNTS_RECORD;
+            }
+            case RecordType::SINK_STATS: {
+                if (!parseSinkStats()) {
+                    if (d_input->is_open()) LOG(ERROR) << "Failed to parse sink stats";
+                    return RecordResult::ERROR;
+                }
+            } break;
+            default:
+                if (d_input->is_open()) LOG(ERROR) << "Invalid record type";
+                return RecordResult::ERROR;
+        }
+    }
+}
+
+bool
+RecordReader::reportProgress()
+{
+    // A source that was closed from under us has nothing more to count.
+    uint64_t bytes_read = std::max(d_input->bytesRead(), d_reported_bytes);
+    d_progress->advance(bytes_read - d_reported_bytes, d_unreported_records);
+    d_reported_bytes = bytes_read;
+    d_unreported_records = 0;
+    if (d_reading_range) {
+        return !d_progress->cancelled();
+    }
+    return d_progress->update();
+}
+
+void
+RecordReader::startReportingProgress()
+{
+    if (d_reading_range || d_parse_started) {
+        return;
+    }
+    d_parse_started = true;
+    d_progress->startPhase(ReadPhase::PARSE, d_input->size());
+}
+
+void
+RecordReader::finishReportingProgress()
+{
+    if (d_reading_range) {
+        // Count what's left, for the reader that reports the phase.
+        (void)reportProgress();
+        return;
+    }
+    if (!d_parse_started || d_parse_finished) {
+        return;
+    }
+    d_parse_finished = true;
+    (void)reportProgress();
+    d_progress->finishPhase();
+}
+
+void
+RecordReader::setProgress(std::shared_ptr<ReadProgress> progress)
+{
+    d_progress = std::move(progress);
+}
+
+ReadProgress*
+RecordReader::progress() const noexcept
+{
+    return d_progress.get();
+}
+
+void
+RecordReader::shareBetweenThreads() noexcept
+{
+    d_shared = true;
+}
+
+void
+RecordReader::startReadingWithoutGil() noexcept
+{
+    d_reads_without_gil.fetch_add(1);
+}
+
+void
+RecordReader::finishReadingWithoutGil() noexcept
+{
+    d_reads_without_gil.fetch_sub(1);
+}
+
+bool
+RecordFilter::includesThread(thread_id_t tid) const noexcept
+{
+    return thread_ids.empty()
+           || std::find(thread_ids.begin(), thread_ids.end(), tid) != thread_ids.end();
+}
+
+bool
+RecordFilter::hasTimeRange() const noexcept
+{
+    return start_time != std::numeric_limits<millis_t>::min()
+           || end_time != std::numeric_limits<millis_t>::max();
+}
+
+void
+RecordReader::setFilter(const RecordFilter& filter)
+{
+    d_filter = filter;
+    d_filtered = !filter.thread_ids.empty() || filter.hasTimeRange();
+    d_current_time = d_header.stats.start_time;
+}
+
+std::unique_lock<std::mutex>
+RecordReader::lockIfShared() const
+{
+    if (!d_shared && !d_reads_without_gil.load()) {
+        return std::unique_lock<std::mutex>(d_mutex, std::defer_lock);
+    }
+    return std::unique_lock<std::mutex>(d_mutex);
+}
+
+RecordReader::RecordResult
+RecordReader::readAllRecords(const std::string& file_name, size_t max_workers)
+{
+    auto read_until_the_end = [](RecordReader& reader) {
+        size_t n_records;
+        return reader.nextRecords(std::numeric_limits<size_t>::max(), n_records);
+    };
+
+    // The checkpoint index is only there once the file has been completely
+    // written, and even then the range readers assume that they start on a
+    // clean slate.
+    bool nothing_read = d_allocation_records.empty() && d_memory_records.empty() && d_frame_map.empty()
+                        && d_pending_allocations.empty();
+    if (max_workers < 2 || d_header.version < 7 || !d_header.checkpoint_index_offset || !nothing_read) {
+        return read_until_the_end(*this);
+    }
+    // The time of each allocation is only known reading from the start.
+    if (d_filter.hasTimeRange()) {
+        return read_until_the_end(*this);
+    }
+
+    std::vector<uint64_t> starts{0};
+    try {
+        RecordReader index_reader(
+                std::make_unique<FileSource>(
+                        file_name,
+                        d_header.checkpoint_index_offset,
+                        std::numeric_limits<uint64_t>::max()),
+                d_header,
+                false);
+        if (index_reader.nextRecord() != RecordResult::END_OF_FILE) {
+            return read_until_the_end(*this);
+        }
+        // Make each range at least as large as it would be if they all were
+        // the same size, so that there are never more than max_workers.
+        uint64_t min_range_size = d_header.checkpoint_index_offset / max_workers;
+        for (uint64_t offset : index_reader.checkpointOffsets()) {
+            if (offset - starts.back() >= min_range_size) {
+                starts.push_back(offset);
+            }
+        }
+    } catch (const IoError&) {
+        // The file is compressed, so its offsets can't be used.
+        return read_until_the_end(*this);
+    }
+    if (starts.size() == 1) {
+        return read_until_the_end(*this);
+    }
+
+    if (d_progress) {
+        startReportingProgress();
+    }
+    std::vector<std::unique_ptr<RecordReader>> ranges;
+    for (size_t i = 0; i < starts.size(); ++i) {
+        uint64_t end = i + 1 < starts.size() ? starts[i + 1] : std::numeric_limits<uint64_t>::max();
+        auto source = std::make_unique<FileSource>(file_name, starts[i], end);
+        ranges.emplace_back(new RecordReader(std::move(source), d_header, i == 0));
+        ranges.back()->d_progress = d_progress;
+        ranges.back()->setFilter(d_filter);
+        // Assume that the allocations are spread evenly over the file.
+        double share = static_cast<double>(std::min(end, d_header.checkpoint_index_offset) - starts[i])
+                       / d_header.checkpoint_index_offset;
+        auto n_allocations = static_cast<size_t>(share * d_header.stats.n_allocations);
+        ranges.back()->d_allocation_records.reserve(n_allocations);
+        ranges.back()->d_allocation_sequences.reserve(n_allocations);
+    }
+    std::vector<RecordResult> results(ranges.size(), RecordResult::ERROR);
+    std::vector<std::exception_ptr> errors(ranges.size());
+    std::vector<std::thread> threads;
+    for (size_t i = 0; i < ranges.size(); ++i) {
+        threads.emplace_back([&, i] {
+            try {
+                results[i] = read_until_the_end(*ranges[i]);
+            } catch (...) {
+                errors[i] = std::current_exception();
+            }
+            if (d_progress) {
+                d_progress->threadFinished();
+            }
+        });
+    }
+    if (d_progress) {
+        d_progress->waitForThreads(threads.size());
+    }
+    for (auto& thread : threads) {
+        thread.join();
+    }
+    if (d_progress && !d_parse_finished) {
+        // The ranges counted all of the bytes, the header included.
+        d_parse_finished = true;
+        d_progress->finishPhase();
+    }
+
+    // Put the ranges back together in order, stopping at the first one that
+    // couldn't be read to the end, as nextRecord() would.
+    std::vector<sequence_t> sequences;
+    sequences.reserve(d_allocation_records.capacity());
+    for (size_t i = 0; i < ranges.size(); ++i) {
+        if (errors[i]) {
+            std::rethrow_exception(errors[i]);
+        }
+        mergeRange(*ranges[i], sequences);
+        if (results[i] == RecordResult::ERROR || i + 1 == ranges.size()) {
+            // Anything read from now on comes from where this range ended.
+            d_input = std::move(ranges[i]->d_input);
+            return results[i];
+        }
+        ranges[i].reset();
+    }
+    return RecordResult::END_OF_FILE;
+}
+
+void
+RecordReader::mergeRange(RecordReader& range, std::vector<sequence_t>& sequences)
+{
+    auto lock = lockIfShared();
+
+    // Frame ids, native frame ids and thread ids are the ones the tracker
+    // gave out, but each range numbered its Python stacks on its own. The
+    // ranges are merged in order and their nodes are added in the order in
+    // which they were created, so the numbers end up being the same that a
+    // single reader would have given them.
+    for (const auto& entry : range.d_frame_map) {
+        addFrame(entry);
+    }
+    std::vector<FrameTree::index_t> indexes(range.d_tree.size());
+    for (FrameTree::index_t index = 1; index < indexes.size(); ++index) {
+        auto [frame_id, parent_index] = range.d_tree.nextNode(index);
+        indexes[index] = d_tree.getTraceIndex(indexes[parent_index], frame_id);
+    }
+    d_stack_traces = std::move(range.d_stack_traces);
+    for (auto& stack : d_stack_traces) {
+        for (auto& index : stack) {
+            index = indexes[index];
+        }
+    }
+    d_sparse_stack_traces = std::move(range.d_sparse_stack_traces);
+    for (auto& [tid, stack] : d_sparse_stack_traces) {
+        for (auto& index : stack) {
+            index = indexes[index];
+        }
+    }
+    d_native_frames.insert(
+            d_native_frames.end(),
+            range.d_native_frames.begin(),
+            range.d_native_frames.end());
+    for (const auto& segments : range.d_deferred_segments) {
+        switch (segments.type) {
+            case RecordType::MEMORY_MAP_START:
                 d_symbol_resolver.clearSegments();
+                ++d_segment_generation;
                 break;
-            }
-            case RecordType::SEGMENT_HEADER:
-                if (!parseSegmentHeader()) {
-                    if (d_input->is_open()) LOG(ERROR) << "Failed to parse segment header";
-                    return RecordResult::ERROR;
-                }
+            case RecordType::MEMORY_MAP_UPDATE:
+                d_symbol_resolver.updateSegments();
+                ++d_segment_generation;
                 break;
-            case RecordType::THREAD_RECORD: {
-                if (!parseThreadRecord()) {
-                    if (d_input->is_open()) LOG(ERROR) << "Failed to parse thread record";
-                    return RecordResult::ERROR;
-                }
+            case RecordType::SEGMENTS_REMOVED:
+                d_symbol_resolver.removeSegments(segments.filename, segments.addr);
                 break;
-            }
             default:
-                if (d_input->is_open()) LOG(ERROR) << "Invalid record type";
-                return RecordResult::ERROR;
+                d_symbol_resolver.addSegments(
+                        segments.filename,
+                        segments.addr,
+                        segments.segments,
+                        segments.build_id);
+                break;
         }
     }
+    for (const auto& [tid, name] : range.d_thread_names) {
+        d_thread_names[tid] = name;
+    }
+
+    // The allocations of each range are sorted by their sequence numbers,
+    // and so are ours. Only the first few of the range can go before some of
+    // ours: those that its reader released at its first barrier, which a
+    // single reader would have merged with the ones still pending.
+    auto& records = range.d_allocation_records;
+    auto& range_sequences = range.d_allocation_sequences;
+    for (auto& frame_index : records.frameIndexes()) {
+        frame_index = indexes[frame_index];
+    }
+    size_t n_ours_after = 0;
+    size_t n_theirs_before = 0;
+    if (!sequences.empty() && !range_sequences.empty()) {
+        n_ours_after = sequences.end()
+                       - std::upper_bound(sequences.begin(), sequences.end(), range_sequences.front());
+        n_theirs_before =
+                std::lower_bound(range_sequences.begin(), range_sequences.end(), sequences.back())
+                - range_sequences.begin();
+    }
+    std::vector<std::pair<sequence_t, Allocation>> overlap;
+    overlap.reserve(n_ours_after + n_theirs_before);
+    for (size_t i = sequences.size() - n_ours_after; i < sequences.size(); ++i) {
+        overlap.emplace_back(sequences[i], d_allocation_records[i]);
+    }
+    for (size_t i = 0; i < n_theirs_before; ++i) {
+        overlap.emplace_back(range_sequences[i], records[i]);
+    }
+    std::sort(overlap.begin(), overlap.end(), [](const auto& lhs, const auto& rhs) {
+        return lhs.first < rhs.first;
+    });
+    sequences.resize(sequences.size() - n_ours_after);
+    d_allocation_records.truncate(d_allocation_records.size() - n_ours_after);
+    for (const auto& [sequence, allocation] : overlap) {
+        sequences.push_back(sequence);
+        d_allocation_records.push_back(allocation);
+    }
+    sequences.insert(sequences.end(), range_sequences.begin() + n_theirs_before, range_sequences.end());
+    d_allocation_records.append(records, n_theirs_before);
+
+    for (auto& allocation : range.d_cancelled_allocation_records) {
+        allocation.frame_index = indexes[allocation.frame_index];
+        d_cancelled_allocation_records.push_back(allocation);
+    }
+    d_memory_records.insert(
+            d_memory_records.end(),
+            range.d_memory_records.begin(),
+            range.d_memory_records.end());
+    for (size_t n_allocations : range.d_memory_record_allocations) {
+        d_memory_record_allocations.push_back(d_n_released_allocations + n_allocations);
+    }
+    d_memory_gauges.insert(
+            d_memory_gauges.end(),
+            range.d_memory_gauges.begin(),
+            range.d_memory_gauges.end());
+    d_n_released_allocations += range.d_n_released_allocations;
+    d_next_sequence = std::max(d_next_sequence, range.d_next_sequence);
+    if (!range.d_checkpoint_offsets.empty()) {
+        d_checkpoint_offsets = std::move(range.d_checkpoint_offsets);
+    }
 }
 
 // Python public APIs
@@ -345,7 +1438,7 @@ RecordReader::nextRecord()
 PyObject*
 RecordReader::Py_GetStackFrame(unsigned int index, size_t max_stacks)
 {
-    std::lock_guard<std::mutex> lock(d_mutex);
+    auto lock = lockIfShared();
 
     size_t stacks_obtained = 0;
     FrameTree::index_t current_index = index;
@@ -356,8 +1449,7 @@ RecordReader::Py_GetStackFrame(unsigned int index, size_t max_stacks)
 
     while (current_index != 0 && stacks_obtained++ != max_stacks) {
         auto [frame_id, next_index] = d_tree.nextNode(current_index);
-        const auto& frame = d_frame_map.at(frame_id);
-        PyObject* pyframe = frame.toPythonObject(d_pystring_cache);
+        PyObject* pyframe = frameToPythonObject(frame_id);
         if (pyframe == nullptr) {
             goto error;
         }
@@ -374,10 +1466,113 @@ error:
     return nullptr;
 }
 
+void
+RecordReader::configureSymbolResolution(size_t max_workers, const std::string& cache_directory)
+{
+    auto lock = lockIfShared();
+    d_symbolizer_workers = max_workers;
+    d_symbol_resolver.setCacheDirectory(cache_directory);
+}
+
+void
+RecordReader::deferSymbolResolution()
+{
+    // The symbols are resolved by another thread from now on.
+    d_shared = true;
+    std::lock_guard<std::mutex> lock(d_mutex);
+    d_defer_symbol_resolution = true;
+    d_symbol_resolver.setDeferResolution(true);
+}
+
+void
+RecordReader::resolveDeferredSymbols()
+{
+    std::vector<native_resolver::SymbolResolver::DeferredIp> work;
+    std::vector<native_resolver::MemorySegment::ExpandedFrame> frames;
+    std::unique_lock<std::mutex> lock(d_mutex);
+    while (true) {
+        d_deferred_symbols_cv.wait(lock, [&] {
+            return d_stop_resolving_symbols || d_symbol_resolver.takeDeferred(work);
+        });
+        if (d_stop_resolving_symbols) {
+            return;
+        }
+
+        // The debug information of a binary is parsed the first time one of
+        // its addresses is resolved, which can take a while, so the lock is
+        // only held to take the addresses and to hand their frames back.
+        // Nothing else resolves symbols with the backtrace states while the
+        // resolution is deferred.
+        lock.unlock();
+        frames.clear();
+        for (const auto& deferred : work) {
+            if (d_stop_resolving_symbols) {
+                break;
+            }
+            frames.push_back(deferred.segment.resolveIp(deferred.ip));
+        }
+        lock.lock();
+        d_symbol_resolver.addDeferred(work, frames);
+        d_symbols_version.fetch_add(1, std::memory_order_release);
+    }
+}
+
+void
+RecordReader::stopResolvingSymbols()
+{
+    {
+        std::lock_guard<std::mutex> lock(d_mutex);
+        d_stop_resolving_symbols = true;
+    }
+    d_deferred_symbols_cv.notify_all();
+}
+
+uint64_t
+RecordReader::symbolsVersion() const noexcept
+{
+    return d_symbols_version.load(std::memory_order_acquire);
+}
+
+PyObject*
+RecordReader::Py_GetFrame(frame_id_t frame_id)
+{
+    auto lock = lockIfShared();
+    return frameToPythonObject(frame_id);
+}
+
+void
+RecordReader::getStackFrameIds(FrameTree::index_t index, std::vector<frame_id_t>& frame_ids)
+{
+    auto lock = lockIfShared();
+
+    frame_ids.clear();
+    FrameTree::index_t current_index = index;
+    while (current_index != 0) {
+        auto [frame_id, next_index] = d_tree.nextNode(current_index);
+        frame_ids.push_back(frame_id);
+        current_index = next_index;
+    }
+}
+
+void
+RecordReader::getFrameInfo(
+        frame_id_t frame_id,
+        std::string_view& function_name,
+        std::string_view& filename,
+        int& lineno)
+{
+    auto lock = lockIfShared();
+
+    const auto& [function_name_id, filename_id] = d_frame_string_ids.at(frame_id);
+    function_name = d_python_strings.resolveString(function_name_id);
+    filename = d_python_strings.resolveString(filename_id);
+    lineno = d_frame_map.at(frame_id).lineno;
+}
+
 PyObject*
 RecordReader::Py_GetNativeStackFrame(FrameTree::index_t index, size_t generation, size_t max_stacks)
 {
-    std::lock_guard<std::mutex> lock(d_mutex);
+    auto lock = lockIfShared();
 
     size_t stacks_obtained = 0;
     FrameTree::index_t current_index = index;
@@ -394,7 +1589,8 @@ RecordReader::Py_GetNativeStackFrame(FrameTree::index_t index, size_t generation
             continue;
         }
         for (auto& native_frame : resolved_frames->frames()) {
-            PyObject* pyframe = native_frame.toPythonObject(d_pystring_cache);
+            PyObject* pyframe =
+                    native_frame.toPythonObject(resolved_frames->strings(), d_native_pystring_cache);
             if (pyframe == nullptr) {
                 return nullptr;
             }
@@ -411,6 +1607,242 @@ error:
     return nullptr;
 }
 
+bool
+RecordReader::isEvalFrame(
+        const native_resolver::ResolvedFrame& frame,
+        const native_resolver::StringStorage& strings)
+{
+    const auto symbol_id = frame.symbolId();
+    if (symbol_id >= d_eval_frame_symbols.size()) {
+        d_eval_frame_symbols.resize(static_cast<size_t>(symbol_id) + 1, 0);
+    }
+    uint8_t& is_eval_frame = d_eval_frame_symbols[symbol_id];
+    if (!is_eval_frame) {
+        const auto symbol = strings.resolveString(symbol_id);
+        is_eval_frame = symbol.find("_PyEval_EvalFrameDefault") != std::string_view::npos ? 2 : 1;
+    }
+    return is_eval_frame == 2;
+}
+
+PyObject*
+RecordReader::Py_GetHybridStackFrame(
+        FrameTree::index_t index,
+        FrameTree::index_t native_index,
+        size_t generation,
+        size_t max_stacks)
+{
+    auto lock = lockIfShared();
+
+    const HybridStackKey key{index, native_index, generation, max_stacks};
+    if (PyObject* cached = d_hybrid_stacks.find(key)) {
+        Py_INCREF(cached);
+        return cached;
+    }
+
+    std::vector<frame_id_t> python_frames;
+    size_t stacks_obtained = 0;
+    FrameTree::index_t current_index = index;
+    while (current_index != 0 && stacks_obtained++ != max_stacks) {
+        auto [frame_id, next_index] = d_tree.nextNode(current_index);
+        const std::string& filename = d_frame_map.at(frame_id).filename;
+        if (filename.size() < 4 || filename.compare(filename.size() - 4, 4, ".pyx") != 0) {
+            python_frames.push_back(frame_id);
+        }
+        current_index = next_index;
+    }
+
+    // Each eval frame stands for the next Python frame, and the stack ends
+    // once they have all been used, unless there were none to begin with.
+    auto next_python_frame = python_frames.cbegin();
+    PyObject* list = PyList_New(0);
+    if (list == nullptr) {
+        return nullptr;
+    }
+    bool complete = false;
+    bool provisional = false;
+    stacks_obtained = 0;
+    current_index = native_index;
+    while (!complete && current_index != 0 && stacks_obtained++ != max_stacks) {
+        auto frame = d_native_frames[current_index - 1];
+        current_index = frame.index;
+        auto resolved_frames = d_symbol_resolver.resolve(frame.ip, generation);
+        if (!resolved_frames) {
+            continue;
+        }
+        provisional |= resolved_frames->isProvisional();
+        for (auto& native_frame : resolved_frames->frames()) {
+            if (!python_frames.empty() && next_python_frame == python_frames.cend()) {
+                complete = true;
+                break;
+            }
+            PyObject* pyframe;
+            if (next_python_frame != python_frames.cend()
+                && isEvalFrame(native_frame, resolved_frames->strings()))
+            {
+                pyframe = frameToPythonObject(*next_python_frame++);
+            } else {
+                pyframe = native_frame.toPythonObject(
+                        resolved_frames->strings(),
+                        d_native_pystring_cache);
+            }
+            if (pyframe == nullptr) {
+                Py_DECREF(list);
+                return nullptr;
+            }
+            int ret = PyList_Append(list, pyframe);
+            Py_DECREF(pyframe);
+            if (ret != 0) {
+                Py_DECREF(list);
+                return nullptr;
+            }
+        }
+    }
+
+    PyObject* stack = PyList_AsTuple(list);
+    Py_DECREF(list);
+    // Stacks with frames that are still being resolved are built again once
+    // their symbols are known.
+    if (stack != nullptr && !provisional) {
+        d_hybrid_stacks.insert(key, stack);
+    }
+    return stack;
+}
+
+PyObject*
+RecordReader::Py_GetStackTable(const std::vector<FrameTree::index_t>& indexes, size_t max_stacks)
+{
+    auto lock = lockIfShared();
+
+    containers::FlatHashMap<frame_id_t, size_t> frame_positions;
+    auto get_key = [&](size_t i) { return indexes[i]; };
+    auto add_frames = [&](size_t i, PyObject* frames, std::vector<size_t>& positions) {
+        size_t stacks_obtained = 0;
+        FrameTree::index_t current_index = indexes[i];
+        while (current_index != 0 && stacks_obtained++ != max_stacks) {
+            auto [frame_id, next_index] = d_tree.nextNode(current_index);
+            auto [it, inserted] = frame_positions.try_emplace(frame_id, frame_positions.size());
+            if (inserted) {
+                PyObject* pyframe = frameToPythonObject(frame_id);
+                if (pyframe == nullptr) {
+                    return false;
+                }
+                int ret = PyList_Append(frames, pyframe);
+                Py_DECREF(pyframe);
+                if (ret != 0) {
+                    return false;
+                }
+            }
+            positions.push_back(it->second);
+            current_index = next_index;
+        }
+        return true;
+    };
+    return makeStackTable<FrameTree::index_t, std::hash<FrameTree::index_t>>(
+            indexes.size(),
+            get_key,
+            add_frames);
+}
+
+PyObject*
+RecordReader::Py_GetNativeStackTable(
+        const std::vector<FrameTree::index_t>& indexes,
+        const std::vector<size_t>& generations,
+        size_t max_stacks)
+{
+    auto lock = lockIfShared();
+
+    // Symbolize all of the instruction pointers at once first. Stacks share
+    // their outermost frames, so the walk up from each one stops as soon as
+    // it reaches a frame that an earlier one went through.
+    std::vector<std::pair<uintptr_t, size_t>> ips;
+    containers::FlatHashMap<std::pair<FrameTree::index_t, size_t>, bool, PairHash> visited;
+    for (size_t i = 0; i < indexes.size(); ++i) {
+        FrameTree::index_t current_index = indexes[i];
+        const size_t generation = generations[i];
+        while (current_index != 0
+               && visited.try_emplace(std::make_pair(current_index, generation)).second)
+        {
+            const auto& frame = d_native_frames[current_index - 1];
+            ips.emplace_back(frame.ip, generation);
+            current_index = frame.index;
+        }
+    }
+    d_symbol_resolver.resolveAll(ips, d_symbolizer_workers, d_progress.get());
+    if (d_progress && d_progress->cancelled()) {
+        Py_RETURN_NONE;
+    }
+
+    // An instruction pointer can resolve to several frames, when functions
+    // were inlined, so each one maps to the range of positions of its frames.
+    using ip_key_t = std::pair<uintptr_t, size_t>;
+    containers::FlatHashMap<ip_key_t, std::pair<size_t, size_t>, PairHash> ip_positions;
+    size_t n_frames = 0;
+    auto get_key = [&](size_t i) { return std::make_pair(indexes[i], generations[i]); };
+    auto add_frames = [&](size_t i, PyObject* frames, std::vector<size_t>& positions) {
+        FrameTree::index_t current_index = indexes[i];
+        size_t generation = generations[i];
+        size_t stacks_obtained = 0;
+        while (current_index != 0 && stacks_obtained++ != max_stacks) {
+            auto frame = d_native_frames[current_index - 1];
+            current_index = frame.index;
+            auto [it, inserted] = ip_positions.try_emplace(ip_key_t{frame.ip, generation});
+            if (inserted) {
+                it->second.first = n_frames;
+                auto resolved_frames = d_symbol_resolver.resolve(frame.ip, generation);
+                if (resolved_frames) {
+                    for (auto& native_frame : resolved_frames->frames()) {
+                        PyObject* pyframe = native_frame.toPythonObject(
+                                resolved_frames->strings(),
+                                d_native_pystring_cache);
+                        if (pyframe == nullptr) {
+                            return false;
+                        }
+                        int ret = PyList_Append(frames, pyframe);
+                        Py_DECREF(pyframe);
+                        if (ret != 0) {
+                            return false;
+                        }
+                        ++n_frames;
+                    }
+                }
+                it->second.second = n_frames;
+            }
+            for (size_t position = it->second.first; position < it->second.second; ++position) {
+                positions.push_back(position);
+            }
+        }
+        return true;
+    };
+    return makeStackTable<std::pair<FrameTree::index_t, size_t>, PairHash>(
+            indexes.size(),
+            get_key,
+            add_frames);
+}
+
+const Allocation*
+RecordReader::nextAllocation()
+{
+    if (d_unreported_allocations == 0) {
+        d_allocation_records.clear();
+    }
+    while (true) {
+        switch (nextRecord()) {
+            case RecordResult::ALLOCATION_RECORD:
+                // Allocations are released in batches and returned in order.
+                d_streamed_allocation =
+                        d_allocation_records[d_allocation_records.size() - 1 - d_unreported_allocations];
+                return &d_streamed_allocation;
+            case RecordResult::AGGREGATED_ALLOCATION_RECORD:
+            case RecordResult::ALLOCATION_COUNTS_RECORD:
+            case RecordResult::MEMORY_RECORD:
+                break;
+            case RecordResult::ERROR:
+            case RecordResult::END_OF_FILE:
+                return nullptr;
+        }
+    }
+}
+
 HeaderRecord
 RecordReader::getHeader() const noexcept
 {
@@ -431,7 +1863,10 @@ void
 RecordReader::clearRecords() noexcept
 {
     d_allocation_records.clear();
+    d_cancelled_allocation_records.clear();
     d_memory_records.clear();
+    d_memory_record_allocations.clear();
+    d_memory_gauges.clear();
 }
 
 allocations_t&
@@ -440,14 +1875,69 @@ RecordReader::allocationRecords() noexcept
     return d_allocation_records;
 }
 
+std::vector<AggregatedAllocation>&
+RecordReader::aggregatedAllocationRecords() noexcept
+{
+    return d_aggregated_allocation_records;
+}
+
+std::vector<AllocationCounts>&
+RecordReader::allocationCounts() noexcept
+{
+    return d_allocation_counts;
+}
+
+std::vector<Allocation>&
+RecordReader::cancelledAllocationRecords() noexcept
+{
+    return d_cancelled_allocation_records;
+}
+
 std::vector<MemoryRecord>&
 RecordReader::memoryRecords() noexcept
 {
     return d_memory_records;
 }
 
+const std::vector<size_t>&
+RecordReader::memoryRecordAllocations() const noexcept
+{
+    return d_memory_record_allocations;
+}
+
+const std::vector<MemoryGauges>&
+RecordReader::memoryGauges() const noexcept
+{
+    return d_memory_gauges;
+}
+
+const std::vector<uint64_t>&
+RecordReader::checkpointOffsets() const noexcept
+{
+    return d_checkpoint_offsets;
+}
+
+SinkLag
+RecordReader::sinkLag() const
+{
+    auto lock = lockIfShared();
+    return d_sink_lag;
+}
+
 PyObject*
 RecordReader::dumpAllRecords()
+{
+    if (!d_progress) {
+        return printAllRecords();
+    }
+    startReportingProgress();
+    PyObject* result = printAllRecords();
+    finishReportingProgress();
+    return result;
+}
+
+PyObject*
+RecordReader::printAllRecords()
 {
     std::string python_allocator;
     switch (d_header.python_allocator) {
@@ -466,7 +1956,8 @@ RecordReader::dumpAllRecords()
     }
     printf("HEADER magic=%.*s version=%d native_traces=%s"
            " n_allocations=%zd n_frames=%zd start_time=%lld end_time=%lld"
-           " pid=%d command_line=%s python_allocator=%s\n",
+           " pid=%d command_line=%s python_allocator=%s sample_rate=%zd file_format=%s"
+           " dropped_records=%zd checkpoint_index_offset=%" PRIu64 "\n",
            (int)sizeof(d_header.magic),
            d_header.magic,
            d_header.version,
@@ -477,7 +1968,13 @@ RecordReader::dumpAllRecords()
            d_header.stats.end_time,
            d_header.pid,
            d_header.command_line.c_str(),
-           python_allocator.c_str());
+           python_allocator.c_str(),
+           d_header.sample_rate,
+           d_header.file_format == FILEFORMAT_AGGREGATED_ALLOCATIONS ? "aggregated"
+           : d_header.file_format == FILEFORMAT_ALLOCATION_COUNTS    ? "counts"
+                                                                     : "all",
+           d_header.dropped_records,
+           d_header.checkpoint_index_offset);
 
     while (true) {
         if (0 != PyErr_CheckSignals()) {
@@ -485,7 +1982,10 @@ RecordReader::dumpAllRecords()
         }
 
         RecordType record_type;
-        if (!d_input->read(reinterpret_cast<char*>(&record_type), sizeof(RecordType))) {
+        if (!readRecordType(record_type)) {
+            Py_RETURN_NONE;
+        }
+        if (d_progress && ++d_unreported_records >= PROGRESS_BATCH_SIZE && !reportProgress()) {
             Py_RETURN_NONE;
         }
 
@@ -501,21 +2001,7 @@ RecordReader::dumpAllRecords()
                     Py_RETURN_NONE;
                 }
 
-                const char* allocator = allocatorName(record.allocator);
-
-                std::string unknownAllocator;
-                if (!allocator) {
-                    unknownAllocator =
-                            "<unknown allocator " + std::to_string((int)record.allocator) + ">";
-                    allocator = unknownAllocator.c_str();
-                }
-
-                printf("tid=%lu address=%p size=%zd allocator=%s native_frame_id=%zd\n",
-                       record.tid,
-                       (void*)record.address,
-                       record.size,
-                       allocator,
-                       record.native_frame_id);
+                printAllocationRecord(record);
             } break;
             case RecordType::FRAME_PUSH: {
                 printf("FRAME_PUSH ");
@@ -570,23 +2056,41 @@ RecordReader::dumpAllRecords()
             case RecordType::MEMORY_MAP_START: {
                 printf("MEMORY_MAP_START\n");
             } break;
+            case RecordType::MEMORY_MAP_UPDATE: {
+                printf("MEMORY_MAP_UPDATE\n");
+            } break;
+            case RecordType::SEGMENTS_REMOVED: {
+                printf("SEGMENTS_REMOVED ");
+
+                std::string filename;
+                uintptr_t addr;
+                if (!d_input->getline(filename, '\0')
+                    || !d_input->read(reinterpret_cast<char*>(&addr), sizeof(addr))) {
+                    Py_RETURN_NONE;
+                }
+
+                printf("filename=%s addr=%p\n", filename.c_str(), (void*)addr);
+            } break;
             case RecordType::SEGMENT_HEADER: {
                 printf("SEGMENT_HEADER ");
 
                 std::string filename;
                 size_t num_segments;
                 uintptr_t addr;
+                std::string build_id;
                 if (!d_input->getline(filename, '\0')
                     || !d_input->read(reinterpret_cast<char*>(&num_segments), sizeof(num_segments))
-                    || !d_input->read(reinterpret_cast<char*>(&addr), sizeof(addr)))
+                    || !d_input->read(reinterpret_cast<char*>(&addr), sizeof(addr))
+                    || (d_header.version >= 7 && !d_input->getline(build_id, '\0')))
                 {
                     Py_RETURN_NONE;
                 }
 
-                printf("filename=%s num_segments=%zd addr=%p\n",
+                printf("filename=%s num_segments=%zd addr=%p build_id=%s\n",
                        filename.c_str(),
                        num_segments,
-                       (void*)addr);
+                       (void*)addr,
+                       build_id.c_str());
             } break;
             case RecordType::SEGMENT: {
                 printf("SEGMENT ");
@@ -619,6 +2123,200 @@ RecordReader::dumpAllRecords()
 
                 printf("time=%ld memory=%" PRIxPTR "\n", record.ms_since_epoch, record.rss);
             } break;
+            case RecordType::MEMORY_GAUGES_RECORD: {
+                printf("MEMORY_GAUGES_RECORD ");
+                MemoryGaugesRecord record;
+                if (!d_input->read(reinterpret_cast<char*>(&record), sizeof(record))) {
+                    Py_RETURN_NONE;
+                }
+
+                printf("time=%ld memory=%" PRIxPTR " heap_size=%zd heap_in_use=%zd "
+                       "pymalloc_arenas=%zd tracked_bytes=%zd\n",
+                       record.memory.ms_since_epoch,
+                       record.memory.rss,
+                       record.gauges.heap_size,
+                       record.gauges.heap_in_use,
+                       record.gauges.pymalloc_arenas,
+                       record.gauges.tracked_bytes);
+            } break;
+            case RecordType::THREAD_CHUNK: {
+                printf("THREAD_CHUNK ");
+                ThreadChunk record;
+                if (!d_input->read(reinterpret_cast<char*>(&record), sizeof(record))) {
+                    Py_RETURN_NONE;
+                }
+
+                printf("tid=%lu size=%zd\n", record.tid, record.size);
+
+                std::vector<char> data(record.size);
+                if (!d_input->read(data.data(), record.size)) {
+                    Py_RETURN_NONE;
+                }
+
+                ChunkDecoder decoder(record.tid, data.data(), record.size);
+                RecordType chunk_record_type;
+                ChunkDecoder::Status status;
+                while ((status = decoder.next(chunk_record_type)) == ChunkDecoder::Status::RECORD) {
+                    switch (chunk_record_type) {
+                        case RecordType::ALLOCATION:
+                            printf("ALLOCATION seq=%" PRIu64 " ", decoder.sequence());
+                            printAllocationRecord(decoder.allocation());
+                            break;
+                        case RecordType::REALLOCATION:
+                            printf("REALLOCATION seq=%" PRIu64 " old_address=%p ",
+                                   decoder.sequence(),
+                                   (void*)decoder.reallocation().old_address);
+                            printAllocationRecord(decoder.reallocation().allocation);
+                            break;
+                        case RecordType::CANCELLED_ALLOCATIONS: {
+                            const CancelledAllocations& cancelled = decoder.cancelledAllocations();
+                            const char* allocator = allocatorName(cancelled.allocator);
+                            if (!allocator) {
+                                allocator = "<unknown allocator>";
+                            }
+                            printf("CANCELLED_ALLOCATIONS tid=%lu allocator=%s native_frame_id=%zd"
+                                   " count=%zd bytes=%zd\n",
+                                   cancelled.tid,
+                                   allocator,
+                                   cancelled.native_frame_id,
+                                   cancelled.count,
+                                   cancelled.bytes);
+                        } break;
+                        case RecordType::FRAME_PUSH:
+                            printf("FRAME_PUSH tid=%lu frame_id=%zd\n",
+                                   decoder.framePush().tid,
+                                   decoder.framePush().frame_id);
+                            break;
+                        case RecordType::FRAME_POP:
+                            printf("FRAME_POP tid=%lu count=%u\n",
+                                   decoder.framePop().tid,
+                                   decoder.framePop().count);
+                            break;
+                        case RecordType::FRAME_LINE_UPDATE:
+                            printf("FRAME_LINE_UPDATE tid=%lu frame_id=%zd\n",
+                                   decoder.frameLineUpdate().tid,
+                                   decoder.frameLineUpdate().frame_id);
+                            break;
+                        default:
+                            break;
+                    }
+                }
+                if (status == ChunkDecoder::Status::ERROR) {
+                    printf("INVALID THREAD CHUNK\n");
+                    Py_RETURN_NONE;
+                }
+            } break;
+            case RecordType::CHUNK_BARRIER: {
+                printf("CHUNK_BARRIER ");
+                ChunkBarrier record;
+                if (!d_input->read(reinterpret_cast<char*>(&record), sizeof(record))) {
+                    Py_RETURN_NONE;
+                }
+
+                printf("next_seq=%" PRIu64 "\n", record.next_sequence);
+            } break;
+            case RecordType::CHECKPOINT: {
+                printf("CHECKPOINT ");
+                Checkpoint record;
+                if (!d_input->read(reinterpret_cast<char*>(&record), sizeof(record))) {
+                    Py_RETURN_NONE;
+                }
+
+                printf("next_seq=%" PRIu64 " native_segment_generation=%zd n_threads=%zd\n",
+                       record.next_sequence,
+                       record.native_segment_generation,
+                       record.n_threads);
+                for (size_t i = 0; i < record.n_threads; ++i) {
+                    CheckpointStack stack;
+                    if (!d_input->read(reinterpret_cast<char*>(&stack), sizeof(stack))) {
+                        Py_RETURN_NONE;
+                    }
+                    printf("  tid=%lu frame_ids=", stack.tid);
+                    for (size_t depth = 0; depth < stack.depth; ++depth) {
+                        frame_id_t frame_id;
+                        if (!d_input->read(reinterpret_cast<char*>(&frame_id), sizeof(frame_id))) {
+                            Py_RETURN_NONE;
+                        }
+                        printf(depth ? ",%zd" : "%zd", frame_id);
+                    }
+                    printf("\n");
+                }
+            } break;
+            case RecordType::CHECKPOINT_INDEX: {
+                printf("CHECKPOINT_INDEX ");
+                CheckpointIndex record;
+                if (!d_input->read(reinterpret_cast<char*>(&record), sizeof(record))) {
+                    Py_RETURN_NONE;
+                }
+
+                printf("n_checkpoints=%zd offsets=", record.n_checkpoints);
+                for (size_t i = 0; i < record.n_checkpoints; ++i) {
+                    uint64_t offset;
+                    if (!d_input->read(reinterpret_cast<char*>(&offset), sizeof(offset))) {
+                        Py_RETURN_NONE;
+                    }
+                    printf(i ? ",%" PRIu64 : "%" PRIu64, offset);
+                }
+                printf("\n");
+            } break;
+            case RecordType::PYTHON_TRACE_INDEX: {
+                printf("PYTHON_TRACE_INDEX ");
+                PythonTraceIndex record;
+                if (!d_input->read(reinterpret_cast<char*>(&record), sizeof(record))) {
+                    Py_RETURN_NONE;
+                }
+
+                printf("frame_id=%zd parent_index=%u\n", record.frame_id, record.parent_index);
+            } break;
+            case RecordType::AGGREGATED_ALLOCATION: {
+                printf("AGGREGATED_ALLOCATION ");
+                AggregatedAllocation record;
+                if (!d_input->read(reinterpret_cast<char*>(&record), sizeof(record))) {
+                    Py_RETURN_NONE;
+                }
+
+                const char* allocator = allocatorName(record.allocator);
+                printf("tid=%lu allocator=%s native_frame_id=%zd frame_index=%zd"
+                       " native_segment_generation=%zd n_allocations_in_high_water_mark=%zd"
+                       " n_allocations_leaked=%zd bytes_in_high_water_mark=%zd bytes_leaked=%zd\n",
+                       record.tid,
+                       allocator ? allocator : "<unknown allocator>",
+                       record.native_frame_id,
+                       record.frame_index,
+                       record.native_segment_generation,
+                       record.n_allocations_in_high_water_mark,
+                       record.n_allocations_leaked,
+                       record.bytes_in_high_water_mark,
+                       record.bytes_leaked);
+            } break;
+            case RecordType::ALLOCATION_COUNTS: {
+                printf("ALLOCATION_COUNTS ");
+                AllocationCounts record;
+                if (!d_input->read(reinterpret_cast<char*>(&record), sizeof(record))) {
+                    Py_RETURN_NONE;
+                }
+
+                const char* allocator = allocatorName(record.allocator);
+                printf("tid=%lu allocator=%s native_frame_id=%zd frame_index=%zd"
+                       " native_segment_generation=%zd n_calls=%" PRIu64 " n_bytes=%" PRIu64 "\n",
+                       record.tid,
+                       allocator ? allocator : "<unknown allocator>",
+                       record.native_frame_id,
+                       record.frame_index,
+                       record.native_segment_generation,
+                       record.n_calls,
+                       record.n_bytes);
+            } break;
+            case RecordType::SINK_STATS: {
+                printf("SINK_STATS ");
+                SinkStats record;
+                if (!d_input->read(reinterpret_cast<char*>(&record), sizeof(record))) {
+                    Py_RETURN_NONE;
+                }
+                printf("ns_since_epoch=%" PRIu64 " blocked_ns=%" PRIu64 "\n",
+                       record.ns_since_epoch,
+                       record.blocked_ns);
+            } break;
             default: {
                 printf("UNKNOWN RECORD TYPE %d\n", (int)record_type);
                 Py_RETURN_NONE;
@@ -1,6 +1,8 @@
 #pragma once
 
 #include <assert.h>
+#include <atomic>
+#include <condition_variable>
 #include <fstream>
 #include <functional>
 #include <limits>
@@ -8,14 +10,17 @@
 #include <stddef.h>
 #include <stdint.h>
 #include <string>
+#include <string_view>
 #include <unordered_map>
 #include <vector>
 
 #include "Python.h"
 
+#include "allocation_store.h"
 #include "frame_tree.h"
 #include "native_resolver.h"
 #include "python_helpers.h"
+#include "read_progress.h"
 #include "records.h"
 #include "source.h"
 
@@ -23,13 +28,46 @@ namespace memray::api {
 
 using namespace tracking_api;
 
-using allocations_t = std::vector<Allocation>;
+// Which of the allocations of a file a reader keeps. Allocations don't have
+// timestamps, so they are taken to happen when the memory record before them
+// was written (or when the capture started, before the first one), and only
+// the ones from start_time up to end_time are kept. Of the other threads,
+// only the deallocations are kept, since they can free what the selected
+// ones allocated, and their reallocations are kept as the deallocations of
+// the addresses that they replaced.
+struct RecordFilter
+{
+    // The threads of the allocations that are kept, or all of them if empty.
+    std::vector<thread_id_t> thread_ids{};
+    millis_t start_time{std::numeric_limits<millis_t>::min()};
+    millis_t end_time{std::numeric_limits<millis_t>::max()};
+
+    bool includesThread(thread_id_t tid) const noexcept;
+    bool hasTimeRange() const noexcept;
+};
+
+// What the SinkStats records that a reader has found tell about how far
+// behind the writer it is. Only live captures have them.
+struct SinkLag
+{
+    uint64_t n_reports{0};
+    // The time that the writer last said it had spent waiting for its sink.
+    uint64_t sender_blocked_ns{0};
+    // How long before being read the last report was written, and the most
+    // that any report took. They compare the clock of the writer with ours,
+    // so they only mean something when both run on the same host.
+    uint64_t lag_ns{0};
+    uint64_t max_lag_ns{0};
+    uint64_t total_lag_ns{0};
+};
 
 class RecordReader
 {
   public:
     enum class RecordResult {
         ALLOCATION_RECORD,
+        AGGREGATED_ALLOCATION_RECORD,
+        ALLOCATION_COUNTS_RECORD,
         MEMORY_RECORD,
         ERROR,
         END_OF_FILE,
@@ -43,37 +81,252 @@ class RecordReader
             FrameTree::index_t index,
             size_t generation,
             size_t max_stacks = std::numeric_limits<size_t>::max());
+    // The native stack with the Python frames in place of the frames of the
+    // interpreter that evaluated them, as a tuple. Native frames after the
+    // one of the outermost Python frame are left out, and so are the frames
+    // of Cython modules, which aren't evaluated by the interpreter. Merged
+    // stacks are kept, so records with the same stacks share their tuple.
+    PyObject* Py_GetHybridStackFrame(
+            FrameTree::index_t index,
+            FrameTree::index_t native_index,
+            size_t generation,
+            size_t max_stacks = std::numeric_limits<size_t>::max());
+    // Resolve the stacks of many records at once, converting each distinct
+    // frame and stack to Python objects only once. They return a tuple with
+    // the list of the frames, the list of the distinct stacks, each one a
+    // tuple with the positions of its frames in the first list (from the most
+    // recent call on), and the list with the position of the stack of each
+    // of the records among the stacks.
+    PyObject* Py_GetStackTable(
+            const std::vector<FrameTree::index_t>& indexes,
+            size_t max_stacks = std::numeric_limits<size_t>::max());
+    PyObject* Py_GetNativeStackTable(
+            const std::vector<FrameTree::index_t>& indexes,
+            const std::vector<size_t>& generations,
+            size_t max_stacks = std::numeric_limits<size_t>::max());
+    PyObject* Py_GetFrame(frame_id_t frame_id);
+    // Native frames that are resolved in bulk are symbolized by up to
+    // max_workers threads, and the symbols are kept in cache_directory, to be
+    // reused by later readers, unless it's empty.
+    void configureSymbolResolution(size_t max_workers, const std::string& cache_directory);
+    // Stop resolving native frames when they are needed, and only give the
+    // binary and the offset into it for the ones whose symbols aren't known
+    // yet. The frames of the native stacks that are read from then on are
+    // resolved by whoever calls resolveDeferredSymbols(), which does it
+    // until stopResolvingSymbols() is called, and bumps symbolsVersion()
+    // every time it has resolved some more.
+    void deferSymbolResolution();
+    void resolveDeferredSymbols();
+    void stopResolvingSymbols();
+    uint64_t symbolsVersion() const noexcept;
+    // Report the progress of parsing the file, and of symbolizing native
+    // frames in bulk, to progress. When it's cancelled, the parsing fails
+    // and the native stack tables come back as None.
+    void setProgress(std::shared_ptr<ReadProgress> progress);
+    ReadProgress* progress() const noexcept;
+    // Lock what the reader has read while it's used, for readers that one
+    // thread reads while others look up the records it has read, like the
+    // ones of live captures. Readers only used by one thread at a time don't
+    // lock anything. It must be called before the reader is shared.
+    void shareBetweenThreads() noexcept;
+    // Lock what the reader has read while a thread reads more of it without
+    // holding the GIL, as other threads can look up the records it handed out
+    // meanwhile. Both must be called with the GIL held, which every lookup of
+    // a record holds too.
+    void startReadingWithoutGil() noexcept;
+    void finishReadingWithoutGil() noexcept;
+    // Only keep the allocations that the filter selects. It must be called
+    // before any record is read.
+    void setFilter(const RecordFilter& filter);
+    // Fills frame_ids with the ids of the Python frames of a stack, from the
+    // most recent call to the oldest one, like Py_GetStackFrame() returns them.
+    void getStackFrameIds(FrameTree::index_t index, std::vector<frame_id_t>& frame_ids);
+    // The function name, file name and line of a Python frame. The names are
+    // the ones the reader interned, and they live as long as it does.
+    void getFrameInfo(
+            frame_id_t frame_id,
+            std::string_view& function_name,
+            std::string_view& filename,
+            int& lineno);
 
     RecordResult nextRecord();
+    // Reads records until max_records of the ones that nextRecord() returns
+    // have been read, or until the end of the file or an error, and returns
+    // what nextRecord() returned for the last of them. n_records is set to
+    // how many were read, not counting the end of the file or the error.
+    RecordResult nextRecords(size_t max_records, size_t& n_records);
+    // Reads up to the next allocation and returns it, or nullptr once the end
+    // of the file is reached or on errors. Allocations are forgotten once
+    // they have all been returned, so going through a file with this only
+    // keeps the allocations that are read together in memory at once.
+    const Allocation* nextAllocation();
     HeaderRecord getHeader() const noexcept;
     PyObject* dumpAllRecords();
     std::string getThreadName(thread_id_t tid);
     void clearRecords() noexcept;
     allocations_t& allocationRecords() noexcept;
+    std::vector<AggregatedAllocation>& aggregatedAllocationRecords() noexcept;
+    std::vector<AllocationCounts>& allocationCounts() noexcept;
+    std::vector<Allocation>& cancelledAllocationRecords() noexcept;
     std::vector<MemoryRecord>& memoryRecords() noexcept;
+    // How many allocations had been read when each memory record was found,
+    // which tells roughly when each allocation happened.
+    const std::vector<size_t>& memoryRecordAllocations() const noexcept;
+    // The gauges of the memory records that came with them, which are either
+    // all of them or none of them.
+    const std::vector<MemoryGauges>& memoryGauges() const noexcept;
+    const std::vector<uint64_t>& checkpointOffsets() const noexcept;
+    SinkLag sinkLag() const;
+
+    // Reads all of the records of the file, like calling nextRecord() until it
+    // returns END_OF_FILE or ERROR would. Files with checkpoints are split at
+    // them into up to max_workers ranges, which are read at the same time, by
+    // as many threads, if nothing has been read since the header.
+    RecordResult readAllRecords(const std::string& file_name, size_t max_workers);
 
   private:
     // Aliases
     using stack_t = std::vector<FrameTree::index_t>;
-    using stack_traces_t = std::unordered_map<thread_id_t, stack_t>;
+    // Indexed by thread id, which is a small integer assigned by the tracker.
+    using stack_traces_t = std::vector<stack_t>;
+    // The stacks of the threads with ids far beyond the ones seen so far are
+    // kept apart, so that a corrupt file can't make the vector any size.
+    using sparse_stack_traces_t = std::unordered_map<thread_id_t, stack_t>;
+    static constexpr thread_id_t MAX_THREAD_ID_GAP = 65536;
+
+    // What a reader of a range of the file found about the memory maps,
+    // which are only given to the symbol resolver when the ranges are merged.
+    struct DeferredSegments
+    {
+        // MEMORY_MAP_START, MEMORY_MAP_UPDATE, SEGMENT_HEADER (with the
+        // segments that were added) or SEGMENTS_REMOVED.
+        RecordType type;
+        std::string filename;
+        uintptr_t addr;
+        std::vector<Segment> segments;
+        std::string build_id;
+    };
+
+    // Private constructors
+    RecordReader(
+            std::unique_ptr<memray::io::Source> source,
+            const HeaderRecord& header,
+            bool skip_header);
+
+    struct HybridStackKey
+    {
+        FrameTree::index_t index;
+        FrameTree::index_t native_index;
+        size_t generation;
+        size_t max_stacks;
+
+        bool operator==(const HybridStackKey& other) const
+        {
+            return index == other.index && native_index == other.native_index
+                   && generation == other.generation && max_stacks == other.max_stacks;
+        }
+
+        struct Hash
+        {
+            size_t operator()(const HybridStackKey& key) const noexcept
+            {
+                uint64_t hash = key.index;
+                hash = containers::combineHash(hash, key.native_index);
+                hash = containers::combineHash(hash, key.generation);
+                hash = containers::combineHash(hash, key.max_stacks);
+                return containers::mixHash(hash);
+            }
+        };
+    };
 
     // Private methods
     void readHeader(HeaderRecord& header);
+    bool addFrame(const pyframe_map_val_t& entry);
+    PyObject* frameToPythonObject(frame_id_t frame_id) const;
+    bool isEvalFrame(
+            const native_resolver::ResolvedFrame& frame,
+            const native_resolver::StringStorage& strings);
+    [[nodiscard]] bool readOverhead(TrackerOverhead& overhead);
+    [[nodiscard]] bool readRecordType(RecordType& record_type);
+    RecordResult parseNextRecord();
+    PyObject* printAllRecords();
+    // Locks d_mutex if the reader is shared between threads, or while it's
+    // read without the GIL.
+    std::unique_lock<std::mutex> lockIfShared() const;
+    // Add what's been read since the last report to the progress, and
+    // return false if the read has been cancelled.
+    [[nodiscard]] bool reportProgress();
+    void startReportingProgress();
+    void finishReportingProgress();
 
     // Data members
     mutable std::mutex d_mutex;
+    bool d_shared{false};
+    std::atomic<unsigned> d_reads_without_gil{0};
     std::unique_ptr<memray::io::Source> d_input;
     HeaderRecord d_header;
     pyframe_map_t d_frame_map{};
     FrameCollection<Frame> d_allocation_frames{1, 2};
     stack_traces_t d_stack_traces{};
+    sparse_stack_traces_t d_sparse_stack_traces{};
     FrameTree d_tree{};
+    // The strings of the Python frames are interned when the frames are read,
+    // and the Python objects for them are found by their ids.
+    native_resolver::StringStorage d_python_strings;
+    using string_id_t = python_helpers::PyUnicode_Cache::id_t;
+    containers::FlatHashMap<frame_id_t, std::pair<string_id_t, string_id_t>> d_frame_string_ids{};
     mutable python_helpers::PyUnicode_Cache d_pystring_cache{};
+    // Native frames have their own ids, the ones of the symbol resolver.
+    mutable python_helpers::PyUnicode_Cache d_native_pystring_cache{};
     native_resolver::SymbolResolver d_symbol_resolver;
+    // Whether each symbol of the resolver is the one of the interpreter's
+    // eval loop, by its id: 0 if it hasn't been looked at yet, 1 if it
+    // isn't and 2 if it is.
+    std::vector<uint8_t> d_eval_frame_symbols{};
+    python_helpers::PyObject_Cache<HybridStackKey, HybridStackKey::Hash> d_hybrid_stacks{};
+    size_t d_symbolizer_workers{1};
+    bool d_defer_symbol_resolution{false};
+    std::atomic<bool> d_stop_resolving_symbols{false};
+    std::condition_variable d_deferred_symbols_cv;
+    std::atomic<uint64_t> d_symbols_version{0};
     std::vector<UnresolvedNativeFrame> d_native_frames{};
     std::unordered_map<thread_id_t, std::string> d_thread_names;
     allocations_t d_allocation_records;
+    // The allocation that nextAllocation() last returned.
+    Allocation d_streamed_allocation;
+    std::vector<AggregatedAllocation> d_aggregated_allocation_records;
+    std::vector<AllocationCounts> d_allocation_counts;
+    std::vector<Allocation> d_cancelled_allocation_records;
     std::vector<MemoryRecord> d_memory_records;
+    std::vector<size_t> d_memory_record_allocations;
+    std::vector<MemoryGauges> d_memory_gauges;
+    SinkLag d_sink_lag{};
+    // Including the ones that nextAllocation() has forgotten since.
+    size_t d_n_released_allocations{0};
+    std::vector<std::pair<sequence_t, Allocation>> d_pending_allocations;
+    std::vector<size_t> d_pending_runs;
+    sequence_t d_next_sequence{0};
+    size_t d_unreported_allocations{0};
+    std::vector<char> d_chunk_data;
+    std::unordered_map<thread_id_t, thread_id_t> d_legacy_thread_ids;
+    std::vector<uint64_t> d_checkpoint_offsets;
+    size_t d_segment_generation{0};
+    std::shared_ptr<ReadProgress> d_progress;
+    // Whether the parse phase has been started or finished, by the reader
+    // that reports it. The readers of ranges only add to its progress.
+    bool d_parse_started{false};
+    bool d_parse_finished{false};
+    uint64_t d_reported_bytes{0};
+    size_t d_unreported_records{0};
+    RecordFilter d_filter{};
+    bool d_filtered{false};
+    // The time of the last memory record read, as a filter sees it.
+    millis_t d_current_time{0};
+
+    // Only used by the readers that readAllRecords() gives a range of the file to.
+    bool d_reading_range{false};
+    std::vector<sequence_t> d_allocation_sequences;
+    std::vector<DeferredSegments> d_deferred_segments;
 
     // Methods
     [[nodiscard]] bool parseFramePush();
@@ -83,8 +336,34 @@ class RecordReader
     [[nodiscard]] bool parseAllocationRecord();
     [[nodiscard]] bool parseSegmentHeader();
     [[nodiscard]] bool parseSegment(Segment& segment);
+    [[nodiscard]] bool parseSegmentsRemoved();
+    void startMemoryMap(RecordType type);
     [[nodiscard]] bool parseThreadRecord();
-    [[nodiscard]] bool parseMemoryRecord();
+    [[nodiscard]] bool parseMemoryRecord(RecordType type);
+    [[nodiscard]] bool parseThreadChunk();
+    [[nodiscard]] bool parseChunkBarrier();
+    [[nodiscard]] bool parseCheckpoint();
+    [[nodiscard]] bool parseCheckpointIndex();
+    [[nodiscard]] bool parsePythonTraceIndex();
+    [[nodiscard]] bool parseAggregatedAllocation();
+    [[nodiscard]] bool parseAllocationCounts();
+    [[nodiscard]] bool parseSinkStats();
+
+    thread_id_t legacyThreadId(thread_id_t tid);
+    stack_t& stackForThread(thread_id_t tid);
+    void pushFrame(thread_id_t tid, frame_id_t frame_id);
+    void popFrames(thread_id_t tid, uint8_t count);
+    void updateFrameLine(thread_id_t tid, frame_id_t frame_id);
+    void addAllocation(
+            sequence_t sequence,
+            const AllocationRecord& record,
+            uintptr_t realloc_old_address = 0);
+    bool filterKeeps(const AllocationRecord& record, uintptr_t realloc_old_address) const;
+    void skipAllocation(sequence_t sequence);
+    void releasePendingAllocations(sequence_t next_sequence);
+    void addCancelledAllocations(const CancelledAllocations& record);
+
+    void mergeRange(RecordReader& range, std::vector<sequence_t>& sequences);
 
     size_t getAllocationFrameIndex(const AllocationRecord& record);
 };
@@ -1,8 +1,15 @@
+from _memray.allocation_store cimport AllocationStore
+from _memray.read_progress cimport ReadProgress
+from _memray.records cimport AggregatedAllocation
 from _memray.records cimport Allocation
+from _memray.records cimport AllocationCounts
 from _memray.records cimport HeaderRecord
+from _memray.records cimport MemoryGauges
 from _memray.records cimport MemoryRecord
 from _memray.source cimport Source
+from libc.stdint cimport uint64_t
 from libcpp cimport bool
+from libcpp.memory cimport shared_ptr
 from libcpp.memory cimport unique_ptr
 from libcpp.string cimport string
 from libcpp.vector cimport vector
@@ -11,22 +18,59 @@ from libcpp.vector cimport vector
 cdef extern from "record_reader.h" namespace "memray::api":
     cdef enum RecordResult 'memray::api::RecordReader::RecordResult':
         RecordResultAllocationRecord 'memray::api::RecordReader::RecordResult::ALLOCATION_RECORD'
+        RecordResultAggregatedAllocationRecord 'memray::api::RecordReader::RecordResult::AGGREGATED_ALLOCATION_RECORD'
+        RecordResultAllocationCountsRecord 'memray::api::RecordReader::RecordResult::ALLOCATION_COUNTS_RECORD'
         RecordResultMemoryRecord 'memray::api::RecordReader::RecordResult::MEMORY_RECORD'
         RecordResultError 'memray::api::RecordReader::RecordResult::ERROR'
         RecordResultEndOfFile 'memray::api::RecordReader::RecordResult::END_OF_FILE'
 
+    cdef struct SinkLag:
+        uint64_t n_reports
+        uint64_t sender_blocked_ns
+        uint64_t lag_ns
+        uint64_t max_lag_ns
+
+    cdef cppclass RecordFilter:
+        vector[unsigned long] thread_ids
+        long long start_time
+        long long end_time
+
     cdef cppclass RecordReader:
         RecordReader(unique_ptr[Source]) except+
         void close()
         bool isOpen() const
         RecordResult nextRecord() except+
+        RecordResult nextRecords(size_t max_records, size_t& n_records) nogil except+
+        const Allocation* nextAllocation() nogil except+
+        RecordResult readAllRecords(string file_name, size_t max_workers) nogil except+
+        void startReadingWithoutGil()
+        void finishReadingWithoutGil()
         object Py_GetStackFrame(int frame_id) except+
         object Py_GetStackFrame(int frame_id, size_t max_stacks) except+
+        object Py_GetStackTable(const vector[unsigned int]& indexes, size_t max_stacks) except+
+        object Py_GetNativeStackTable(
+            const vector[unsigned int]& indexes,
+            const vector[size_t]& generations,
+            size_t max_stacks
+        ) except+
+        object Py_GetFrame(size_t frame_id) except+
+        void configureSymbolResolution(size_t max_workers, string cache_directory) except+
+        void setProgress(shared_ptr[ReadProgress] progress)
+        void setFilter(const RecordFilter& filter) except+
+        ReadProgress* progress()
+        void getStackFrameIds(unsigned int index, vector[size_t]& frame_ids) except+
         object Py_GetNativeStackFrame(int frame_id, size_t generation) except+
         object Py_GetNativeStackFrame(int frame_id, size_t generation, size_t max_stacks) except+
+        object Py_GetHybridStackFrame(int frame_id, int native_frame_id, size_t generation) except+
+        object Py_GetHybridStackFrame(int frame_id, int native_frame_id, size_t generation, size_t max_stacks) except+
         size_t totalAllocations()
         HeaderRecord getHeader()
         object dumpAllRecords() except+
         string getThreadName(long int tid) except+
-        vector[Allocation]& allocationRecords() except+
+        AllocationStore& allocationRecords() except+
+        vector[AggregatedAllocation]& aggregatedAllocationRecords() except+
+        vector[AllocationCounts]& allocationCounts() except+
+        vector[Allocation]& cancelledAllocationRecords() except+
         vector[MemoryRecord]& memoryRecords() except+
+        const vector[size_t]& memoryRecordAllocations()
+        const vector[MemoryGauges]& memoryGauges()
@@ -1,12 +1,421 @@
 #include <chrono>
+#include <cstddef>
 #include <fcntl.h>
+#include <sched.h>
 #include <stdexcept>
 
+#include "hooks.h"
 #include "record_writer.h"
 
 namespace memray::tracking_api {
 
 using namespace std::chrono;
+using memray::hooks::RecursionGuard;
+
+namespace {
+
+// Track how many times a new RecordWriter has been created, so that threads
+// can tell that the buffer they hold belongs to a writer that's gone.
+std::atomic<unsigned int> g_writer_generation;
+
+// This must be trivially destructible (see the comment on PythonStackTracker
+// in tracking_api.cpp): records can still be written from a thread after its
+// non-trivial thread locals have been destroyed. The ThreadBufferOwner below
+// owns the buffer and resets this when the thread exits.
+struct ThreadBufferSlot
+{
+    ThreadBuffer* buffer;
+    unsigned int writer_generation;
+    bool thread_exited;
+};
+
+MEMRAY_FAST_TLS thread_local ThreadBufferSlot t_thread_buffer_slot;
+
+// For the counters that only their owning thread adds to, which don't need
+// an atomic read-modify-write.
+void
+ownerAdd(std::atomic<uint64_t>& counter, uint64_t value)
+{
+    counter.store(counter.load(std::memory_order_relaxed) + value, std::memory_order_relaxed);
+}
+
+}  // namespace
+
+class ThreadBufferOwner
+{
+  public:
+    std::shared_ptr<ThreadBuffer> buffer;
+    std::weak_ptr<RecordWriter> writer;
+
+    ~ThreadBufferOwner()
+    {
+        // Anything this thread writes from now on goes straight to the sink,
+        // so move what's buffered there first to keep this thread's records
+        // in order.
+        t_thread_buffer_slot = {nullptr, 0, true};
+        if (!buffer) {
+            return;
+        }
+        RecursionGuard guard;
+        if (auto the_writer = writer.lock()) {
+            the_writer->retireThreadBuffer(*buffer);
+        }
+        buffer.reset();
+    }
+};
+
+ThreadBuffer::ThreadBuffer(thread_id_t tid)
+: d_tid(tid)
+, d_data(new char[CAPACITY])
+{
+}
+
+thread_id_t
+ThreadBuffer::tid() const
+{
+    return d_tid;
+}
+
+size_t
+ThreadBuffer::freeSpace() const
+{
+    return CAPACITY
+           - (d_tail.load(std::memory_order_relaxed) - d_head.load(std::memory_order_acquire));
+}
+
+void
+ThreadBuffer::append(const char* data, size_t length)
+{
+    size_t tail = d_tail.load(std::memory_order_relaxed);
+    size_t start = tail % CAPACITY;
+    size_t first_part = std::min(length, CAPACITY - start);
+    ::memcpy(d_data.get() + start, data, first_part);
+    ::memcpy(d_data.get(), data + first_part, length - first_part);
+    d_tail.store(tail + length, std::memory_order_release);
+}
+
+void
+ThreadBuffer::markBusy()
+{
+    // This must be ordered before the sequence number is taken, see
+    // RecordWriter::drainThreadBuffersUnsafe.
+    d_busy.store(true, std::memory_order_seq_cst);
+}
+
+void
+ThreadBuffer::publish()
+{
+    d_busy.store(false, std::memory_order_release);
+}
+
+void
+ThreadBuffer::countAllocations(size_t count)
+{
+    // Only the owning thread ever increments this, so there's no need for an
+    // atomic read-modify-write.
+    size_t n_allocations = d_n_allocations.load(std::memory_order_relaxed);
+    d_n_allocations.store(n_allocations + count, std::memory_order_relaxed);
+}
+
+AllocationStage&
+ThreadBuffer::stage()
+{
+    return d_stage;
+}
+
+AllocationCounters&
+ThreadBuffer::counters()
+{
+    return d_counters;
+}
+
+void
+ThreadBuffer::waitForPendingRecord() const
+{
+    // If the producer is in the middle of appending a record, wait until that
+    // record (and only that one) has been published.
+    size_t tail = d_tail.load(std::memory_order_acquire);
+    while (d_busy.load(std::memory_order_seq_cst) && d_tail.load(std::memory_order_acquire) == tail) {
+        sched_yield();
+    }
+}
+
+size_t
+ThreadBuffer::nAllocations() const
+{
+    return d_n_allocations.load(std::memory_order_relaxed);
+}
+
+OverheadCounters&
+ThreadBuffer::overhead()
+{
+    return d_overhead;
+}
+
+const OverheadCounters&
+ThreadBuffer::overhead() const
+{
+    return d_overhead;
+}
+
+void
+OverheadCounters::countRecord(RecordType token, size_t length)
+{
+    auto index = static_cast<size_t>(token);
+    ownerAdd(d_n_records[index], 1);
+    ownerAdd(d_n_bytes[index], length);
+}
+
+void
+OverheadCounters::countHookCalls(uint64_t n_calls, uint64_t hooks_ns, uint64_t unwind_ns)
+{
+    ownerAdd(d_n_hook_calls, n_calls);
+    ownerAdd(d_hooks_ns, hooks_ns);
+    ownerAdd(d_unwind_ns, unwind_ns);
+}
+
+void
+OverheadCounters::addTo(TrackerOverhead& overhead) const
+{
+    overhead.n_hook_calls += d_n_hook_calls.load(std::memory_order_relaxed);
+    overhead.hooks_ns += d_hooks_ns.load(std::memory_order_relaxed);
+    overhead.unwind_ns += d_unwind_ns.load(std::memory_order_relaxed);
+    for (size_t i = 0; i < N_RECORD_TYPES; ++i) {
+        overhead.n_records[i] += d_n_records[i].load(std::memory_order_relaxed);
+        overhead.n_bytes[i] += d_n_bytes[i].load(std::memory_order_relaxed);
+    }
+}
+
+void
+AllocationStage::lock()
+{
+    while (d_lock.test_and_set(std::memory_order_acquire)) {
+        sched_yield();
+    }
+}
+
+bool
+AllocationStage::tryLock()
+{
+    return !d_lock.test_and_set(std::memory_order_acquire);
+}
+
+void
+AllocationStage::unlock()
+{
+    d_lock.clear(std::memory_order_release);
+}
+
+bool
+AllocationStage::empty() const
+{
+    return d_size == 0;
+}
+
+bool
+AllocationStage::full() const
+{
+    return d_size == CAPACITY;
+}
+
+size_t
+AllocationStage::size() const
+{
+    return d_size;
+}
+
+const AllocationStage::Entry&
+AllocationStage::entry(size_t index) const
+{
+    assert(index < d_size);
+    return d_entries[index];
+}
+
+void
+AllocationStage::push(const Entry& entry)
+{
+    assert(d_size < CAPACITY);
+    d_entries[d_size++] = entry;
+}
+
+AllocationStage::Entry
+AllocationStage::popOldest()
+{
+    assert(d_size > 0);
+    Entry oldest = d_entries[0];
+    std::copy(d_entries + 1, d_entries + d_size, d_entries);
+    --d_size;
+    return oldest;
+}
+
+bool
+AllocationStage::cancel(uintptr_t address, AllocationRecord& cancelled)
+{
+    // If the address was freed and reused since it was staged, the record of
+    // the deallocation came from another thread, so the allocation that this
+    // one is freeing is the most recent one.
+    for (size_t i = d_size; i-- > 0;) {
+        const Entry& entry = d_entries[i];
+        if (!entry.is_reallocation && entry.record.allocation.address == address
+            && hooks::allocatorKind(entry.record.allocation.allocator)
+                       == hooks::AllocatorKind::SIMPLE_ALLOCATOR)
+        {
+            cancelled = entry.record.allocation;
+            std::copy(d_entries + i + 1, d_entries + d_size, d_entries + i);
+            --d_size;
+            return true;
+        }
+    }
+    return false;
+}
+
+bool
+AllocationStage::addCancelled(const AllocationRecord& record)
+{
+    for (size_t i = 0; i < d_n_cancelled; ++i) {
+        CancelledAllocations& counts = d_cancelled[i];
+        if (counts.allocator == record.allocator && counts.native_frame_id == record.native_frame_id) {
+            counts.count += 1;
+            counts.bytes += record.size;
+            return true;
+        }
+    }
+    if (d_n_cancelled == MAX_CANCELLED) {
+        return false;
+    }
+    d_cancelled[d_n_cancelled++] = {record.tid, record.allocator, record.native_frame_id, 1, record.size};
+    return true;
+}
+
+size_t
+AllocationStage::nCancelled() const
+{
+    return d_n_cancelled;
+}
+
+const CancelledAllocations&
+AllocationStage::cancelled(size_t index) const
+{
+    assert(index < d_n_cancelled);
+    return d_cancelled[index];
+}
+
+void
+AllocationStage::clearCancelled()
+{
+    d_n_cancelled = 0;
+}
+
+sequence_t
+AllocationStage::oldestSequence() const
+{
+    return d_oldest_sequence.load(std::memory_order_seq_cst);
+}
+
+void
+AllocationStage::setOldestSequence(sequence_t sequence)
+{
+    d_oldest_sequence.store(sequence, std::memory_order_seq_cst);
+}
+
+void
+AllocationStage::updateOldestSequence()
+{
+    setOldestSequence(d_size ? d_entries[0].sequence : NO_SEQUENCE);
+}
+
+void
+AllocationStage::clear()
+{
+    d_size = 0;
+    d_n_cancelled = 0;
+}
+
+void
+AllocationCounters::lock()
+{
+    while (d_lock.test_and_set(std::memory_order_acquire)) {
+        sched_yield();
+    }
+}
+
+void
+AllocationCounters::unlock()
+{
+    d_lock.clear(std::memory_order_release);
+}
+
+std::vector<FrameTree::index_t>&
+AllocationCounters::pythonStack()
+{
+    return d_python_stack;
+}
+
+void
+AllocationCounters::count(const Key& key, uint64_t n_calls, uint64_t n_bytes)
+{
+    auto [it, inserted] = d_counts.try_emplace(key, Counts{n_calls, n_bytes});
+    if (!inserted) {
+        it->second.n_calls += n_calls;
+        it->second.n_bytes += n_bytes;
+    }
+}
+
+void
+AllocationCounters::takeCounts(thread_id_t tid, std::vector<AllocationCounts>& counts)
+{
+    for (const auto& [key, value] : d_counts) {
+        counts.push_back(
+                {tid,
+                 key.allocator,
+                 key.native_frame_id,
+                 key.frame_index,
+                 key.native_segment_generation,
+                 value.n_calls,
+                 value.n_bytes});
+    }
+    d_counts.clear();
+}
+
+// Serialize staged records the way writeThreadSpecificRecord would have,
+// returning the number of bytes written to data.
+static size_t
+serializeStagedRecord(const AllocationStage::Entry& entry, char* data)
+{
+    RecordType token = entry.is_reallocation ? RecordType::REALLOCATION : RecordType::ALLOCATION;
+    ::memcpy(data, &token, sizeof(token));
+    ::memcpy(data + sizeof(token), &entry.sequence, sizeof(entry.sequence));
+    size_t length = sizeof(token) + sizeof(entry.sequence);
+    if (entry.is_reallocation) {
+        ::memcpy(data + length, &entry.record, sizeof(entry.record));
+        return length + sizeof(entry.record);
+    }
+    ::memcpy(data + length, &entry.record.allocation, sizeof(entry.record.allocation));
+    return length + sizeof(entry.record.allocation);
+}
+
+static size_t
+serializeCancelled(const AllocationStage& stage, char* data)
+{
+    char* cursor = data;
+    for (size_t i = 0; i < stage.nCancelled(); ++i) {
+        RecordType token = RecordType::CANCELLED_ALLOCATIONS;
+        ::memcpy(cursor, &token, sizeof(token));
+        ::memcpy(cursor + sizeof(token), &stage.cancelled(i), sizeof(CancelledAllocations));
+        cursor += sizeof(token) + sizeof(CancelledAllocations);
+    }
+    return cursor - data;
+}
+
+static size_t
+serializeStage(const AllocationStage& stage, char* data)
+{
+    size_t length = 0;
+    for (size_t i = 0; i < stage.size(); ++i) {
+        length += serializeStagedRecord(stage.entry(i), data + length);
+    }
+    return length + serializeCancelled(stage, data + length);
+}
 
 static PythonAllocatorType
 getPythonAllocator()
@@ -34,9 +443,21 @@ getPythonAllocator()
 RecordWriter::RecordWriter(
         std::unique_ptr<memray::io::Sink> sink,
         const std::string& command_line,
-        bool native_traces)
-: d_sink(std::move(sink))
+        bool native_traces,
+        size_t sample_rate,
+        FileFormat file_format,
+        bool cancel_short_lived_allocations,
+        BackpressurePolicy backpressure)
+: d_generation(++g_writer_generation)
+, d_sink(std::make_unique<io::AsyncSink>(std::move(sink)))
 , d_stats({0, 0, duration_cast<milliseconds>(system_clock::now().time_since_epoch()).count()})
+, d_chunk_records(new char[ThreadBuffer::CAPACITY])
+, d_chunk_data(new char[ThreadBuffer::CAPACITY])
+, d_stage_allocations(
+          cancel_short_lived_allocations && file_format == FILEFORMAT_ALL_ALLOCATIONS)
+, d_backpressure(backpressure)
+, d_restart_point_interval(d_sink->restartPointInterval())
+, d_sink_is_live(d_sink->isLive())
 {
     d_header = HeaderRecord{
             "",
@@ -45,15 +466,22 @@ RecordWriter::RecordWriter(
             d_stats,
             command_line,
             ::getpid(),
-            getPythonAllocator()};
+            getPythonAllocator(),
+            sample_rate,
+            file_format};
     strncpy(d_header.magic, MAGIC, sizeof(d_header.magic));
 }
 
 bool
 RecordWriter::writeHeader(bool seek_to_start)
 {
-    std::lock_guard<std::mutex> lock(d_mutex);
+    auto lock = lockMutex();
     if (seek_to_start) {
+        // The index goes at the end of the capture, and the header that we're
+        // about to rewrite says where it is.
+        if (!writeCheckpointIndexUnsafe()) {
+            return false;
+        }
         // If we can't seek to the beginning to the stream (e.g. dealing with a socket), just give
         // up.
         if (!d_sink->seek(0, SEEK_SET)) {
@@ -61,22 +489,875 @@ RecordWriter::writeHeader(bool seek_to_start)
         }
     }
 
+    if (!writeHeaderUnsafe()) {
+        return false;
+    }
+    // Whatever follows the header can be read from the start, and the
+    // header itself is always kept.
+    if (!seek_to_start && d_restart_point_interval && !d_sink->markRestartPoint(nullptr, 0)) {
+        return false;
+    }
+    return d_sink->flush();
+}
+
+bool
+RecordWriter::writeHeaderUnsafe()
+{
     d_stats.end_time = duration_cast<milliseconds>(system_clock::now().time_since_epoch()).count();
     d_header.stats = d_stats;
+    d_header.dropped_records = d_dropped_records.load(std::memory_order_relaxed);
+    for (const auto& buffer : d_thread_buffers) {
+        d_header.stats.n_allocations += buffer->nAllocations();
+    }
+    d_header.overhead = overheadUnsafe();
     if (!writeSimpleType(d_header.magic) or !writeSimpleType(d_header.version)
         or !writeSimpleType(d_header.native_traces) or !writeSimpleType(d_header.stats)
         or !writeString(d_header.command_line.c_str()) or !writeSimpleType(d_header.pid)
-        or !writeSimpleType(d_header.python_allocator))
+        or !writeSimpleType(d_header.python_allocator) or !writeSimpleType(d_header.sample_rate)
+        or !writeSimpleType(d_header.file_format) or !writeSimpleType(d_header.dropped_records)
+        or !writeSimpleType(d_header.checkpoint_index_offset) or !writeOverheadUnsafe(d_header.overhead))
     {
         return false;
     }
     return true;
 }
 
+bool
+RecordWriter::writeOverheadUnsafe(const TrackerOverhead& overhead)
+{
+    const uint32_t n_types = N_RECORD_TYPES;
+    return writeAll(reinterpret_cast<const char*>(&overhead), offsetof(TrackerOverhead, n_records))
+           && writeSimpleType(n_types)
+           && writeAll(reinterpret_cast<const char*>(overhead.n_records), sizeof(overhead.n_records))
+           && writeAll(reinterpret_cast<const char*>(overhead.n_bytes), sizeof(overhead.n_bytes));
+}
+
+bool
+RecordWriter::dump()
+{
+    auto lock = lockMutex();
+    if (!d_restart_point_interval) {
+        return true;
+    }
+    // The sink rewrites the header in place, so that the dump says how far the
+    // capture got, and then carries on where it was. Our idea of where that
+    // is starts over, though.
+    if (!drainThreadBuffersUnsafe() || !d_sink->seek(0, SEEK_SET) || !writeHeaderUnsafe()) {
+        return false;
+    }
+    d_last_checkpoint_position = d_sink->position();
+    return d_sink->flush();
+}
+
+bool
+RecordWriter::keepsOnlyRecentRecords() const
+{
+    return d_restart_point_interval != 0;
+}
+
+bool
+RecordWriter::countsAllocationsOnly() const
+{
+    return d_header.file_format == FILEFORMAT_ALLOCATION_COUNTS;
+}
+
+bool
+RecordWriter::writeSinkStats()
+{
+    if (!d_sink_is_live) {
+        return true;
+    }
+    auto lock = lockMutex();
+    SinkStats stats{
+            static_cast<uint64_t>(
+                    duration_cast<nanoseconds>(system_clock::now().time_since_epoch()).count()),
+            d_sink->blockedNanoseconds()};
+    return writeRecordUnsafe(RecordType::SINK_STATS, stats);
+}
+
+ThreadBuffer*
+RecordWriter::getThreadBuffer(thread_id_t tid, bool create)
+{
+    ThreadBufferSlot& slot = t_thread_buffer_slot;
+    if (slot.buffer && slot.writer_generation == d_generation) {
+        return slot.buffer;
+    }
+    if (!create || slot.thread_exited) {
+        return nullptr;
+    }
+
+    // Only touch the owner when we know it's safe to create it: this is never
+    // done for a thread that is already being torn down.
+    MEMRAY_FAST_TLS static thread_local ThreadBufferOwner t_thread_buffer_owner;
+
+    auto buffer = std::make_shared<ThreadBuffer>(tid);
+    {
+        auto lock = lockMutex();
+        d_thread_buffers.push_back(buffer);
+    }
+    t_thread_buffer_owner.buffer = buffer;
+    t_thread_buffer_owner.writer = weak_from_this();
+    slot = {buffer.get(), d_generation, false};
+    return slot.buffer;
+}
+
+bool
+RecordWriter::appendToThreadBuffer(
+        thread_id_t tid,
+        char* data,
+        size_t length,
+        bool sequenced,
+        bool may_create_buffer)
+{
+    RecordType token;
+    ::memcpy(&token, data, sizeof(RecordType));
+    if (d_header.file_format == FILEFORMAT_AGGREGATED_ALLOCATIONS) {
+        auto lock = lockMutex();
+        countRecordUnsafe(token, length);
+        if (sequenced) {
+            d_stats.n_allocations += 1;
+        }
+        return aggregateRecordUnsafe(tid, data);
+    }
+
+    ThreadBuffer* buffer = getThreadBuffer(tid, may_create_buffer);
+    if (d_header.file_format == FILEFORMAT_ALLOCATION_COUNTS) {
+        if (!buffer) {
+            // The thread is being torn down, and what it does now isn't
+            // worth counting.
+            return true;
+        }
+        buffer->overhead().countRecord(token, length);
+        if (sequenced) {
+            buffer->countAllocations(1);
+        }
+        return countRecord(*buffer, data);
+    }
+    if (!buffer) {
+        // Fall back to writing a chunk with just this record directly to the sink.
+        auto lock = lockMutex();
+        countRecordUnsafe(token, length);
+        if (sequenced) {
+            sequence_t sequence = d_next_sequence.fetch_add(1, std::memory_order_seq_cst);
+            ::memcpy(data + sizeof(RecordType), &sequence, sizeof(sequence));
+            d_stats.n_allocations += 1;
+        }
+        char encoded[ChunkEncoder::MAX_RECORD_SIZE];
+        ChunkEncoder encoder(encoded, sizeof(encoded));
+        return writeChunkUnsafe(tid, data, length, encoder);
+    }
+
+    buffer->overhead().countRecord(token, length);
+    if (!d_stage_allocations) {
+        return appendToBuffer(*buffer, data, length, sequenced);
+    }
+
+    AllocationStage& stage = buffer->stage();
+    stage.lock();
+    bool ret;
+    if (sequenced) {
+        ret = stageRecord(*buffer, data);
+    } else {
+        // The Python stack of the thread is about to change, and the reader
+        // uses the one it has when it finds each record.
+        ret = flushStageToBuffer(*buffer) && appendToBuffer(*buffer, data, length, false);
+    }
+    stage.unlock();
+    return ret;
+}
+
+bool
+RecordWriter::reserveBufferSpace(ThreadBuffer& buffer, size_t length)
+{
+    if (buffer.freeSpace() < length) {
+        auto lock = lockMutex();
+        return flushThreadBufferUnsafe(buffer);
+    }
+    return true;
+}
+
+bool
+RecordWriter::mustDropRecord(ThreadBuffer& buffer, size_t length)
+{
+    // Making room for the record would mean waiting for the sink.
+    if (d_backpressure != BACKPRESSURE_DROP || buffer.freeSpace() >= length || !d_sink->isBehind()) {
+        return false;
+    }
+    d_dropped_records.fetch_add(1, std::memory_order_relaxed);
+    return true;
+}
+
+bool
+RecordWriter::appendToBuffer(ThreadBuffer& buffer, char* data, size_t length, bool sequenced)
+{
+    // Only allocation records can be dropped: the Python stacks of the
+    // reader must stay right for the records that we do write.
+    if (sequenced && mustDropRecord(buffer, length)) {
+        return true;
+    }
+    if (!reserveBufferSpace(buffer, length)) {
+        return false;
+    }
+
+    buffer.markBusy();
+    if (sequenced) {
+        sequence_t sequence = d_next_sequence.fetch_add(1, std::memory_order_seq_cst);
+        ::memcpy(data + sizeof(RecordType), &sequence, sizeof(sequence));
+        buffer.countAllocations(1);
+    }
+    buffer.append(data, length);
+    buffer.publish();
+    return true;
+}
+
+bool
+RecordWriter::stageRecord(ThreadBuffer& buffer, const char* data)
+{
+    AllocationStage& stage = buffer.stage();
+    AllocationStage::Entry entry{};
+    RecordType token;
+    ::memcpy(&token, data, sizeof(RecordType));
+    data += sizeof(RecordType) + sizeof(sequence_t);
+    if (token == RecordType::REALLOCATION) {
+        ::memcpy(&entry.record, data, sizeof(ReallocationRecord));
+        entry.is_reallocation = true;
+    } else {
+        ::memcpy(&entry.record.allocation, data, sizeof(AllocationRecord));
+    }
+    const AllocationRecord& record = entry.record.allocation;
+    auto kind = hooks::allocatorKind(record.allocator);
+
+    uintptr_t freed_address = 0;
+    if (kind == hooks::AllocatorKind::SIMPLE_DEALLOCATOR) {
+        freed_address = record.address;
+    } else if (entry.is_reallocation) {
+        freed_address = entry.record.old_address;
+    }
+    AllocationRecord cancelled;
+    if (freed_address && stage.cancel(freed_address, cancelled)) {
+        if (!stage.addCancelled(cancelled)) {
+            if (!flushCancelledToBuffer(buffer)) {
+                return false;
+            }
+            bool added = stage.addCancelled(cancelled);
+            assert(added);
+            (void)added;
+        }
+        stage.updateOldestSequence();
+        if (kind == hooks::AllocatorKind::SIMPLE_DEALLOCATOR) {
+            return true;
+        }
+        // What's left of the reallocation is an allocation like any other,
+        // which can itself be cancelled by a later deallocation.
+        entry.is_reallocation = false;
+    }
+
+    if (stage.full() && !evictOldestStagedRecord(buffer)) {
+        return false;
+    }
+    if (stage.empty()) {
+        if (kind != hooks::AllocatorKind::SIMPLE_ALLOCATOR) {
+            // Nothing staged can be cancelled by this record, and there's no
+            // older staged record that it has to follow.
+            char record_data[sizeof(RecordType) + sizeof(sequence_t) + sizeof(ReallocationRecord)];
+            size_t length = serializeStagedRecord(entry, record_data);
+            return appendToBuffer(buffer, record_data, length, true);
+        }
+        // Set a lower bound for the sequence number before taking it, see
+        // drainThreadBuffersUnsafe.
+        stage.setOldestSequence(d_next_sequence.load(std::memory_order_seq_cst));
+    }
+    entry.sequence = d_next_sequence.fetch_add(1, std::memory_order_seq_cst);
+    stage.push(entry);
+    if (stage.size() == 1) {
+        stage.updateOldestSequence();
+    }
+    return true;
+}
+
+bool
+RecordWriter::evictOldestStagedRecord(ThreadBuffer& buffer)
+{
+    AllocationStage& stage = buffer.stage();
+    char data[sizeof(RecordType) + sizeof(sequence_t) + sizeof(ReallocationRecord)];
+    size_t length = serializeStagedRecord(stage.popOldest(), data);
+    if (mustDropRecord(buffer, length)) {
+        stage.updateOldestSequence();
+        return true;
+    }
+    if (!reserveBufferSpace(buffer, length)) {
+        return false;
+    }
+    buffer.append(data, length);
+    buffer.countAllocations(1);
+    // Only once the record is in the buffer.
+    stage.updateOldestSequence();
+    return true;
+}
+
+bool
+RecordWriter::flushCancelledToBuffer(ThreadBuffer& buffer)
+{
+    AllocationStage& stage = buffer.stage();
+    char data[AllocationStage::MAX_CANCELLED * (sizeof(RecordType) + sizeof(CancelledAllocations))];
+    size_t length = serializeCancelled(stage, data);
+    if (!reserveBufferSpace(buffer, length)) {
+        return false;
+    }
+    buffer.append(data, length);
+    stage.clearCancelled();
+    return true;
+}
+
+bool
+RecordWriter::flushStageToBuffer(ThreadBuffer& buffer)
+{
+    AllocationStage& stage = buffer.stage();
+    if (stage.empty() && stage.nCancelled() == 0) {
+        return true;
+    }
+    char data[AllocationStage::MAX_SERIALIZED_SIZE];
+    size_t length = serializeStage(stage, data);
+    if (!reserveBufferSpace(buffer, length)) {
+        return false;
+    }
+    buffer.append(data, length);
+    buffer.countAllocations(stage.size());
+    stage.clear();
+    stage.updateOldestSequence();
+    return true;
+}
+
+bool
+RecordWriter::flushStageUnsafe(ThreadBuffer& buffer)
+{
+    // Only called while the stage can't change, and after the ThreadBuffer
+    // has been flushed, as the stage holds the most recent records.
+    AllocationStage& stage = buffer.stage();
+    if (stage.empty() && stage.nCancelled() == 0) {
+        return true;
+    }
+    size_t length = serializeStage(stage, d_chunk_records.get());
+    ChunkEncoder encoder(d_chunk_data.get(), ThreadBuffer::CAPACITY);
+    if (!writeChunkUnsafe(buffer.tid(), d_chunk_records.get(), length, encoder)) {
+        return false;
+    }
+    d_stats.n_allocations += stage.size();
+    stage.clear();
+    stage.updateOldestSequence();
+    return true;
+}
+
+bool
+RecordWriter::flushThreadBufferUnsafe(ThreadBuffer& buffer)
+{
+    return buffer.consume(
+            [&](const char* first, size_t first_size, const char* second, size_t second_size) {
+                // A record can wrap around the end of the ring, so put the
+                // two parts back together before encoding them.
+                ::memcpy(d_chunk_records.get(), first, first_size);
+                ::memcpy(d_chunk_records.get() + first_size, second, second_size);
+                ChunkEncoder encoder(d_chunk_data.get(), ThreadBuffer::CAPACITY);
+                return writeChunkUnsafe(
+                        buffer.tid(),
+                        d_chunk_records.get(),
+                        first_size + second_size,
+                        encoder);
+            });
+}
+
+bool
+RecordWriter::writeChunkUnsafe(thread_id_t tid, const char* data, size_t length, ChunkEncoder& encoder)
+{
+    // The thread buffers hold the records as they were appended by
+    // writeThreadSpecificRecord. What goes to the sink is their compact
+    // encoding, which is never larger than that.
+    if (tid >= d_thread_stacks.size()) {
+        d_thread_stacks.resize(tid + 1);
+    }
+    auto& stack = d_thread_stacks[tid];
+    const char* end = data + length;
+    while (data < end) {
+        RecordType token;
+        ::memcpy(&token, data, sizeof(RecordType));
+        data += sizeof(RecordType);
+        switch (token) {
+            case RecordType::ALLOCATION: {
+                sequence_t sequence;
+                AllocationRecord record;
+                ::memcpy(&sequence, data, sizeof(sequence));
+                ::memcpy(&record, data + sizeof(sequence), sizeof(record));
+                data += sizeof(sequence) + sizeof(record);
+                encoder.addAllocation(sequence, record);
+            } break;
+            case RecordType::REALLOCATION: {
+                sequence_t sequence;
+                ReallocationRecord record;
+                ::memcpy(&sequence, data, sizeof(sequence));
+                ::memcpy(&record, data + sizeof(sequence), sizeof(record));
+                data += sizeof(sequence) + sizeof(record);
+                encoder.addReallocation(sequence, record);
+            } break;
+            case RecordType::CANCELLED_ALLOCATIONS: {
+                CancelledAllocations record;
+                ::memcpy(&record, data, sizeof(record));
+                data += sizeof(record);
+                encoder.addCancelledAllocations(record);
+            } break;
+            case RecordType::FRAME_PUSH: {
+                FramePush record;
+                ::memcpy(&record, data, sizeof(record));
+                data += sizeof(record);
+                encoder.addFramePush(record.frame_id);
+                stack.push_back(record.frame_id);
+            } break;
+            case RecordType::FRAME_POP: {
+                FramePop record;
+                ::memcpy(&record, data, sizeof(record));
+                data += sizeof(record);
+                encoder.addFramePop(record.count);
+                stack.resize(stack.size() - std::min<size_t>(record.count, stack.size()));
+            } break;
+            case RecordType::FRAME_LINE_UPDATE: {
+                FrameLineUpdate record;
+                ::memcpy(&record, data, sizeof(record));
+                data += sizeof(record);
+                encoder.addFrameLineUpdate(record.frame_id);
+                if (!stack.empty()) {
+                    stack.back() = record.frame_id;
+                }
+            } break;
+            default:
+                assert(false);
+                return false;
+        }
+    }
+    countRecordUnsafe(
+            RecordType::THREAD_CHUNK,
+            sizeof(RecordType) + sizeof(ThreadChunk) + encoder.size());
+    return writeSimpleType(RecordType::THREAD_CHUNK)
+           && writeSimpleType(ThreadChunk{tid, encoder.size()})
+           && d_sink->writeAll(encoder.data(), encoder.size());
+}
+
+std::vector<FrameTree::index_t>&
+RecordWriter::pythonStackUnsafe(thread_id_t tid)
+{
+    if (tid >= d_python_stacks.size()) {
+        d_python_stacks.resize(tid + 1);
+    }
+    return d_python_stacks[tid];
+}
+
+bool
+RecordWriter::aggregateRecordUnsafe(thread_id_t tid, const char* data)
+{
+    // Do what the reader would do with the record, but keep only the state
+    // of the heap that matters for its high water mark and its leaks.
+    RecordType token;
+    ::memcpy(&token, data, sizeof(RecordType));
+    data += sizeof(RecordType);
+    auto& stack = pythonStackUnsafe(tid);
+    Allocation allocation;
+    switch (token) {
+        case RecordType::ALLOCATION: {
+            ::memcpy(&allocation.record, data + sizeof(sequence_t), sizeof(AllocationRecord));
+        } break;
+        case RecordType::REALLOCATION: {
+            ReallocationRecord record;
+            ::memcpy(&record, data + sizeof(sequence_t), sizeof(record));
+            allocation.record = record.allocation;
+            allocation.realloc_old_address = record.old_address;
+        } break;
+        case RecordType::FRAME_PUSH: {
+            FramePush record;
+            ::memcpy(&record, data, sizeof(record));
+            FrameTree::index_t parent_index = stack.empty() ? 0 : stack.back();
+            FrameTree::index_t index = d_python_trace_tree.getTraceIndex(parent_index, record.frame_id);
+            d_python_trace_count = std::max(d_python_trace_count, index);
+            stack.push_back(index);
+            return true;
+        }
+        case RecordType::FRAME_POP: {
+            FramePop record;
+            ::memcpy(&record, data, sizeof(record));
+            stack.resize(stack.size() - std::min<size_t>(record.count, stack.size()));
+            return true;
+        }
+        case RecordType::FRAME_LINE_UPDATE: {
+            FrameLineUpdate record;
+            ::memcpy(&record, data, sizeof(record));
+            if (!stack.empty()) {
+                stack.pop_back();
+            }
+            FrameTree::index_t parent_index = stack.empty() ? 0 : stack.back();
+            FrameTree::index_t index = d_python_trace_tree.getTraceIndex(parent_index, record.frame_id);
+            d_python_trace_count = std::max(d_python_trace_count, index);
+            stack.push_back(index);
+            return true;
+        }
+        default:
+            assert(false);
+            return false;
+    }
+    allocation.frame_index = stack.empty() ? 0 : stack.back();
+    allocation.native_segment_generation = d_native_segment_generation;
+    scaleSampledAllocation(allocation, d_header.sample_rate);
+    d_aggregator.addAllocation(allocation);
+    return true;
+}
+
+bool
+RecordWriter::countRecord(ThreadBuffer& buffer, const char* data)
+{
+    // Like aggregateRecordUnsafe, but without the RecordWriter mutex: only
+    // the Python stack tree is shared with the other threads.
+    RecordType token;
+    ::memcpy(&token, data, sizeof(RecordType));
+    data += sizeof(RecordType);
+    AllocationCounters& counters = buffer.counters();
+    std::lock_guard<AllocationCounters> lock(counters);
+    auto& stack = counters.pythonStack();
+    Allocation allocation;
+    switch (token) {
+        case RecordType::ALLOCATION: {
+            ::memcpy(&allocation.record, data + sizeof(sequence_t), sizeof(AllocationRecord));
+        } break;
+        case RecordType::REALLOCATION: {
+            ReallocationRecord record;
+            ::memcpy(&record, data + sizeof(sequence_t), sizeof(record));
+            allocation.record = record.allocation;
+        } break;
+        case RecordType::FRAME_PUSH: {
+            FramePush record;
+            ::memcpy(&record, data, sizeof(record));
+            FrameTree::index_t parent_index = stack.empty() ? 0 : stack.back();
+            stack.push_back(d_python_trace_tree.getTraceIndex(parent_index, record.frame_id));
+            return true;
+        }
+        case RecordType::FRAME_POP: {
+            FramePop record;
+            ::memcpy(&record, data, sizeof(record));
+            stack.resize(stack.size() - std::min<size_t>(record.count, stack.size()));
+            return true;
+        }
+        case RecordType::FRAME_LINE_UPDATE: {
+            FrameLineUpdate record;
+            ::memcpy(&record, data, sizeof(record));
+            if (!stack.empty()) {
+                stack.pop_back();
+            }
+            FrameTree::index_t parent_index = stack.empty() ? 0 : stack.back();
+            stack.push_back(d_python_trace_tree.getTraceIndex(parent_index, record.frame_id));
+            return true;
+        }
+        default:
+            assert(false);
+            return false;
+    }
+    scaleSampledAllocation(allocation, d_header.sample_rate);
+    AllocationCounters::Key key{
+            stack.empty() ? 0 : stack.back(),
+            allocation.record.native_frame_id,
+            d_native_segment_generation.load(std::memory_order_relaxed),
+            allocation.record.allocator};
+    counters.count(key, allocation.n_allocations, allocation.record.size);
+    return true;
+}
+
+void
+RecordWriter::takeCountsUnsafe(ThreadBuffer& buffer)
+{
+    AllocationCounters& counters = buffer.counters();
+    std::lock_guard<AllocationCounters> lock(counters);
+    counters.takeCounts(buffer.tid(), d_allocation_counts);
+}
+
+bool
+RecordWriter::writeAllocationCountsUnsafe()
+{
+    // The new nodes of the tree are written after the counts were taken, so
+    // they include every Python stack that the counts refer to, and in the
+    // order they were created in, like writeTrailer() does.
+    FrameTree::index_t n_nodes = d_python_trace_tree.size();
+    for (FrameTree::index_t index = d_python_trace_count + 1; index < n_nodes; ++index) {
+        auto [frame_id, parent_index] = d_python_trace_tree.nextNode(index);
+        if (!writeRecordUnsafe(RecordType::PYTHON_TRACE_INDEX, PythonTraceIndex{frame_id, parent_index}))
+        {
+            return false;
+        }
+        d_python_trace_count = index;
+    }
+    for (const auto& counts : d_allocation_counts) {
+        if (!writeRecordUnsafe(RecordType::ALLOCATION_COUNTS, counts)) {
+            return false;
+        }
+    }
+    d_allocation_counts.clear();
+    return true;
+}
+
+bool
+RecordWriter::drainThreadBuffers()
+{
+    auto lock = lockMutex();
+    // This is called periodically from the tracker's background thread, so
+    // don't let what's been written sit in the sink until its buffer fills up.
+    return drainThreadBuffersUnsafe() && d_sink->handOff();
+}
+
+bool
+RecordWriter::drainThreadBuffersUnsafe()
+{
+    // Every allocation record whose sequence number is lower than the one we
+    // read here either has already been written directly to the sink (which
+    // can't happen concurrently because we hold the lock), or is in some
+    // thread's buffer, or is being appended to it right now (in which case
+    // its buffer is marked busy, because that happens before the sequence
+    // number is taken). Once every buffer has been flushed, the reader knows
+    // it won't see any more allocations with a lower sequence number, and we
+    // tell it so with a barrier record.
+    if (d_header.file_format == FILEFORMAT_AGGREGATED_ALLOCATIONS) {
+        // Nothing is ever buffered.
+        return true;
+    }
+    if (d_header.file_format == FILEFORMAT_ALLOCATION_COUNTS) {
+        // Nothing is buffered either, but what every thread counted since
+        // the last time is written out.
+        for (const auto& buffer : d_thread_buffers) {
+            takeCountsUnsafe(*buffer);
+        }
+        return writeAllocationCountsUnsafe();
+    }
+    //
+    // Staged records already have a sequence number, so we write out the
+    // stage of every thread whose stage lock we can take. For the others, the
+    // barrier must stay below their oldest staged record. This is read before
+    // the buffer is flushed, because that record may be moved to the buffer
+    // in the meantime.
+    sequence_t next_sequence = d_next_sequence.load(std::memory_order_seq_cst);
+    for (const auto& buffer : d_thread_buffers) {
+        AllocationStage& stage = buffer->stage();
+        bool stage_locked = false;
+        if (d_stage_allocations) {
+            stage_locked = stage.tryLock();
+            if (!stage_locked) {
+                next_sequence = std::min(next_sequence, stage.oldestSequence());
+            }
+        }
+        buffer->waitForPendingRecord();
+        bool ok = flushThreadBufferUnsafe(*buffer) && (!stage_locked || flushStageUnsafe(*buffer));
+        if (stage_locked) {
+            stage.unlock();
+        }
+        if (!ok) {
+            return false;
+        }
+    }
+    if (!writeRecordUnsafe(RecordType::CHUNK_BARRIER, ChunkBarrier{next_sequence})) {
+        return false;
+    }
+    uint64_t interval = d_restart_point_interval ? d_restart_point_interval : CHECKPOINT_INTERVAL;
+    if (d_sink->position() - d_last_checkpoint_position < interval) {
+        return true;
+    }
+    d_last_checkpoint_position = d_sink->position();
+    if (d_restart_point_interval) {
+        // A reader starting here gets the state records from the sink, and
+        // the checkpoint that we write next. There's no index to write, as
+        // the stream that's written out doesn't start where ours did.
+        if (!d_sink->markRestartPoint(d_state_records.data(), d_state_records.size())) {
+            return false;
+        }
+        d_state_records.clear();
+    } else {
+        d_checkpoint_offsets.push_back(d_last_checkpoint_position);
+    }
+    return writeCheckpointUnsafe(next_sequence);
+}
+
+bool
+RecordWriter::writeCheckpointUnsafe(sequence_t next_sequence)
+{
+    // Right after a barrier, the stacks we have are the ones the reader has
+    // once it has read every chunk so far, so a reader starting here can
+    // take them from us instead.
+    size_t n_threads = std::count_if(d_thread_stacks.begin(), d_thread_stacks.end(), [](const auto& stack) {
+        return !stack.empty();
+    });
+    if (!writeRecordUnsafe(
+                RecordType::CHECKPOINT,
+                Checkpoint{next_sequence, d_native_segment_generation, n_threads}))
+    {
+        return false;
+    }
+    for (thread_id_t tid = 0; tid < d_thread_stacks.size(); ++tid) {
+        const auto& stack = d_thread_stacks[tid];
+        if (stack.empty()) {
+            continue;
+        }
+        // The stacks that follow the record are part of it.
+        d_overhead.n_bytes[static_cast<size_t>(RecordType::CHECKPOINT)] +=
+                sizeof(CheckpointStack) + stack.size() * sizeof(frame_id_t);
+        if (!writeSimpleType(CheckpointStack{tid, stack.size()})
+            || !d_sink->writeAll(
+                    reinterpret_cast<const char*>(stack.data()),
+                    stack.size() * sizeof(frame_id_t)))
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool
+RecordWriter::writeCheckpointIndexUnsafe()
+{
+    if (d_checkpoint_offsets.empty()) {
+        return true;
+    }
+    d_header.checkpoint_index_offset = d_sink->position();
+    d_overhead.n_bytes[static_cast<size_t>(RecordType::CHECKPOINT_INDEX)] +=
+            d_checkpoint_offsets.size() * sizeof(uint64_t);
+    return writeRecordUnsafe(RecordType::CHECKPOINT_INDEX, CheckpointIndex{d_checkpoint_offsets.size()})
+           && d_sink->writeAll(
+                   reinterpret_cast<const char*>(d_checkpoint_offsets.data()),
+                   d_checkpoint_offsets.size() * sizeof(uint64_t));
+}
+
+bool
+RecordWriter::writeMemoryMapStartUnsafe()
+{
+    // The allocations aggregated from now on use the segments that follow.
+    ++d_native_segment_generation;
+    StateRecordScope scope(*this, RecordType::MEMORY_MAP_START);
+    return writeSimpleType(RecordType::MEMORY_MAP_START);
+}
+
+bool
+RecordWriter::writeMemoryMapUpdateUnsafe()
+{
+    ++d_native_segment_generation;
+    StateRecordScope scope(*this, RecordType::MEMORY_MAP_UPDATE);
+    return writeSimpleType(RecordType::MEMORY_MAP_UPDATE);
+}
+
+bool
+RecordWriter::writeTrailer()
+{
+    auto lock = lockMutex();
+    if (d_header.file_format != FILEFORMAT_AGGREGATED_ALLOCATIONS) {
+        return true;
+    }
+
+    // The tree nodes go first, in the order they were created in, so that
+    // the reader gives every Python stack the same index we did.
+    for (FrameTree::index_t index = 1; index <= d_python_trace_count; ++index) {
+        auto [frame_id, parent_index] = d_python_trace_tree.nextNode(index);
+        if (!writeRecordUnsafe(RecordType::PYTHON_TRACE_INDEX, PythonTraceIndex{frame_id, parent_index}))
+        {
+            return false;
+        }
+    }
+    for (const auto& aggregated : d_aggregator.getAggregatedAllocations()) {
+        if (!writeRecordUnsafe(RecordType::AGGREGATED_ALLOCATION, aggregated)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool
+RecordWriter::retireThreadBuffer(ThreadBuffer& buffer)
+{
+    // The owning thread can't touch its stage anymore, and the mutex keeps
+    // drainThreadBuffersUnsafe from doing it.
+    auto lock = lockMutex();
+    bool ret = flushThreadBufferUnsafe(buffer) && flushStageUnsafe(buffer);
+    if (d_header.file_format == FILEFORMAT_ALLOCATION_COUNTS) {
+        takeCountsUnsafe(buffer);
+        ret = ret && writeAllocationCountsUnsafe();
+    }
+    d_stats.n_allocations += buffer.nAllocations();
+    buffer.overhead().addTo(d_overhead);
+    auto it = std::find_if(d_thread_buffers.begin(), d_thread_buffers.end(), [&](const auto& candidate) {
+        return candidate.get() == &buffer;
+    });
+    if (it != d_thread_buffers.end()) {
+        d_thread_buffers.erase(it);
+    }
+    return ret;
+}
+
 std::unique_lock<std::mutex>
 RecordWriter::acquireLock()
 {
-    return std::unique_lock<std::mutex>(d_mutex);
+    return lockMutex();
+}
+
+std::unique_lock<std::mutex>
+RecordWriter::lockMutex()
+{
+    // Only the threads that have to wait read the clock, so taking a free
+    // lock costs no more than it did.
+    std::unique_lock<std::mutex> lock(d_mutex, std::try_to_lock);
+    if (!lock.owns_lock()) {
+        auto start = steady_clock::now();
+        lock.lock();
+        auto waited = duration_cast<nanoseconds>(steady_clock::now() - start).count();
+        d_lock_wait_ns.fetch_add(waited, std::memory_order_relaxed);
+    }
+    return lock;
+}
+
+void
+RecordWriter::countRecordUnsafe(RecordType token, size_t length)
+{
+    auto index = static_cast<size_t>(token);
+    d_overhead.n_records[index] += 1;
+    d_overhead.n_bytes[index] += length;
+}
+
+TrackerOverhead
+RecordWriter::overheadUnsafe() const
+{
+    TrackerOverhead overhead = d_overhead;
+    overhead.n_hook_calls += d_n_hook_calls.load(std::memory_order_relaxed);
+    overhead.hooks_ns += d_hooks_ns.load(std::memory_order_relaxed);
+    overhead.unwind_ns += d_unwind_ns.load(std::memory_order_relaxed);
+    overhead.lock_wait_ns += d_lock_wait_ns.load(std::memory_order_relaxed);
+    for (const auto& buffer : d_thread_buffers) {
+        buffer->overhead().addTo(overhead);
+    }
+    return overhead;
+}
+
+TrackerOverhead
+RecordWriter::overhead()
+{
+    auto lock = lockMutex();
+    return overheadUnsafe();
+}
+
+void
+RecordWriter::countHookCalls(uint64_t n_calls, uint64_t hooks_ns, uint64_t unwind_ns)
+{
+    // The buffer is never created here, so its thread id doesn't matter.
+    ThreadBuffer* buffer = getThreadBuffer(0, false);
+    if (buffer) {
+        buffer->overhead().countHookCalls(n_calls, hooks_ns, unwind_ns);
+        return;
+    }
+    d_n_hook_calls.fetch_add(n_calls, std::memory_order_relaxed);
+    d_hooks_ns.fetch_add(hooks_ns, std::memory_order_relaxed);
+    d_unwind_ns.fetch_add(unwind_ns, std::memory_order_relaxed);
+}
+
+void
+RecordWriter::countDeactivatedRecords(uint64_t count)
+{
+    auto lock = lockMutex();
+    d_overhead.deactivated_records += count;
 }
 
 std::unique_ptr<RecordWriter>
@@ -86,10 +1367,18 @@ RecordWriter::cloneInChildProcess()
     if (!new_sink) {
         return {};
     }
-    return std::make_unique<RecordWriter>(
+    auto new_writer = std::make_unique<RecordWriter>(
             std::move(new_sink),
             d_header.command_line,
-            d_header.native_traces);
+            d_header.native_traces,
+            d_header.sample_rate,
+            d_header.file_format,
+            d_stage_allocations,
+            d_backpressure);
+    // The child inherits the allocator hooks of the tracker, if any, which
+    // would hide what the Python allocator is.
+    new_writer->d_header.python_allocator = d_header.python_allocator;
+    return new_writer;
 }
 
 }  // namespace memray::tracking_api
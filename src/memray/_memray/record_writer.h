@@ -1,25 +1,244 @@
 #pragma once
 
+#include <algorithm>
+#include <atomic>
+#include <cassert>
 #include <cerrno>
 #include <climits>
 #include <cstring>
+#include <limits>
 #include <memory>
 #include <mutex>
 #include <string>
 #include <type_traits>
 #include <unistd.h>
+#include <vector>
 
+#include "flat_hash_map.h"
+#include "frame_tree.h"
 #include "records.h"
 #include "sink.h"
+#include "snapshot.h"
 
 namespace memray::tracking_api {
-class RecordWriter
+
+// What a thread does with an allocation record when its ThreadBuffer is full
+// and the sink's background thread can't take any more data yet.
+enum BackpressurePolicy {
+    // Wait for the background thread to catch up.
+    BACKPRESSURE_BLOCK = 1,
+    // Drop the record, and count it in the header.
+    BACKPRESSURE_DROP = 2,
+};
+
+// The allocation records of one thread that haven't been written to its
+// ThreadBuffer yet. An allocation that the same thread frees while it's still
+// here is never written out at all: both records are dropped, and only a
+// count of them is kept for each allocator and native stack, until the
+// Python stack of the thread changes.
+//
+// Records are staged with their sequence number already assigned, so until
+// they reach the ThreadBuffer the RecordWriter must not tell the reader that
+// every record up to the current sequence number has been written. It uses
+// oldestSequence() to find how far it can go instead.
+//
+// The owning thread holds the lock from before it stages a record until that
+// record is either staged or appended to its ThreadBuffer. The RecordWriter
+// only ever tries to take it, because a thread can block on the RecordWriter
+// mutex while holding it.
+class AllocationStage
+{
+  public:
+    static constexpr size_t CAPACITY = 8;
+    static constexpr size_t MAX_CANCELLED = 4;
+    static constexpr sequence_t NO_SEQUENCE = std::numeric_limits<sequence_t>::max();
+
+    struct Entry
+    {
+        sequence_t sequence;
+        ReallocationRecord record;
+        bool is_reallocation;
+    };
+
+    // Upper bound on the size of all the records in the stage, after they
+    // are serialized the way the ThreadBuffer holds them.
+    static constexpr size_t MAX_SERIALIZED_SIZE =
+            CAPACITY * (sizeof(RecordType) + sizeof(sequence_t) + sizeof(ReallocationRecord))
+            + MAX_CANCELLED * (sizeof(RecordType) + sizeof(CancelledAllocations));
+
+    void lock();
+    bool tryLock();
+    void unlock();
+
+    bool empty() const;
+    bool full() const;
+    size_t size() const;
+    const Entry& entry(size_t index) const;
+    void push(const Entry& entry);
+    Entry popOldest();
+
+    // Remove the most recent staged allocation at this address, if any.
+    bool cancel(uintptr_t address, AllocationRecord& cancelled);
+
+    // Add one allocation to the count of the cancelled ones. This fails if
+    // it has a new allocator and native stack and there's no room for them.
+    [[nodiscard]] bool addCancelled(const AllocationRecord& record);
+    size_t nCancelled() const;
+    const CancelledAllocations& cancelled(size_t index) const;
+    void clearCancelled();
+    void clear();
+
+    sequence_t oldestSequence() const;
+    void setOldestSequence(sequence_t sequence);
+    void updateOldestSequence();
+
+  private:
+    // Data members
+    std::atomic_flag d_lock = ATOMIC_FLAG_INIT;
+    Entry d_entries[CAPACITY];
+    size_t d_size{0};
+    CancelledAllocations d_cancelled[MAX_CANCELLED];
+    size_t d_n_cancelled{0};
+    std::atomic<sequence_t> d_oldest_sequence{NO_SEQUENCE};
+};
+
+// The calls that one thread made to the allocators, and the bytes they asked
+// for, by Python stack, native stack and allocator, for the
+// FILEFORMAT_ALLOCATION_COUNTS format. Nothing is kept about the addresses or
+// the frees. The thread follows its own Python stack here, as the indexes of
+// its frames in the RecordWriter's tree of Python stacks, so counting a call
+// only takes a hash table update.
+//
+// The owning thread holds the lock while it counts, and the RecordWriter
+// takes it to take the counts away. Unlike with the AllocationStage, the
+// owning thread never waits for the RecordWriter mutex while holding it.
+class AllocationCounters
+{
+  public:
+    struct Key
+    {
+        FrameTree::index_t frame_index;
+        frame_id_t native_frame_id;
+        size_t native_segment_generation;
+        hooks::Allocator allocator;
+
+        bool operator==(const Key& other) const
+        {
+            return frame_index == other.frame_index && native_frame_id == other.native_frame_id
+                   && native_segment_generation == other.native_segment_generation
+                   && allocator == other.allocator;
+        }
+
+        struct Hash
+        {
+            size_t operator()(const Key& key) const noexcept
+            {
+                uint64_t hash = key.frame_index;
+                hash = containers::combineHash(hash, key.native_frame_id);
+                hash = containers::combineHash(hash, key.native_segment_generation);
+                hash = containers::combineHash(hash, static_cast<uint64_t>(key.allocator));
+                return containers::mixHash(hash);
+            }
+        };
+    };
+
+    void lock();
+    void unlock();
+
+    std::vector<FrameTree::index_t>& pythonStack();
+    void count(const Key& key, uint64_t n_calls, uint64_t n_bytes);
+    // Append what was counted since the last call, and start from zero.
+    void takeCounts(thread_id_t tid, std::vector<AllocationCounts>& counts);
+
+  private:
+    struct Counts
+    {
+        uint64_t n_calls;
+        uint64_t n_bytes;
+    };
+
+    // Data members
+    std::atomic_flag d_lock = ATOMIC_FLAG_INIT;
+    std::vector<FrameTree::index_t> d_python_stack{};
+    containers::FlatHashMap<Key, Counts, Key::Hash> d_counts{};
+};
+
+// What one thread's records and calls to the hooks cost. Only the owning
+// thread updates the counters, and the RecordWriter reads them whenever it
+// sums them up.
+class OverheadCounters
+{
+  public:
+    void countRecord(RecordType token, size_t length);
+    void countHookCalls(uint64_t n_calls, uint64_t hooks_ns, uint64_t unwind_ns);
+    void addTo(TrackerOverhead& overhead) const;
+
+  private:
+    // Data members
+    std::atomic<uint64_t> d_n_hook_calls{0};
+    std::atomic<uint64_t> d_hooks_ns{0};
+    std::atomic<uint64_t> d_unwind_ns{0};
+    std::atomic<uint64_t> d_n_records[N_RECORD_TYPES]{};
+    std::atomic<uint64_t> d_n_bytes[N_RECORD_TYPES]{};
+};
+
+// Single producer, single consumer ring of serialized records for one thread.
+//
+// The owning thread appends whole records without taking any lock, and the
+// RecordWriter moves the accumulated bytes to the sink (as a THREAD_CHUNK
+// record) while holding its own mutex. The producer only ever advances
+// d_tail and the consumer only ever advances d_head, so either side can
+// compute how many bytes are readable/writable with a pair of atomic loads.
+class ThreadBuffer
+{
+  public:
+    static constexpr size_t CAPACITY = 64 * 1024;
+
+    explicit ThreadBuffer(thread_id_t tid);
+
+    thread_id_t tid() const;
+
+    // Producer side.
+    size_t freeSpace() const;
+    void append(const char* data, size_t length);
+    void markBusy();
+    void publish();
+    void countAllocations(size_t count);
+    AllocationStage& stage();
+    AllocationCounters& counters();
+    OverheadCounters& overhead();
+
+    // Consumer side.
+    template<typename Callback>
+    bool consume(const Callback& callback);
+    void waitForPendingRecord() const;
+    size_t nAllocations() const;
+    const OverheadCounters& overhead() const;
+
+  private:
+    // Data members
+    const thread_id_t d_tid;
+    std::unique_ptr<char[]> d_data;
+    std::atomic<size_t> d_head{0};
+    std::atomic<size_t> d_tail{0};
+    std::atomic<bool> d_busy{false};
+    std::atomic<size_t> d_n_allocations{0};
+    AllocationStage d_stage{};
+    AllocationCounters d_counters{};
+    OverheadCounters d_overhead{};
+};
+
+class RecordWriter : public std::enable_shared_from_this<RecordWriter>
 {
   public:
     explicit RecordWriter(
             std::unique_ptr<memray::io::Sink> sink,
             const std::string& command_line,
-            bool native_traces);
+            bool native_traces,
+            size_t sample_rate,
+            FileFormat file_format = FILEFORMAT_ALL_ALLOCATIONS,
+            bool cancel_short_lived_allocations = false,
+            BackpressurePolicy backpressure = BACKPRESSURE_BLOCK);
 
     RecordWriter(RecordWriter& other) = delete;
     RecordWriter(RecordWriter&& other) = delete;
@@ -33,35 +252,218 @@ class RecordWriter
     bool inline writeRecord(const RecordType& token, const T& item);
     template<typename T>
     bool inline writeRecordUnsafe(const RecordType& token, const T& item);
+    template<typename T>
+    bool inline writeThreadSpecificRecord(const RecordType& token, const T& item);
+    bool drainThreadBuffers();
+    bool drainThreadBuffersUnsafe();
+    bool writeMemoryMapStartUnsafe();
+    bool writeMemoryMapUpdateUnsafe();
     bool writeHeader(bool seek_to_start);
+    bool writeTrailer();
+    // With a sink that only keeps the most recent records, write out what it
+    // has, and carry on.
+    bool dump();
+    bool keepsOnlyRecentRecords() const;
+    bool countsAllocationsOnly() const;
+    // With a sink that's read while it's written, tell the reader when this
+    // was and how long writing has waited for the sink so far, so that it can
+    // tell how far behind it is. Other sinks get nothing.
+    bool writeSinkStats();
 
     std::unique_lock<std::mutex> acquireLock();
     std::unique_ptr<RecordWriter> cloneInChildProcess();
 
+    // What tracking has cost so far, with what every thread counted.
+    TrackerOverhead overhead();
+    // Called by the tracker for a sample of its calls to the hooks, counting
+    // the calls and the time spent in them on behalf of the calling thread.
+    void countHookCalls(uint64_t n_calls, uint64_t hooks_ns, uint64_t unwind_ns);
+    void countDeactivatedRecords(uint64_t count);
+
   private:
+    friend class ThreadBufferOwner;
+
+    // While this is alive, what's written to the sink is also kept to be
+    // handed to it at the next restart point, if it needs them and the
+    // record is one that describes the capture. It's counted as a record of
+    // the given type as well.
+    class StateRecordScope
+    {
+      public:
+        inline StateRecordScope(RecordWriter& writer, RecordType token);
+        inline ~StateRecordScope();
+
+      private:
+        RecordWriter& d_writer;
+        const RecordType d_token;
+        const uint64_t d_start;
+    };
+
+    // Methods
+    bool inline writeAll(const char* data, size_t length);
+    std::unique_lock<std::mutex> lockMutex();
+    void countRecordUnsafe(RecordType token, size_t length);
+    TrackerOverhead overheadUnsafe() const;
+    bool writeHeaderUnsafe();
+    bool writeOverheadUnsafe(const TrackerOverhead& overhead);
+    ThreadBuffer* getThreadBuffer(thread_id_t tid, bool create);
+    bool appendToThreadBuffer(
+            thread_id_t tid,
+            char* data,
+            size_t length,
+            bool sequenced,
+            bool may_create_buffer);
+    bool appendToBuffer(ThreadBuffer& buffer, char* data, size_t length, bool sequenced);
+    bool reserveBufferSpace(ThreadBuffer& buffer, size_t length);
+    bool mustDropRecord(ThreadBuffer& buffer, size_t length);
+    bool stageRecord(ThreadBuffer& buffer, const char* data);
+    bool evictOldestStagedRecord(ThreadBuffer& buffer);
+    bool flushCancelledToBuffer(ThreadBuffer& buffer);
+    bool flushStageToBuffer(ThreadBuffer& buffer);
+    bool flushStageUnsafe(ThreadBuffer& buffer);
+    bool flushThreadBufferUnsafe(ThreadBuffer& buffer);
+    bool writeChunkUnsafe(thread_id_t tid, const char* data, size_t length, ChunkEncoder& encoder);
+    bool writeCheckpointUnsafe(sequence_t next_sequence);
+    bool writeCheckpointIndexUnsafe();
+    bool retireThreadBuffer(ThreadBuffer& buffer);
+    bool aggregateRecordUnsafe(thread_id_t tid, const char* data);
+    bool countRecord(ThreadBuffer& buffer, const char* data);
+    void takeCountsUnsafe(ThreadBuffer& buffer);
+    bool writeAllocationCountsUnsafe();
+    std::vector<FrameTree::index_t>& pythonStackUnsafe(thread_id_t tid);
+
     // Data members
     int d_version{CURRENT_HEADER_VERSION};
-    std::unique_ptr<memray::io::Sink> d_sink;
+    const unsigned int d_generation;
+    // Only the sink's background thread ever writes to the sink we're given.
+    std::unique_ptr<memray::io::AsyncSink> d_sink;
     std::mutex d_mutex;
     HeaderRecord d_header{};
     TrackerStats d_stats{};
+    std::atomic<sequence_t> d_next_sequence{0};
+    std::vector<std::shared_ptr<ThreadBuffer>> d_thread_buffers{};
+    std::unique_ptr<char[]> d_chunk_records;
+    std::unique_ptr<char[]> d_chunk_data;
+
+    // Whether allocation records go through the AllocationStage of their
+    // thread, to drop those of the allocations that are freed right away.
+    const bool d_stage_allocations;
+
+    const BackpressurePolicy d_backpressure;
+    std::atomic<size_t> d_dropped_records{0};
+
+    // What tracking costs, apart from what the thread buffers count. What the
+    // threads count is added to d_overhead when their buffers are retired,
+    // and it's guarded by d_mutex, like d_bytes_written. Hooks that run on a
+    // thread without a buffer, and threads that wait for the lock, update the
+    // atomics instead.
+    TrackerOverhead d_overhead{};
+    uint64_t d_bytes_written{0};
+    std::atomic<uint64_t> d_n_hook_calls{0};
+    std::atomic<uint64_t> d_hooks_ns{0};
+    std::atomic<uint64_t> d_unwind_ns{0};
+    std::atomic<uint64_t> d_lock_wait_ns{0};
+
+    // The Python stack of every thread as of the last chunk written, indexed
+    // by thread id, so that checkpoints can tell the reader what they are.
+    const uint64_t CHECKPOINT_INTERVAL{1024 * 1024};  // 1 MiB
+    std::vector<std::vector<frame_id_t>> d_thread_stacks{};
+    std::vector<uint64_t> d_checkpoint_offsets{};
+    uint64_t d_last_checkpoint_position{0};
+
+    // Sinks that only keep the most recent records get restart points
+    // instead, and the state records written since the last one.
+    const size_t d_restart_point_interval;
+    std::vector<char> d_state_records{};
+    bool d_writing_state_record{false};
+    const bool d_sink_is_live;
+
+    // What we keep instead of writing the allocations out when using the
+    // FILEFORMAT_AGGREGATED_ALLOCATIONS format. The tree of Python stacks is
+    // also used by the FILEFORMAT_ALLOCATION_COUNTS format, whose threads
+    // add to it without holding d_mutex, and then d_python_trace_count is
+    // the number of nodes that were written out.
+    FrameTree d_python_trace_tree{};
+    FrameTree::index_t d_python_trace_count{0};
+    // Indexed by thread id, like the stacks of the reader.
+    std::vector<std::vector<FrameTree::index_t>> d_python_stacks{};
+    std::atomic<size_t> d_native_segment_generation{0};
+    api::HighWaterMarkAggregator d_aggregator{};
+    // The counts taken from the threads, until they are written out.
+    std::vector<AllocationCounts> d_allocation_counts{};
 };
 
+template<typename Callback>
+bool
+ThreadBuffer::consume(const Callback& callback)
+{
+    size_t head = d_head.load(std::memory_order_relaxed);
+    size_t tail = d_tail.load(std::memory_order_acquire);
+    if (head == tail) {
+        return true;
+    }
+
+    size_t start = head % CAPACITY;
+    size_t length = tail - head;
+    size_t first_part = std::min(length, CAPACITY - start);
+    if (!callback(d_data.get() + start, first_part, d_data.get(), length - first_part)) {
+        return false;
+    }
+    d_head.store(tail, std::memory_order_release);
+    return true;
+}
+
+inline RecordWriter::StateRecordScope::StateRecordScope(RecordWriter& writer, RecordType token)
+: d_writer(writer)
+, d_token(token)
+, d_start(writer.d_bytes_written)
+{
+    switch (token) {
+        case RecordType::FRAME_INDEX:
+        case RecordType::NATIVE_TRACE_INDEX:
+        case RecordType::MEMORY_MAP_START:
+        case RecordType::MEMORY_MAP_UPDATE:
+        case RecordType::SEGMENT_HEADER:
+        case RecordType::SEGMENT:
+        case RecordType::SEGMENTS_REMOVED:
+        case RecordType::THREAD_RECORD:
+            d_writer.d_writing_state_record = d_writer.d_restart_point_interval != 0;
+            break;
+        default:
+            break;
+    }
+}
+
+inline RecordWriter::StateRecordScope::~StateRecordScope()
+{
+    d_writer.d_writing_state_record = false;
+    d_writer.countRecordUnsafe(d_token, d_writer.d_bytes_written - d_start);
+}
+
+bool inline RecordWriter::writeAll(const char* data, size_t length)
+{
+    d_bytes_written += length;
+    if (d_writing_state_record) {
+        d_state_records.insert(d_state_records.end(), data, data + length);
+    }
+    return d_sink->writeAll(data, length);
+}
+
 template<typename T>
 bool inline RecordWriter::writeSimpleType(T&& item)
 {
-    return d_sink->writeAll(reinterpret_cast<const char*>(&item), sizeof(item));
+    return writeAll(reinterpret_cast<const char*>(&item), sizeof(item));
 };
 
 bool inline RecordWriter::writeString(const char* the_string)
 {
-    return d_sink->writeAll(the_string, strlen(the_string) + 1);
+    return writeAll(the_string, strlen(the_string) + 1);
 }
 
 template<typename T>
 bool inline RecordWriter::writeRecord(const RecordType& token, const T& item)
 {
-    std::lock_guard<std::mutex> lock(d_mutex);
+    auto lock = lockMutex();
     return writeRecordUnsafe(token, item);
 }
 
@@ -71,18 +473,71 @@ bool inline RecordWriter::writeRecordUnsafe(const RecordType& token, const T& it
     static_assert(
             std::is_trivially_copyable<T>::value,
             "Called writeRecord on binary records which cannot be trivially copied");
+    static_assert(
+            !std::is_same<T, AllocationRecord>::value && !std::is_same<T, ReallocationRecord>::value,
+            "Allocations carry a sequence number and must go through writeThreadSpecificRecord");
+    assert(token != RecordType::ALLOCATION && token != RecordType::REALLOCATION);
 
-    if (token == RecordType::ALLOCATION) {
-        d_stats.n_allocations += 1;
-    }
-    return d_sink->writeAll(reinterpret_cast<const char*>(&token), sizeof(RecordType))
-           && d_sink->writeAll(reinterpret_cast<const char*>(&item), sizeof(T));
+    // The token and the payload go out in a single write.
+    char data[sizeof(RecordType) + sizeof(T)];
+    ::memcpy(data, &token, sizeof(RecordType));
+    ::memcpy(data + sizeof(RecordType), &item, sizeof(T));
+    StateRecordScope scope(*this, token);
+    return writeAll(data, sizeof(data));
+}
+
+template<typename T>
+bool inline RecordWriter::writeThreadSpecificRecord(const RecordType& token, const T& item)
+{
+    static_assert(
+            std::is_trivially_copyable<T>::value,
+            "Called writeThreadSpecificRecord on binary records which cannot be trivially copied");
+
+    char data[sizeof(RecordType) + sizeof(T)];
+    ::memcpy(data, &token, sizeof(RecordType));
+    ::memcpy(data + sizeof(RecordType), &item, sizeof(T));
+    return appendToThreadBuffer(item.tid, data, sizeof(data), false, true);
+}
+
+template<>
+bool inline RecordWriter::writeThreadSpecificRecord(
+        const RecordType& token,
+        const AllocationRecord& item)
+{
+    // Allocation records from different threads interleave in the output
+    // stream in whatever order their buffers are drained, so each of them is
+    // stamped with a global sequence number that the reader uses to restore
+    // the order in which the allocations actually happened. The sequence
+    // number is filled in by appendToThreadBuffer.
+    char data[sizeof(RecordType) + sizeof(sequence_t) + sizeof(AllocationRecord)];
+    ::memcpy(data, &token, sizeof(RecordType));
+    ::memcpy(data + sizeof(RecordType) + sizeof(sequence_t), &item, sizeof(AllocationRecord));
+
+    // Don't create a buffer for a thread whose first record is a deallocation:
+    // this is what we see while threads are being torn down, when it is no
+    // longer safe to construct thread local objects.
+    bool may_create_buffer =
+            hooks::allocatorKind(item.allocator) != hooks::AllocatorKind::SIMPLE_DEALLOCATOR;
+    return appendToThreadBuffer(item.tid, data, sizeof(data), true, may_create_buffer);
+}
+
+template<>
+bool inline RecordWriter::writeThreadSpecificRecord(
+        const RecordType& token,
+        const ReallocationRecord& item)
+{
+    // Sequenced just like a single allocation record.
+    char data[sizeof(RecordType) + sizeof(sequence_t) + sizeof(ReallocationRecord)];
+    ::memcpy(data, &token, sizeof(RecordType));
+    ::memcpy(data + sizeof(RecordType) + sizeof(sequence_t), &item, sizeof(ReallocationRecord));
+    return appendToThreadBuffer(item.allocation.tid, data, sizeof(data), true, true);
 }
 
 template<>
 bool inline RecordWriter::writeRecordUnsafe(const RecordType& token, const pyrawframe_map_val_t& item)
 {
     d_stats.n_frames += 1;
+    StateRecordScope scope(*this, token);
     return writeSimpleType(token) && writeSimpleType(item.first)
            && writeString(item.second.function_name) && writeString(item.second.filename)
            && writeSimpleType(item.second.lineno);
@@ -91,13 +546,22 @@ bool inline RecordWriter::writeRecordUnsafe(const RecordType& token, const pyraw
 template<>
 bool inline RecordWriter::writeRecordUnsafe(const RecordType& token, const SegmentHeader& item)
 {
+    StateRecordScope scope(*this, token);
     return writeSimpleType(token) && writeString(item.filename) && writeSimpleType(item.num_segments)
-           && writeSimpleType(item.addr);
+           && writeSimpleType(item.addr) && writeString(item.build_id);
+}
+
+template<>
+bool inline RecordWriter::writeRecordUnsafe(const RecordType& token, const RemovedSegments& item)
+{
+    StateRecordScope scope(*this, token);
+    return writeSimpleType(token) && writeString(item.filename) && writeSimpleType(item.addr);
 }
 
 template<>
 bool inline RecordWriter::writeRecordUnsafe(const RecordType& token, const ThreadRecord& record)
 {
+    StateRecordScope scope(*this, token);
     return writeSimpleType(token) && writeSimpleType(record.tid) && writeString(record.name);
 }
 
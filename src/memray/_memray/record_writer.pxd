@@ -1,9 +1,15 @@
+from _memray.records cimport FileFormat
 from _memray.sink cimport Sink
 from libcpp cimport bool
 from libcpp.memory cimport unique_ptr
 from libcpp.string cimport string
 
 
+cdef extern from "record_writer.h" namespace "memray::tracking_api":
+    cdef enum BackpressurePolicy:
+        BACKPRESSURE_BLOCK
+        BACKPRESSURE_DROP
+
 cdef extern from "record_writer.h" namespace "memray::api":
     cdef cppclass RecordWriter:
-        RecordWriter(unique_ptr[Sink], string command_line, bool native_trace) except+
+        RecordWriter(unique_ptr[Sink], string command_line, bool native_trace, size_t sample_rate, FileFormat file_format, bool cancel_short_lived_allocations, BackpressurePolicy backpressure) except+
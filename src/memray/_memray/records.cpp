@@ -1,64 +1,109 @@
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include <cstring>
+
 #include "Python.h"
 
+#include "hooks.h"
 #include "python_helpers.h"
 #include "records.h"
 
 namespace memray::tracking_api {
-PyObject*
-Allocation::toPythonObject() const
+
+namespace {  // unnamed
+
+hooks::Allocator
+deallocatorFor(hooks::Allocator allocator)
 {
-    // We are not using PyBuildValue here because unrolling the
-    // operations speeds up the parsing moderately. Additionally, some of
-    // the types we need to convert from are not supported by PyBuildValue
-    // natively.
-    PyObject* tuple = PyTuple_New(8);
-    if (tuple == nullptr) {
-        return nullptr;
+    if (hooks::isPythonAllocator(allocator)) {
+        return hooks::Allocator::PYMALLOC_FREE;
     }
+    return hooks::Allocator::FREE;
+}
 
-#define __CHECK_ERROR(elem)                                                                             \
-    do {                                                                                                \
-        if (elem == nullptr) {                                                                          \
-            Py_DECREF(tuple);                                                                           \
-            return nullptr;                                                                             \
-        }                                                                                               \
-    } while (0)
-    PyObject* elem = PyLong_FromLong(record.tid);
-    __CHECK_ERROR(elem);
-    PyTuple_SET_ITEM(tuple, 0, elem);
-    elem = PyLong_FromUnsignedLong(record.address);
-    __CHECK_ERROR(elem);
-    PyTuple_SET_ITEM(tuple, 1, elem);
-    elem = PyLong_FromSize_t(record.size);
-    __CHECK_ERROR(elem);
-    PyTuple_SET_ITEM(tuple, 2, elem);
-    elem = PyLong_FromLong(static_cast<int>(record.allocator));
-    __CHECK_ERROR(elem);
-    PyTuple_SET_ITEM(tuple, 3, elem);
-    elem = PyLong_FromSize_t(frame_index);
-    __CHECK_ERROR(elem);
-    PyTuple_SET_ITEM(tuple, 4, elem);
-    elem = PyLong_FromSize_t(n_allocations);
-    __CHECK_ERROR(elem);
-    PyTuple_SET_ITEM(tuple, 5, elem);
-    elem = PyLong_FromSize_t(record.native_frame_id);
-    __CHECK_ERROR(elem);
-    PyTuple_SET_ITEM(tuple, 6, elem);
-    elem = PyLong_FromSize_t(native_segment_generation);
-    __CHECK_ERROR(elem);
-    PyTuple_SET_ITEM(tuple, 7, elem);
-#undef __CHECK_ERROR
-    return tuple;
+}  // unnamed namespace
+
+Allocation
+Allocation::oldAddressDeallocation() const
+{
+    Allocation deallocation;
+    deallocation.record = {record.tid, realloc_old_address, 0, deallocatorFor(record.allocator), 0};
+    deallocation.frame_index = frame_index;
+    deallocation.native_segment_generation = native_segment_generation;
+    return deallocation;
+}
+
+Allocation
+Allocation::cancelledDeallocation() const
+{
+    Allocation deallocation = *this;
+    deallocation.record.size = 0;
+    deallocation.record.allocator = deallocatorFor(record.allocator);
+    deallocation.record.native_frame_id = 0;
+    return deallocation;
+}
+
+void
+scaleSampledAllocation(Allocation& allocation, size_t sample_rate)
+{
+    AllocationRecord& record = allocation.record;
+    if (!sample_rate || hooks::allocatorKind(record.allocator) != hooks::AllocatorKind::SIMPLE_ALLOCATOR)
+    {
+        return;
+    }
+    // A sampled allocation was recorded with probability 1 - exp(-size / sample_rate).
+    double probability = -std::expm1(-static_cast<double>(record.size) / sample_rate);
+    if (probability > 0) {
+        record.size = std::llround(record.size / probability);
+        allocation.n_allocations = std::max(1LL, std::llround(1.0 / probability));
+    }
+}
+
+Allocation
+AggregatedAllocation::contributionToHighWaterMark() const
+{
+    Allocation allocation;
+    allocation.record = {tid, 0, bytes_in_high_water_mark, allocator, native_frame_id};
+    allocation.frame_index = frame_index;
+    allocation.native_segment_generation = native_segment_generation;
+    allocation.n_allocations = n_allocations_in_high_water_mark;
+    return allocation;
+}
+
+Allocation
+AggregatedAllocation::contributionToLeaks() const
+{
+    Allocation allocation;
+    allocation.record = {tid, 0, bytes_leaked, allocator, native_frame_id};
+    allocation.frame_index = frame_index;
+    allocation.native_segment_generation = native_segment_generation;
+    allocation.n_allocations = n_allocations_leaked;
+    return allocation;
+}
+
+Allocation
+AllocationCounts::toAllocation() const
+{
+    Allocation allocation;
+    allocation.record = {tid, 0, n_bytes, allocator, native_frame_id};
+    allocation.frame_index = frame_index;
+    allocation.native_segment_generation = native_segment_generation;
+    allocation.n_allocations = n_calls;
+    return allocation;
 }
 
 PyObject*
-Frame::toPythonObject(python_helpers::PyUnicode_Cache& pystring_cache) const
+Frame::toPythonObject(
+        python_helpers::PyUnicode_Cache& pystring_cache,
+        python_helpers::PyUnicode_Cache::id_t function_name_id,
+        python_helpers::PyUnicode_Cache::id_t filename_id) const
 {
-    PyObject* pyfunction_name = pystring_cache.getUnicodeObject(function_name);
+    PyObject* pyfunction_name = pystring_cache.getUnicodeObject(function_name_id, function_name);
     if (pyfunction_name == nullptr) {
         return nullptr;
     }
-    PyObject* pyfilename = pystring_cache.getUnicodeObject(filename);
+    PyObject* pyfilename = pystring_cache.getUnicodeObject(filename_id, filename);
     if (pyfilename == nullptr) {
         return nullptr;
     }
@@ -78,4 +123,303 @@ Frame::toPythonObject(python_helpers::PyUnicode_Cache& pystring_cache) const
     PyTuple_SET_ITEM(tuple, 2, pylineno);
     return tuple;
 }
+ChunkEncoder::ChunkEncoder(char* buffer, size_t capacity)
+: d_buffer(buffer)
+, d_capacity(capacity)
+{
+}
+
+void
+ChunkEncoder::addAllocation(sequence_t sequence, const AllocationRecord& record)
+{
+    writeAllocation(sequence, record, false, 0);
+}
+
+void
+ChunkEncoder::addReallocation(sequence_t sequence, const ReallocationRecord& record)
+{
+    writeAllocation(sequence, record.allocation, true, record.old_address);
+}
+
+void
+ChunkEncoder::writeAllocation(
+        sequence_t sequence,
+        const AllocationRecord& record,
+        bool is_reallocation,
+        uintptr_t old_address)
+{
+    unsigned char token = COMPACT_ALLOCATION_FLAG | static_cast<unsigned char>(record.allocator);
+    if (record.native_frame_id) {
+        token |= COMPACT_NATIVE_FRAME_FLAG;
+    }
+    if (is_reallocation) {
+        token |= COMPACT_REALLOCATION_FLAG;
+    }
+    writeByte(token);
+    writeVarint(sequence - d_last_sequence);
+    writeSignedVarint(static_cast<int64_t>(record.address - d_last_address));
+    if (is_reallocation) {
+        writeSignedVarint(static_cast<int64_t>(old_address - record.address));
+    }
+    if (hooks::allocatorKind(record.allocator) != hooks::AllocatorKind::SIMPLE_DEALLOCATOR) {
+        writeVarint(record.size);
+    }
+    if (record.native_frame_id) {
+        writeSignedVarint(static_cast<int64_t>(record.native_frame_id - d_last_native_frame_id));
+        d_last_native_frame_id = record.native_frame_id;
+    }
+    d_last_sequence = sequence;
+    d_last_address = record.address;
+}
+
+void
+ChunkEncoder::addCancelledAllocations(const CancelledAllocations& record)
+{
+    writeByte(static_cast<unsigned char>(RecordType::CANCELLED_ALLOCATIONS));
+    writeByte(static_cast<unsigned char>(record.allocator));
+    writeSignedVarint(static_cast<int64_t>(record.native_frame_id - d_last_native_frame_id));
+    writeVarint(record.count);
+    writeVarint(record.bytes);
+    d_last_native_frame_id = record.native_frame_id;
+}
+
+void
+ChunkEncoder::addFramePush(frame_id_t frame_id)
+{
+    writeByte(static_cast<unsigned char>(RecordType::FRAME_PUSH));
+    writeVarint(frame_id);
+}
+
+void
+ChunkEncoder::addFramePop(uint8_t count)
+{
+    writeByte(static_cast<unsigned char>(RecordType::FRAME_POP));
+    writeByte(count);
+}
+
+void
+ChunkEncoder::addFrameLineUpdate(frame_id_t frame_id)
+{
+    writeByte(static_cast<unsigned char>(RecordType::FRAME_LINE_UPDATE));
+    writeVarint(frame_id);
+}
+
+const char*
+ChunkEncoder::data() const
+{
+    return d_buffer;
+}
+
+size_t
+ChunkEncoder::size() const
+{
+    return d_size;
+}
+
+void
+ChunkEncoder::writeByte(unsigned char byte)
+{
+    assert(d_size < d_capacity);
+    d_buffer[d_size++] = static_cast<char>(byte);
+}
+
+void
+ChunkEncoder::writeVarint(uint64_t value)
+{
+    while (value >= 0x80) {
+        writeByte(static_cast<unsigned char>(value) | 0x80);
+        value >>= 7;
+    }
+    writeByte(static_cast<unsigned char>(value));
+}
+
+void
+ChunkEncoder::writeSignedVarint(int64_t value)
+{
+    // Zigzag encoding, so that small negative deltas are small too.
+    writeVarint((static_cast<uint64_t>(value) << 1) ^ static_cast<uint64_t>(value >> 63));
+}
+
+ChunkDecoder::ChunkDecoder(thread_id_t tid, const char* data, size_t size)
+: d_cursor(data)
+, d_end(data + size)
+{
+    d_allocation.tid = tid;
+    d_cancelled_allocations.tid = tid;
+    d_frame_push.tid = tid;
+    d_frame_pop.tid = tid;
+    d_frame_line_update.tid = tid;
+}
+
+ChunkDecoder::Status
+ChunkDecoder::next(RecordType& record_type)
+{
+    if (d_cursor == d_end) {
+        return Status::END_OF_CHUNK;
+    }
+
+    auto token = static_cast<unsigned char>(*d_cursor++);
+    if (token & COMPACT_ALLOCATION_FLAG) {
+        record_type = RecordType::ALLOCATION;
+        d_allocation.allocator = static_cast<hooks::Allocator>(token & COMPACT_ALLOCATOR_MASK);
+
+        uint64_t sequence_delta;
+        int64_t address_delta;
+        if (!readVarint(sequence_delta) || !readSignedVarint(address_delta)) {
+            return Status::ERROR;
+        }
+        d_sequence += sequence_delta;
+        d_allocation.address += static_cast<uintptr_t>(address_delta);
+
+        int64_t old_address_delta = 0;
+        if ((token & COMPACT_REALLOCATION_FLAG) && !readSignedVarint(old_address_delta)) {
+            return Status::ERROR;
+        }
+
+        uint64_t size = 0;
+        if (hooks::allocatorKind(d_allocation.allocator) != hooks::AllocatorKind::SIMPLE_DEALLOCATOR
+            && !readVarint(size))
+        {
+            return Status::ERROR;
+        }
+        d_allocation.size = size;
+
+        d_allocation.native_frame_id = 0;
+        if (token & COMPACT_NATIVE_FRAME_FLAG) {
+            int64_t native_frame_id_delta;
+            if (!readSignedVarint(native_frame_id_delta)) {
+                return Status::ERROR;
+            }
+            d_last_native_frame_id += static_cast<frame_id_t>(native_frame_id_delta);
+            d_allocation.native_frame_id = d_last_native_frame_id;
+        }
+
+        if (token & COMPACT_REALLOCATION_FLAG) {
+            record_type = RecordType::REALLOCATION;
+            d_reallocation.allocation = d_allocation;
+            d_reallocation.old_address = d_allocation.address + static_cast<uintptr_t>(old_address_delta);
+        }
+        return Status::RECORD;
+    }
+
+    switch (static_cast<RecordType>(token)) {
+        case RecordType::CANCELLED_ALLOCATIONS: {
+            record_type = RecordType::CANCELLED_ALLOCATIONS;
+            if (d_cursor == d_end) {
+                return Status::ERROR;
+            }
+            d_cancelled_allocations.allocator = static_cast<hooks::Allocator>(*d_cursor++);
+            int64_t native_frame_id_delta;
+            uint64_t count;
+            uint64_t bytes;
+            if (!readSignedVarint(native_frame_id_delta) || !readVarint(count) || !readVarint(bytes)) {
+                return Status::ERROR;
+            }
+            d_last_native_frame_id += static_cast<frame_id_t>(native_frame_id_delta);
+            d_cancelled_allocations.native_frame_id = d_last_native_frame_id;
+            d_cancelled_allocations.count = count;
+            d_cancelled_allocations.bytes = bytes;
+            return Status::RECORD;
+        }
+        case RecordType::FRAME_PUSH: {
+            record_type = RecordType::FRAME_PUSH;
+            uint64_t frame_id;
+            if (!readVarint(frame_id)) {
+                return Status::ERROR;
+            }
+            d_frame_push.frame_id = frame_id;
+            return Status::RECORD;
+        }
+        case RecordType::FRAME_POP: {
+            record_type = RecordType::FRAME_POP;
+            if (d_cursor == d_end) {
+                return Status::ERROR;
+            }
+            d_frame_pop.count = static_cast<uint8_t>(*d_cursor++);
+            return Status::RECORD;
+        }
+        case RecordType::FRAME_LINE_UPDATE: {
+            record_type = RecordType::FRAME_LINE_UPDATE;
+            uint64_t frame_id;
+            if (!readVarint(frame_id)) {
+                return Status::ERROR;
+            }
+            d_frame_line_update.frame_id = frame_id;
+            return Status::RECORD;
+        }
+        default:
+            return Status::ERROR;
+    }
+}
+
+sequence_t
+ChunkDecoder::sequence() const
+{
+    return d_sequence;
+}
+
+const AllocationRecord&
+ChunkDecoder::allocation() const
+{
+    return d_allocation;
+}
+
+const ReallocationRecord&
+ChunkDecoder::reallocation() const
+{
+    return d_reallocation;
+}
+
+const CancelledAllocations&
+ChunkDecoder::cancelledAllocations() const
+{
+    return d_cancelled_allocations;
+}
+
+const FramePush&
+ChunkDecoder::framePush() const
+{
+    return d_frame_push;
+}
+
+const FramePop&
+ChunkDecoder::framePop() const
+{
+    return d_frame_pop;
+}
+
+const FrameLineUpdate&
+ChunkDecoder::frameLineUpdate() const
+{
+    return d_frame_line_update;
+}
+
+bool
+ChunkDecoder::readVarint(uint64_t& value)
+{
+    value = 0;
+    for (unsigned int shift = 0; shift < 64; shift += 7) {
+        if (d_cursor == d_end) {
+            return false;
+        }
+        auto byte = static_cast<unsigned char>(*d_cursor++);
+        value |= static_cast<uint64_t>(byte & 0x7f) << shift;
+        if (!(byte & 0x80)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+bool
+ChunkDecoder::readSignedVarint(int64_t& value)
+{
+    uint64_t encoded;
+    if (!readVarint(encoded)) {
+        return false;
+    }
+    value = static_cast<int64_t>((encoded >> 1) ^ -(encoded & 1));
+    return true;
+}
+
 }  // namespace memray::tracking_api
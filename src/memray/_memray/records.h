@@ -2,25 +2,29 @@
 
 #include <fstream>
 #include <stddef.h>
+#include <stdint.h>
 #include <string>
-#include <unordered_map>
 #include <utility>
 
 #include "Python.h"
 
+#include "flat_hash_map.h"
 #include "hooks.h"
 #include "python_helpers.h"
 
 namespace memray::tracking_api {
 
 const char MAGIC[] = "memray";
-const int CURRENT_HEADER_VERSION = 6;
+const int CURRENT_HEADER_VERSION = 7;
+// The oldest version whose records we still know how to read.
+const int OLDEST_SUPPORTED_HEADER_VERSION = 6;
 
 using frame_id_t = size_t;
 using thread_id_t = unsigned long;
 using millis_t = long long;
+using sequence_t = uint64_t;
 
-enum class RecordType {
+enum class RecordType : unsigned char {
     UNINITIALIZED = 0,
     ALLOCATION = 1,
     FRAME_INDEX = 2,
@@ -32,8 +36,47 @@ enum class RecordType {
     FRAME_POP = 8,
     THREAD_RECORD = 9,
     MEMORY_RECORD = 10,
+    THREAD_CHUNK = 11,
+    CHUNK_BARRIER = 12,
+    // Only found inside the thread buffers of the writer, never in a file.
+    REALLOCATION = 13,
+    AGGREGATED_ALLOCATION = 14,
+    PYTHON_TRACE_INDEX = 15,
+    // Only found inside a THREAD_CHUNK.
+    CANCELLED_ALLOCATIONS = 16,
+    CHECKPOINT = 17,
+    CHECKPOINT_INDEX = 18,
+    // Like MEMORY_MAP_START, but the new memory maps start as a copy of the
+    // previous ones, and only the objects that changed follow.
+    MEMORY_MAP_UPDATE = 19,
+    SEGMENTS_REMOVED = 20,
+    // Only found inside a THREAD_CHUNK. Replaces the innermost frame of the
+    // thread's stack with the same function at another line.
+    FRAME_LINE_UPDATE = 21,
+    // Replaces MEMORY_RECORD when the tracker samples the allocators too.
+    MEMORY_GAUGES_RECORD = 22,
+    ALLOCATION_COUNTS = 23,
+    // Only written to sinks that are read while they're being written.
+    SINK_STATS = 24,
 };
 
+// The header counts records by type. It says how many types it has counts
+// for, so that new types leave its layout alone.
+const size_t N_RECORD_TYPES = static_cast<size_t>(RecordType::SINK_STATS) + 1;
+
+// Allocation records inside a THREAD_CHUNK don't use a RecordType token.
+// Instead, their one byte token has the COMPACT_ALLOCATION_FLAG bit set
+// (which no RecordType has), the allocator in its low bits and a flag that
+// tells whether a native frame id follows. Reallocations have one more flag
+// set, and carry the address that they replaced.
+const unsigned char COMPACT_ALLOCATION_FLAG = 0x80;
+const unsigned char COMPACT_NATIVE_FRAME_FLAG = 0x40;
+const unsigned char COMPACT_REALLOCATION_FLAG = 0x20;
+const unsigned char COMPACT_ALLOCATOR_MASK = 0x0f;
+static_assert(
+        static_cast<unsigned char>(hooks::Allocator::PYMALLOC_FREE) <= COMPACT_ALLOCATOR_MASK,
+        "Allocators must fit in the low bits of a compact allocation token");
+
 struct TrackerStats
 {
     size_t n_allocations{0};
@@ -42,6 +85,29 @@ struct TrackerStats
     millis_t end_time{};
 };
 
+// What tracking cost the tracked process, as counted by the tracker itself.
+struct TrackerOverhead
+{
+    // Only one in every few calls to the hooks is timed, and the times of
+    // the rest are estimated from those.
+    uint64_t n_hook_calls{0};
+    uint64_t hooks_ns{0};
+    // The part of hooks_ns spent unwinding native stacks.
+    uint64_t unwind_ns{0};
+    // Time spent waiting for the RecordWriter's lock while another thread had it.
+    uint64_t lock_wait_ns{0};
+    // Allocations and deallocations that the hooks saw after the tracker was
+    // deactivated, while it was being torn down or after it failed to write.
+    uint64_t deactivated_records{0};
+    // The records handed to the RecordWriter and their size, by RecordType.
+    // Records of a thread are counted as they were handed over, and the
+    // THREAD_CHUNK records that carry them as they were written out. These
+    // are written after the number of types, and counts of types that the
+    // reader doesn't know about are skipped.
+    uint64_t n_records[N_RECORD_TYPES]{};
+    uint64_t n_bytes[N_RECORD_TYPES]{};
+};
+
 enum PythonAllocatorType {
     PYTHONALLOCATOR_PYMALLOC = 1,
     PYTHONALLOCATOR_PYMALLOC_DEBUG = 2,
@@ -49,6 +115,18 @@ enum PythonAllocatorType {
     PYTHONALLOCATOR_OTHER = 4,
 };
 
+enum FileFormat {
+    // Every allocation and deallocation is written as it happens.
+    FILEFORMAT_ALL_ALLOCATIONS = 1,
+    // The tracker keeps the heap aggregated by location in memory and writes
+    // only the totals of each location at its peak and at exit.
+    FILEFORMAT_AGGREGATED_ALLOCATIONS = 2,
+    // The tracker only counts the calls to the allocators made by each
+    // location and the bytes they asked for, ignoring the frees, and writes
+    // what it counted since the last time every so often.
+    FILEFORMAT_ALLOCATION_COUNTS = 3,
+};
+
 struct HeaderRecord
 {
     char magic[sizeof(MAGIC)];
@@ -58,6 +136,14 @@ struct HeaderRecord
     std::string command_line;
     int pid{-1};
     PythonAllocatorType python_allocator;
+    size_t sample_rate{0};
+    FileFormat file_format{FILEFORMAT_ALL_ALLOCATIONS};
+    // Allocation records that weren't written because the tracker couldn't
+    // write them out as fast as they were produced.
+    size_t dropped_records{0};
+    // Where the CHECKPOINT_INDEX record is in the file, or 0 if there's none.
+    uint64_t checkpoint_index_offset{0};
+    TrackerOverhead overhead{};
 };
 
 struct MemoryRecord
@@ -66,6 +152,38 @@ struct MemoryRecord
     size_t rss;
 };
 
+// What the allocators had when a MemoryRecord was taken, so that the memory
+// that's fragmented can be told apart from the memory that's in use.
+struct MemoryGauges
+{
+    // The memory that malloc got from the system, and the part of it that's
+    // allocated.
+    size_t heap_size;
+    size_t heap_in_use;
+    // The pymalloc arenas allocated since tracking started and not yet freed.
+    size_t pymalloc_arenas;
+    // The bytes that the hooks saw allocated and not yet freed.
+    size_t tracked_bytes;
+};
+
+struct MemoryGaugesRecord
+{
+    MemoryRecord memory;
+    MemoryGauges gauges;
+};
+
+// Written every so often to a sink whose reader reads the records as they
+// arrive, so that the reader can tell how far behind it is, and how much
+// the tracked process has had to wait for it.
+struct SinkStats
+{
+    // When the record was written, in nanoseconds since the epoch.
+    uint64_t ns_since_epoch;
+    // The time that writing has spent waiting for the sink to take what was
+    // written to it, since tracking started.
+    uint64_t blocked_ns;
+};
+
 struct AllocationRecord
 {
     thread_id_t tid;
@@ -75,14 +193,100 @@ struct AllocationRecord
     frame_id_t native_frame_id{0};
 };
 
+// A realloc() that moved or resized the allocation at old_address, recorded
+// as a single event instead of a deallocation followed by an allocation.
+struct ReallocationRecord
+{
+    AllocationRecord allocation;
+    uintptr_t old_address;
+};
+
+// Allocations that were freed by the thread that made them so soon after
+// that they were never written out. These are counted per allocator and
+// native stack, and belong to the Python stack that the thread has at the
+// point where this record is found.
+struct CancelledAllocations
+{
+    thread_id_t tid;
+    hooks::Allocator allocator;
+    frame_id_t native_frame_id;
+    size_t count;
+    size_t bytes;
+};
+
 struct Allocation
 {
     tracking_api::AllocationRecord record;
     size_t frame_index{0};
     size_t native_segment_generation{0};
     size_t n_allocations{1};
+    // For a reallocation, the address of the allocation that it replaced.
+    // Aggregators must treat that one as freed by this same event.
+    uintptr_t realloc_old_address{0};
+
+    // The deallocation of realloc_old_address, as it would have been
+    // recorded if the reallocation had been recorded as 2 separate events.
+    Allocation oldAddressDeallocation() const;
+    // The deallocation of all of the allocations counted by this one, which
+    // must come from a CANCELLED_ALLOCATIONS record.
+    Allocation cancelledDeallocation() const;
+};
+
+// Scale a sampled allocation up by the inverse of the probability that it
+// was recorded, so that it stands for all the memory (and all the
+// allocations) that weren't. Only simple allocations are sampled.
+void
+scaleSampledAllocation(Allocation& allocation, size_t sample_rate);
+
+// The contribution of all the allocations made from one location (the same
+// thread, Python stack and native stack) to the heap at its high water mark
+// and at the end of the tracking. Written by the tracker in place of the
+// allocations themselves when the FILEFORMAT_AGGREGATED_ALLOCATIONS file
+// format is used.
+struct AggregatedAllocation
+{
+    thread_id_t tid;
+    hooks::Allocator allocator;
+    frame_id_t native_frame_id;
+    size_t frame_index;
+    size_t native_segment_generation;
+
+    size_t n_allocations_in_high_water_mark;
+    size_t n_allocations_leaked;
+    size_t bytes_in_high_water_mark;
+    size_t bytes_leaked;
+
+    Allocation contributionToHighWaterMark() const;
+    Allocation contributionToLeaks() const;
+};
+
+// The calls that one location (the same thread, Python stack, native stack
+// and allocator) made to the allocator since the last counts written for it,
+// and the bytes that they asked for. Written by the tracker every so often
+// when the FILEFORMAT_ALLOCATION_COUNTS file format is used, so the reader
+// adds up all of the counts of each location.
+struct AllocationCounts
+{
+    thread_id_t tid;
+    hooks::Allocator allocator;
+    frame_id_t native_frame_id;
+    size_t frame_index;
+    size_t native_segment_generation;
+
+    uint64_t n_calls;
+    uint64_t n_bytes;
 
-    PyObject* toPythonObject() const;
+    Allocation toAllocation() const;
+};
+
+// A node of the tree of Python stacks built by a tracker aggregating or
+// counting the allocations itself. These are written in the order the nodes
+// were created in, so the reader ends up with the same indexes for the same
+// stacks.
+struct PythonTraceIndex
+{
+    frame_id_t frame_id;
+    uint32_t parent_index;
 };
 
 struct SegmentHeader
@@ -90,6 +294,9 @@ struct SegmentHeader
     const char* filename;
     size_t num_segments;
     uintptr_t addr;
+    // The GNU build id of the object, in hex, or an empty string if it has
+    // none. Files from before version 7 don't have it.
+    const char* build_id;
 };
 
 struct Segment
@@ -98,6 +305,13 @@ struct Segment
     uintptr_t memsz;
 };
 
+// An object that was unloaded, with all of its segments.
+struct RemovedSegments
+{
+    const char* filename;
+    uintptr_t addr;
+};
+
 struct RawFrame
 {
     const char* function_name;
@@ -122,11 +336,15 @@ struct RawFrame
             // two different char* but in that case we will end registering the
             // name twice, which is a good compromise given the speed that we
             // gain keeping this simple.
-
-            auto the_func = std::hash<const char*>{}(frame.function_name);
-            auto the_filename = std::hash<const char*>{}(frame.filename);
-            auto lineno = std::hash<int>{}(frame.lineno);
-            return the_func ^ the_filename ^ lineno;
+            //
+            // The fields are mixed rather than XORed together: the pointers
+            // share most of their bits, and XOR would make frames that only
+            // differ by swapping line numbers between functions collide.
+
+            uint64_t hash = reinterpret_cast<uintptr_t>(frame.function_name);
+            hash = containers::combineHash(hash, reinterpret_cast<uintptr_t>(frame.filename));
+            hash = containers::combineHash(hash, static_cast<uint64_t>(frame.lineno));
+            return containers::mixHash(hash);
         }
     };
 };
@@ -137,7 +355,11 @@ struct Frame
     std::string filename;
     int lineno{0};
 
-    PyObject* toPythonObject(python_helpers::PyUnicode_Cache& pystring_cache) const;
+    // The ids are the ones that the cache knows the two strings by.
+    PyObject* toPythonObject(
+            python_helpers::PyUnicode_Cache& pystring_cache,
+            python_helpers::PyUnicode_Cache::id_t function_name_id,
+            python_helpers::PyUnicode_Cache::id_t filename_id) const;
 
     auto operator==(const Frame& other) const -> bool
     {
@@ -158,10 +380,10 @@ struct Frame
             // name twice, which is a good compromise given the speed that we
             // gain keeping this simple.
 
-            auto the_func = std::hash<std::string>{}(frame.function_name);
-            auto the_filename = std::hash<std::string>{}(frame.filename);
-            auto lineno = std::hash<int>{}(frame.lineno);
-            return the_func ^ the_filename ^ lineno;
+            auto hash = std::hash<std::string>{}(frame.function_name);
+            hash = containers::combineHash(hash, std::hash<std::string>{}(frame.filename));
+            hash = containers::combineHash(hash, static_cast<uint64_t>(frame.lineno));
+            return containers::mixHash(hash);
         }
     };
 };
@@ -178,6 +400,12 @@ struct FramePop
     uint8_t count;
 };
 
+struct FrameLineUpdate
+{
+    frame_id_t frame_id;
+    thread_id_t tid;
+};
+
 struct UnresolvedNativeFrame
 {
     uintptr_t ip;
@@ -208,12 +436,12 @@ class FrameCollection
   private:
     const unsigned int d_index_increment;
     frame_id_t d_current_frame_id;
-    std::unordered_map<FrameType, frame_id_t, typename FrameType::Hash> d_frame_map{};
+    containers::FlatHashMap<FrameType, frame_id_t, typename FrameType::Hash> d_frame_map{};
 };
 
 using pyrawframe_map_val_t = std::pair<frame_id_t, RawFrame>;
 using pyframe_map_val_t = std::pair<frame_id_t, Frame>;
-using pyframe_map_t = std::unordered_map<pyframe_map_val_t::first_type, pyframe_map_val_t::second_type>;
+using pyframe_map_t = containers::FlatHashMap<pyframe_map_val_t::first_type, pyframe_map_val_t::second_type>;
 
 struct ThreadRecord
 {
@@ -221,4 +449,129 @@ struct ThreadRecord
     const char* name;
 };
 
+struct ThreadChunk
+{
+    thread_id_t tid;
+    size_t size;
+};
+
+struct ChunkBarrier
+{
+    sequence_t next_sequence;
+};
+
+// Written after a CHUNK_BARRIER every so often, so that a reader can start
+// reading from there. It's followed by a CheckpointStack for each of the
+// `n_threads` threads that had Python frames on their stack, each of which
+// is followed by `depth` frame ids, from the outermost frame inwards.
+struct Checkpoint
+{
+    sequence_t next_sequence;
+    size_t native_segment_generation;
+    size_t n_threads;
+};
+
+struct CheckpointStack
+{
+    thread_id_t tid;
+    size_t depth;
+};
+
+// Written at the end of the file, followed by the offsets of each CHECKPOINT.
+struct CheckpointIndex
+{
+    size_t n_checkpoints;
+};
+
+// Encodes the records of a THREAD_CHUNK into a caller provided buffer.
+//
+// The thread id is implied by the chunk, integers are written as LEB128
+// varints, and sequence numbers, addresses and native frame ids are written
+// as the difference with the ones in the previous allocation of the chunk.
+// Deallocations don't carry a size or a native frame id. The address that a
+// reallocation replaced is written as the difference with the new one, which
+// is 0 when the allocation was resized in place. Counts of cancelled
+// allocations share the native frame id delta with the allocations. A chunk
+// always starts from a clean state, so every chunk can be decoded on its own.
+class ChunkEncoder
+{
+  public:
+    // Upper bound on the number of bytes taken by any encoded record.
+    static constexpr size_t MAX_RECORD_SIZE = 1 + 5 * 10;
+
+    ChunkEncoder(char* buffer, size_t capacity);
+
+    void addAllocation(sequence_t sequence, const AllocationRecord& record);
+    void addReallocation(sequence_t sequence, const ReallocationRecord& record);
+    void addCancelledAllocations(const CancelledAllocations& record);
+    void addFramePush(frame_id_t frame_id);
+    void addFramePop(uint8_t count);
+    void addFrameLineUpdate(frame_id_t frame_id);
+
+    const char* data() const;
+    size_t size() const;
+
+  private:
+    // Methods
+    void writeAllocation(
+            sequence_t sequence,
+            const AllocationRecord& record,
+            bool is_reallocation,
+            uintptr_t old_address);
+    void writeByte(unsigned char byte);
+    void writeVarint(uint64_t value);
+    void writeSignedVarint(int64_t value);
+
+    // Data members
+    char* d_buffer;
+    size_t d_capacity;
+    size_t d_size{0};
+    sequence_t d_last_sequence{0};
+    uintptr_t d_last_address{0};
+    frame_id_t d_last_native_frame_id{0};
+};
+
+// Decodes the records of a THREAD_CHUNK written by a ChunkEncoder.
+class ChunkDecoder
+{
+  public:
+    enum class Status {
+        RECORD,
+        END_OF_CHUNK,
+        ERROR,
+    };
+
+    ChunkDecoder(thread_id_t tid, const char* data, size_t size);
+
+    // Decode the next record. When RECORD is returned, record_type is one of
+    // ALLOCATION, REALLOCATION, CANCELLED_ALLOCATIONS, FRAME_PUSH, FRAME_POP or
+    // FRAME_LINE_UPDATE and the matching accessor below holds the decoded record.
+    Status next(RecordType& record_type);
+
+    sequence_t sequence() const;
+    const AllocationRecord& allocation() const;
+    const ReallocationRecord& reallocation() const;
+    const CancelledAllocations& cancelledAllocations() const;
+    const FramePush& framePush() const;
+    const FramePop& framePop() const;
+    const FrameLineUpdate& frameLineUpdate() const;
+
+  private:
+    // Methods
+    [[nodiscard]] bool readVarint(uint64_t& value);
+    [[nodiscard]] bool readSignedVarint(int64_t& value);
+
+    // Data members
+    const char* d_cursor;
+    const char* const d_end;
+    sequence_t d_sequence{0};
+    frame_id_t d_last_native_frame_id{0};
+    AllocationRecord d_allocation{};
+    ReallocationRecord d_reallocation{};
+    CancelledAllocations d_cancelled_allocations{};
+    FramePush d_frame_push{};
+    FramePop d_frame_pop{};
+    FrameLineUpdate d_frame_line_update{};
+};
+
 }  // namespace memray::tracking_api
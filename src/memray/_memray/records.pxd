@@ -1,9 +1,15 @@
+from libc.stdint cimport uint64_t
 from libc.stdint cimport uintptr_t
 from libcpp cimport bool
 from libcpp.string cimport string
 from libcpp.vector cimport vector
 
 
+cdef extern from "hooks.h":
+    cdef enum Allocator 'memray::hooks::Allocator':
+        AllocatorMalloc 'memray::hooks::Allocator::MALLOC'
+
+
 cdef extern from "records.h" namespace "memray::tracking_api":
 
    struct Frame:
@@ -15,8 +21,8 @@ cdef extern from "records.h" namespace "memray::tracking_api":
        long int tid
        uintptr_t address
        size_t size
-       string allocator
-       vector[Frame] stack_trace
+       Allocator allocator
+       size_t native_frame_id
 
    struct TrackerStats:
        size_t n_allocations
@@ -24,6 +30,17 @@ cdef extern from "records.h" namespace "memray::tracking_api":
        long long start_time
        long long end_time
 
+   enum: N_RECORD_TYPES
+
+   struct TrackerOverhead:
+       uint64_t n_hook_calls
+       uint64_t hooks_ns
+       uint64_t unwind_ns
+       uint64_t lock_wait_ns
+       uint64_t deactivated_records
+       uint64_t n_records[N_RECORD_TYPES]
+       uint64_t n_bytes[N_RECORD_TYPES]
+
    struct HeaderRecord:
        int version
        bool native_traces
@@ -31,13 +48,40 @@ cdef extern from "records.h" namespace "memray::tracking_api":
        string command_line
        int pid
        int python_allocator
+       size_t sample_rate
+       int file_format
+       size_t dropped_records
+       uint64_t checkpoint_index_offset
+       TrackerOverhead overhead
 
    cdef cppclass Allocation:
        AllocationRecord record
        size_t frame_index
+       size_t native_segment_generation
        size_t n_allocations
-       object toPythonObject()
+       uintptr_t realloc_old_address
+       Allocation oldAddressDeallocation() const
+       Allocation cancelledDeallocation() const
+
+   cdef enum FileFormat:
+       FILEFORMAT_ALL_ALLOCATIONS
+       FILEFORMAT_AGGREGATED_ALLOCATIONS
+       FILEFORMAT_ALLOCATION_COUNTS
+
+   struct AggregatedAllocation:
+       size_t bytes_in_high_water_mark
+       size_t bytes_leaked
+
+   struct AllocationCounts:
+       uint64_t n_calls
+       uint64_t n_bytes
 
    struct MemoryRecord:
        unsigned long int ms_since_epoch
        size_t rss
+
+   struct MemoryGauges:
+       size_t heap_size
+       size_t heap_in_use
+       size_t pymalloc_arenas
+       size_t tracked_bytes
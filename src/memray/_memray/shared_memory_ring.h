@@ -0,0 +1,101 @@
+#pragma once
+
+#include <atomic>
+#include <cerrno>
+#include <cstdint>
+#include <ctime>
+#include <string>
+
+#include <linux/futex.h>
+#include <sys/file.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+namespace memray::io {
+
+// The header of the shared memory segment that a SharedMemorySink writes
+// to and a SharedMemorySource reads from, followed by `capacity` bytes of
+// data. Like in a ThreadBuffer, the writer only ever advances `tail` and the
+// reader only ever advances `head`.
+//
+// A side that finds the ring full (or empty) sets its `*_waiting` flag and
+// sleeps on the futex word that the other side bumps when it makes progress.
+// This is re-checked after the flag is set, and both sides use sequentially
+// consistent operations, so either the sleeper sees the progress or the
+// other side sees the flag. Sleeps are bounded anyway, so that closing
+// either side is always noticed.
+struct SharedMemoryRing
+{
+    static constexpr uint32_t MAGIC = 0x6d656d72;  // "memr"
+    static constexpr long WAIT_TIMEOUT_NS = 100 * 1000 * 1000;  // 100 ms
+
+    // Set last, once the writer has initialized the rest.
+    std::atomic<uint32_t> magic;
+    uint64_t capacity;
+    std::atomic<uint64_t> head;
+    std::atomic<uint64_t> tail;
+    std::atomic<uint32_t> data_generation;
+    std::atomic<uint32_t> space_generation;
+    std::atomic<uint32_t> reader_waiting;
+    std::atomic<uint32_t> writer_waiting;
+    std::atomic<uint32_t> reader_attached;
+    std::atomic<uint32_t> reader_closed;
+    std::atomic<uint32_t> writer_closed;
+
+    char* data()
+    {
+        return reinterpret_cast<char*>(this + 1);
+    }
+};
+
+static_assert(
+        sizeof(std::atomic<uint32_t>) == sizeof(uint32_t) && std::atomic<uint32_t>::is_always_lock_free,
+        "Futex words must be plain 32 bit integers");
+
+inline std::string
+sharedMemoryPath(const std::string& name)
+{
+    return "/memray-" + name;
+}
+
+// The writer holds an exclusive flock() on the segment for as long as it has
+// it open, so that the reader can tell if it died without closing the ring.
+inline bool
+writerIsGone(const SharedMemoryRing& ring, int fd)
+{
+    return ring.writer_closed.load(std::memory_order_seq_cst) || ::flock(fd, LOCK_EX | LOCK_NB) == 0;
+}
+
+// The reader can't lock the segment too, so it holds an exclusive flock() on
+// this second one, which the writer creates next to it, for as long as it's
+// attached. A writer that waits for space checks it to tell if the reader died.
+inline std::string
+readerLockPath(const std::string& segment_path)
+{
+    return segment_path + ".reader";
+}
+
+inline bool
+readerIsGone(const SharedMemoryRing& ring, int reader_lock_fd)
+{
+    return ring.reader_closed.load(std::memory_order_seq_cst)
+           || (ring.reader_attached.load(std::memory_order_seq_cst)
+               && ::flock(reader_lock_fd, LOCK_EX | LOCK_NB) == 0);
+}
+
+inline void
+futexWait(std::atomic<uint32_t>& word, uint32_t expected)
+{
+    timespec timeout{0, SharedMemoryRing::WAIT_TIMEOUT_NS};
+    // The segment is shared between processes, so this can't be a private futex.
+    ::syscall(SYS_futex, reinterpret_cast<uint32_t*>(&word), FUTEX_WAIT, expected, &timeout, nullptr, 0);
+}
+
+inline void
+futexWake(std::atomic<uint32_t>& word)
+{
+    word.fetch_add(1, std::memory_order_seq_cst);
+    ::syscall(SYS_futex, reinterpret_cast<uint32_t*>(&word), FUTEX_WAKE, 1, nullptr, nullptr, 0);
+}
+
+}  // namespace memray::io
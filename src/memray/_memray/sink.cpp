@@ -1,4 +1,5 @@
 #include <cerrno>
+#include <chrono>
 #include <cstdio>
 
 #include <arpa/inet.h>
@@ -7,15 +8,28 @@
 #include <stdexcept>
 #include <sys/mman.h>
 #include <sys/socket.h>
+#include <sys/syscall.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <unistd.h>
 #include <utility>
 
 #include <Python.h>
+#include <zstd.h>
 
 #include "exceptions.h"
+#include "hooks.h"
 #include "sink.h"
 
+#if __has_include(<linux/io_uring.h>)
+#    include <linux/io_uring.h>
+#endif
+
+// Writing through io_uring needs IORING_OP_WRITE, which came with 5.6.
+#if defined(IORING_FEAT_RW_CUR_POS) && defined(__NR_io_uring_setup) && defined(__NR_io_uring_enter)
+#    define MEMRAY_HAS_IO_URING 1
+#endif
+
 namespace memray::io {
 
 using namespace memray::exception;
@@ -36,8 +50,79 @@ removeSuffix(const std::string& s, const std::string& suffix)
     return s.substr(0, s.size() - suffix.size());
 }
 
+// Wait for the predicate to hold, and add the time that took to waited_ns if
+// it didn't hold already.
+template<typename Predicate>
+void
+waitCounting(
+        std::condition_variable& cv,
+        std::unique_lock<std::mutex>& lock,
+        std::atomic<uint64_t>& waited_ns,
+        Predicate predicate)
+{
+    if (predicate()) {
+        return;
+    }
+    auto started = std::chrono::steady_clock::now();
+    cv.wait(lock, predicate);
+    auto waited = std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now() - started);
+    waited_ns.fetch_add(waited.count(), std::memory_order_relaxed);
+}
+
+int
+openOutputFile(const std::string& file_name, bool exist_ok)
+{
+    int flags = O_CREAT | O_RDWR | O_TRUNC | O_CLOEXEC;
+    if (!exist_ok) {
+        flags |= O_EXCL;
+    }
+    int fd;
+    do {
+        fd = ::open(file_name.c_str(), flags, 0644);
+    } while (fd < 0 && errno == EINTR);
+    if (fd < 0) {
+        throw IoError{"Could not create output file " + file_name + ": " + std::string(strerror(errno))};
+    }
+    return fd;
+}
+
+bool
+writeAllAt(int fd, const char* data, size_t length, off_t offset)
+{
+    while (length) {
+        ssize_t ret = ::pwrite(fd, data, length, offset);
+        if (ret < 0 && errno != EINTR) {
+            return false;
+        } else if (ret >= 0) {
+            data += ret;
+            length -= ret;
+            offset += ret;
+        }
+    }
+    return true;
+}
+
 }  // unnamed namespace
 
+size_t
+Sink::restartPointInterval() const
+{
+    return 0;
+}
+
+bool
+Sink::markRestartPoint(__attribute__((unused)) const char* state, __attribute__((unused)) size_t length)
+{
+    return true;
+}
+
+bool
+Sink::isLive() const
+{
+    return false;
+}
+
 bool
 FileSink::writeAll(const char* data, size_t length)
 {
@@ -70,17 +155,15 @@ FileSink::writeAll(const char* data, size_t length)
 
 FileSink::FileSink(const std::string& file_name, bool exist_ok)
 : d_fileNameStem(removeSuffix(file_name, "." + std::to_string(::getpid())))
+, d_fd(openOutputFile(file_name, exist_ok))
 {
-    int flags = O_CREAT | O_RDWR | O_TRUNC | O_CLOEXEC;
-    if (!exist_ok) {
-        flags |= O_EXCL;
-    }
-    do {
-        d_fd = ::open(file_name.c_str(), flags, 0644);
-    } while (d_fd < 0 && errno == EINTR);
-    if (d_fd < 0) {
-        throw IoError{"Could not create output file " + file_name + ": " + std::string(strerror(errno))};
-    }
+}
+
+bool
+FileSink::flush()
+{
+    // Whatever is in our shared mapping is already in the file.
+    return true;
 }
 
 bool
@@ -183,163 +266,1281 @@ FileSink::~FileSink()
     }
 }
 
-SocketSink::SocketSink(std::string host, uint16_t port)
-: d_host(std::move(host))
-, d_port(port)
-, d_buffer(new char[BUFFER_SIZE])
-, d_bufferNeedle(d_buffer.get())
+// The parts of io_uring that the sink needs, set up with the raw system
+// calls so that there's no library to depend on. Each request is submitted
+// as soon as it's queued, and there are never more of them in flight than
+// there are entries in the submission queue.
+#ifdef MEMRAY_HAS_IO_URING
+struct UringFileSink::Ring
 {
-    open();
-}
+    static constexpr unsigned ENTRIES = 8;
 
-size_t
-SocketSink::freeSpaceInBuffer()
+    Ring() = default;
+    Ring(const Ring&) = delete;
+    Ring& operator=(const Ring&) = delete;
+    ~Ring();
+
+    static std::unique_ptr<Ring> create();
+    bool submitWrite(int fd, const char* data, size_t length, off_t offset, uint64_t user_data);
+    bool popCompletion(uint64_t& user_data, int& result);
+    bool waitForCompletion();
+
+    int d_fd{-1};
+    void* d_sqRing{nullptr};
+    size_t d_sqRingSize{0};
+    void* d_cqRing{nullptr};
+    size_t d_cqRingSize{0};
+    io_uring_sqe* d_sqes{nullptr};
+    size_t d_sqesSize{0};
+    unsigned* d_sqTail{nullptr};
+    unsigned* d_sqMask{nullptr};
+    unsigned* d_sqArray{nullptr};
+    unsigned* d_cqHead{nullptr};
+    unsigned* d_cqTail{nullptr};
+    unsigned* d_cqMask{nullptr};
+    io_uring_cqe* d_cqes{nullptr};
+};
+
+UringFileSink::Ring::~Ring()
 {
-    return BUFFER_SIZE - (d_bufferNeedle - d_buffer.get());
+    if (d_sqes) {
+        munmap(d_sqes, d_sqesSize);
+    }
+    if (d_cqRing && d_cqRing != d_sqRing) {
+        munmap(d_cqRing, d_cqRingSize);
+    }
+    if (d_sqRing) {
+        munmap(d_sqRing, d_sqRingSize);
+    }
+    if (d_fd != -1) {
+        ::close(d_fd);
+    }
 }
 
-bool
-SocketSink::writeAll(const char* data, size_t length)
+std::unique_ptr<UringFileSink::Ring>
+UringFileSink::Ring::create()
 {
-    while (freeSpaceInBuffer() < length) {
-        size_t toWrite = freeSpaceInBuffer();
-        memcpy(d_bufferNeedle, data, toWrite);
-        d_bufferNeedle += toWrite;
-        data += toWrite;
-        length -= toWrite;
-        if (!flush()) {
-            return false;
+    io_uring_params params{};
+    int fd = static_cast<int>(syscall(__NR_io_uring_setup, ENTRIES, &params));
+    if (fd < 0) {
+        return nullptr;
+    }
+    auto ring = std::make_unique<Ring>();
+    ring->d_fd = fd;
+
+    auto map = [&](size_t size, off_t offset) -> void* {
+        void* ptr = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, offset);
+        return ptr == MAP_FAILED ? nullptr : ptr;
+    };
+    ring->d_sqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring->d_cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        ring->d_sqRingSize = ring->d_cqRingSize = std::max(ring->d_sqRingSize, ring->d_cqRingSize);
+    }
+    ring->d_sqRing = map(ring->d_sqRingSize, IORING_OFF_SQ_RING);
+    if (!ring->d_sqRing) {
+        return nullptr;
+    }
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        ring->d_cqRing = ring->d_sqRing;
+    } else {
+        ring->d_cqRing = map(ring->d_cqRingSize, IORING_OFF_CQ_RING);
+        if (!ring->d_cqRing) {
+            return nullptr;
         }
     }
+    ring->d_sqesSize = params.sq_entries * sizeof(io_uring_sqe);
+    ring->d_sqes = static_cast<io_uring_sqe*>(map(ring->d_sqesSize, IORING_OFF_SQES));
+    if (!ring->d_sqes) {
+        return nullptr;
+    }
 
-    memcpy(d_bufferNeedle, data, length);
-    d_bufferNeedle += length;
-    return true;
+    auto sq = static_cast<char*>(ring->d_sqRing);
+    auto cq = static_cast<char*>(ring->d_cqRing);
+    ring->d_sqTail = reinterpret_cast<unsigned*>(sq + params.sq_off.tail);
+    ring->d_sqMask = reinterpret_cast<unsigned*>(sq + params.sq_off.ring_mask);
+    ring->d_sqArray = reinterpret_cast<unsigned*>(sq + params.sq_off.array);
+    ring->d_cqHead = reinterpret_cast<unsigned*>(cq + params.cq_off.head);
+    ring->d_cqTail = reinterpret_cast<unsigned*>(cq + params.cq_off.tail);
+    ring->d_cqMask = reinterpret_cast<unsigned*>(cq + params.cq_off.ring_mask);
+    ring->d_cqes = reinterpret_cast<io_uring_cqe*>(cq + params.cq_off.cqes);
+    return ring;
 }
 
 bool
-SocketSink::flush()
+UringFileSink::Ring::submitWrite(
+        int fd,
+        const char* data,
+        size_t length,
+        off_t offset,
+        uint64_t user_data)
 {
-    const char* data = d_buffer.get();
-    size_t length = d_bufferNeedle - data;
+    // Only this side moves the tail of the submission queue.
+    const unsigned tail = *d_sqTail;
+    const unsigned index = tail & *d_sqMask;
+    io_uring_sqe* sqe = &d_sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = IORING_OP_WRITE;
+    sqe->fd = fd;
+    sqe->addr = reinterpret_cast<uint64_t>(data);
+    sqe->len = static_cast<uint32_t>(length);
+    sqe->off = static_cast<uint64_t>(offset);
+    sqe->user_data = user_data;
+    d_sqArray[index] = index;
+    __atomic_store_n(d_sqTail, tail + 1, __ATOMIC_RELEASE);
 
-    d_bufferNeedle = d_buffer.get();
+    long ret;
+    do {
+        ret = syscall(__NR_io_uring_enter, d_fd, 1, 0, 0, nullptr, 0);
+    } while (ret < 0 && errno == EINTR);
+    return ret == 1;
+}
 
-    while (length) {
-        ssize_t ret = ::send(d_socket_fd, data, length, 0);
-        if (ret < 0 && errno != EINTR) {
-            return false;
-        } else if (ret >= 0) {
-            data += ret;
-            length -= ret;
-        }
+bool
+UringFileSink::Ring::popCompletion(uint64_t& user_data, int& result)
+{
+    // Only this side moves the head of the completion queue.
+    const unsigned head = *d_cqHead;
+    if (head == __atomic_load_n(d_cqTail, __ATOMIC_ACQUIRE)) {
+        return false;
     }
+    const io_uring_cqe& cqe = d_cqes[head & *d_cqMask];
+    user_data = cqe.user_data;
+    result = cqe.res;
+    __atomic_store_n(d_cqHead, head + 1, __ATOMIC_RELEASE);
     return true;
 }
 
 bool
-SocketSink::seek(__attribute__((unused)) off_t offset, __attribute__((unused)) int whence)
+UringFileSink::Ring::waitForCompletion()
 {
-    return false;
+    long ret;
+    do {
+        ret = syscall(__NR_io_uring_enter, d_fd, 0, 1, IORING_ENTER_GETEVENTS, nullptr, 0);
+    } while (ret < 0 && errno == EINTR);
+    return ret >= 0;
 }
 
-std::unique_ptr<Sink>
-SocketSink::cloneInChildProcess()
-{
-    // We can't clone ourselves. We can't start a new TCP stream and block
-    // waiting for a client, and we can't create a new sink that shares the
-    // same socket because the client would see writes from all processes
-    // interleaved.
-    return {};
-}
+#else
 
-SocketSink::~SocketSink()
+// Without io_uring everything is written synchronously.
+struct UringFileSink::Ring
 {
-    if (d_socket_open) {
-        flush();
-        ::close(d_socket_fd);
-        d_socket_open = false;
+    static constexpr unsigned ENTRIES = 8;
+
+    static std::unique_ptr<Ring> create()
+    {
+        return nullptr;
     }
-}
 
-void
-SocketSink::open()
-{
-    int sockfd;
-    struct sockaddr_storage their_addr;
-    socklen_t sin_size;
-    int yes = 1;
+    bool submitWrite(int, const char*, size_t, off_t, uint64_t)
+    {
+        return false;
+    }
 
-    sockaddr_in si;
-    si.sin_family = AF_INET;
-    si.sin_addr.s_addr = ::inet_addr(d_host.c_str());
-    si.sin_port = htons(d_port);
+    bool popCompletion(uint64_t&, int&)
+    {
+        return false;
+    }
 
-    if ((sockfd = socket(PF_INET, SOCK_STREAM, 0)) == -1) {
-        LOG(ERROR) << "Encountered error in 'socket' call: " << strerror(errno);
-        throw IoError{"Failed to open socket"};
+    bool waitForCompletion()
+    {
+        return false;
     }
+};
 
-    if (setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(int)) == -1) {
-        ::close(sockfd);
-        LOG(ERROR) << "Encountered error in 'setsockopt' call: " << strerror(errno);
-        throw IoError{"Failed to set socket options"};
+#endif  // MEMRAY_HAS_IO_URING
+
+UringFileSink::UringFileSink(const std::string& file_name, bool exist_ok)
+: d_fileNameStem(removeSuffix(file_name, "." + std::to_string(::getpid())))
+, d_fd(openOutputFile(file_name, exist_ok))
+{
+    // The buffers are faulted in now, rather than by the first writes.
+    const size_t size = NUM_BUFFERS * BUFFER_SIZE;
+    const int flags = MAP_PRIVATE | MAP_ANONYMOUS;
+    void* buffers = MAP_FAILED;
+#ifdef MAP_HUGETLB
+    buffers = mmap(nullptr, size, PROT_READ | PROT_WRITE, flags | MAP_HUGETLB | MAP_POPULATE, -1, 0);
+#endif
+    if (buffers == MAP_FAILED) {
+        // There are no huge pages set aside: settle for transparent ones.
+        buffers = mmap(nullptr, size, PROT_READ | PROT_WRITE, flags, -1, 0);
+        if (buffers == MAP_FAILED) {
+            int error = errno;
+            ::close(d_fd);
+            throw IoError{"Could not allocate the output buffers: " + std::string(strerror(error))};
+        }
+#ifdef MADV_HUGEPAGE
+        madvise(buffers, size, MADV_HUGEPAGE);
+#endif
+        memset(buffers, 0, size);
     }
+    d_buffers = static_cast<char*>(buffers);
 
-    if (bind(sockfd, (sockaddr*)&si, sizeof si) == -1) {
-        ::close(sockfd);
-        LOG(WARNING) << "Encountered error in 'bind' call: " << strerror(errno);
-        throw IoError{"Failed to bind to host and port"};
+    d_ring = Ring::create();
+    d_requests.resize(Ring::ENTRIES);
+    for (size_t i = 0; i < Ring::ENTRIES; ++i) {
+        d_freeRequests.push_back(i);
     }
+}
 
-    if (listen(sockfd, 1) == -1) {
-        ::close(sockfd);
-        throw IoError{"Encountered error in listen call"};
+bool
+UringFileSink::writeAll(const char* data, size_t length)
+{
+    if (d_failed) {
+        return false;
     }
+    while (length) {
+        if (d_bufferUsed == BUFFER_SIZE && !nextBuffer()) {
+            return false;
+        }
+        size_t toCopy = std::min(BUFFER_SIZE - d_bufferUsed, length);
+        memcpy(d_buffers + d_currentBuffer * BUFFER_SIZE + d_bufferUsed, data, toCopy);
+        d_bufferUsed += toCopy;
+        data += toCopy;
+        length -= toCopy;
+    }
+    return true;
+}
 
-    LOG(DEBUG) << "Waiting for connections";
-    sin_size = sizeof their_addr;
+bool
+UringFileSink::flush()
+{
+    if (!submitBuffer()) {
+        return false;
+    }
+    for (size_t buffer = 0; buffer < NUM_BUFFERS; ++buffer) {
+        if (!waitForBuffer(buffer)) {
+            return false;
+        }
+    }
+    return !d_failed;
+}
 
-    bool async_err = false;
-    do {
-        Py_BEGIN_ALLOW_THREADS;
-        d_socket_fd = accept(sockfd, (struct sockaddr*)&their_addr, &sin_size);
-        Py_END_ALLOW_THREADS;
-    } while (d_socket_fd != 0 && errno == EINTR && !(async_err = PyErr_CheckSignals()));
-    ::close(sockfd);
+bool
+UringFileSink::seek(off_t offset, int whence)
+{
+    if (whence != SEEK_SET && whence != SEEK_END) {
+        errno = EINVAL;
+        return false;
+    }
+    if (!flush()) {
+        return false;
+    }
+    if (whence == SEEK_END) {
+        offset += d_fileSize;
+    }
+    if (offset < 0) {
+        errno = EINVAL;
+        return false;
+    }
+    d_bufferOffset = offset;
+    d_bufferUsed = d_bufferSubmitted = 0;
+    return true;
+}
 
-    if (async_err) {
-        return;
+bool
+UringFileSink::submitBuffer()
+{
+    if (d_bufferUsed == d_bufferSubmitted) {
+        return !d_failed;
+    }
+    const char* data = d_buffers + d_currentBuffer * BUFFER_SIZE + d_bufferSubmitted;
+    if (!submitWrite(data, d_bufferUsed - d_bufferSubmitted, d_bufferOffset + d_bufferSubmitted)) {
+        d_failed = true;
+        return false;
     }
+    d_bufferSubmitted = d_bufferUsed;
+    return true;
+}
 
-    if (d_socket_fd == -1) {
-        LOG(ERROR) << "Encountered error in 'accept' call: " << strerror(errno);
-        throw IoError{strerror(errno)};
+bool
+UringFileSink::nextBuffer()
+{
+    if (!submitBuffer()) {
+        return false;
     }
+    d_bufferOffset += d_bufferUsed;
+    d_currentBuffer = (d_currentBuffer + 1) % NUM_BUFFERS;
+    d_bufferUsed = d_bufferSubmitted = 0;
+    return waitForBuffer(d_currentBuffer);
+}
 
-    d_socket_open = true;
+bool
+UringFileSink::submitWrite(const char* data, size_t length, off_t offset)
+{
+    preallocate(offset + length);
+    d_fileSize = std::max(d_fileSize, static_cast<off_t>(offset + length));
+    while (d_ring && d_freeRequests.empty()) {
+        if (!reapCompletions(true)) {
+            return false;
+        }
+    }
+    if (!d_ring) {
+        return writeAllAt(d_fd, data, length, offset);
+    }
+    size_t request = d_freeRequests.back();
+    d_freeRequests.pop_back();
+    d_requests[request] = Request{d_currentBuffer, data, length, offset};
+    ++d_pendingWrites[d_currentBuffer];
+    return d_ring->submitWrite(d_fd, data, length, offset, request);
 }
 
-NullSink::~NullSink()
+bool
+UringFileSink::reapCompletions(bool wait)
 {
+    bool reaped = false;
+    while (d_ring) {
+        uint64_t request;
+        int result;
+        if (!d_ring->popCompletion(request, result)) {
+            if (!wait || reaped) {
+                break;
+            }
+            if (!d_ring->waitForCompletion()) {
+                d_failed = true;
+                return false;
+            }
+            continue;
+        }
+        reaped = true;
+        --d_pendingWrites[d_requests[request].buffer];
+        d_freeRequests.push_back(request);
+        if (!completeRequest(d_requests[request], result)) {
+            d_failed = true;
+        }
+    }
+    return !d_failed;
 }
 
 bool
-NullSink::writeAll(const char*, size_t)
+UringFileSink::completeRequest(Request& request, int result)
 {
+    if (result < 0) {
+        // Kernels before 5.6 have io_uring but can't write with it, so give
+        // up on it once nothing else is in flight, and write synchronously.
+        if (result == -EINVAL || result == -EOPNOTSUPP) {
+            if (d_freeRequests.size() == Ring::ENTRIES) {
+                d_ring.reset();
+            }
+        }
+        return writeAllAt(d_fd, request.data, request.length, request.offset);
+    }
+    // What a short write left is written synchronously.
+    const auto written = static_cast<size_t>(result);
+    if (written < request.length) {
+        const size_t remaining = request.length - written;
+        return writeAllAt(d_fd, request.data + written, remaining, request.offset + written);
+    }
     return true;
 }
 
 bool
-NullSink::seek(off_t, int)
+UringFileSink::waitForBuffer(size_t buffer)
 {
-    return true;
+    while (d_pendingWrites[buffer]) {
+        if (!reapCompletions(true)) {
+            return false;
+        }
+    }
+    return !d_failed;
+}
+
+void
+UringFileSink::preallocate(off_t end)
+{
+    if (!d_canPreallocate || end <= d_preallocatedSize) {
+        return;
+    }
+    // Blocks past the end of the data are given back when the sink is
+    // destroyed, and the size of the file only follows what was written.
+    off_t new_size = (end / PREALLOCATION_STEP + 1) * PREALLOCATION_STEP;
+    if (0 != fallocate(d_fd, FALLOC_FL_KEEP_SIZE, d_preallocatedSize, new_size - d_preallocatedSize)) {
+        // Not every file system can do this, and it's only an optimization.
+        d_canPreallocate = false;
+        return;
+    }
+    d_preallocatedSize = new_size;
 }
 
 std::unique_ptr<Sink>
-NullSink::cloneInChildProcess()
+UringFileSink::cloneInChildProcess()
 {
-    return std::make_unique<NullSink>();
+    std::string file_name = d_fileNameStem + "." + std::to_string(::getpid());
+    return std::make_unique<UringFileSink>(file_name, true);
+}
+
+UringFileSink::~UringFileSink()
+{
+    if (!flush()) {
+        LOG(ERROR) << "Failed to write the output file: " << strerror(errno);
+    }
+    d_ring.reset();
+    if (d_preallocatedSize > d_fileSize && 0 != ftruncate(d_fd, d_fileSize)) {
+        LOG(ERROR) << "Failed to truncate the output file: " << strerror(errno);
+    }
+    munmap(d_buffers, NUM_BUFFERS * BUFFER_SIZE);
+    ::close(d_fd);
+}
+
+CompressedFileSink::CompressedFileSink(const std::string& file_name, bool exist_ok)
+: d_fileNameStem(removeSuffix(file_name, "." + std::to_string(::getpid())))
+, d_fd(openOutputFile(file_name, exist_ok))
+{
+    d_frame.reserve(FRAME_SIZE);
+    d_pendingFrame.reserve(FRAME_SIZE);
+    d_thread = std::thread(&CompressedFileSink::compressFrames, this);
+}
+
+bool
+CompressedFileSink::writeAll(const char* data, size_t length)
+{
+    if (d_failed) {
+        return false;
+    }
+    if (!d_storedFrameSize || d_rewritingStoredFrame) {
+        d_frame.insert(d_frame.end(), data, data + length);
+        return true;
+    }
+    while (length) {
+        size_t toCopy = std::min(length, FRAME_SIZE - d_frame.size());
+        d_frame.insert(d_frame.end(), data, data + toCopy);
+        data += toCopy;
+        length -= toCopy;
+        if (d_frame.size() == FRAME_SIZE && !submitFrame()) {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool
+CompressedFileSink::flush()
+{
+    if (!d_storedFrameSize || d_rewritingStoredFrame) {
+        return writeStoredFrame();
+    }
+    return submitFrame() && waitForPendingFrame();
+}
+
+bool
+CompressedFileSink::seek(off_t offset, int whence)
+{
+    // The only position we know in the uncompressed stream is its start.
+    if (offset != 0 || whence != SEEK_SET) {
+        errno = EINVAL;
+        return false;
+    }
+    if (d_storedFrameSize) {
+        if (!submitFrame() || !waitForPendingFrame()) {
+            return false;
+        }
+        d_rewritingStoredFrame = true;
+    }
+    d_frame.clear();
+    return true;
+}
+
+bool
+CompressedFileSink::writeStoredFrame()
+{
+    if (d_rewritingStoredFrame && d_frame.size() != d_storedFrameSize) {
+        errno = EINVAL;
+        return false;
+    }
+
+    // A zstd frame with a single segment, its content size, and raw blocks.
+    const size_t MAX_BLOCK_SIZE = 128 * 1024;
+    std::vector<char> frame;
+    auto append = [&](uint64_t value, size_t size) {
+        for (size_t i = 0; i < size; ++i) {
+            frame.push_back(static_cast<char>(value >> (8 * i)));
+        }
+    };
+    append(ZSTD_MAGICNUMBER, 4);
+    append(0xA0, 1);
+    append(d_frame.size(), 4);
+    size_t offset = 0;
+    do {
+        size_t size = std::min(MAX_BLOCK_SIZE, d_frame.size() - offset);
+        bool last = offset + size == d_frame.size();
+        append((size << 3) | (last ? 1 : 0), 3);
+        frame.insert(frame.end(), d_frame.begin() + offset, d_frame.begin() + offset + size);
+        offset += size;
+    } while (offset < d_frame.size());
+
+    if (!writeAllAt(d_fd, frame.data(), frame.size(), 0)) {
+        return false;
+    }
+    if (!d_rewritingStoredFrame) {
+        // Nothing has been handed to the background thread yet.
+        d_storedFrameSize = d_frame.size();
+        d_fileOffset = frame.size();
+    }
+    d_rewritingStoredFrame = false;
+    d_frame.clear();
+    return true;
+}
+
+bool
+CompressedFileSink::submitFrame()
+{
+    if (d_frame.empty()) {
+        return !d_failed;
+    }
+    std::unique_lock<std::mutex> lock(d_mutex);
+    d_cv.wait(lock, [this] { return !d_framePending; });
+    d_frame.swap(d_pendingFrame);
+    d_frame.clear();
+    d_framePending = true;
+    d_cv.notify_all();
+    return !d_failed;
+}
+
+bool
+CompressedFileSink::waitForPendingFrame()
+{
+    std::unique_lock<std::mutex> lock(d_mutex);
+    d_cv.wait(lock, [this] { return !d_framePending; });
+    return !d_failed;
+}
+
+void
+CompressedFileSink::compressFrames()
+{
+    // Nothing this thread allocates must be tracked.
+    hooks::RecursionGuard::isActive = true;
+
+    ZSTD_CCtx* context = ZSTD_createCCtx();
+    if (!context) {
+        LOG(ERROR) << "Failed to create a compression context";
+        d_failed = true;
+    }
+    std::vector<char> compressed;
+    std::unique_lock<std::mutex> lock(d_mutex);
+    while (true) {
+        d_cv.wait(lock, [this] { return d_framePending || d_stopping; });
+        if (!d_framePending) {
+            break;
+        }
+
+        // The frame can't change until we say that it's no longer pending.
+        lock.unlock();
+        if (!d_failed) {
+            compressed.resize(ZSTD_compressBound(d_pendingFrame.size()));
+            size_t size = ZSTD_compressCCtx(
+                    context,
+                    compressed.data(),
+                    compressed.size(),
+                    d_pendingFrame.data(),
+                    d_pendingFrame.size(),
+                    COMPRESSION_LEVEL);
+            if (ZSTD_isError(size)) {
+                LOG(ERROR) << "Failed to compress the output file: " << ZSTD_getErrorName(size);
+                d_failed = true;
+            } else if (!writeAllAt(d_fd, compressed.data(), size, d_fileOffset)) {
+                LOG(ERROR) << "Failed to write the output file: " << strerror(errno);
+                d_failed = true;
+            } else {
+                d_fileOffset += size;
+            }
+        }
+        lock.lock();
+
+        d_framePending = false;
+        d_cv.notify_all();
+    }
+    ZSTD_freeCCtx(context);
+}
+
+std::unique_ptr<Sink>
+CompressedFileSink::cloneInChildProcess()
+{
+    std::string file_name = d_fileNameStem + "." + std::to_string(::getpid());
+    return std::make_unique<CompressedFileSink>(file_name, true);
+}
+
+CompressedFileSink::~CompressedFileSink()
+{
+    if (!d_storedFrameSize || d_rewritingStoredFrame) {
+        if (!d_frame.empty() && !writeStoredFrame()) {
+            LOG(ERROR) << "Failed to write the output file: " << strerror(errno);
+        }
+    } else {
+        submitFrame();
+    }
+    {
+        std::lock_guard<std::mutex> lock(d_mutex);
+        d_stopping = true;
+    }
+    d_cv.notify_all();
+    d_thread.join();
+    ::close(d_fd);
+}
+
+SocketSink::SocketSink(std::string host, uint16_t port, size_t buffer_size, bool connect_to_collector)
+: d_host(std::move(host))
+, d_port(port)
+, d_connect_to_collector(connect_to_collector)
+, d_bufferSize(buffer_size)
+, d_buffer(new char[d_bufferSize])
+, d_bufferNeedle(d_buffer.get())
+{
+    if (d_connect_to_collector) {
+        connect();
+    } else {
+        open();
+    }
+}
+
+size_t
+SocketSink::freeSpaceInBuffer()
+{
+    return d_bufferSize - (d_bufferNeedle - d_buffer.get());
+}
+
+bool
+SocketSink::writeAll(const char* data, size_t length)
+{
+    if (length <= freeSpaceInBuffer()) {
+        memcpy(d_bufferNeedle, data, length);
+        d_bufferNeedle += length;
+        return true;
+    }
+    // Send what's buffered and the new data together, without copying it.
+    return sendAll(data, length);
+}
+
+bool
+SocketSink::flush()
+{
+    return sendAll(nullptr, 0);
+}
+
+bool
+SocketSink::sendAll(const char* data, size_t length)
+{
+    iovec iov[2] = {
+            {d_buffer.get(), static_cast<size_t>(d_bufferNeedle - d_buffer.get())},
+            {const_cast<char*>(data), length}};
+    d_bufferNeedle = d_buffer.get();
+
+    msghdr message{};
+    message.msg_iov = iov;
+    message.msg_iovlen = 2;
+    size_t sent = 0;
+    while (true) {
+        // Skip over whatever has been sent already.
+        for (; message.msg_iovlen; ++message.msg_iov, --message.msg_iovlen) {
+            if (sent < message.msg_iov->iov_len) {
+                message.msg_iov->iov_base = static_cast<char*>(message.msg_iov->iov_base) + sent;
+                message.msg_iov->iov_len -= sent;
+                break;
+            }
+            sent -= message.msg_iov->iov_len;
+        }
+        if (!message.msg_iovlen) {
+            return true;
+        }
+
+        ssize_t ret = ::sendmsg(d_socket_fd, &message, 0);
+        if (ret < 0 && errno != EINTR) {
+            return false;
+        }
+        sent = ret < 0 ? 0 : ret;
+    }
+}
+
+bool
+SocketSink::seek(__attribute__((unused)) off_t offset, __attribute__((unused)) int whence)
+{
+    return false;
+}
+
+bool
+SocketSink::isLive() const
+{
+    return true;
+}
+
+std::unique_ptr<Sink>
+SocketSink::cloneInChildProcess()
+{
+    // We can't clone ourselves. We can't start a new TCP stream and block
+    // waiting for a client, and we can't create a new sink that shares the
+    // same socket because the client would see writes from all processes
+    // interleaved. A collector accepts any number of connections, though.
+    if (!d_connect_to_collector) {
+        return {};
+    }
+    try {
+        return std::make_unique<SocketSink>(d_host, d_port, d_bufferSize, true);
+    } catch (const IoError& e) {
+        LOG(ERROR) << "Failed to connect to the collector from the child process: " << e.what();
+        return {};
+    }
+}
+
+SocketSink::~SocketSink()
+{
+    if (d_socket_open) {
+        flush();
+        ::close(d_socket_fd);
+        d_socket_open = false;
+    }
+}
+
+void
+SocketSink::open()
+{
+    int sockfd;
+    struct sockaddr_storage their_addr;
+    socklen_t sin_size;
+    int yes = 1;
+
+    sockaddr_in si;
+    si.sin_family = AF_INET;
+    si.sin_addr.s_addr = ::inet_addr(d_host.c_str());
+    si.sin_port = htons(d_port);
+
+    if ((sockfd = socket(PF_INET, SOCK_STREAM, 0)) == -1) {
+        LOG(ERROR) << "Encountered error in 'socket' call: " << strerror(errno);
+        throw IoError{"Failed to open socket"};
+    }
+
+    if (setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(int)) == -1) {
+        ::close(sockfd);
+        LOG(ERROR) << "Encountered error in 'setsockopt' call: " << strerror(errno);
+        throw IoError{"Failed to set socket options"};
+    }
+
+    if (bind(sockfd, (sockaddr*)&si, sizeof si) == -1) {
+        ::close(sockfd);
+        LOG(WARNING) << "Encountered error in 'bind' call: " << strerror(errno);
+        throw IoError{"Failed to bind to host and port"};
+    }
+
+    if (listen(sockfd, 1) == -1) {
+        ::close(sockfd);
+        throw IoError{"Encountered error in listen call"};
+    }
+
+    LOG(DEBUG) << "Waiting for connections";
+    sin_size = sizeof their_addr;
+
+    bool async_err = false;
+    do {
+        Py_BEGIN_ALLOW_THREADS;
+        d_socket_fd = accept(sockfd, (struct sockaddr*)&their_addr, &sin_size);
+        Py_END_ALLOW_THREADS;
+    } while (d_socket_fd != 0 && errno == EINTR && !(async_err = PyErr_CheckSignals()));
+    ::close(sockfd);
+
+    if (async_err) {
+        return;
+    }
+
+    if (d_socket_fd == -1) {
+        LOG(ERROR) << "Encountered error in 'accept' call: " << strerror(errno);
+        throw IoError{strerror(errno)};
+    }
+
+    d_socket_open = true;
+}
+
+void
+SocketSink::connect()
+{
+    sockaddr_in si{};
+    si.sin_family = AF_INET;
+    si.sin_addr.s_addr = ::inet_addr(d_host.c_str());
+    si.sin_port = htons(d_port);
+
+    if ((d_socket_fd = socket(PF_INET, SOCK_STREAM, 0)) == -1) {
+        LOG(ERROR) << "Encountered error in 'socket' call: " << strerror(errno);
+        throw IoError{"Failed to open socket"};
+    }
+
+    // If a signal interrupts the call, the connection carries on being set
+    // up in the background, and calling it again tells when it's done.
+    int ret;
+    do {
+        ret = ::connect(d_socket_fd, (sockaddr*)&si, sizeof si);
+    } while (ret == -1 && (errno == EINTR || errno == EALREADY));
+
+    if (ret == -1 && errno != EISCONN) {
+        ::close(d_socket_fd);
+        d_socket_fd = -1;
+        LOG(ERROR) << "Encountered error in 'connect' call: " << strerror(errno);
+        throw IoError{"Failed to connect to the collector"};
+    }
+
+    d_socket_open = true;
+}
+
+SharedMemorySink::SharedMemorySink(const std::string& name, size_t capacity)
+: d_path(sharedMemoryPath(name))
+, d_mappingSize(sizeof(SharedMemoryRing) + capacity)
+{
+    d_fd = ::shm_open(d_path.c_str(), O_CREAT | O_EXCL | O_RDWR | O_CLOEXEC, 0600);
+    if (d_fd < 0) {
+        throw IoError{"Could not create shared memory segment " + d_path + ": " + strerror(errno)};
+    }
+    d_reader_lock_fd =
+            ::shm_open(readerLockPath(d_path).c_str(), O_CREAT | O_EXCL | O_RDWR | O_CLOEXEC, 0600);
+    if (d_reader_lock_fd < 0) {
+        std::string error = strerror(errno);
+        ::close(d_fd);
+        ::shm_unlink(d_path.c_str());
+        throw IoError{"Could not create shared memory segment " + readerLockPath(d_path) + ": " + error};
+    }
+    if (::flock(d_fd, LOCK_EX) < 0 || ::ftruncate(d_fd, d_mappingSize) < 0) {
+        std::string error = strerror(errno);
+        closeSegments();
+        throw IoError{"Could not set up shared memory segment " + d_path + ": " + error};
+    }
+    void* mapping = ::mmap(nullptr, d_mappingSize, PROT_READ | PROT_WRITE, MAP_SHARED, d_fd, 0);
+    if (mapping == MAP_FAILED) {
+        std::string error = strerror(errno);
+        closeSegments();
+        throw IoError{"Could not map shared memory segment " + d_path + ": " + error};
+    }
+
+    // The new segment is zero filled, which is how every field starts.
+    d_ring = static_cast<SharedMemoryRing*>(mapping);
+    d_ring->capacity = capacity;
+    d_ring->magic.store(SharedMemoryRing::MAGIC, std::memory_order_release);
+}
+
+bool
+SharedMemorySink::writeAll(const char* data, size_t length)
+{
+    const size_t capacity = d_ring->capacity;
+    while (length) {
+        if (d_ring->reader_closed.load(std::memory_order_acquire)) {
+            errno = EPIPE;
+            return false;
+        }
+
+        uint64_t tail = d_ring->tail.load(std::memory_order_relaxed);
+        size_t free_space = capacity - (tail - d_ring->head.load(std::memory_order_seq_cst));
+        if (free_space == 0) {
+            // A reader that was killed never says it's closed, so check its lock
+            // too. That costs a system call, so only do it when we'd wait for it.
+            if (readerIsGone(*d_ring, d_reader_lock_fd)) {
+                errno = EPIPE;
+                return false;
+            }
+            uint32_t generation = d_ring->space_generation.load(std::memory_order_seq_cst);
+            d_ring->writer_waiting.store(1, std::memory_order_seq_cst);
+            if (tail - d_ring->head.load(std::memory_order_seq_cst) == capacity) {
+                futexWait(d_ring->space_generation, generation);
+            }
+            d_ring->writer_waiting.store(0, std::memory_order_relaxed);
+            continue;
+        }
+
+        size_t to_copy = std::min(length, free_space);
+        size_t start = tail % capacity;
+        size_t first_part = std::min(to_copy, capacity - start);
+        ::memcpy(d_ring->data() + start, data, first_part);
+        ::memcpy(d_ring->data(), data + first_part, to_copy - first_part);
+        d_ring->tail.store(tail + to_copy, std::memory_order_seq_cst);
+        if (d_ring->reader_waiting.load(std::memory_order_seq_cst)) {
+            futexWake(d_ring->data_generation);
+        }
+        data += to_copy;
+        length -= to_copy;
+    }
+    return true;
+}
+
+bool
+SharedMemorySink::flush()
+{
+    // Everything is visible to the reader as soon as it's written.
+    return true;
+}
+
+bool
+SharedMemorySink::seek(__attribute__((unused)) off_t offset, __attribute__((unused)) int whence)
+{
+    return false;
+}
+
+std::unique_ptr<Sink>
+SharedMemorySink::cloneInChildProcess()
+{
+    // Just like with a socket, the reader would see the writes of every
+    // process interleaved.
+    return {};
+}
+
+bool
+SharedMemorySink::isLive() const
+{
+    return true;
+}
+
+SharedMemorySink::~SharedMemorySink()
+{
+    // The reader keeps its own mapping, so it can still read what's left.
+    d_ring->writer_closed.store(1, std::memory_order_seq_cst);
+    futexWake(d_ring->data_generation);
+    ::munmap(d_ring, d_mappingSize);
+    closeSegments();
+}
+
+void
+SharedMemorySink::closeSegments()
+{
+    ::close(d_fd);
+    ::close(d_reader_lock_fd);
+    ::shm_unlink(d_path.c_str());
+    ::shm_unlink(readerLockPath(d_path).c_str());
+}
+
+FlightRecorderSink::FlightRecorderSink(const std::string& file_name, bool exist_ok, size_t capacity)
+: d_fileName(file_name)
+, d_fileNameStem(removeSuffix(file_name, "." + std::to_string(::getpid())))
+, d_capacity(std::max<size_t>(capacity, 1))
+, d_ring(new char[d_capacity])
+{
+    // Nothing is written to the file until we're flushed, but fail now
+    // rather than then if it can't be created.
+    ::close(openOutputFile(file_name, exist_ok));
+}
+
+FlightRecorderSink::~FlightRecorderSink()
+{
+}
+
+bool
+FlightRecorderSink::writeAll(const char* data, size_t length)
+{
+    if (d_rewritingPreamble) {
+        size_t toCopy = std::min(length, d_preamble.size() - d_preambleNeedle);
+        ::memcpy(d_preamble.data() + d_preambleNeedle, data, toCopy);
+        d_preambleNeedle += toCopy;
+        d_rewritingPreamble = d_preambleNeedle < d_preamble.size();
+        data += toCopy;
+        length -= toCopy;
+    }
+    if (!d_streamStarted) {
+        d_preamble.insert(d_preamble.end(), data, data + length);
+    } else {
+        writeToRing(data, length);
+    }
+    return true;
+}
+
+void
+FlightRecorderSink::writeToRing(const char* data, size_t length)
+{
+    if (length > d_capacity) {
+        // Only the end of it would survive anyway.
+        d_tail += length - d_capacity;
+        data += length - d_capacity;
+        length = d_capacity;
+    }
+    size_t start = d_tail % d_capacity;
+    size_t first_part = std::min(length, d_capacity - start);
+    ::memcpy(d_ring.get() + start, data, first_part);
+    ::memcpy(d_ring.get(), data + first_part, length - first_part);
+    d_tail += length;
+
+    if (d_tail - d_head > d_capacity) {
+        d_head = d_tail - d_capacity;
+        while (!d_restartPoints.empty() && d_restartPoints.front().position < d_head) {
+            d_restartPoints.pop_front();
+        }
+    }
+}
+
+bool
+FlightRecorderSink::flush()
+{
+    // Write everything to another file first, so that the output file always
+    // holds a complete capture, even if we die halfway through.
+    std::string temporary_file_name = d_fileName + ".tmp";
+    int fd;
+    do {
+        fd = ::open(temporary_file_name.c_str(), O_CREAT | O_WRONLY | O_TRUNC | O_CLOEXEC, 0644);
+    } while (fd < 0 && errno == EINTR);
+    if (fd < 0) {
+        return false;
+    }
+
+    bool ok = writeAllAt(fd, d_preamble.data(), d_preamble.size(), 0);
+    off_t offset = d_preamble.size();
+    if (ok && !d_restartPoints.empty()) {
+        const RestartPoint& oldest = d_restartPoints.front();
+        ok = writeAllAt(fd, d_state.data(), oldest.stateSize, offset);
+        offset += oldest.stateSize;
+
+        size_t length = d_tail - oldest.position;
+        size_t start = oldest.position % d_capacity;
+        size_t first_part = std::min(length, d_capacity - start);
+        ok = ok && writeAllAt(fd, d_ring.get() + start, first_part, offset)
+             && writeAllAt(fd, d_ring.get(), length - first_part, offset + first_part);
+    }
+    ok = ::close(fd) == 0 && ok;
+    if (!ok || ::rename(temporary_file_name.c_str(), d_fileName.c_str()) != 0) {
+        ::unlink(temporary_file_name.c_str());
+        return false;
+    }
+    return true;
+}
+
+bool
+FlightRecorderSink::seek(off_t offset, int whence)
+{
+    // The only thing that can be rewritten is the preamble.
+    if (offset != 0 || whence != SEEK_SET) {
+        errno = EINVAL;
+        return false;
+    }
+    d_rewritingPreamble = !d_preamble.empty();
+    d_preambleNeedle = 0;
+    return true;
+}
+
+std::unique_ptr<Sink>
+FlightRecorderSink::cloneInChildProcess()
+{
+    std::string file_name = d_fileNameStem + "." + std::to_string(::getpid());
+    return std::make_unique<FlightRecorderSink>(file_name, true, d_capacity);
+}
+
+size_t
+FlightRecorderSink::restartPointInterval() const
+{
+    // Whatever is older than the oldest restart point in the ring is lost,
+    // so have a few of them in it at all times.
+    return std::max<size_t>(d_capacity / 4, 1);
+}
+
+bool
+FlightRecorderSink::markRestartPoint(const char* state, size_t length)
+{
+    d_streamStarted = true;
+    d_state.insert(d_state.end(), state, state + length);
+    d_restartPoints.push_back({d_tail, d_state.size()});
+    return true;
+}
+
+NullSink::~NullSink()
+{
+}
+
+bool
+NullSink::writeAll(const char*, size_t)
+{
+    return true;
+}
+
+bool
+NullSink::flush()
+{
+    return true;
+}
+
+bool
+NullSink::seek(off_t, int)
+{
+    return true;
+}
+
+std::unique_ptr<Sink>
+NullSink::cloneInChildProcess()
+{
+    return std::make_unique<NullSink>();
+}
+
+AsyncSink::AsyncSink(std::unique_ptr<Sink> sink)
+: d_sink(std::move(sink))
+{
+    d_buffer.reserve(BUFFER_SIZE);
+    d_thread = std::thread(&AsyncSink::writeBuffers, this);
+}
+
+bool
+AsyncSink::writeAllSlow(const char* data, size_t length)
+{
+    if (d_failed) {
+        return false;
+    }
+    d_position += length;
+    while (length) {
+        size_t toCopy = std::min(length, BUFFER_SIZE - d_buffer.size());
+        d_buffer.insert(d_buffer.end(), data, data + toCopy);
+        data += toCopy;
+        length -= toCopy;
+        if (d_buffer.size() == BUFFER_SIZE && !submitBuffer()) {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool
+AsyncSink::flush()
+{
+    return waitUntilIdle() && d_sink->flush();
+}
+
+bool
+AsyncSink::seek(off_t offset, int whence)
+{
+    // The background thread doesn't touch the wrapped sink while it's idle.
+    if (!waitUntilIdle() || !d_sink->seek(offset, whence)) {
+        return false;
+    }
+    if (whence == SEEK_SET) {
+        d_position = offset;
+    } else if (whence == SEEK_CUR) {
+        d_position += offset;
+    }
+    return true;
+}
+
+std::unique_ptr<Sink>
+AsyncSink::cloneInChildProcess()
+{
+    return d_sink->cloneInChildProcess();
+}
+
+size_t
+AsyncSink::restartPointInterval() const
+{
+    return d_sink->restartPointInterval();
+}
+
+bool
+AsyncSink::markRestartPoint(const char* state, size_t length)
+{
+    return waitUntilIdle() && d_sink->markRestartPoint(state, length);
+}
+
+bool
+AsyncSink::isLive() const
+{
+    return d_sink->isLive();
+}
+
+bool
+AsyncSink::handOff()
+{
+    // If the background thread is busy, let the buffer fill up some more
+    // rather than queueing many small ones behind it.
+    if (d_nPendingBuffers.load(std::memory_order_relaxed) > 0) {
+        return !d_failed;
+    }
+    return submitBuffer();
+}
+
+bool
+AsyncSink::isBehind() const
+{
+    return d_nPendingBuffers.load(std::memory_order_relaxed) >= MAX_PENDING_BUFFERS;
+}
+
+uint64_t
+AsyncSink::position() const
+{
+    return d_position;
+}
+
+uint64_t
+AsyncSink::blockedNanoseconds() const
+{
+    return d_blockedNanoseconds.load(std::memory_order_relaxed);
+}
+
+bool
+AsyncSink::submitBuffer()
+{
+    if (d_buffer.empty()) {
+        return !d_failed;
+    }
+    std::unique_lock<std::mutex> lock(d_mutex);
+    waitCounting(d_cv, lock, d_blockedNanoseconds, [this] {
+        return d_pendingBuffers.size() < MAX_PENDING_BUFFERS || d_failed;
+    });
+    if (d_failed) {
+        return false;
+    }
+    d_pendingBuffers.push_back(std::move(d_buffer));
+    d_nPendingBuffers = d_pendingBuffers.size();
+    if (d_spareBuffers.empty()) {
+        d_buffer = std::vector<char>();
+        d_buffer.reserve(BUFFER_SIZE);
+    } else {
+        d_buffer = std::move(d_spareBuffers.back());
+        d_spareBuffers.pop_back();
+    }
+    d_cv.notify_all();
+    return true;
+}
+
+bool
+AsyncSink::waitUntilIdle()
+{
+    if (!submitBuffer()) {
+        return false;
+    }
+    std::unique_lock<std::mutex> lock(d_mutex);
+    waitCounting(d_cv, lock, d_blockedNanoseconds, [this] {
+        return (d_pendingBuffers.empty() && !d_writing) || d_failed;
+    });
+    return !d_failed;
+}
+
+void
+AsyncSink::writeBuffers()
+{
+    // Nothing this thread allocates must be tracked.
+    hooks::RecursionGuard::isActive = true;
+
+    std::unique_lock<std::mutex> lock(d_mutex);
+    while (true) {
+        d_cv.wait(lock, [this] { return !d_pendingBuffers.empty() || d_stopping; });
+        if (d_pendingBuffers.empty()) {
+            break;
+        }
+        std::vector<char> buffer = std::move(d_pendingBuffers.front());
+        d_pendingBuffers.pop_front();
+        d_writing = true;
+        lock.unlock();
+
+        if (!d_failed && !d_sink->writeAll(buffer.data(), buffer.size())) {
+            LOG(ERROR) << "Failed to write the output: " << strerror(errno);
+            d_failed = true;
+        }
+        buffer.clear();
+
+        lock.lock();
+        d_writing = false;
+        if (d_failed) {
+            d_pendingBuffers.clear();
+        }
+        d_nPendingBuffers = d_pendingBuffers.size();
+        if (d_spareBuffers.size() < MAX_PENDING_BUFFERS) {
+            d_spareBuffers.push_back(std::move(buffer));
+        }
+        d_cv.notify_all();
+    }
+}
+
+AsyncSink::~AsyncSink()
+{
+    submitBuffer();
+    {
+        std::lock_guard<std::mutex> lock(d_mutex);
+        d_stopping = true;
+    }
+    d_cv.notify_all();
+    d_thread.join();
 }
 
 }  // namespace memray::io
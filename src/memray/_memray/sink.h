@@ -1,11 +1,18 @@
 #pragma once
 
+#include <atomic>
 #include <cerrno>
+#include <condition_variable>
+#include <deque>
 #include <memory>
+#include <mutex>
 #include <string>
+#include <thread>
 #include <unistd.h>
+#include <vector>
 
 #include "records.h"
+#include "shared_memory_ring.h"
 
 namespace memray::io {
 
@@ -14,8 +21,26 @@ class Sink
   public:
     virtual ~Sink(){};
     virtual bool writeAll(const char* data, size_t length) = 0;
+    // Make sure that everything written so far can be read back, even if
+    // nothing else is ever written.
+    virtual bool flush() = 0;
     virtual bool seek(off_t offset, int whence) = 0;
     virtual std::unique_ptr<Sink> cloneInChildProcess() = 0;
+
+    // Sinks that only keep what was written most recently must be told every
+    // so often where a reader could start reading once everything before is
+    // gone. They return how many bytes can go between two of these restart
+    // points, and the others return 0.
+    virtual size_t restartPointInterval() const;
+    // A reader starting at a restart point first needs every record written
+    // before it that describes the capture instead of what happens in it
+    // (frames, threads and memory maps). `state` holds the ones written
+    // since the previous restart point.
+    virtual bool markRestartPoint(const char* state, size_t length);
+
+    // Whether what's written is read while it's still being written, by a
+    // reader that can fall behind and make writing wait for it.
+    virtual bool isLive() const;
 };
 
 class FileSink : public memray::io::Sink
@@ -29,6 +54,7 @@ class FileSink : public memray::io::Sink
     void operator=(const FileSink&&) = delete;
 
     bool writeAll(const char* data, size_t length) override;
+    bool flush() override;
     bool seek(off_t offset, int whence) override;
     std::unique_ptr<Sink> cloneInChildProcess() override;
 
@@ -47,10 +73,134 @@ class FileSink : public memray::io::Sink
     char* d_bufferNeedle{nullptr};
 };
 
+// Writes to a file from a few buffers that are allocated up front, backed by
+// huge pages when there are some, without ever mapping the file itself.
+// Full buffers are written with io_uring, while the next one fills up, and
+// the file is preallocated in large steps ahead of them. Kernels without
+// io_uring (or where it's disabled) get the same buffers written with
+// pwrite() instead.
+//
+// Seeking waits for everything written so far to reach the file, so it's
+// only meant for rewriting the header when tracking stops.
+class UringFileSink : public memray::io::Sink
+{
+  public:
+    UringFileSink(const std::string& file_name, bool exist_ok);
+    ~UringFileSink() override;
+    UringFileSink(UringFileSink&) = delete;
+    UringFileSink(UringFileSink&&) = delete;
+    void operator=(const UringFileSink&) = delete;
+    void operator=(const UringFileSink&&) = delete;
+
+    bool writeAll(const char* data, size_t length) override;
+    bool flush() override;
+    bool seek(off_t offset, int whence) override;
+    std::unique_ptr<Sink> cloneInChildProcess() override;
+
+  private:
+    struct Ring;
+    struct Request
+    {
+        size_t buffer;
+        const char* data;
+        size_t length;
+        off_t offset;
+    };
+
+    bool submitBuffer();
+    bool nextBuffer();
+    bool submitWrite(const char* data, size_t length, off_t offset);
+    bool reapCompletions(bool wait);
+    bool completeRequest(Request& request, int result);
+    bool waitForBuffer(size_t buffer);
+    void preallocate(off_t end);
+
+    std::string d_fileNameStem;
+    int d_fd{-1};
+    static constexpr size_t BUFFER_SIZE{2 * 1024 * 1024};  // 2 MiB, one huge page
+    static constexpr size_t NUM_BUFFERS{4};
+    static constexpr off_t PREALLOCATION_STEP{64 * 1024 * 1024};  // 64 MiB
+    char* d_buffers{nullptr};
+    size_t d_currentBuffer{0};
+    // How much of the current buffer is used, and how much of that has been
+    // handed to the kernel already.
+    size_t d_bufferUsed{0};
+    size_t d_bufferSubmitted{0};
+    // Where the start of the current buffer goes in the file.
+    off_t d_bufferOffset{0};
+    off_t d_fileSize{0};
+    off_t d_preallocatedSize{0};
+    bool d_canPreallocate{true};
+    size_t d_pendingWrites[NUM_BUFFERS]{};
+    std::unique_ptr<Ring> d_ring;
+    std::vector<Request> d_requests;
+    std::vector<size_t> d_freeRequests;
+    bool d_failed{false};
+};
+
+// Writes to a file as a series of independent zstd frames, which are
+// compressed by a background thread. Everything up to the last complete
+// frame can be read back even if the process dies before the sink is
+// destroyed.
+//
+// The first frame holds whatever is written before the first call to
+// flush(), stored without compression, so that it can be rewritten in place
+// with data of the same size after a seek to the start of the file.
+class CompressedFileSink : public memray::io::Sink
+{
+  public:
+    CompressedFileSink(const std::string& file_name, bool exist_ok);
+    ~CompressedFileSink() override;
+    CompressedFileSink(CompressedFileSink&) = delete;
+    CompressedFileSink(CompressedFileSink&&) = delete;
+    void operator=(const CompressedFileSink&) = delete;
+    void operator=(const CompressedFileSink&&) = delete;
+
+    bool writeAll(const char* data, size_t length) override;
+    bool flush() override;
+    bool seek(off_t offset, int whence) override;
+    std::unique_ptr<Sink> cloneInChildProcess() override;
+
+  private:
+    bool submitFrame();
+    bool waitForPendingFrame();
+    bool writeStoredFrame();
+    void compressFrames();
+
+    std::string d_fileNameStem;
+    int d_fd{-1};
+    const size_t FRAME_SIZE{1024 * 1024};  // 1 MiB
+    // Favor speed: the point is to write less, not to make the file smallest.
+    const int COMPRESSION_LEVEL{1};
+    std::vector<char> d_frame;
+    // Size of what's stored in the first frame, or 0 until it's written.
+    size_t d_storedFrameSize{0};
+    bool d_rewritingStoredFrame{false};
+
+    // Shared with the background thread.
+    std::mutex d_mutex;
+    std::condition_variable d_cv;
+    std::vector<char> d_pendingFrame;
+    bool d_framePending{false};
+    bool d_stopping{false};
+    off_t d_fileOffset{0};
+    std::atomic<bool> d_failed{false};
+    std::thread d_thread;
+};
+
 class SocketSink : public Sink
 {
   public:
-    explicit SocketSink(std::string host, uint16_t port);
+    static constexpr size_t DEFAULT_BUFFER_SIZE = 256 * 1024;  // 256 KiB
+
+    // By default the sink waits for a reader to connect to it. A sink that
+    // connects to a collector instead can be cloned in child processes, as
+    // each of them gets a connection of its own.
+    explicit SocketSink(
+            std::string host,
+            uint16_t port,
+            size_t buffer_size = DEFAULT_BUFFER_SIZE,
+            bool connect_to_collector = false);
     ~SocketSink() override;
 
     SocketSink(SocketSink&) = delete;
@@ -59,31 +209,196 @@ class SocketSink : public Sink
     void operator=(const SocketSink&&) = delete;
 
     bool writeAll(const char* data, size_t length) override;
+    bool flush() override;
     bool seek(off_t offset, int whence) override;
     std::unique_ptr<Sink> cloneInChildProcess() override;
+    bool isLive() const override;
 
   private:
     size_t freeSpaceInBuffer();
+    bool sendAll(const char* data, size_t length);
     void open();
-    bool flush();
+    void connect();
 
     const std::string d_host;
     uint16_t d_port;
+    const bool d_connect_to_collector;
     int d_socket_fd{-1};
     bool d_socket_open{false};
 
-    const size_t BUFFER_SIZE{PIPE_BUF};
+    const size_t d_bufferSize;
     std::unique_ptr<char[]> d_buffer{nullptr};
     char* d_bufferNeedle{nullptr};
 };
 
+// Writes to a ring buffer in a POSIX shared memory segment, for a
+// SharedMemorySource in another process on the same host to read. Writing
+// blocks while the ring is full, and fails once the reader has gone away.
+class SharedMemorySink : public Sink
+{
+  public:
+    static constexpr size_t DEFAULT_CAPACITY = 8 * 1024 * 1024;  // 8 MiB
+
+    explicit SharedMemorySink(const std::string& name, size_t capacity = DEFAULT_CAPACITY);
+    ~SharedMemorySink() override;
+
+    SharedMemorySink(SharedMemorySink&) = delete;
+    SharedMemorySink(SharedMemorySink&&) = delete;
+    void operator=(const SharedMemorySink&) = delete;
+    void operator=(const SharedMemorySink&&) = delete;
+
+    bool writeAll(const char* data, size_t length) override;
+    bool flush() override;
+    bool seek(off_t offset, int whence) override;
+    std::unique_ptr<Sink> cloneInChildProcess() override;
+    bool isLive() const override;
+
+  private:
+    void closeSegments();
+
+    const std::string d_path;
+    int d_fd{-1};
+    int d_reader_lock_fd{-1};
+    size_t d_mappingSize{0};
+    SharedMemoryRing* d_ring{nullptr};
+};
+
+// Keeps the most recent `capacity` bytes written to it in memory, and only
+// writes them to a file when it's flushed, replacing what was there.
+//
+// What's written before the first restart point (the header) is always
+// kept. It can be rewritten in place after a seek to the start of the
+// stream, and writing then carries on where it was. The file gets that,
+// what a reader needs before the oldest restart point still in memory, and
+// everything from there on.
+class FlightRecorderSink : public memray::io::Sink
+{
+  public:
+    static constexpr size_t DEFAULT_CAPACITY = 64 * 1024 * 1024;  // 64 MiB
+
+    FlightRecorderSink(const std::string& file_name, bool exist_ok, size_t capacity = DEFAULT_CAPACITY);
+    ~FlightRecorderSink() override;
+    FlightRecorderSink(FlightRecorderSink&) = delete;
+    FlightRecorderSink(FlightRecorderSink&&) = delete;
+    void operator=(const FlightRecorderSink&) = delete;
+    void operator=(const FlightRecorderSink&&) = delete;
+
+    bool writeAll(const char* data, size_t length) override;
+    bool flush() override;
+    bool seek(off_t offset, int whence) override;
+    std::unique_ptr<Sink> cloneInChildProcess() override;
+    size_t restartPointInterval() const override;
+    bool markRestartPoint(const char* state, size_t length) override;
+
+  private:
+    struct RestartPoint
+    {
+        uint64_t position;
+        size_t stateSize;
+    };
+
+    void writeToRing(const char* data, size_t length);
+
+    const std::string d_fileName;
+    const std::string d_fileNameStem;
+    const size_t d_capacity;
+    std::vector<char> d_preamble;
+    size_t d_preambleNeedle{0};
+    bool d_rewritingPreamble{false};
+    bool d_streamStarted{false};
+    // Positions in the stream that follows the preamble: the ring holds the
+    // bytes from d_head to d_tail.
+    std::unique_ptr<char[]> d_ring;
+    uint64_t d_head{0};
+    uint64_t d_tail{0};
+    std::vector<char> d_state;
+    std::deque<RestartPoint> d_restartPoints;
+};
+
 class NullSink : public Sink
 {
   public:
     ~NullSink() override;
     bool writeAll(const char* data, size_t length) override;
+    bool flush() override;
+    bool seek(off_t offset, int whence) override;
+    std::unique_ptr<Sink> cloneInChildProcess() override;
+};
+
+// Collects what's written to it in memory and hands it over in large buffers
+// to a background thread, which is the only one that writes to the wrapped
+// sink. Writing only blocks when that thread already has MAX_PENDING_BUFFERS
+// buffers to go through.
+// Final, so that the calls that the RecordWriter makes through the concrete
+// type aren't virtual, and writeAll() can be inlined into them.
+class AsyncSink final : public memray::io::Sink
+{
+  public:
+    explicit AsyncSink(std::unique_ptr<Sink> sink);
+    ~AsyncSink() override;
+    AsyncSink(AsyncSink&) = delete;
+    AsyncSink(AsyncSink&&) = delete;
+    void operator=(const AsyncSink&) = delete;
+    void operator=(const AsyncSink&&) = delete;
+
+    bool writeAll(const char* data, size_t length) override;
+    bool flush() override;
     bool seek(off_t offset, int whence) override;
+    // This returns a clone of the wrapped sink: the background thread isn't
+    // running in the child, and whoever owns the clone decides how to wrap it.
     std::unique_ptr<Sink> cloneInChildProcess() override;
+    size_t restartPointInterval() const override;
+    // Everything written before the restart point reaches the wrapped sink
+    // before it's told about it.
+    bool markRestartPoint(const char* state, size_t length) override;
+    bool isLive() const override;
+
+    // Give whatever has been written so far to the background thread, unless
+    // it's still busy with what it got before. This never waits.
+    bool handOff();
+    // Whether writing a full buffer would have to wait for the background thread.
+    bool isBehind() const;
+    // Where the next byte written will end up in the wrapped sink.
+    uint64_t position() const;
+    // The time that writing has spent waiting for the background thread to
+    // get through what it had, since the sink was made.
+    uint64_t blockedNanoseconds() const;
+
+  private:
+    bool writeAllSlow(const char* data, size_t length);
+    bool submitBuffer();
+    bool waitUntilIdle();
+    void writeBuffers();
+
+    std::unique_ptr<Sink> d_sink;
+    const size_t BUFFER_SIZE{1024 * 1024};  // 1 MiB
+    const size_t MAX_PENDING_BUFFERS{4};
+    std::vector<char> d_buffer;
+    uint64_t d_position{0};
+
+    // Shared with the background thread.
+    std::mutex d_mutex;
+    std::condition_variable d_cv;
+    std::deque<std::vector<char>> d_pendingBuffers;
+    std::vector<std::vector<char>> d_spareBuffers;
+    std::atomic<size_t> d_nPendingBuffers{0};
+    std::atomic<uint64_t> d_blockedNanoseconds{0};
+    bool d_writing{false};
+    bool d_stopping{false};
+    std::atomic<bool> d_failed{false};
+    std::thread d_thread;
 };
 
+inline bool
+AsyncSink::writeAll(const char* data, size_t length)
+{
+    // Almost every write fits in the current buffer without filling it.
+    if (length < BUFFER_SIZE - d_buffer.size() && !d_failed.load(std::memory_order_relaxed)) {
+        d_position += length;
+        d_buffer.insert(d_buffer.end(), data, data + length);
+        return true;
+    }
+    return writeAllSlow(data, length);
+}
+
 }  // namespace memray::io
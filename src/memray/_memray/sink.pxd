@@ -10,8 +10,21 @@ cdef extern from "sink.h" namespace "memray::io":
     cdef cppclass FileSink(Sink):
         FileSink(const string& file_name, bool exist_ok) except +IOError
 
+    cdef cppclass UringFileSink(Sink):
+        UringFileSink(const string& file_name, bool exist_ok) except +IOError
+
     cdef cppclass SocketSink(Sink):
-        SocketSink(string host, unsigned int port) except +IOError
+        SocketSink(string host, unsigned int port, size_t buffer_size) except +IOError
+        SocketSink(string host, unsigned int port, size_t buffer_size, bool connect_to_collector) except +IOError
+
+    cdef cppclass SharedMemorySink(Sink):
+        SharedMemorySink(string name, size_t capacity) except +IOError
+
+    cdef cppclass FlightRecorderSink(Sink):
+        FlightRecorderSink(const string& file_name, bool exist_ok, size_t capacity) except +IOError
+
+    cdef cppclass CompressedFileSink(Sink):
+        CompressedFileSink(const string& file_name, bool exist_ok) except +IOError
 
     cdef cppclass NullSink(Sink):
         NullSink() except +IOError
@@ -1,9 +1,27 @@
+#include <algorithm>
+#include <cerrno>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <limits>
 #include <numeric>
+#include <queue>
+#include <stdexcept>
+#include <sys/stat.h>
+#include <thread>
+#include <tuple>
+#include <unistd.h>
 
 #include "snapshot.h"
 
+#include "exceptions.h"
+#include "logging.h"
+
 namespace memray::api {
 
+using namespace memray::exception;
+
 Interval::Interval(uintptr_t begin, uintptr_t end)
 : begin(begin)
 , end(end){};
@@ -50,19 +68,250 @@ Interval::rightIntersects(const Interval& other) const
     return (begin > other.begin) && (end == other.end);
 }
 
+// Process ranged allocations. As there can be partial deallocations in mmap'd regions,
+// we update the allocation to reflect the actual size at the peak, based on the lengths
+// of the ranges in the interval tree.
+static void
+addRangesToSnapshot(
+        const IntervalTree<Allocation>& interval_tree,
+        bool merge_threads,
+        reduced_snapshot_map_t& stack_to_allocation)
+{
+    for (const auto& [range, allocation] : interval_tree) {
+        const thread_id_t thread_id = merge_threads ? NO_THREAD_INFO : allocation.record.tid;
+        auto alloc_it = stack_to_allocation.find(std::pair(allocation.frame_index, thread_id));
+        if (alloc_it == stack_to_allocation.end()) {
+            Allocation new_alloc = allocation;
+            new_alloc.record.size = range.size();
+            stack_to_allocation.insert(
+                    alloc_it,
+                    std::pair(std::pair(allocation.frame_index, thread_id), new_alloc));
+        } else {
+            alloc_it->second.record.size += range.size();
+            alloc_it->second.n_allocations += allocation.n_allocations;
+        }
+    }
+}
+
+SpillDirectory::SpillDirectory(const std::string& parent)
+{
+    std::string path = parent + "/memray-XXXXXX";
+    if (!::mkdtemp(path.data())) {
+        throw IoError{"Could not create a directory in " + parent + ": " + std::string(strerror(errno))};
+    }
+    d_path = std::move(path);
+}
+
+SpillDirectory::~SpillDirectory()
+{
+    for (size_t index = 0; index < d_n_files; ++index) {
+        const std::string path = d_path + "/" + std::to_string(index);
+        if (::unlink(path.c_str()) != 0 && errno != ENOENT) {
+            LOG(WARNING) << "Could not remove " << path << ": " << strerror(errno);
+        }
+    }
+    if (::rmdir(d_path.c_str()) != 0) {
+        LOG(WARNING) << "Could not remove " << d_path << ": " << strerror(errno);
+    }
+}
+
+std::string
+SpillDirectory::newFile()
+{
+    return d_path + "/" + std::to_string(d_n_files++);
+}
+
+void
+SpillDirectory::append(const std::string& path, const char* data, size_t size)
+{
+    // The files are only opened to append each buffer, so that there aren't
+    // as many of them open as there are partitions when they are written.
+    int fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0600);
+    if (fd < 0) {
+        throw IoError{"Could not open file " + path + ": " + std::string(strerror(errno))};
+    }
+    while (size) {
+        ssize_t written = ::write(fd, data, size);
+        if (written < 0 && errno == EINTR) {
+            continue;
+        }
+        if (written < 0) {
+            int error = errno;
+            ::close(fd);
+            throw IoError{"Could not write to file " + path + ": " + std::string(strerror(error))};
+        }
+        data += written;
+        size -= written;
+    }
+    ::close(fd);
+}
+
+int
+SpillDirectory::open(const std::string& path)
+{
+    int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        throw IoError{"Could not open file " + path + ": " + std::string(strerror(errno))};
+    }
+    return fd;
+}
+
+size_t
+SpillDirectory::read(int fd, const std::string& path, char* data, size_t size)
+{
+    size_t total = 0;
+    while (total < size) {
+        ssize_t n_read = ::read(fd, data + total, size - total);
+        if (n_read < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n_read < 0) {
+            throw IoError{"Could not read file " + path + ": " + std::string(strerror(errno))};
+        }
+        if (n_read == 0) {
+            break;
+        }
+        total += n_read;
+    }
+    return total;
+}
+
+// There can't be more partitions than files that can be merged at once.
+static constexpr size_t MAX_SPILL_PARTITIONS = 4096;
+// The fewest records that each file buffers, however tight the budget is.
+static constexpr size_t MIN_SPILL_BUFFER_SIZE = 64;
+
+SpilledEvents::SpilledEvents(
+        const std::string& directory,
+        size_t n_partitions,
+        size_t memory_budget)
+: d_directory(directory)
+, d_memory_budget(memory_budget)
+{
+    const size_t buffer_size = bufferSize(sizeof(SpilledEvent));
+    d_partitions.reserve(n_partitions);
+    for (size_t index = 0; index < n_partitions; ++index) {
+        d_partitions.emplace_back(d_directory, buffer_size);
+    }
+}
+
+size_t
+SpilledEvents::partitionsFor(
+        size_t memory_budget,
+        size_t max_live_allocations,
+        size_t bytes_per_allocation)
+{
+    // Half of the budget is for the live allocations of the partition that
+    // is replayed, and the rest for the buffers of the files.
+    const size_t replay_budget = std::max<size_t>(memory_budget / 2, 1);
+    const size_t needed = max_live_allocations * bytes_per_allocation;
+    return std::min((needed + replay_budget - 1) / replay_budget, MAX_SPILL_PARTITIONS);
+}
+
+void
+SpilledEvents::add(const SpilledEvent& event)
+{
+    const uint64_t hash = containers::mixHash(event.address >> 4);
+    const size_t index = (static_cast<unsigned __int128>(hash) * d_partitions.size()) >> 64;
+    d_partitions[index].append(event);
+}
+
+size_t
+SpilledEvents::numPartitions() const noexcept
+{
+    return d_partitions.size();
+}
+
+SpillFile<SpilledEvent>&
+SpilledEvents::partition(size_t index)
+{
+    return d_partitions[index];
+}
+
+SpillDirectory&
+SpilledEvents::directory() noexcept
+{
+    return d_directory;
+}
+
+size_t
+SpilledEvents::bufferSize(size_t record_size) const noexcept
+{
+    const size_t n_partitions = std::max<size_t>(d_partitions.capacity(), 1);
+    return std::max(d_memory_budget / 4 / n_partitions / record_size, MIN_SPILL_BUFFER_SIZE);
+}
+
+// What a live simple allocation takes in a hash map, with room for the map
+// to grow.
+template<typename Value>
+static constexpr size_t LIVE_ALLOCATION_BYTES = 4 * (sizeof(uintptr_t) + sizeof(Value) + 1);
+
+uint32_t
+SnapshotAllocationAggregator::locationIndex(const Allocation& allocation)
+{
+    auto [it, inserted] = d_location_indexes.try_emplace(
+            AllocationLocation::of(allocation),
+            static_cast<uint32_t>(d_locations.size()));
+    if (inserted) {
+        d_locations.push_back(allocation);
+    }
+    return it->second;
+}
+
+void
+SnapshotAllocationAggregator::spillTo(
+        const std::string& directory,
+        size_t memory_budget,
+        size_t max_allocations)
+{
+    assert(d_live_allocations.empty() && !d_spilled_events);
+    const size_t n_partitions = SpilledEvents::partitionsFor(
+            memory_budget,
+            max_allocations,
+            LIVE_ALLOCATION_BYTES<LiveAllocation>);
+    if (n_partitions > 1) {
+        d_spilled_events = std::make_unique<SpilledEvents>(directory, n_partitions, memory_budget);
+    }
+}
+
+void
+SnapshotAllocationAggregator::spillEvent(
+        uintptr_t address,
+        uint32_t location_index,
+        size_t size,
+        size_t n_allocations)
+{
+    d_spilled_events->add(
+            SpilledEvent{d_n_spilled_events++, address, size, n_allocations, location_index});
+}
+
 void
 SnapshotAllocationAggregator::addAllocation(const Allocation& allocation)
 {
     switch (hooks::allocatorKind(allocation.record.allocator)) {
         case hooks::AllocatorKind::SIMPLE_ALLOCATOR: {
-            d_ptr_to_allocation[allocation.record.address] = allocation;
+            if (d_spilled_events) {
+                if (allocation.realloc_old_address) {
+                    spillEvent(allocation.realloc_old_address, SpilledEvent::FREED, 0, 0);
+                }
+                spillEvent(
+                        allocation.record.address,
+                        locationIndex(allocation),
+                        allocation.record.size,
+                        allocation.n_allocations);
+                break;
+            }
+            if (allocation.realloc_old_address) {
+                d_live_allocations.erase(allocation.realloc_old_address);
+            }
+            d_live_allocations[allocation.record.address] = LiveAllocation{
+                    locationIndex(allocation),
+                    allocation.record.size,
+                    allocation.n_allocations};
             break;
         }
         case hooks::AllocatorKind::SIMPLE_DEALLOCATOR: {
-            auto it = d_ptr_to_allocation.find(allocation.record.address);
-            if (it != d_ptr_to_allocation.end()) {
-                d_ptr_to_allocation.erase(it);
-            }
+            removeAllocation(allocation.record.address);
             break;
         }
         case hooks::AllocatorKind::RANGED_ALLOCATOR: {
@@ -76,7 +325,6 @@ SnapshotAllocationAggregator::addAllocation(const Allocation& allocation)
             break;
         }
     }
-    d_index++;
 }
 
 reduced_snapshot_map_t
@@ -84,160 +332,1491 @@ SnapshotAllocationAggregator::getSnapshotAllocations(bool merge_threads)
 {
     reduced_snapshot_map_t stack_to_allocation{};
 
-    for (const auto& it : d_ptr_to_allocation) {
-        const Allocation& record = it.second;
-        const thread_id_t thread_id = merge_threads ? NO_THREAD_INFO : record.record.tid;
-        auto alloc_it = stack_to_allocation.find(std::pair(record.frame_index, thread_id));
-        if (alloc_it == stack_to_allocation.end()) {
-            stack_to_allocation.insert(
-                    alloc_it,
-                    std::pair(std::pair(record.frame_index, thread_id), record));
-        } else {
-            alloc_it->second.record.size += record.record.size;
-            alloc_it->second.n_allocations += 1;
+    if (!d_spilled_events) {
+        addLiveAllocations(merge_threads, stack_to_allocation);
+    } else {
+        // Each partition is a heap of its own, so they can be replayed one
+        // at a time, only ever keeping the allocations of one of them.
+        for (size_t index = 0; index < d_spilled_events->numPartitions(); ++index) {
+            auto& partition = d_spilled_events->partition(index);
+            partition.rewind();
+            while (const SpilledEvent* event = partition.next()) {
+                if (event->location_index == SpilledEvent::FREED) {
+                    d_live_allocations.erase(event->address);
+                } else {
+                    d_live_allocations[event->address] =
+                            LiveAllocation{event->location_index, event->size, event->n_allocations};
+                }
+            }
+            addLiveAllocations(merge_threads, stack_to_allocation);
+            d_live_allocations.clear();
         }
+        d_spilled_events.reset();
     }
 
-    // Process ranged allocations. As there can be partial deallocations in mmap'd regions,
-    // we update the allocation to reflect the actual size at the peak, based on the lengths
-    // of the ranges in the interval tree.
-    for (const auto& [range, allocation] : d_interval_tree) {
-        const thread_id_t thread_id = merge_threads ? NO_THREAD_INFO : allocation.record.tid;
-        auto alloc_it = stack_to_allocation.find(std::pair(allocation.frame_index, thread_id));
+    addRangesToSnapshot(d_interval_tree, merge_threads, stack_to_allocation);
+    return stack_to_allocation;
+}
+
+void
+SnapshotAllocationAggregator::addLiveAllocations(
+        bool merge_threads,
+        reduced_snapshot_map_t& stack_to_allocation) const
+{
+    for (const auto& [address, live] : d_live_allocations) {
+        const Allocation& first = d_locations[live.location_index];
+        const thread_id_t thread_id = merge_threads ? NO_THREAD_INFO : first.record.tid;
+        auto key = std::pair(static_cast<FrameTree::index_t>(first.frame_index), thread_id);
+        auto alloc_it = stack_to_allocation.find(key);
         if (alloc_it == stack_to_allocation.end()) {
-            Allocation new_alloc = allocation;
-            new_alloc.record.size = range.size();
-            stack_to_allocation.insert(
-                    alloc_it,
-                    std::pair(std::pair(allocation.frame_index, thread_id), new_alloc));
+            Allocation allocation = first;
+            allocation.record.address = address;
+            allocation.record.size = live.size;
+            allocation.n_allocations = live.n_allocations;
+            allocation.realloc_old_address = 0;
+            stack_to_allocation.emplace(key, allocation);
         } else {
-            alloc_it->second.record.size += range.size();
-            alloc_it->second.n_allocations += 1;
+            alloc_it->second.record.size += live.size;
+            alloc_it->second.n_allocations += live.n_allocations;
         }
     }
-
-    return stack_to_allocation;
 }
 
-/**
- * Produce an aggregated snapshot from a vector of allocations and a index in that vector
- *
- * This function takes a vector containing a sequence of allocation events and an index in that
- * vector indicating the position where the snapshot should be produced and returns a collection
- * of allocations representing the heap structure at that particular point. This collection of
- * allocations is aggregated so allocations with the same stack trace will be reported together
- * as a single allocation with the size being the sum af the sizes of the individual allocations.
- *
- **/
-static reduced_snapshot_map_t
-reduceSnapshotAllocations(const allocations_t& records, size_t snapshot_index, bool merge_threads)
+LeakAgeAggregator::LeakAgeAggregator(millis_t start_time)
+: d_time(start_time)
 {
-    assert(snapshot_index < records.size());
+}
 
-    SnapshotAllocationAggregator aggregator;
+uint32_t
+LeakAgeAggregator::locationIndex(const Allocation& allocation)
+{
+    auto [it, inserted] = d_location_indexes.try_emplace(
+            AllocationLocation::of(allocation),
+            static_cast<uint32_t>(d_locations.size()));
+    if (inserted) {
+        d_locations.push_back(allocation);
+    }
+    return it->second;
+}
 
-    std::for_each(records.cbegin(), records.cbegin() + snapshot_index + 1, [&](auto& record) {
-        aggregator.addAllocation(record);
-    });
+void
+LeakAgeAggregator::addAllocation(
+        const Allocation& allocation,
+        const std::vector<MemoryRecord>& memory_records,
+        const std::vector<size_t>& memory_record_allocations)
+{
+    // The memory records found before this allocation are the ones found
+    // when fewer allocations than this one's position had been read.
+    while (d_n_memory_records < memory_record_allocations.size()
+           && memory_record_allocations[d_n_memory_records] <= d_n_allocations)
+    {
+        d_time = memory_records[d_n_memory_records].ms_since_epoch;
+        ++d_n_memory_records;
+    }
+    ++d_n_allocations;
 
-    return aggregator.getSnapshotAllocations(merge_threads);
+    const auto& record = allocation.record;
+    switch (hooks::allocatorKind(record.allocator)) {
+        case hooks::AllocatorKind::SIMPLE_ALLOCATOR: {
+            if (allocation.realloc_old_address) {
+                d_live_allocations.erase(allocation.realloc_old_address);
+            }
+            d_live_allocations[record.address] = LiveAllocation{
+                    locationIndex(allocation),
+                    record.size,
+                    allocation.n_allocations,
+                    d_time};
+            break;
+        }
+        case hooks::AllocatorKind::SIMPLE_DEALLOCATOR: {
+            d_live_allocations.erase(record.address);
+            break;
+        }
+        case hooks::AllocatorKind::RANGED_ALLOCATOR: {
+            d_ranges.addInterval(
+                    record.address,
+                    record.size,
+                    LiveRange{locationIndex(allocation), allocation.n_allocations, d_time});
+            break;
+        }
+        case hooks::AllocatorKind::RANGED_DEALLOCATOR: {
+            d_ranges.removeInterval(record.address, record.size);
+            break;
+        }
+    }
 }
 
-HighWatermark
-getHighWatermark(const allocations_t& records)
+size_t
+LeakAgeAggregator::bucketIndex(millis_t age)
 {
-    HighWatermark result;
-    size_t current_memory = 0;
-    std::unordered_map<uintptr_t, size_t> ptr_to_allocation{};
-    IntervalTree<Allocation> mmap_intervals;
+    size_t index = 0;
+    for (uint64_t remaining = age > 0 ? age : 0; remaining; remaining >>= 1) {
+        ++index;
+    }
+    return index;
+}
 
-    auto update_peak = [&](allocations_t::const_iterator records_it) {
-        if (current_memory >= result.peak_memory) {
-            result.index = records_it - records.cbegin();
-            result.peak_memory = current_memory;
+std::vector<LeakAgeAggregator::StackAges>
+LeakAgeAggregator::getStackAges(millis_t end_time, bool merge_threads) const
+{
+    std::vector<StackAges> stacks;
+    std::unordered_map<std::pair<FrameTree::index_t, thread_id_t>, size_t, index_thread_pair_hash>
+            positions;
+    auto add = [&](uint32_t location_index, size_t size, size_t n_allocations, millis_t time) {
+        const Allocation& first = d_locations[location_index];
+        const thread_id_t thread_id = merge_threads ? NO_THREAD_INFO : first.record.tid;
+        auto [it, inserted] = positions.try_emplace(
+                std::pair(static_cast<FrameTree::index_t>(first.frame_index), thread_id),
+                stacks.size());
+        if (inserted) {
+            Allocation allocation = first;
+            allocation.record.size = 0;
+            allocation.n_allocations = 0;
+            allocation.realloc_old_address = 0;
+            stacks.push_back(StackAges{allocation, {}});
         }
+        StackAges& stack = stacks[it->second];
+        stack.allocation.record.size += size;
+        stack.allocation.n_allocations += n_allocations;
+        size_t bucket = bucketIndex(end_time - time);
+        if (stack.buckets.size() <= bucket) {
+            stack.buckets.resize(bucket + 1);
+        }
+        stack.buckets[bucket].n_allocations += n_allocations;
+        stack.buckets[bucket].bytes += size;
     };
 
-    for (auto records_it = records.cbegin(); records_it != records.cend(); records_it++) {
-        switch (hooks::allocatorKind(records_it->record.allocator)) {
-            case hooks::AllocatorKind::SIMPLE_ALLOCATOR: {
-                current_memory += records_it->record.size;
-                update_peak(records_it);
-                ptr_to_allocation[records_it->record.address] = records_it - records.begin();
-                break;
-            }
-            case hooks::AllocatorKind::SIMPLE_DEALLOCATOR: {
-                auto it = ptr_to_allocation.find(records_it->record.address);
-                if (it != ptr_to_allocation.end()) {
-                    current_memory -= records[it->second].record.size;
-                    ptr_to_allocation.erase(it);
+    for (const auto& [address, live] : d_live_allocations) {
+        add(live.location_index, live.size, live.n_allocations, live.time);
+    }
+    for (const auto& [range, live] : d_ranges) {
+        add(live.location_index, range.size(), live.n_allocations, live.time);
+    }
+    return stacks;
+}
+
+void
+LiveSnapshotAggregator::addAllocation(const Allocation& allocation)
+{
+    ++d_version;
+    switch (hooks::allocatorKind(allocation.record.allocator)) {
+        case hooks::AllocatorKind::SIMPLE_ALLOCATOR: {
+            if (allocation.realloc_old_address) {
+                auto it = d_ptr_to_allocation.find(allocation.realloc_old_address);
+                if (it != d_ptr_to_allocation.end()) {
+                    removeFromLocation(it->second);
+                    d_ptr_to_allocation.erase(it);
                 }
-                break;
             }
-            case hooks::AllocatorKind::RANGED_ALLOCATOR: {
-                mmap_intervals.addInterval(
-                        records_it->record.address,
-                        records_it->record.size,
-                        *records_it);
-                current_memory += records_it->record.size;
-                update_peak(records_it);
-                break;
+            auto [it, inserted] = d_ptr_to_allocation.try_emplace(allocation.record.address, allocation);
+            if (!inserted) {
+                removeFromLocation(it->second);
+                it->second = allocation;
             }
-            case hooks::AllocatorKind::RANGED_DEALLOCATOR: {
-                const auto address = records_it->record.address;
-                const auto size = records_it->record.size;
-                const auto removed = mmap_intervals.removeInterval(address, size);
-
-                if (!removed.has_value()) {
-                    break;
-                }
-                size_t removed_size = std::accumulate(
-                        removed.value().begin(),
-                        removed.value().cend(),
-                        0,
-                        [](size_t sum, const std::pair<Interval, Allocation>& range) {
-                            return sum + range.first.size();
-                        });
-                current_memory -= removed_size;
-                update_peak(records_it);
+            addToLocation(allocation);
+            break;
+        }
+        case hooks::AllocatorKind::SIMPLE_DEALLOCATOR: {
+            auto it = d_ptr_to_allocation.find(allocation.record.address);
+            if (it != d_ptr_to_allocation.end()) {
+                removeFromLocation(it->second);
+                d_ptr_to_allocation.erase(it);
+            }
+            break;
+        }
+        case hooks::AllocatorKind::RANGED_ALLOCATOR: {
+            auto& record = allocation.record;
+            if (record.size == 0) {
                 break;
             }
+            touchRemovedRanges(d_interval_tree.removeInterval(record.address, record.size));
+            d_interval_tree.addInterval(record.address, record.size, allocation);
+            touchLocation(allocation);
+            break;
+        }
+        case hooks::AllocatorKind::RANGED_DEALLOCATOR: {
+            auto& record = allocation.record;
+            touchRemovedRanges(d_interval_tree.removeInterval(record.address, record.size));
+            break;
         }
     }
-    return result;
 }
 
-PyObject*
-Py_ListFromSnapshotAllocationRecords(const reduced_snapshot_map_t& stack_to_allocation)
+LiveSnapshotAggregator::Location&
+LiveSnapshotAggregator::touchLocation(const Allocation& allocation)
+{
+    auto [it, inserted] = d_locations.try_emplace(
+            location_t(allocation.frame_index, allocation.record.tid),
+            Location{allocation, d_version});
+    if (inserted) {
+        it->second.totals.record.size = 0;
+        it->second.totals.n_allocations = 0;
+    }
+    it->second.version = d_version;
+    return it->second;
+}
+
+void
+LiveSnapshotAggregator::addToLocation(const Allocation& allocation)
+{
+    Location& location = touchLocation(allocation);
+    if (location.totals.n_allocations == 0) {
+        location.totals = allocation;
+        return;
+    }
+    location.totals.record.size += allocation.record.size;
+    location.totals.n_allocations += allocation.n_allocations;
+}
+
+void
+LiveSnapshotAggregator::removeFromLocation(const Allocation& allocation)
+{
+    // The location keeps the first allocation that it saw for the fields
+    // other than the totals, even once that allocation is gone.
+    Location& location = touchLocation(allocation);
+    location.totals.record.size -= allocation.record.size;
+    location.totals.n_allocations -= allocation.n_allocations;
+}
+
+void
+LiveSnapshotAggregator::touchRemovedRanges(
+        const std::optional<std::vector<std::pair<Interval, Allocation>>>& removed)
+{
+    if (!removed) {
+        return;
+    }
+    for (const auto& [range, allocation] : removed.value()) {
+        touchLocation(allocation);
+    }
+}
+
+reduced_snapshot_map_t
+LiveSnapshotAggregator::getSnapshotAllocations(bool merge_threads) const
 {
-    PyObject* list = PyList_New(stack_to_allocation.size());
-    if (list == nullptr) {
-        return nullptr;
+    reduced_snapshot_map_t stack_to_allocation;
+    stack_to_allocation.reserve(d_locations.size());
+    for (const auto& [key, location] : d_locations) {
+        if (location.totals.n_allocations == 0) {
+            continue;
+        }
+        const thread_id_t thread_id = merge_threads ? NO_THREAD_INFO : key.second;
+        auto [it, inserted] = stack_to_allocation.try_emplace(
+                std::pair(key.first, thread_id),
+                location.totals);
+        if (!inserted) {
+            it->second.record.size += location.totals.record.size;
+            it->second.n_allocations += location.totals.n_allocations;
+        }
     }
-    size_t list_index = 0;
-    for (const auto& it : stack_to_allocation) {
-        const auto& record = it.second;
-        PyObject* pyrecord = record.toPythonObject();
-        if (pyrecord == nullptr) {
-            Py_DECREF(list);
-            return nullptr;
+    addRangesToSnapshot(d_interval_tree, merge_threads, stack_to_allocation);
+    return stack_to_allocation;
+}
+
+std::pair<LiveSnapshotAggregator::version_t, reduced_snapshot_map_t>
+LiveSnapshotAggregator::getSnapshotChanges(version_t since) const
+{
+    reduced_snapshot_map_t ranges;
+    addRangesToSnapshot(d_interval_tree, false, ranges);
+
+    reduced_snapshot_map_t changes;
+    for (const auto& [key, location] : d_locations) {
+        if (location.version <= since) {
+            continue;
+        }
+        Allocation totals = location.totals;
+        auto range_it = ranges.find(key);
+        if (range_it != ranges.end()) {
+            if (totals.n_allocations == 0) {
+                totals = range_it->second;
+            } else {
+                totals.record.size += range_it->second.record.size;
+                totals.n_allocations += range_it->second.n_allocations;
+            }
         }
-        PyList_SET_ITEM(list, list_index++, pyrecord);
+        // Whoever has nothing yet doesn't need to hear about what is gone.
+        if (since == 0 && totals.n_allocations == 0) {
+            continue;
+        }
+        changes.emplace(key, totals);
     }
-    return list;
+    return {d_version, std::move(changes)};
 }
 
-PyObject*
-Py_GetSnapshotAllocationRecords(
-        const allocations_t& all_records,
-        size_t record_index,
-        bool merge_threads)
+void
+HighWaterMarkAggregator::addAllocation(const Allocation& allocation)
 {
-    if (all_records.empty()) {
-        return PyList_New(0);
+    const auto& record = allocation.record;
+    switch (hooks::allocatorKind(record.allocator)) {
+        case hooks::AllocatorKind::SIMPLE_ALLOCATOR: {
+            // A reallocation frees its old address and allocates its new
+            // one at the same time: the peak can't be in between.
+            if (allocation.realloc_old_address) {
+                removeLiveAllocation(allocation.realloc_old_address);
+            }
+            // If we missed the deallocation of something that was at the
+            // same address, it was freed by now.
+            removeLiveAllocation(record.address);
+            size_t location_index = locationIndex(allocation);
+            addToLocation(location_index, allocation.n_allocations, record.size);
+            d_live_allocations.emplace(
+                    record.address,
+                    LiveAllocation{location_index, record.size, allocation.n_allocations});
+            updatePeak();
+            break;
+        }
+        case hooks::AllocatorKind::SIMPLE_DEALLOCATOR: {
+            removeLiveAllocation(record.address);
+            break;
+        }
+        case hooks::AllocatorKind::RANGED_ALLOCATOR: {
+            if (record.size == 0) {
+                break;
+            }
+            // A new mapping replaces whatever was mapped at the same addresses.
+            removeRange(record.address, record.size);
+            size_t location_index = locationIndex(allocation);
+            d_live_ranges.addInterval(record.address, record.size, location_index);
+            addToLocation(location_index, 1, record.size);
+            updatePeak();
+            break;
+        }
+        case hooks::AllocatorKind::RANGED_DEALLOCATOR: {
+            removeRange(record.address, record.size);
+            break;
+        }
     }
-    const auto stack_to_allocation = reduceSnapshotAllocations(all_records, record_index, merge_threads);
-    return Py_ListFromSnapshotAllocationRecords(stack_to_allocation);
+}
+
+std::vector<AggregatedAllocation>
+HighWaterMarkAggregator::getAggregatedAllocations() const
+{
+    std::vector<AggregatedAllocation> result;
+    for (const auto& usage : d_usage) {
+        bool changed_since_peak = usage.peak_count == d_peak_count;
+        size_t n_allocations_at_peak =
+                changed_since_peak ? usage.n_allocations_at_peak : usage.n_allocations;
+        size_t bytes_at_peak = changed_since_peak ? usage.bytes_at_peak : usage.bytes;
+        if (n_allocations_at_peak == 0 && usage.n_allocations == 0) {
+            continue;
+        }
+        const Location& location = usage.location;
+        result.push_back(
+                {location.tid,
+                 location.allocator,
+                 location.native_frame_id,
+                 location.frame_index,
+                 location.native_segment_generation,
+                 n_allocations_at_peak,
+                 usage.n_allocations,
+                 bytes_at_peak,
+                 usage.bytes});
+    }
+    return result;
+}
+
+size_t
+HighWaterMarkAggregator::locationIndex(const Allocation& allocation)
+{
+    Location location = Location::of(allocation);
+    auto [it, inserted] = d_location_indexes.try_emplace(location, d_usage.size());
+    if (inserted) {
+        // It had nothing allocated at the last peak, and that is known already.
+        d_usage.push_back({location, d_peak_count});
+    }
+    return it->second;
+}
+
+HighWaterMarkAggregator::UsageHistory&
+HighWaterMarkAggregator::usageBeforeChange(size_t location_index)
+{
+    UsageHistory& usage = d_usage[location_index];
+    if (usage.peak_count != d_peak_count) {
+        // This is the first change since the heap reached its last peak, so
+        // what the location has now is what it had at that peak.
+        usage.peak_count = d_peak_count;
+        usage.n_allocations_at_peak = usage.n_allocations;
+        usage.bytes_at_peak = usage.bytes;
+    }
+    return usage;
+}
+
+void
+HighWaterMarkAggregator::addToLocation(size_t location_index, size_t n_allocations, size_t bytes)
+{
+    UsageHistory& usage = usageBeforeChange(location_index);
+    usage.n_allocations += n_allocations;
+    usage.bytes += bytes;
+    d_current_memory += bytes;
+}
+
+void
+HighWaterMarkAggregator::removeFromLocation(size_t location_index, size_t n_allocations, size_t bytes)
+{
+    UsageHistory& usage = usageBeforeChange(location_index);
+    usage.n_allocations -= n_allocations;
+    usage.bytes -= bytes;
+    d_current_memory -= bytes;
+}
+
+void
+HighWaterMarkAggregator::removeLiveAllocation(uintptr_t address)
+{
+    auto it = d_live_allocations.find(address);
+    if (it == d_live_allocations.end()) {
+        return;
+    }
+    const LiveAllocation& live = it->second;
+    removeFromLocation(live.location_index, live.n_allocations, live.size);
+    d_live_allocations.erase(it);
+}
+
+void
+HighWaterMarkAggregator::removeRange(uintptr_t address, size_t size)
+{
+    if (size == 0) {
+        return;
+    }
+    // Every piece of a partially unmapped range counts as one allocation,
+    // like it does in the snapshots built by SnapshotAllocationAggregator.
+    const Interval removed(address, address + size);
+    d_live_ranges.visitOverlapping(address, size, [&](const Interval& range, size_t location_index) {
+        auto intersection = range.intersection(removed).value();
+        size_t pieces_left = (range.begin < intersection.begin) + (intersection.end < range.end);
+        UsageHistory& usage = usageBeforeChange(location_index);
+        usage.n_allocations = usage.n_allocations + pieces_left - 1;
+        usage.bytes -= intersection.size();
+        d_current_memory -= intersection.size();
+    });
+    d_live_ranges.removeInterval(address, size);
+}
+
+void
+HighWaterMarkAggregator::updatePeak()
+{
+    if (d_current_memory >= d_peak_memory) {
+        d_peak_memory = d_current_memory;
+        d_peak_count++;
+    }
+}
+
+// Reducing a snapshot across several threads only pays off for the shards
+// of this many records or more.
+static constexpr size_t MIN_RECORDS_PER_SHARD = 1 << 18;
+static constexpr size_t MAX_SHARDS = std::numeric_limits<uint8_t>::max();
+
+static uint8_t
+addressShard(uintptr_t address, size_t n_shards)
+{
+    const uint64_t hash = containers::mixHash(address >> 4);
+    return static_cast<uint8_t>((static_cast<unsigned __int128>(hash) * n_shards) >> 64);
+}
+
+template<typename Function>
+static void
+runInThreads(size_t n_threads, Function&& function)
+{
+    std::vector<std::thread> threads;
+    for (size_t index = 1; index < n_threads; ++index) {
+        threads.emplace_back(function, index);
+    }
+    function(0);
+    for (auto& thread : threads) {
+        thread.join();
+    }
+}
+
+/**
+ * Produce an aggregated snapshot from a vector of allocations and a index in that vector
+ *
+ * This function takes a vector containing a sequence of allocation events and an index in that
+ * vector indicating the position where the snapshot should be produced and returns a collection
+ * of allocations representing the heap structure at that particular point. This collection of
+ * allocations is aggregated so allocations with the same stack trace will be reported together
+ * as a single allocation with the size being the sum af the sizes of the individual allocations.
+ *
+ * Long sequences are split between up to max_workers threads by address. Each thread only
+ * follows the simple allocations at the addresses of its shard, which it sees in order, so the
+ * shards are separate heaps that are only merged once they are reduced. Ranged allocations can
+ * span the addresses of any number of shards, so they are all followed by the first one.
+ **/
+static reduced_snapshot_map_t
+reduceSnapshotAllocations(
+        const allocations_t& records,
+        size_t snapshot_index,
+        bool merge_threads,
+        size_t max_workers)
+{
+    assert(snapshot_index < records.size());
+
+    const size_t n_records = snapshot_index + 1;
+    const size_t n_shards = std::min({max_workers, n_records / MIN_RECORDS_PER_SHARD, MAX_SHARDS});
+    if (n_shards < 2) {
+        SnapshotAllocationAggregator aggregator;
+
+        for (size_t i = 0; i <= snapshot_index; ++i) {
+            aggregator.addAllocation(records[i]);
+        }
+
+        return aggregator.getSnapshotAllocations(merge_threads);
+    }
+
+    // Every worker goes through all of the records, so the shard of each one
+    // is found first, by all of them at once, to only compare it afterwards.
+    const auto& allocators = records.allocators();
+    const auto& addresses = records.addresses();
+    const auto& realloc_old_addresses = records.reallocOldAddresses();
+    std::vector<uint8_t> record_shards(n_records);
+    runInThreads(n_shards, [&](size_t worker) {
+        const size_t end = n_records * (worker + 1) / n_shards;
+        for (size_t i = n_records * worker / n_shards; i < end; ++i) {
+            const auto kind = hooks::allocatorKind(allocators[i]);
+            const bool ranged = kind == hooks::AllocatorKind::RANGED_ALLOCATOR
+                                || kind == hooks::AllocatorKind::RANGED_DEALLOCATOR;
+            record_shards[i] = ranged ? 0 : addressShard(addresses[i], n_shards);
+        }
+    });
+
+    std::vector<reduced_snapshot_map_t> shards(n_shards);
+    runInThreads(n_shards, [&](size_t shard) {
+        SnapshotAllocationAggregator aggregator;
+        for (size_t i = 0; i < n_records; ++i) {
+            if (record_shards[i] == shard) {
+                if (hooks::allocatorKind(allocators[i]) == hooks::AllocatorKind::SIMPLE_DEALLOCATOR) {
+                    aggregator.removeAllocation(addresses[i]);
+                } else {
+                    aggregator.addAllocation(records[i]);
+                }
+                continue;
+            }
+            // A reallocation can move an allocation to another shard, which
+            // leaves the shard of its old address with only the free.
+            const uintptr_t old_address = realloc_old_addresses[i];
+            if (old_address && addressShard(old_address, n_shards) == shard) {
+                aggregator.removeAllocation(old_address);
+            }
+        }
+        shards[shard] = aggregator.getSnapshotAllocations(merge_threads);
+    });
+
+    reduced_snapshot_map_t stack_to_allocation = std::move(shards[0]);
+    for (size_t shard = 1; shard < n_shards; ++shard) {
+        for (const auto& [key, allocation] : shards[shard]) {
+            auto [it, inserted] = stack_to_allocation.try_emplace(key, allocation);
+            if (!inserted) {
+                it->second.record.size += allocation.record.size;
+                it->second.n_allocations += allocation.n_allocations;
+            }
+        }
+    }
+    return stack_to_allocation;
+}
+
+void
+SnapshotAllocationAggregator::removeAllocation(uintptr_t address)
+{
+    if (d_spilled_events) {
+        spillEvent(address, SpilledEvent::FREED, 0, 0);
+        return;
+    }
+    d_live_allocations.erase(address);
+}
+
+void
+SnapshotAllocationAggregator::addRange(const Interval& range, const Allocation& allocation)
+{
+    d_interval_tree.addInterval(range.begin, range.size(), allocation);
+}
+
+HeapCheckpoints::HeapCheckpoints(const allocations_t& records)
+: d_records(records)
+{
+    const auto& allocators = records.allocators();
+    const auto& addresses = records.addresses();
+    const auto& sizes = records.sizes();
+    const auto& realloc_old_addresses = records.reallocOldAddresses();
+
+    containers::FlatHashMap<uintptr_t, size_t> live_allocations;
+    IntervalTree<size_t> live_ranges;
+    size_t n_events = 0;
+    d_checkpoints.push_back(Checkpoint{0, 0, {}, {}});
+
+    for (size_t i = 0; i < records.size(); ++i) {
+        n_events += realloc_old_addresses[i] ? 2 : 1;
+        switch (hooks::allocatorKind(allocators[i])) {
+            case hooks::AllocatorKind::SIMPLE_ALLOCATOR: {
+                if (realloc_old_addresses[i]) {
+                    live_allocations.erase(realloc_old_addresses[i]);
+                }
+                live_allocations[addresses[i]] = i;
+                break;
+            }
+            case hooks::AllocatorKind::SIMPLE_DEALLOCATOR: {
+                live_allocations.erase(addresses[i]);
+                break;
+            }
+            case hooks::AllocatorKind::RANGED_ALLOCATOR: {
+                live_ranges.addInterval(addresses[i], sizes[i], i);
+                break;
+            }
+            case hooks::AllocatorKind::RANGED_DEALLOCATOR: {
+                live_ranges.removeInterval(addresses[i], sizes[i]);
+                break;
+            }
+        }
+
+        size_t n_records = i + 1;
+        size_t interval = std::max(MIN_CHECKPOINT_INTERVAL, live_allocations.size());
+        if (n_records - d_checkpoints.back().n_records < interval) {
+            continue;
+        }
+        Checkpoint checkpoint{n_records, n_events, {}, {live_ranges.begin(), live_ranges.end()}};
+        checkpoint.live_allocations.reserve(live_allocations.size());
+        for (const auto& [address, index] : live_allocations) {
+            checkpoint.live_allocations.push_back(index);
+        }
+        // Allocations are put back in order, so that a reallocation can't
+        // forget about a later allocation at the address that it freed.
+        std::sort(checkpoint.live_allocations.begin(), checkpoint.live_allocations.end());
+        d_checkpoints.push_back(std::move(checkpoint));
+    }
+}
+
+reduced_snapshot_map_t
+HeapCheckpoints::getSnapshotAllocations(size_t n_records, bool merge_threads) const
+{
+    n_records = std::min(n_records, d_records.size());
+    auto it = std::upper_bound(
+            d_checkpoints.begin(),
+            d_checkpoints.end(),
+            n_records,
+            [](size_t n_records, const Checkpoint& checkpoint) {
+                return n_records < checkpoint.n_records;
+            });
+    const Checkpoint& checkpoint = *std::prev(it);
+
+    SnapshotAllocationAggregator aggregator;
+    for (size_t index : checkpoint.live_allocations) {
+        aggregator.addAllocation(d_records[index]);
+    }
+    for (const auto& [range, index] : checkpoint.live_ranges) {
+        aggregator.addRange(range, d_records[index]);
+    }
+    for (size_t i = checkpoint.n_records; i < n_records; ++i) {
+        aggregator.addAllocation(d_records[i]);
+    }
+    return aggregator.getSnapshotAllocations(merge_threads);
+}
+
+size_t
+HeapCheckpoints::recordsForEvents(size_t n_events) const
+{
+    auto it = std::upper_bound(
+            d_checkpoints.begin(),
+            d_checkpoints.end(),
+            n_events,
+            [](size_t n_events, const Checkpoint& checkpoint) {
+                return n_events < checkpoint.n_events;
+            });
+    const Checkpoint& checkpoint = *std::prev(it);
+
+    const auto& realloc_old_addresses = d_records.reallocOldAddresses();
+    size_t n_records = checkpoint.n_records;
+    size_t events = checkpoint.n_events;
+    while (events < n_events && n_records < d_records.size()) {
+        events += realloc_old_addresses[n_records++] ? 2 : 1;
+    }
+    return n_records;
+}
+
+static size_t
+removedSize(const std::vector<std::pair<Interval, size_t>>& removed)
+{
+    return std::accumulate(
+            removed.begin(),
+            removed.end(),
+            size_t{0},
+            [](size_t sum, const std::pair<Interval, size_t>& range) {
+                return sum + range.first.size();
+            });
+}
+
+void
+HighWatermarkFinder::updatePeak()
+{
+    if (d_spilled_events) {
+        // Only the ranged allocations are known, so the peak is looked for
+        // once the changes of the simple ones are too.
+        d_updated_peak = true;
+        return;
+    }
+    if (d_current_memory >= d_result.peak_memory) {
+        d_result.index = d_index;
+        d_result.peak_memory = d_current_memory;
+    }
+}
+
+void
+HighWatermarkFinder::processAllocation(const Allocation& allocation)
+{
+    processAllocation(
+            allocation.record.allocator,
+            allocation.record.address,
+            allocation.record.size,
+            allocation.realloc_old_address);
+}
+
+void
+HighWatermarkFinder::processAllocation(
+        hooks::Allocator allocator,
+        uintptr_t address,
+        size_t size,
+        uintptr_t realloc_old_address)
+{
+    if (d_spilled_events) {
+        spillAllocation(allocator, address, size, realloc_old_address);
+    } else {
+        applyAllocation(allocator, address, size, realloc_old_address);
+    }
+    d_index++;
+}
+
+void
+HighWatermarkFinder::applyAllocation(
+        hooks::Allocator allocator,
+        uintptr_t address,
+        size_t size,
+        uintptr_t realloc_old_address)
+{
+    switch (hooks::allocatorKind(allocator)) {
+        case hooks::AllocatorKind::SIMPLE_ALLOCATOR: {
+            // A reallocation frees its old address and allocates its new
+            // one at the same time: the peak can't be in between.
+            if (realloc_old_address) {
+                auto it = d_ptr_to_size.find(realloc_old_address);
+                if (it != d_ptr_to_size.end()) {
+                    d_current_memory -= it->second;
+                    d_ptr_to_size.erase(it);
+                }
+            }
+            d_current_memory += size;
+            updatePeak();
+            d_ptr_to_size[address] = size;
+            break;
+        }
+        case hooks::AllocatorKind::SIMPLE_DEALLOCATOR: {
+            auto it = d_ptr_to_size.find(address);
+            if (it != d_ptr_to_size.end()) {
+                d_current_memory -= it->second;
+                d_ptr_to_size.erase(it);
+            }
+            break;
+        }
+        case hooks::AllocatorKind::RANGED_ALLOCATOR: {
+            // A new mapping replaces whatever was mapped at the same addresses.
+            const auto replaced = d_mmap_intervals.removeInterval(address, size);
+            if (replaced.has_value()) {
+                d_current_memory -= removedSize(replaced.value());
+            }
+            d_mmap_intervals.addInterval(address, size, 0);
+            d_current_memory += size;
+            updatePeak();
+            break;
+        }
+        case hooks::AllocatorKind::RANGED_DEALLOCATOR: {
+            const auto removed = d_mmap_intervals.removeInterval(address, size);
+
+            if (!removed.has_value()) {
+                break;
+            }
+            d_current_memory -= removedSize(removed.value());
+            updatePeak();
+            break;
+        }
+    }
+}
+
+void
+HighWatermarkFinder::spillTo(
+        const std::string& directory,
+        size_t memory_budget,
+        size_t max_allocations)
+{
+    assert(d_index == 0 && !d_spilled_events);
+    const size_t n_partitions = SpilledEvents::partitionsFor(
+            memory_budget,
+            max_allocations,
+            LIVE_ALLOCATION_BYTES<size_t>);
+    if (n_partitions > 1) {
+        d_spilled_events = std::make_unique<SpilledEvents>(directory, n_partitions, memory_budget);
+    }
+}
+
+void
+HighWatermarkFinder::spillAllocation(
+        hooks::Allocator allocator,
+        uintptr_t address,
+        size_t size,
+        uintptr_t realloc_old_address)
+{
+    switch (hooks::allocatorKind(allocator)) {
+        case hooks::AllocatorKind::SIMPLE_ALLOCATOR: {
+            // The free of the old address of a reallocation has the same
+            // index as the allocation, so their changes are merged together.
+            if (realloc_old_address) {
+                d_spilled_events->add(
+                        SpilledEvent{d_index, realloc_old_address, 0, 0, SpilledEvent::FREED});
+            }
+            d_spilled_events->add(SpilledEvent{d_index, address, size, 1, 0});
+            break;
+        }
+        case hooks::AllocatorKind::SIMPLE_DEALLOCATOR: {
+            d_spilled_events->add(SpilledEvent{d_index, address, 0, 0, SpilledEvent::FREED});
+            break;
+        }
+        case hooks::AllocatorKind::RANGED_ALLOCATOR:
+        case hooks::AllocatorKind::RANGED_DEALLOCATOR: {
+            // The mappings are few enough to always follow in memory, which
+            // leaves d_current_memory with only their size.
+            const size_t before = d_current_memory;
+            d_updated_peak = false;
+            applyAllocation(allocator, address, size, realloc_old_address);
+            if (d_current_memory != before || d_updated_peak) {
+                d_ranged_changes.push_back(HeapChange{
+                        d_index,
+                        static_cast<int64_t>(d_current_memory - before),
+                        d_updated_peak});
+            }
+            break;
+        }
+    }
+}
+
+void
+HighWatermarkFinder::findSpilledHighWatermark()
+{
+    // Replaying each partition gives the changes of its events to the heap,
+    // in the order of their indexes, which are then merged back with those
+    // of the other partitions and of the ranged allocations.
+    std::vector<SpillFile<HeapChange>> runs;
+    runs.reserve(d_spilled_events->numPartitions());
+    const size_t buffer_size = d_spilled_events->bufferSize(sizeof(HeapChange));
+    for (size_t index = 0; index < d_spilled_events->numPartitions(); ++index) {
+        auto& partition = d_spilled_events->partition(index);
+        auto& run = runs.emplace_back(d_spilled_events->directory(), buffer_size);
+        partition.rewind();
+        while (const SpilledEvent* event = partition.next()) {
+            if (event->location_index != SpilledEvent::FREED) {
+                d_ptr_to_size[event->address] = event->size;
+                run.append(HeapChange{event->index, static_cast<int64_t>(event->size), true});
+                continue;
+            }
+            auto it = d_ptr_to_size.find(event->address);
+            if (it != d_ptr_to_size.end()) {
+                run.append(HeapChange{event->index, -static_cast<int64_t>(it->second), false});
+                d_ptr_to_size.erase(it);
+            }
+        }
+        d_ptr_to_size.clear();
+        run.rewind();
+    }
+
+    using head_t = std::pair<HeapChange, size_t>;
+    auto later = [](const head_t& lhs, const head_t& rhs) {
+        return lhs.first.index > rhs.first.index;
+    };
+    std::priority_queue<head_t, std::vector<head_t>, decltype(later)> heads(later);
+    for (size_t index = 0; index < runs.size(); ++index) {
+        if (const HeapChange* change = runs[index].next()) {
+            heads.emplace(*change, index);
+        }
+    }
+    size_t ranged_position = 0;
+
+    size_t current_memory = 0;
+    while (!heads.empty() || ranged_position < d_ranged_changes.size()) {
+        uint64_t index = std::numeric_limits<uint64_t>::max();
+        if (!heads.empty()) {
+            index = heads.top().first.index;
+        }
+        if (ranged_position < d_ranged_changes.size()) {
+            index = std::min(index, d_ranged_changes[ranged_position].index);
+        }
+
+        bool updates_peak = false;
+        while (!heads.empty() && heads.top().first.index == index) {
+            auto [change, run] = heads.top();
+            heads.pop();
+            current_memory += change.delta;
+            updates_peak |= change.updates_peak;
+            if (const HeapChange* next = runs[run].next()) {
+                heads.emplace(*next, run);
+            }
+        }
+        while (ranged_position < d_ranged_changes.size()
+               && d_ranged_changes[ranged_position].index == index)
+        {
+            const HeapChange& change = d_ranged_changes[ranged_position++];
+            current_memory += change.delta;
+            updates_peak |= change.updates_peak;
+        }
+
+        if (updates_peak && current_memory >= d_result.peak_memory) {
+            d_result.index = index;
+            d_result.peak_memory = current_memory;
+        }
+    }
+
+    d_current_memory = current_memory;
+    d_ranged_changes = {};
+    runs.clear();
+    d_spilled_events.reset();
+}
+
+HighWatermark
+HighWatermarkFinder::getHighWatermark()
+{
+    if (d_spilled_events) {
+        findSpilledHighWatermark();
+    }
+    return d_result;
+}
+
+size_t
+HighWatermarkFinder::currentMemory() const noexcept
+{
+    return d_current_memory;
+}
+
+HighWatermark
+getHighWatermark(const allocations_t& records, ReadProgress* progress)
+{
+    // Only go through the columns that are needed to find the peak.
+    const auto& allocators = records.allocators();
+    const auto& addresses = records.addresses();
+    const auto& sizes = records.sizes();
+    const auto& realloc_old_addresses = records.reallocOldAddresses();
+
+    HighWatermarkFinder finder;
+    if (!progress) {
+        for (size_t i = 0; i < records.size(); ++i) {
+            finder.processAllocation(allocators[i], addresses[i], sizes[i], realloc_old_addresses[i]);
+        }
+        return finder.getHighWatermark();
+    }
+
+    constexpr size_t BATCH_SIZE = 1 << 16;
+    progress->startPhase(ReadPhase::HIGH_WATERMARK, records.size());
+    for (size_t start = 0; start < records.size(); start += BATCH_SIZE) {
+        size_t end = std::min(records.size(), start + BATCH_SIZE);
+        for (size_t i = start; i < end; ++i) {
+            finder.processAllocation(allocators[i], addresses[i], sizes[i], realloc_old_addresses[i]);
+        }
+        progress->advance(end - start);
+        if (!progress->update()) {
+            break;
+        }
+    }
+    progress->finishPhase();
+    return finder.getHighWatermark();
+}
+
+void
+MemoryTimelineAggregator::addMemoryRecords(
+        const std::vector<size_t>& memory_record_allocations,
+        size_t n_allocations)
+{
+    while (d_spans.size() < memory_record_allocations.size()
+           && memory_record_allocations[d_spans.size()] <= n_allocations)
+    {
+        d_spans.push_back(d_span);
+        size_t heap = d_heap.currentMemory();
+        d_span = Span{heap, heap, d_n_events};
+    }
+}
+
+void
+MemoryTimelineAggregator::addAllocation(
+        const Allocation& allocation,
+        const std::vector<MemoryRecord>&,
+        const std::vector<size_t>& memory_record_allocations)
+{
+    // The memory records found before this allocation are the ones found
+    // when fewer allocations than this one's position had been read.
+    addMemoryRecords(memory_record_allocations, d_n_allocations);
+    ++d_n_allocations;
+
+    d_heap.processAllocation(allocation);
+    d_n_events += allocation.realloc_old_address ? 2 : 1;
+    size_t heap = d_heap.currentMemory();
+    if (heap > d_span.max_heap) {
+        d_span.max_heap = heap;
+        d_span.peak_events = d_n_events;
+    }
+    d_span.min_heap = std::min(d_span.min_heap, heap);
+}
+
+std::vector<MemoryTimelineAggregator::Point>
+MemoryTimelineAggregator::getTimeline(
+        const std::vector<MemoryRecord>& memory_records,
+        const std::vector<size_t>& memory_record_allocations,
+        size_t n_points)
+{
+    addMemoryRecords(memory_record_allocations, std::numeric_limits<size_t>::max());
+    std::vector<Point> points;
+    if (d_spans.empty() || n_points == 0) {
+        return points;
+    }
+    // What happened after the last memory record goes with it.
+    Span& last = d_spans.back();
+    if (d_span.max_heap > last.max_heap) {
+        last.max_heap = d_span.max_heap;
+        last.peak_events = d_span.peak_events;
+    }
+    last.min_heap = std::min(last.min_heap, d_span.min_heap);
+    d_span = Span{d_heap.currentMemory(), d_heap.currentMemory(), d_n_events};
+
+    const auto start = static_cast<millis_t>(memory_records.front().ms_since_epoch);
+    const auto end = static_cast<millis_t>(memory_records[d_spans.size() - 1].ms_since_epoch);
+    // Memory records can go back in time when the clock does.
+    const uint64_t duration = std::max(end, start) - start + 1;
+    size_t current_point = 0;
+    for (size_t i = 0; i < d_spans.size(); ++i) {
+        const MemoryRecord& record = memory_records[i];
+        const Span& span = d_spans[i];
+        const auto time = static_cast<millis_t>(record.ms_since_epoch);
+        const uint64_t offset = std::max(time, start) - start;
+        size_t point = std::min<uint64_t>(offset * n_points / duration, n_points - 1);
+        if (points.empty() || point != current_point) {
+            current_point = point;
+            points.push_back(
+                    {time,
+                     time,
+                     record.rss,
+                     record.rss,
+                     span.min_heap,
+                     span.max_heap,
+                     span.peak_events,
+                     1});
+            continue;
+        }
+        Point& merged = points.back();
+        merged.end_time = time;
+        merged.min_rss = std::min(merged.min_rss, record.rss);
+        merged.max_rss = std::max(merged.max_rss, record.rss);
+        merged.min_heap = std::min(merged.min_heap, span.min_heap);
+        if (span.max_heap > merged.max_heap) {
+            merged.max_heap = span.max_heap;
+            merged.peak_events = span.peak_events;
+        }
+        ++merged.n_memory_records;
+    }
+    return points;
+}
+
+namespace {
+
+// The layout of the index file. It's only ever read by the machine that wrote
+// it, so the fields are in native byte order.
+struct HighWatermarkIndexContents
+{
+    char magic[8];
+    uint64_t capture_size;
+    int64_t capture_mtime_ns;
+    uint64_t capture_inode;
+    uint64_t index;
+    uint64_t peak_memory;
+};
+
+constexpr char INDEX_MAGIC[8] = {'m', 'e', 'm', 'r', 'a', 'y', 'i', '1'};
+
+}  // unnamed namespace
+
+HighWatermarkIndex::HighWatermarkIndex(const std::string& capture_file)
+{
+    size_t slash = capture_file.rfind('/');
+    size_t name_start = slash == std::string::npos ? 0 : slash + 1;
+    d_path = capture_file.substr(0, name_start) + "." + capture_file.substr(name_start)
+             + ".memray-index";
+
+    struct stat st;
+    if (stat(capture_file.c_str(), &st) != 0) {
+        return;
+    }
+    d_valid = true;
+    d_capture_size = st.st_size;
+    d_capture_mtime_ns = static_cast<int64_t>(st.st_mtim.tv_sec) * 1000000000 + st.st_mtim.tv_nsec;
+    d_capture_inode = st.st_ino;
+}
+
+bool
+HighWatermarkIndex::read(HighWatermark& watermark) const
+{
+    if (!d_valid) {
+        return false;
+    }
+    int fd = open(d_path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return false;
+    }
+    HighWatermarkIndexContents contents;
+    ssize_t n_read = ::read(fd, &contents, sizeof(contents));
+    close(fd);
+    if (n_read != sizeof(contents) || memcmp(contents.magic, INDEX_MAGIC, sizeof(INDEX_MAGIC)) != 0
+        || contents.capture_size != d_capture_size || contents.capture_mtime_ns != d_capture_mtime_ns
+        || contents.capture_inode != d_capture_inode)
+    {
+        return false;
+    }
+    watermark.index = contents.index;
+    watermark.peak_memory = contents.peak_memory;
+    return true;
+}
+
+void
+HighWatermarkIndex::write(const HighWatermark& watermark) const
+{
+    if (!d_valid) {
+        return;
+    }
+    HighWatermarkIndexContents contents;
+    memcpy(contents.magic, INDEX_MAGIC, sizeof(INDEX_MAGIC));
+    contents.capture_size = d_capture_size;
+    contents.capture_mtime_ns = d_capture_mtime_ns;
+    contents.capture_inode = d_capture_inode;
+    contents.index = watermark.index;
+    contents.peak_memory = watermark.peak_memory;
+
+    // Written to a file of its own and then renamed over the index, so that
+    // other readers see either the old index or the whole new one.
+    const std::string tmp_path = d_path + "." + std::to_string(getpid());
+    int fd = open(tmp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        LOG(DEBUG) << "Failed to create the index file " << tmp_path << ": " << strerror(errno);
+        return;
+    }
+    bool written = ::write(fd, &contents, sizeof(contents)) == sizeof(contents);
+    if (!written) {
+        LOG(DEBUG) << "Failed to write to the index file " << tmp_path << ": " << strerror(errno);
+    }
+    close(fd);
+    if (!written || rename(tmp_path.c_str(), d_path.c_str()) != 0) {
+        unlink(tmp_path.c_str());
+    }
+}
+
+const std::string&
+HighWatermarkIndex::path() const noexcept
+{
+    return d_path;
+}
+
+reduced_snapshot_map_t
+getSnapshotAllocations(
+        const allocations_t& all_records,
+        size_t record_index,
+        bool merge_threads,
+        size_t max_workers)
+{
+    if (all_records.empty()) {
+        return {};
+    }
+    return reduceSnapshotAllocations(all_records, record_index, merge_threads, max_workers);
+}
+
+HighWatermark
+getAggregatedHighWatermark(const std::vector<AggregatedAllocation>& aggregated_allocations)
+{
+    // What every location had at the peak adds up to the size of the heap then.
+    HighWatermark result;
+    for (const auto& aggregated : aggregated_allocations) {
+        result.peak_memory += aggregated.bytes_in_high_water_mark;
+    }
+    return result;
+}
+
+reduced_snapshot_map_t
+getAggregatedSnapshotAllocations(
+        const std::vector<AggregatedAllocation>& aggregated_allocations,
+        bool high_water_mark,
+        bool merge_threads)
+{
+    reduced_snapshot_map_t stack_to_allocation{};
+    for (const auto& aggregated : aggregated_allocations) {
+        Allocation allocation = high_water_mark ? aggregated.contributionToHighWaterMark()
+                                                : aggregated.contributionToLeaks();
+        if (allocation.n_allocations == 0) {
+            continue;
+        }
+        const thread_id_t thread_id = merge_threads ? NO_THREAD_INFO : allocation.record.tid;
+        auto [it, inserted] =
+                stack_to_allocation.emplace(std::pair(allocation.frame_index, thread_id), allocation);
+        if (!inserted) {
+            it->second.record.size += allocation.record.size;
+            it->second.n_allocations += allocation.n_allocations;
+        }
+    }
+    return stack_to_allocation;
+}
+
+std::vector<Allocation>
+getAllocationCounts(const std::vector<AllocationCounts>& allocation_counts, bool merge_threads)
+{
+    // thread, Python stack, native stack, native segment generation, allocator
+    using location_t = std::tuple<thread_id_t, size_t, frame_id_t, size_t, hooks::Allocator>;
+    std::map<location_t, Allocation> allocation_by_location;
+    for (const auto& counts : allocation_counts) {
+        location_t location{
+                merge_threads ? NO_THREAD_INFO : counts.tid,
+                counts.frame_index,
+                counts.native_frame_id,
+                counts.native_segment_generation,
+                counts.allocator};
+        auto [it, inserted] = allocation_by_location.emplace(location, counts.toAllocation());
+        if (!inserted) {
+            it->second.record.size += counts.n_bytes;
+            it->second.n_allocations += counts.n_calls;
+        }
+    }
+
+    std::vector<Allocation> result;
+    result.reserve(allocation_by_location.size());
+    for (const auto& [location, allocation] : allocation_by_location) {
+        result.push_back(allocation);
+    }
+    return result;
+}
+
+// The same as a // b is for floats in Python, which isn't always floor(a / b),
+// so that sizes fall in the same histogram bins as they do in the reporters.
+static double
+pythonFloorDivide(double a, double b)
+{
+    const double mod = std::fmod(a, b);
+    double div = (a - mod) / b;
+    if (mod && ((b < 0) != (mod < 0))) {
+        div -= 1.0;
+    }
+    if (!div) {
+        return std::copysign(0.0, a / b);
+    }
+    double floordiv = std::floor(div);
+    if (div - floordiv > 0.5) {
+        floordiv += 1.0;
+    }
+    return floordiv;
+}
+
+AllocationStatsAggregator::AllocationStatsAggregator(size_t num_largest)
+: d_num_largest(num_largest)
+{
+}
+
+void
+AllocationStatsAggregator::addAllocation(const Allocation& allocation)
+{
+    ++d_num_added;
+    const size_t size = allocation.record.size;
+    d_total_memory_allocated += size;
+    d_total_num_allocations += allocation.n_allocations;
+
+    const hooks::AllocatorKind kind = hooks::allocatorKind(allocation.record.allocator);
+    const bool is_deallocator = kind == hooks::AllocatorKind::SIMPLE_DEALLOCATOR
+                                || kind == hooks::AllocatorKind::RANGED_DEALLOCATOR;
+    if (!is_deallocator) {
+        auto it = std::find_if(
+                d_allocator_counts.begin(),
+                d_allocator_counts.end(),
+                [&](const auto& entry) { return entry.first == allocation.record.allocator; });
+        if (it == d_allocator_counts.end()) {
+            d_allocator_counts.emplace_back(allocation.record.allocator, 1);
+        } else {
+            ++it->second;
+        }
+    }
+
+    if (size) {
+        ++d_size_counts[size];
+        d_min_size = d_num_sized_allocations ? std::min(d_min_size, size) : size;
+        d_max_size = std::max(d_max_size, size);
+        ++d_num_sized_allocations;
+    }
+
+    rank(d_largest_by_size, size, allocation);
+    rank(d_largest_by_count, allocation.n_allocations, allocation);
+}
+
+void
+AllocationStatsAggregator::addAllocationEvents(const Allocation& allocation)
+{
+    if (allocation.realloc_old_address) {
+        addAllocation(allocation.oldAddressDeallocation());
+    }
+    addAllocation(allocation);
+}
+
+void
+AllocationStatsAggregator::addSnapshot(const reduced_snapshot_map_t& snapshot)
+{
+    // In the same order as the readers yield the records of the snapshot.
+    for (const auto& it : snapshot) {
+        addAllocation(it.second);
+    }
+}
+
+size_t
+AllocationStatsAggregator::totalMemoryAllocated() const noexcept
+{
+    return d_total_memory_allocated;
+}
+
+size_t
+AllocationStatsAggregator::totalNumAllocations() const noexcept
+{
+    return d_total_num_allocations;
+}
+
+const std::vector<std::pair<hooks::Allocator, size_t>>&
+AllocationStatsAggregator::allocatorCounts() const noexcept
+{
+    return d_allocator_counts;
+}
+
+std::vector<Allocation>
+AllocationStatsAggregator::largestBySize() const
+{
+    return fromLargest(d_largest_by_size);
+}
+
+std::vector<Allocation>
+AllocationStatsAggregator::largestByCount() const
+{
+    return fromLargest(d_largest_by_count);
+}
+
+size_t
+AllocationStatsAggregator::numSizedAllocations() const noexcept
+{
+    return d_num_sized_allocations;
+}
+
+size_t
+AllocationStatsAggregator::minSize() const noexcept
+{
+    return d_min_size;
+}
+
+size_t
+AllocationStatsAggregator::maxSize() const noexcept
+{
+    return d_max_size;
+}
+
+std::vector<std::pair<size_t, size_t>>
+AllocationStatsAggregator::sizeHistogram(size_t bins) const
+{
+    if (bins == 0) {
+        throw std::invalid_argument("the histogram needs at least one bin");
+    }
+    std::vector<std::pair<size_t, size_t>> histogram;
+    if (!d_num_sized_allocations) {
+        return histogram;
+    }
+
+    // The same bins as get_histogram_databins() makes, except that it can't
+    // make any when every size is 1, and here they all go in the first one.
+    const double low = std::log(static_cast<double>(d_min_size));
+    const double high = std::log(static_cast<double>(d_max_size));
+    double step = (high - low) / static_cast<double>(bins);
+    if (step == 0) {
+        step = low;
+    }
+    // When all sizes are the same, the bounds grow past what a size_t holds.
+    const double max_bound = static_cast<double>(std::numeric_limits<size_t>::max());
+    histogram.reserve(bins);
+    for (size_t i = 0; i < bins; ++i) {
+        const double bound = std::exp(low + step * static_cast<double>(i + 1));
+        histogram.emplace_back(
+                bound < max_bound ? static_cast<size_t>(bound) : std::numeric_limits<size_t>::max(),
+                0);
+    }
+    for (const auto& [size, count] : d_size_counts) {
+        double bin = 0;
+        if (step != 0) {
+            bin = pythonFloorDivide(std::log(static_cast<double>(size)) - low, step);
+        }
+        // Like there, the largest sizes can fall just past the last bin.
+        if (bin < 0 || bin >= static_cast<double>(bins)) {
+            continue;
+        }
+        histogram[static_cast<size_t>(bin)].second += count;
+    }
+    return histogram;
+}
+
+size_t
+AllocationStatsAggregator::sizePercentile(double percentile) const
+{
+    if (!(0 <= percentile && percentile <= 100)) {
+        throw std::invalid_argument("the percentile must be between 0 and 100");
+    }
+    if (!d_num_sized_allocations) {
+        return 0;
+    }
+
+    std::vector<std::pair<size_t, size_t>> size_counts;
+    size_counts.reserve(d_size_counts.size());
+    for (const auto& [size, count] : d_size_counts) {
+        size_counts.emplace_back(size, count);
+    }
+    std::sort(size_counts.begin(), size_counts.end());
+    const double rank = std::ceil(percentile / 100 * static_cast<double>(d_num_sized_allocations));
+    const size_t wanted = std::max(static_cast<size_t>(rank), size_t(1));
+    size_t seen = 0;
+    for (const auto& [size, count] : size_counts) {
+        seen += count;
+        if (seen >= wanted) {
+            return size;
+        }
+    }
+    return d_max_size;
+}
+
+bool
+AllocationStatsAggregator::ranksHigher(const RankedAllocation& lhs, const RankedAllocation& rhs)
+{
+    return lhs.key > rhs.key || (lhs.key == rhs.key && lhs.order < rhs.order);
+}
+
+void
+AllocationStatsAggregator::rank(
+        std::vector<RankedAllocation>& heap,
+        size_t key,
+        const Allocation& allocation)
+{
+    if (heap.size() < d_num_largest) {
+        heap.push_back({key, d_num_added, allocation});
+        std::push_heap(heap.begin(), heap.end(), ranksHigher);
+        return;
+    }
+    // Anything added later loses a tie, so it has to be strictly larger.
+    if (heap.empty() || key <= heap.front().key) {
+        return;
+    }
+    std::pop_heap(heap.begin(), heap.end(), ranksHigher);
+    heap.back() = {key, d_num_added, allocation};
+    std::push_heap(heap.begin(), heap.end(), ranksHigher);
+}
+
+std::vector<Allocation>
+AllocationStatsAggregator::fromLargest(std::vector<RankedAllocation> heap)
+{
+    std::sort(heap.begin(), heap.end(), ranksHigher);
+    std::vector<Allocation> result;
+    result.reserve(heap.size());
+    for (const auto& ranked : heap) {
+        result.push_back(ranked.allocation);
+    }
+    return result;
 }
 
 }  // namespace memray::api
@@ -1,13 +1,25 @@
 #pragma once
 
+#include <algorithm>
 #include <functional>
+#include <iterator>
+#include <limits>
+#include <map>
+#include <memory>
 #include <optional>
+#include <string>
+#include <type_traits>
 #include <unordered_map>
+#include <utility>
 #include <vector>
 
+#include <unistd.h>
+
 #include "Python.h"
 
+#include "allocation_store.h"
 #include "frame_tree.h"
+#include "read_progress.h"
 #include "records.h"
 
 namespace memray::api {
@@ -26,7 +38,6 @@ struct index_thread_pair_hash
     }
 };
 
-using allocations_t = std::vector<Allocation>;
 using reduced_snapshot_map_t = std::
         unordered_map<std::pair<FrameTree::index_t, thread_id_t>, Allocation, index_thread_pair_hash>;
 
@@ -45,124 +56,733 @@ struct Interval
     uintptr_t end;
 };
 
+/**
+ * A set of non-overlapping address ranges, each with a value attached.
+ *
+ * The ranges are kept ordered by their start, so adding and removing one
+ * only costs a lookup plus the number of ranges that it overlaps, and
+ * removing part of a range splits it. Like a new memory mapping replaces
+ * whatever was mapped at the same addresses, adding a range replaces the
+ * parts of other ranges that it overlaps.
+ **/
 template<typename T>
 class IntervalTree
 {
   private:
-    using intervals_t = std::vector<std::pair<Interval, T>>;
+    // Keyed by the start of each interval.
+    using intervals_t = std::map<uintptr_t, std::pair<Interval, T>>;
     intervals_t d_intervals;
+    size_t d_size{0};
+
+    template<typename Map>
+    static auto firstEndingAfter(Map& intervals, uintptr_t address)
+    {
+        auto it = intervals.upper_bound(address);
+        if (it != intervals.begin() && std::prev(it)->second.first.end > address) {
+            --it;
+        }
+        return it;
+    }
 
   public:
-    using const_iterator = typename intervals_t::const_iterator;
-    using iterator = typename intervals_t::iterator;
+    class const_iterator
+    {
+      public:
+        using iterator_category = std::forward_iterator_tag;
+        using value_type = std::pair<Interval, T>;
+        using difference_type = std::ptrdiff_t;
+        using pointer = const value_type*;
+        using reference = const value_type&;
+
+        explicit const_iterator(typename intervals_t::const_iterator it)
+        : d_it(it)
+        {
+        }
+
+        reference operator*() const
+        {
+            return d_it->second;
+        }
+
+        pointer operator->() const
+        {
+            return &d_it->second;
+        }
+
+        const_iterator& operator++()
+        {
+            ++d_it;
+            return *this;
+        }
+
+        bool operator==(const const_iterator& other) const
+        {
+            return d_it == other.d_it;
+        }
+
+        bool operator!=(const const_iterator& other) const
+        {
+            return d_it != other.d_it;
+        }
+
+      private:
+        typename intervals_t::const_iterator d_it;
+    };
+    using iterator = const_iterator;
 
     void addInterval(uintptr_t start, size_t size, const T& element)
     {
         if (size <= 0) {
             return;
         }
-        d_intervals.emplace_back(Interval(start, start + size), element);
+        removeInterval(start, size);
+        d_intervals.emplace(start, std::pair<Interval, T>(Interval(start, start + size), element));
+        d_size += size;
+    }
+
+    // Call visitor(interval, value) for every interval that overlaps the
+    // given range, in order, without changing anything.
+    template<typename Visitor>
+    void visitOverlapping(uintptr_t start, size_t size, Visitor&& visitor) const
+    {
+        if (size <= 0) {
+            return;
+        }
+        const uintptr_t end = start + size;
+        for (auto it = firstEndingAfter(d_intervals, start);
+             it != d_intervals.end() && it->second.first.begin < end;
+             ++it)
+        {
+            visitor(it->second.first, it->second.second);
+        }
     }
+
     std::optional<std::vector<std::pair<Interval, T>>> removeInterval(uintptr_t start, size_t size)
     {
         if (size <= 0) {
             return std::nullopt;
         }
 
-        std::vector<std::pair<Interval, T>> new_intervals;
         std::vector<std::pair<Interval, T>> removed_intervals;
         const auto removed_interval = Interval(start, start + size);
 
-        for (auto& [interval, value] : d_intervals) {
-            std::optional<Interval> intersection = interval.intersection(removed_interval);
-            // This interval doesn't contain the element to removed_interval, so don't removed_interval
-            // anything
-            if (!intersection) {
-                new_intervals.emplace_back(interval, value);
-                continue;
-            }
-            // The interval completely overlaps with the interval that we got, so we need to
-            // remove it entirely: add it to the list of removed intervals.
-            if ((intersection == interval)) {
-                removed_intervals.emplace_back(intersection.value(), value);
-            }
-            // Check if the interval intersects from the left and then remove a piece from the start.
-            else if (intersection->leftIntersects(interval))
-            {
-                auto new_interval = Interval{intersection->end, interval.end};
-                new_intervals.emplace_back(new_interval, value);
-                removed_intervals.emplace_back(intersection.value(), value);
-            }
-            // Check if the interval intersects from the right and then remove a piece from the start.
-            else if (intersection->rightIntersects(interval))
-            {
-                auto new_interval = Interval{interval.begin, intersection->begin};
-                new_intervals.emplace_back(new_interval, value);
-                removed_intervals.emplace_back(intersection.value(), value);
+        auto it = firstEndingAfter(d_intervals, start);
+        while (it != d_intervals.end() && it->second.first.begin < removed_interval.end) {
+            auto [interval, value] = std::move(it->second);
+            const Interval intersection = interval.intersection(removed_interval).value();
+            it = d_intervals.erase(it);
+            d_size -= intersection.size();
+
+            // Keep whatever is left of the interval on either side.
+            if (interval.begin < intersection.begin) {
+                d_intervals.emplace_hint(
+                        it,
+                        interval.begin,
+                        std::pair<Interval, T>(Interval(interval.begin, intersection.begin), value));
             }
-            // The interval is contained in the chunk, so we need to remove the intersection from the
-            // middle, effectively splitting the interval in two.
-            else
-            {
-                new_intervals.emplace_back(Interval{interval.begin, intersection->begin}, value);
-                new_intervals.emplace_back(Interval{intersection->end, interval.end}, value);
-                removed_intervals.emplace_back(intersection.value(), value);
+            if (intersection.end < interval.end) {
+                d_intervals.emplace_hint(
+                        it,
+                        intersection.end,
+                        std::pair<Interval, T>(Interval(intersection.end, interval.end), value));
             }
+            removed_intervals.emplace_back(intersection, std::move(value));
         }
 
-        // Re-assign intervals after the calculation.
-        d_intervals = new_intervals;
-
         if (removed_intervals.empty()) {
             return std::nullopt;
         }
         return removed_intervals;
     }
 
-    size_t size()
+    size_t size() const noexcept
     {
-        size_t result = 0;
-        std::for_each(d_intervals.begin(), d_intervals.end(), [&](const auto& pair) {
-            result += pair.first.size();
-        });
-        return result;
+        return d_size;
     }
 
-    iterator begin()
+    const_iterator begin() const
     {
-        return d_intervals.begin();
+        return const_iterator(d_intervals.cbegin());
     }
 
-    iterator end()
+    const_iterator end() const
     {
-        return d_intervals.end();
+        return const_iterator(d_intervals.cend());
     }
 
-    const_iterator cbegin()
+    const_iterator cbegin() const
     {
-        return d_intervals.cbegin();
+        return begin();
     }
 
-    const_iterator cend()
+    const_iterator cend() const
     {
-        return d_intervals.cend();
+        return end();
     }
 };
 
+// Where an allocation was made from: its thread, its Python and native
+// stacks, and its allocator.
+struct AllocationLocation
+{
+    thread_id_t tid;
+    size_t frame_index;
+    frame_id_t native_frame_id;
+    size_t native_segment_generation;
+    hooks::Allocator allocator;
+
+    static AllocationLocation of(const Allocation& allocation)
+    {
+        return {allocation.record.tid,
+                allocation.frame_index,
+                allocation.record.native_frame_id,
+                allocation.native_segment_generation,
+                allocation.record.allocator};
+    }
+
+    bool operator==(const AllocationLocation& other) const
+    {
+        return tid == other.tid && frame_index == other.frame_index
+               && native_frame_id == other.native_frame_id
+               && native_segment_generation == other.native_segment_generation
+               && allocator == other.allocator;
+    }
+
+    struct Hash
+    {
+        size_t operator()(const AllocationLocation& location) const noexcept
+        {
+            uint64_t hash = location.tid;
+            hash = containers::combineHash(hash, location.frame_index);
+            hash = containers::combineHash(hash, location.native_frame_id);
+            hash = containers::combineHash(hash, location.native_segment_generation);
+            hash = containers::combineHash(hash, static_cast<uint64_t>(location.allocator));
+            return containers::mixHash(hash);
+        }
+    };
+};
+
+/**
+ * A temporary directory for what doesn't fit in memory, which is removed
+ * along with its files when the object goes away.
+ **/
+class SpillDirectory
+{
+  public:
+    // Constructors
+    explicit SpillDirectory(const std::string& parent);
+    SpillDirectory(const SpillDirectory&) = delete;
+    SpillDirectory& operator=(const SpillDirectory&) = delete;
+    ~SpillDirectory();
+
+    // Methods
+    // The path of a new file in the directory, which isn't created yet.
+    std::string newFile();
+    // Unbuffered I/O on the files, raising IoError when it fails. Reads only
+    // come up short at the end of the file.
+    static void append(const std::string& path, const char* data, size_t size);
+    static int open(const std::string& path);
+    static size_t read(int fd, const std::string& path, char* data, size_t size);
+
+  private:
+    // Data members
+    std::string d_path;
+    size_t d_n_files{0};
+};
+
+/**
+ * Records of a fixed size appended to a file, and then read back in the
+ * same order. Only a buffer of them is in memory at a time, and the file is
+ * never written at all if they all fit in it.
+ **/
+template<typename T>
+class SpillFile
+{
+    static_assert(std::is_trivially_copyable_v<T>);
+
+  public:
+    // Constructors
+    SpillFile(SpillDirectory& directory, size_t buffer_size)
+    : d_path(directory.newFile())
+    , d_buffer_size(std::max<size_t>(buffer_size, 1))
+    {
+    }
+
+    SpillFile(SpillFile&& other) noexcept
+    : d_path(std::move(other.d_path))
+    , d_buffer_size(other.d_buffer_size)
+    , d_buffer(std::move(other.d_buffer))
+    , d_n_written(other.d_n_written)
+    , d_position(other.d_position)
+    , d_fd(std::exchange(other.d_fd, -1))
+    {
+    }
+
+    SpillFile(const SpillFile&) = delete;
+    SpillFile& operator=(const SpillFile&) = delete;
+
+    ~SpillFile()
+    {
+        if (d_fd >= 0) {
+            ::close(d_fd);
+        }
+    }
+
+    // Methods
+    void append(const T& record)
+    {
+        d_buffer.push_back(record);
+        if (d_buffer.size() >= d_buffer_size) {
+            SpillDirectory::append(
+                    d_path,
+                    reinterpret_cast<const char*>(d_buffer.data()),
+                    d_buffer.size() * sizeof(T));
+            d_n_written += d_buffer.size();
+            d_buffer.clear();
+        }
+    }
+
+    // Start reading the records from the first one. Nothing can be appended
+    // to the file anymore.
+    void rewind()
+    {
+        d_position = 0;
+        if (d_n_written == 0) {
+            return;
+        }
+        if (!d_buffer.empty()) {
+            SpillDirectory::append(
+                    d_path,
+                    reinterpret_cast<const char*>(d_buffer.data()),
+                    d_buffer.size() * sizeof(T));
+            d_n_written += d_buffer.size();
+        }
+        d_buffer.clear();
+        d_fd = SpillDirectory::open(d_path);
+    }
+
+    // The next record, or nullptr once they have all been read, which frees
+    // the buffer.
+    const T* next()
+    {
+        if (d_position == d_buffer.size()) {
+            d_position = 0;
+            d_buffer.resize(d_fd >= 0 ? d_buffer_size : 0);
+            if (d_fd >= 0) {
+                size_t n_read = SpillDirectory::read(
+                        d_fd,
+                        d_path,
+                        reinterpret_cast<char*>(d_buffer.data()),
+                        d_buffer.size() * sizeof(T));
+                d_buffer.resize(n_read / sizeof(T));
+            }
+            if (d_buffer.empty()) {
+                d_buffer.shrink_to_fit();
+                return nullptr;
+            }
+        }
+        return &d_buffer[d_position++];
+    }
+
+  private:
+    // Data members
+    std::string d_path;
+    size_t d_buffer_size;
+    std::vector<T> d_buffer;
+    size_t d_n_written{0};
+    size_t d_position{0};
+    int d_fd{-1};
+};
+
+// A simple allocation event, as the aggregators that spill them keep it.
+struct SpilledEvent
+{
+    // The location index of the events that free their address.
+    static constexpr uint32_t FREED = std::numeric_limits<uint32_t>::max();
+
+    uint64_t index;
+    uintptr_t address;
+    uint64_t size;
+    uint64_t n_allocations;
+    uint32_t location_index;
+};
+
+/**
+ * Simple allocation events spilled to files, split by address.
+ *
+ * The allocation at an address can only be freed by the events at the same
+ * address, so every partition is a heap of its own that can be replayed
+ * without the others, needing only the memory of its own live allocations.
+ * As the events are appended in order, each file is a run sorted by their
+ * index, and what the replays of the partitions find can be merged back by
+ * it. There are as many partitions as it takes for the live allocations of
+ * each one to fit in the memory budget, assuming that every allocation seen
+ * could be live at the same time.
+ **/
+class SpilledEvents
+{
+  public:
+    // Constructors
+    SpilledEvents(const std::string& directory, size_t n_partitions, size_t memory_budget);
+
+    // Methods
+    // How many partitions max_live_allocations live allocations need to fit
+    // in the budget, if each one takes bytes_per_allocation.
+    static size_t
+    partitionsFor(size_t memory_budget, size_t max_live_allocations, size_t bytes_per_allocation);
+    void add(const SpilledEvent& event);
+    size_t numPartitions() const noexcept;
+    SpillFile<SpilledEvent>& partition(size_t index);
+    SpillDirectory& directory() noexcept;
+    // How many records each file buffers, to keep some of the budget for
+    // the replays.
+    size_t bufferSize(size_t record_size) const noexcept;
+
+  private:
+    // Data members
+    SpillDirectory d_directory;
+    size_t d_memory_budget;
+    std::vector<SpillFile<SpilledEvent>> d_partitions;
+};
+
+/**
+ * The heap at the end of a sequence of allocation events.
+ *
+ * Live simple allocations are only kept as their size, their count and the
+ * index of their location, and the first allocation seen at every location
+ * stands for all the others in the snapshot, with the address of one of
+ * those that are still live.
+ **/
 class SnapshotAllocationAggregator
 {
+  public:
+    void addAllocation(const Allocation& allocation);
+    // Add what is left mapped of a ranged allocation.
+    void addRange(const Interval& range, const Allocation& allocation);
+    // Forget the simple allocation at the address, if it's live.
+    void removeAllocation(uintptr_t address);
+    // Keep the simple allocations in files in a new directory under the
+    // given one, instead of in memory, if more than memory_budget bytes of
+    // them could be live, going by how many allocations there are at most.
+    // It must be called before any allocation is added.
+    void spillTo(const std::string& directory, size_t memory_budget, size_t max_allocations);
+    reduced_snapshot_map_t getSnapshotAllocations(bool merge_threads);
+
+  private:
+    struct LiveAllocation
+    {
+        uint32_t location_index;
+        size_t size;
+        size_t n_allocations;
+    };
+
+    // Methods
+    uint32_t locationIndex(const Allocation& allocation);
+    void spillEvent(uintptr_t address, uint32_t location_index, size_t size, size_t n_allocations);
+    void addLiveAllocations(bool merge_threads, reduced_snapshot_map_t& stack_to_allocation) const;
+
+    // Data members
+    IntervalTree<Allocation> d_interval_tree;
+    containers::FlatHashMap<AllocationLocation, uint32_t, AllocationLocation::Hash> d_location_indexes{};
+    std::vector<Allocation> d_locations{};
+    containers::FlatHashMap<uintptr_t, LiveAllocation> d_live_allocations{};
+    std::unique_ptr<SpilledEvents> d_spilled_events;
+    size_t d_n_spilled_events{0};
+};
+
+/**
+ * How long the allocations left at the end of a sequence had been alive, by
+ * stack, found in the same pass that reduces them.
+ *
+ * Allocations carry no time of their own, but the memory records that the
+ * tracker writes every few milliseconds do, and the reader counts how many
+ * allocations it had read when it found each of them. Every allocation is
+ * given the time of the last memory record found before it, or the start of
+ * the capture if there was none, so ages are as coarse as the interval of
+ * the memory records.
+ *
+ * The ages are put in buckets that double in width: bucket 0 holds the
+ * allocations that are less than a millisecond old, and bucket i the ones
+ * that are at least 2^(i-1) and less than 2^i milliseconds old.
+ **/
+class LeakAgeAggregator
+{
+  public:
+    struct AgeBucket
+    {
+        size_t n_allocations{0};
+        size_t bytes{0};
+    };
+
+    struct StackAges
+    {
+        // The first allocation of the stack, with the size and the count of
+        // all the ones that are left.
+        Allocation allocation;
+        std::vector<AgeBucket> buckets;
+    };
+
+    explicit LeakAgeAggregator(millis_t start_time);
+
+    // Allocations must be added in the order that the reader returned them,
+    // along with the memory records that it had found by then.
+    void addAllocation(
+            const Allocation& allocation,
+            const std::vector<MemoryRecord>& memory_records,
+            const std::vector<size_t>& memory_record_allocations);
+    std::vector<StackAges> getStackAges(millis_t end_time, bool merge_threads) const;
+    static size_t bucketIndex(millis_t age);
+
   private:
-    size_t d_index{0};
+    struct LiveAllocation
+    {
+        uint32_t location_index;
+        size_t size;
+        size_t n_allocations;
+        millis_t time;
+    };
+
+    struct LiveRange
+    {
+        uint32_t location_index;
+        size_t n_allocations;
+        millis_t time;
+    };
+
+    // Methods
+    uint32_t locationIndex(const Allocation& allocation);
+
+    // Data members
+    millis_t d_time;
+    size_t d_n_allocations{0};
+    size_t d_n_memory_records{0};
+    IntervalTree<LiveRange> d_ranges;
+    containers::FlatHashMap<AllocationLocation, uint32_t, AllocationLocation::Hash> d_location_indexes{};
+    std::vector<Allocation> d_locations{};
+    containers::FlatHashMap<uintptr_t, LiveAllocation> d_live_allocations{};
+};
+
+/**
+ * The heap of a process that is still running, kept up to date as its
+ * allocations arrive.
+ *
+ * Besides the live allocations, this keeps what each location (its Python
+ * stack and thread) has allocated, and updates it on every event. Getting a
+ * snapshot then only goes over the locations, which are far fewer than the
+ * live allocations, instead of reducing all of them every time. Ranged
+ * allocations are few and can be partially deallocated, so they are still
+ * added to the snapshot when it is taken.
+ *
+ * Every event advances a version, and each location remembers the version
+ * of the last event that changed it, so a client that already has the
+ * snapshot at some version can ask for just the locations that changed
+ * since then. Locations are never forgotten, so that the ones that are left
+ * with nothing can be reported as such.
+ **/
+class LiveSnapshotAggregator
+{
+  public:
+    using version_t = uint64_t;
+
+    void addAllocation(const Allocation& allocation);
+    reduced_snapshot_map_t getSnapshotAllocations(bool merge_threads) const;
+    // The current totals of the locations that changed after the given
+    // version, including the ones that have nothing allocated anymore, and
+    // the version that they are at.
+    std::pair<version_t, reduced_snapshot_map_t> getSnapshotChanges(version_t since) const;
+
+  private:
+    using location_t = std::pair<FrameTree::index_t, thread_id_t>;
+
+    struct Location
+    {
+        // The size and count of the live simple allocations of the location,
+        // with the other fields taken from the first one of them.
+        Allocation totals;
+        version_t version;
+    };
+
+    // Methods
+    Location& touchLocation(const Allocation& allocation);
+    void addToLocation(const Allocation& allocation);
+    void removeFromLocation(const Allocation& allocation);
+    void touchRemovedRanges(const std::optional<std::vector<std::pair<Interval, Allocation>>>& removed);
+
+    // Data members
+    version_t d_version{0};
+    containers::FlatHashMap<uintptr_t, Allocation> d_ptr_to_allocation{};
     IntervalTree<Allocation> d_interval_tree;
-    std::unordered_map<uintptr_t, Allocation> d_ptr_to_allocation{};
+    std::unordered_map<location_t, Location, index_thread_pair_hash> d_locations{};
+};
 
+/**
+ * Periodic checkpoints of the heap over a sequence of allocation events.
+ *
+ * Getting the snapshot at some point of the sequence only needs to replay
+ * the events since the last checkpoint before it, instead of all of them. A
+ * checkpoint keeps the indexes of the allocations that were live at that
+ * point, and checkpoints are never taken closer together than the number of
+ * live allocations, so that all of them together are at most as large as
+ * one index per event.
+ **/
+class HeapCheckpoints
+{
+  public:
+    explicit HeapCheckpoints(const allocations_t& records);
+
+    // The heap once the first n_records records have been applied.
+    reduced_snapshot_map_t getSnapshotAllocations(size_t n_records, bool merge_threads) const;
+    // How many records it takes to have at least n_events events, counting
+    // each reallocation as its deallocation followed by its allocation.
+    size_t recordsForEvents(size_t n_events) const;
+
+  private:
+    struct Checkpoint
+    {
+        size_t n_records;
+        size_t n_events;
+        // In the order in which they were allocated.
+        std::vector<size_t> live_allocations;
+        // What is left mapped of each ranged allocation.
+        std::vector<std::pair<Interval, size_t>> live_ranges;
+    };
+
+    static constexpr size_t MIN_CHECKPOINT_INTERVAL = 64 * 1024;
+
+    // Data members
+    const allocations_t& d_records;
+    std::vector<Checkpoint> d_checkpoints;
+};
+
+/**
+ * Aggregate a sequence of allocation events as it happens, by location.
+ *
+ * This keeps track of the memory that every location (the same thread,
+ * Python stack and native stack) had allocated at the high water mark of the
+ * heap, and of what it still has allocated, without keeping the history of
+ * the allocations. It reaches the same results as getHighWatermark() and a
+ * SnapshotAllocationAggregator replaying the whole sequence would, but in
+ * memory proportional to the live allocations and the number of locations.
+ *
+ * Rather than copying the usage of every location each time that the heap
+ * grows past its previous peak, the usage of a location at the peak is only
+ * saved when it changes for the first time after that peak.
+ **/
+class HighWaterMarkAggregator
+{
   public:
     void addAllocation(const Allocation& allocation);
-    reduced_snapshot_map_t getSnapshotAllocations(bool merge_threads);
+    std::vector<AggregatedAllocation> getAggregatedAllocations() const;
+
+  private:
+    using Location = AllocationLocation;
+
+    struct UsageHistory
+    {
+        Location location;
+        // The value of d_peak_count when the *_at_peak fields were saved.
+        size_t peak_count;
+        size_t n_allocations{0};
+        size_t bytes{0};
+        size_t n_allocations_at_peak{0};
+        size_t bytes_at_peak{0};
+    };
+
+    struct LiveAllocation
+    {
+        size_t location_index;
+        size_t size;
+        size_t n_allocations;
+    };
+
+    // Methods
+    size_t locationIndex(const Allocation& allocation);
+    UsageHistory& usageBeforeChange(size_t location_index);
+    void addToLocation(size_t location_index, size_t n_allocations, size_t bytes);
+    void removeFromLocation(size_t location_index, size_t n_allocations, size_t bytes);
+    void removeLiveAllocation(uintptr_t address);
+    void removeRange(uintptr_t address, size_t size);
+    void updatePeak();
+
+    // Data members
+    containers::FlatHashMap<Location, size_t, Location::Hash> d_location_indexes{};
+    std::vector<UsageHistory> d_usage{};
+    containers::FlatHashMap<uintptr_t, LiveAllocation> d_live_allocations{};
+    IntervalTree<size_t> d_live_ranges{};
+    size_t d_current_memory{0};
+    size_t d_peak_memory{0};
+    // How many times the heap has grown to a new peak.
+    size_t d_peak_count{0};
 };
 
-PyObject*
-Py_ListFromSnapshotAllocationRecords(const reduced_snapshot_map_t& stack_to_allocation);
+/**
+ * Summary statistics of a set of allocations, gathered as they are added.
+ *
+ * This gives the totals, the number of allocations of each allocator, the
+ * distribution of their sizes and the ones that are largest by size and by
+ * count, without keeping the allocations themselves. Sizes are only kept as
+ * the number of allocations of each distinct size, and the largest
+ * allocations are selected with a heap of just as many of them as are
+ * requested. The results are the same as the stats reporter gets from the
+ * same allocations as Python objects, ties included.
+ **/
+class AllocationStatsAggregator
+{
+  public:
+    explicit AllocationStatsAggregator(size_t num_largest);
+
+    void addAllocation(const Allocation& allocation);
+    // Add the events of a record of a capture file: a reallocation is the
+    // deallocation of its old address followed by the new allocation.
+    void addAllocationEvents(const Allocation& allocation);
+    void addSnapshot(const reduced_snapshot_map_t& snapshot);
+
+    size_t totalMemoryAllocated() const noexcept;
+    size_t totalNumAllocations() const noexcept;
+    // How many of the allocations were made by each allocator, in the order
+    // in which the allocators were first seen. Deallocators aren't counted.
+    const std::vector<std::pair<hooks::Allocator, size_t>>& allocatorCounts() const noexcept;
+    // From the largest, and in the order in which they were added if tied.
+    std::vector<Allocation> largestBySize() const;
+    std::vector<Allocation> largestByCount() const;
+
+    // The rest only consider the allocations that have a size.
+    size_t numSizedAllocations() const noexcept;
+    size_t minSize() const noexcept;
+    size_t maxSize() const noexcept;
+    // Counts of the sizes in bins of the same width on a logarithmic scale,
+    // each with the largest size that it's meant to hold.
+    std::vector<std::pair<size_t, size_t>> sizeHistogram(size_t bins) const;
+    // The smallest size that is at least as large as the given percentage of the sizes.
+    size_t sizePercentile(double percentile) const;
+
+  private:
+    struct RankedAllocation
+    {
+        size_t key;
+        size_t order;
+        Allocation allocation;
+    };
+
+    // Methods
+    static bool ranksHigher(const RankedAllocation& lhs, const RankedAllocation& rhs);
+    void rank(std::vector<RankedAllocation>& heap, size_t key, const Allocation& allocation);
+    static std::vector<Allocation> fromLargest(std::vector<RankedAllocation> heap);
+
+    // Data members
+    size_t d_num_largest;
+    size_t d_num_added{0};
+    size_t d_total_memory_allocated{0};
+    size_t d_total_num_allocations{0};
+    std::vector<std::pair<hooks::Allocator, size_t>> d_allocator_counts{};
+    containers::FlatHashMap<size_t, size_t> d_size_counts{};
+    size_t d_num_sized_allocations{0};
+    size_t d_min_size{0};
+    size_t d_max_size{0};
+    // Heaps with the lowest ranked of the largest allocations at the front.
+    std::vector<RankedAllocation> d_largest_by_size{};
+    std::vector<RankedAllocation> d_largest_by_count{};
+};
 
 struct HighWatermark
 {
@@ -170,13 +790,188 @@ struct HighWatermark
     size_t peak_memory{0};
 };
 
+/**
+ * Find the high water mark of a sequence of allocation events as it happens.
+ *
+ * Only the sizes of the live allocations are kept, so the sequence doesn't
+ * need to be in memory to find where the heap peaked. The result is the same
+ * as getHighWatermark() would give for the events seen so far.
+ *
+ * When even the live allocations may not fit in memory, the simple ones can
+ * be spilled to files instead, split by address. The change that each event
+ * made to the heap is then only known once the events of each partition are
+ * replayed, and the peak is found by merging those changes back in order,
+ * with the ones of the ranged allocations, which are always kept in memory.
+ **/
+class HighWatermarkFinder
+{
+  public:
+    void processAllocation(const Allocation& allocation);
+    // The same, with only the fields of the allocation that matter here.
+    void processAllocation(
+            hooks::Allocator allocator,
+            uintptr_t address,
+            size_t size,
+            uintptr_t realloc_old_address);
+    // Spill the simple allocations like SnapshotAllocationAggregator::spillTo does.
+    void spillTo(const std::string& directory, size_t memory_budget, size_t max_allocations);
+    // A finder that spilled its allocations finds the high water mark when
+    // this is first called, and can't process any more events after that.
+    HighWatermark getHighWatermark();
+    // The memory that the events seen so far left allocated, which isn't
+    // known for a finder that spills until its high water mark is found.
+    size_t currentMemory() const noexcept;
+
+  private:
+    // A change to the heap by the event at an index, and whether the peak
+    // is looked for after it.
+    struct HeapChange
+    {
+        uint64_t index;
+        int64_t delta;
+        bool updates_peak;
+    };
+
+    // Methods
+    void updatePeak();
+    void applyAllocation(
+            hooks::Allocator allocator,
+            uintptr_t address,
+            size_t size,
+            uintptr_t realloc_old_address);
+    void spillAllocation(
+            hooks::Allocator allocator,
+            uintptr_t address,
+            size_t size,
+            uintptr_t realloc_old_address);
+    void findSpilledHighWatermark();
+
+    // Data members
+    size_t d_index{0};
+    size_t d_current_memory{0};
+    HighWatermark d_result{};
+    containers::FlatHashMap<uintptr_t, size_t> d_ptr_to_size{};
+    IntervalTree<size_t> d_mmap_intervals{};
+    bool d_updated_peak{false};
+    std::unique_ptr<SpilledEvents> d_spilled_events;
+    std::vector<HeapChange> d_ranged_changes;
+};
+
+// The progress made is reported as the HIGH_WATERMARK phase, if there's
+// somewhere to report it to, and a cancelled progress stops it early.
 HighWatermark
-getHighWatermark(const allocations_t& sum);
+getHighWatermark(const allocations_t& sum, ReadProgress* progress = nullptr);
+
+/**
+ * A timeline of the resident size and of the tracked heap, downsampled to a
+ * given number of points, found in a single pass over the allocations.
+ *
+ * The heap is replayed like HighWatermarkFinder does, and the lowest and
+ * highest it got between each two memory records are kept, so a point
+ * covers every event of its time span and not only the heap at the times
+ * of its memory records. Each point also tells how many events it took to
+ * reach its highest heap, which is where a snapshot of that peak is.
+ **/
+class MemoryTimelineAggregator
+{
+  public:
+    struct Point
+    {
+        // The times of the first and the last memory record of the point.
+        millis_t start_time;
+        millis_t end_time;
+        size_t min_rss;
+        size_t max_rss;
+        size_t min_heap;
+        size_t max_heap;
+        // Counting each reallocation as its deallocation and its allocation.
+        size_t peak_events;
+        size_t n_memory_records;
+    };
+
+    // Allocations must be added in the order that the reader returned them,
+    // along with the memory records that it had found by then.
+    void addAllocation(
+            const Allocation& allocation,
+            const std::vector<MemoryRecord>& memory_records,
+            const std::vector<size_t>& memory_record_allocations);
+    // Memory records are put in n_points spans of the same duration, and
+    // the spans without any are left out.
+    std::vector<Point> getTimeline(
+            const std::vector<MemoryRecord>& memory_records,
+            const std::vector<size_t>& memory_record_allocations,
+            size_t n_points);
+
+  private:
+    // What the heap did since the memory record before.
+    struct Span
+    {
+        size_t min_heap;
+        size_t max_heap;
+        size_t peak_events;
+    };
+
+    void addMemoryRecords(const std::vector<size_t>& memory_record_allocations, size_t n_allocations);
+
+    HighWatermarkFinder d_heap;
+    size_t d_n_allocations{0};
+    size_t d_n_events{0};
+    Span d_span{0, 0, 0};
+    std::vector<Span> d_spans;
+};
+
+/**
+ * The high water mark of a capture file, kept in a hidden file next to it.
+ *
+ * Finding the high water mark takes a pass over every allocation in the
+ * capture, which for a streaming reader is a whole extra pass over the file,
+ * so reports that run one after another on the same capture share it through
+ * this index. The size, modification time and inode of the capture file are
+ * taken when the index is created, and an index written for a capture file
+ * that doesn't match them anymore is ignored.
+ **/
+class HighWatermarkIndex
+{
+  public:
+    explicit HighWatermarkIndex(const std::string& capture_file);
+
+    // Methods
+    bool read(HighWatermark& watermark) const;
+    // Failing to write the index only means that the next reader won't find it.
+    void write(const HighWatermark& watermark) const;
+    const std::string& path() const noexcept;
+
+  private:
+    // Data members
+    std::string d_path;
+    bool d_valid{false};
+    uint64_t d_capture_size{0};
+    int64_t d_capture_mtime_ns{0};
+    uint64_t d_capture_inode{0};
+};
 
-PyObject*
-Py_GetSnapshotAllocationRecords(
+// The heap after the record at the given index, by location, found by up
+// to max_workers threads.
+reduced_snapshot_map_t
+getSnapshotAllocations(
         const allocations_t& all_records,
         size_t record_index,
+        bool merge_threads,
+        size_t max_workers = 1);
+
+HighWatermark
+getAggregatedHighWatermark(const std::vector<AggregatedAllocation>& aggregated_allocations);
+
+reduced_snapshot_map_t
+getAggregatedSnapshotAllocations(
+        const std::vector<AggregatedAllocation>& aggregated_allocations,
+        bool high_water_mark,
         bool merge_threads);
 
+// What each location allocated over the whole capture, from the counts
+// written for it by a tracker using the FILEFORMAT_ALLOCATION_COUNTS format.
+// Locations are told apart by their allocator and their native stack too.
+std::vector<Allocation>
+getAllocationCounts(const std::vector<AllocationCounts>& allocation_counts, bool merge_threads);
+
 }  // namespace memray::api
@@ -1,12 +1,104 @@
+from _memray.allocation_store cimport AllocationStore
+from _memray.read_progress cimport ReadProgress
+from _memray.records cimport AggregatedAllocation
 from _memray.records cimport Allocation
+from _memray.records cimport AllocationCounts
+from _memray.records cimport MemoryRecord
 from libcpp cimport bool
+from libcpp.string cimport string
+from libcpp.utility cimport pair
 from libcpp.vector cimport vector
 
 
+cdef extern from "hooks.h":
+    cdef enum Allocator 'memray::hooks::Allocator':
+        AllocatorMalloc 'memray::hooks::Allocator::MALLOC'
+
+
 cdef extern from "snapshot.h" namespace "memray::api":
     cdef struct HighWatermark:
         size_t index
         size_t peak_memory
 
-    HighWatermark getHighWatermark(const vector[Allocation]& records) except+
-    object Py_GetSnapshotAllocationRecords(const vector[Allocation]& all_records, size_t record_index, bool merge_threads) except+
+    cdef cppclass SnapshotEntry "memray::api::reduced_snapshot_map_t::value_type":
+        Allocation second
+
+    cdef cppclass reduced_snapshot_map_t:
+        cppclass const_iterator:
+            const SnapshotEntry& operator*()
+            const_iterator operator++()
+            bool operator!=(const_iterator)
+
+        const_iterator begin() const
+        const_iterator end() const
+
+    cdef cppclass SnapshotAllocationAggregator:
+        void addAllocation(const Allocation& allocation) nogil except+
+        void spillTo(const string& directory, size_t memory_budget, size_t max_allocations) except+
+        reduced_snapshot_map_t getSnapshotAllocations(bool merge_threads) except+
+
+    cdef cppclass HighWatermarkFinder:
+        void processAllocation(const Allocation& allocation) nogil except+
+        void spillTo(const string& directory, size_t memory_budget, size_t max_allocations) except+
+        HighWatermark getHighWatermark() except+
+
+    cdef cppclass HighWatermarkIndex:
+        HighWatermarkIndex(const string& capture_file) except+
+        bool read(HighWatermark& watermark)
+        void write(const HighWatermark& watermark)
+        const string& path()
+
+    cdef cppclass AgeBucket "memray::api::LeakAgeAggregator::AgeBucket":
+        size_t n_allocations
+        size_t bytes
+
+    cdef cppclass StackAges "memray::api::LeakAgeAggregator::StackAges":
+        Allocation allocation
+        vector[AgeBucket] buckets
+
+    cdef cppclass LeakAgeAggregator:
+        LeakAgeAggregator(long long start_time) except+
+        void addAllocation(const Allocation& allocation, const vector[MemoryRecord]& memory_records, const vector[size_t]& memory_record_allocations) nogil except+
+        vector[StackAges] getStackAges(long long end_time, bool merge_threads) except+
+
+    cdef cppclass MemoryTimelinePoint "memray::api::MemoryTimelineAggregator::Point":
+        long long start_time
+        long long end_time
+        size_t min_rss
+        size_t max_rss
+        size_t min_heap
+        size_t max_heap
+        size_t peak_events
+        size_t n_memory_records
+
+    cdef cppclass MemoryTimelineAggregator:
+        void addAllocation(const Allocation& allocation, const vector[MemoryRecord]& memory_records, const vector[size_t]& memory_record_allocations) nogil except+
+        vector[MemoryTimelinePoint] getTimeline(const vector[MemoryRecord]& memory_records, const vector[size_t]& memory_record_allocations, size_t n_points) except+
+
+    cdef cppclass HeapCheckpoints:
+        HeapCheckpoints(const AllocationStore& records) except+
+        reduced_snapshot_map_t getSnapshotAllocations(size_t n_records, bool merge_threads) except+
+        size_t recordsForEvents(size_t n_events)
+
+    cdef cppclass AllocationStatsAggregator:
+        AllocationStatsAggregator(size_t num_largest) except+
+        void addAllocation(const Allocation& allocation) nogil except+
+        void addAllocationEvents(const Allocation& allocation) nogil except+
+        void addSnapshot(const reduced_snapshot_map_t& snapshot) except+
+        size_t totalMemoryAllocated()
+        size_t totalNumAllocations()
+        const vector[pair[Allocator, size_t]]& allocatorCounts()
+        vector[Allocation] largestBySize() except+
+        vector[Allocation] largestByCount() except+
+        size_t numSizedAllocations()
+        size_t minSize()
+        size_t maxSize()
+        vector[pair[size_t, size_t]] sizeHistogram(size_t bins) except+
+        size_t sizePercentile(double percentile) except+
+
+    HighWatermark getHighWatermark(const AllocationStore& records) except+
+    HighWatermark getHighWatermark(const AllocationStore& records, ReadProgress* progress) except+
+    reduced_snapshot_map_t getSnapshotAllocations(const AllocationStore& all_records, size_t record_index, bool merge_threads, size_t max_workers) except+
+    HighWatermark getAggregatedHighWatermark(const vector[AggregatedAllocation]& aggregated_allocations) except+
+    reduced_snapshot_map_t getAggregatedSnapshotAllocations(const vector[AggregatedAllocation]& aggregated_allocations, bool high_water_mark, bool merge_threads) except+
+    vector[Allocation] getAllocationCounts(const vector[AllocationCounts]& allocation_counts, bool merge_threads) except+
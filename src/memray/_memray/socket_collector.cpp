@@ -0,0 +1,223 @@
+#include <cerrno>
+#include <cstring>
+
+#include <arpa/inet.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include "exceptions.h"
+#include "logging.h"
+#include "socket_collector.h"
+#include "source.h"
+
+namespace memray::socket_thread {
+
+using namespace memray::exception;
+
+namespace {  // unnamed
+
+// How long a new connection has to send its header before it's dropped, so
+// that a client that doesn't send anything can't hold up the others.
+constexpr time_t HEADER_TIMEOUT_SECONDS = 5;
+
+void
+setReceiveTimeout(int sockfd, time_t seconds)
+{
+    timeval timeout{};
+    timeout.tv_sec = seconds;
+    if (::setsockopt(sockfd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout)) == -1) {
+        LOG(WARNING) << "Encountered error in 'setsockopt' call: " << strerror(errno);
+    }
+}
+
+}  // namespace
+
+SocketCollector::SocketCollector(const std::string& host, uint16_t port)
+{
+    sockaddr_in si{};
+    si.sin_family = AF_INET;
+    si.sin_addr.s_addr = ::inet_addr(host.c_str());
+    si.sin_port = htons(port);
+    int yes = 1;
+
+    if ((d_listen_fd = ::socket(PF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0)) == -1) {
+        LOG(ERROR) << "Encountered error in 'socket' call: " << strerror(errno);
+        throw IoError{"Failed to open socket"};
+    }
+
+    if (::setsockopt(d_listen_fd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(int)) == -1) {
+        closeDescriptors();
+        LOG(ERROR) << "Encountered error in 'setsockopt' call: " << strerror(errno);
+        throw IoError{"Failed to set socket options"};
+    }
+
+    if (::bind(d_listen_fd, (sockaddr*)&si, sizeof si) == -1) {
+        closeDescriptors();
+        LOG(WARNING) << "Encountered error in 'bind' call: " << strerror(errno);
+        throw IoError{"Failed to bind to host and port"};
+    }
+
+    if (::listen(d_listen_fd, SOMAXCONN) == -1) {
+        closeDescriptors();
+        throw IoError{"Encountered error in listen call"};
+    }
+
+    socklen_t length = sizeof si;
+    if (::getsockname(d_listen_fd, (sockaddr*)&si, &length) == -1) {
+        closeDescriptors();
+        throw IoError{"Encountered error in getsockname call"};
+    }
+    d_port = ntohs(si.sin_port);
+
+    d_epoll_fd = ::epoll_create1(EPOLL_CLOEXEC);
+    d_wakeup_fd = ::eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (d_epoll_fd == -1 || d_wakeup_fd == -1) {
+        closeDescriptors();
+        throw IoError{"Failed to set up the collector's event loop"};
+    }
+    for (int fd : {d_listen_fd, d_wakeup_fd}) {
+        epoll_event event{};
+        event.events = EPOLLIN;
+        event.data.fd = fd;
+        if (::epoll_ctl(d_epoll_fd, EPOLL_CTL_ADD, fd, &event) == -1) {
+            closeDescriptors();
+            throw IoError{"Failed to set up the collector's event loop"};
+        }
+    }
+}
+
+SocketCollector::~SocketCollector()
+{
+    stop();
+    // The background readers close their readers and wait for their
+    // threads when they are destroyed.
+    d_connections.clear();
+    closeDescriptors();
+}
+
+void
+SocketCollector::closeDescriptors()
+{
+    for (int* fd : {&d_listen_fd, &d_epoll_fd, &d_wakeup_fd}) {
+        if (*fd != -1) {
+            ::close(*fd);
+            *fd = -1;
+        }
+    }
+}
+
+void
+SocketCollector::start()
+{
+    d_thread = std::thread(&SocketCollector::acceptConnections, this);
+}
+
+void
+SocketCollector::stop()
+{
+    if (d_stop.exchange(true)) {
+        return;
+    }
+    uint64_t one = 1;
+    if (::write(d_wakeup_fd, &one, sizeof(one)) != sizeof(one)) {
+        LOG(ERROR) << "Failed to wake up the collector: " << strerror(errno);
+    }
+    if (d_thread.joinable()) {
+        d_thread.join();
+    }
+}
+
+uint16_t
+SocketCollector::port() const
+{
+    return d_port;
+}
+
+void
+SocketCollector::acceptConnections()
+{
+    epoll_event events[2];
+    while (!d_stop) {
+        int n_events = ::epoll_wait(d_epoll_fd, events, 2, -1);
+        if (n_events == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            LOG(ERROR) << "Encountered error in 'epoll_wait' call: " << strerror(errno);
+            return;
+        }
+        for (int i = 0; i < n_events && !d_stop; ++i) {
+            if (events[i].data.fd != d_listen_fd) {
+                continue;
+            }
+            int sockfd = ::accept4(d_listen_fd, nullptr, nullptr, SOCK_CLOEXEC);
+            if (sockfd == -1) {
+                if (errno != EINTR && errno != EAGAIN && errno != ECONNABORTED) {
+                    LOG(ERROR) << "Encountered error in 'accept' call: " << strerror(errno);
+                }
+                continue;
+            }
+            addConnection(sockfd);
+        }
+    }
+}
+
+void
+SocketCollector::addConnection(int sockfd)
+{
+    std::shared_ptr<api::RecordReader> reader;
+    setReceiveTimeout(sockfd, HEADER_TIMEOUT_SECONDS);
+    try {
+        reader = std::make_shared<api::RecordReader>(io::SocketSource::fromConnectedSocket(sockfd));
+    } catch (const std::exception& e) {
+        // The source has closed the socket already.
+        LOG(WARNING) << "Dropping a connection that didn't send a valid header: " << e.what();
+        return;
+    }
+    setReceiveTimeout(sockfd, 0);
+
+    auto background_reader = std::make_unique<BackgroundSocketReader>(reader);
+    background_reader->start();
+    std::lock_guard<std::mutex> lock(d_mutex);
+    d_connections.push_back(Connection{std::move(reader), std::move(background_reader)});
+}
+
+size_t
+SocketCollector::numConnections() const
+{
+    std::lock_guard<std::mutex> lock(d_mutex);
+    return d_connections.size();
+}
+
+std::shared_ptr<api::RecordReader>
+SocketCollector::reader(size_t connection) const
+{
+    std::lock_guard<std::mutex> lock(d_mutex);
+    return d_connections.at(connection).reader;
+}
+
+BackgroundSocketReader&
+SocketCollector::backgroundReader(size_t connection) const
+{
+    // The background readers are never destroyed before the collector, so
+    // they can be used after the lock is released.
+    std::lock_guard<std::mutex> lock(d_mutex);
+    return *d_connections.at(connection).background_reader;
+}
+
+bool
+SocketCollector::isActive(size_t connection) const
+{
+    return backgroundReader(connection).is_active();
+}
+
+api::reduced_snapshot_map_t
+SocketCollector::getSnapshotAllocations(size_t connection, bool merge_threads)
+{
+    return backgroundReader(connection).getSnapshotAllocations(merge_threads);
+}
+
+}  // namespace memray::socket_thread
@@ -0,0 +1,77 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "Python.h"
+#include "record_reader.h"
+#include "socket_reader_thread.h"
+
+namespace memray::socket_thread {
+
+/**
+ * A server that any number of tracked processes can send their records to.
+ *
+ * A SocketReader connects to the one process that is waiting for it, but
+ * here the tracked processes are the ones that connect, so the children of
+ * a process that follows forks can connect too, and so can every worker of
+ * a pre-fork server. A background thread waits for new connections, and
+ * each one gets a reader of its own that is kept up to date by a
+ * BackgroundSocketReader, just like the one of a SocketReader.
+ *
+ * Connections are numbered in the order in which they were accepted, and
+ * they are kept after their process goes away, so that what it had
+ * allocated can still be looked at.
+ **/
+class SocketCollector
+{
+  public:
+    SocketCollector(SocketCollector& other) = delete;
+    SocketCollector(SocketCollector&& other) = delete;
+    void operator=(const SocketCollector&) = delete;
+    void operator=(SocketCollector&&) = delete;
+
+    // Starts listening right away. A port of 0 picks any free port.
+    SocketCollector(const std::string& host, uint16_t port);
+    ~SocketCollector();
+
+    void start();
+    void stop();
+    uint16_t port() const;
+
+    size_t numConnections() const;
+    std::shared_ptr<api::RecordReader> reader(size_t connection) const;
+    bool isActive(size_t connection) const;
+    api::reduced_snapshot_map_t getSnapshotAllocations(size_t connection, bool merge_threads);
+
+  private:
+    struct Connection
+    {
+        std::shared_ptr<api::RecordReader> reader;
+        std::unique_ptr<BackgroundSocketReader> background_reader;
+    };
+
+    // Methods
+    void acceptConnections();
+    void addConnection(int sockfd);
+    BackgroundSocketReader& backgroundReader(size_t connection) const;
+    void closeDescriptors();
+
+    // Data members
+    int d_listen_fd{-1};
+    int d_epoll_fd{-1};
+    int d_wakeup_fd{-1};
+    uint16_t d_port{0};
+    std::atomic<bool> d_stop{false};
+    mutable std::mutex d_mutex;
+    std::vector<Connection> d_connections;
+    std::thread d_thread;
+};
+
+}  // namespace memray::socket_thread
@@ -0,0 +1,19 @@
+from _memray.record_reader cimport RecordReader
+from _memray.snapshot cimport reduced_snapshot_map_t
+from libc.stdint cimport uint16_t
+from libcpp cimport bool
+from libcpp.memory cimport shared_ptr
+from libcpp.string cimport string
+
+
+cdef extern from "socket_collector.h" namespace "memray::socket_thread":
+    cdef cppclass SocketCollector:
+        SocketCollector(string host, uint16_t port) except +IOError
+
+        void start() except+
+        void stop()
+        uint16_t port()
+        size_t numConnections()
+        shared_ptr[RecordReader] reader(size_t connection) except+
+        bool isActive(size_t connection) except+
+        reduced_snapshot_map_t getSnapshotAllocations(size_t connection, bool merge_threads) except+
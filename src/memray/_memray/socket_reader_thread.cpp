@@ -19,13 +19,18 @@ BackgroundSocketReader::backgroundThreadWorker()
         switch (record_type) {
             case RecordResult::ALLOCATION_RECORD: {
                 std::lock_guard<std::mutex> lock(d_mutex);
-                const auto& record = d_record_reader->allocationRecords().back();
-                d_aggregator.addAllocation(record);
+                // The reader may release several reordered allocations at once.
+                for (const auto& record : d_record_reader->allocationRecords()) {
+                    d_aggregator.addAllocation(record);
+                }
+                d_n_allocations += d_record_reader->allocationRecords().size();
                 // Clear the records in the reader to avoid growing memory indefinitely
                 d_record_reader->clearRecords();
                 break;
             }
 
+            case RecordResult::AGGREGATED_ALLOCATION_RECORD:
+            case RecordResult::ALLOCATION_COUNTS_RECORD:
             case RecordResult::MEMORY_RECORD: {
                 break;
             }
@@ -41,11 +46,18 @@ BackgroundSocketReader::backgroundThreadWorker()
 BackgroundSocketReader::BackgroundSocketReader(std::shared_ptr<api::RecordReader> reader)
 : d_record_reader(reader)
 {
+    // The records are read by our thread while others take snapshots.
+    d_record_reader->shareBetweenThreads();
 }
 
 void
 BackgroundSocketReader::start()
 {
+    if (d_record_reader->getHeader().native_traces) {
+        d_record_reader->deferSymbolResolution();
+        d_symbolizer_thread =
+                std::thread(&api::RecordReader::resolveDeferredSymbols, d_record_reader.get());
+    }
     d_thread = std::thread(&BackgroundSocketReader::backgroundThreadWorker, this);
 }
 
@@ -54,18 +66,42 @@ BackgroundSocketReader::~BackgroundSocketReader()
     d_record_reader->close();
     d_stop_thread = true;
     d_thread.join();
+    if (d_symbolizer_thread.joinable()) {
+        d_record_reader->stopResolvingSymbols();
+        d_symbolizer_thread.join();
+    }
+}
+
+uint64_t
+BackgroundSocketReader::symbolsVersion() const
+{
+    return d_record_reader->symbolsVersion();
+}
+
+api::reduced_snapshot_map_t
+BackgroundSocketReader::getSnapshotAllocations(bool merge_threads)
+{
+    std::lock_guard<std::mutex> lock(d_mutex);
+    return d_aggregator.getSnapshotAllocations(merge_threads);
+}
+
+std::pair<api::LiveSnapshotAggregator::version_t, api::reduced_snapshot_map_t>
+BackgroundSocketReader::getSnapshotChanges(uint64_t since)
+{
+    std::lock_guard<std::mutex> lock(d_mutex);
+    return d_aggregator.getSnapshotChanges(since);
 }
 
-PyObject*
-BackgroundSocketReader::Py_GetSnapshotAllocationRecords(bool merge_threads)
+LiveStats
+BackgroundSocketReader::getLiveStats()
 {
-    api::reduced_snapshot_map_t stack_to_allocation;
+    LiveStats stats;
     {
         std::lock_guard<std::mutex> lock(d_mutex);
-        stack_to_allocation = d_aggregator.getSnapshotAllocations(merge_threads);
+        stats.n_allocations = d_n_allocations;
     }
-
-    return api::Py_ListFromSnapshotAllocationRecords(stack_to_allocation);
+    stats.sink = d_record_reader->sinkLag();
+    return stats;
 }
 
 bool
@@ -4,6 +4,7 @@
 #include <memory>
 #include <mutex>
 #include <thread>
+#include <utility>
 
 #include "Python.h"
 #include "record_reader.h"
@@ -11,6 +12,14 @@
 
 namespace memray::socket_thread {
 
+// How well the reader keeps up with the tracked process.
+struct LiveStats
+{
+    // The allocations and deallocations read so far.
+    uint64_t n_allocations{0};
+    api::SinkLag sink{};
+};
+
 class BackgroundSocketReader
 {
   private:
@@ -20,8 +29,12 @@ class BackgroundSocketReader
     std::mutex d_mutex;
     std::shared_ptr<api::RecordReader> d_record_reader;
 
-    api::SnapshotAllocationAggregator d_aggregator;
+    api::LiveSnapshotAggregator d_aggregator;
+    uint64_t d_n_allocations{0};
     std::thread d_thread;
+    // Resolves the symbols of the native frames as they arrive, so that
+    // getting the stacks of the snapshots never has to wait for them.
+    std::thread d_symbolizer_thread;
 
     void backgroundThreadWorker();
 
@@ -36,7 +49,12 @@ class BackgroundSocketReader
 
     void start();
     bool is_active() const;
-    PyObject* Py_GetSnapshotAllocationRecords(bool merge_threads);
+    // Bumped every time more native frames have had their symbols resolved.
+    uint64_t symbolsVersion() const;
+    api::reduced_snapshot_map_t getSnapshotAllocations(bool merge_threads);
+    std::pair<api::LiveSnapshotAggregator::version_t, api::reduced_snapshot_map_t>
+    getSnapshotChanges(uint64_t since);
+    LiveStats getLiveStats();
 };
 
 }  // namespace memray::socket_thread
@@ -1,13 +1,24 @@
 from _memray.record_reader cimport RecordReader
+from _memray.record_reader cimport SinkLag
+from _memray.snapshot cimport reduced_snapshot_map_t
+from libc.stdint cimport uint64_t
 from libcpp cimport bool
 from libcpp cimport int
 from libcpp.memory cimport shared_ptr
+from libcpp.utility cimport pair
 
 
 cdef extern from "socket_reader_thread.h" namespace "memray::socket_thread":
+    cdef struct LiveStats:
+        uint64_t n_allocations
+        SinkLag sink
+
     cdef cppclass BackgroundSocketReader:
         BackgroundSocketReader(shared_ptr[RecordReader]) except+
 
         void start() except+
         bool is_active()
-        object Py_GetSnapshotAllocationRecords(bool merge_threads)
+        uint64_t symbolsVersion()
+        reduced_snapshot_map_t getSnapshotAllocations(bool merge_threads) except+
+        pair[uint64_t, reduced_snapshot_map_t] getSnapshotChanges(uint64_t since) except+
+        LiveStats getLiveStats() except+
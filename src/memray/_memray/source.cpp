@@ -3,10 +3,14 @@
 #include <cstdio>
 #include <cstring>
 #include <iostream>
+#include <limits>
 #include <netdb.h>
 #include <sstream>
 #include <stdexcept>
+#include <fcntl.h>
+#include <sys/mman.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
 #include <unistd.h>
 
 #include <chrono>
@@ -22,31 +26,207 @@ using namespace memray::exception;
 
 namespace memray::io {
 
+ZstdDecompressingBuf::ZstdDecompressingBuf(std::streambuf* source)
+: d_source(source)
+, d_context(ZSTD_createDCtx())
+, d_input(ZSTD_DStreamInSize())
+, d_output(ZSTD_DStreamOutSize())
+{
+    if (!d_context) {
+        throw std::bad_alloc();
+    }
+    setg(d_output.data(), d_output.data(), d_output.data());
+}
+
+ZstdDecompressingBuf::~ZstdDecompressingBuf()
+{
+    ZSTD_freeDCtx(d_context);
+}
+
+int
+ZstdDecompressingBuf::underflow()
+{
+    if (gptr() < egptr()) {
+        return traits_type::to_int_type(*gptr());
+    }
+
+    // A single block may need more input than what we have before it
+    // produces any output, so keep going until it does.
+    while (true) {
+        if (d_input_pos == d_input_size) {
+            d_input_size = d_source->sgetn(d_input.data(), d_input.size());
+            d_input_pos = 0;
+            d_input_total += d_input_size;
+            if (d_input_size == 0) {
+                return traits_type::eof();
+            }
+        }
+
+        ZSTD_inBuffer input{d_input.data(), d_input_size, d_input_pos};
+        ZSTD_outBuffer output{d_output.data(), d_output.size(), 0};
+        size_t ret = ZSTD_decompressStream(d_context, &output, &input);
+        d_input_pos = input.pos;
+        if (ZSTD_isError(ret)) {
+            LOG(ERROR) << "Failed to decompress input file: " << ZSTD_getErrorName(ret);
+            return traits_type::eof();
+        }
+        if (output.pos) {
+            setg(d_output.data(), d_output.data(), d_output.data() + output.pos);
+            return traits_type::to_int_type(*gptr());
+        }
+    }
+}
+
+uint64_t
+ZstdDecompressingBuf::bytesConsumed() const noexcept
+{
+    return d_input_total - (d_input_size - d_input_pos);
+}
+
 FileSource::FileSource(const std::string& file_name)
 : d_file_name(file_name)
 {
-    d_stream.open(d_file_name, std::ios::binary | std::ios::in);
-    if (!d_stream) {
-        throw IoError{"Could not open file " + file_name + ": " + std::string(strerror(errno))};
+    open(0, std::numeric_limits<uint64_t>::max(), true);
+}
+
+FileSource::FileSource(const std::string& file_name, uint64_t start, uint64_t end)
+: d_file_name(file_name)
+{
+    open(start, end, false);
+}
+
+void
+FileSource::open(uint64_t start, uint64_t end, bool whole_file)
+{
+    int fd = ::open(d_file_name.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        throw IoError{"Could not open file " + d_file_name + ": " + std::string(strerror(errno))};
+    }
+    struct stat info;
+    if (::fstat(fd, &info) != 0) {
+        int error = errno;
+        ::close(fd);
+        throw IoError{"Could not open file " + d_file_name + ": " + std::string(strerror(error))};
+    }
+
+    // Files written by a CompressedFileSink start with a zstd frame.
+    unsigned char magic[4] = {};
+    bool compressed = false;
+    if (::pread(fd, magic, sizeof(magic), 0) == sizeof(magic)) {
+        uint32_t value = magic[0] | magic[1] << 8 | magic[2] << 16 | static_cast<uint32_t>(magic[3]) << 24;
+        compressed = value == ZSTD_MAGICNUMBER;
+    }
+    if (compressed) {
+        ::close(fd);
+        if (!whole_file) {
+            // The offsets in a compressed file are those of the uncompressed stream.
+            throw IoError{"Can't read part of compressed file " + d_file_name};
+        }
+        d_file_stream.open(d_file_name, std::ios::binary | std::ios::in);
+        if (!d_file_stream) {
+            throw IoError{"Could not open file " + d_file_name + ": " + std::string(strerror(errno))};
+        }
+        d_decompressing_buf = std::make_unique<ZstdDecompressingBuf>(d_file_stream.rdbuf());
+        d_stream.rdbuf(d_decompressing_buf.get());
+        d_compressed_size = info.st_size;
+        return;
+    }
+
+    d_map_size = info.st_size;
+    if (d_map_size) {
+        void* map = ::mmap(nullptr, d_map_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (map == MAP_FAILED) {
+            int error = errno;
+            ::close(fd);
+            throw IoError{"Could not map file " + d_file_name + ": " + std::string(strerror(error))};
+        }
+        d_map = static_cast<char*>(map);
+    }
+    ::close(fd);
+    d_mapped = true;
+    d_start = d_position = d_map + std::min<uint64_t>(start, d_map_size);
+    d_end = d_map + std::min<uint64_t>(end, d_map_size);
+
+    // The records are read once, from the start to the end.
+    if (d_position < d_end) {
+        static const uintptr_t page_size = ::sysconf(_SC_PAGESIZE);
+        auto first_page = reinterpret_cast<uintptr_t>(d_position) & ~(page_size - 1);
+        ::madvise(reinterpret_cast<void*>(first_page),
+                  reinterpret_cast<uintptr_t>(d_end) - first_page,
+                  MADV_SEQUENTIAL);
     }
 }
 
 bool
 FileSource::read(char* stream, ssize_t length)
 {
-    return !d_stream.read(stream, length).fail();
+    if (!d_mapped) {
+        return !d_stream.read(stream, length).fail();
+    }
+    if (static_cast<size_t>(length) > static_cast<size_t>(d_end - d_position)) {
+        // Like a stream, fail from now on.
+        d_position = d_end;
+        return false;
+    }
+    ::memcpy(stream, d_position, length);
+    d_position += length;
+    return true;
 }
 
 bool
 FileSource::getline(std::string& result, char delimiter)
 {
-    std::getline(d_stream, result, delimiter);
-    if (!d_stream) {
+    if (!d_mapped) {
+        std::getline(d_stream, result, delimiter);
+        if (!d_stream) {
+            return false;
+        }
+        return true;
+    }
+    std::string_view view;
+    if (!getlineView(view, delimiter)) {
+        return false;
+    }
+    result.assign(view);
+    return true;
+}
+
+bool
+FileSource::getlineView(std::string_view& result, char delimiter)
+{
+    if (!d_mapped) {
+        return Source::getlineView(result, delimiter);
+    }
+    // Like std::getline, a string that isn't terminated ends the input, and
+    // it only fails if there's nothing left.
+    if (d_position == d_end) {
         return false;
     }
+    auto found = static_cast<const char*>(::memchr(d_position, delimiter, d_end - d_position));
+    const char* line_end = found ? found : d_end;
+    result = std::string_view(d_position, line_end - d_position);
+    d_position = found ? found + 1 : d_end;
     return true;
 }
 
+uint64_t
+FileSource::bytesRead() const
+{
+    if (d_mapped) {
+        return d_position - d_start;
+    }
+    return d_decompressing_buf ? d_decompressing_buf->bytesConsumed() : 0;
+}
+
+uint64_t
+FileSource::size() const
+{
+    if (d_mapped) {
+        return d_end - d_start;
+    }
+    return d_compressed_size;
+}
+
 void
 FileSource::close()
 {
@@ -56,17 +236,30 @@ FileSource::close()
 void
 FileSource::_close()
 {
-    d_stream.close();
-    if (d_stream.fail() && !d_stream.eof()) {
+    if (d_mapped) {
+        if (d_map) {
+            ::munmap(d_map, d_map_size);
+            d_map = nullptr;
+        }
+        d_mapped = false;
+        d_start = d_position = d_end = nullptr;
+        return;
+    }
+    if (!d_file_stream.is_open()) {
+        return;
+    }
+    d_file_stream.close();
+    if (d_file_stream.fail()) {
         // d_file_name might have been already destroyed at this point, so don't
         // try to print it
         std::cerr << "Failed to close output file, results might be incomplete" << std::endl;
     }
 }
+
 bool
 FileSource::is_open()
 {
-    return d_stream.is_open();
+    return d_mapped || d_file_stream.is_open();
 }
 
 FileSource::~FileSource()
@@ -93,19 +286,8 @@ SocketBuf::underflow()
         return traits_type::to_int_type(*gptr());
     }
 
-    ssize_t bytes_read;
-    do {
-        bytes_read = ::recv(d_sockfd, d_buf, MAX_BUF_SIZE, 0);
-    } while (bytes_read < 0 && errno == EINTR);
-
-    if (bytes_read < 0) {
-        if (d_open) {
-            LOG(ERROR) << "Encountered error in 'recv' call: " << strerror(errno);
-        }
-        return traits_type::eof();
-    }
-
-    if (bytes_read == 0) {
+    ssize_t bytes_read = receive(d_buf, MAX_BUF_SIZE);
+    if (bytes_read <= 0) {
         return traits_type::eof();
     }
 
@@ -113,11 +295,36 @@ SocketBuf::underflow()
     return traits_type::to_int_type(*gptr());
 }
 
+ssize_t
+SocketBuf::receive(char* destination, size_t length)
+{
+    ssize_t bytes_read;
+    do {
+        bytes_read = ::recv(d_sockfd, destination, length, 0);
+    } while (bytes_read < 0 && errno == EINTR);
+
+    if (bytes_read < 0 && d_open) {
+        LOG(ERROR) << "Encountered error in 'recv' call: " << strerror(errno);
+    }
+    return bytes_read;
+}
+
 std::streamsize
 SocketBuf::xsgetn(char* destination, std::streamsize length)
 {
     std::streamsize needed = length;
     while (needed > 0) {
+        if (gptr() == egptr() && needed >= MIN_DIRECT_READ_SIZE) {
+            // Buffer empty, and there's enough to read that copying it
+            // through the buffer would only cost us.
+            ssize_t bytes_read = receive(destination, needed);
+            if (bytes_read <= 0) {
+                return traits_type::eof();
+            }
+            destination += bytes_read;
+            needed -= bytes_read;
+            continue;
+        }
         if (gptr() == egptr()) {
             // Buffer empty. Get some new data, and throw if we can't.
             if (underflow() == traits_type::eof()) {
@@ -193,6 +400,16 @@ SocketSource::SocketSource(int port)
     d_socket_buf = std::make_unique<SocketBuf>(d_sockfd);
 }
 
+std::unique_ptr<SocketSource>
+SocketSource::fromConnectedSocket(int sockfd)
+{
+    std::unique_ptr<SocketSource> source(new SocketSource());
+    source->d_sockfd = sockfd;
+    source->d_is_open = true;
+    source->d_socket_buf = std::make_unique<SocketBuf>(sockfd);
+    return source;
+}
+
 bool
 SocketSource::read(char* result, ssize_t length)
 {
@@ -248,4 +465,234 @@ SocketSource::~SocketSource()
     _close();
 }
 
+SharedMemoryBuf::SharedMemoryBuf(SharedMemoryRing* ring, int fd)
+: d_ring(ring)
+, d_fd(fd)
+{
+    setg(d_buf, d_buf, d_buf);
+}
+
+void
+SharedMemoryBuf::close()
+{
+    d_open = false;
+    futexWake(d_ring->data_generation);
+}
+
+int
+SharedMemoryBuf::underflow()
+{
+    if (gptr() < egptr()) {
+        return traits_type::to_int_type(*gptr());
+    }
+
+    ssize_t bytes_read = receive(d_buf, MAX_BUF_SIZE);
+    if (bytes_read <= 0) {
+        return traits_type::eof();
+    }
+
+    setg(d_buf, d_buf, d_buf + bytes_read);
+    return traits_type::to_int_type(*gptr());
+}
+
+std::streamsize
+SharedMemoryBuf::xsgetn(char* destination, std::streamsize length)
+{
+    std::streamsize needed = length;
+    std::streamsize buffered = std::min(egptr() - gptr(), needed);
+    ::memcpy(destination, gptr(), buffered);
+    gbump(static_cast<int>(buffered));
+    destination += buffered;
+    needed -= buffered;
+
+    // Copying out of the ring is as cheap as copying out of our buffer, so
+    // the rest goes straight to the caller.
+    while (needed > 0) {
+        ssize_t bytes_read = receive(destination, needed);
+        if (bytes_read <= 0) {
+            return traits_type::eof();
+        }
+        destination += bytes_read;
+        needed -= bytes_read;
+    }
+    return length;
+}
+
+ssize_t
+SharedMemoryBuf::receive(char* destination, size_t length)
+{
+    // Returns 0 once the writer is gone and everything it wrote has been
+    // read, and -1 if we're closed first.
+    const size_t capacity = d_ring->capacity;
+    while (d_open) {
+        uint64_t head = d_ring->head.load(std::memory_order_relaxed);
+        size_t available = d_ring->tail.load(std::memory_order_seq_cst) - head;
+        if (available) {
+            size_t to_copy = std::min(length, available);
+            size_t start = head % capacity;
+            size_t first_part = std::min(to_copy, capacity - start);
+            ::memcpy(destination, d_ring->data() + start, first_part);
+            ::memcpy(destination + first_part, d_ring->data(), to_copy - first_part);
+            d_ring->head.store(head + to_copy, std::memory_order_seq_cst);
+            if (d_ring->writer_waiting.load(std::memory_order_seq_cst)) {
+                futexWake(d_ring->space_generation);
+            }
+            return to_copy;
+        }
+
+        // The writer says it's closed after it has written everything.
+        if (writerIsGone(*d_ring, d_fd) && d_ring->tail.load(std::memory_order_seq_cst) == head) {
+            return 0;
+        }
+
+        uint32_t generation = d_ring->data_generation.load(std::memory_order_seq_cst);
+        d_ring->reader_waiting.store(1, std::memory_order_seq_cst);
+        if (d_ring->tail.load(std::memory_order_seq_cst) == head
+            && !d_ring->writer_closed.load(std::memory_order_seq_cst))
+        {
+            futexWait(d_ring->data_generation, generation);
+        }
+        d_ring->reader_waiting.store(0, std::memory_order_relaxed);
+    }
+    return -1;
+}
+
+SharedMemorySource::SharedMemorySource(const std::string& name)
+{
+    std::string path = sharedMemoryPath(name);
+    while (!attach(path)) {
+        Py_BEGIN_ALLOW_THREADS;
+        LOG(DEBUG) << "No shared memory segment, sleeping before retrying...";
+        std::this_thread::sleep_for(std::chrono::milliseconds(500));
+        Py_END_ALLOW_THREADS;
+        // Give a chance to check for signals arriving so we don't block the main thread.
+        if (PyErr_CheckSignals() < 0) {
+            return;
+        }
+    }
+    d_is_open = true;
+    d_buf = std::make_unique<SharedMemoryBuf>(d_ring, d_fd);
+}
+
+bool
+SharedMemorySource::attach(const std::string& path)
+{
+    // Returns false if the writer hasn't finished creating the segment yet.
+    int fd = ::shm_open(path.c_str(), O_RDWR | O_CLOEXEC, 0);
+    if (fd < 0) {
+        if (errno == ENOENT) {
+            return false;
+        }
+        throw IoError{"Could not open shared memory segment " + path + ": " + strerror(errno)};
+    }
+    struct stat info;
+    if (::fstat(fd, &info) < 0) {
+        std::string error = strerror(errno);
+        ::close(fd);
+        throw IoError{"Could not open shared memory segment " + path + ": " + error};
+    }
+    size_t size = info.st_size;
+    if (size <= sizeof(SharedMemoryRing)) {
+        ::close(fd);
+        return false;
+    }
+    void* mapping = ::mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (mapping == MAP_FAILED) {
+        std::string error = strerror(errno);
+        ::close(fd);
+        throw IoError{"Could not map shared memory segment " + path + ": " + error};
+    }
+
+    auto ring = static_cast<SharedMemoryRing*>(mapping);
+    if (ring->magic.load(std::memory_order_acquire) != SharedMemoryRing::MAGIC) {
+        ::munmap(mapping, size);
+        ::close(fd);
+        return false;
+    }
+    // Take the lock before saying we're attached, so the writer never sees
+    // us attached without it.
+    int reader_lock_fd = ::shm_open(readerLockPath(path).c_str(), O_RDWR | O_CLOEXEC, 0);
+    if (reader_lock_fd < 0) {
+        std::string error = strerror(errno);
+        ::munmap(mapping, size);
+        ::close(fd);
+        throw IoError{"Could not open shared memory segment " + readerLockPath(path) + ": " + error};
+    }
+    if (ring->capacity != size - sizeof(SharedMemoryRing)
+        || ::flock(reader_lock_fd, LOCK_EX | LOCK_NB) < 0 || ring->reader_attached.exchange(1))
+    {
+        ::munmap(mapping, size);
+        ::close(fd);
+        ::close(reader_lock_fd);
+        throw IoError{"Shared memory segment " + path + " is already in use"};
+    }
+    d_fd = fd;
+    d_reader_lock_fd = reader_lock_fd;
+    d_mapping_size = size;
+    d_ring = ring;
+    return true;
+}
+
+bool
+SharedMemorySource::read(char* result, ssize_t length)
+{
+    if (!d_is_open) {
+        return false;
+    }
+    return d_buf->sgetn(result, length) != SharedMemoryBuf::traits_type::eof();
+}
+
+void
+SharedMemorySource::_close()
+{
+    if (!d_is_open) {
+        return;
+    }
+    d_is_open = false;
+    d_buf->close();
+    // Make the writer fail instead of waiting for us forever.
+    d_ring->reader_closed.store(1, std::memory_order_seq_cst);
+    futexWake(d_ring->space_generation);
+}
+
+void
+SharedMemorySource::close()
+{
+    _close();
+}
+
+bool
+SharedMemorySource::is_open()
+{
+    return d_is_open;
+}
+
+bool
+SharedMemorySource::getline(std::string& result, char delimiter)
+{
+    char buf;
+    while (true) {
+        buf = static_cast<char>(d_buf->sbumpc());
+        if (buf == delimiter || buf == SharedMemoryBuf::traits_type::eof()) {
+            if (!d_is_open) {
+                return false;
+            }
+            break;
+        }
+        result.push_back(buf);
+    }
+    return true;
+}
+
+SharedMemorySource::~SharedMemorySource()
+{
+    _close();
+    // Only now that nobody can be reading from it.
+    if (d_ring) {
+        ::munmap(d_ring, d_mapping_size);
+        ::close(d_fd);
+        ::close(d_reader_lock_fd);
+    }
+}
+
 }  // namespace memray::io
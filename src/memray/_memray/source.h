@@ -3,11 +3,18 @@
 #include <atomic>
 #include <cstdint>
 #include <fstream>
+#include <memory>
 #include <string>
+#include <string_view>
+#include <vector>
+
+#include <zstd.h>
+
+#include "shared_memory_ring.h"
 
 namespace memray::io {
 
-const int MAX_BUF_SIZE = 4096;
+const int MAX_BUF_SIZE = 256 * 1024;
 
 class Source
 {
@@ -17,8 +24,59 @@ class Source
     virtual bool is_open() = 0;
     virtual bool read(char* result, ssize_t length) = 0;
     virtual bool getline(std::string& result, char delimiter) = 0;
+    // Like getline(), but what the view points to is only valid until the
+    // next call to getline() or getlineView(). Sources that have the whole
+    // input in memory point into it, instead of copying each string out.
+    virtual bool getlineView(std::string_view& result, char delimiter)
+    {
+        if (!getline(d_line, delimiter)) {
+            return false;
+        }
+        result = d_line;
+        return true;
+    }
+    // How many bytes of the input have been consumed so far, and how many
+    // there are, or 0 if that isn't known. For compressed files these are
+    // the compressed bytes.
+    virtual uint64_t bytesRead() const
+    {
+        return 0;
+    }
+    virtual uint64_t size() const
+    {
+        return 0;
+    }
+
+  private:
+    std::string d_line;
+};
+
+// Decompresses on the fly a stream of zstd frames read from another buffer.
+// A truncated stream ends after the last block that could be decompressed.
+class ZstdDecompressingBuf : public std::streambuf
+{
+  public:
+    explicit ZstdDecompressingBuf(std::streambuf* source);
+    ~ZstdDecompressingBuf() override;
+    ZstdDecompressingBuf(ZstdDecompressingBuf& other) = delete;
+    ZstdDecompressingBuf(ZstdDecompressingBuf&& other) = delete;
+    void operator=(const ZstdDecompressingBuf&) = delete;
+    void operator=(ZstdDecompressingBuf&&) = delete;
+    // The compressed bytes that have been decompressed so far.
+    uint64_t bytesConsumed() const noexcept;
+
+  private:
+    int underflow() override;
+    std::streambuf* d_source;
+    ZSTD_DCtx* d_context;
+    std::vector<char> d_input;
+    size_t d_input_pos{0};
+    size_t d_input_size{0};
+    uint64_t d_input_total{0};
+    std::vector<char> d_output;
 };
 
+// Uncompressed files are mapped into memory and read straight from there.
 class FileSource : public Source
 {
   public:
@@ -28,16 +86,35 @@ class FileSource : public Source
     void operator=(FileSource&&) = delete;
 
     FileSource(const std::string& file_name);
+    // Reads only the bytes in [start, end) of a file that isn't compressed.
+    FileSource(const std::string& file_name, uint64_t start, uint64_t end);
     ~FileSource() override;
     void close() override;
     bool is_open() override;
     bool read(char* result, ssize_t length) override;
     bool getline(std::string& result, char delimiter) override;
+    bool getlineView(std::string_view& result, char delimiter) override;
+    uint64_t bytesRead() const override;
+    uint64_t size() const override;
 
   private:
+    void open(uint64_t start, uint64_t end, bool whole_file);
     void _close();
     const std::string& d_file_name;
-    std::ifstream d_stream;
+
+    // Used for compressed files.
+    std::ifstream d_file_stream;
+    std::unique_ptr<ZstdDecompressingBuf> d_decompressing_buf;
+    std::istream d_stream{nullptr};
+    uint64_t d_compressed_size{0};
+
+    // Used for everything else.
+    bool d_mapped{false};
+    char* d_map{nullptr};
+    size_t d_map_size{0};
+    const char* d_start{nullptr};
+    const char* d_position{nullptr};
+    const char* d_end{nullptr};
 };
 
 class SocketBuf : public std::streambuf
@@ -49,6 +126,10 @@ class SocketBuf : public std::streambuf
   private:
     int underflow() override;
     std::streamsize xsgetn(char_type* s, std::streamsize n) override;
+    ssize_t receive(char* destination, size_t length);
+
+    // Reads at least this large skip the buffer when it's empty.
+    static constexpr std::streamsize MIN_DIRECT_READ_SIZE = 4096;
     int d_sockfd{-1};
     char d_buf[MAX_BUF_SIZE];
     std::atomic<bool> d_open{true};
@@ -63,6 +144,9 @@ class SocketSource : public Source
     void operator=(SocketSource&&) = delete;
 
     SocketSource(int port);
+    // Reads from a socket that some other code has already connected, and
+    // takes ownership of it.
+    static std::unique_ptr<SocketSource> fromConnectedSocket(int sockfd);
     ~SocketSource() override;
     void close() override;
     bool is_open() override;
@@ -70,10 +154,56 @@ class SocketSource : public Source
     bool getline(std::string& result, char delimiter) override;
 
   private:
+    SocketSource() = default;
     void _close();
     int d_sockfd{-1};
     std::atomic<bool> d_is_open{false};
     std::unique_ptr<SocketBuf> d_socket_buf;
 };
 
+class SharedMemoryBuf : public std::streambuf
+{
+  public:
+    SharedMemoryBuf(SharedMemoryRing* ring, int fd);
+    void close();
+
+  private:
+    int underflow() override;
+    std::streamsize xsgetn(char_type* s, std::streamsize n) override;
+    ssize_t receive(char* destination, size_t length);
+
+    SharedMemoryRing* d_ring;
+    int d_fd;
+    char d_buf[MAX_BUF_SIZE];
+    std::atomic<bool> d_open{true};
+};
+
+// Reads what a SharedMemorySink in another process writes. This waits for the
+// writer to create the segment, and only one reader can ever attach to it.
+class SharedMemorySource : public Source
+{
+  public:
+    SharedMemorySource(SharedMemorySource& other) = delete;
+    SharedMemorySource(SharedMemorySource&& other) = delete;
+    void operator=(const SharedMemorySource&) = delete;
+    void operator=(SharedMemorySource&&) = delete;
+
+    explicit SharedMemorySource(const std::string& name);
+    ~SharedMemorySource() override;
+    void close() override;
+    bool is_open() override;
+    bool read(char* result, ssize_t length) override;
+    bool getline(std::string& result, char delimiter) override;
+
+  private:
+    void _close();
+    bool attach(const std::string& path);
+    int d_fd{-1};
+    int d_reader_lock_fd{-1};
+    size_t d_mapping_size{0};
+    SharedMemoryRing* d_ring{nullptr};
+    std::atomic<bool> d_is_open{false};
+    std::unique_ptr<SharedMemoryBuf> d_buf;
+};
+
 }  // namespace memray::io
@@ -11,3 +11,6 @@ cdef extern from "source.h" namespace "memray::io":
 
     cdef cppclass SocketSource(Source):
         SocketSource(int port) except+ IOError
+
+    cdef cppclass SharedMemorySource(Source):
+        SharedMemorySource(const string& name) except+ IOError
@@ -1,7 +1,16 @@
+#include <algorithm>
 #include <cassert>
+#include <charconv>
+#include <chrono>
+#include <cmath>
+#include <fcntl.h>
+#include <fnmatch.h>
+#include <iterator>
 #include <limits.h>
 #include <link.h>
+#include <malloc.h>
 #include <mutex>
+#include <pthread.h>
 #include <type_traits>
 #include <unistd.h>
 #include <utility>
@@ -19,24 +28,7 @@ using namespace std::chrono_literals;
 
 namespace {
 
-struct RecursionGuard
-{
-    RecursionGuard()
-    : wasLocked(isActive)
-    {
-        isActive = true;
-    }
-
-    ~RecursionGuard()
-    {
-        isActive = wasLocked;
-    }
-
-    const bool wasLocked;
-    MEMRAY_FAST_TLS static thread_local bool isActive;
-};
-
-MEMRAY_FAST_TLS thread_local bool RecursionGuard::isActive = false;
+using memray::hooks::RecursionGuard;
 
 std::string
 get_executable()
@@ -60,6 +52,251 @@ starts_with(const std::string& haystack, const std::string_view& needle)
 // Track how many times a new Tracker has been created
 std::atomic<unsigned int> g_tracker_generation;
 
+// Per-thread state of the allocation sampler. See Tracker::shouldSampleAllocation.
+struct SamplerState
+{
+    uint64_t rng_state;
+    int64_t bytes_until_next_sample;
+};
+
+MEMRAY_FAST_TLS thread_local SamplerState t_sampler_state;
+
+#if PY_VERSION_HEX >= 0x030C0000
+#    define MEMRAY_CODE_GET_EXTRA PyUnstable_Code_GetExtra
+#    define MEMRAY_CODE_SET_EXTRA PyUnstable_Code_SetExtra
+#    define MEMRAY_REQUEST_CODE_EXTRA_INDEX PyUnstable_Eval_RequestCodeExtraIndex
+#else
+#    define MEMRAY_CODE_GET_EXTRA _PyCode_GetExtra
+#    define MEMRAY_CODE_SET_EXTRA _PyCode_SetExtra
+#    define MEMRAY_REQUEST_CODE_EXTRA_INDEX _PyEval_RequestCodeExtraIndex
+#endif
+
+// The names of a code object in UTF-8, which are looked up the first time
+// that it runs and then kept in one of its co_extra slots. The strings are
+// owned by the code object, so they live as long as the slot does.
+struct CodeObjectNames
+{
+    const char* function;
+    const char* filename;
+};
+
+Py_ssize_t g_code_names_index = -1;
+
+PyCodeObject*
+frameCode(PyFrameObject* frame)
+{
+#if PY_VERSION_HEX >= 0x030B0000
+    // The frame keeps its code object alive, so it can be borrowed.
+    PyCodeObject* code = PyFrame_GetCode(frame);
+    Py_DECREF(code);
+    return code;
+#else
+    return frame->f_code;
+#endif
+}
+
+bool
+getCodeObjectNames(PyCodeObject* code, CodeObjectNames* names)
+{
+    auto code_object = reinterpret_cast<PyObject*>(code);
+    void* extra = nullptr;
+    if (g_code_names_index >= 0 && MEMRAY_CODE_GET_EXTRA(code_object, g_code_names_index, &extra) == 0
+        && extra != nullptr)
+    {
+        *names = *static_cast<CodeObjectNames*>(extra);
+        return true;
+    }
+    PyErr_Clear();
+
+    names->function = PyUnicode_AsUTF8(code->co_name);
+    if (names->function == nullptr) {
+        return false;
+    }
+    names->filename = PyUnicode_AsUTF8(code->co_filename);
+    if (names->filename == nullptr) {
+        return false;
+    }
+
+    if (g_code_names_index >= 0) {
+        auto cached = static_cast<CodeObjectNames*>(PyMem_RawMalloc(sizeof(CodeObjectNames)));
+        if (cached != nullptr) {
+            *cached = *names;
+            if (MEMRAY_CODE_SET_EXTRA(code_object, g_code_names_index, cached) != 0) {
+                PyErr_Clear();
+                PyMem_RawFree(cached);
+            }
+        }
+    }
+    return true;
+}
+
+// Threads are identified in the records by a small integer, assigned the
+// first time that they write something. Zero means "not assigned yet" (and
+// is what the reader uses for merged threads), so the first id is 1.
+std::atomic<unsigned long> g_next_thread_id{1};
+MEMRAY_FAST_TLS thread_local unsigned long t_thread_id;
+
+// Bounds of the current thread's stack, used to validate frame pointers.
+struct StackBounds
+{
+    bool initialized;
+    uintptr_t low;
+    uintptr_t high;
+};
+
+MEMRAY_FAST_TLS thread_local StackBounds t_stack_bounds;
+
+const StackBounds&
+currentThreadStackBounds()
+{
+    StackBounds& bounds = t_stack_bounds;
+    if (!bounds.initialized) {
+        bounds = {true, 0, 0};
+        pthread_attr_t attr;
+        if (pthread_getattr_np(pthread_self(), &attr) == 0) {
+            void* stack_addr;
+            size_t stack_size;
+            if (pthread_attr_getstack(&attr, &stack_addr, &stack_size) == 0) {
+                bounds.low = reinterpret_cast<uintptr_t>(stack_addr);
+                bounds.high = bounds.low + stack_size;
+            }
+            pthread_attr_destroy(&attr);
+        }
+    }
+    return bounds;
+}
+
+std::atomic<uint64_t> g_sampler_seed;
+
+uint64_t
+splitmix64(uint64_t value)
+{
+    value += 0x9E3779B97F4A7C15ULL;
+    value = (value ^ (value >> 30U)) * 0xBF58476D1CE4E5B9ULL;
+    value = (value ^ (value >> 27U)) * 0x94D049BB133111EBULL;
+    return value ^ (value >> 31U);
+}
+
+#if PY_VERSION_HEX < 0x030B0000
+// The frames of a thread are linked from its PyThreadState, which the
+// Tracker can walk when it has to record an allocation.
+#    define MEMRAY_HAS_LAZY_PYTHON_STACKS 1
+
+// The UTF-8 contents of a string, if it can be had without allocating and so
+// without the GIL. The names of code objects are almost always ASCII, and the
+// UTF-8 of an ASCII string is its data.
+const char*
+utf8WithoutGIL(PyObject* string)
+{
+    if (PyUnicode_IS_COMPACT_ASCII(string)) {
+        return reinterpret_cast<const char*>(reinterpret_cast<PyASCIIObject*>(string) + 1);
+    }
+    const char* utf8 = reinterpret_cast<PyCompactUnicodeObject*>(string)->utf8;
+    return utf8 != nullptr ? utf8 : "<unknown>";
+}
+#endif
+
+// While the memory gauges are sampled, pymalloc gets its arenas through
+// these, which count the ones that are in use. Only the arenas allocated
+// while counting are remembered, so that freeing one that was allocated
+// before can't make the count go wrong. Arenas are only allocated and freed
+// with the GIL held, and rarely, so the set needs no lock.
+PyObjectArenaAllocator g_original_arena_allocator;
+std::unordered_set<void*> g_pymalloc_arenas;
+std::atomic<size_t> g_n_pymalloc_arenas{0};
+
+void*
+countingArenaAlloc(void* ctx, size_t size)
+{
+    void* arena = g_original_arena_allocator.alloc(ctx, size);
+    if (arena) {
+        RecursionGuard guard;
+        g_pymalloc_arenas.insert(arena);
+        g_n_pymalloc_arenas = g_pymalloc_arenas.size();
+    }
+    return arena;
+}
+
+void
+countingArenaFree(void* ctx, void* ptr, size_t size)
+{
+    {
+        RecursionGuard guard;
+        g_pymalloc_arenas.erase(ptr);
+        g_n_pymalloc_arenas = g_pymalloc_arenas.size();
+    }
+    g_original_arena_allocator.free(ctx, ptr, size);
+}
+
+void
+startCountingPymallocArenas()
+{
+    PyObjectArenaAllocator allocator;
+    PyObject_GetArenaAllocator(&allocator);
+    if (allocator.alloc == &countingArenaAlloc) {
+        // Inherited from the tracker of the parent process, arenas included.
+        return;
+    }
+    g_original_arena_allocator = allocator;
+    RecursionGuard guard;
+    g_pymalloc_arenas.clear();
+    g_n_pymalloc_arenas = 0;
+    allocator.alloc = &countingArenaAlloc;
+    allocator.free = &countingArenaFree;
+    PyObject_SetArenaAllocator(&allocator);
+}
+
+void
+stopCountingPymallocArenas()
+{
+    PyObjectArenaAllocator allocator;
+    PyObject_GetArenaAllocator(&allocator);
+    if (allocator.alloc == &countingArenaAlloc) {
+        PyObject_SetArenaAllocator(&g_original_arena_allocator);
+    }
+}
+
+// The allocators of the domains that trace_python_allocators hooks, which
+// the hooks get as their context.
+PyMemAllocatorEx g_original_mem_allocator;
+PyMemAllocatorEx g_original_obj_allocator;
+
+void
+startTracingPythonAllocators()
+{
+    PyMemAllocatorEx allocator;
+    PyMem_GetAllocator(PYMEM_DOMAIN_MEM, &allocator);
+    if (allocator.malloc == &memray::intercept::pymalloc_malloc) {
+        // Inherited from the tracker of the parent process.
+        return;
+    }
+    for (auto [domain, original] :
+         {std::pair{PYMEM_DOMAIN_MEM, &g_original_mem_allocator},
+          std::pair{PYMEM_DOMAIN_OBJ, &g_original_obj_allocator}})
+    {
+        PyMem_GetAllocator(domain, original);
+        PyMemAllocatorEx hooks{
+                original,
+                &memray::intercept::pymalloc_malloc,
+                &memray::intercept::pymalloc_calloc,
+                &memray::intercept::pymalloc_realloc,
+                &memray::intercept::pymalloc_free};
+        PyMem_SetAllocator(domain, &hooks);
+    }
+}
+
+void
+stopTracingPythonAllocators()
+{
+    PyMemAllocatorEx allocator;
+    PyMem_GetAllocator(PYMEM_DOMAIN_MEM, &allocator);
+    if (allocator.malloc != &memray::intercept::pymalloc_malloc) {
+        return;
+    }
+    PyMem_SetAllocator(PYMEM_DOMAIN_MEM, &g_original_mem_allocator);
+    PyMem_SetAllocator(PYMEM_DOMAIN_OBJ, &g_original_obj_allocator);
+}
+
 }  // namespace
 
 namespace memray::tracking_api {
@@ -67,7 +304,10 @@ namespace memray::tracking_api {
 static inline thread_id_t
 thread_id()
 {
-    return reinterpret_cast<thread_id_t>(pthread_self());
+    if (!t_thread_id) {
+        t_thread_id = g_next_thread_id.fetch_add(1, std::memory_order_relaxed);
+    }
+    return t_thread_id;
 };
 
 // Tracker interface
@@ -92,9 +332,9 @@ thread_id()
 // once for the vector that had been created before the thread died and the
 // pthread struct was reused).
 //
-// To prevent that, we only create the vector in one method (pushPythonFrame).
+// To prevent that, we only create the vector in one method (createStack).
 // All other methods access a pointer called `d_stack` that is set to the TLS
-// stack when it is created by pushPythonFrame, and set to a null pointer when
+// stack when it is created by createStack, and set to a null pointer when
 // the TLS stack is destroyed.
 //
 // This can result in this class being constructed during thread teardown, but
@@ -107,18 +347,33 @@ class PythonStackTracker
         PyFrameObject* frame;
         RawFrame raw_frame_record;
         bool emitted;
+        // Emitted, but left out of the stack that was written, so it isn't popped.
+        bool excluded;
+        // Emitted, but with a line number that isn't the current one anymore.
+        bool line_outdated;
+        // The line number of the frame when it was at the instruction lasti.
+        int lasti;
+        int lasti_lineno;
     };
 
+    // Never the last instruction of a frame, not even of one that hasn't started.
+    static constexpr int UNKNOWN_LASTI = -2;
+
   public:
     void reset(PyFrameObject* current_frame);
     void emitPendingPops();
     void emitPendingPushes();
     int getCurrentPythonLineNumber();
     void setMostRecentFrameLineNumber(int lineno);
-    int pushPythonFrame(PyFrameObject* frame);
+    int pushPythonFrame(PyFrameObject* frame, PyCodeObject* code);
     void popPythonFrame();
+    void loadFrameChain(PyFrameObject* current_frame);
 
   private:
+    std::vector<LazilyEmittedFrame>& createStack();
+    static int lineNumber(LazilyEmittedFrame& entry);
+    bool popEmittedFrames(std::vector<LazilyEmittedFrame>::reverse_iterator last_emitted);
+
     uint32_t d_num_pending_pops{};
     uint32_t d_tracker_generation{};
     std::vector<LazilyEmittedFrame>* d_stack{};
@@ -128,6 +383,61 @@ class PythonStackTracker
 static_assert(std::is_trivially_destructible<PythonStackTracker>::value);
 MEMRAY_FAST_TLS thread_local PythonStackTracker t_python_stack_tracker;
 
+// Points to the FrameTree::TraceCache of the current thread. The cache itself
+// is owned by a TLS object that is only created in getNativeTraceCache, for
+// the same reasons explained above PythonStackTracker, and that object marks
+// the thread as exited when it is destroyed so it's never created again.
+struct NativeTraceCacheSlot
+{
+    FrameTree::TraceCache* cache;
+    unsigned int tracker_generation;
+    bool thread_exited;
+};
+
+static_assert(std::is_trivially_destructible<NativeTraceCacheSlot>::value);
+MEMRAY_FAST_TLS thread_local NativeTraceCacheSlot t_native_trace_cache_slot;
+
+static FrameTree::TraceCache*
+getNativeTraceCache()
+{
+    NativeTraceCacheSlot& slot = t_native_trace_cache_slot;
+    if (!slot.cache) {
+        if (slot.thread_exited) {
+            return nullptr;
+        }
+
+        struct CacheCreator
+        {
+            FrameTree::TraceCache cache;
+
+            CacheCreator()
+            {
+                t_native_trace_cache_slot.cache = &cache;
+            }
+            ~CacheCreator()
+            {
+                t_native_trace_cache_slot = {nullptr, 0, true};
+                // The cache was filled while tracking was suspended, so don't
+                // report the memory it gives back either.
+                RecursionGuard guard;
+                cache.clear();
+                cache.frames.shrink_to_fit();
+                cache.indexes.shrink_to_fit();
+            }
+        };
+
+        MEMRAY_FAST_TLS static thread_local CacheCreator t_cache_creator;
+        slot.tracker_generation = g_tracker_generation;
+    }
+
+    if (slot.tracker_generation != g_tracker_generation) {
+        // The indexes refer to the tree of a Tracker that is gone.
+        slot.tracker_generation = g_tracker_generation;
+        slot.cache->clear();
+    }
+    return slot.cache;
+}
+
 void
 PythonStackTracker::reset(PyFrameObject* current_frame)
 {
@@ -136,7 +446,7 @@ PythonStackTracker::reset(PyFrameObject* current_frame)
         d_stack->clear();
     }
 
-    if (current_frame && 0 != pushPythonFrame(current_frame)) {
+    if (current_frame && 0 != pushPythonFrame(current_frame, frameCode(current_frame))) {
         PyErr_Clear();  // Nothing to be done about it here.
     }
 }
@@ -154,6 +464,8 @@ PythonStackTracker::emitPendingPops()
         if (d_stack) {
             for (auto it = d_stack->begin(); it != d_stack->end(); it++) {
                 it->emitted = false;
+                it->excluded = false;
+                it->line_outdated = false;
             }
         }
     } else {
@@ -169,26 +481,96 @@ PythonStackTracker::emitPendingPushes()
         return;
     }
 
+    Tracker* tracker = Tracker::getTracker();
     auto last_emitted_rit =
             std::find_if(d_stack->rbegin(), d_stack->rend(), [](auto& f) { return f.emitted; });
+    auto first_to_emit = last_emitted_rit.base();
+
+    // With a limit, the frames that were emitted are the innermost ones of
+    // the stack as it was then. If the stack went deeper or shallower since,
+    // they don't start where the innermost ones of the stack start now, and
+    // they are all popped to emit those instead.
+    size_t max_frames = tracker->maxPythonFrames();
+    if (max_frames) {
+        auto window_start = d_stack->end() - std::min(max_frames, d_stack->size());
+        bool window_moved = last_emitted_rit != d_stack->rend()
+                            && (!window_start->emitted
+                                || (window_start != d_stack->begin() && (window_start - 1)->emitted));
+        if (window_moved) {
+            if (!popEmittedFrames(last_emitted_rit)) {
+                return;
+            }
+            last_emitted_rit = d_stack->rend();
+            first_to_emit = window_start;
+        } else {
+            first_to_emit = std::max(first_to_emit, window_start);
+        }
+    }
+
+    // Only the innermost frame that was emitted can have moved to another
+    // line since, and then it's updated in place instead of being popped and
+    // pushed again.
+    if (last_emitted_rit != d_stack->rend() && last_emitted_rit->line_outdated) {
+        if (!last_emitted_rit->excluded
+            && !tracker->updateFrameLine(last_emitted_rit->raw_frame_record))
+        {
+            return;
+        }
+        last_emitted_rit->line_outdated = false;
+    }
 
-    for (auto to_emit = last_emitted_rit.base(); to_emit != d_stack->end(); to_emit++) {
-        if (!Tracker::getTracker()->pushFrame(to_emit->raw_frame_record)) {
+    for (auto to_emit = first_to_emit; to_emit != d_stack->end(); to_emit++) {
+        bool excluded;
+        if (!tracker->pushFrame(to_emit->raw_frame_record, excluded)) {
             break;
         }
         to_emit->emitted = true;
+        to_emit->excluded = excluded;
+    }
+}
+
+bool
+PythonStackTracker::popEmittedFrames(std::vector<LazilyEmittedFrame>::reverse_iterator last_emitted)
+{
+    uint32_t to_pop = 0;
+    for (auto it = last_emitted; it != d_stack->rend() && it->emitted; ++it) {
+        to_pop += !it->excluded;
+        it->emitted = false;
+        it->excluded = false;
+        it->line_outdated = false;
     }
+    return Tracker::getTracker()->popFrames(to_pop);
 }
 
 inline int
 PythonStackTracker::getCurrentPythonLineNumber()
 {
     if (d_stack && !d_stack->empty()) {
-        return PyFrame_GetLineNumber(d_stack->back().frame);
+        return lineNumber(d_stack->back());
     }
     return 0;
 }
 
+inline int
+PythonStackTracker::lineNumber(LazilyEmittedFrame& entry)
+{
+#if PY_VERSION_HEX < 0x030B0000
+    // Finding the line means searching the line table of the frame's code,
+    // so it's only done again once the frame has moved to another
+    // instruction. The line of a frame that is being traced is whatever its
+    // trace function last set it to, so that one is always asked for.
+    PyFrameObject* frame = entry.frame;
+    if (frame->f_trace == nullptr) {
+        if (frame->f_lasti != entry.lasti) {
+            entry.lasti = frame->f_lasti;
+            entry.lasti_lineno = PyFrame_GetLineNumber(frame);
+        }
+        return entry.lasti_lineno;
+    }
+#endif
+    return PyFrame_GetLineNumber(entry.frame);
+}
+
 void
 PythonStackTracker::setMostRecentFrameLineNumber(int lineno)
 {
@@ -198,28 +580,15 @@ PythonStackTracker::setMostRecentFrameLineNumber(int lineno)
 
     d_stack->back().raw_frame_record.lineno = lineno;
     if (d_stack->back().emitted) {
-        // If it was already emitted with an old line number, pop that frame
-        // and re-emit it with the new line number.
-        d_num_pending_pops += 1;
-        d_stack->back().emitted = false;
+        // It was already emitted with an old line number, which gets updated
+        // the next time the stack is emitted.
+        d_stack->back().line_outdated = true;
     }
 }
 
-int
-PythonStackTracker::pushPythonFrame(PyFrameObject* frame)
+std::vector<PythonStackTracker::LazilyEmittedFrame>&
+PythonStackTracker::createStack()
 {
-    const char* function = PyUnicode_AsUTF8(frame->f_code->co_name);
-    if (function == nullptr) {
-        return -1;
-    }
-
-    const char* filename = PyUnicode_AsUTF8(frame->f_code->co_filename);
-    if (filename == nullptr) {
-        return -1;
-    }
-
-    int parent_lineno = getCurrentPythonLineNumber();
-
     struct StackCreator
     {
         std::vector<LazilyEmittedFrame> stack;
@@ -236,18 +605,98 @@ PythonStackTracker::pushPythonFrame(PyFrameObject* frame)
         }
     };
 
-    setMostRecentFrameLineNumber(parent_lineno);
     MEMRAY_FAST_TLS static thread_local StackCreator t_stack_creator;
-    t_stack_creator.stack.push_back({frame, {function, filename, 0}, false});
     assert(d_stack);  // The above call sets d_stack if it wasn't already set.
+    return t_stack_creator.stack;
+}
+
+int
+PythonStackTracker::pushPythonFrame(PyFrameObject* frame, PyCodeObject* code)
+{
+    CodeObjectNames names;
+    if (!getCodeObjectNames(code, &names)) {
+        return -1;
+    }
+
+    int parent_lineno = getCurrentPythonLineNumber();
+    setMostRecentFrameLineNumber(parent_lineno);
+    createStack().push_back(
+            {frame, {names.function, names.filename, 0}, false, false, false, UNKNOWN_LASTI, 0});
     return 0;
 }
 
+void
+PythonStackTracker::loadFrameChain(PyFrameObject* current_frame)
+{
+#ifdef MEMRAY_HAS_LAZY_PYTHON_STACKS
+    // The stack that was loaded last is kept, and the frames that are still
+    // the same from the outermost one in aren't emitted again. The chain is
+    // walked from the innermost frame out, so the first pass finds how deep
+    // it is and the first of its frames that changed, and the second one
+    // fills in the stack from there.
+    auto& stack = createStack();
+    size_t depth = 0;
+    for (PyFrameObject* frame = current_frame; frame != nullptr; frame = frame->f_back) {
+        ++depth;
+    }
+
+    auto same_function = [](const LazilyEmittedFrame& entry, PyFrameObject* frame) {
+        return entry.frame == frame
+               && entry.raw_frame_record.function_name == utf8WithoutGIL(frame->f_code->co_name)
+               && entry.raw_frame_record.filename == utf8WithoutGIL(frame->f_code->co_filename);
+    };
+
+    size_t first_changed = std::min(depth, stack.size());
+    PyFrameObject* first_changed_frame = nullptr;
+    size_t index = depth;
+    for (PyFrameObject* frame = current_frame; frame != nullptr; frame = frame->f_back) {
+        --index;
+        if (index < first_changed
+            && (!same_function(stack[index], frame)
+                || lineNumber(stack[index]) != stack[index].raw_frame_record.lineno))
+        {
+            first_changed = index;
+            first_changed_frame = frame;
+        }
+    }
+
+    // If the outermost frame that changed is still running, it has only
+    // moved to another line, and it keeps its place in the stack.
+    size_t first_replaced = first_changed;
+    if (first_changed_frame && same_function(stack[first_changed], first_changed_frame)) {
+        LazilyEmittedFrame& entry = stack[first_changed];
+        entry.raw_frame_record.lineno = lineNumber(entry);
+        entry.line_outdated = entry.emitted;
+        first_replaced += 1;
+    }
+
+    for (size_t i = first_replaced; i < stack.size(); ++i) {
+        if (stack[i].emitted && !stack[i].excluded) {
+            d_num_pending_pops += 1;
+        }
+    }
+    stack.resize(depth);
+
+    index = depth;
+    for (PyFrameObject* frame = current_frame; index > first_replaced; frame = frame->f_back) {
+        --index;
+        int lineno = PyFrame_GetLineNumber(frame);
+        RawFrame raw_frame{
+                utf8WithoutGIL(frame->f_code->co_name),
+                utf8WithoutGIL(frame->f_code->co_filename),
+                lineno};
+        stack[index] = {frame, raw_frame, false, false, false, frame->f_lasti, lineno};
+    }
+#else
+    (void)current_frame;
+#endif
+}
+
 void
 PythonStackTracker::popPythonFrame()
 {
     if (d_stack && !d_stack->empty()) {
-        if (d_stack->back().emitted) {
+        if (d_stack->back().emitted && !d_stack->back().excluded) {
             d_num_pending_pops += 1;
             assert(d_num_pending_pops != 0);  // Ensure we didn't overflow.
         }
@@ -262,21 +711,133 @@ PythonStackTracker::popPythonFrame()
 }
 
 std::atomic<bool> Tracker::d_active = false;
+std::atomic<bool> Tracker::d_dormant = false;
+std::atomic<bool> Tracker::d_dump_requested = false;
+std::atomic<int64_t> Tracker::d_tracked_bytes = 0;
+std::atomic<uint64_t> Tracker::d_deactivated_records = 0;
 std::unique_ptr<Tracker> Tracker::d_instance_owner;
 std::atomic<Tracker*> Tracker::d_instance = nullptr;
+elf::SymbolPatcher* Tracker::d_forking_patcher = nullptr;
 MEMRAY_FAST_TLS thread_local size_t NativeTrace::MAX_SIZE{64};
 
+size_t
+NativeTrace::frame_pointer_unwind()
+{
+#if defined(__x86_64__) || defined(__aarch64__)
+    const StackBounds& bounds = currentThreadStackBounds();
+    if (bounds.low == bounds.high) {
+        return resume_unwind_from(0);
+    }
+
+    // Each frame record holds the caller's frame pointer followed by the
+    // return address. The chain must stay within this thread's stack and
+    // move towards its base; if it doesn't, some function in between didn't
+    // keep a frame pointer and libunwind takes over from the last good frame.
+    auto fp = reinterpret_cast<uintptr_t>(__builtin_frame_address(0));
+    size_t size = 0;
+    while (true) {
+        if (fp < bounds.low || fp > bounds.high - 2 * sizeof(uintptr_t) || fp % sizeof(uintptr_t)) {
+            return resume_unwind_from(size);
+        }
+        auto frame = reinterpret_cast<const uintptr_t*>(fp);
+        uintptr_t next_fp = frame[0];
+        uintptr_t ip = frame[1];
+        if (ip == 0) {
+            return size;
+        }
+        append_frame(size++, ip);
+        if (next_fp == 0 || size == d_limit) {
+            // The outermost frame, or as many frames as we want.
+            return size;
+        }
+        if (next_fp <= fp) {
+            return resume_unwind_from(size);
+        }
+        fp = next_fp;
+    }
+#else
+    return resume_unwind_from(0);
+#endif
+}
+
+size_t
+NativeTrace::resume_unwind_from(size_t size)
+{
+    unw_context_t context;
+    unw_cursor_t cursor;
+    if (unw_getcontext(&context) < 0 || unw_init_local(&cursor, &context) < 0) {
+        return size;
+    }
+
+    // Our own frames come first, followed by the ones that the frame pointer
+    // walk already found. Skip them until we reach the last good one.
+    bool found = false;
+    while (size < d_limit && unw_step(&cursor) > 0) {
+        unw_word_t ip;
+        if (unw_get_reg(&cursor, UNW_REG_IP, &ip) < 0) {
+            break;
+        }
+        if (!found) {
+            if (size == 0) {
+                // Skip frame_pointer_unwind itself, as the walk would have.
+                found = true;
+            } else {
+                found = ip == d_data[size - 1];
+            }
+            continue;
+        }
+        append_frame(size++, ip);
+    }
+    return size;
+}
+
+void
+NativeTrace::append_frame(size_t index, ip_t ip)
+{
+    if (index == d_data.size()) {
+        d_data.resize(d_data.size() * 2);
+        MAX_SIZE = d_data.size();
+    }
+    d_data[index] = ip;
+}
+
 Tracker::Tracker(
         std::unique_ptr<RecordWriter> record_writer,
         bool native_traces,
         unsigned int memory_interval,
-        bool follow_fork)
+        bool follow_fork,
+        size_t sample_rate,
+        NativeUnwinder native_unwinder,
+        bool lazy_python_stacks,
+        size_t max_python_frames,
+        size_t max_native_frames,
+        std::vector<std::string> excluded_filenames,
+        size_t trigger_rss,
+        size_t trigger_rss_growth,
+        size_t dump_rss,
+        bool memory_gauges,
+        bool trace_python_allocators,
+        elf::SymbolPatcher* parent_patcher)
 : d_writer(std::move(record_writer))
 , d_unwind_native_frames(native_traces)
+, d_native_trace_index_cache(native_traces ? std::make_unique<NativeTraceIndexCache>() : nullptr)
+, d_native_unwinder(native_unwinder)
 , d_memory_interval(memory_interval)
 , d_follow_fork(follow_fork)
+, d_sample_rate(sample_rate)
+, d_lazy_python_stacks(lazy_python_stacks)
+, d_max_python_frames(max_python_frames)
+, d_max_native_frames(max_native_frames)
+, d_excluded_filenames(std::move(excluded_filenames))
+, d_trigger_rss(trigger_rss)
+, d_trigger_rss_growth(trigger_rss_growth)
+, d_dump_rss(dump_rss)
+, d_memory_gauges(memory_gauges)
+, d_trace_python_allocators(trace_python_allocators)
+, d_count_allocations_only(d_writer->countsAllocationsOnly())
 {
     g_tracker_generation++;
+    d_tracked_bytes = 0;
 
     // Note: this must be set before the hooks are installed.
     d_instance = this;
@@ -297,22 +858,80 @@ Tracker::Tracker(
     updateModuleCache();
 
     RecursionGuard guard;
-    tracking_api::install_trace_function();  //  TODO pass our instance here to avoid static object
+    if (!d_lazy_python_stacks) {
+        tracking_api::install_trace_function();  //  TODO pass our instance here to avoid static object
+    }
+    if (parent_patcher) {
+        // In a child, the objects that the parent had patched are patched
+        // already, and only the GOT slots of the ones it hadn't seen need
+        // to be overwritten.
+        d_patcher.inheritPatchedObjects(*parent_patcher);
+    }
     d_patcher.overwrite_symbols();
+    if (d_memory_gauges) {
+        startCountingPymallocArenas();
+    }
+    if (d_trace_python_allocators) {
+        startTracingPythonAllocators();
+    }
 
-    d_background_thread = std::make_unique<BackgroundThread>(d_writer, memory_interval);
-    d_background_thread->start();
+    d_background_thread = std::make_unique<BackgroundThread>(
+            d_writer,
+            memory_interval,
+            trigger_rss,
+            trigger_rss_growth,
+            dump_rss,
+            memory_gauges);
+
+    if (d_writer->keepsOnlyRecentRecords()) {
+        // The records are written out by the background thread, as the
+        // handler can't take any locks.
+        struct sigaction action{};
+        action.sa_handler = &Tracker::requestDump;
+        sigemptyset(&action.sa_mask);
+        action.sa_flags = SA_RESTART;
+        d_handles_sigusr2 = ::sigaction(SIGUSR2, &action, &d_previous_sigusr2_action) == 0;
+    }
+
+    // What the hooks saw while we were being set up doesn't count as lost.
+    d_deactivated_records = 0;
 
-    tracking_api::Tracker::activate();
+    // With a trigger, the background thread activates the tracker once the
+    // RSS crosses it, and until then the Python stacks are followed but not
+    // written.
+    if (trigger_rss || trigger_rss_growth) {
+        d_dormant = true;
+    } else {
+        tracking_api::Tracker::activate();
+    }
+    d_background_thread->start();
 }
 
 Tracker::~Tracker()
 {
     RecursionGuard guard;
+    if (isDormant()) {
+        // Stop the background thread first, so that it can't activate us
+        // after we are deactivated. It activates us before it clears
+        // d_dormant, so it can't be doing that if d_dormant is already clear.
+        d_background_thread->stop();
+    }
     tracking_api::Tracker::deactivate();
     d_background_thread->stop();
+    if (d_handles_sigusr2) {
+        ::sigaction(SIGUSR2, &d_previous_sigusr2_action, nullptr);
+    }
+    if (d_memory_gauges) {
+        stopCountingPymallocArenas();
+    }
+    if (d_trace_python_allocators) {
+        stopTracingPythonAllocators();
+    }
     t_python_stack_tracker.reset(nullptr);
     d_patcher.restore_symbols();
+    d_writer->drainThreadBuffers();
+    d_writer->writeTrailer();
+    d_writer->countDeactivatedRecords(d_deactivated_records.load(std::memory_order_relaxed));
     d_writer->writeHeader(true);
     d_writer.reset();
 
@@ -322,16 +941,31 @@ Tracker::~Tracker()
 
 Tracker::BackgroundThread::BackgroundThread(
         std::shared_ptr<RecordWriter> record_writer,
-        unsigned int memory_interval)
+        unsigned int memory_interval,
+        size_t trigger_rss,
+        size_t trigger_rss_growth,
+        size_t dump_rss,
+        bool memory_gauges)
 : d_writer(std::move(record_writer))
 , d_memory_interval(memory_interval)
+, d_trigger_rss(trigger_rss)
+, d_trigger_rss_growth(trigger_rss_growth)
+, d_dump_rss(dump_rss)
+, d_memory_gauges(memory_gauges)
 {
-    d_procs_statm.open("/proc/self/statm");
-    if (!d_procs_statm) {
+    // Kept open and read with pread(), which costs a single system call for
+    // every sample.
+    d_procs_statm = ::open("/proc/self/statm", O_RDONLY | O_CLOEXEC);
+    if (d_procs_statm == -1) {
         throw IoError{"Failed to open /proc/self/statm"};
     }
 }
 
+Tracker::BackgroundThread::~BackgroundThread()
+{
+    ::close(d_procs_statm);
+}
+
 unsigned long int
 Tracker::BackgroundThread::timeElapsed()
 {
@@ -347,21 +981,89 @@ Tracker::BackgroundThread::getRSS() const
     constexpr int max_unsigned_long_chars = std::numeric_limits<unsigned long>::digits10 + 1;
     constexpr int bufsize = (max_unsigned_long_chars + sizeof(' ')) * 2;
     char buffer[bufsize];
-    d_procs_statm.read(buffer, sizeof(buffer) - 1);
-    buffer[d_procs_statm.gcount()] = '\0';
-    d_procs_statm.clear();
-    d_procs_statm.seekg(0);
+    ssize_t length = ::pread(d_procs_statm, buffer, sizeof(buffer), 0);
 
+    // The RSS is the second of the numbers, in pages.
+    const char* begin = buffer;
+    const char* end = begin + std::max(length, ssize_t(0));
+    const char* rss_start = std::find(begin, end, ' ');
     size_t rss;
-    if (sscanf(buffer, "%*u %zu", &rss) != 1) {
+    if (rss_start == end || std::from_chars(rss_start + 1, end, rss).ec != std::errc()) {
         std::cerr << "WARNING: Failed to read RSS value from /proc/self/statm" << std::endl;
-        d_procs_statm.close();
         return 0;
     }
 
     return rss * pagesize;
 }
 
+MemoryGauges
+Tracker::BackgroundThread::getGauges() const
+{
+    MemoryGauges gauges{};
+#if defined(__GLIBC__) && __GLIBC_PREREQ(2, 33)
+    // Chunks that malloc gets with mmap() are counted as part of the heap, as
+    // they are freed back to the system as soon as they're freed.
+    struct mallinfo2 info = mallinfo2();
+    gauges.heap_size = info.arena + info.hblkhd;
+    gauges.heap_in_use = info.uordblks + info.hblkhd;
+#endif
+    gauges.pymalloc_arenas = g_n_pymalloc_arenas;
+    gauges.tracked_bytes = Tracker::d_tracked_bytes.load();
+    return gauges;
+}
+
+bool
+Tracker::BackgroundThread::writeMemoryRecord(size_t rss)
+{
+    MemoryRecord record{timeElapsed(), rss};
+    if (!d_memory_gauges) {
+        return d_writer->writeRecord(RecordType::MEMORY_RECORD, record);
+    }
+    return d_writer->writeRecord(
+            RecordType::MEMORY_GAUGES_RECORD,
+            MemoryGaugesRecord{record, getGauges()});
+}
+
+bool
+Tracker::BackgroundThread::crossedTrigger(size_t rss)
+{
+    if (d_trigger_rss && rss >= d_trigger_rss) {
+        return true;
+    }
+    if (!d_trigger_rss_growth) {
+        return false;
+    }
+
+    // The growth is measured over windows of at least a second, as the RSS
+    // of a single interval goes up and down too much to tell a trend.
+    unsigned long int now = timeElapsed();
+    if (d_growth_window_start == 0) {
+        d_growth_window_start = now;
+        d_growth_window_rss = rss;
+        return false;
+    }
+    unsigned long int elapsed = now - d_growth_window_start;
+    if (elapsed < 1000) {
+        return false;
+    }
+    bool crossed = rss > d_growth_window_rss
+                   && (rss - d_growth_window_rss) * 1000 / elapsed >= d_trigger_rss_growth;
+    d_growth_window_start = now;
+    d_growth_window_rss = rss;
+    return crossed;
+}
+
+bool
+Tracker::BackgroundThread::crossedDumpThreshold(size_t rss)
+{
+    // Only once each time the RSS goes over the threshold, not every time
+    // it's found above it.
+    bool above = d_dump_rss && rss >= d_dump_rss;
+    bool crossed = above && !d_above_dump_rss;
+    d_above_dump_rss = above;
+    return crossed;
+}
+
 void
 Tracker::BackgroundThread::start()
 {
@@ -381,7 +1083,23 @@ Tracker::BackgroundThread::start()
                 Tracker::deactivate();
                 break;
             }
-            if (!d_writer->writeRecord(RecordType::MEMORY_RECORD, MemoryRecord{timeElapsed(), rss})) {
+            if (Tracker::isDormant()) {
+                if (!crossedTrigger(rss)) {
+                    continue;
+                }
+                Tracker::activate();
+            }
+            // The stats go out with the allocations that are drained after
+            // them, so that the reader sees how long those took to reach it.
+            if (!d_writer->writeSinkStats() || !d_writer->drainThreadBuffers()
+                || !writeMemoryRecord(rss))
+            {
+                std::cerr << "Failed to write output, deactivating tracking" << std::endl;
+                Tracker::deactivate();
+                break;
+            }
+            bool dump_requested = Tracker::d_dump_requested.exchange(false);
+            if ((crossedDumpThreshold(rss) || dump_requested) && !d_writer->dump()) {
                 std::cerr << "Failed to write output, deactivating tracking" << std::endl;
                 Tracker::deactivate();
                 break;
@@ -411,11 +1129,24 @@ Tracker::prepareFork()
 {
     // Don't do any custom track_allocation handling while inside fork
     RecursionGuard::isActive = true;
+
+    // Keep other threads from patching symbols until the child has taken
+    // over the objects that are already patched.
+    Tracker* tracker = d_instance;
+    if (tracker) {
+        tracker->d_patcher.lockForFork();
+        d_forking_patcher = &tracker->d_patcher;
+    }
 }
 
 void
 Tracker::parentFork()
 {
+    if (d_forking_patcher) {
+        d_forking_patcher->unlockAfterFork();
+        d_forking_patcher = nullptr;
+    }
+
     // We can continue tracking
     RecursionGuard::isActive = false;
 }
@@ -433,9 +1164,17 @@ Tracker::childFork()
 
     Tracker* old_tracker = d_instance;
 
+    // The patcher that prepareFork() locked is the old tracker's, which is
+    // leaked along with it. It's only unlocked once the new tracker has
+    // taken over the objects it patched.
+    elf::SymbolPatcher* parent_patcher = d_forking_patcher;
+    d_forking_patcher = nullptr;
+
     // If we inherited an active tracker, try to clone its record writer.
     std::unique_ptr<RecordWriter> new_writer;
-    if (old_tracker && old_tracker->isActive() && old_tracker->d_follow_fork) {
+    if (old_tracker && (old_tracker->isActive() || old_tracker->isDormant())
+        && old_tracker->d_follow_fork)
+    {
         new_writer = old_tracker->d_writer->cloneInChildProcess();
     }
 
@@ -445,7 +1184,11 @@ Tracker::childFork()
         // Note that the old tracker's hooks may still be installed. This is
         // OK, as long as they always check the (static) isActive() flag before
         // calling any methods on the now null tracker singleton.
+        if (parent_patcher) {
+            parent_patcher->unlockAfterFork();
+        }
         d_instance = nullptr;
+        d_dormant = false;
         RecursionGuard::isActive = false;
         return;
     }
@@ -455,41 +1198,186 @@ Tracker::childFork()
             std::move(new_writer),
             old_tracker->d_unwind_native_frames,
             old_tracker->d_memory_interval,
-            old_tracker->d_follow_fork));
+            old_tracker->d_follow_fork,
+            old_tracker->d_sample_rate,
+            old_tracker->d_native_unwinder,
+            old_tracker->d_lazy_python_stacks,
+            old_tracker->d_max_python_frames,
+            old_tracker->d_max_native_frames,
+            old_tracker->d_excluded_filenames,
+            old_tracker->d_trigger_rss,
+            old_tracker->d_trigger_rss_growth,
+            old_tracker->d_dump_rss,
+            old_tracker->d_memory_gauges,
+            old_tracker->d_trace_python_allocators,
+            parent_patcher));
+    if (parent_patcher) {
+        parent_patcher->unlockAfterFork();
+    }
     RecursionGuard::isActive = false;
 }
 
 void
-Tracker::trackAllocationImpl(void* ptr, size_t size, hooks::Allocator func)
+Tracker::requestDump(__attribute__((unused)) int signal)
 {
-    if (RecursionGuard::isActive || !Tracker::isActive()) {
-        return;
+    d_dump_requested.store(true, std::memory_order_relaxed);
+}
+
+namespace {
+
+// Only one in this many calls to the hooks of each thread is timed, and it
+// stands for the others, so that the clock isn't read on every call.
+const uint32_t HOOK_TIMING_INTERVAL = 64;
+
+struct HookTiming
+{
+    uint32_t n_calls;
+    bool timed;
+    uint64_t unwind_ns;
+};
+
+static_assert(std::is_trivially_destructible<HookTiming>::value);
+MEMRAY_FAST_TLS thread_local HookTiming t_hook_timing;
+
+uint64_t
+steadyNanoseconds()
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+                   std::chrono::steady_clock::now().time_since_epoch())
+            .count();
+}
+
+// Times the call to the hook that it's created in, if it's one of those
+// that are timed, and counts the calls since the last one that was.
+class HookTimer
+{
+  public:
+    explicit HookTimer(RecordWriter& writer)
+    : d_writer(writer)
+    {
+        auto& timing = t_hook_timing;
+        if (++timing.n_calls < HOOK_TIMING_INTERVAL) {
+            return;
+        }
+        timing = {0, true, 0};
+        d_start = steadyNanoseconds();
     }
-    RecursionGuard guard;
 
+    ~HookTimer()
+    {
+        auto& timing = t_hook_timing;
+        if (!timing.timed) {
+            return;
+        }
+        timing.timed = false;
+        uint64_t elapsed = steadyNanoseconds() - d_start;
+        d_writer.countHookCalls(
+                HOOK_TIMING_INTERVAL,
+                elapsed * HOOK_TIMING_INTERVAL,
+                timing.unwind_ns * HOOK_TIMING_INTERVAL);
+    }
+
+  private:
+    RecordWriter& d_writer;
+    uint64_t d_start{0};
+};
+
+}  // namespace
+
+size_t
+Tracker::captureNativeTrace()
+{
+    if (!d_unwind_native_frames) {
+        return 0;
+    }
+    NativeTrace trace;
+    auto& timing = t_hook_timing;
+    uint64_t unwind_start = timing.timed ? steadyNanoseconds() : 0;
+    // Skip the internal frames so we don't need to filter them later.
+    bool unwound = trace.fill(2, d_native_unwinder, d_max_native_frames);
+    if (timing.timed) {
+        timing.unwind_ns += steadyNanoseconds() - unwind_start;
+    }
+    if (!unwound) {
+        return 0;
+    }
+    auto key = NativeTraceIndexCache::keyFor(trace);
+    FrameTree::index_t cached_index = d_native_trace_index_cache->find(key);
+    if (cached_index) {
+        return cached_index;
+    }
+
+    auto callback = [&](frame_id_t ip, uint32_t index) {
+        return d_writer->writeRecord(RecordType::NATIVE_TRACE_INDEX, UnresolvedNativeFrame{ip, index});
+    };
+    FrameTree::TraceCache* cache = getNativeTraceCache();
+    size_t index = cache ? d_native_trace_tree.getTraceIndex(trace, callback, *cache)
+                         : d_native_trace_tree.getTraceIndex(trace, callback);
+    if (index) {
+        d_native_trace_index_cache->insert(key, index);
+    }
+    return index;
+}
+
+void
+Tracker::emitPythonStack()
+{
     // Grab a reference to the TLS variable to guarantee it's only resolved once.
     auto& python_stack_tracker = t_python_stack_tracker;
+#ifdef MEMRAY_HAS_LAZY_PYTHON_STACKS
+    if (d_lazy_python_stacks) {
+        // This doesn't need the GIL: only this thread changes its frames.
+        PyThreadState* ts = PyGILState_GetThisThreadState();
+        python_stack_tracker.loadFrameChain(ts != nullptr ? ts->frame : nullptr);
+        python_stack_tracker.emitPendingPops();
+        python_stack_tracker.emitPendingPushes();
+        return;
+    }
+#endif
     int lineno = python_stack_tracker.getCurrentPythonLineNumber();
 
     python_stack_tracker.setMostRecentFrameLineNumber(lineno);
     python_stack_tracker.emitPendingPops();
     python_stack_tracker.emitPendingPushes();
+}
+
+void
+Tracker::trackAllocationImpl(void* ptr, size_t size, hooks::Allocator func)
+{
+    if (RecursionGuard::isActive) {
+        return;
+    }
+    if (!Tracker::isActive()) {
+        countDeactivatedRecord();
+        return;
+    }
+    RecursionGuard guard;
+    HookTimer timer(*d_writer);
+
+    if (d_memory_gauges && !hooks::isPythonAllocator(func)) {
+        // What free() releases is only known from the allocator, so that's
+        // what's counted for an allocation as well.
+        bool simple = hooks::allocatorKind(func) == hooks::AllocatorKind::SIMPLE_ALLOCATOR;
+        d_tracked_bytes += simple ? malloc_usable_size(ptr) : size;
+    }
+    // The gauges need the addresses too, to only take back what they counted.
+    if (!d_count_allocations_only || d_memory_gauges) {
+        d_tracked_addresses.add(reinterpret_cast<uintptr_t>(ptr));
+    }
 
-    size_t native_index = 0;
-    if (d_unwind_native_frames) {
-        NativeTrace trace;
-        // Skip the internal frames so we don't need to filter them later.
-        if (trace.fill(2)) {
-            native_index = d_native_trace_tree.getTraceIndex(trace, [&](frame_id_t ip, uint32_t index) {
-                return d_writer->writeRecord(
-                        RecordType::NATIVE_TRACE_INDEX,
-                        UnresolvedNativeFrame{ip, index});
-            });
+    // Ranged allocations are rare and large, so they are always recorded.
+    if (d_sample_rate && hooks::allocatorKind(func) == hooks::AllocatorKind::SIMPLE_ALLOCATOR) {
+        if (!shouldSampleAllocation(size)) {
+            return;
         }
+        d_sampled_addresses.add(reinterpret_cast<uintptr_t>(ptr));
     }
 
+    emitPythonStack();
+
+    size_t native_index = captureNativeTrace();
     AllocationRecord record{thread_id(), reinterpret_cast<uintptr_t>(ptr), size, func, native_index};
-    if (!d_writer->writeRecord(RecordType::ALLOCATION, record)) {
+    if (!d_writer->writeThreadSpecificRecord(RecordType::ALLOCATION, record)) {
         std::cerr << "Failed to write output, deactivating tracking" << std::endl;
         deactivate();
     }
@@ -498,26 +1386,268 @@ Tracker::trackAllocationImpl(void* ptr, size_t size, hooks::Allocator func)
 void
 Tracker::trackDeallocationImpl(void* ptr, size_t size, hooks::Allocator func)
 {
-    if (RecursionGuard::isActive || !Tracker::isActive()) {
+    if (RecursionGuard::isActive) {
+        return;
+    }
+    if (!Tracker::isActive()) {
+        countDeactivatedRecord();
         return;
     }
     RecursionGuard guard;
+    HookTimer timer(*d_writer);
+
+    // Only what was allocated while tracking was counted. The other frees
+    // never get here, but unmaps do, since ranges are unmapped in pieces. Of
+    // those, only the ones at the start of a counted range are taken back.
+    if (d_memory_gauges && !hooks::isPythonAllocator(func)
+        && (func != hooks::Allocator::MUNMAP
+            || d_tracked_addresses.mayContain(reinterpret_cast<uintptr_t>(ptr))))
+    {
+        bool simple = hooks::allocatorKind(func) == hooks::AllocatorKind::SIMPLE_DEALLOCATOR;
+        d_tracked_bytes -= simple ? malloc_usable_size(ptr) : size;
+    }
+    if (d_count_allocations_only) {
+        return;
+    }
 
-    // Grab a reference to the TLS variable to guarantee it's only resolved once.
-    auto& python_stack_tracker = t_python_stack_tracker;
-    int lineno = python_stack_tracker.getCurrentPythonLineNumber();
+    if (d_sample_rate && hooks::allocatorKind(func) == hooks::AllocatorKind::SIMPLE_DEALLOCATOR
+        && !d_sampled_addresses.remove(reinterpret_cast<uintptr_t>(ptr)))
+    {
+        // The allocation being freed wasn't sampled.
+        return;
+    }
 
-    python_stack_tracker.setMostRecentFrameLineNumber(lineno);
-    python_stack_tracker.emitPendingPops();
-    python_stack_tracker.emitPendingPushes();
+    if (!d_lazy_python_stacks) {
+        // Deallocations don't need a stack, but emitting it now keeps the
+        // pending pushes and pops from piling up.
+        emitPythonStack();
+    }
 
     AllocationRecord record{thread_id(), reinterpret_cast<uintptr_t>(ptr), size, func, 0};
-    if (!d_writer->writeRecord(RecordType::ALLOCATION, record)) {
+    if (!d_writer->writeThreadSpecificRecord(RecordType::ALLOCATION, record)) {
         std::cerr << "Failed to write output, deactivating tracking" << std::endl;
         deactivate();
     }
 }
 
+void
+Tracker::trackReallocationImpl(
+        void* old_ptr,
+        void* new_ptr,
+        size_t size,
+        size_t old_size,
+        hooks::Allocator func)
+{
+    if (RecursionGuard::isActive) {
+        return;
+    }
+    if (!Tracker::isActive()) {
+        countDeactivatedRecord();
+        return;
+    }
+    RecursionGuard guard;
+    HookTimer timer(*d_writer);
+
+    auto old_address = reinterpret_cast<uintptr_t>(old_ptr);
+    auto new_address = reinterpret_cast<uintptr_t>(new_ptr);
+    // Like for a free, the old half can't match anything if it wasn't
+    // allocated while tracking, and it wasn't counted by the gauges either.
+    const bool old_was_tracked = old_address != 0 && d_tracked_addresses.mayContain(old_address);
+    if (d_memory_gauges && !hooks::isPythonAllocator(func)) {
+        d_tracked_bytes += malloc_usable_size(new_ptr);
+        if (old_was_tracked) {
+            d_tracked_bytes -= old_size;
+        }
+    }
+    if (!d_count_allocations_only || d_memory_gauges) {
+        d_tracked_addresses.add(new_address);
+    }
+    // Only the new half is counted, like any other allocation, when the
+    // allocations are only counted.
+    bool track_old = !d_count_allocations_only && old_was_tracked;
+    bool track_new = true;
+    if (d_sample_rate) {
+        track_old = track_old && d_sampled_addresses.remove(old_address);
+        track_new = shouldSampleAllocation(size);
+        if (track_new) {
+            d_sampled_addresses.add(new_address);
+        }
+    }
+    if (!track_old && !track_new) {
+        return;
+    }
+
+    emitPythonStack();
+
+    // The common case gets a single record for both halves of the operation.
+    // When only one of them needs to be recorded (because the old pointer was
+    // NULL, or because of sampling) it's recorded like it always used to be.
+    bool ok;
+    if (!track_new) {
+        auto deallocator = hooks::Allocator::FREE;
+        if (hooks::isPythonAllocator(func)) {
+            deallocator = hooks::Allocator::PYMALLOC_FREE;
+        }
+        AllocationRecord record{thread_id(), old_address, 0, deallocator, 0};
+        ok = d_writer->writeThreadSpecificRecord(RecordType::ALLOCATION, record);
+    } else {
+        size_t native_index = captureNativeTrace();
+        AllocationRecord record{thread_id(), new_address, size, func, native_index};
+        if (track_old) {
+            ReallocationRecord reallocation{record, old_address};
+            ok = d_writer->writeThreadSpecificRecord(RecordType::REALLOCATION, reallocation);
+        } else {
+            ok = d_writer->writeThreadSpecificRecord(RecordType::ALLOCATION, record);
+        }
+    }
+    if (!ok) {
+        std::cerr << "Failed to write output, deactivating tracking" << std::endl;
+        deactivate();
+    }
+}
+
+void
+Tracker::countDeactivatedRecord()
+{
+    // The hooks see what's allocated until they are uninstalled, and none of
+    // it is written. While we're dormant, that's what's meant to happen.
+    if (!isDormant()) {
+        d_deactivated_records.fetch_add(1, std::memory_order_relaxed);
+    }
+}
+
+TrackerOverhead
+Tracker::getOverhead()
+{
+    RecursionGuard guard;
+    TrackerOverhead overhead = d_writer->overhead();
+    overhead.deactivated_records += d_deactivated_records.load(std::memory_order_relaxed);
+    return overhead;
+}
+
+bool
+Tracker::shouldSampleAllocation(size_t size) const
+{
+    // Sampling points are laid out on the stream of bytes allocated by each
+    // thread so that the distance between consecutive points follows an
+    // exponential distribution with mean d_sample_rate (in other words, they
+    // form a Poisson process). An allocation is sampled if it contains at
+    // least one of them. This happens with probability
+    // 1 - exp(-size / d_sample_rate), which only depends on the allocation's
+    // size, so the reader can scale each sampled allocation back to an
+    // unbiased estimate of the memory it stands for.
+    auto& state = t_sampler_state;
+    auto next_distance = [&]() -> int64_t {
+        // xorshift64*: cheap and plenty good for picking sampling points.
+        state.rng_state ^= state.rng_state >> 12U;
+        state.rng_state ^= state.rng_state << 25U;
+        state.rng_state ^= state.rng_state >> 27U;
+        uint64_t random = state.rng_state * 0x2545F4914F6CDD1DULL;
+        // Uniformly distributed in (0, 1].
+        double uniform = (static_cast<double>(random >> 11U) + 1.0) * 0x1.0p-53;
+        return static_cast<int64_t>(-std::log(uniform) * static_cast<double>(d_sample_rate)) + 1;
+    };
+
+    if (state.rng_state == 0) {
+        state.rng_state = splitmix64(g_sampler_seed++ ^ thread_id()) | 1U;
+        state.bytes_until_next_sample = next_distance();
+    }
+
+    state.bytes_until_next_sample -= static_cast<int64_t>(size);
+    if (state.bytes_until_next_sample > 0) {
+        return false;
+    }
+
+    // The process is memoryless: the distance from the end of this allocation
+    // to the next sampling point follows the same distribution again.
+    state.bytes_until_next_sample = next_distance();
+    return true;
+}
+
+void
+SampledAddressSet::add(uintptr_t address)
+{
+    Shard& shard = shardFor(address);
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    shard.addresses.insert(address);
+}
+
+bool
+SampledAddressSet::remove(uintptr_t address)
+{
+    Shard& shard = shardFor(address);
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    return shard.addresses.erase(address) != 0;
+}
+
+SampledAddressSet::Shard&
+SampledAddressSet::shardFor(uintptr_t address)
+{
+    // The low bits of heap addresses are mostly alignment, so mix them before
+    // picking a shard.
+    uint64_t hash = (static_cast<uint64_t>(address) >> 4U) * 0x9E3779B97F4A7C15ULL;
+    return d_shards[hash >> 58U];
+}
+
+NativeTraceIndexCache::Key
+NativeTraceIndexCache::keyFor(const NativeTrace& trace)
+{
+    // Two independent multiplicative hashes of the instruction pointers,
+    // seeded with the depth of the stack.
+    uint64_t hash = 0x9E3779B97F4A7C15ULL ^ static_cast<uint64_t>(trace.size());
+    uint64_t check = static_cast<uint64_t>(trace.size());
+    for (int i = 0; i < trace.size(); ++i) {
+        uint64_t ip = trace[i];
+        hash = (hash ^ ip) * 0xFF51AFD7ED558CCDULL;
+        hash ^= hash >> 32U;
+        check = (check + ip) * 0xC4CEB9FE1A85EC53ULL;
+        check ^= check >> 29U;
+    }
+    // 0 marks a free slot.
+    return {hash | 1U, static_cast<uint32_t>(check >> 32U)};
+}
+
+FrameTree::index_t
+NativeTraceIndexCache::find(const Key& key) const
+{
+    for (size_t probe = 0; probe < MAX_PROBES; ++probe) {
+        const Slot& slot = d_slots[(key.hash + probe) & (NUM_SLOTS - 1)];
+        uint64_t hash = slot.hash.load(std::memory_order_acquire);
+        if (hash == 0) {
+            return 0;
+        }
+        if (hash != key.hash) {
+            continue;
+        }
+        uint64_t value = slot.value.load(std::memory_order_acquire);
+        if (value && static_cast<uint32_t>(value >> 32U) == key.check) {
+            return static_cast<FrameTree::index_t>(value);
+        }
+    }
+    return 0;
+}
+
+void
+NativeTraceIndexCache::insert(const Key& key, FrameTree::index_t index)
+{
+    uint64_t value = (static_cast<uint64_t>(key.check) << 32U) | index;
+    for (size_t probe = 0; probe < MAX_PROBES; ++probe) {
+        Slot& slot = d_slots[(key.hash + probe) & (NUM_SLOTS - 1)];
+        uint64_t hash = slot.hash.load(std::memory_order_relaxed);
+        if (hash == 0
+            && slot.hash.compare_exchange_strong(hash, key.hash, std::memory_order_acq_rel))
+        {
+            slot.value.store(value, std::memory_order_release);
+            return;
+        }
+        if (hash == key.hash) {
+            // Already cached by another thread, or a stack with the same
+            // hash got the slot first.
+            return;
+        }
+    }
+}
+
 void
 Tracker::invalidate_module_cache_impl()
 {
@@ -526,10 +1656,22 @@ Tracker::invalidate_module_cache_impl()
     updateModuleCache();
 }
 
+namespace {
+
+struct LoadedObject
+{
+    std::string filename;
+    uintptr_t addr;
+    std::vector<Segment> segments;
+    std::string build_id;
+};
+
+}  // namespace
+
 static int
 dl_iterate_phdr_callback(struct dl_phdr_info* info, [[maybe_unused]] size_t size, void* data)
 {
-    auto writer = reinterpret_cast<RecordWriter*>(data);
+    auto objects = reinterpret_cast<std::vector<LoadedObject>*>(data);
     const char* filename = info->dlpi_name;
     std::string executable;
     assert(filename != nullptr);
@@ -542,32 +1684,44 @@ dl_iterate_phdr_callback(struct dl_phdr_info* info, [[maybe_unused]] size_t size
         return 0;
     }
 
-    std::vector<Segment> segments;
+    LoadedObject object{filename, info->dlpi_addr, {}};
     for (int i = 0; i < info->dlpi_phnum; i++) {
         const auto& phdr = info->dlpi_phdr[i];
         if (phdr.p_type == PT_LOAD) {
-            segments.emplace_back(Segment{phdr.p_vaddr, phdr.p_memsz});
+            object.segments.emplace_back(Segment{phdr.p_vaddr, phdr.p_memsz});
+        } else if (phdr.p_type == PT_NOTE && object.build_id.empty()) {
+            // The notes are loaded with the object, so the build id is read
+            // from memory, and readers can find the symbols of the binary by
+            // it wherever they are.
+            object.build_id = findGnuBuildId(
+                    reinterpret_cast<const char*>(info->dlpi_addr + phdr.p_vaddr),
+                    phdr.p_memsz,
+                    phdr.p_align);
         }
     }
+    objects->push_back(std::move(object));
+    return 0;
+}
 
-    if (!writer->writeRecordUnsafe(
+static bool
+writeLoadedObject(RecordWriter& writer, const LoadedObject& object)
+{
+    if (!writer.writeRecordUnsafe(
                 RecordType::SEGMENT_HEADER,
-                SegmentHeader{filename, segments.size(), info->dlpi_addr}))
+                SegmentHeader{
+                        object.filename.c_str(),
+                        object.segments.size(),
+                        object.addr,
+                        object.build_id.c_str()}))
     {
-        std::cerr << "memray: Failed to write output, deactivating tracking" << std::endl;
-        Tracker::deactivate();
-        return 1;
+        return false;
     }
-
-    for (const auto& segment : segments) {
-        if (!writer->writeRecordUnsafe(RecordType::SEGMENT, segment)) {
-            std::cerr << "memray: Failed to write output, deactivating tracking" << std::endl;
-            Tracker::deactivate();
-            return 1;
+    for (const auto& segment : object.segments) {
+        if (!writer.writeRecordUnsafe(RecordType::SEGMENT, segment)) {
+            return false;
         }
     }
-
-    return 0;
+    return true;
 }
 
 void
@@ -576,13 +1730,67 @@ Tracker::updateModuleCacheImpl()
     if (!d_unwind_native_frames) {
         return;
     }
+    // The objects are listed with the writer's lock held, so that the updates
+    // of different threads are written in the same order that they saw them.
     auto writer_lock = d_writer->acquireLock();
-    if (!d_writer->writeSimpleType(RecordType::MEMORY_MAP_START)) {
+    std::vector<LoadedObject> objects;
+    dl_iterate_phdr(&dl_iterate_phdr_callback, &objects);
+
+    std::vector<std::pair<uintptr_t, std::string>> loaded_objects;
+    loaded_objects.reserve(objects.size());
+    for (const auto& object : objects) {
+        loaded_objects.emplace_back(object.addr, object.filename);
+    }
+    std::sort(loaded_objects.begin(), loaded_objects.end());
+
+    // Once the whole module cache has been written, only the objects that
+    // were loaded or unloaded since are, so loading many of them one after
+    // another doesn't write all of the previous ones again every time.
+    std::vector<std::pair<uintptr_t, std::string>> removed;
+    std::set_difference(
+            d_loaded_objects.begin(),
+            d_loaded_objects.end(),
+            loaded_objects.begin(),
+            loaded_objects.end(),
+            std::back_inserter(removed));
+    auto is_new = [&](const LoadedObject& object) {
+        return !std::binary_search(
+                d_loaded_objects.begin(),
+                d_loaded_objects.end(),
+                std::make_pair(object.addr, object.filename));
+    };
+    bool changed = !removed.empty() || std::any_of(objects.begin(), objects.end(), is_new);
+    if (d_module_cache_written && !changed) {
+        return;
+    }
+
+    // Allocations made before the module cache changed must be read with the
+    // old module cache, so get them out of the thread buffers first.
+    bool ok = d_writer->drainThreadBuffersUnsafe();
+    if (!d_module_cache_written) {
+        ok = ok && d_writer->writeMemoryMapStartUnsafe();
+        for (const auto& object : objects) {
+            ok = ok && writeLoadedObject(*d_writer, object);
+        }
+    } else {
+        ok = ok && d_writer->writeMemoryMapUpdateUnsafe();
+        for (const auto& [addr, filename] : removed) {
+            ok = ok
+                 && d_writer->writeRecordUnsafe(
+                         RecordType::SEGMENTS_REMOVED,
+                         RemovedSegments{filename.c_str(), addr});
+        }
+        for (const auto& object : objects) {
+            ok = ok && (!is_new(object) || writeLoadedObject(*d_writer, object));
+        }
+    }
+    if (!ok) {
         std::cerr << "memray: Failed to write output, deactivating tracking" << std::endl;
         deactivate();
+        return;
     }
-
-    dl_iterate_phdr(&dl_iterate_phdr_callback, d_writer.get());
+    d_loaded_objects = std::move(loaded_objects);
+    d_module_cache_written = true;
 }
 
 void
@@ -599,6 +1807,14 @@ Tracker::registerFrame(const RawFrame& frame)
 {
     const auto [frame_id, is_new_frame] = d_frames.getIndex(frame);
     if (is_new_frame) {
+        for (const auto& pattern : d_excluded_filenames) {
+            if (::fnmatch(pattern.c_str(), frame.filename, 0) == 0) {
+                // Frame ids only grow, so this never shrinks the vector.
+                d_excluded_frames.resize(frame_id + 1);
+                d_excluded_frames[frame_id] = true;
+                return frame_id;
+            }
+        }
         pyrawframe_map_val_t frame_index{frame_id, frame};
         if (!d_writer->writeRecord(RecordType::FRAME_INDEX, frame_index)) {
             std::cerr << "memray: Failed to write output, deactivating tracking" << std::endl;
@@ -608,6 +1824,12 @@ Tracker::registerFrame(const RawFrame& frame)
     return frame_id;
 }
 
+bool
+Tracker::isExcludedFrame(frame_id_t frame_id) const
+{
+    return frame_id < d_excluded_frames.size() && d_excluded_frames[frame_id];
+}
+
 bool
 Tracker::popFrames(uint32_t count)
 {
@@ -616,7 +1838,7 @@ Tracker::popFrames(uint32_t count)
         count -= to_pop;
 
         const FramePop entry{thread_id(), to_pop};
-        if (!d_writer->writeRecord(RecordType::FRAME_POP, entry)) {
+        if (!d_writer->writeThreadSpecificRecord(RecordType::FRAME_POP, entry)) {
             std::cerr << "memray: Failed to write output, deactivating tracking" << std::endl;
             deactivate();
             return false;
@@ -626,11 +1848,34 @@ Tracker::popFrames(uint32_t count)
 }
 
 bool
-Tracker::pushFrame(const RawFrame& frame)
+Tracker::pushFrame(const RawFrame& frame, bool& excluded)
 {
     const frame_id_t frame_id = registerFrame(frame);
+    excluded = isExcludedFrame(frame_id);
+    if (excluded) {
+        return true;
+    }
     const FramePush entry{frame_id, thread_id()};
-    if (!d_writer->writeRecord(RecordType::FRAME_PUSH, entry)) {
+    if (!d_writer->writeThreadSpecificRecord(RecordType::FRAME_PUSH, entry)) {
+        std::cerr << "memray: Failed to write output, deactivating tracking" << std::endl;
+        deactivate();
+        return false;
+    }
+    return true;
+}
+
+size_t
+Tracker::maxPythonFrames() const
+{
+    return d_max_python_frames;
+}
+
+bool
+Tracker::updateFrameLine(const RawFrame& frame)
+{
+    const frame_id_t frame_id = registerFrame(frame);
+    const FrameLineUpdate entry{frame_id, thread_id()};
+    if (!d_writer->writeThreadSpecificRecord(RecordType::FRAME_LINE_UPDATE, entry)) {
         std::cerr << "memray: Failed to write output, deactivating tracking" << std::endl;
         deactivate();
         return false;
@@ -642,11 +1887,13 @@ void
 Tracker::activate()
 {
     d_active = true;
+    d_dormant = false;
 }
 
 void
 Tracker::deactivate()
 {
+    d_dormant = false;
     d_active = false;
 }
 
@@ -656,6 +1903,12 @@ Tracker::isActive()
     return Tracker::d_active;
 }
 
+bool
+Tracker::isDormant()
+{
+    return Tracker::d_dormant.load(std::memory_order_relaxed);
+}
+
 // Static methods managing the singleton
 
 PyObject*
@@ -663,11 +1916,36 @@ Tracker::createTracker(
         std::unique_ptr<RecordWriter> record_writer,
         bool native_traces,
         unsigned int memory_interval,
-        bool follow_fork)
+        bool follow_fork,
+        size_t sample_rate,
+        NativeUnwinder native_unwinder,
+        bool lazy_python_stacks,
+        size_t max_python_frames,
+        size_t max_native_frames,
+        std::vector<std::string> excluded_filenames,
+        size_t trigger_rss,
+        size_t trigger_rss_growth,
+        size_t dump_rss,
+        bool memory_gauges,
+        bool trace_python_allocators)
 {
     // Note: the GIL is used for synchronization of the singleton
-    d_instance_owner.reset(
-            new Tracker(std::move(record_writer), native_traces, memory_interval, follow_fork));
+    d_instance_owner.reset(new Tracker(
+            std::move(record_writer),
+            native_traces,
+            memory_interval,
+            follow_fork,
+            sample_rate,
+            native_unwinder,
+            lazy_python_stacks,
+            max_python_frames,
+            max_native_frames,
+            std::move(excluded_filenames),
+            trigger_rss,
+            trigger_rss_growth,
+            dump_rss,
+            memory_gauges,
+            trace_python_allocators));
     Py_RETURN_NONE;
 }
 
@@ -695,13 +1973,13 @@ PyTraceFunction(
         [[maybe_unused]] PyObject* arg)
 {
     RecursionGuard guard;
-    if (!Tracker::isActive()) {
+    if (!Tracker::isActive() && !Tracker::isDormant()) {
         return 0;
     }
 
     switch (what) {
         case PyTrace_CALL: {
-            return t_python_stack_tracker.pushPythonFrame(frame);
+            return t_python_stack_tracker.pushPythonFrame(frame, frameCode(frame));
         }
         case PyTrace_RETURN: {
             t_python_stack_tracker.popPythonFrame();
@@ -718,6 +1996,10 @@ install_trace_function()
 {
     assert(PyGILState_Check());
     RecursionGuard guard;
+    if (g_code_names_index < 0) {
+        g_code_names_index = MEMRAY_REQUEST_CODE_EXTRA_INDEX(PyMem_RawFree);
+    }
+
     // Don't clear the python stack if we have already registered the tracking
     // function with the current thread.
     PyThreadState* ts = PyThreadState_Get();
@@ -1,14 +1,20 @@
 #pragma once
 
+#include <array>
 #include <atomic>
 #include <condition_variable>
+#include <csignal>
 #include <cstddef>
 #include <fstream>
 #include <iterator>
+#include <limits>
 #include <memory>
 #include <string>
+#include <mutex>
 #include <thread>
 #include <unordered_set>
+#include <utility>
+#include <vector>
 
 #include <unwind.h>
 
@@ -23,14 +29,14 @@
 #include "record_writer.h"
 #include "records.h"
 
-#ifdef MEMRAY_TLS_MODEL
-#    define MEMRAY_FAST_TLS __attribute__((tls_model(MEMRAY_TLS_MODEL)))
-#else
-#    define MEMRAY_FAST_TLS
-#endif
-
 namespace memray::tracking_api {
 
+// How native stacks are unwound when native traces are requested.
+enum class NativeUnwinder {
+    LIBUNWIND = 1,
+    FRAME_POINTER = 2,
+};
+
 // Trace function interface
 
 /**
@@ -83,14 +89,23 @@ class NativeTrace
     {
         return d_size;
     }
-    __attribute__((always_inline)) inline bool fill(size_t skip)
+    // Unwind the stack, leaving out the innermost skip frames. Only the
+    // innermost max_frames of the rest are kept, if that isn't 0.
+    __attribute__((always_inline)) inline bool
+    fill(size_t skip, NativeUnwinder unwinder, size_t max_frames = 0)
     {
-        size_t size = unwind(d_data.data());
-        if (size == MAX_SIZE) {
-            d_data.resize(0);
-            size = exact_unwind();
-            MAX_SIZE = MAX_SIZE * 2 > size ? MAX_SIZE * 2 : size;
-            d_data.resize(MAX_SIZE);
+        d_limit = max_frames ? skip + max_frames : std::numeric_limits<size_t>::max();
+        size_t size;
+        if (unwinder == NativeUnwinder::FRAME_POINTER) {
+            size = frame_pointer_unwind();
+        } else {
+            size = unwind(d_data.data());
+            if (size == MAX_SIZE && size < d_limit) {
+                d_data.resize(0);
+                size = exact_unwind();
+                MAX_SIZE = MAX_SIZE * 2 > size ? MAX_SIZE * 2 : size;
+                d_data.resize(MAX_SIZE);
+            }
         }
         d_size = size > skip ? size - skip : 0;
         d_skip = skip;
@@ -117,9 +132,9 @@ class NativeTrace
 
   private:
     MEMRAY_FAST_TLS static thread_local size_t MAX_SIZE;
-    __attribute__((always_inline)) static inline int unwind(frame_id_t* data)
+    __attribute__((always_inline)) inline int unwind(frame_id_t* data)
     {
-        return unw_backtrace((void**)data, MAX_SIZE);
+        return unw_backtrace((void**)data, std::min(MAX_SIZE, d_limit));
     }
 
     __attribute__((always_inline)) size_t inline exact_unwind()
@@ -143,16 +158,143 @@ class NativeTrace
                 return 0;
             }
             d_data.emplace_back(ip);
-        } while (unw_step(&cursor));
+        } while (d_data.size() < d_limit && unw_step(&cursor));
         return d_data.size();
     }
 
+    // Walk the chain of frame pointers, starting with the caller of this
+    // function (so that the frames match the ones reported by libunwind).
+    // This is much cheaper than libunwind, but only works as long as every
+    // function in the stack keeps a frame pointer. Must not be inlined.
+    __attribute__((noinline)) size_t frame_pointer_unwind();
+    __attribute__((noinline)) size_t resume_unwind_from(size_t size);
+    void append_frame(size_t index, ip_t ip);
+
   private:
     size_t d_size = 0;
     size_t d_skip = 0;
+    size_t d_limit = std::numeric_limits<size_t>::max();
     std::vector<ip_t> d_data;
 };
 
+/**
+ * Set of the addresses of the allocations selected while sampling
+ *
+ * When sampling, only the deallocations of the allocations that were recorded are of interest. This
+ * set is consulted from every deallocation hook, so it is split in shards with independent locks to
+ * keep threads that free memory at the same time from contending with each other.
+ **/
+class SampledAddressSet
+{
+  public:
+    void add(uintptr_t address);
+    bool remove(uintptr_t address);
+
+  private:
+    struct Shard
+    {
+        std::mutex mutex;
+        std::unordered_set<uintptr_t> addresses;
+    };
+    static constexpr size_t NUM_SHARDS = 64;
+
+    // Methods
+    Shard& shardFor(uintptr_t address);
+
+    // Data members
+    std::array<Shard, NUM_SHARDS> d_shards;
+};
+
+/**
+ * Approximate set of the addresses of the allocations made while tracking
+ *
+ * A process that started tracking late frees a lot of memory that it allocated before, and those
+ * frees can't match any allocation in the capture. This is a Bloom filter of the addresses that
+ * the allocation hooks recorded, checked by the deallocation hooks before they do anything else.
+ * It can say that an address might have been recorded when it wasn't, but never the opposite.
+ * Each address sets two bits of a single word, so adding one and checking for it take a single
+ * atomic operation, without any lock. Addresses are never removed, but the allocators reuse them
+ * so much that the filter fills up slowly, and a fuller filter only lets more frees through.
+ **/
+class TrackedAddressFilter
+{
+  public:
+    __attribute__((always_inline)) inline void add(uintptr_t address)
+    {
+        auto [word, mask] = locate(address);
+        // Don't take the cache line away from other threads if there's no need.
+        if ((word.load(std::memory_order_relaxed) & mask) != mask) {
+            word.fetch_or(mask, std::memory_order_relaxed);
+        }
+    }
+
+    __attribute__((always_inline)) inline bool mayContain(uintptr_t address) const
+    {
+        auto [word, mask] = locate(address);
+        return (word.load(std::memory_order_relaxed) & mask) == mask;
+    }
+
+  private:
+    // 4 MiB of bits.
+    static constexpr unsigned int WORD_BITS = 19;
+    static constexpr size_t NUM_WORDS = size_t(1) << WORD_BITS;
+
+    // Methods
+    __attribute__((always_inline)) inline std::pair<std::atomic<uint64_t>&, uint64_t>
+    locate(uintptr_t address) const
+    {
+        // The low bits of heap addresses are mostly alignment, so mix them
+        // before picking the word and the bits in it.
+        uint64_t hash = static_cast<uint64_t>(address) >> 4U;
+        hash = (hash ^ (hash >> 33U)) * 0xFF51AFD7ED558CCDULL;
+        hash ^= hash >> 29U;
+        uint64_t mask = (uint64_t(1) << (hash & 63U)) | (uint64_t(1) << ((hash >> 6U) & 63U));
+        return {d_words[hash >> (64U - WORD_BITS)], mask};
+    }
+
+    // Data members
+    std::unique_ptr<std::atomic<uint64_t>[]> d_words{new std::atomic<uint64_t>[NUM_WORDS]()};
+};
+
+/**
+ * Cache of the FrameTree index of whole native stacks, by a hash of their instruction pointers
+ *
+ * Most allocations come from a stack that was seen before, and finding it here takes a single
+ * lookup without any lock, where the FrameTree would be walked frame by frame under its mutex.
+ * Stacks are told apart by a 96 bit fingerprint. Slots are claimed once and never change their
+ * stack afterwards, and a stack that doesn't find a free slot near its hash is simply not
+ * cached: it's still found in the FrameTree, just more slowly.
+ **/
+class NativeTraceIndexCache
+{
+  public:
+    struct Key
+    {
+        uint64_t hash;
+        uint32_t check;
+    };
+
+    static Key keyFor(const NativeTrace& trace);
+    // Returns 0 if the stack isn't cached.
+    FrameTree::index_t find(const Key& key) const;
+    void insert(const Key& key, FrameTree::index_t index);
+
+  private:
+    struct Slot
+    {
+        // 0 while the slot is free.
+        std::atomic<uint64_t> hash{0};
+        // The check in the high half and the index in the low one, or 0
+        // while the claimed slot is still being filled.
+        std::atomic<uint64_t> value{0};
+    };
+    static constexpr size_t NUM_SLOTS = 64 * 1024;
+    static constexpr size_t MAX_PROBES = 8;
+
+    // Data members
+    std::unique_ptr<Slot[]> d_slots{new Slot[NUM_SLOTS]};
+};
+
 /**
  * Singleton managing all the global state and functionality of the tracing mechanism
  *
@@ -178,7 +320,18 @@ class Tracker
             std::unique_ptr<RecordWriter> record_writer,
             bool native_traces,
             unsigned int memory_interval,
-            bool follow_fork);
+            bool follow_fork,
+            size_t sample_rate,
+            NativeUnwinder native_unwinder,
+            bool lazy_python_stacks,
+            size_t max_python_frames,
+            size_t max_native_frames,
+            std::vector<std::string> excluded_filenames,
+            size_t trigger_rss,
+            size_t trigger_rss_growth,
+            size_t dump_rss,
+            bool memory_gauges,
+            bool trace_python_allocators);
     static PyObject* destroyTracker();
     static Tracker* getTracker();
 
@@ -194,13 +347,44 @@ class Tracker
 
     __attribute__((always_inline)) inline static void
     trackDeallocation(void* ptr, size_t size, hooks::Allocator func)
+    {
+        Tracker* tracker = getTracker();
+        if (!tracker) {
+            return;
+        }
+        // Ranges can be unmapped in pieces, so only whole allocations can
+        // be told apart by their address.
+        if (func != hooks::Allocator::MUNMAP
+            && !tracker->d_tracked_addresses.mayContain(reinterpret_cast<uintptr_t>(ptr)))
+        {
+            // Not allocated while tracking, so there's nothing to match.
+            return;
+        }
+        tracker->trackDeallocationImpl(ptr, size, func);
+    }
+
+    __attribute__((always_inline)) inline static void
+    trackReallocation(
+            void* old_ptr,
+            void* new_ptr,
+            size_t size,
+            size_t old_size,
+            hooks::Allocator func)
     {
         Tracker* tracker = getTracker();
         if (tracker) {
-            tracker->trackDeallocationImpl(ptr, size, func);
+            tracker->trackReallocationImpl(old_ptr, new_ptr, size, old_size, func);
         }
     }
 
+    // Whether the hooks must find the size of what realloc() is given, which
+    // can't be known once it has been reallocated.
+    __attribute__((always_inline)) inline static bool countsTrackedBytes()
+    {
+        Tracker* tracker = getTracker();
+        return tracker && tracker->d_memory_gauges;
+    }
+
     __attribute__((always_inline)) inline static void invalidate_module_cache()
     {
         Tracker* tracker = getTracker();
@@ -226,20 +410,33 @@ class Tracker
     }
 
     // RawFrame stack interface
-    bool pushFrame(const RawFrame& frame);
+    bool pushFrame(const RawFrame& frame, bool& excluded);
     bool popFrames(uint32_t count);
+    bool updateFrameLine(const RawFrame& frame);
+    size_t maxPythonFrames() const;
 
     // Interface to activate/deactivate the tracking
     static const std::atomic<bool>& isActive();
+    static bool isDormant();
     static void activate();
     static void deactivate();
 
+    // What tracking has cost so far, as counted by the tracker and its writer.
+    TrackerOverhead getOverhead();
+
   private:
     class BackgroundThread
     {
       public:
         // Constructors
-        BackgroundThread(std::shared_ptr<RecordWriter> record_writer, unsigned int memory_interval);
+        BackgroundThread(
+                std::shared_ptr<RecordWriter> record_writer,
+                unsigned int memory_interval,
+                size_t trigger_rss,
+                size_t trigger_rss_growth,
+                size_t dump_rss,
+                bool memory_gauges);
+        ~BackgroundThread();
 
         // Methods
         void start();
@@ -250,35 +447,106 @@ class Tracker
         std::shared_ptr<RecordWriter> d_writer;
         bool d_stop{false};
         unsigned int d_memory_interval;
+        size_t d_trigger_rss;
+        size_t d_trigger_rss_growth;
+        unsigned long int d_growth_window_start{0};
+        size_t d_growth_window_rss{0};
+        size_t d_dump_rss;
+        bool d_above_dump_rss{false};
         std::mutex d_mutex;
         std::condition_variable d_cv;
         std::thread d_thread;
-        mutable std::ifstream d_procs_statm;
+        int d_procs_statm{-1};
+        bool d_memory_gauges;
 
         // Methods
         size_t getRSS() const;
+        MemoryGauges getGauges() const;
+        bool writeMemoryRecord(size_t rss);
+        bool crossedTrigger(size_t rss);
+        bool crossedDumpThreshold(size_t rss);
         static unsigned long int timeElapsed();
     };
 
     // Data members
     FrameCollection<RawFrame> d_frames{0, 2};
     static std::atomic<bool> d_active;
+    // Set while the tracker waits for the RSS to cross its trigger. The hooks
+    // and the Python stacks are kept up to date, but nothing is recorded.
+    static std::atomic<bool> d_dormant;
+    // Set from the SIGUSR2 handler when the writer only keeps the most recent
+    // records. The background thread writes them out the next time it runs.
+    static std::atomic<bool> d_dump_requested;
     static std::unique_ptr<Tracker> d_instance_owner;
     static std::atomic<Tracker*> d_instance;
+    // The patcher locked by prepareFork(), if there was a tracker to lock.
+    static elf::SymbolPatcher* d_forking_patcher;
 
     std::shared_ptr<RecordWriter> d_writer;
     FrameTree d_native_trace_tree;
     bool d_unwind_native_frames;
+    // Only created when native traces are unwound.
+    std::unique_ptr<NativeTraceIndexCache> d_native_trace_index_cache;
+    NativeUnwinder d_native_unwinder;
     unsigned int d_memory_interval;
     bool d_follow_fork;
+    size_t d_sample_rate;
+    // Walk the frames of a thread when it allocates, instead of following
+    // every call and return with the trace function.
+    bool d_lazy_python_stacks;
+    // Only the innermost frames of the stacks are kept, when these aren't 0.
+    size_t d_max_python_frames;
+    size_t d_max_native_frames;
+    // Python frames whose file name matches one of these fnmatch patterns are
+    // left out of the stacks. Each frame is matched once, when it is first
+    // registered, and the excluded ones are never written.
+    std::vector<std::string> d_excluded_filenames;
+    std::vector<bool> d_excluded_frames;
+    size_t d_trigger_rss;
+    size_t d_trigger_rss_growth;
+    size_t d_dump_rss;
+    // Sample the state of the allocators along with the RSS. The bytes that
+    // the hooks saw allocated and not yet freed are counted while this is set.
+    bool d_memory_gauges;
+    static std::atomic<int64_t> d_tracked_bytes;
+    // What the hooks saw while there was a tracker that wasn't active, and
+    // wasn't dormant either.
+    static std::atomic<uint64_t> d_deactivated_records;
+    // Hook the Python allocators as well, which records the objects that
+    // pymalloc hands out instead of the arenas they come from.
+    bool d_trace_python_allocators;
+    // The writer only counts the allocations made by each location, so the
+    // frees, and the addresses, don't matter.
+    bool d_count_allocations_only;
+    bool d_handles_sigusr2{false};
+    struct sigaction d_previous_sigusr2_action{};
+    SampledAddressSet d_sampled_addresses;
+    // The addresses of the allocations seen while active, so that the frees
+    // of the ones that weren't can be dropped right away.
+    TrackedAddressFilter d_tracked_addresses;
     elf::SymbolPatcher d_patcher;
     std::unique_ptr<BackgroundThread> d_background_thread;
+    // The objects that the module cache was last written with, by their load
+    // address and name, so that updates only need to write what changed.
+    std::vector<std::pair<uintptr_t, std::string>> d_loaded_objects;
+    bool d_module_cache_written{false};
 
     // Methods
     frame_id_t registerFrame(const RawFrame& frame);
+    bool isExcludedFrame(frame_id_t frame_id) const;
+    bool shouldSampleAllocation(size_t size) const;
+    static void countDeactivatedRecord();
+    void emitPythonStack();
 
     void trackAllocationImpl(void* ptr, size_t size, hooks::Allocator func);
     void trackDeallocationImpl(void* ptr, size_t size, hooks::Allocator func);
+    void trackReallocationImpl(
+            void* old_ptr,
+            void* new_ptr,
+            size_t size,
+            size_t old_size,
+            hooks::Allocator func);
+    __attribute__((always_inline)) inline size_t captureNativeTrace();
     void invalidate_module_cache_impl();
     void updateModuleCacheImpl();
     void registerThreadNameImpl(const char* name);
@@ -287,11 +555,24 @@ class Tracker
             std::unique_ptr<RecordWriter> record_writer,
             bool native_traces,
             unsigned int memory_interval,
-            bool follow_fork);
+            bool follow_fork,
+            size_t sample_rate,
+            NativeUnwinder native_unwinder,
+            bool lazy_python_stacks,
+            size_t max_python_frames,
+            size_t max_native_frames,
+            std::vector<std::string> excluded_filenames,
+            size_t trigger_rss,
+            size_t trigger_rss_growth,
+            size_t dump_rss,
+            bool memory_gauges,
+            bool trace_python_allocators,
+            elf::SymbolPatcher* parent_patcher = nullptr);
 
     static void prepareFork();
     static void parentFork();
     static void childFork();
+    static void requestDump(int signal);
 };
 
 }  // namespace memray::tracking_api
@@ -1,10 +1,16 @@
 from _memray.record_writer cimport RecordWriter
+from _memray.records cimport TrackerOverhead
 from libcpp cimport bool
 from libcpp.memory cimport unique_ptr
 from libcpp.string cimport string
+from libcpp.vector cimport vector
 
 
 cdef extern from "tracking_api.h" namespace "memray::tracking_api":
+    cdef enum NativeUnwinder 'memray::tracking_api::NativeUnwinder':
+        NativeUnwinderLibunwind 'memray::tracking_api::NativeUnwinder::LIBUNWIND'
+        NativeUnwinderFramePointer 'memray::tracking_api::NativeUnwinder::FRAME_POINTER'
+
     void install_trace_function() except*
 
     cdef cppclass Tracker:
@@ -14,6 +20,17 @@ cdef extern from "tracking_api.h" namespace "memray::tracking_api":
             bool native_traces,
             unsigned int memory_interval,
             bool follow_fork,
+            size_t sample_rate,
+            NativeUnwinder native_unwinder,
+            bool lazy_python_stacks,
+            size_t max_python_frames,
+            size_t max_native_frames,
+            vector[string] excluded_filenames,
+            size_t trigger_rss,
+            size_t trigger_rss_growth,
+            size_t dump_rss,
+            bool memory_gauges,
+            bool trace_python_allocators,
         ) except+
 
         @staticmethod
@@ -21,3 +38,5 @@ cdef extern from "tracking_api.h" namespace "memray::tracking_api":
 
         @staticmethod
         Tracker* getTracker()
+
+        TrackerOverhead getOverhead() except+
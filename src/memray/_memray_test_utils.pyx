@@ -119,3 +119,150 @@ cdef class MmapAllocator:
 @cython.profile(True)
 cdef void* _pthread_worker(void* arg) with gil:
     (<object> arg)()
+
+
+cdef extern from "Python.h":
+    void* PyMem_Malloc(size_t)
+    void* PyMem_Calloc(size_t, size_t)
+    void* PyMem_Realloc(void*, size_t)
+    void PyMem_Free(void*)
+    void* PyObject_Malloc(size_t)
+    void* PyObject_Calloc(size_t, size_t)
+    void* PyObject_Realloc(void*, size_t)
+    void PyObject_Free(void*)
+
+
+cdef class PymallocMemoryAllocator:
+    """Allocate memory from one of the domains of the Python allocators.
+
+    ``domain`` is either ``"mem"``, for ``PyMem_Malloc`` and friends, or
+    ``"object"``, for ``PyObject_Malloc`` and friends.
+    """
+    cdef void* ptr
+    cdef bint _object_domain
+
+    def __cinit__(self, domain):
+        if domain not in ("mem", "object"):
+            raise ValueError("domain must be 'mem' or 'object'")
+        self.ptr = NULL
+        self._object_domain = domain == "object"
+
+    @cython.profile(True)
+    def free(self):
+        if self.ptr == NULL:
+            raise RuntimeError("Pointer cannot be NULL")
+        if self._object_domain:
+            PyObject_Free(self.ptr)
+        else:
+            PyMem_Free(self.ptr)
+        self.ptr = NULL
+
+    @cython.profile(True)
+    def malloc(self, size_t size):
+        if self._object_domain:
+            self.ptr = PyObject_Malloc(size)
+        else:
+            self.ptr = PyMem_Malloc(size)
+
+    @cython.profile(True)
+    def calloc(self, size_t size):
+        if self._object_domain:
+            self.ptr = PyObject_Calloc(1, size)
+        else:
+            self.ptr = PyMem_Calloc(1, size)
+
+    @cython.profile(True)
+    def realloc(self, size_t size):
+        if self._object_domain:
+            self.ptr = PyObject_Malloc(1)
+            self.ptr = PyObject_Realloc(self.ptr, size)
+        else:
+            self.ptr = PyMem_Malloc(1)
+            self.ptr = PyMem_Realloc(self.ptr, size)
+
+
+# Native benchmarks of the tracking hot path. Each one returns the average
+# nanoseconds per iteration seen by one of its threads.
+
+def benchmark_track_allocations(size_t n_threads, size_t n_iterations):
+    """Report an allocation and its deallocation to the active tracker."""
+    cdef double ret
+    with nogil:
+        ret = trackAllocations(n_threads, n_iterations)
+    return ret
+
+
+def benchmark_write_allocation_records(file_name, size_t n_threads, size_t n_iterations):
+    """Write allocation records to a file, or nowhere if file_name is None."""
+    cdef cppstring c_file_name
+    if file_name is not None:
+        c_file_name = os.fsencode(file_name)
+    cdef double ret
+    with nogil:
+        ret = writeAllocationRecords(c_file_name, n_threads, n_iterations)
+    return ret
+
+
+def benchmark_look_up_traces(
+    size_t n_threads, size_t n_iterations, size_t n_stacks, size_t depth, bool use_cache
+):
+    """Look up stacks in a frame tree shared by all the threads."""
+    cdef double ret
+    with nogil:
+        ret = lookUpTraces(n_threads, n_iterations, n_stacks, depth, use_cache)
+    return ret
+
+
+def write_synthetic_capture(file_name, size_t n_records, size_t stack_depth):
+    """Write a capture that a single thread with deep Python stacks could have made."""
+    cdef cppstring c_file_name = os.fsencode(file_name)
+    with nogil:
+        writeSyntheticCapture(c_file_name, n_records, stack_depth)
+
+
+def benchmark_read_records(file_name):
+    """Parse every record of a capture, and return how many allocations it has."""
+    cdef cppstring c_file_name = os.fsencode(file_name)
+    cdef size_t ret
+    with nogil:
+        ret = readRecords(c_file_name)
+    return ret
+
+
+def benchmark_live_throughput(size_t n_threads, size_t n_iterations):
+    """Send allocation records through a socket to a live reader in this process.
+
+    Returns a dict with the events read per second, the mean and the maximum
+    lag of the reader in nanoseconds, and the nanoseconds the writer spent
+    blocked waiting for the reader.
+    """
+    cdef LiveThroughput ret
+    with nogil:
+        ret = liveThroughput(n_threads, n_iterations)
+    return ret
+
+
+cdef class SnapshotBenchmark:
+    """The allocations of a capture, read once, to time the snapshots of them."""
+    cdef unique_ptr[NativeSnapshotBenchmark] _impl
+
+    def __init__(self, file_name):
+        cdef cppstring c_file_name = os.fsencode(file_name)
+        with nogil:
+            self._impl.reset(new NativeSnapshotBenchmark(c_file_name))
+
+    @property
+    def num_records(self):
+        return self._impl.get().numRecords()
+
+    def high_watermark(self):
+        cdef size_t ret
+        with nogil:
+            ret = self._impl.get().highWatermark()
+        return ret
+
+    def snapshot_allocations(self, size_t n_records, bool merge_threads=True):
+        cdef size_t ret
+        with nogil:
+            ret = self._impl.get().snapshotAllocations(n_records, merge_threads)
+        return ret
@@ -1,5 +1,75 @@
 from dataclasses import dataclass
 from datetime import datetime
+from typing import Dict
+from typing import Optional
+from typing import Tuple
+
+
+@dataclass
+class TrackerOverhead:
+    """What tracking cost the tracked process, as counted by the tracker.
+
+    Only a sample of the calls to the hooks is timed, so the times spent in
+    them, and unwinding native stacks within them, are estimates. The records
+    and bytes are what was handed to the writer, by record type.
+    """
+
+    n_hook_calls: int
+    hooks_time_ns: int
+    unwind_time_ns: int
+    lock_wait_time_ns: int
+    deactivated_records: int
+    records_by_type: Dict[str, int]
+    bytes_by_type: Dict[str, int]
+
+
+@dataclass
+class LiveStats:
+    """How well a live reader keeps up with the tracked process.
+
+    The tracker reports every so often how long it has waited for the
+    reader to take its records, and when it made the report. ``lag_ns`` is
+    how long before being read the last report was made, and ``max_lag_ns``
+    is the most that any of them took. They compare the clocks of both ends,
+    so they are only meaningful when both run on the same host. They stay
+    at 0 until the first report arrives, which ``n_reports`` tells.
+    """
+
+    n_allocations: int
+    n_reports: int
+    sender_blocked_time_ns: int
+    lag_ns: int
+    max_lag_ns: int
+
+
+@dataclass
+class ReadProgress:
+    """How far a reader has got with one phase of reading a capture.
+
+    The phase is ``"parse"``, when ``completed`` and ``total`` count bytes of
+    the file (compressed bytes, for compressed captures), ``"high_watermark"``,
+    when they count allocations, or ``"symbolization"``, when they count the
+    addresses of native frames. ``total`` is 0 if it isn't known.
+    """
+
+    phase: str
+    completed: int
+    total: int
+    records: int
+    elapsed_time: float
+    finished: bool
+
+    @property
+    def records_per_second(self) -> float:
+        if self.elapsed_time <= 0:
+            return 0.0
+        return self.records / self.elapsed_time
+
+    @property
+    def fraction(self) -> Optional[float]:
+        if not self.total:
+            return None
+        return self.completed / self.total
 
 
 @dataclass
@@ -12,3 +82,34 @@ class Metadata:
     command_line: str
     pid: int
     python_allocator: str
+    sample_rate: int = 0
+    dropped_records: int = 0
+    # None for captures made before the tracker counted its overhead.
+    overhead: Optional[TrackerOverhead] = None
+
+
+@dataclass
+class CaptureSummary:
+    file_name: str
+    pid: int
+    command_line: str
+    peak_memory: int
+    leaked_memory: int
+    leaked_allocations: int
+
+
+@dataclass
+class StackDelta:
+    stack: Tuple[Tuple[str, str, int], ...]
+    size_before: int
+    size_after: int
+    n_allocations_before: int
+    n_allocations_after: int
+
+    @property
+    def size_delta(self) -> int:
+        return self.size_after - self.size_before
+
+    @property
+    def n_allocations_delta(self) -> int:
+        return self.n_allocations_after - self.n_allocations_before
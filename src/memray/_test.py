@@ -1,11 +1,27 @@
 from ._memray import MemoryAllocator
 from ._memray import MmapAllocator
+from ._memray import PymallocMemoryAllocator
+from ._memray import SnapshotBenchmark
 from ._memray import _cython_nested_allocation
+from ._memray import benchmark_live_throughput
+from ._memray import benchmark_look_up_traces
+from ._memray import benchmark_read_records
+from ._memray import benchmark_track_allocations
+from ._memray import benchmark_write_allocation_records
 from ._memray import set_thread_name
+from ._memray import write_synthetic_capture
 
 __all__ = [
     "MemoryAllocator",
     "_cython_nested_allocation",
+    "benchmark_live_throughput",
+    "benchmark_look_up_traces",
+    "benchmark_read_records",
+    "benchmark_track_allocations",
+    "benchmark_write_allocation_records",
     "MmapAllocator",
+    "PymallocMemoryAllocator",
+    "SnapshotBenchmark",
     "set_thread_name",
+    "write_synthetic_capture",
 ]
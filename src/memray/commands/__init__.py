@@ -14,13 +14,16 @@ from memray._errors import MemrayCommandError
 from memray._errors import MemrayError
 from memray._memray import set_log_level
 
+from . import diff
 from . import flamegraph
 from . import live
+from . import merge
 from . import parse
 from . import run
 from . import stats
 from . import summary
 from . import table
+from . import transform
 from . import tree
 
 _EPILOG = textwrap.dedent(
@@ -62,6 +65,9 @@ _COMMANDS: List[Command] = [
     parse.ParseCommand(),
     summary.SummaryCommand(),
     stats.StatsCommand(),
+    merge.MergeCommand(),
+    diff.DiffCommand(),
+    transform.TransformCommand(),
 ]
 
 
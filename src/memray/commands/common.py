@@ -1,23 +1,92 @@
 import argparse
+import contextlib
 import os
 import pathlib
+import sys
 from pathlib import Path
+from typing import Any
+from typing import Dict
 from typing import Iterable
+from typing import Iterator
 from typing import Optional
 from typing import Tuple
 
+from rich.console import Console
+from rich.progress import BarColumn
+from rich.progress import Progress
+from rich.progress import TaskID
+from rich.progress import TextColumn
+from rich.progress import TimeRemainingColumn
+
 try:
     from typing import Protocol
 except ImportError:
     from typing_extensions import Protocol  # type: ignore
 
 from memray import AllocationRecord
+from memray import FileFormat
 from memray import FileReader
 from memray import MemoryRecord
+from memray import ReadProgress
 from memray._errors import MemrayCommandError
 from memray.reporters import BaseReporter
 
 
+def default_symbol_cache_dir() -> Path:
+    """Where reports keep the symbols of native frames, to reuse them later."""
+    cache_home = os.environ.get("XDG_CACHE_HOME") or os.path.expanduser("~/.cache")
+    return Path(cache_home) / "memray" / "symbols"
+
+
+READ_PHASE_DESCRIPTIONS = {
+    "parse": "Reading records",
+    "high_watermark": "Finding the high water mark",
+    "symbolization": "Resolving native symbols",
+}
+
+
+@contextlib.contextmanager
+def read_progress() -> Iterator[Dict[str, Any]]:
+    """Show how far the reading of a capture has got, on stderr.
+
+    This yields the keyword arguments that make a reader report its progress,
+    which are none at all if stderr isn't a terminal. The bars are removed
+    once the context is left.
+    """
+    if not sys.stderr.isatty():
+        yield {}
+        return
+
+    progress = Progress(
+        TextColumn("{task.description}"),
+        BarColumn(),
+        TextColumn("{task.percentage:>3.0f}%"),
+        TextColumn("{task.fields[rate]}"),
+        TimeRemainingColumn(),
+        console=Console(file=sys.stderr),
+        transient=True,
+    )
+    tasks: Dict[str, TaskID] = {}
+
+    def report(update: ReadProgress) -> None:
+        if update.phase not in tasks:
+            tasks[update.phase] = progress.add_task(
+                READ_PHASE_DESCRIPTIONS[update.phase], total=update.total, rate=""
+            )
+        rate = ""
+        if update.records:
+            rate = f"{update.records_per_second:,.0f} records/s"
+        progress.update(
+            tasks[update.phase],
+            completed=update.completed,
+            total=update.total,
+            rate=rate,
+        )
+
+    with progress:
+        yield {"progress_callback": report}
+
+
 class ReporterFactory(Protocol):
     def __call__(
         self,
@@ -72,22 +141,41 @@ class HighWatermarkCommand:
         show_memory_leaks: bool,
         merge_threads: Optional[bool] = None,
     ) -> None:
+        snapshot_merge_threads = merge_threads if merge_threads is not None else True
         try:
-            reader = FileReader(os.fspath(result_path))
-            if show_memory_leaks:
-                snapshot = reader.get_leaked_allocation_records(
-                    merge_threads=merge_threads if merge_threads is not None else True
+            with read_progress() as progress_kwargs:
+                reader = FileReader(
+                    os.fspath(result_path),
+                    symbol_cache_dir=default_symbol_cache_dir(),
+                    high_watermark_index=True,
+                    **progress_kwargs,
                 )
-            else:
-                snapshot = reader.get_high_watermark_allocation_records(
-                    merge_threads=merge_threads if merge_threads is not None else True
+                if reader.file_format == FileFormat.ALLOCATION_COUNTS:
+                    # What each stack allocated over the whole run stands in
+                    # for what it had allocated at the peak.
+                    if show_memory_leaks:
+                        raise MemrayCommandError(
+                            f"{result_path} only counts the allocations made "
+                            "by each stack, and has no leaks to report",
+                            exit_code=1,
+                        )
+                    snapshot = reader.get_allocation_counts(
+                        merge_threads=snapshot_merge_threads
+                    )
+                elif show_memory_leaks:
+                    snapshot = reader.get_leaked_allocation_records(
+                        merge_threads=snapshot_merge_threads
+                    )
+                else:
+                    snapshot = reader.get_high_watermark_allocation_records(
+                        merge_threads=snapshot_merge_threads
+                    )
+                memory_records = tuple(reader.get_memory_records())
+                reporter = self.reporter_factory(
+                    snapshot,
+                    memory_records=memory_records,
+                    native_traces=reader.has_native_traces,
                 )
-            memory_records = tuple(reader.get_memory_records())
-            reporter = self.reporter_factory(
-                snapshot,
-                memory_records=memory_records,
-                native_traces=reader.has_native_traces,
-            )
         except OSError as e:
             raise MemrayCommandError(
                 f"Failed to parse allocation records in {result_path}\nReason: {e}",
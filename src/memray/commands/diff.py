@@ -0,0 +1,63 @@
+import argparse
+import os
+from pathlib import Path
+
+from memray import CaptureDiff
+from memray._errors import MemrayCommandError
+from memray.commands.common import default_symbol_cache_dir
+from memray.reporters.diff import DiffReporter
+
+
+class DiffCommand:
+    """Compare the memory usage of two tracker runs, stack by stack"""
+
+    def prepare_parser(self, parser: argparse.ArgumentParser) -> None:
+        parser.add_argument(
+            "before", help="Results of the tracker run to compare against"
+        )
+        parser.add_argument("after", help="Results of the tracker run to compare")
+        parser.add_argument(
+            "--leaks",
+            help="Compare memory leaks, instead of peak memory usage",
+            action="store_true",
+            dest="show_memory_leaks",
+            default=False,
+        )
+        parser.add_argument(
+            "-r",
+            "--max-rows",
+            help="Maximum number of stacks to display",
+            type=int,
+            default=None,
+        )
+        parser.add_argument(
+            "-j",
+            "--max-workers",
+            help="Maximum number of threads to read the capture files with",
+            type=int,
+            default=None,
+        )
+
+    def run(self, args: argparse.Namespace, parser: argparse.ArgumentParser) -> None:
+        if args.max_workers is not None and args.max_workers < 1:
+            parser.error("The --max-workers argument must be at least 1")
+
+        for results in (args.before, args.after):
+            result_path = Path(results)
+            if not result_path.exists() or not result_path.is_file():
+                raise MemrayCommandError(f"No such file: {results}", exit_code=1)
+        try:
+            diff = CaptureDiff(
+                os.fspath(args.before),
+                os.fspath(args.after),
+                max_workers=args.max_workers,
+                symbol_cache_dir=default_symbol_cache_dir(),
+            )
+            reporter = DiffReporter(diff, show_memory_leaks=args.show_memory_leaks)
+        except OSError as e:
+            raise MemrayCommandError(
+                f"Failed to parse allocation records\nReason: {e}",
+                exit_code=1,
+            )
+
+        reporter.render(max_rows=args.max_rows)
@@ -91,11 +91,18 @@ class LiveCommand:
             raise MemrayCommandError(f"Invalid port: {port}", exit_code=1)
         with SocketReader(port=port) as reader:
             tui = TUI(reader.pid, reader.command_line, reader.has_native_traces)
+            version = 0
+            symbols_version = 0
 
             def _get_renderable() -> Layout:
+                nonlocal version, symbols_version
                 if tui.active:
-                    snapshot = list(reader.get_current_snapshot(merge_threads=False))
-                    tui.update_snapshot(snapshot)
+                    version, changes = reader.get_snapshot_changes(since=version)
+                    tui.update_snapshot_changes(changes)
+                    if reader.symbols_version != symbols_version:
+                        symbols_version = reader.symbols_version
+                        tui.refresh_stacks()
+                    tui.update_live_stats(reader.live_stats)
 
                 if not reader.is_active:
                     tui.active = False
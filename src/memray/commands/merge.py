@@ -0,0 +1,73 @@
+import argparse
+import os
+from pathlib import Path
+
+from memray import CaptureFamilyReader
+from memray._errors import MemrayCommandError
+from memray.commands.common import default_symbol_cache_dir
+from memray.reporters.merge import MergeReporter
+from memray.reporters.summary import SummaryReporter
+
+
+class MergeCommand:
+    """Summarize the memory usage of a process and of all the children it forked"""
+
+    def prepare_parser(self, parser: argparse.ArgumentParser) -> None:
+        parser.add_argument(
+            "results",
+            help="Results of the tracker run of the parent process; the results "
+            "of its children are found next to it",
+        )
+        parser.add_argument(
+            "--leaks",
+            help="Show memory leaks, instead of peak memory usage",
+            action="store_true",
+            dest="show_memory_leaks",
+            default=False,
+        )
+        parser.add_argument(
+            "-s",
+            "--sort-column",
+            help="Colum number to sort on",
+            type=int,
+            default=1,
+        )
+        parser.add_argument(
+            "-r",
+            "--max-rows",
+            help="Maximum number of rows to display",
+            type=int,
+            default=None,
+        )
+        parser.add_argument(
+            "-j",
+            "--max-workers",
+            help="Maximum number of capture files to read at the same time",
+            type=int,
+            default=None,
+        )
+
+    def run(self, args: argparse.Namespace, parser: argparse.ArgumentParser) -> None:
+        max_cols = SummaryReporter.N_COLUMNS
+        if args.sort_column < 1 or args.sort_column > max_cols:
+            parser.error(f"The --sort-column argument must be between 1 and {max_cols}")
+        if args.max_workers is not None and args.max_workers < 1:
+            parser.error("The --max-workers argument must be at least 1")
+
+        result_path = Path(args.results)
+        if not result_path.exists() or not result_path.is_file():
+            raise MemrayCommandError(f"No such file: {args.results}", exit_code=1)
+        try:
+            reader = CaptureFamilyReader.from_parent(
+                os.fspath(result_path),
+                max_workers=args.max_workers,
+                symbol_cache_dir=default_symbol_cache_dir(),
+            )
+            reporter = MergeReporter(reader, show_memory_leaks=args.show_memory_leaks)
+        except OSError as e:
+            raise MemrayCommandError(
+                f"Failed to parse allocation records in {result_path}\nReason: {e}",
+                exit_code=1,
+            )
+
+        reporter.render(sort_column=args.sort_column, max_rows=args.max_rows)
@@ -3,6 +3,7 @@ import os
 
 from memray import dump_all_records
 from memray._errors import MemrayCommandError
+from memray.commands.common import read_progress
 
 
 class ParseCommand:
@@ -19,7 +20,8 @@ class ParseCommand:
             )
 
         try:
-            dump_all_records(args.results)
+            with read_progress() as progress_kwargs:
+                dump_all_records(args.results, **progress_kwargs)
         except OSError as e:
             raise MemrayCommandError(
                 f"Failed to parse allocation records in {args.results}\nReason: {e}",
@@ -12,9 +12,12 @@ from contextlib import closing
 from contextlib import suppress
 from typing import List
 from typing import Optional
+from typing import Union
 
 from memray import Destination
 from memray import FileDestination
+from memray import FileFormat
+from memray import FlightRecorderDestination
 from memray import SocketDestination
 from memray import Tracker
 from memray._errors import MemrayCommandError
@@ -33,6 +36,9 @@ def _run_tracker(
     args: argparse.Namespace,
     post_run_message: Optional[str] = None,
     follow_fork: bool = False,
+    aggregate: bool = False,
+    compress: bool = False,
+    count_allocations: bool = False,
 ) -> None:
     sys.argv = [args.script, *args.script_args]
     if args.run_as_module:
@@ -41,6 +47,34 @@ def _run_tracker(
         kwargs = {}
         if follow_fork:
             kwargs["follow_fork"] = True
+        if args.sample_bytes:
+            kwargs["sample_rate"] = args.sample_bytes
+        if aggregate:
+            kwargs["file_format"] = FileFormat.AGGREGATED_ALLOCATIONS
+        if count_allocations:
+            kwargs["file_format"] = FileFormat.ALLOCATION_COUNTS
+        if args.cancel_short_lived:
+            kwargs["cancel_short_lived_allocations"] = True
+        if args.drop_when_behind:
+            kwargs["backpressure"] = "drop"
+        if args.lazy_python_stacks:
+            kwargs["lazy_python_stacks"] = True
+        if args.max_python_frames:
+            kwargs["max_python_frames"] = args.max_python_frames
+        if args.max_native_frames:
+            kwargs["max_native_frames"] = args.max_native_frames
+        if args.exclude:
+            kwargs["excluded_filenames"] = args.exclude
+        if args.trigger_rss:
+            kwargs["trigger_rss"] = args.trigger_rss
+        if args.trigger_rss_growth:
+            kwargs["trigger_rss_growth"] = args.trigger_rss_growth
+        if args.memory_gauges:
+            kwargs["memory_gauges"] = True
+        if args.trace_python_allocators:
+            kwargs["trace_python_allocators"] = True
+        if compress:
+            kwargs["compression"] = "zstd"
         tracker = Tracker(destination=destination, native_traces=args.native, **kwargs)
     except OSError as error:
         raise MemrayCommandError(str(error), exit_code=1)
@@ -60,11 +94,22 @@ def _run_tracker(
 
 def _child_process(
     port: int,
-    native: bool,
+    native: Union[bool, str],
     run_as_module: bool,
     quiet: bool,
     script: str,
     script_args: List[str],
+    sample_bytes: int = 0,
+    cancel_short_lived: bool = False,
+    drop_when_behind: bool = False,
+    lazy_python_stacks: bool = False,
+    max_python_frames: int = 0,
+    max_native_frames: int = 0,
+    exclude: Optional[List[str]] = None,
+    trigger_rss: int = 0,
+    trigger_rss_growth: int = 0,
+    memory_gauges: bool = False,
+    trace_python_allocators: bool = False,
 ) -> None:
     args = argparse.Namespace(
         native=native,
@@ -72,6 +117,17 @@ def _child_process(
         quiet=quiet,
         script=script,
         script_args=script_args,
+        sample_bytes=sample_bytes,
+        cancel_short_lived=cancel_short_lived,
+        drop_when_behind=drop_when_behind,
+        lazy_python_stacks=lazy_python_stacks,
+        max_python_frames=max_python_frames,
+        max_native_frames=max_native_frames,
+        exclude=exclude,
+        trigger_rss=trigger_rss,
+        trigger_rss_growth=trigger_rss_growth,
+        memory_gauges=memory_gauges,
+        trace_python_allocators=trace_python_allocators,
     )
     _run_tracker(destination=SocketDestination(port=port), args=args)
 
@@ -84,9 +140,32 @@ def _run_child_process_and_attach(args: argparse.Namespace) -> None:
         raise MemrayCommandError(f"Invalid port: {port}", exit_code=1)
 
     arguments = (
-        f"{port},{args.native},{args.run_as_module},{args.quiet},"
+        f"{port},{args.native!r},{args.run_as_module},{args.quiet},"
         f'"{args.script}",{args.script_args}'
     )
+    if args.sample_bytes:
+        arguments += f",sample_bytes={args.sample_bytes}"
+    if args.cancel_short_lived:
+        arguments += ",cancel_short_lived=True"
+    if args.drop_when_behind:
+        arguments += ",drop_when_behind=True"
+    if args.lazy_python_stacks:
+        arguments += ",lazy_python_stacks=True"
+    if args.max_python_frames:
+        arguments += f",max_python_frames={args.max_python_frames}"
+    if args.max_native_frames:
+        arguments += f",max_native_frames={args.max_native_frames}"
+    if args.exclude:
+        arguments += f",exclude={args.exclude!r}"
+    if args.trigger_rss:
+        arguments += f",trigger_rss={args.trigger_rss}"
+    if args.trigger_rss_growth:
+        arguments += f",trigger_rss_growth={args.trigger_rss_growth}"
+    if args.memory_gauges:
+        arguments += ",memory_gauges=True"
+    if args.trace_python_allocators:
+        arguments += ",trace_python_allocators=True"
+
     tracked_app_cmd = [
         sys.executable,
         "-c",
@@ -147,13 +226,25 @@ def _run_with_file_output(args: argparse.Namespace) -> None:
         """
     ).strip()
 
-    destination = FileDestination(path=filename, exist_ok=args.force)
+    destination: Destination
+    if args.flight_recorder:
+        destination = FlightRecorderDestination(
+            path=filename,
+            capacity=args.flight_recorder,
+            exist_ok=args.force,
+            dump_rss=args.dump_rss,
+        )
+    else:
+        destination = FileDestination(path=filename, exist_ok=args.force)
     try:
         _run_tracker(
             destination=destination,
             args=args,
             post_run_message=example_report_generation_message,
             follow_fork=args.follow_fork,
+            aggregate=args.aggregate,
+            compress=args.compress,
+            count_allocations=args.count_allocations,
         )
     except OSError as error:
         raise MemrayCommandError(str(error), exit_code=1)
@@ -199,12 +290,139 @@ class RunCommand:
             dest="native",
             default=False,
         )
+        parser.add_argument(
+            "--fast-unwind",
+            help="Unwind native stacks by following frame pointers. This is much faster, "
+            "but only gives complete stacks for code compiled with frame pointers "
+            "(implies --native)",
+            action="store_true",
+            default=False,
+        )
+        parser.add_argument(
+            "--sample-bytes",
+            help="Only record about one allocation per this many bytes allocated, "
+            "scaling the results (default: record every allocation)",
+            type=int,
+            default=0,
+            metavar="N",
+        )
         parser.add_argument(
             "--follow-fork",
             action="store_true",
             help="Record allocations in child processes forked from the tracked script",
             default=False,
         )
+        parser.add_argument(
+            "--aggregate",
+            action="store_true",
+            help="Write only the memory used by each stack at the peak and at exit, "
+            "instead of every allocation",
+            default=False,
+        )
+        parser.add_argument(
+            "--count-allocations",
+            action="store_true",
+            help="Only count the calls to the allocators made by each stack and the "
+            "bytes they asked for, ignoring frees",
+            default=False,
+        )
+        parser.add_argument(
+            "--compress",
+            action="store_true",
+            help="Compress the output file with zstd as it is written",
+            default=False,
+        )
+        parser.add_argument(
+            "--cancel-short-lived",
+            action="store_true",
+            help="Don't record allocations that are freed right after being made, "
+            "only count them",
+            default=False,
+        )
+        parser.add_argument(
+            "--drop-when-behind",
+            action="store_true",
+            help="Drop allocation records instead of pausing the tracked threads "
+            "when the output can't keep up with them",
+            default=False,
+        )
+        parser.add_argument(
+            "--lazy-python-stacks",
+            action="store_true",
+            help="Find the Python stack of an allocation when it is recorded, instead "
+            "of following every function call (only before Python 3.11)",
+            default=False,
+        )
+        parser.add_argument(
+            "--max-python-frames",
+            help="Only record the innermost N Python frames of each stack "
+            "(default: record every frame)",
+            type=int,
+            default=0,
+            metavar="N",
+        )
+        parser.add_argument(
+            "--max-native-frames",
+            help="Only record the innermost N native frames of each stack "
+            "(default: record every frame)",
+            type=int,
+            default=0,
+            metavar="N",
+        )
+        parser.add_argument(
+            "--exclude",
+            help="Leave the Python frames of the files matching this pattern out of "
+            "the stacks (can be given more than once)",
+            action="append",
+            default=[],
+            metavar="PATTERN",
+        )
+        parser.add_argument(
+            "--trigger-rss",
+            help="Don't record anything until the resident set size of the process "
+            "reaches this many bytes",
+            type=int,
+            default=0,
+            metavar="BYTES",
+        )
+        parser.add_argument(
+            "--trigger-rss-growth",
+            help="Don't record anything until the resident set size of the process "
+            "grows by this many bytes in a second",
+            type=int,
+            default=0,
+            metavar="BYTES",
+        )
+        parser.add_argument(
+            "--flight-recorder",
+            help="Keep only the most recent BYTES of records in memory, and write them "
+            "to the output file at exit or when the process gets a SIGUSR2",
+            type=int,
+            default=0,
+            metavar="BYTES",
+        )
+        parser.add_argument(
+            "--dump-rss",
+            help="With --flight-recorder, also write the output file when the resident "
+            "set size of the process reaches this many bytes",
+            type=int,
+            default=0,
+            metavar="BYTES",
+        )
+        parser.add_argument(
+            "--memory-gauges",
+            action="store_true",
+            help="Record the state of the malloc heap and of the pymalloc arenas, "
+            "and the bytes that Memray tracks, along with the resident set size",
+            default=False,
+        )
+        parser.add_argument(
+            "--trace-python-allocators",
+            action="store_true",
+            help="Record the objects that the Python allocators hand out, "
+            "instead of the pymalloc arenas that they come from",
+            default=False,
+        )
         parser.add_argument(
             "-q",
             "--quiet",
@@ -249,6 +467,45 @@ class RunCommand:
             parser.error("The --live-port argument requires --live-remote")
         if args.follow_fork is True and (args.live_mode or args.live_remote_mode):
             parser.error("--follow-fork cannot be used with the live TUI")
+        if args.aggregate and (args.live_mode or args.live_remote_mode):
+            parser.error("--aggregate cannot be used with the live TUI")
+        if args.count_allocations and (args.live_mode or args.live_remote_mode):
+            parser.error("--count-allocations cannot be used with the live TUI")
+        if args.count_allocations and args.aggregate:
+            parser.error("--count-allocations cannot be used with --aggregate")
+        if args.compress and (args.live_mode or args.live_remote_mode):
+            parser.error("--compress cannot be used with the live TUI")
+        if args.sample_bytes < 0:
+            parser.error("The --sample-bytes argument must not be negative")
+        if args.max_python_frames < 0 or args.max_native_frames < 0:
+            parser.error(
+                "The --max-python-frames and --max-native-frames arguments "
+                "must not be negative"
+            )
+        if args.trigger_rss < 0 or args.trigger_rss_growth < 0:
+            parser.error(
+                "The --trigger-rss and --trigger-rss-growth arguments "
+                "must not be negative"
+            )
+        if args.flight_recorder < 0 or args.dump_rss < 0:
+            parser.error(
+                "The --flight-recorder and --dump-rss arguments must not be negative"
+            )
+        if args.flight_recorder and (args.live_mode or args.live_remote_mode):
+            parser.error("--flight-recorder cannot be used with the live TUI")
+        if args.flight_recorder and (
+            args.aggregate or args.compress or args.count_allocations
+        ):
+            parser.error(
+                "--flight-recorder cannot be used with --aggregate, --compress "
+                "or --count-allocations"
+            )
+        if args.dump_rss and not args.flight_recorder:
+            parser.error("The --dump-rss argument requires --flight-recorder")
+        if args.lazy_python_stacks and sys.version_info >= (3, 11):
+            parser.error("--lazy-python-stacks is only supported before Python 3.11")
+        if args.fast_unwind:
+            args.native = "fp"
 
         self.validate_target_file(args)
 
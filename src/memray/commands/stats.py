@@ -4,6 +4,7 @@ from pathlib import Path
 
 from memray import FileReader
 from memray._errors import MemrayCommandError
+from memray.commands.common import read_progress
 from memray.reporters.stats import StatsReporter
 
 
@@ -44,19 +45,22 @@ class StatsCommand:
         result_path = Path(args.results)
         if not result_path.exists() or not result_path.is_file():
             raise MemrayCommandError(f"No such file: {args.results}", exit_code=1)
-        reader = FileReader(os.fspath(args.results))
-        try:
-            if args.include_all_allocations:
-                snapshot = iter(reader.get_allocation_records())
-            else:
-                snapshot = iter(
-                    reader.get_high_watermark_allocation_records(merge_threads=True)
-                )
-        except OSError as e:
-            raise MemrayCommandError(
-                f"Failed to parse allocation records in {result_path}\nReason: {e}",
-                exit_code=1,
+        with read_progress() as progress_kwargs:
+            reader = FileReader(
+                os.fspath(args.results), high_watermark_index=True, **progress_kwargs
             )
+            try:
+                stats = reader.get_allocation_stats(
+                    args.num_largest,
+                    include_all_allocations=args.include_all_allocations,
+                )
+            except OSError as e:
+                raise MemrayCommandError(
+                    f"Failed to parse allocation records in {result_path}\nReason: {e}",
+                    exit_code=1,
+                )
+            except NotImplementedError as e:
+                raise MemrayCommandError(str(e), exit_code=1)
 
-        reporter = StatsReporter.from_snapshot(snapshot, args.num_largest)
+        reporter = StatsReporter.from_allocation_stats(stats)
         reporter.render()
@@ -4,6 +4,7 @@ from pathlib import Path
 
 from memray import FileReader
 from memray._errors import MemrayCommandError
+from memray.commands.common import read_progress
 from memray.reporters.summary import SummaryReporter
 
 
@@ -35,19 +36,22 @@ class SummaryCommand:
         result_path = Path(args.results)
         if not result_path.exists() or not result_path.is_file():
             raise MemrayCommandError(f"No such file: {args.results}", exit_code=1)
-        reader = FileReader(os.fspath(args.results))
-        try:
-            snapshot = iter(
-                reader.get_high_watermark_allocation_records(merge_threads=True)
-            )
-        except OSError as e:
-            raise MemrayCommandError(
-                f"Failed to parse allocation records in {result_path}\nReason: {e}",
-                exit_code=1,
+        with read_progress() as progress_kwargs:
+            reader = FileReader(
+                os.fspath(args.results), high_watermark_index=True, **progress_kwargs
             )
+            try:
+                snapshot = iter(
+                    reader.get_high_watermark_allocation_records(merge_threads=True)
+                )
+            except OSError as e:
+                raise MemrayCommandError(
+                    f"Failed to parse allocation records in {result_path}\nReason: {e}",
+                    exit_code=1,
+                )
 
-        reporter = SummaryReporter.from_snapshot(
-            snapshot,
-            native=reader.has_native_traces,
-        )
+            reporter = SummaryReporter.from_snapshot(
+                snapshot,
+                native=reader.has_native_traces,
+            )
         reporter.render(sort_column=args.sort_column, max_rows=args.max_rows)
@@ -0,0 +1,90 @@
+import argparse
+import gzip
+import os
+from pathlib import Path
+
+from memray._errors import MemrayCommandError
+from memray._memray import export_profile
+from memray.commands.common import default_symbol_cache_dir
+
+# The suffix of the files of each format.
+_SUFFIXES = {
+    "pprof": ".pb.gz",
+    "collapsed": ".txt",
+}
+
+
+class TransformCommand:
+    """Convert a capture file into a profile that other tools can read"""
+
+    def prepare_parser(self, parser: argparse.ArgumentParser) -> None:
+        parser.add_argument(
+            "format",
+            help="Format to convert to: a gzipped pprof profile, or the collapsed "
+            "stacks that flame graph tools read",
+            choices=sorted(_SUFFIXES),
+        )
+        parser.add_argument("results", help="Results of the tracker run")
+        parser.add_argument(
+            "-o",
+            "--output",
+            help="Output file name",
+            default=None,
+        )
+        parser.add_argument(
+            "-f",
+            "--force",
+            help="If the output file already exists, overwrite it",
+            action="store_true",
+            default=False,
+        )
+        parser.add_argument(
+            "--leaks",
+            help="Convert memory leaks, instead of peak memory usage",
+            action="store_true",
+            dest="show_memory_leaks",
+            default=False,
+        )
+
+    def determine_output_filename(
+        self, results_file: Path, profile_format: str
+    ) -> Path:
+        output_name = results_file.with_suffix(_SUFFIXES[profile_format]).name
+        if output_name.startswith("memray-"):
+            output_name = output_name[len("memray-") :]
+        return results_file.parent / f"memray-{profile_format}-{output_name}"
+
+    def run(self, args: argparse.Namespace, parser: argparse.ArgumentParser) -> None:
+        result_path = Path(args.results)
+        if not result_path.exists() or not result_path.is_file():
+            raise MemrayCommandError(f"No such file: {args.results}", exit_code=1)
+        output_file = Path(
+            args.output
+            if args.output is not None
+            else self.determine_output_filename(result_path, args.format)
+        )
+        if not args.force and output_file.exists():
+            raise MemrayCommandError(
+                f"File already exists, will not overwrite: {output_file}",
+                exit_code=1,
+            )
+
+        try:
+            profile = export_profile(
+                os.fspath(result_path),
+                args.format,
+                leaks=args.show_memory_leaks,
+                symbol_cache_dir=default_symbol_cache_dir(),
+            )
+        except OSError as e:
+            raise MemrayCommandError(
+                f"Failed to parse allocation records in {result_path}\nReason: {e}",
+                exit_code=1,
+            )
+
+        # pprof profiles are gzipped by convention, although the tools that
+        # read them also take them uncompressed.
+        if args.format == "pprof":
+            profile = gzip.compress(profile)
+        output_file.expanduser().write_bytes(profile)
+        print(f"Wrote {output_file}")
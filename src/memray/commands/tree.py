@@ -7,6 +7,8 @@ from rich import print as rprint
 from memray import FileReader
 from memray._errors import MemrayCommandError
 from memray._memray import size_fmt
+from memray.commands.common import default_symbol_cache_dir
+from memray.commands.common import read_progress
 from memray.reporters.tree import TreeReporter
 
 
@@ -27,21 +29,27 @@ class TreeCommand:
         result_path = Path(args.results)
         if not result_path.exists() or not result_path.is_file():
             raise MemrayCommandError(f"No such file: {args.results}", exit_code=1)
-        reader = FileReader(os.fspath(args.results))
-        try:
-            snapshot = iter(
-                reader.get_high_watermark_allocation_records(merge_threads=False)
-            )
-            reporter = TreeReporter.from_snapshot(
-                snapshot,
-                biggest_allocs=args.biggest_allocs,
-                native_traces=reader.has_native_traces,
-            )
-        except OSError as e:
-            raise MemrayCommandError(
-                f"Failed to parse allocation records in {result_path}\nReason: {e}",
-                exit_code=1,
+        with read_progress() as progress_kwargs:
+            reader = FileReader(
+                os.fspath(args.results),
+                symbol_cache_dir=default_symbol_cache_dir(),
+                high_watermark_index=True,
+                **progress_kwargs,
             )
+            try:
+                snapshot = iter(
+                    reader.get_high_watermark_allocation_records(merge_threads=False)
+                )
+                reporter = TreeReporter.from_snapshot(
+                    snapshot,
+                    biggest_allocs=args.biggest_allocs,
+                    native_traces=reader.has_native_traces,
+                )
+            except OSError as e:
+                raise MemrayCommandError(
+                    f"Failed to parse allocation records in {result_path}\nReason: {e}",
+                    exit_code=1,
+                )
         print()
         header = "Allocation metadata"
         rprint(f"{header}\n{'-'*len(header)}")
@@ -0,0 +1,93 @@
+from typing import IO
+from typing import Optional
+
+from rich import print as rprint
+from rich.markup import escape
+from rich.table import Table
+
+from memray import CaptureDiff
+from memray import StackDelta
+from memray._memray import size_fmt
+
+
+def _signed_size_fmt(num: int) -> str:
+    return ("+" if num > 0 else "") + size_fmt(num)
+
+
+def _location(delta: StackDelta) -> str:
+    if not delta.stack:
+        return "<unknown>"
+    function, filename, lineno = delta.stack[0]
+    return f"{function} at {filename}:{lineno}"
+
+
+class DiffReporter:
+    """Report how the memory usage changed between two captures.
+
+    The captures are summarized side by side, followed by the stacks whose
+    usage changed the most, at the high water mark of each capture or at
+    its end.
+    """
+
+    def __init__(self, diff: CaptureDiff, show_memory_leaks: bool):
+        self.diff = diff
+        self.show_memory_leaks = show_memory_leaks
+        self.deltas = diff.get_stack_deltas(leaks=show_memory_leaks)
+
+    def get_captures_table(self) -> Table:
+        table = Table(title="Captures", expand=True)
+        table.add_column("", justify="left")
+        table.add_column("Peak memory", justify="right")
+        table.add_column("Leaked memory", justify="right")
+        table.add_column("Leaked allocations", justify="right")
+        table.add_column("Command line", ratio=1)
+        before = self.diff.before
+        after = self.diff.after
+        for name, capture in (("Before", before), ("After", after)):
+            table.add_row(
+                name,
+                size_fmt(capture.peak_memory),
+                size_fmt(capture.leaked_memory),
+                str(capture.leaked_allocations),
+                escape(capture.command_line),
+            )
+        table.add_row(
+            "Change",
+            _signed_size_fmt(after.peak_memory - before.peak_memory),
+            _signed_size_fmt(after.leaked_memory - before.leaked_memory),
+            f"{after.leaked_allocations - before.leaked_allocations:+d}",
+            "",
+            style="bold",
+        )
+        return table
+
+    def get_stacks_table(self, max_rows: Optional[int] = None) -> Table:
+        if self.show_memory_leaks:
+            title = "Leaked memory by stack"
+        else:
+            title = "Peak memory by stack"
+        table = Table(title=title, expand=True)
+        table.add_column("Location", ratio=1)
+        table.add_column("Before", justify="right")
+        table.add_column("After", justify="right")
+        table.add_column("Change", justify="right")
+        table.add_column("Allocations change", justify="right")
+        deltas = self.deltas if max_rows is None else self.deltas[:max_rows]
+        for delta in deltas:
+            table.add_row(
+                escape(_location(delta)),
+                size_fmt(delta.size_before),
+                size_fmt(delta.size_after),
+                _signed_size_fmt(delta.size_delta),
+                f"{delta.n_allocations_delta:+d}",
+            )
+        return table
+
+    def render(
+        self,
+        *,
+        max_rows: Optional[int] = None,
+        file: Optional[IO[str]] = None,
+    ) -> None:
+        rprint(self.get_captures_table(), file=file)
+        rprint(self.get_stacks_table(max_rows=max_rows), file=file)
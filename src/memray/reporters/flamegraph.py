@@ -1,15 +1,22 @@
 import html
+import itertools
+import json
 import linecache
 import sys
 from typing import Any
 from typing import Dict
 from typing import Iterable
 from typing import Iterator
+from typing import List
 from typing import TextIO
+from typing import Union
+
+from jinja2.utils import htmlsafe_json_dumps
 
 from memray import AllocationRecord
 from memray import MemoryRecord
 from memray import Metadata
+from memray._memray import FlameGraphBuilder
 from memray.reporters.frame_tools import StackFrame
 from memray.reporters.frame_tools import is_cpython_internal
 from memray.reporters.frame_tools import is_frame_interesting
@@ -23,6 +30,9 @@ MAX_STACKS_NODE = {
     "children": {},
 }
 
+# The properties of the nodes that the native builder fills in itself.
+NATIVE_NODE_KEYS = ("value", "n_allocations", "children")
+
 
 def with_converted_children_dict(node: Dict[str, Any]) -> Dict[str, Any]:
     stack = [node]
@@ -53,17 +63,71 @@ def create_framegraph_node_from_stack_frame(stack_frame: StackFrame) -> Dict[str
     }
 
 
+def json_properties(node: Dict[str, Any], *keys: str) -> str:
+    return ", ".join(
+        f"{htmlsafe_json_dumps(key)}: {htmlsafe_json_dumps(node[key])}" for key in keys
+    )
+
+
+def build_flamegraph_json(
+    allocations: Iterable[AllocationRecord], root: Dict[str, Any]
+) -> str:
+    """Build the same tree as FlameGraphReporter.from_snapshot, natively.
+
+    The tree is aggregated and written out as JSON by the extension module,
+    so Python only sees each distinct frame and thread once.
+    """
+    frame_keys: Dict[StackFrame, int] = {}
+    frame_properties: List[str] = []
+    frame_is_interesting: List[bool] = []
+    thread_keys: Dict[str, int] = {}
+
+    def frame_key(stack_frame: StackFrame) -> int:
+        if is_cpython_internal(stack_frame):
+            return -1
+        key = frame_keys.get(stack_frame)
+        if key is None:
+            node = create_framegraph_node_from_stack_frame(stack_frame)
+            key = frame_keys[stack_frame] = len(frame_properties)
+            frame_properties.append(json_properties(node, "name", "location"))
+            frame_is_interesting.append(node["interesting"])
+        return key
+
+    def thread_key(thread_name: str) -> int:
+        return thread_keys.setdefault(thread_name, len(thread_keys))
+
+    builder = FlameGraphBuilder(frame_key, thread_key, MAX_STACKS)
+    for record in allocations:
+        builder.add(record)
+
+    root = dict(root, unique_threads=sorted(thread_keys))
+    return builder.to_json(
+        json_properties(root, *(key for key in root if key not in NATIVE_NODE_KEYS)),
+        frame_properties,
+        frame_is_interesting,
+        [str(htmlsafe_json_dumps(thread_name)) for thread_name in thread_keys],
+        json_properties(MAX_STACKS_NODE, "name", "location"),
+    )
+
+
 class FlameGraphReporter:
     def __init__(
         self,
-        data: Dict[str, Any],
+        data: Union[Dict[str, Any], str],
         *,
         memory_records: Iterable[MemoryRecord],
     ) -> None:
         super().__init__()
-        self.data = data
+        self._data = data
         self.memory_records = memory_records
 
+    @property
+    def data(self) -> Dict[str, Any]:
+        if isinstance(self._data, str):
+            data: Dict[str, Any] = json.loads(self._data)
+            return data
+        return self._data
+
     @classmethod
     def from_snapshot(
         cls,
@@ -82,6 +146,18 @@ class FlameGraphReporter:
             "interesting": True,
         }
 
+        # Records that come from a capture file have their stacks in the
+        # reader, so the tree can be built without going through Python
+        # objects for every frame. The result is then kept as JSON.
+        allocations = iter(allocations)
+        first_record = next(allocations, None)
+        if first_record is not None:
+            allocations = itertools.chain([first_record], allocations)
+        if isinstance(first_record, AllocationRecord) and not native_traces:
+            return cls(
+                build_flamegraph_json(allocations, data), memory_records=memory_records
+            )
+
         unique_threads = set()
         for record in allocations:
             size = record.size
@@ -126,7 +202,7 @@ class FlameGraphReporter:
     ) -> None:
         html_code = render_report(
             kind="flamegraph",
-            data=self.data,
+            data=self._data,
             metadata=metadata,
             memory_records=self.memory_records,
             show_memory_leaks=show_memory_leaks,
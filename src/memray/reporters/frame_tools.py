@@ -1,7 +1,12 @@
 """Tools for processing and filtering stack frames."""
 import re
+from typing import Any
+from typing import Optional
+from typing import Sequence
 from typing import Tuple
 
+from memray._memray import resolve_stack_traces
+
 Symbol = str
 File = str
 Lineno = int
@@ -61,3 +66,19 @@ def is_frame_interesting(frame: StackFrame) -> bool:
         return False
 
     return not is_cpython_internal(frame)
+
+
+def prefetch_stack_traces(
+    records: Sequence[Any], *, native_traces: bool, max_stacks: Optional[int] = None
+) -> None:
+    """Resolve the stack traces of a snapshot's records together.
+
+    Stacks shared by several records are only resolved once, and the records
+    keep them, so calling ``stack_trace()`` or ``native_stack_trace()`` on them
+    afterwards (with the same ``max_stacks``) doesn't go back to the reader.
+    The reader merges hybrid stacks itself, but it finds their native frames
+    already symbolized.
+    """
+    resolve_stack_traces(records, max_stacks=max_stacks)
+    if native_traces:
+        resolve_stack_traces(records, native=True, max_stacks=max_stacks)
@@ -0,0 +1,66 @@
+from typing import IO
+from typing import Optional
+
+from rich import print as rprint
+from rich.markup import escape
+from rich.table import Table
+
+from memray import CaptureFamilyReader
+from memray._memray import size_fmt
+from memray.reporters.summary import SummaryReporter
+
+
+class MergeReporter:
+    """Report on the captures of a process and of the children it forked.
+
+    Every process gets a row with what it had at its peak and at its end,
+    and the allocations of all of them are then summarized together, by the
+    functions that made them.
+    """
+
+    def __init__(self, reader: CaptureFamilyReader, show_memory_leaks: bool):
+        self.reader = reader
+        self.show_memory_leaks = show_memory_leaks
+        if show_memory_leaks:
+            snapshot = reader.get_leaked_allocation_records(merge_threads=True)
+        else:
+            snapshot = reader.get_high_watermark_allocation_records(merge_threads=True)
+        self._summary = SummaryReporter.from_snapshot(
+            snapshot, native=reader.has_native_traces
+        )
+
+    def get_processes_table(self) -> Table:
+        table = Table(title="Processes", expand=True)
+        table.add_column("PID", justify="right")
+        table.add_column("Peak memory", justify="right")
+        table.add_column("Leaked memory", justify="right")
+        table.add_column("Leaked allocations", justify="right")
+        table.add_column("Command line", ratio=1)
+        processes = self.reader.processes
+        for process in processes:
+            table.add_row(
+                str(process.pid),
+                size_fmt(process.peak_memory),
+                size_fmt(process.leaked_memory),
+                str(process.leaked_allocations),
+                escape(process.command_line),
+            )
+        table.add_row(
+            "Total",
+            size_fmt(sum(process.peak_memory for process in processes)),
+            size_fmt(sum(process.leaked_memory for process in processes)),
+            str(sum(process.leaked_allocations for process in processes)),
+            f"{len(processes)} processes",
+            style="bold",
+        )
+        return table
+
+    def render(
+        self,
+        sort_column: int,
+        *,
+        max_rows: Optional[int] = None,
+        file: Optional[IO[str]] = None,
+    ) -> None:
+        rprint(self.get_processes_table(), file=file)
+        self._summary.render(sort_column, max_rows=max_rows, file=file)
@@ -15,6 +15,7 @@ import rich
 
 from memray import AllocationRecord
 from memray import AllocatorType
+from memray._memray import AllocationStats
 from memray._memray import size_fmt
 
 
@@ -35,40 +36,61 @@ def get_stats_data(data: Iterable[AllocationRecord]) -> _StatsData:
         AllocatorType(alloc.allocator).name for alloc in data
     )
 
-    # remove FREE and MUNMAP from allocation_type
+    # remove the deallocators from allocation_type
     shdata.allocation_type_counter.pop("FREE", None)
     shdata.allocation_type_counter.pop("MUNMAP", None)
+    shdata.allocation_type_counter.pop("PYMALLOC_FREE", None)
 
     return shdata
 
 
+def get_stats_data_from_allocation_stats(stats: AllocationStats) -> _StatsData:
+    shdata = _StatsData()
+    shdata.total_num_allocations = stats.total_num_allocations
+    shdata.total_memory_allocated = stats.total_memory_allocated
+    shdata.allocation_type_counter = {
+        allocator.name: count
+        for allocator, count in stats.allocator_type_counts.items()
+    }
+    return shdata
+
+
+def _top_frame_string(record: AllocationRecord) -> str:
+    stack_trace = record.stack_trace()
+    if not stack_trace:
+        return "<stack trace unavailable>"
+    (function, file, line), *_ = stack_trace
+    return f"{function}:{file}:{line}"
+
+
+def format_top_allocations_by_size(
+    records: Iterable[AllocationRecord],
+) -> Generator[str, None, None]:
+    for record in records:
+        yield f"{_top_frame_string(record)} -> {size_fmt(record.size)}"
+
+
+def format_top_allocations_by_count(
+    records: Iterable[AllocationRecord],
+) -> Generator[str, None, None]:
+    for record in records:
+        yield f"{_top_frame_string(record)} -> {record.n_allocations}"
+
+
 def get_top_allocations_by_size(
     data: Iterable[AllocationRecord], num_largest: int
 ) -> Generator[str, None, None]:
-    for record in heapq.nlargest(num_largest, data, key=lambda rec: rec.size):
-        stack_trace = record.stack_trace()
-        strace_string = ""
-        if stack_trace:
-            (function, file, line), *_ = stack_trace
-            strace_string = f"{function}:{file}:{line}"
-        else:
-            strace_string = "<stack trace unavailable>"
-
-        yield f"{strace_string} -> {size_fmt(record.size)}"
+    yield from format_top_allocations_by_size(
+        heapq.nlargest(num_largest, data, key=lambda rec: rec.size)
+    )
 
 
 def get_top_allocations_by_count(
     data: Iterable[AllocationRecord], num_largest: int
 ) -> Generator[str, None, None]:
-    for record in heapq.nlargest(num_largest, data, key=lambda rec: rec.n_allocations):
-        stack_trace = record.stack_trace()
-        strace_string = ""
-        if stack_trace:
-            (function, file, line), *_ = stack_trace
-            strace_string = f"{function}:{file}:{line}"
-        else:
-            strace_string = "<stack trace unavailable>"
-        yield f"{strace_string} -> {record.n_allocations}"
+    yield from format_top_allocations_by_count(
+        heapq.nlargest(num_largest, data, key=lambda rec: rec.n_allocations)
+    )
 
 
 def get_allocator_type_distribution(
@@ -112,7 +134,39 @@ def draw_histogram(data: List[int], bins: int, *, hist_scale_factor: int = 25) -
         )
 
     data_bins = get_histogram_databins(data, bins=bins)
+    return format_histogram(
+        data_bins, min(data), max(data), hist_scale_factor=hist_scale_factor
+    )
+
 
+def draw_allocation_stats_histogram(
+    stats: AllocationStats, bins: int, *, hist_scale_factor: int = 25
+) -> str:
+    """The same histogram as draw_histogram() of the sizes that stats summarizes."""
+    if stats.num_sized_allocations == 0:
+        return "<no data for histogram>"
+    if bins <= 0:
+        raise ValueError(f"Invalid input bins={bins}, should be greater than 0")
+    if hist_scale_factor <= 0:
+        raise ValueError(
+            f"Invalid input hist_scale_factor={hist_scale_factor},"
+            " should be greater than 0"
+        )
+    return format_histogram(
+        stats.size_histogram(bins),
+        stats.min_size,
+        stats.max_size,
+        hist_scale_factor=hist_scale_factor,
+    )
+
+
+def format_histogram(
+    data_bins: List[Tuple[int, int]],
+    min_size: int,
+    max_size: int,
+    *,
+    hist_scale_factor: int,
+) -> str:
     max_data_bin = max([t[1] for t in data_bins])
     scaled_data_bins = [
         math.ceil((v / max_data_bin) * hist_scale_factor) for _, v in data_bins
@@ -130,7 +184,7 @@ def draw_histogram(data: List[int], bins: int, *, hist_scale_factor: int = 25) -
     )
 
     result = []
-    result.append(f"min: {size_fmt(min(data))}")
+    result.append(f"min: {size_fmt(min_size)}")
     result.append("\n\t")
     result.append("-" * hist_width_total)
     result.append("\n\t")
@@ -141,7 +195,7 @@ def draw_histogram(data: List[int], bins: int, *, hist_scale_factor: int = 25) -
         result.append("▇" * scaled_data_bins[i])
         result.append("\n\t")
     result.append("-" * hist_width_total)
-    result.append(f"\n\tmax: {size_fmt(max(data))}")
+    result.append(f"\n\tmax: {size_fmt(max_size)}")
 
     return "".join(result)
 
@@ -152,6 +206,7 @@ class StatsReporter:
         if num_largest < 1:
             raise ValueError(f"Invalid input num_largest={num_largest}, should be >=1")
         self.num_largest = num_largest
+        self._stats: Optional[AllocationStats] = None
 
     @classmethod
     def from_snapshot(
@@ -159,6 +214,13 @@ class StatsReporter:
     ) -> "StatsReporter":
         return cls(allocations, num_largest)
 
+    @classmethod
+    def from_allocation_stats(cls, stats: AllocationStats) -> "StatsReporter":
+        """Report what the reader already summarized, instead of the records."""
+        reporter = cls([], stats.num_largest)
+        reporter._stats = stats
+        return reporter
+
     def render(
         self,
         *,
@@ -207,12 +269,20 @@ class StatsReporter:
             print(f"\t- {entry}")
 
     def _get_stats_data(self) -> _StatsData:
+        if self._stats is not None:
+            return get_stats_data_from_allocation_stats(self._stats)
         return get_stats_data(self.data)
 
     def _get_top_allocations_by_size(self) -> Generator[str, None, None]:
+        if self._stats is not None:
+            yield from format_top_allocations_by_size(self._stats.largest_by_size())
+            return
         yield from get_top_allocations_by_size(self.data, self.num_largest)
 
     def _get_top_allocations_by_count(self) -> Generator[str, None, None]:
+        if self._stats is not None:
+            yield from format_top_allocations_by_count(self._stats.largest_by_count())
+            return
         yield from get_top_allocations_by_count(self.data, self.num_largest)
 
     def _get_allocator_type_distribution(
@@ -223,4 +293,8 @@ class StatsReporter:
     def _draw_histogram(
         self, data: List[int], bins: int, *, hist_scale_factor: int = 25
     ) -> str:
+        if self._stats is not None:
+            return draw_allocation_stats_histogram(
+                self._stats, bins, hist_scale_factor=hist_scale_factor
+            )
         return draw_histogram(data, bins, hist_scale_factor=hist_scale_factor)
@@ -5,11 +5,13 @@ from typing import Iterable
 from typing import Iterator
 from typing import List
 from typing import TextIO
+from typing import Tuple
 
 from memray import AllocationRecord
 from memray import AllocatorType
 from memray import MemoryRecord
 from memray import Metadata
+from memray.reporters.frame_tools import prefetch_stack_traces
 from memray.reporters.templates import render_report
 
 
@@ -33,26 +35,38 @@ class TableReporter:
         native_traces: bool,
     ) -> "TableReporter":
 
+        records = list(allocations)
+        prefetch_stack_traces(records, native_traces=native_traces, max_stacks=1)
+        # Many rows share their thread, allocator and top frame, so each of
+        # them is only formatted once.
+        thread_names: Dict[int, str] = {}
+        allocator_names: Dict[int, str] = {}
+        stacks: Dict[Tuple[str, str, int], str] = {}
         result = []
-        for record in allocations:
+        for record in records:
             stack_trace = (
-                list(record.hybrid_stack_trace(max_stacks=1))
+                next(iter(record.hybrid_stack_trace(max_stacks=1)), None)
                 if native_traces
-                else record.stack_trace(max_stacks=1)
+                else next(iter(record.stack_trace(max_stacks=1)), None)
             )
             stack = "???"
             if stack_trace:
-                function, file, line = stack_trace[0]
-                stack = f"{function} at {file}:{line}"
-
-            allocator = AllocatorType(record.allocator)
+                if stack_trace not in stacks:
+                    function, file, line = stack_trace
+                    stacks[stack_trace] = html.escape(f"{function} at {file}:{line}")
+                stack = stacks[stack_trace]
+            if record.tid not in thread_names:
+                thread_names[record.tid] = record.thread_name
+            if record.allocator not in allocator_names:
+                allocator = AllocatorType(record.allocator)
+                allocator_names[record.allocator] = allocator.name.lower()
             result.append(
                 dict(
-                    tid=record.thread_name,
+                    tid=thread_names[record.tid],
                     size=record.size,
-                    allocator=allocator.name.lower(),
+                    allocator=allocator_names[record.allocator],
                     n_allocations=record.n_allocations,
-                    stack_trace=html.escape(stack),
+                    stack_trace=stack,
                 )
             )
 
@@ -27,7 +27,7 @@ def get_report_title(*, kind: str, show_memory_leaks: bool) -> str:
 def render_report(
     *,
     kind: str,
-    data: Union[Dict[str, Any], Iterable[Dict[str, Any]]],
+    data: Union[Dict[str, Any], Iterable[Dict[str, Any]], str],
     metadata: Metadata,
     memory_records: Iterable[MemoryRecord],
     show_memory_leaks: bool,
@@ -14,6 +14,7 @@ import rich.tree
 from memray import AllocationRecord
 from memray._memray import size_fmt
 from memray.reporters.frame_tools import is_cpython_internal
+from memray.reporters.frame_tools import prefetch_stack_traces
 
 MAX_STACKS = int(sys.getrecursionlimit() // 2.5)
 
@@ -63,9 +64,11 @@ class TreeReporter:
         native_traces: bool,
     ) -> "TreeReporter":
         data = Frame(location=ROOT_NODE, value=0)
-        for record in sorted(allocations, key=lambda alloc: alloc.size, reverse=True)[
+        records = sorted(allocations, key=lambda alloc: alloc.size, reverse=True)[
             :biggest_allocs
-        ]:
+        ]
+        prefetch_stack_traces(records, native_traces=native_traces)
+        for record in records:
             size = record.size
             data.value += size
             data.n_allocations += record.n_allocations
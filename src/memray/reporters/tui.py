@@ -1,9 +1,11 @@
 import os
+from collections import Counter
 from collections import defaultdict
 from collections import deque
 from dataclasses import dataclass
 from datetime import datetime
 from math import ceil
+from typing import Counter as CounterType
 from typing import DefaultDict
 from typing import Deque
 from typing import Dict
@@ -21,7 +23,9 @@ from rich.table import Column
 from rich.table import Table
 
 from memray import AllocationRecord
+from memray import LiveStats
 from memray._memray import size_fmt
+from memray.reporters.frame_tools import prefetch_stack_traces
 
 MAX_MEMORY_RATIO = 0.95
 
@@ -183,6 +187,111 @@ def aggregate_allocations(
     return processed_allocations
 
 
+def _stack_locations(
+    allocation: AllocationRecord, native_traces: Optional[bool]
+) -> List[Tuple[Location, bool]]:
+    """The locations that aggregate_allocations() adds an allocation to, and
+    whether it is their own allocation or one of their children's."""
+    stack_trace = list(
+        allocation.hybrid_stack_trace() if native_traces else allocation.stack_trace()
+    )
+    if not stack_trace:
+        return [(Location(function="???", file="???"), True)]
+    (function, file_name, _), *caller_frames = stack_trace
+    locations = [(Location(function=function, file=file_name), True)]
+    visited = set()
+    for function, file_name, _ in caller_frames:
+        location = Location(function=function, file=file_name)
+        if location in visited:
+            continue
+        visited.add(location)
+        locations.append((location, False))
+    return locations
+
+
+def _record_key(record: AllocationRecord) -> Tuple[int, int]:
+    return record.tid, record.stack_id
+
+
+class IncrementalAggregate:
+    """Allocation entries for a snapshot that changes a few records at a time.
+
+    Records are identified by their thread and stack, like the ones that
+    ``SocketReader.get_snapshot_changes`` returns. The stack of each record
+    is only resolved the first time that it shows up, and a change to it
+    only updates the entries of the functions in its stack, instead of
+    aggregating the whole snapshot again.
+    """
+
+    def __init__(self, native_traces: Optional[bool] = False) -> None:
+        self._native_traces = native_traces
+        self._records: Dict[Tuple[int, int], AllocationRecord] = {}
+        self._locations: Dict[Tuple[int, int], List[Tuple[Location, bool]]] = {}
+        self._thread_counts: DefaultDict[Location, CounterType[int]] = defaultdict(
+            Counter
+        )
+        self.entries: Dict[Location, AllocationEntry] = {}
+        self.total_memory = 0
+        self.total_allocations = 0
+
+    def update(self, changes: Iterable[AllocationRecord]) -> None:
+        """Replace the records of the same thread and stack with the changed
+        ones. Records without allocations are removed."""
+        changes = list(changes)
+        new_records = [
+            record
+            for record in changes
+            if record.n_allocations and _record_key(record) not in self._locations
+        ]
+        prefetch_stack_traces(new_records, native_traces=self._native_traces)
+        for record in changes:
+            key = _record_key(record)
+            old_record = self._records.pop(key, None)
+            if old_record is not None:
+                self._add(key, old_record, -1)
+            if not record.n_allocations:
+                self._locations.pop(key, None)
+                continue
+            if key not in self._locations:
+                self._locations[key] = _stack_locations(record, self._native_traces)
+            self._records[key] = record
+            self._add(key, record, 1)
+
+    def refresh_stacks(self) -> None:
+        """Resolve the stacks of all of the records again, for when more of
+        their native frames have had their symbols resolved since."""
+        for key, record in self._records.items():
+            self._add(key, record, -1)
+            self._locations[key] = _stack_locations(record, self._native_traces)
+            self._add(key, record, 1)
+
+    def _add(self, key: Tuple[int, int], record: AllocationRecord, sign: int) -> None:
+        size = sign * record.size
+        n_allocations = sign * record.n_allocations
+        self.total_memory += size
+        self.total_allocations += n_allocations
+        for location, is_own in self._locations[key]:
+            entry = self.entries.get(location)
+            if entry is None:
+                entry = self.entries[location] = AllocationEntry(
+                    own_memory=0, total_memory=0, n_allocations=0, thread_ids=set()
+                )
+            entry.total_memory += size
+            entry.n_allocations += n_allocations
+            if is_own:
+                entry.own_memory += size
+            thread_counts = self._thread_counts[location]
+            thread_counts[record.tid] += sign
+            if thread_counts[record.tid]:
+                entry.thread_ids.add(record.tid)
+                continue
+            del thread_counts[record.tid]
+            entry.thread_ids.discard(record.tid)
+            if not thread_counts:
+                del self.entries[location]
+                del self._thread_counts[location]
+
+
 class TUI:
     KEY_TO_COLUMN_NAME = {
         1: "total_memory",
@@ -212,9 +321,11 @@ class TUI:
         self.start = datetime.now()
         self._last_update = datetime.now()
         self._snapshot: Tuple[AllocationRecord, ...] = tuple()
+        self._aggregate: Optional[IncrementalAggregate] = None
         self._current_memory_size = 0
         self._max_memory_seen = 0
         self._message = ""
+        self._live_stats: Optional[LiveStats] = None
         self.active = True
         self._sort_field_name = "total_memory"
         self._sort_column_id = 1
@@ -262,6 +373,12 @@ class TUI:
             f"[b]Samples[/]: {self.n_samples}",
             f"[b]Duration[/]: {(self._last_update - self.start).total_seconds()} seconds",
         )
+        if self._live_stats is not None:
+            blocked = self._live_stats.sender_blocked_time_ns / 1e9
+            metadata.add_row(
+                f"[b]Blocked[/]: {blocked:.2f}s",
+                f"[b]Lag[/]: {self._live_stats.lag_ns / 1e6:.0f}ms",
+            )
 
         graph = "\n".join(self.stream.graph)
         plot = Panel(
@@ -314,10 +431,16 @@ class TUI:
         sort_column = table.columns[self._sort_column_id]
         sort_column.header = f"<{sort_column.header}>"
 
-        total_allocations = sum(record.n_allocations for record in self._snapshot)
-        allocation_entries = aggregate_allocations(
-            self._snapshot, MAX_MEMORY_RATIO * self._current_memory_size, self._native
-        )
+        if self._aggregate is not None:
+            total_allocations = self._aggregate.total_allocations
+            allocation_entries = self._aggregate.entries
+        else:
+            total_allocations = sum(record.n_allocations for record in self._snapshot)
+            allocation_entries = aggregate_allocations(
+                self._snapshot,
+                MAX_MEMORY_RATIO * self._current_memory_size,
+                self._native,
+            )
 
         sorted_allocations = sorted(
             allocation_entries.items(),
@@ -378,15 +501,47 @@ class TUI:
         return self.layout
 
     def update_snapshot(self, snapshot: Iterable[AllocationRecord]) -> None:
+        self._aggregate = None
         self._snapshot = tuple(snapshot)
-        for record in self._snapshot:
+        prefetch_stack_traces(self._snapshot, native_traces=self._native)
+        self._add_sample(self._snapshot, sum(record.size for record in self._snapshot))
+
+    def update_snapshot_changes(self, changes: Iterable[AllocationRecord]) -> None:
+        """Update the snapshot with the records that changed since the last
+        update, as returned by ``SocketReader.get_snapshot_changes``."""
+        if self._aggregate is None:
+            self._aggregate = IncrementalAggregate(self._native)
+            self._snapshot = tuple()
+        changes = tuple(changes)
+        self._aggregate.update(changes)
+        self._add_sample(changes, self._aggregate.total_memory)
+
+    def refresh_stacks(self) -> None:
+        """Resolve the stacks of the snapshot again, once the symbols of
+        more of their native frames are known."""
+        if self._aggregate is not None:
+            self._aggregate.refresh_stacks()
+
+    def update_live_stats(self, stats: LiveStats) -> None:
+        """Show how long the tracked process has waited for the reader, and
+        how far behind the reader is, once the tracker has reported it."""
+        if not stats.n_reports:
+            return
+        if self._live_stats is None:
+            self.layout["header"].size = 8
+        self._live_stats = stats
+
+    def _add_sample(
+        self, records: Iterable[AllocationRecord], memory_size: int
+    ) -> None:
+        for record in records:
             if record.tid in self._seen_threads:
                 continue
             self._threads.append(record.tid)
             self._seen_threads.add(record.tid)
         self.n_samples += 1
         self._last_update = datetime.now()
-        self._current_memory_size = sum(record.size for record in self._snapshot)
+        self._current_memory_size = memory_size
         if self._current_memory_size > self._max_memory_seen:
             self._max_memory_seen = self._current_memory_size
             self.stream.reset_max(self._max_memory_seen)
@@ -2,6 +2,7 @@
 
 import pytest
 
+from memray import AllocatorType
 from memray import FileDestination
 from memray import FileReader
 from memray import SocketDestination
@@ -54,6 +55,25 @@ def test_file_destination_str_path(tmp_path):
         assert len(list(reader.get_allocation_records())) == 2
 
 
+def test_file_destination_with_io_uring(tmp_path):
+    # GIVEN
+    allocator = MemoryAllocator()
+    result_file = tmp_path / "test.bin"
+
+    # WHEN
+    with Tracker(destination=FileDestination(result_file, io_uring=True)):
+        for _ in range(10000):
+            allocator.valloc(1234)
+            allocator.free()
+
+    # THEN
+    with FileReader(result_file) as reader:
+        records = list(reader.get_allocation_records())
+        vallocs = [r for r in records if r.allocator == AllocatorType.VALLOC]
+        assert len(vallocs) == 10000
+        assert reader.metadata.total_allocations == len(records)
+
+
 def test_combine_destination_args():
     """Combining `writer` and `file_name` arguments in the `Tracker` should
     raise an exception."""
@@ -1,6 +1,7 @@
 import shutil
 import subprocess
 import sys
+import textwrap
 from pathlib import Path
 
 import pytest
@@ -61,6 +62,50 @@ def test_multithreaded_extension(tmpdir, monkeypatch):
     assert len(memalign_frees) >= 100 * 100
 
 
+def test_extension_imported_while_tracking(tmpdir):
+    """Check that an extension loaded while tracking is patched, and that it is
+    patched again by the next tracker after the first one restored it."""
+    # GIVEN
+    first_output = Path(tmpdir) / "first.bin"
+    second_output = Path(tmpdir) / "second.bin"
+    extension_name = "multithreaded_extension"
+    extension_path = tmpdir / extension_name
+    shutil.copytree(TEST_MULTITHREADED_EXTENSION, extension_path)
+    subprocess.run(
+        [sys.executable, str(extension_path / "setup.py"), "build_ext", "--inplace"],
+        check=True,
+        cwd=extension_path,
+        capture_output=True,
+    )
+    program = textwrap.dedent(
+        f"""\
+        import sys
+        from memray import Tracker
+
+        sys.path.append({str(extension_path)!r})
+        with Tracker({str(first_output)!r}):
+            from testext import run
+
+            run()
+        run()
+        with Tracker({str(second_output)!r}):
+            run()
+        """
+    )
+
+    # WHEN
+    subprocess.run([sys.executable, "-c", program], check=True, timeout=60)
+
+    # THEN
+    for output in (first_output, second_output):
+        memaligns = [
+            record
+            for record in FileReader(output).get_allocation_records()
+            if record.allocator == AllocatorType.MEMALIGN
+        ]
+        assert len(memaligns) == 100 * 100
+
+
 def test_misbehaving_extension(tmpdir, monkeypatch):
     """Check that we can correctly track allocations in an extension which invokes
     Python code in a thread and does not register trace functions."""
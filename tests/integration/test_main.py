@@ -344,12 +344,15 @@ class TestParseSubcommand:
             "ALLOCATION",
             "FRAME_PUSH",
             "FRAME_POP",
+            "FRAME_LINE_UPDATE",
             "FRAME_ID",
             "NATIVE_FRAME_ID",
             "MEMORY_MAP_START",
             "SEGMENT_HEADER",
             "SEGMENT",
             "MEMORY",
+            "THREAD_CHUNK",
+            "CHUNK_BARRIER",
         ]
         code_file = tmp_path / "code.py"
         program = textwrap.dedent(
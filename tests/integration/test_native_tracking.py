@@ -1,6 +1,8 @@
+import os
 import shutil
 import subprocess
 import sys
+import textwrap
 from pathlib import Path
 
 import pytest
@@ -8,6 +10,7 @@ import pytest
 from memray import AllocatorType
 from memray import FileReader
 from memray import Tracker
+from memray._memray import resolve_stack_traces
 from memray._test import MemoryAllocator
 from tests.utils import filter_relevant_allocations
 
@@ -109,6 +112,53 @@ def test_simple_call_chain_with_native_tracking(tmpdir, monkeypatch):
     assert expected_symbols == [stack[0] for stack in valloc.native_stack_trace()[:3]]
 
 
+def test_simple_call_chain_with_frame_pointer_unwinding(tmpdir, monkeypatch):
+    # GIVEN
+    output = Path(tmpdir) / "test.bin"
+    extension_name = "multithreaded_extension"
+    extension_path = tmpdir / extension_name
+    shutil.copytree(TEST_NATIVE_EXTENSION, extension_path)
+    subprocess.run(
+        [sys.executable, str(extension_path / "setup.py"), "build_ext", "--inplace"],
+        check=True,
+        cwd=extension_path,
+        capture_output=True,
+    )
+
+    # WHEN
+    with monkeypatch.context() as ctx:
+        ctx.setattr(sys, "path", [*sys.path, str(extension_path)])
+        from native_ext import run_simple  # type: ignore
+
+        with Tracker(output, native_traces="fp"):
+            run_simple()
+
+    # THEN
+    reader = FileReader(output)
+    assert reader.has_native_traces
+    vallocs = [
+        record
+        for record in filter_relevant_allocations(reader.get_allocation_records())
+        if record.allocator == AllocatorType.VALLOC
+    ]
+
+    assert len(vallocs) == 1
+    (valloc,) = vallocs
+
+    # The extension is built without optimizations, so it keeps frame pointers
+    expected_symbols = ["baz", "bar", "foo"]
+    assert expected_symbols == [stack[0] for stack in valloc.native_stack_trace()[:3]]
+
+
+def test_rejects_unknown_native_unwinder(tmpdir):
+    # GIVEN
+    output = Path(tmpdir) / "test.bin"
+
+    # WHEN/THEN
+    with pytest.raises(ValueError, match="native_traces must be a bool or 'fp'"):
+        Tracker(output, native_traces="dwarf")
+
+
 def test_inlined_call_chain_with_native_tracking(tmpdir, monkeypatch):
     # GIVEN
     output = Path(tmpdir) / "test.bin"
@@ -150,6 +200,51 @@ def test_inlined_call_chain_with_native_tracking(tmpdir, monkeypatch):
     assert expected_symbols == [stack[0] for stack in valloc.native_stack_trace()[:3]]
 
 
+def test_consecutive_call_chains_with_native_tracking(tmpdir, monkeypatch):
+    """Consecutive allocations share most of their native stack, and each
+    must still get its own trace."""
+    # GIVEN
+    output = Path(tmpdir) / "test.bin"
+    extension_name = "multithreaded_extension"
+    extension_path = tmpdir / extension_name
+    shutil.copytree(TEST_NATIVE_EXTENSION, extension_path)
+    subprocess.run(
+        [sys.executable, str(extension_path / "setup.py"), "build_ext", "--inplace"],
+        check=True,
+        cwd=extension_path,
+        capture_output=True,
+    )
+
+    # WHEN
+    with monkeypatch.context() as ctx:
+        ctx.setattr(sys, "path", [*sys.path, str(extension_path)])
+        from native_ext import run_inline
+        from native_ext import run_simple
+
+        with Tracker(output, native_traces=True):
+            run_simple()
+            run_inline()
+            run_simple()
+
+    # THEN
+    records = list(FileReader(output).get_allocation_records())
+    vallocs = [
+        record
+        for record in filter_relevant_allocations(records)
+        if record.allocator == AllocatorType.VALLOC
+    ]
+
+    assert len(vallocs) == 3
+    symbols = [
+        [stack[0] for stack in valloc.native_stack_trace()[:3]] for valloc in vallocs
+    ]
+    assert symbols == [
+        ["baz", "bar", "foo"],
+        ["baz_inline", "bar_inline", "foo_inline"],
+        ["baz", "bar", "foo"],
+    ]
+
+
 @pytest.mark.valgrind
 def test_deep_call_chain_with_native_tracking(tmpdir, monkeypatch):
     # GIVEN
@@ -242,6 +337,43 @@ def test_hybrid_stack_in_pure_python(tmpdir):
     assert hybrid_stack[-1] == "test_hybrid_stack_in_pure_python"
 
 
+def test_hybrid_stacks_are_shared_by_records_with_the_same_stacks(tmpdir):
+    # GIVEN
+    allocator = MemoryAllocator()
+    output = Path(tmpdir) / "test.bin"
+
+    def recursive_func(n):
+        if n == 1:
+            allocator.valloc(1234)
+            allocator.free()
+            return
+        return recursive_func(n - 1)
+
+    # WHEN
+    with Tracker(output, native_traces=True):
+        for _ in range(2):
+            recursive_func(3)
+
+    # THEN
+    records = list(FileReader(output).get_allocation_records())
+    first, second = [
+        record
+        for record in filter_relevant_allocations(records)
+        if record.allocator == AllocatorType.VALLOC
+    ]
+    assert first.hybrid_stack_trace() is second.hybrid_stack_trace()
+    assert first.hybrid_stack_trace(max_stacks=1) is not first.hybrid_stack_trace()
+
+    # Eval frames stand for the Python frames, which are found in order, and
+    # the native frames that called the outermost one are left out.
+    python_stack = [
+        frame for frame in first.stack_trace() if not frame[1].endswith(".pyx")
+    ]
+    hybrid_stack = list(first.hybrid_stack_trace())
+    assert [frame for frame in hybrid_stack if frame in python_stack] == python_stack
+    assert hybrid_stack[-1] == python_stack[-1]
+
+
 def test_hybrid_stack_in_recursive_python_c_call(tmpdir, monkeypatch):
     # GIVEN
     output = Path(tmpdir) / "test.bin"
@@ -349,3 +481,224 @@ def test_native_tracing_header(native_traces, tmpdir):
 
     # THEN
     assert FileReader(output).has_native_traces is native_traces
+
+
+def test_bulk_resolution_reuses_the_symbol_cache(tmpdir, monkeypatch):
+    # GIVEN
+    output = Path(tmpdir) / "test.bin"
+    cache_dir = Path(tmpdir) / "symbols"
+    extension_name = "multithreaded_extension"
+    extension_path = tmpdir / extension_name
+    shutil.copytree(TEST_NATIVE_EXTENSION, extension_path)
+    subprocess.run(
+        [sys.executable, str(extension_path / "setup.py"), "build_ext", "--inplace"],
+        check=True,
+        cwd=extension_path,
+        capture_output=True,
+    )
+
+    with monkeypatch.context() as ctx:
+        ctx.setattr(sys, "path", [*sys.path, str(extension_path)])
+        from native_ext import run_simple  # type: ignore
+
+        with Tracker(output, native_traces=True):
+            run_simple()
+
+    def native_stacks(reader):
+        records = list(reader.get_high_watermark_allocation_records())
+        resolve_stack_traces(records, native=True)
+        return [record.native_stack_trace() for record in records]
+
+    expected = [
+        record.native_stack_trace()
+        for record in FileReader(output).get_high_watermark_allocation_records()
+    ]
+
+    # WHEN
+    first_run = native_stacks(FileReader(output, symbol_cache_dir=cache_dir))
+    cache_files = sorted(cache_dir.iterdir())
+    second_run = native_stacks(
+        FileReader(output, max_workers=4, symbol_cache_dir=cache_dir)
+    )
+
+    # THEN
+    assert first_run == expected
+    assert second_run == expected
+    assert cache_files
+    assert all(path.suffix == ".symbols" for path in cache_files)
+    assert sorted(cache_dir.iterdir()) == cache_files
+
+
+def test_symbol_cache_recovers_from_an_incomplete_entry(tmpdir, monkeypatch):
+    """An entry that was only partly written is resolved again, and the file
+    is rewritten with it complete instead of growing past the damage."""
+    # GIVEN
+    output = Path(tmpdir) / "test.bin"
+    cache_dir = Path(tmpdir) / "symbols"
+    extension_name = "multithreaded_extension"
+    extension_path = tmpdir / extension_name
+    shutil.copytree(TEST_NATIVE_EXTENSION, extension_path)
+    subprocess.run(
+        [sys.executable, str(extension_path / "setup.py"), "build_ext", "--inplace"],
+        check=True,
+        cwd=extension_path,
+        capture_output=True,
+    )
+
+    with monkeypatch.context() as ctx:
+        ctx.setattr(sys, "path", [*sys.path, str(extension_path)])
+        from native_ext import run_simple  # type: ignore
+
+        with Tracker(output, native_traces=True):
+            run_simple()
+
+    def native_stacks(reader):
+        records = list(reader.get_high_watermark_allocation_records())
+        resolve_stack_traces(records, native=True)
+        return [record.native_stack_trace() for record in records]
+
+    expected = native_stacks(FileReader(output, symbol_cache_dir=cache_dir))
+    sizes = {path: path.stat().st_size for path in cache_dir.iterdir()}
+    for path, size in sizes.items():
+        os.truncate(path, size - 3)
+
+    # WHEN
+    stacks = native_stacks(FileReader(output, symbol_cache_dir=cache_dir))
+
+    # THEN
+    assert stacks == expected
+    assert {path: path.stat().st_size for path in cache_dir.iterdir()} == sizes
+
+
+def test_symbol_cache_is_found_by_the_build_ids_of_the_capture(tmpdir, monkeypatch):
+    """The symbols of a binary that's gone from where it was loaded are found
+    in the cache by the build id that the capture recorded for it."""
+    # GIVEN
+    output = Path(tmpdir) / "test.bin"
+    cache_dir = Path(tmpdir) / "symbols"
+    extension_name = "multithreaded_extension"
+    extension_path = tmpdir / extension_name
+    shutil.copytree(TEST_NATIVE_EXTENSION, extension_path)
+    subprocess.run(
+        [sys.executable, str(extension_path / "setup.py"), "build_ext", "--inplace"],
+        check=True,
+        cwd=extension_path,
+        capture_output=True,
+    )
+
+    with monkeypatch.context() as ctx:
+        ctx.setattr(sys, "path", [*sys.path, str(extension_path)])
+        from native_ext import run_simple  # type: ignore
+
+        with Tracker(output, native_traces=True):
+            run_simple()
+
+    def native_stacks(reader):
+        records = list(reader.get_high_watermark_allocation_records())
+        resolve_stack_traces(records, native=True)
+        return [record.native_stack_trace() for record in records]
+
+    expected = native_stacks(FileReader(output, symbol_cache_dir=cache_dir))
+
+    # WHEN
+    shutil.rmtree(extension_path)
+    stacks = native_stacks(FileReader(output, symbol_cache_dir=cache_dir))
+
+    # THEN
+    assert any(
+        frame[0] == "baz" for stack in expected for frame in stack
+    ), "the extension's frames should be resolved"
+    assert stacks == expected
+
+
+def test_symbol_cache_ignores_frames_of_another_build(tmpdir, monkeypatch):
+    """Frames resolved from a binary that isn't the build that the capture
+    recorded aren't kept under the build id of the capture."""
+    # GIVEN
+    output = Path(tmpdir) / "test.bin"
+    extension_name = "multithreaded_extension"
+    extension_path = tmpdir / extension_name
+    shutil.copytree(TEST_NATIVE_EXTENSION, extension_path)
+
+    def build_extension():
+        setup = str(extension_path / "setup.py")
+        subprocess.run(
+            [sys.executable, setup, "build_ext", "--inplace"],
+            check=True,
+            cwd=extension_path,
+            capture_output=True,
+        )
+
+    build_extension()
+    with monkeypatch.context() as ctx:
+        ctx.setattr(sys, "path", [*sys.path, str(extension_path)])
+        from native_ext import run_simple  # type: ignore
+
+        with Tracker(output, native_traces=True):
+            run_simple()
+
+    def cache_files(cache_dir):
+        reader = FileReader(output, symbol_cache_dir=cache_dir)
+        records = list(reader.get_high_watermark_allocation_records())
+        resolve_stack_traces(records, native=True)
+        return {path.name for path in cache_dir.iterdir()}
+
+    same_build = cache_files(Path(tmpdir) / "same_build")
+
+    # WHEN
+    with open(extension_path / "native_ext.cpp", "a") as source:
+        source.write("\nint memray_test_another_build = 1;\n")
+    build_extension()
+    another_build = cache_files(Path(tmpdir) / "another_build")
+
+    # THEN
+    assert another_build < same_build
+
+
+def test_extension_loaded_while_tracking(tmpdir):
+    """An extension that is imported after the tracker started is added to
+    the memory maps that were already written, and its symbols resolve."""
+    # GIVEN
+    output = Path(tmpdir) / "test.bin"
+    extension_name = "multithreaded_extension"
+    extension_path = tmpdir / extension_name
+    shutil.copytree(TEST_NATIVE_EXTENSION, extension_path)
+    subprocess.run(
+        [sys.executable, str(extension_path / "setup.py"), "build_ext", "--inplace"],
+        check=True,
+        cwd=extension_path,
+        capture_output=True,
+    )
+    program = textwrap.dedent(
+        f"""\
+        import sys
+        from memray import Tracker
+        from memray._test import MemoryAllocator
+
+        allocator = MemoryAllocator()
+        with Tracker({str(output)!r}, native_traces=True):
+            allocator.valloc(1234)
+            allocator.free()
+            sys.path.append({str(extension_path)!r})
+            from native_ext import run_simple
+
+            run_simple()
+        """
+    )
+
+    # WHEN
+    subprocess.run([sys.executable, "-c", program], check=True, timeout=60)
+
+    # THEN
+    records = list(FileReader(output).get_allocation_records())
+    vallocs = [
+        record
+        for record in filter_relevant_allocations(records)
+        if record.allocator == AllocatorType.VALLOC
+    ]
+
+    assert len(vallocs) == 2
+    first, loaded = vallocs
+    assert first.size == 1234
+    expected_symbols = ["baz", "bar", "foo"]
+    assert expected_symbols == [stack[0] for stack in loaded.native_stack_trace()[:3]]
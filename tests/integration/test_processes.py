@@ -1,7 +1,11 @@
+import subprocess
+import sys
+import textwrap
 from multiprocessing import Pool
 from pathlib import Path
 
 from memray import AllocatorType
+from memray import CaptureFamilyReader
 from memray import FileReader
 from memray import Tracker
 from memray._test import MemoryAllocator
@@ -105,3 +109,99 @@ def test_allocations_with_multiprocessing_following_fork(tmpdir):
     assert len(child_frees) == num_expected
     for valloc in child_vallocs:
         assert valloc.size == 1234
+
+
+def test_reading_the_captures_of_forked_children_together(tmp_path):
+    # GIVEN
+    output = tmp_path / "test.bin"
+    program = textwrap.dedent(
+        """
+        import os
+        import sys
+        from memray import Tracker
+        from memray._test import MemoryAllocator
+
+        allocator = MemoryAllocator()
+        with Tracker(sys.argv[1], follow_fork=True):
+            allocator.valloc(1234)
+            pids = []
+            for i in range(3):
+                pid = os.fork()
+                if pid == 0:
+                    allocator.free()
+                    allocator.valloc(1234 * (i + 2))
+                    pids = []
+                    break
+                pids.append(pid)
+            for pid in pids:
+                os.waitpid(pid, 0)
+        """
+    )
+    subprocess.run([sys.executable, "-c", program, str(output)], check=True)
+
+    # WHEN
+    reader = CaptureFamilyReader.from_parent(output, max_workers=2)
+
+    # THEN
+    processes = reader.processes
+    assert len(processes) == 4
+    assert processes[0].file_name == str(output)
+    child_pids = [process.pid for process in processes[1:]]
+    assert child_pids == sorted(child_pids)
+
+    leaks = list(filter_relevant_allocations(reader.get_leaked_allocation_records()))
+    assert sorted(record.size for record in leaks) == [1234, 2468, 3702, 4936]
+
+    parent_leaks = list(
+        filter_relevant_allocations(
+            reader.get_leaked_allocation_records(pid=processes[0].pid)
+        )
+    )
+    assert [record.size for record in parent_leaks] == [1234]
+    (symbol, filename, lineno), *_ = parent_leaks[0].stack_trace()
+    assert symbol == "valloc"
+
+    peaks = list(
+        filter_relevant_allocations(reader.get_high_watermark_allocation_records())
+    )
+    assert sorted(record.size for record in peaks) == [1234, 2468, 3702, 4936]
+    assert reader.peak_memory >= 1234 + 2468 + 3702 + 4936
+
+
+def test_forked_children_patch_objects_loaded_after_the_fork(tmp_path):
+    # GIVEN
+    output = tmp_path / "test.bin"
+    program = textwrap.dedent(
+        """
+        import os
+        import sys
+        from memray import Tracker
+
+        with Tracker(sys.argv[1], native_traces=True, follow_fork=True):
+            pid = os.fork()
+            if pid == 0:
+                # Loaded after the fork, so the child can't reuse the GOT
+                # slots that the parent patched for it.
+                from memray._test import MemoryAllocator
+
+                allocator = MemoryAllocator()
+                allocator.valloc(1234)
+            else:
+                os.waitpid(pid, 0)
+        """
+    )
+    subprocess.run([sys.executable, "-c", program, str(output)], check=True)
+
+    # WHEN
+    reader = CaptureFamilyReader.from_parent(output)
+
+    # THEN
+    processes = reader.processes
+    assert len(processes) == 2
+    child_leaks = list(
+        filter_relevant_allocations(
+            reader.get_leaked_allocation_records(pid=processes[1].pid)
+        )
+    )
+    assert [record.size for record in child_leaks] == [1234]
+    assert child_leaks[0].allocator == AllocatorType.VALLOC
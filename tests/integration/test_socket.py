@@ -14,6 +14,7 @@ from typing import Tuple
 import pytest
 
 from memray import AllocatorType
+from memray import SocketCollector
 from memray import SocketReader
 from tests.utils import filter_relevant_allocations
 
@@ -305,6 +306,78 @@ class TestSocketReaderAccess:
         assert filename == "src/memray/_memray_test_utils.pyx"
         assert 0 < lineno < 200
 
+    def test_live_stats_are_reported(self, free_port: int, tmp_path: Path) -> None:
+        # GIVEN
+        reader = SocketReader(port=free_port)
+        program = ALLOCATE_MANY_THEN_SNAPSHOT_THEN_FREE_MANY
+
+        # WHEN
+        with run_till_snapshot_point(
+            program,
+            reader=reader,
+            tmp_path=tmp_path,
+            free_port=free_port,
+        ):
+            stats = reader.live_stats
+
+        # THEN
+        assert stats.n_allocations >= MULTI_ALLOCATION_COUNT
+        assert stats.n_reports >= 1
+        assert stats.sender_blocked_time_ns >= 0
+        assert stats.max_lag_ns >= stats.lag_ns
+        assert reader.live_stats.n_reports == 0
+
+    def test_multi_allocation_snapshot_with_small_send_buffer(
+        self, free_port: int, tmp_path: Path
+    ) -> None:
+        # GIVEN
+        reader = SocketReader(port=free_port)
+        program = textwrap.dedent(
+            """
+            def get_tracker():
+                return Tracker(destination=SocketDestination(port=port, buffer_size=16))
+            """
+        )
+        program += ALLOCATE_MANY_THEN_SNAPSHOT_THEN_FREE_MANY
+
+        # WHEN
+        with run_till_snapshot_point(
+            program,
+            reader=reader,
+            tmp_path=tmp_path,
+            free_port=free_port,
+        ):
+            unfiltered_snapshot = list(reader.get_current_snapshot(merge_threads=False))
+
+        # THEN
+        snapshot = list(filter_relevant_allocations(unfiltered_snapshot))
+        assert len(snapshot) == 1
+        assert snapshot[0].size == ALLOCATION_SIZE * MULTI_ALLOCATION_COUNT
+        assert snapshot[0].allocator == AllocatorType.VALLOC
+
+    def test_snapshot_changes(self, free_port: int, tmp_path: Path) -> None:
+        # GIVEN
+        reader = SocketReader(port=free_port)
+        program = ALLOCATE_MANY_THEN_SNAPSHOT_THEN_FREE_MANY
+
+        # WHEN
+        with run_till_snapshot_point(
+            program,
+            reader=reader,
+            tmp_path=tmp_path,
+            free_port=free_port,
+        ):
+            version, unfiltered_changes = reader.get_snapshot_changes()
+            _, unfiltered_changes_since = reader.get_snapshot_changes(since=version)
+
+        # THEN
+        changes = list(filter_relevant_allocations(unfiltered_changes))
+        assert len(changes) == 1
+        assert changes[0].size == ALLOCATION_SIZE * MULTI_ALLOCATION_COUNT
+        assert changes[0].n_allocations == MULTI_ALLOCATION_COUNT
+        assert version > 0
+        assert not list(filter_relevant_allocations(unfiltered_changes_since))
+
     @pytest.mark.valgrind
     def test_multiple_context_entries_does_not_crash(
         self, free_port: int, tmp_path: Path
@@ -417,3 +490,163 @@ class TestSocketReaderAccess:
         # THEN
         assert len(traces) >= MAX_TRACES
         proc.returncode == 0
+
+
+class TestSharedMemoryTransport:
+    def test_multi_allocation_snapshot(self, free_port: int, tmp_path: Path) -> None:
+        # GIVEN
+        name = f"test-{os.getpid()}-{free_port}"
+        reader = SocketReader(shared_memory_name=name)
+        program = textwrap.dedent(
+            f"""
+            from memray._memray import SharedMemoryDestination
+
+            def get_tracker():
+                return Tracker(destination=SharedMemoryDestination(name={name!r}))
+            """
+        )
+        program += ALLOCATE_MANY_THEN_SNAPSHOT_THEN_FREE_MANY
+
+        # WHEN
+        with run_till_snapshot_point(
+            program,
+            reader=reader,
+            tmp_path=tmp_path,
+            free_port=free_port,
+        ):
+            unfiltered_snapshot = list(reader.get_current_snapshot(merge_threads=False))
+
+        # THEN
+        snapshot = list(filter_relevant_allocations(unfiltered_snapshot))
+        assert len(snapshot) == 1
+        assert snapshot[0].size == ALLOCATION_SIZE * MULTI_ALLOCATION_COUNT
+        assert snapshot[0].allocator == AllocatorType.VALLOC
+        assert reader.is_active is False
+        assert not (Path("/dev/shm") / f"memray-{name}").exists()
+
+    def test_writer_stops_when_the_reader_is_killed(self, free_port: int) -> None:
+        # GIVEN
+        name = f"test-{os.getpid()}-{free_port}"
+        writer_code = textwrap.dedent(
+            f"""
+            import sys
+            from memray._memray import MemoryAllocator
+            from memray._memray import SharedMemoryDestination
+            from memray._memray import Tracker
+
+            destination = SharedMemoryDestination(name={name!r}, capacity=4096)
+            with Tracker(destination=destination):
+                sys.stdin.readline()
+                allocator = MemoryAllocator()
+                for _ in range(10000):
+                    allocator.valloc({ALLOCATION_SIZE})
+                    allocator.free()
+            """
+        )
+        reader_code = textwrap.dedent(
+            f"""
+            import time
+            from memray import SocketReader
+
+            with SocketReader(shared_memory_name={name!r}):
+                print("attached", flush=True)
+                time.sleep(60)
+            """
+        )
+
+        with subprocess.Popen(
+            [sys.executable, "-c", writer_code], stdin=subprocess.PIPE, text=True
+        ) as writer:
+            with subprocess.Popen(
+                [sys.executable, "-c", reader_code], stdout=subprocess.PIPE, text=True
+            ) as reader:
+                assert reader.stdout.readline() == "attached\n"
+                reader.kill()
+
+            # WHEN
+            writer.stdin.write("\n")
+            writer.stdin.flush()
+
+            # THEN
+            writer.wait(timeout=TIMEOUT)
+
+        assert not (Path("/dev/shm") / f"memray-{name}").exists()
+        assert not (Path("/dev/shm") / f"memray-{name}.reader").exists()
+
+    def test_requires_exactly_one_source(self) -> None:
+        # GIVEN / WHEN / THEN
+        with pytest.raises(TypeError, match="Exactly one of"):
+            SocketReader(1234, shared_memory_name="test")
+
+
+class TestSocketCollector:
+    def test_collects_forked_children(self, tmp_path: Path) -> None:
+        # GIVEN
+        allocations_made = tmp_path / "allocations_made.event"
+        snapshot_taken = tmp_path / "snapshot_taken.event"
+        os.mkfifo(allocations_made)
+        os.mkfifo(snapshot_taken)
+        program = textwrap.dedent(
+            f"""
+            import os
+            import sys
+            from memray._memray import CollectorDestination
+            from memray._memray import MemoryAllocator
+            from memray._memray import Tracker
+
+            port = int(sys.argv[1])
+            allocator = MemoryAllocator()
+            destination = CollectorDestination(port=port, buffer_size=16)
+            with Tracker(destination=destination, follow_fork=True):
+                allocator.valloc({ALLOCATION_SIZE})
+                pid = os.fork()
+                if pid == 0:
+                    allocator.valloc({ALLOCATION_SIZE * 2})
+                    with open(sys.argv[2], "w") as allocations_made:
+                        allocations_made.write(str(os.getpid()))
+                    with open(sys.argv[3], "r") as snapshot_taken:
+                        assert snapshot_taken.read() == "done"
+                    os._exit(0)
+                os.waitpid(pid, 0)
+            """
+        )
+
+        # WHEN
+        with SocketCollector() as collector:
+            proc = subprocess.Popen(
+                [
+                    sys.executable,
+                    "-c",
+                    program,
+                    str(collector.port),
+                    allocations_made,
+                    snapshot_taken,
+                ]
+            )
+            try:
+                with open(allocations_made, "r") as f1:
+                    child_pid = int(f1.read())
+                time.sleep(0.1)
+                pids = collector.pids
+                child_snapshot = list(
+                    collector.get_current_snapshot(merge_threads=False, pid=child_pid)
+                )
+                merged_snapshot = list(
+                    collector.get_current_snapshot(merge_threads=False)
+                )
+                with open(snapshot_taken, "w") as f2:
+                    f2.write("done")
+            finally:
+                assert proc.wait(timeout=TIMEOUT) == 0
+
+        # THEN
+        assert sorted(pids) == sorted([proc.pid, child_pid])
+        child_allocations = list(filter_relevant_allocations(child_snapshot))
+        assert [allocation.size for allocation in child_allocations] == [
+            ALLOCATION_SIZE * 2
+        ]
+        merged_allocations = list(filter_relevant_allocations(merged_snapshot))
+        assert sorted(allocation.size for allocation in merged_allocations) == [
+            ALLOCATION_SIZE,
+            ALLOCATION_SIZE * 2,
+        ]
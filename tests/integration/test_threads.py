@@ -92,3 +92,61 @@ def test_thread_name(tmpdir):
     (valloc,) = vallocs
     assert valloc.size == 1234
     assert "my thread name" in valloc.thread_name
+
+
+def test_allocations_from_different_threads_are_read_in_order(tmpdir):
+    # GIVEN
+    output = Path(tmpdir) / "test.bin"
+    allocators = [MemoryAllocator() for _ in range(10)]
+
+    def run_in_thread(func, *args):
+        thread = threading.Thread(target=func, args=args)
+        thread.start()
+        thread.join()
+
+    # WHEN
+    with Tracker(output):
+        for allocator in allocators:
+            run_in_thread(allocator.valloc, 1234)
+            run_in_thread(allocator.free)
+
+    # THEN
+    relevant_records = list(
+        filter_relevant_allocations(FileReader(output).get_allocation_records())
+    )
+    assert [record.allocator for record in relevant_records] == [
+        AllocatorType.VALLOC,
+        AllocatorType.FREE,
+    ] * len(allocators)
+    for valloc, free in zip(relevant_records[::2], relevant_records[1::2]):
+        assert valloc.address == free.address
+        assert valloc.tid != free.tid
+
+
+def test_threads_that_ran_one_after_another_have_different_ids(tmpdir):
+    # GIVEN
+    output = Path(tmpdir) / "test.bin"
+    allocator = MemoryAllocator()
+
+    def allocating_function():
+        allocator.valloc(1234)
+        allocator.free()
+
+    # WHEN
+    with Tracker(output):
+        # The pthread_t of a joined thread is normally reused by the next one
+        for _ in range(5):
+            thread = threading.Thread(target=allocating_function)
+            thread.start()
+            thread.join()
+
+    # THEN
+    vallocs = [
+        record
+        for record in filter_relevant_allocations(
+            FileReader(output).get_allocation_records()
+        )
+        if record.allocator == AllocatorType.VALLOC
+    ]
+    assert len(vallocs) == 5
+    assert len({record.tid for record in vallocs}) == 5
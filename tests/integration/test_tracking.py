@@ -1,6 +1,9 @@
 import collections
 import datetime
+import math
 import mmap
+import os
+import shutil
 import signal
 import subprocess
 import sys
@@ -12,10 +15,31 @@ from pathlib import Path
 import pytest
 
 from memray import AllocatorType
+from memray import CaptureDiff
+from memray import FileFormat
 from memray import FileReader
+from memray import FlightRecorderDestination
+from memray import SocketDestination
 from memray import Tracker
+from memray import dump_all_records
 from memray._memray import MmapAllocator
+from memray._memray import export_profile
+from memray._memray import resolve_stack_traces
 from memray._test import MemoryAllocator
+from memray._test import PymallocMemoryAllocator
+from memray._test import SnapshotBenchmark
+from memray._test import benchmark_live_throughput
+from memray._test import benchmark_look_up_traces
+from memray._test import benchmark_read_records
+from memray._test import benchmark_track_allocations
+from memray._test import benchmark_write_allocation_records
+from memray._test import write_synthetic_capture
+from memray.reporters.stats import format_top_allocations_by_count
+from memray.reporters.stats import format_top_allocations_by_size
+from memray.reporters.stats import get_histogram_databins
+from memray.reporters.stats import get_stats_data
+from memray.reporters.stats import get_top_allocations_by_count
+from memray.reporters.stats import get_top_allocations_by_size
 from tests.utils import filter_relevant_allocations
 
 ALLOCATORS = [
@@ -68,6 +92,81 @@ def test_simple_allocation_tracking(allocator_func, allocator_type, tmp_path):
     assert len(frees) >= 1
 
 
+def test_realloc_is_reported_as_a_free_followed_by_an_allocation(tmp_path):
+    # GIVEN
+    allocator = MemoryAllocator()
+    output = tmp_path / "test.bin"
+
+    # WHEN
+    with Tracker(output):
+        allocator.realloc(1234)
+        allocator.free()
+
+    # THEN
+    allocations = list(FileReader(output).get_allocation_records())
+    (realloc_index,) = [
+        i
+        for i, event in enumerate(allocations)
+        if event.size == 1234 and event.allocator == AllocatorType.REALLOC
+    ]
+    (malloc,) = [
+        event
+        for event in allocations[:realloc_index]
+        if event.size == 1 and event.allocator == AllocatorType.MALLOC
+    ]
+    free = allocations[realloc_index - 1]
+    assert free.allocator == AllocatorType.FREE
+    assert free.address == malloc.address
+    assert free.tid == allocations[realloc_index].tid
+
+
+def test_records_read_twice_compare_equal(tmp_path):
+    # GIVEN
+    allocator = MemoryAllocator()
+    output = tmp_path / "test.bin"
+
+    # WHEN
+    with Tracker(output):
+        allocator.valloc(1234)
+        allocator.free()
+        allocator.valloc(4321)
+
+    # THEN
+    first = list(FileReader(output).get_high_watermark_allocation_records())
+    second = list(FileReader(output).get_high_watermark_allocation_records())
+    assert set(first) == set(second)
+    assert {hash(record) for record in first} == {hash(record) for record in second}
+    (record,) = [record for record in first if record.size == 4321]
+    assert record.allocator == AllocatorType.VALLOC
+    assert record.n_allocations == 1
+    assert record.stack_trace()
+    allocator.free()
+
+
+def test_frees_of_memory_allocated_before_tracking_are_not_recorded(tmp_path):
+    # GIVEN
+    allocator = MemoryAllocator()
+    output = tmp_path / "test.bin"
+    allocator.valloc(1234)
+
+    # WHEN
+    with Tracker(output):
+        allocator.free()
+        allocator.valloc(4321)
+        allocator.free()
+
+    # THEN
+    allocations = list(FileReader(output).get_allocation_records())
+    allocated = {
+        event.address
+        for event in allocations
+        if event.allocator not in (AllocatorType.FREE, AllocatorType.MUNMAP)
+    }
+    frees = [event for event in allocations if event.allocator == AllocatorType.FREE]
+    assert frees
+    assert all(free.address in allocated for free in frees)
+
+
 def test_mmap_tracking(tmp_path):
     # GIVEN / WHEN
     output = tmp_path / "test.bin"
@@ -132,6 +231,7 @@ def test_tracking_with_SIGKILL(tmpdir):
         import signal
         from memray import Tracker
         from memray._test import MemoryAllocator
+from memray._test import PymallocMemoryAllocator
 
         allocator = MemoryAllocator()
         output = "{output}"
@@ -783,6 +883,30 @@ class TestLeaks:
         assert allocation.size == 1024 * 10
         assert allocation.n_allocations == 10
 
+    def test_reallocated_allocation_is_replaced_in_leaks(self, tmp_path):
+        # GIVEN
+        allocator = MemoryAllocator()
+        output = tmp_path / "test.bin"
+
+        # WHEN
+        with Tracker(output):
+            allocator.realloc(1234)
+
+        # THEN
+        reader = FileReader(output)
+        leaked_allocations = [
+            record
+            for record in reader.get_leaked_allocation_records()
+            if record.allocator in (AllocatorType.MALLOC, AllocatorType.REALLOC)
+            and record.size in (1, 1234, 1235)
+        ]
+        assert len(leaked_allocations) == 1
+        (allocation,) = leaked_allocations
+        assert allocation.allocator == AllocatorType.REALLOC
+        assert allocation.size == 1234
+        assert allocation.n_allocations == 1
+        allocator.free()
+
     def test_unmatched_deallocations_are_not_reported(self, tmp_path):
         # GIVEN
         allocator = MemoryAllocator()
@@ -795,8 +919,6 @@ class TestLeaks:
 
         # THEN
         reader = FileReader(output)
-        all_allocations = list(reader.get_allocation_records())
-        assert len(all_allocations) >= 1
         assert not list(
             filter_relevant_allocations(reader.get_leaked_allocation_records())
         )
@@ -931,6 +1053,7 @@ class TestHeader:
             f"""
         from memray import Tracker
         from memray._test import MemoryAllocator
+from memray._test import PymallocMemoryAllocator
         allocator = MemoryAllocator()
 
         with Tracker('{output}'):
@@ -952,6 +1075,86 @@ class TestHeader:
         assert metadata.python_allocator == allocator_name
 
 
+class TestTrackerOverhead:
+    def test_overhead_is_in_the_header(self, tmp_path):
+        # GIVEN
+        allocator = MemoryAllocator()
+        output = tmp_path / "test.bin"
+
+        # WHEN
+        with Tracker(output):
+            for _ in range(1000):
+                allocator.valloc(1024)
+                allocator.free()
+
+        # THEN
+        overhead = FileReader(output).metadata.overhead
+        assert overhead is not None
+        n_allocations = overhead.records_by_type["allocation"]
+        assert n_allocations >= 2000
+        assert overhead.bytes_by_type["allocation"] > n_allocations
+        assert overhead.records_by_type["thread_chunk"] >= 1
+        assert overhead.records_by_type["chunk_barrier"] >= 1
+        # Only a sample of the calls is timed, and each stands for the rest.
+        assert overhead.n_hook_calls >= 1984
+        assert overhead.n_hook_calls % 64 == 0
+        assert overhead.hooks_time_ns > 0
+        assert overhead.unwind_time_ns == 0
+        assert overhead.deactivated_records == 0
+
+    def test_unwinding_is_timed_with_native_traces(self, tmp_path):
+        # GIVEN
+        allocator = MemoryAllocator()
+        output = tmp_path / "test.bin"
+
+        # WHEN
+        with Tracker(output, native_traces=True):
+            for _ in range(1000):
+                allocator.valloc(1024)
+                allocator.free()
+
+        # THEN
+        overhead = FileReader(output).metadata.overhead
+        assert 0 < overhead.unwind_time_ns <= overhead.hooks_time_ns
+        assert overhead.records_by_type["native_trace_index"] >= 1
+
+    def test_overhead_of_the_active_tracker(self, tmp_path):
+        # GIVEN
+        allocator = MemoryAllocator()
+        output = tmp_path / "test.bin"
+
+        # WHEN
+        with Tracker(output) as tracker:
+            for _ in range(1000):
+                allocator.valloc(1024)
+                allocator.free()
+            overhead = tracker.get_overhead()
+
+        # THEN
+        assert overhead.records_by_type["allocation"] >= 2000
+        final_overhead = FileReader(output).metadata.overhead
+        assert final_overhead.n_hook_calls >= overhead.n_hook_calls
+        with pytest.raises(RuntimeError, match="only known while a Tracker is active"):
+            tracker.get_overhead()
+
+    def test_aggregated_captures_count_their_records(self, tmp_path):
+        # GIVEN
+        allocator = MemoryAllocator()
+        output = tmp_path / "test.bin"
+
+        # WHEN
+        with Tracker(output, file_format=FileFormat.AGGREGATED_ALLOCATIONS):
+            for _ in range(1000):
+                allocator.valloc(1024)
+                allocator.free()
+
+        # THEN
+        overhead = FileReader(output).metadata.overhead
+        assert overhead.records_by_type["allocation"] >= 2000
+        assert overhead.records_by_type["aggregated_allocation"] >= 1
+        assert overhead.n_hook_calls >= 1984
+
+
 class TestMemoryRecords:
     @pytest.mark.valgrind
     def test_memory_records_are_written(self, tmp_path):
@@ -994,3 +1197,1999 @@ class TestMemoryRecords:
             _next.time - prev.time >= 20
             for prev, _next in zip(memory_records, memory_records[1:])
         )
+
+    def test_memory_gauges_are_recorded(self, tmp_path):
+        # GIVEN
+        allocator = MemoryAllocator()
+        output = tmp_path / "test.bin"
+
+        # WHEN
+        with Tracker(output, memory_gauges=True):
+            allocator.valloc(64 * 2**20)
+            objects = [object() for _ in range(100_000)]
+            time.sleep(0.11)
+            allocator.free()
+        del objects
+
+        # THEN
+        reader = FileReader(output)
+        memory_records = list(reader.get_memory_records())
+        assert memory_records
+        assert all(record.tracked_bytes is not None for record in memory_records)
+        assert all(
+            record.heap_in_use <= record.heap_size for record in memory_records
+        )
+        assert max(record.tracked_bytes for record in memory_records) >= 64 * 2**20
+        assert max(record.heap_in_use for record in memory_records) >= 64 * 2**20
+        if reader.metadata.python_allocator == "pymalloc":
+            assert max(record.pymalloc_arenas for record in memory_records) > 0
+
+    def test_tracked_bytes_ignore_frees_of_memory_allocated_before(self, tmp_path):
+        # GIVEN
+        allocated_before = MemoryAllocator()
+        allocator = MemoryAllocator()
+        output = tmp_path / "test.bin"
+        allocated_before.valloc(64 * 2**20)
+
+        # WHEN
+        with Tracker(output, memory_gauges=True):
+            allocated_before.free()
+            allocator.valloc(2**20)
+            time.sleep(0.11)
+            allocator.free()
+
+        # THEN
+        memory_records = list(FileReader(output).get_memory_records())
+        assert memory_records
+        assert 2**20 <= max(record.tracked_bytes for record in memory_records)
+        assert max(record.tracked_bytes for record in memory_records) < 64 * 2**20
+
+    def test_memory_gauges_are_not_recorded_by_default(self, tmp_path):
+        # GIVEN
+        allocator = MemoryAllocator()
+        output = tmp_path / "test.bin"
+
+        # WHEN
+        with Tracker(output):
+            allocator.valloc(1234)
+            time.sleep(0.11)
+            allocator.free()
+
+        # THEN
+        memory_records = list(FileReader(output).get_memory_records())
+        assert memory_records
+        assert all(record.heap_size is None for record in memory_records)
+
+
+class TestSampling:
+    def test_sampled_sizes_are_scaled_to_an_estimate(self, tmp_path):
+        # GIVEN
+        allocator = MemoryAllocator()
+        output = tmp_path / "test.bin"
+        n_allocations = 10_000
+        size = 1024
+
+        # WHEN
+        with Tracker(output, sample_rate=4 * size):
+            for _ in range(n_allocations):
+                allocator.valloc(size)
+                allocator.free()
+
+        # THEN
+        vallocs = [
+            record
+            for record in FileReader(output).get_allocation_records()
+            if record.allocator == AllocatorType.VALLOC
+        ]
+        assert 0 < len(vallocs) < n_allocations
+        estimated_size = sum(record.size for record in vallocs)
+        estimated_count = sum(record.n_allocations for record in vallocs)
+        assert estimated_size == pytest.approx(n_allocations * size, rel=0.2)
+        assert estimated_count == pytest.approx(n_allocations, rel=0.2)
+
+    def test_big_allocations_are_always_recorded(self, tmp_path):
+        # GIVEN
+        allocator = MemoryAllocator()
+        output = tmp_path / "test.bin"
+        sample_rate = 4096
+
+        # WHEN
+        with Tracker(output, sample_rate=sample_rate):
+            for _ in range(10):
+                allocator.valloc(sample_rate * 100)
+                allocator.free()
+
+        # THEN
+        records = list(
+            filter_relevant_allocations(FileReader(output).get_allocation_records())
+        )
+        assert [record.allocator for record in records] == [
+            AllocatorType.VALLOC,
+            AllocatorType.FREE,
+        ] * 10
+        assert all(
+            record.size == sample_rate * 100
+            for record in records
+            if record.allocator == AllocatorType.VALLOC
+        )
+
+    def test_only_sampled_allocations_are_deallocated(self, tmp_path):
+        # GIVEN
+        allocator = MemoryAllocator()
+        output = tmp_path / "test.bin"
+
+        # WHEN
+        with Tracker(output, sample_rate=4096):
+            for _ in range(1000):
+                allocator.valloc(1024)
+                allocator.free()
+
+        # THEN
+        live_addresses = set()
+        n_frees = 0
+        for record in FileReader(output).get_allocation_records():
+            if record.allocator == AllocatorType.FREE:
+                assert record.address in live_addresses
+                live_addresses.remove(record.address)
+                n_frees += 1
+            elif record.allocator != AllocatorType.MUNMAP:
+                live_addresses.add(record.address)
+        assert n_frees > 0
+
+    def test_sample_rate_is_stored_in_the_header(self, tmp_path):
+        # GIVEN
+        output = tmp_path / "test.bin"
+
+        # WHEN
+        with Tracker(output, sample_rate=1234):
+            pass
+
+        # THEN
+        assert FileReader(output).metadata.sample_rate == 1234
+
+
+class TestAggregatedFileFormat:
+    def test_high_watermark_allocations_are_aggregated(self, tmp_path):
+        # GIVEN
+        allocator = MemoryAllocator()
+        output = tmp_path / "test.bin"
+
+        # WHEN
+        with Tracker(output, file_format=FileFormat.AGGREGATED_ALLOCATIONS):
+            allocator.valloc(1024)
+            allocator.free()
+            for _ in range(3):
+                allocator.valloc(2048)
+            allocator.free()
+
+        # THEN
+        reader = FileReader(output)
+        peak_allocations = [
+            record
+            for record in reader.get_high_watermark_allocation_records()
+            if record.allocator == AllocatorType.VALLOC
+        ]
+        assert len(peak_allocations) == 1
+        record = peak_allocations[0]
+        assert record.size == 3 * 2048
+        assert record.n_allocations == 3
+        assert reader.metadata.peak_memory >= 3 * 2048
+
+    def test_leaked_allocations_are_aggregated(self, tmp_path):
+        # GIVEN
+        allocator = MemoryAllocator()
+        output = tmp_path / "test.bin"
+
+        # WHEN
+        with Tracker(output, file_format=FileFormat.AGGREGATED_ALLOCATIONS):
+            for _ in range(3):
+                allocator.valloc(2048)
+            allocator.free()
+
+        # THEN
+        leaked_allocations = [
+            record
+            for record in FileReader(output).get_leaked_allocation_records()
+            if record.allocator == AllocatorType.VALLOC
+        ]
+        assert len(leaked_allocations) == 1
+        record = leaked_allocations[0]
+        assert record.size == 2 * 2048
+        assert record.n_allocations == 2
+
+    def test_aggregated_snapshots_match_the_full_ones(self, tmp_path):
+        # GIVEN
+        def workload():
+            allocator = MemoryAllocator()
+            allocators = []
+            for size in range(1, 1000, 37):
+                allocators.append(MemoryAllocator())
+                allocators[-1].valloc(size * 100)
+            for other in allocators[::3]:
+                other.free()
+            allocator.valloc(500000)
+            allocator.free()
+            mmap_allocator = MmapAllocator(10 * PAGE_SIZE)
+            mmap_allocator.munmap(PAGE_SIZE, 2 * PAGE_SIZE)
+            return allocators, mmap_allocator
+
+        def snapshot(records):
+            # Only the line numbers of the frames calling workload() differ.
+            return sorted(
+                (
+                    [
+                        (function, filename)
+                        for function, filename, _ in record.stack_trace()
+                    ],
+                    record.allocator,
+                    record.size,
+                    record.n_allocations,
+                )
+                for record in records
+                if record.allocator in (AllocatorType.VALLOC, AllocatorType.MMAP)
+            )
+
+        full_output = tmp_path / "full.bin"
+        aggregated_output = tmp_path / "aggregated.bin"
+
+        # WHEN
+        with Tracker(full_output):
+            _ = workload()
+        with Tracker(
+            aggregated_output, file_format=FileFormat.AGGREGATED_ALLOCATIONS
+        ):
+            _ = workload()
+
+        # THEN
+        full = FileReader(full_output)
+        aggregated = FileReader(aggregated_output)
+        assert snapshot(
+            aggregated.get_high_watermark_allocation_records()
+        ) == snapshot(full.get_high_watermark_allocation_records())
+        assert snapshot(aggregated.get_leaked_allocation_records()) == snapshot(
+            full.get_leaked_allocation_records()
+        )
+
+    def test_individual_allocations_are_not_available(self, tmp_path):
+        # GIVEN
+        output = tmp_path / "test.bin"
+
+        # WHEN
+        with Tracker(output, file_format=FileFormat.AGGREGATED_ALLOCATIONS):
+            pass
+
+        # THEN
+        with pytest.raises(NotImplementedError):
+            FileReader(output).get_allocation_records()
+
+    def test_requires_an_output_file(self):
+        # GIVEN / WHEN / THEN
+        with pytest.raises(RuntimeError, match="requires an output file"):
+            Tracker(
+                destination=SocketDestination(port=1234),
+                file_format=FileFormat.AGGREGATED_ALLOCATIONS,
+            )
+
+
+class TestAllocationCountsFileFormat:
+    def test_allocations_are_counted_by_location(self, tmp_path):
+        # GIVEN
+        allocator = MemoryAllocator()
+        output = tmp_path / "test.bin"
+
+        # WHEN
+        with Tracker(output, file_format=FileFormat.ALLOCATION_COUNTS):
+            allocator.valloc(1024)
+            allocator.free()
+            for _ in range(3):
+                allocator.valloc(2048)
+                allocator.free()
+
+        # THEN
+        reader = FileReader(output)
+        assert reader.file_format == FileFormat.ALLOCATION_COUNTS
+        counts = [
+            record
+            for record in reader.get_allocation_counts()
+            if record.allocator in (AllocatorType.VALLOC, AllocatorType.FREE)
+        ]
+        assert len(counts) == 1
+        (record,) = counts
+        assert record.allocator == AllocatorType.VALLOC
+        assert record.n_allocations == 4
+        assert record.size == 1024 + 3 * 2048
+        (symbol, _, _), *_ = record.stack_trace()
+        assert symbol == "valloc"
+
+    def test_the_counts_of_exited_threads_are_kept(self, tmp_path):
+        # GIVEN
+        output = tmp_path / "test.bin"
+
+        def allocating_thread():
+            allocator = MemoryAllocator()
+            for _ in range(10):
+                allocator.valloc(1234)
+                allocator.free()
+
+        # WHEN
+        with Tracker(output, file_format=FileFormat.ALLOCATION_COUNTS):
+            threads = [threading.Thread(target=allocating_thread) for _ in range(3)]
+            for thread in threads:
+                thread.start()
+            for thread in threads:
+                thread.join()
+
+        # THEN
+        reader = FileReader(output)
+        counts = [
+            record
+            for record in reader.get_allocation_counts(merge_threads=False)
+            if record.allocator == AllocatorType.VALLOC
+        ]
+        assert sum(record.n_allocations for record in counts) == 30
+        assert sum(record.size for record in counts) == 30 * 1234
+
+    def test_the_heap_is_not_available(self, tmp_path):
+        # GIVEN
+        output = tmp_path / "test.bin"
+
+        # WHEN
+        with Tracker(output, file_format=FileFormat.ALLOCATION_COUNTS):
+            pass
+
+        # THEN
+        reader = FileReader(output)
+        with pytest.raises(NotImplementedError):
+            list(reader.get_high_watermark_allocation_records())
+        with pytest.raises(NotImplementedError):
+            reader.get_allocation_records()
+
+    def test_requires_an_output_file(self):
+        # GIVEN / WHEN / THEN
+        with pytest.raises(RuntimeError, match="requires an output file"):
+            Tracker(
+                destination=SocketDestination(port=1234),
+                file_format=FileFormat.ALLOCATION_COUNTS,
+            )
+
+
+class TestCancelShortLivedAllocations:
+    def test_short_lived_allocations_are_only_counted(self, tmp_path):
+        # GIVEN
+        allocator = MemoryAllocator()
+        output = tmp_path / "test.bin"
+
+        # WHEN
+        with Tracker(output, cancel_short_lived_allocations=True):
+            for _ in range(10):
+                allocator.valloc(1234)
+                allocator.free()
+
+        # THEN
+        allocations = [
+            record
+            for record in FileReader(output).get_allocation_records()
+            if record.allocator == AllocatorType.VALLOC
+        ]
+        assert len(allocations) < 10
+        assert sum(record.n_allocations for record in allocations) == 10
+        assert sum(record.size for record in allocations) == 10 * 1234
+
+    def test_allocations_that_are_not_freed_are_recorded(self, tmp_path):
+        # GIVEN
+        allocator = MemoryAllocator()
+        output = tmp_path / "test.bin"
+
+        # WHEN
+        with Tracker(output, cancel_short_lived_allocations=True):
+            allocator.valloc(1234)
+            allocator.valloc(4321)
+            allocator.free()
+
+        # THEN
+        leaked_allocations = [
+            record
+            for record in FileReader(output).get_leaked_allocation_records()
+            if record.allocator == AllocatorType.VALLOC
+        ]
+        assert len(leaked_allocations) == 1
+        assert leaked_allocations[0].size == 1234
+
+
+class TestCompression:
+    def test_compressed_file_has_the_same_records(self, tmp_path):
+        # GIVEN
+        def allocations(output, **kwargs):
+            allocator = MemoryAllocator()
+            with Tracker(output, **kwargs):
+                for size in range(1, 100):
+                    allocator.valloc(size * 10)
+                    allocator.free()
+            return [
+                (record.allocator, record.size, record.n_allocations)
+                for record in FileReader(output).get_allocation_records()
+                if record.allocator in (AllocatorType.VALLOC, AllocatorType.FREE)
+            ]
+
+        # WHEN
+        uncompressed = allocations(tmp_path / "uncompressed.bin")
+        compressed = allocations(tmp_path / "compressed.bin", compression="zstd")
+
+        # THEN
+        assert compressed == uncompressed
+        zstd_magic = b"\x28\xb5\x2f\xfd"
+        assert (tmp_path / "compressed.bin").read_bytes()[:4] == zstd_magic
+
+    def test_metadata_is_available(self, tmp_path):
+        # GIVEN
+        output = tmp_path / "test.bin"
+
+        # WHEN
+        with Tracker(output, compression="zstd"):
+            allocator = MemoryAllocator()
+            allocator.valloc(1234)
+            allocator.free()
+
+        # THEN
+        metadata = FileReader(output).metadata
+        assert metadata.total_allocations >= 2
+        assert metadata.peak_memory >= 1234
+
+    def test_unknown_compression(self, tmp_path):
+        # GIVEN / WHEN / THEN
+        with pytest.raises(ValueError, match="compression must be"):
+            Tracker(tmp_path / "test.bin", compression="gzip")
+
+    def test_requires_an_output_file(self):
+        # GIVEN / WHEN / THEN
+        with pytest.raises(RuntimeError, match="requires an output file"):
+            Tracker(destination=SocketDestination(port=1234), compression="zstd")
+
+
+class TestBackpressure:
+    @pytest.mark.parametrize("backpressure", ["block", "drop"])
+    def test_allocations_are_recorded(self, tmp_path, backpressure):
+        # GIVEN
+        allocator = MemoryAllocator()
+        output = tmp_path / "test.bin"
+
+        # WHEN
+        with Tracker(output, backpressure=backpressure):
+            allocator.valloc(1234)
+            allocator.free()
+
+        # THEN
+        allocations = [
+            record
+            for record in FileReader(output).get_allocation_records()
+            if record.allocator == AllocatorType.VALLOC
+        ]
+        assert len(allocations) == 1
+        assert allocations[0].size == 1234
+
+    def test_no_records_are_dropped_when_blocking(self, tmp_path):
+        # GIVEN
+        allocator = MemoryAllocator()
+        output = tmp_path / "test.bin"
+
+        # WHEN
+        with Tracker(output):
+            for _ in range(10000):
+                allocator.valloc(1234)
+                allocator.free()
+
+        # THEN
+        reader = FileReader(output)
+        assert reader.metadata.dropped_records == 0
+        allocations = [
+            record
+            for record in reader.get_allocation_records()
+            if record.allocator == AllocatorType.VALLOC
+        ]
+        assert len(allocations) == 10000
+
+    def test_unknown_backpressure_policy(self, tmp_path):
+        # GIVEN / WHEN / THEN
+        with pytest.raises(ValueError, match="backpressure must be"):
+            Tracker(tmp_path / "test.bin", backpressure="wait")
+
+
+class TestCheckpoints:
+    def test_large_captures_are_checkpointed(self, tmp_path, capfd):
+        # GIVEN
+        allocator = MemoryAllocator()
+        output = tmp_path / "test.bin"
+
+        def allocating_function():
+            for _ in range(200000):
+                allocator.valloc(1234)
+                allocator.free()
+
+        # WHEN
+        with Tracker(output):
+            allocating_function()
+
+        # THEN
+        dump_all_records(output)
+        records = capfd.readouterr().out.splitlines()
+        assert any(record.startswith("CHECKPOINT ") for record in records)
+        assert sum(record.startswith("CHECKPOINT_INDEX ") for record in records) == 1
+        assert not records[0].endswith(" checkpoint_index_offset=0")
+
+        allocations = [
+            record
+            for record in FileReader(output).get_allocation_records()
+            if record.allocator == AllocatorType.VALLOC
+        ]
+        assert len(allocations) == 200000
+        assert all(
+            record.stack_trace()[0][0] == "allocating_function"
+            for record in allocations
+        )
+
+    def test_reading_in_parallel_gives_the_same_records(self, tmp_path):
+        # GIVEN
+        allocator = MemoryAllocator()
+        output = tmp_path / "test.bin"
+
+        def allocating_function(n):
+            for _ in range(n):
+                allocator.valloc(1234)
+                allocator.free()
+
+        # WHEN
+        with Tracker(output):
+            thread = threading.Thread(target=allocating_function, args=(100000,))
+            thread.start()
+            allocating_function(200000)
+            thread.join()
+
+        # THEN
+        def records(max_workers):
+            reader = FileReader(output, max_workers=max_workers)
+            return [
+                (record.tid, record.address, record.allocator, record.stack_trace())
+                for record in reader.get_allocation_records()
+            ]
+
+        assert records(max_workers=4) == records(max_workers=1)
+
+    def test_reducing_snapshots_in_parallel_gives_the_same_snapshots(self, tmp_path):
+        # GIVEN
+        allocator = MemoryAllocator()
+        leaked = MemoryAllocator()
+        output = tmp_path / "test.bin"
+
+        def allocating_function(n):
+            for i in range(n):
+                allocator.valloc(1234)
+                allocator.free()
+                if i % 1000 == 0:
+                    leaked.valloc(4321)
+
+        # WHEN
+        with Tracker(output):
+            allocating_function(300000)
+
+        # THEN
+        def snapshots(max_workers):
+            reader = FileReader(output, max_workers=max_workers)
+            return [
+                sorted(
+                    (record.stack_trace(), record.size, record.n_allocations)
+                    for record in snapshot
+                )
+                for snapshot in (
+                    reader.get_high_watermark_allocation_records(),
+                    reader.get_leaked_allocation_records(),
+                )
+            ]
+
+        assert snapshots(max_workers=4) == snapshots(max_workers=1)
+
+    def test_max_workers_must_be_positive(self, tmp_path):
+        # GIVEN
+        output = tmp_path / "test.bin"
+        with Tracker(output):
+            pass
+
+        # WHEN / THEN
+        with pytest.raises(ValueError, match="max_workers must be at least 1"):
+            FileReader(output, max_workers=0)
+
+
+class TestStreamingReads:
+    def test_streaming_reads_give_the_same_results(self, tmp_path):
+        # GIVEN
+        allocator = MemoryAllocator()
+        output = tmp_path / "test.bin"
+
+        def allocating_function():
+            for size in range(1, 1000):
+                allocator.valloc(size)
+                allocator.free()
+            leaked = MemoryAllocator()
+            leaked.valloc(4321)
+            for _ in range(10):
+                peak = MemoryAllocator()
+                peak.valloc(12345)
+                peak.free()
+
+        # WHEN
+        with Tracker(output):
+            allocating_function()
+
+        # THEN
+        def results(streaming):
+            reader = FileReader(output, streaming=streaming)
+
+            def snapshot(records):
+                return sorted(
+                    (r.tid, r.size, r.allocator, r.n_allocations, r.stack_trace())
+                    for r in records
+                )
+
+            return (
+                reader.metadata.peak_memory,
+                snapshot(reader.get_high_watermark_allocation_records()),
+                snapshot(reader.get_leaked_allocation_records()),
+                [
+                    (r.address, r.size, r.allocator)
+                    for r in reader.get_allocation_records()
+                ],
+                list(reader.get_memory_records()),
+            )
+
+        assert results(streaming=True) == results(streaming=False)
+
+    def test_reads_within_a_memory_budget_give_the_same_results(self, tmp_path):
+        # GIVEN
+        output = tmp_path / "test.bin"
+        spill_directory = tmp_path / "spill"
+        spill_directory.mkdir()
+        allocators = [MemoryAllocator() for _ in range(20000)]
+
+        def allocating_function():
+            for size, allocator in enumerate(allocators, 1):
+                allocator.valloc(size % 512 + 1)
+            for allocator in allocators[::2]:
+                allocator.free()
+            peak = MemoryAllocator()
+            peak.valloc(1024 * 1024)
+            peak.free()
+            for allocator in allocators[1::4]:
+                allocator.free()
+
+        # WHEN
+        with Tracker(output):
+            allocating_function()
+
+        # THEN
+        def results(**kwargs):
+            reader = FileReader(output, **kwargs)
+
+            def snapshot(records):
+                return sorted(
+                    (r.tid, r.size, r.allocator, r.n_allocations, r.stack_trace())
+                    for r in records
+                )
+
+            return (
+                reader.metadata.peak_memory,
+                snapshot(reader.get_high_watermark_allocation_records()),
+                snapshot(reader.get_leaked_allocation_records()),
+            )
+
+        spilled = results(memory_budget=64 * 1024, spill_directory=spill_directory)
+        assert spilled == results()
+        assert not list(spill_directory.iterdir())
+
+
+class TestFilteredReads:
+    @pytest.mark.parametrize("streaming", [False, True])
+    def test_only_the_allocations_of_the_threads_are_kept(self, tmp_path, streaming):
+        # GIVEN
+        main_allocator = MemoryAllocator()
+        thread_allocator = MemoryAllocator()
+        output = tmp_path / "test.bin"
+
+        def thread_body():
+            thread_allocator.valloc(2222)
+            main_allocator.free()
+
+        # WHEN
+        with Tracker(output):
+            main_allocator.valloc(1111)
+            thread = threading.Thread(target=thread_body)
+            thread.start()
+            thread.join()
+
+        # THEN
+        (main_record,) = [
+            record
+            for record in FileReader(output).get_allocation_records()
+            if record.size == 1111
+        ]
+        reader = FileReader(output, streaming=streaming, threads=[main_record.tid])
+        records = list(filter_relevant_allocations(reader.get_allocation_records()))
+        # The allocation of the main thread is still freed by the other one.
+        assert [record.allocator for record in records] == [
+            AllocatorType.VALLOC,
+            AllocatorType.FREE,
+        ]
+        assert records[0].size == 1111
+        assert not [
+            record
+            for record in reader.get_leaked_allocation_records()
+            if record.allocator == AllocatorType.VALLOC
+        ]
+
+    @pytest.mark.parametrize("streaming", [False, True])
+    def test_only_the_allocations_of_the_time_range_are_kept(self, tmp_path, streaming):
+        # GIVEN
+        old = MemoryAllocator()
+        young = MemoryAllocator()
+        output = tmp_path / "test.bin"
+
+        # WHEN
+        with Tracker(output, memory_interval_ms=10):
+            old.valloc(1234)
+            time.sleep(0.2)
+            middle = datetime.datetime.now()
+            time.sleep(0.2)
+            young.valloc(4321)
+
+        # THEN
+        def sizes(**kwargs):
+            reader = FileReader(output, streaming=streaming, **kwargs)
+            return [
+                record.size
+                for record in reader.get_leaked_allocation_records()
+                if record.allocator == AllocatorType.VALLOC
+            ]
+
+        assert sorted(sizes()) == [1234, 4321]
+        assert sizes(start_time=middle) == [4321]
+        assert sizes(end_time=middle) == [1234]
+
+    def test_aggregated_captures_cannot_be_filtered(self, tmp_path):
+        # GIVEN
+        output = tmp_path / "test.bin"
+        with Tracker(output, file_format=FileFormat.AGGREGATED_ALLOCATIONS):
+            MemoryAllocator().valloc(1234)
+
+        # WHEN/THEN
+        with pytest.raises(NotImplementedError, match="filtered"):
+            FileReader(output, threads=[1])
+
+
+class TestLeakAges:
+    @pytest.mark.parametrize("streaming", [False, True])
+    def test_old_and_young_leaks_fall_in_different_ages(self, tmp_path, streaming):
+        # GIVEN
+        old = MemoryAllocator()
+        young = MemoryAllocator()
+        output = tmp_path / "test.bin"
+
+        def allocate_old():
+            old.valloc(1234)
+
+        def allocate_young():
+            young.valloc(4321)
+
+        # WHEN
+        with Tracker(output, memory_interval_ms=10):
+            allocate_old()
+            time.sleep(0.3)
+            allocate_young()
+
+        # THEN
+        reader = FileReader(output, streaming=streaming)
+        ages = {
+            record.stack_trace()[0][0]: buckets
+            for record, buckets in reader.get_leaked_allocation_ages()
+            if record.allocator == AllocatorType.VALLOC
+        }
+        (old_age,) = ages["allocate_old"]
+        (young_age,) = ages["allocate_young"]
+        assert old_age[2:] == (1, 1234)
+        assert young_age[2:] == (1, 4321)
+        # The old allocation was alive for at least the 300ms of the sleep.
+        assert old_age[1] > 256
+        assert old_age[0] > young_age[0]
+
+    def test_ages_add_up_to_the_leaked_allocations(self, tmp_path):
+        # GIVEN
+        allocator = MemoryAllocator()
+        output = tmp_path / "test.bin"
+
+        def allocating_function():
+            for _ in range(5):
+                allocator.valloc(1024)
+                time.sleep(0.02)
+
+        # WHEN
+        with Tracker(output, memory_interval_ms=10):
+            allocating_function()
+
+        # THEN
+        reader = FileReader(output)
+        leaks = {
+            (record.stack_id, record.size, record.n_allocations)
+            for record in reader.get_leaked_allocation_records()
+        }
+        ages = reader.get_leaked_allocation_ages()
+        assert {
+            (record.stack_id, record.size, record.n_allocations) for record, _ in ages
+        } == leaks
+        for record, buckets in ages:
+            assert sum(size for *_, size in buckets) == record.size
+            assert sum(count for _, _, count, _ in buckets) == record.n_allocations
+            assert all(min_age < max_age for min_age, max_age, *_ in buckets)
+
+    def test_aggregated_files_are_not_supported(self, tmp_path):
+        # GIVEN
+        output = tmp_path / "test.bin"
+        with Tracker(output, file_format=FileFormat.AGGREGATED_ALLOCATIONS):
+            MemoryAllocator().valloc(1234)
+
+        # WHEN/THEN
+        with pytest.raises(NotImplementedError):
+            FileReader(output).get_leaked_allocation_ages()
+
+
+class TestSnapshotsAt:
+    @pytest.mark.parametrize("streaming", [False, True])
+    def test_snapshot_after_each_allocation(self, tmp_path, streaming):
+        # GIVEN
+        allocators = [MemoryAllocator() for _ in range(3)]
+        output = tmp_path / "test.bin"
+
+        # WHEN
+        with Tracker(output):
+            for allocator in allocators:
+                allocator.valloc(1234)
+            for allocator in allocators:
+                allocator.free()
+
+        # THEN
+        reader = FileReader(output, streaming=streaming)
+        events = list(filter_relevant_allocations(reader.get_allocation_records()))
+        records = list(reader.get_allocation_records())
+        indexes = [records.index(event) for event in events]
+
+        def valloc_bytes(index):
+            return sum(
+                record.size
+                for record in reader.get_snapshot_at(index)
+                if record.allocator == AllocatorType.VALLOC
+            )
+
+        assert valloc_bytes(indexes[0] - 1) == 0
+        assert [valloc_bytes(index) for index in indexes] == [
+            1234,
+            2468,
+            3702,
+            2468,
+            1234,
+            0,
+        ]
+
+    def test_snapshot_at_a_time(self, tmp_path):
+        # GIVEN
+        first = MemoryAllocator()
+        second = MemoryAllocator()
+        output = tmp_path / "test.bin"
+
+        # WHEN
+        before = datetime.datetime.now() - datetime.timedelta(seconds=1)
+        with Tracker(output, memory_interval_ms=10):
+            first.valloc(1234)
+            time.sleep(0.1)
+            between = datetime.datetime.now()
+            time.sleep(0.1)
+            second.valloc(4321)
+            time.sleep(0.1)
+        after = datetime.datetime.now()
+
+        # THEN
+        reader = FileReader(output)
+
+        def valloc_sizes(when):
+            return [
+                record.size
+                for record in reader.get_snapshot_at(when)
+                if record.allocator == AllocatorType.VALLOC
+            ]
+
+        assert valloc_sizes(before) == []
+        assert valloc_sizes(between) == [1234]
+        assert sorted(valloc_sizes(after)) == [1234, 4321]
+
+    def test_snapshot_index_must_not_be_negative(self, tmp_path):
+        # GIVEN
+        output = tmp_path / "test.bin"
+        with Tracker(output):
+            pass
+
+        # WHEN / THEN
+        with pytest.raises(IndexError, match="out of range"):
+            FileReader(output).get_snapshot_at(-1)
+
+
+class TestMemoryTimeline:
+    @pytest.mark.parametrize("streaming", [False, True])
+    def test_timeline_points_have_the_peaks_of_the_heap(self, tmp_path, streaming):
+        # GIVEN
+        allocator = MemoryAllocator()
+        output = tmp_path / "test.bin"
+        size = 64 * 1024 * 1024
+
+        # WHEN
+        with Tracker(output, memory_interval_ms=10):
+            time.sleep(0.1)
+            allocator.valloc(size)
+            allocator.free()
+            time.sleep(0.1)
+
+        # THEN
+        reader = FileReader(output, streaming=streaming)
+        memory_records = list(reader.get_memory_records())
+        points = reader.get_memory_timeline(n_points=1000)
+        assert 0 < len(points) <= 1000
+        assert sum(point.n_memory_records for point in points) == len(memory_records)
+        assert points[0].start_time == memory_records[0].time
+        assert points[-1].end_time == memory_records[-1].time
+        assert min(point.min_rss for point in points) == min(
+            record.rss for record in memory_records
+        )
+        assert max(point.max_rss for point in points) == max(
+            record.rss for record in memory_records
+        )
+
+        peak = max(points, key=lambda point: point.max_heap)
+        assert peak.max_heap >= size
+        assert points[-1].min_heap < size
+        assert size in {
+            record.size
+            for record in reader.get_snapshot_at(peak.peak_index)
+            if record.allocator == AllocatorType.VALLOC
+        }
+
+    def test_timeline_is_downsampled(self, tmp_path):
+        # GIVEN
+        output = tmp_path / "test.bin"
+        with Tracker(output, memory_interval_ms=10):
+            time.sleep(0.2)
+
+        # WHEN
+        reader = FileReader(output)
+        memory_records = list(reader.get_memory_records())
+        points = reader.get_memory_timeline(n_points=2)
+
+        # THEN
+        assert len(memory_records) > 2
+        assert len(points) == 2
+        assert points[0].end_time < points[1].start_time
+        assert sum(point.n_memory_records for point in points) == len(memory_records)
+
+    def test_aggregated_files_are_not_supported(self, tmp_path):
+        # GIVEN
+        output = tmp_path / "test.bin"
+        with Tracker(output, file_format=FileFormat.AGGREGATED_ALLOCATIONS):
+            MemoryAllocator().valloc(1234)
+
+        # WHEN/THEN
+        with pytest.raises(NotImplementedError):
+            FileReader(output).get_memory_timeline()
+
+
+class TestAllocationColumns:
+    @pytest.mark.parametrize("streaming", [False, True])
+    def test_columns_have_the_allocation_records(self, tmp_path, streaming):
+        # GIVEN
+        allocator = MemoryAllocator()
+        output = tmp_path / "test.bin"
+        with Tracker(output):
+            allocator.valloc(1234)
+            allocator.free()
+            allocator.realloc(4321)
+            allocator.free()
+
+        # WHEN
+        reader = FileReader(output, streaming=streaming)
+        columns = reader.get_allocation_columns()
+
+        # THEN
+        events = []
+        for i in range(len(columns)):
+            tid = columns.tid[i]
+            if columns.realloc_old_address[i]:
+                old_address = columns.realloc_old_address[i]
+                events.append((tid, old_address, 0, AllocatorType.FREE))
+            address, size, allocator_type = (
+                columns.address[i],
+                columns.size[i],
+                columns.allocator[i],
+            )
+            events.append((tid, address, size, allocator_type))
+        assert events == [
+            (record.tid, record.address, record.size, record.allocator)
+            for record in reader.get_allocation_records()
+        ]
+        assert AllocatorType.REALLOC in columns.allocator.tolist()
+
+    def test_columns_are_typed_read_only_arrays(self, tmp_path):
+        # GIVEN
+        allocator = MemoryAllocator()
+        output = tmp_path / "test.bin"
+        with Tracker(output):
+            allocator.valloc(1234)
+            allocator.free()
+
+        # WHEN
+        columns = FileReader(output).get_allocation_columns()
+
+        # THEN
+        for column in (columns.address, columns.size, columns.stack_id):
+            assert column.readonly
+            assert column.ndim == 1
+            assert column.format in "BHIQ"
+            assert len(column) == len(columns)
+        assert columns.allocator.format == "i"
+        with pytest.raises(TypeError):
+            columns.size[0] = 0
+
+    def test_records_of_the_rows_have_their_stacks(self, tmp_path):
+        # GIVEN
+        allocator = MemoryAllocator()
+        output = tmp_path / "test.bin"
+        with Tracker(output):
+            allocator.valloc(1234)
+            allocator.free()
+
+        # WHEN
+        columns = FileReader(output).get_allocation_columns()
+        (index,) = [i for i, size in enumerate(columns.size) if size == 1234]
+        record = columns.record(index)
+
+        # THEN
+        assert record.size == 1234
+        assert record.allocator == AllocatorType.VALLOC
+        assert record.stack_id == columns.stack_id[index]
+        assert record.stack_trace()
+        assert columns.record(index - len(columns)) == record
+        with pytest.raises(IndexError):
+            columns.record(len(columns))
+
+    def test_aggregated_files_are_not_supported(self, tmp_path):
+        # GIVEN
+        output = tmp_path / "test.bin"
+        with Tracker(output, file_format=FileFormat.AGGREGATED_ALLOCATIONS):
+            MemoryAllocator().valloc(1234)
+
+        # WHEN/THEN
+        with pytest.raises(NotImplementedError):
+            FileReader(output).get_allocation_columns()
+
+
+class TestAllocationStats:
+    @staticmethod
+    def summary(stats):
+        return (
+            stats.total_memory_allocated,
+            stats.total_num_allocations,
+            {
+                allocator.name: n
+                for allocator, n in stats.allocator_type_counts.items()
+            },
+            list(format_top_allocations_by_size(stats.largest_by_size())),
+            list(format_top_allocations_by_count(stats.largest_by_count())),
+            stats.size_histogram(10),
+            (stats.min_size, stats.max_size),
+        )
+
+    @staticmethod
+    def expected_summary(records, num_largest):
+        records = list(records)
+        data = get_stats_data(records)
+        sizes = data.allocation_size_array
+        return (
+            data.total_memory_allocated,
+            data.total_num_allocations,
+            dict(data.allocation_type_counter),
+            list(get_top_allocations_by_size(records, num_largest)),
+            list(get_top_allocations_by_count(records, num_largest)),
+            get_histogram_databins(sizes, 10),
+            (min(sizes), max(sizes)),
+        )
+
+    @pytest.mark.parametrize("streaming", [False, True])
+    @pytest.mark.parametrize("include_all_allocations", [False, True])
+    def test_same_stats_as_the_records_give(
+        self, tmp_path, streaming, include_all_allocations
+    ):
+        # GIVEN
+        output = tmp_path / "test.bin"
+        allocators = [MemoryAllocator() for _ in range(20)]
+
+        def allocate_many():
+            for size, allocator in enumerate(allocators, 1):
+                allocator.malloc(size * 100)
+            for allocator in allocators[::2]:
+                allocator.free()
+
+        def allocate_few():
+            mmap.mmap(-1, mmap.PAGESIZE * 3).close()
+            for size, allocator in enumerate(allocators[::2], 1):
+                allocator.calloc(size * 1000)
+
+        # WHEN
+        with Tracker(output):
+            allocate_many()
+            allocate_few()
+
+        # THEN
+        reader = FileReader(output, streaming=streaming)
+        stats = reader.get_allocation_stats(
+            3, include_all_allocations=include_all_allocations
+        )
+        if include_all_allocations:
+            records = FileReader(output).get_allocation_records()
+        else:
+            records = FileReader(output).get_high_watermark_allocation_records(
+                merge_threads=True
+            )
+        assert self.summary(stats) == self.expected_summary(records, 3)
+
+    def test_aggregated_capture_files(self, tmp_path):
+        # GIVEN
+        output = tmp_path / "test.bin"
+        allocators = [MemoryAllocator() for _ in range(10)]
+
+        # WHEN
+        with Tracker(output, file_format=FileFormat.AGGREGATED_ALLOCATIONS):
+            for size, allocator in enumerate(allocators, 1):
+                allocator.valloc(size * 1234)
+            for allocator in allocators[1::2]:
+                allocator.free()
+
+        # THEN
+        reader = FileReader(output)
+        stats = reader.get_allocation_stats(5)
+        records = reader.get_high_watermark_allocation_records(merge_threads=True)
+        assert self.summary(stats) == self.expected_summary(records, 5)
+        with pytest.raises(NotImplementedError):
+            reader.get_allocation_stats(5, include_all_allocations=True)
+
+    def test_size_percentiles(self, tmp_path):
+        # GIVEN
+        output = tmp_path / "test.bin"
+        allocator = MemoryAllocator()
+
+        # WHEN
+        with Tracker(output):
+            for size in range(1, 101):
+                allocator.valloc(size * 1024)
+                allocator.free()
+
+        # THEN
+        stats = FileReader(output).get_allocation_stats(1, include_all_allocations=True)
+        valloc_sizes = sorted(
+            record.size
+            for record in FileReader(output).get_allocation_records()
+            if record.size
+        )
+        assert stats.num_sized_allocations == len(valloc_sizes)
+        assert stats.size_percentile(0) == valloc_sizes[0]
+        assert stats.size_percentile(100) == valloc_sizes[-1]
+        rank = math.ceil(len(valloc_sizes) / 2)
+        assert stats.size_percentile(50) == valloc_sizes[rank - 1]
+        with pytest.raises(ValueError):
+            stats.size_percentile(101)
+
+
+class TestCaptureDiff:
+    @staticmethod
+    def track(output, sizes, *, free):
+        allocators = [MemoryAllocator() for _ in sizes]
+
+        def allocate(allocator, size):
+            allocator.valloc(size)
+
+        def allocate_elsewhere(allocator, size):
+            allocator.valloc(size)
+
+        with Tracker(output):
+            for allocator, (function, size) in zip(allocators, sizes):
+                if function == "allocate":
+                    allocate(allocator, size)
+                else:
+                    allocate_elsewhere(allocator, size)
+            if free:
+                for allocator in allocators:
+                    allocator.free()
+
+    @staticmethod
+    def valloc_deltas(diff, *, leaks):
+        return {
+            delta.stack[1][0]: (
+                delta.size_before,
+                delta.size_after,
+                delta.n_allocations_delta,
+            )
+            for delta in diff.get_stack_deltas(leaks=leaks)
+            if delta.stack and delta.stack[0][0] == "valloc"
+        }
+
+    @pytest.mark.parametrize("leaks", [False, True])
+    def test_stacks_are_matched_by_their_frames(self, tmp_path, leaks):
+        # GIVEN
+        before = tmp_path / "before.bin"
+        after = tmp_path / "after.bin"
+        self.track(before, [("allocate", 1024), ("allocate", 1024)], free=not leaks)
+        self.track(
+            after,
+            [("allocate", 1024), ("allocate", 4096), ("allocate_elsewhere", 512)],
+            free=not leaks,
+        )
+
+        # WHEN
+        diff = CaptureDiff(before, after, max_workers=2)
+
+        # THEN
+        assert self.valloc_deltas(diff, leaks=leaks) == {
+            "allocate": (2048, 5120, 0),
+            "allocate_elsewhere": (0, 512, 1),
+        }
+        assert diff.before.file_name == str(before)
+        assert diff.after.file_name == str(after)
+
+    def test_unchanged_stacks_are_left_out(self, tmp_path):
+        # GIVEN
+        before = tmp_path / "before.bin"
+        after = tmp_path / "after.bin"
+        self.track(before, [("allocate", 1024)], free=False)
+        self.track(after, [("allocate", 1024)], free=False)
+
+        # WHEN
+        diff = CaptureDiff(before, after)
+
+        # THEN
+        assert self.valloc_deltas(diff, leaks=True) == {}
+
+    def test_deltas_are_ordered_by_the_size_of_the_change(self, tmp_path):
+        # GIVEN
+        before = tmp_path / "before.bin"
+        after = tmp_path / "after.bin"
+        self.track(before, [("allocate", 8192)], free=False)
+        self.track(after, [("allocate_elsewhere", 1024)], free=False)
+
+        # WHEN
+        deltas = [
+            delta
+            for delta in CaptureDiff(before, after).get_stack_deltas(leaks=True)
+            if delta.stack and delta.stack[0][0] == "valloc"
+        ]
+
+        # THEN
+        assert [delta.size_delta for delta in deltas] == [-8192, 1024]
+
+
+class TestExportProfile:
+    @pytest.mark.parametrize("leaks", [False, True])
+    def test_collapsed_stacks(self, tmp_path, leaks):
+        # GIVEN
+        output = tmp_path / "test.bin"
+        allocator = MemoryAllocator()
+
+        def allocate():
+            allocator.valloc(1234)
+
+        with Tracker(output):
+            allocate()
+            if not leaks:
+                allocator.free()
+
+        # WHEN
+        profile = export_profile(output, "collapsed", leaks=leaks).decode()
+
+        # THEN
+        stacks = dict(line.rsplit(" ", 1) for line in profile.splitlines())
+        (valloc_stack,) = [stack for stack in stacks if "valloc (" in stack]
+        assert stacks[valloc_stack] == "1234"
+        *_, caller, innermost = valloc_stack.split(";")
+        assert caller.startswith("allocate (")
+        assert innermost.startswith("valloc (")
+
+    def test_pprof_profile(self, tmp_path):
+        # GIVEN
+        output = tmp_path / "test.bin"
+        allocator = MemoryAllocator()
+        with Tracker(output):
+            allocator.valloc(1234)
+
+        # WHEN
+        profile = export_profile(output, "pprof")
+
+        # THEN
+        for string in (b"inuse_objects", b"inuse_space", b"valloc"):
+            assert string in profile
+
+    def test_unknown_format(self, tmp_path):
+        # GIVEN
+        output = tmp_path / "test.bin"
+        with Tracker(output):
+            pass
+
+        # WHEN / THEN
+        with pytest.raises(ValueError, match="Unknown profile format"):
+            export_profile(output, "json")
+
+
+class TestResolveStackTraces:
+    def test_resolves_each_stack_once(self, tmp_path):
+        # GIVEN
+        allocator = MemoryAllocator()
+        output = tmp_path / "test.bin"
+
+        def alloc():
+            allocator.valloc(1024)
+            allocator.free()
+
+        with Tracker(output):
+            for _ in range(3):
+                alloc()
+            alloc()
+
+        records = list(
+            filter_relevant_allocations(FileReader(output).get_allocation_records())
+        )
+        expected = [
+            record.stack_trace()
+            for record in filter_relevant_allocations(
+                FileReader(output).get_allocation_records()
+            )
+        ]
+
+        # WHEN
+        table = resolve_stack_traces(records + [None])
+
+        # THEN
+        assert len(records) == 8
+        assert len(table.stacks) == 4
+        assert len(table.frames) == len(set(table.frames))
+        assert table.record_stacks[-1] is None
+        for record, stack, expected_trace in zip(
+            records, table.record_stacks, expected
+        ):
+            trace = [table.frames[frame] for frame in table.stacks[stack]]
+            assert trace == expected_trace
+            assert record.stack_trace() == expected_trace
+
+
+@pytest.mark.skipif(
+    sys.version_info >= (3, 11), reason="needs the frames of the thread state"
+)
+class TestFrameLineUpdates:
+    @staticmethod
+    def allocate_on_alternating_lines(output, **kwargs):
+        allocator = MemoryAllocator()
+
+        def allocating_function():
+            for _ in range(100):
+                allocator.valloc(1234)
+                allocator.free()
+                allocator.valloc(2345)
+                allocator.free()
+
+        with Tracker(output, **kwargs):
+            allocating_function()
+
+        first_line = allocating_function.__code__.co_firstlineno
+        return first_line, [
+            (record.size, record.stack_trace()[0][2])
+            for record in filter_relevant_allocations(
+                FileReader(output).get_allocation_records()
+            )
+        ]
+
+    @pytest.mark.parametrize(
+        "lazy_python_stacks",
+        [
+            False,
+            pytest.param(
+                True,
+                marks=pytest.mark.skipif(
+                    sys.version_info >= (3, 11),
+                    reason="lazy Python stacks need Python < 3.11",
+                ),
+            ),
+        ],
+    )
+    def test_allocations_have_the_lines_they_were_made_on(
+        self, tmp_path, lazy_python_stacks
+    ):
+        # WHEN
+        first_line, allocations = self.allocate_on_alternating_lines(
+            tmp_path / "test.bin", lazy_python_stacks=lazy_python_stacks
+        )
+
+        # THEN
+        assert allocations == [(1234, first_line + 2), (2345, first_line + 4)] * 100
+
+    def test_the_frame_is_not_popped_when_its_line_changes(self, tmp_path, capfd):
+        # GIVEN
+        output = tmp_path / "test.bin"
+        self.allocate_on_alternating_lines(output)
+
+        # WHEN
+        dump_all_records(output)
+
+        # THEN
+        record_types = [
+            record.partition(" ")[0] for record in capfd.readouterr().out.splitlines()
+        ]
+        assert record_types.count("FRAME_LINE_UPDATE") >= 199
+        assert record_types.count("FRAME_POP") < 10
+
+
+class TestStackLimits:
+    @staticmethod
+    def allocate_at_every_depth(output, max_depth, **kwargs):
+        allocator = MemoryAllocator()
+
+        def recurse(depth):
+            if depth < max_depth:
+                recurse(depth + 1)
+            allocator.valloc(1000 + depth)
+            allocator.free()
+
+        with Tracker(output, **kwargs):
+            recurse(0)
+
+        return [
+            (record.size, record.stack_trace())
+            for record in filter_relevant_allocations(
+                FileReader(output).get_allocation_records()
+            )
+        ]
+
+    def test_python_stacks_keep_their_innermost_frames(self, tmp_path):
+        # WHEN
+        unlimited = self.allocate_at_every_depth(tmp_path / "unlimited.bin", 30)
+        limited = self.allocate_at_every_depth(
+            tmp_path / "limited.bin", 30, max_python_frames=10
+        )
+
+        # THEN
+        assert [size for size, _ in limited] == list(range(1030, 999, -1))
+        assert all(len(stack) > 10 for _, stack in unlimited)
+        assert limited == [(size, stack[:10]) for size, stack in unlimited]
+
+    def test_native_stacks_keep_their_innermost_frames(self, tmp_path):
+        # GIVEN
+        allocator = MemoryAllocator()
+
+        def native_stack(output, **kwargs):
+            with Tracker(output, native_traces=True, **kwargs):
+                allocator.valloc(1234)
+                allocator.free()
+
+            (record,) = filter_relevant_allocations(
+                FileReader(output).get_allocation_records()
+            )
+            return record.native_stack_trace()
+
+        # WHEN
+        unlimited = native_stack(tmp_path / "unlimited.bin")
+        limited = native_stack(tmp_path / "limited.bin", max_native_frames=5)
+
+        # THEN
+        # Inlined functions are reported as frames of their own, so there can
+        # be more frames than return addresses.
+        assert 0 < len(limited) < len(unlimited)
+        assert limited == unlimited[: len(limited)]
+
+    def test_frames_of_excluded_files_are_left_out(self, tmp_path):
+        # GIVEN
+        allocator = MemoryAllocator()
+        output = tmp_path / "test.bin"
+        helpers = {"allocator": allocator}
+        code = textwrap.dedent(
+            """\
+            def allocate():
+                allocator.valloc(1234)
+                allocator.free()
+
+            def call_allocate():
+                allocate()
+            """
+        )
+        exec(compile(code, "/some/library/helpers.py", "exec"), helpers)
+
+        def allocating_function():
+            helpers["call_allocate"]()
+
+        # WHEN
+        with Tracker(output, excluded_filenames=["*/library/*"]):
+            allocating_function()
+
+        # THEN
+        (record,) = filter_relevant_allocations(
+            FileReader(output).get_allocation_records()
+        )
+        stack = record.stack_trace()
+        assert stack[0][0] == "allocating_function"
+        assert all(filename != "/some/library/helpers.py" for _, filename, _ in stack)
+
+
+class TestRSSTriggers:
+    def test_nothing_is_recorded_until_the_trigger_is_crossed(self, tmp_path):
+        # GIVEN
+        allocator = MemoryAllocator()
+        output = tmp_path / "test.bin"
+
+        # WHEN
+        with Tracker(output, memory_interval_ms=10, trigger_rss=2**62):
+            allocator.valloc(1234)
+            allocator.free()
+            time.sleep(0.05)
+
+        # THEN
+        reader = FileReader(output)
+        assert list(filter_relevant_allocations(reader.get_allocation_records())) == []
+        assert list(reader.get_memory_records()) == []
+
+    def test_recording_starts_with_the_stacks_of_the_functions_already_running(
+        self, tmp_path
+    ):
+        # GIVEN
+        allocator = MemoryAllocator()
+        output = tmp_path / "test.bin"
+
+        def allocating_function():
+            # The RSS is already above the threshold, so the next check of the
+            # background thread activates the tracker.
+            time.sleep(0.1)
+            allocator.valloc(1234)
+            allocator.free()
+
+        # WHEN
+        with Tracker(output, memory_interval_ms=10, trigger_rss=1):
+            allocating_function()
+
+        # THEN
+        reader = FileReader(output)
+        (record,) = filter_relevant_allocations(reader.get_allocation_records())
+        functions = [function for function, _, _ in record.stack_trace()]
+        assert functions[:2] == [
+            "allocating_function",
+            "test_recording_starts_with_the_stacks_of_the_functions_already_running",
+        ]
+        assert list(reader.get_memory_records())
+
+    def test_the_growth_of_the_rss_triggers_recording(self, tmp_path):
+        # GIVEN
+        allocator = MemoryAllocator()
+        output = tmp_path / "test.bin"
+
+        # WHEN
+        with Tracker(output, memory_interval_ms=10, trigger_rss_growth=1):
+            # Let the background thread measure the RSS before it grows, and
+            # then give it more than a second to see that it did.
+            time.sleep(0.3)
+            data = bytearray(64 * 2**20)
+            time.sleep(1.5)
+            allocator.valloc(1234)
+            allocator.free()
+        del data
+
+        # THEN
+        allocations = filter_relevant_allocations(
+            FileReader(output).get_allocation_records()
+        )
+        assert [record.size for record in allocations] == [1234]
+
+
+class TestFlightRecorder:
+    def test_only_the_most_recent_records_are_kept(self, tmp_path):
+        # GIVEN
+        allocator = MemoryAllocator()
+        output = tmp_path / "test.bin"
+        destination = FlightRecorderDestination(output, capacity=2**20)
+
+        def old_allocations():
+            for _ in range(200_000):
+                allocator.valloc(1234)
+                allocator.free()
+
+        def recent_allocations():
+            allocator.valloc(4321)
+            allocator.free()
+
+        # WHEN
+        with Tracker(destination=destination):
+            old_allocations()
+            recent_allocations()
+
+        # THEN
+        assert output.stat().st_size < 2 * 2**20
+        allocations = [
+            record
+            for record in filter_relevant_allocations(
+                FileReader(output).get_allocation_records()
+            )
+            if record.allocator == AllocatorType.VALLOC
+        ]
+        old = [record for record in allocations if record.size == 1234]
+        assert 0 < len(old) < 200_000
+        for record in old:
+            assert record.stack_trace()[0][0] == "old_allocations"
+        recent = [record for record in allocations if record.size == 4321]
+        assert len(recent) == 1
+        assert recent[0].stack_trace()[0][0] == "recent_allocations"
+
+    def test_a_signal_dumps_the_records_while_tracking(self, tmp_path):
+        # GIVEN
+        allocator = MemoryAllocator()
+        output = tmp_path / "test.bin"
+        snapshot = tmp_path / "snapshot.bin"
+
+        # WHEN
+        with Tracker(
+            destination=FlightRecorderDestination(output), memory_interval_ms=10
+        ):
+            allocator.valloc(1234)
+            allocator.free()
+            os.kill(os.getpid(), signal.SIGUSR2)
+            time.sleep(0.5)
+            shutil.copyfile(output, snapshot)
+
+        # THEN
+        allocations = filter_relevant_allocations(
+            FileReader(snapshot).get_allocation_records()
+        )
+        assert [record.size for record in allocations] == [1234, 0]
+
+    def test_crossing_the_dump_rss_dumps_the_records(self, tmp_path):
+        # GIVEN
+        allocator = MemoryAllocator()
+        output = tmp_path / "test.bin"
+        snapshot = tmp_path / "snapshot.bin"
+        with open("/proc/self/statm") as statm:
+            rss = int(statm.read().split()[1]) * mmap.PAGESIZE
+        destination = FlightRecorderDestination(output, dump_rss=rss + 32 * 2**20)
+
+        # WHEN
+        with Tracker(destination=destination, memory_interval_ms=10):
+            allocator.valloc(1234)
+            allocator.free()
+            data = bytearray(64 * 2**20)
+            time.sleep(0.5)
+            shutil.copyfile(output, snapshot)
+        del data
+
+        # THEN
+        allocations = filter_relevant_allocations(
+            FileReader(snapshot).get_allocation_records()
+        )
+        assert [record.size for record in allocations] == [1234, 0]
+
+    def test_the_capacity_must_be_positive(self, tmp_path):
+        # GIVEN
+        destination = FlightRecorderDestination(tmp_path / "test.bin", capacity=0)
+
+        # WHEN/THEN
+        with pytest.raises(ValueError, match="capacity"):
+            Tracker(destination=destination)
+
+
+PYMALLOC_ALLOCATORS = [
+    ("malloc", AllocatorType.PYMALLOC_MALLOC),
+    ("calloc", AllocatorType.PYMALLOC_CALLOC),
+    ("realloc", AllocatorType.PYMALLOC_REALLOC),
+]
+
+
+class TestPythonAllocators:
+    @pytest.mark.parametrize("domain", ["mem", "object"])
+    @pytest.mark.parametrize(["allocator_func", "allocator_type"], PYMALLOC_ALLOCATORS)
+    def test_python_allocations_are_recorded(
+        self, domain, allocator_func, allocator_type, tmp_path
+    ):
+        # GIVEN
+        allocator = PymallocMemoryAllocator(domain)
+        output = tmp_path / "test.bin"
+
+        # WHEN
+        with Tracker(output, trace_python_allocators=True):
+            getattr(allocator, allocator_func)(123)
+            allocator.free()
+
+        # THEN
+        allocations = list(FileReader(output).get_allocation_records())
+        (alloc,) = [
+            event
+            for event in allocations
+            if event.size == 123 and event.allocator == allocator_type
+        ]
+        frees = [
+            event
+            for event in allocations
+            if event.address == alloc.address
+            and event.allocator == AllocatorType.PYMALLOC_FREE
+        ]
+        assert len(frees) >= 1
+
+    def test_python_reallocations_free_the_old_block(self, tmp_path):
+        # GIVEN
+        allocator = PymallocMemoryAllocator("mem")
+        output = tmp_path / "test.bin"
+
+        # WHEN
+        with Tracker(output, trace_python_allocators=True):
+            allocator.realloc(1234)
+            allocator.free()
+
+        # THEN
+        allocations = list(FileReader(output).get_allocation_records())
+        (realloc_index,) = [
+            i
+            for i, event in enumerate(allocations)
+            if event.size == 1234 and event.allocator == AllocatorType.PYMALLOC_REALLOC
+        ]
+        free = allocations[realloc_index - 1]
+        assert free.allocator == AllocatorType.PYMALLOC_FREE
+        assert any(
+            event.address == free.address
+            and event.size == 1
+            and event.allocator == AllocatorType.PYMALLOC_MALLOC
+            for event in allocations[:realloc_index]
+        )
+
+    def test_memory_behind_python_allocations_is_not_recorded_twice(self, tmp_path):
+        # GIVEN
+        allocator = PymallocMemoryAllocator("object")
+        output = tmp_path / "test.bin"
+        size = 1024 * 1024
+
+        # WHEN
+        with Tracker(output, trace_python_allocators=True):
+            allocator.malloc(size)
+            allocator.free()
+
+        # THEN
+        sizes = [
+            (record.allocator, record.size)
+            for record in FileReader(output).get_allocation_records()
+            if record.size == size
+        ]
+        assert sizes == [(AllocatorType.PYMALLOC_MALLOC, size)]
+
+    def test_python_allocators_are_not_traced_by_default(self, tmp_path):
+        # GIVEN
+        allocator = PymallocMemoryAllocator("mem")
+        output = tmp_path / "test.bin"
+
+        # WHEN
+        with Tracker(output):
+            allocator.malloc(123)
+            allocator.free()
+
+        # THEN
+        python_allocators = {
+            AllocatorType.PYMALLOC_MALLOC,
+            AllocatorType.PYMALLOC_CALLOC,
+            AllocatorType.PYMALLOC_REALLOC,
+            AllocatorType.PYMALLOC_FREE,
+        }
+        assert not any(
+            record.allocator in python_allocators
+            for record in FileReader(output).get_allocation_records()
+        )
+
+    def test_python_allocations_can_be_sampled(self, tmp_path):
+        # GIVEN
+        allocator = PymallocMemoryAllocator("object")
+        output = tmp_path / "test.bin"
+        n_allocations = 10_000
+        size = 256
+
+        # WHEN
+        with Tracker(output, trace_python_allocators=True, sample_rate=4 * size):
+            for _ in range(n_allocations):
+                allocator.malloc(size)
+                allocator.free()
+
+        # THEN
+        allocs = [
+            record
+            for record in FileReader(output).get_allocation_records()
+            if record.allocator == AllocatorType.PYMALLOC_MALLOC
+            and record.stack_trace()
+            and record.stack_trace()[0][0] == "malloc"
+        ]
+        assert 0 < len(allocs) < n_allocations
+        estimated_size = sum(record.size for record in allocs)
+        assert estimated_size == pytest.approx(n_allocations * size, rel=0.2)
+
+    def test_python_allocators_are_restored(self, tmp_path):
+        # GIVEN
+        allocator = PymallocMemoryAllocator("mem")
+        traced_output = tmp_path / "traced.bin"
+        output = tmp_path / "test.bin"
+
+        # WHEN
+        with Tracker(traced_output, trace_python_allocators=True):
+            pass
+        with Tracker(output):
+            allocator.malloc(123)
+            allocator.free()
+
+        # THEN
+        assert not any(
+            record.allocator == AllocatorType.PYMALLOC_MALLOC
+            for record in FileReader(output).get_allocation_records()
+        )
+
+
+class TestLazyPythonStacks:
+    @staticmethod
+    def allocate_in_nested_functions(output, **kwargs):
+        allocator = MemoryAllocator()
+
+        def inner(size):
+            allocator.valloc(size)
+            allocator.free()
+
+        def outer():
+            inner(1234)
+            inner(2345)
+            allocator.valloc(3456)
+            allocator.free()
+            for size in (4567, 5678):
+                inner(size)
+
+        with Tracker(output, **kwargs):
+            outer()
+
+        return [
+            (record.size, record.stack_trace()[:3])
+            for record in filter_relevant_allocations(
+                FileReader(output).get_allocation_records()
+            )
+        ]
+
+    def test_stacks_are_the_same_as_when_following_calls(self, tmp_path):
+        # WHEN
+        followed = self.allocate_in_nested_functions(tmp_path / "followed.bin")
+        walked = self.allocate_in_nested_functions(
+            tmp_path / "walked.bin", lazy_python_stacks=True
+        )
+
+        # THEN
+        assert [size for size, _ in walked] == [1234, 2345, 3456, 4567, 5678]
+        assert walked == followed
+
+    def test_the_profile_function_is_not_installed(self, tmp_path):
+        # GIVEN
+        profile_functions = []
+
+        # WHEN
+        with Tracker(tmp_path / "test.bin", lazy_python_stacks=True):
+            profile_functions.append(sys.getprofile())
+            profile_functions.append(threading._profile_hook)
+
+        # THEN
+        assert profile_functions == [None, None]
+
+    def test_stacks_of_other_threads(self, tmp_path):
+        # GIVEN
+        allocator = MemoryAllocator()
+        output = tmp_path / "test.bin"
+
+        def allocating_function():
+            allocator.valloc(1234)
+            allocator.free()
+
+        def thread_body():
+            allocating_function()
+
+        # WHEN
+        with Tracker(output, lazy_python_stacks=True):
+            thread = threading.Thread(target=thread_body)
+            thread.start()
+            thread.join()
+
+        # THEN
+        (record,) = filter_relevant_allocations(
+            FileReader(output).get_allocation_records()
+        )
+        functions = [function for function, _, _ in record.stack_trace()]
+        assert functions[:2] == ["allocating_function", "thread_body"]
+
+
+@pytest.mark.skipif(
+    sys.version_info < (3, 11), reason="the frames of the thread state can be walked"
+)
+def test_lazy_python_stacks_are_rejected_on_newer_pythons(tmp_path):
+    with pytest.raises(RuntimeError, match="lazy_python_stacks"):
+        Tracker(tmp_path / "test.bin", lazy_python_stacks=True)
+
+
+class TestNativeBenchmarks:
+    @pytest.mark.parametrize("threads", [1, 4])
+    def test_track_allocations(self, tmp_path, threads):
+        # GIVEN
+        output = tmp_path / "test.bin"
+
+        # WHEN
+        with Tracker(output):
+            benchmark_track_allocations(threads, 100)
+
+        # THEN
+        records = [
+            record
+            for record in FileReader(output).get_allocation_records()
+            if record.allocator == AllocatorType.MALLOC
+            # Every thread uses fake addresses starting at (thread + 1) << 40.
+            and 1 <= record.address >> 40 <= threads
+            and record.size == 64
+        ]
+        assert len(records) == threads * 100
+
+    def test_track_allocations_needs_a_tracker(self):
+        with pytest.raises(RuntimeError):
+            benchmark_track_allocations(1, 100)
+
+    @pytest.mark.parametrize("threads", [1, 4])
+    def test_write_allocation_records(self, tmp_path, threads):
+        # GIVEN
+        output = tmp_path / "test.bin"
+
+        # WHEN
+        assert benchmark_write_allocation_records(output, threads, 100) > 0
+
+        # THEN
+        records = list(FileReader(output).get_allocation_records())
+        assert len(records) == threads * 100
+        assert {record.tid for record in records} == set(range(1, threads + 1))
+
+    @pytest.mark.parametrize("use_cache", [False, True])
+    def test_look_up_traces(self, use_cache):
+        assert benchmark_look_up_traces(4, 1000, 100, 10, use_cache) > 0
+
+    @pytest.mark.parametrize("threads", [1, 4])
+    def test_live_throughput(self, threads):
+        # WHEN
+        result = benchmark_live_throughput(threads, 10_000)
+
+        # THEN
+        assert result["events_per_second"] > 0
+        assert result["max_lag_ns"] >= result["mean_lag_ns"] >= 0
+        assert result["sender_blocked_ns"] >= 0
+
+    def test_synthetic_capture(self, tmp_path):
+        # GIVEN
+        output = tmp_path / "test.bin"
+
+        # WHEN
+        write_synthetic_capture(output, 50_000, 16)
+
+        # THEN
+        assert benchmark_read_records(output) == 50_000
+        reader = FileReader(output)
+        records = list(reader.get_allocation_records())
+        assert len(records) == 50_000
+        assert {AllocatorType.MMAP, AllocatorType.MUNMAP} <= {
+            record.allocator for record in records
+        }
+        assert max(len(record.stack_trace()) for record in records) >= 16
+        assert len(list(reader.get_memory_records())) == 5
+
+        snapshots = SnapshotBenchmark(output)
+        assert snapshots.num_records == 50_000
+        assert snapshots.high_watermark() == reader.metadata.peak_memory
+        leaks = list(reader.get_leaked_allocation_records())
+        assert snapshots.snapshot_allocations(snapshots.num_records) == len(leaks)
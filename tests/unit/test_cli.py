@@ -6,12 +6,17 @@ from unittest.mock import patch
 import pytest
 
 from memray import FileDestination
+from memray import FileFormat
+from memray import FlightRecorderDestination
 from memray import SocketDestination
 from memray.commands import main
+from memray.commands.diff import DiffCommand
 from memray.commands.flamegraph import FlamegraphCommand
+from memray.commands.merge import MergeCommand
 from memray.commands.run import RunCommand
 from memray.commands.summary import SummaryCommand
 from memray.commands.table import TableCommand
+from memray.commands.transform import TransformCommand
 from memray.commands.tree import TreeCommand
 
 
@@ -64,6 +69,19 @@ class TestRunSubCommand:
             native_traces=True,
         )
 
+    def test_run_with_fast_unwind(
+        self, getpid_mock, runpy_mock, tracker_mock, validate_mock
+    ):
+        getpid_mock.return_value = 0
+        assert 0 == main(["run", "--fast-unwind", "-m", "foobar"])
+        runpy_mock.run_module.assert_called_with(
+            "foobar", run_name="__main__", alter_sys=True
+        )
+        tracker_mock.assert_called_with(
+            destination=FileDestination("memray-foobar.0.bin", exist_ok=False),
+            native_traces="fp",
+        )
+
     def test_run_override_output(
         self, getpid_mock, runpy_mock, tracker_mock, validate_mock
     ):
@@ -212,6 +230,320 @@ class TestRunSubCommand:
             follow_fork=True,
         )
 
+    def test_run_with_sample_bytes(
+        self,
+        getpid_mock,
+        runpy_mock,
+        tracker_mock,
+        validate_mock,
+    ):
+        getpid_mock.return_value = 0
+        assert 0 == main(["run", "--sample-bytes", "4096", "-m", "foobar"])
+        runpy_mock.run_module.assert_called_with(
+            "foobar", run_name="__main__", alter_sys=True
+        )
+        tracker_mock.assert_called_with(
+            destination=FileDestination("memray-foobar.0.bin", exist_ok=False),
+            native_traces=False,
+            sample_rate=4096,
+        )
+
+    def test_run_with_aggregate(
+        self,
+        getpid_mock,
+        runpy_mock,
+        tracker_mock,
+        validate_mock,
+    ):
+        getpid_mock.return_value = 0
+        assert 0 == main(["run", "--aggregate", "-m", "foobar"])
+        runpy_mock.run_module.assert_called_with(
+            "foobar", run_name="__main__", alter_sys=True
+        )
+        tracker_mock.assert_called_with(
+            destination=FileDestination("memray-foobar.0.bin", exist_ok=False),
+            native_traces=False,
+            file_format=FileFormat.AGGREGATED_ALLOCATIONS,
+        )
+
+    def test_run_with_count_allocations(
+        self,
+        getpid_mock,
+        runpy_mock,
+        tracker_mock,
+        validate_mock,
+    ):
+        getpid_mock.return_value = 0
+        assert 0 == main(["run", "--count-allocations", "-m", "foobar"])
+        runpy_mock.run_module.assert_called_with(
+            "foobar", run_name="__main__", alter_sys=True
+        )
+        tracker_mock.assert_called_with(
+            destination=FileDestination("memray-foobar.0.bin", exist_ok=False),
+            native_traces=False,
+            file_format=FileFormat.ALLOCATION_COUNTS,
+        )
+
+    def test_run_with_aggregate_and_live_mode(
+        self, getpid_mock, runpy_mock, tracker_mock, validate_mock, capsys
+    ):
+        with pytest.raises(SystemExit):
+            main(["run", "--live", "--aggregate", "./directory/foobar.py"])
+
+        captured = capsys.readouterr()
+        assert "--aggregate cannot be used with" in captured.err
+
+    def test_run_with_compress(
+        self,
+        getpid_mock,
+        runpy_mock,
+        tracker_mock,
+        validate_mock,
+    ):
+        getpid_mock.return_value = 0
+        assert 0 == main(["run", "--compress", "-m", "foobar"])
+        runpy_mock.run_module.assert_called_with(
+            "foobar", run_name="__main__", alter_sys=True
+        )
+        tracker_mock.assert_called_with(
+            destination=FileDestination("memray-foobar.0.bin", exist_ok=False),
+            native_traces=False,
+            compression="zstd",
+        )
+
+    def test_run_with_compress_and_live_mode(
+        self, getpid_mock, runpy_mock, tracker_mock, validate_mock, capsys
+    ):
+        with pytest.raises(SystemExit):
+            main(["run", "--live", "--compress", "./directory/foobar.py"])
+
+        captured = capsys.readouterr()
+        assert "--compress cannot be used with" in captured.err
+
+    def test_run_with_cancel_short_lived(
+        self,
+        getpid_mock,
+        runpy_mock,
+        tracker_mock,
+        validate_mock,
+    ):
+        getpid_mock.return_value = 0
+        assert 0 == main(["run", "--cancel-short-lived", "-m", "foobar"])
+        runpy_mock.run_module.assert_called_with(
+            "foobar", run_name="__main__", alter_sys=True
+        )
+        tracker_mock.assert_called_with(
+            destination=FileDestination("memray-foobar.0.bin", exist_ok=False),
+            native_traces=False,
+            cancel_short_lived_allocations=True,
+        )
+
+    def test_run_with_drop_when_behind(
+        self,
+        getpid_mock,
+        runpy_mock,
+        tracker_mock,
+        validate_mock,
+    ):
+        getpid_mock.return_value = 0
+        assert 0 == main(["run", "--drop-when-behind", "-m", "foobar"])
+        runpy_mock.run_module.assert_called_with(
+            "foobar", run_name="__main__", alter_sys=True
+        )
+        tracker_mock.assert_called_with(
+            destination=FileDestination("memray-foobar.0.bin", exist_ok=False),
+            native_traces=False,
+            backpressure="drop",
+        )
+
+    @pytest.mark.skipif(
+        sys.version_info >= (3, 11), reason="needs the frames of the thread state"
+    )
+    def test_run_with_lazy_python_stacks(
+        self,
+        getpid_mock,
+        runpy_mock,
+        tracker_mock,
+        validate_mock,
+    ):
+        getpid_mock.return_value = 0
+        assert 0 == main(["run", "--lazy-python-stacks", "-m", "foobar"])
+        runpy_mock.run_module.assert_called_with(
+            "foobar", run_name="__main__", alter_sys=True
+        )
+        tracker_mock.assert_called_with(
+            destination=FileDestination("memray-foobar.0.bin", exist_ok=False),
+            native_traces=False,
+            lazy_python_stacks=True,
+        )
+
+    def test_run_with_stack_limits_and_exclusions(
+        self,
+        getpid_mock,
+        runpy_mock,
+        tracker_mock,
+        validate_mock,
+    ):
+        getpid_mock.return_value = 0
+        assert 0 == main(
+            [
+                "run",
+                "--max-python-frames",
+                "64",
+                "--max-native-frames",
+                "32",
+                "--exclude",
+                "*/site-packages/*",
+                "--exclude",
+                "*/lib/python3*",
+                "-m",
+                "foobar",
+            ]
+        )
+        runpy_mock.run_module.assert_called_with(
+            "foobar", run_name="__main__", alter_sys=True
+        )
+        tracker_mock.assert_called_with(
+            destination=FileDestination("memray-foobar.0.bin", exist_ok=False),
+            native_traces=False,
+            max_python_frames=64,
+            max_native_frames=32,
+            excluded_filenames=["*/site-packages/*", "*/lib/python3*"],
+        )
+
+    def test_run_with_negative_max_frames(
+        self, getpid_mock, runpy_mock, tracker_mock, validate_mock, capsys
+    ):
+        with pytest.raises(SystemExit):
+            main(["run", "--max-python-frames", "-1", "./directory/foobar.py"])
+
+        captured = capsys.readouterr()
+        assert "--max-native-frames arguments must not be negative" in captured.err
+
+    def test_run_with_rss_triggers(
+        self,
+        getpid_mock,
+        runpy_mock,
+        tracker_mock,
+        validate_mock,
+    ):
+        getpid_mock.return_value = 0
+        assert 0 == main(
+            [
+                "run",
+                "--trigger-rss",
+                "1000000",
+                "--trigger-rss-growth",
+                "2000",
+                "-m",
+                "foobar",
+            ]
+        )
+        runpy_mock.run_module.assert_called_with(
+            "foobar", run_name="__main__", alter_sys=True
+        )
+        tracker_mock.assert_called_with(
+            destination=FileDestination("memray-foobar.0.bin", exist_ok=False),
+            native_traces=False,
+            trigger_rss=1000000,
+            trigger_rss_growth=2000,
+        )
+
+    def test_run_with_negative_rss_trigger(
+        self, getpid_mock, runpy_mock, tracker_mock, validate_mock, capsys
+    ):
+        with pytest.raises(SystemExit):
+            main(["run", "--trigger-rss", "-1", "./directory/foobar.py"])
+
+        captured = capsys.readouterr()
+        assert "--trigger-rss-growth arguments must not be negative" in captured.err
+
+    def test_run_with_flight_recorder(
+        self,
+        getpid_mock,
+        runpy_mock,
+        tracker_mock,
+        validate_mock,
+    ):
+        getpid_mock.return_value = 0
+        assert 0 == main(
+            [
+                "run",
+                "--flight-recorder",
+                "1000000",
+                "--dump-rss",
+                "2000000",
+                "-m",
+                "foobar",
+            ]
+        )
+        runpy_mock.run_module.assert_called_with(
+            "foobar", run_name="__main__", alter_sys=True
+        )
+        tracker_mock.assert_called_with(
+            destination=FlightRecorderDestination(
+                "memray-foobar.0.bin",
+                capacity=1000000,
+                exist_ok=False,
+                dump_rss=2000000,
+            ),
+            native_traces=False,
+        )
+
+    def test_run_with_dump_rss_without_flight_recorder(
+        self, getpid_mock, runpy_mock, tracker_mock, validate_mock, capsys
+    ):
+        with pytest.raises(SystemExit):
+            main(["run", "--dump-rss", "1000", "./directory/foobar.py"])
+
+        captured = capsys.readouterr()
+        assert "The --dump-rss argument requires --flight-recorder" in captured.err
+
+    def test_run_with_memory_gauges(
+        self,
+        getpid_mock,
+        runpy_mock,
+        tracker_mock,
+        validate_mock,
+    ):
+        getpid_mock.return_value = 0
+        assert 0 == main(["run", "--memory-gauges", "-m", "foobar"])
+        runpy_mock.run_module.assert_called_with(
+            "foobar", run_name="__main__", alter_sys=True
+        )
+        tracker_mock.assert_called_with(
+            destination=FileDestination("memray-foobar.0.bin", exist_ok=False),
+            native_traces=False,
+            memory_gauges=True,
+        )
+
+    def test_run_with_trace_python_allocators(
+        self,
+        getpid_mock,
+        runpy_mock,
+        tracker_mock,
+        validate_mock,
+    ):
+        getpid_mock.return_value = 0
+        assert 0 == main(["run", "--trace-python-allocators", "-m", "foobar"])
+        runpy_mock.run_module.assert_called_with(
+            "foobar", run_name="__main__", alter_sys=True
+        )
+        tracker_mock.assert_called_with(
+            destination=FileDestination("memray-foobar.0.bin", exist_ok=False),
+            native_traces=False,
+            trace_python_allocators=True,
+        )
+
+    def test_run_with_negative_sample_bytes(
+        self, getpid_mock, runpy_mock, tracker_mock, validate_mock, capsys
+    ):
+        with pytest.raises(SystemExit):
+            main(["run", "--sample-bytes", "-1", "./directory/foobar.py"])
+
+        captured = capsys.readouterr()
+        assert "--sample-bytes argument must not be negative" in captured.err
+
     def test_run_with_follow_fork_and_live_mode(
         self, getpid_mock, runpy_mock, tracker_mock, validate_mock, capsys
     ):
@@ -638,3 +970,173 @@ class TestSummarySubCommand:
         assert namespace.results == "results.txt"
         assert namespace.sort_column == 1
         assert namespace.max_rows == 2
+
+
+class TestMergeSubCommand:
+    @staticmethod
+    def get_prepared_parser():
+        parser = argparse.ArgumentParser()
+        command = MergeCommand()
+        command.prepare_parser(parser)
+
+        return command, parser
+
+    def test_parser_rejects_no_arguments(self):
+        # GIVEN
+        _, parser = self.get_prepared_parser()
+
+        # WHEN / THEN
+        with pytest.raises(SystemExit):
+            parser.parse_args([])
+
+    def test_parser_accepts_single_argument(self):
+        # GIVEN
+        _, parser = self.get_prepared_parser()
+
+        # WHEN
+        namespace = parser.parse_args(["results.txt"])
+
+        # THEN
+        assert namespace.results == "results.txt"
+        assert namespace.show_memory_leaks is False
+        assert namespace.sort_column == 1
+        assert namespace.max_rows is None
+        assert namespace.max_workers is None
+
+    def test_parser_takes_memory_leaks_as_a_flag(self):
+        # GIVEN
+        _, parser = self.get_prepared_parser()
+
+        # WHEN
+        namespace = parser.parse_args(["results.txt", "--leaks"])
+
+        # THEN
+        assert namespace.show_memory_leaks is True
+
+    def test_parser_accepts_max_workers(self):
+        # GIVEN
+        _, parser = self.get_prepared_parser()
+
+        # WHEN
+        namespace = parser.parse_args(["results.txt", "-j", "4"])
+
+        # THEN
+        assert namespace.max_workers == 4
+
+    def test_parser_rejects_max_workers_below_one(self):
+        # GIVEN
+        command, parser = self.get_prepared_parser()
+
+        # WHEN
+        args = parser.parse_args(["results.txt", "--max-workers", "0"])
+
+        # THEN
+        with pytest.raises(SystemExit):
+            command.run(args, parser)
+
+
+class TestDiffSubCommand:
+    @staticmethod
+    def get_prepared_parser():
+        parser = argparse.ArgumentParser()
+        command = DiffCommand()
+        command.prepare_parser(parser)
+
+        return command, parser
+
+    def test_parser_rejects_a_single_argument(self):
+        # GIVEN
+        _, parser = self.get_prepared_parser()
+
+        # WHEN / THEN
+        with pytest.raises(SystemExit):
+            parser.parse_args(["before.bin"])
+
+    def test_parser_accepts_two_arguments(self):
+        # GIVEN
+        _, parser = self.get_prepared_parser()
+
+        # WHEN
+        namespace = parser.parse_args(["before.bin", "after.bin"])
+
+        # THEN
+        assert namespace.before == "before.bin"
+        assert namespace.after == "after.bin"
+        assert namespace.show_memory_leaks is False
+        assert namespace.max_rows is None
+        assert namespace.max_workers is None
+
+    def test_parser_takes_memory_leaks_as_a_flag(self):
+        # GIVEN
+        _, parser = self.get_prepared_parser()
+
+        # WHEN
+        namespace = parser.parse_args(["before.bin", "after.bin", "--leaks"])
+
+        # THEN
+        assert namespace.show_memory_leaks is True
+
+    def test_parser_rejects_max_workers_below_one(self):
+        # GIVEN
+        command, parser = self.get_prepared_parser()
+
+        # WHEN
+        args = parser.parse_args(["before.bin", "after.bin", "-j", "0"])
+
+        # THEN
+        with pytest.raises(SystemExit):
+            command.run(args, parser)
+
+
+class TestTransformSubCommand:
+    @staticmethod
+    def get_prepared_parser():
+        parser = argparse.ArgumentParser()
+        command = TransformCommand()
+        command.prepare_parser(parser)
+
+        return command, parser
+
+    def test_parser_rejects_unknown_formats(self):
+        # GIVEN
+        _, parser = self.get_prepared_parser()
+
+        # WHEN / THEN
+        with pytest.raises(SystemExit):
+            parser.parse_args(["json", "results.bin"])
+
+    @pytest.mark.parametrize("profile_format", ["pprof", "collapsed"])
+    def test_parser_accepts_format_and_results(self, profile_format):
+        # GIVEN
+        _, parser = self.get_prepared_parser()
+
+        # WHEN
+        namespace = parser.parse_args([profile_format, "results.bin"])
+
+        # THEN
+        assert namespace.format == profile_format
+        assert namespace.results == "results.bin"
+        assert namespace.output is None
+        assert namespace.force is False
+        assert namespace.show_memory_leaks is False
+
+    @pytest.mark.parametrize(
+        "profile_format, expected",
+        [
+            ("pprof", "memray-pprof-results.pb.gz"),
+            ("collapsed", "memray-collapsed-results.txt"),
+        ],
+    )
+    def test_output_file_is_named_after_the_results(
+        self, tmp_path, profile_format, expected
+    ):
+        # GIVEN
+        command, _ = self.get_prepared_parser()
+
+        # WHEN
+        output_file = command.determine_output_filename(
+            tmp_path / "memray-results.bin", profile_format
+        )
+
+        # THEN
+        assert output_file == tmp_path / expected
@@ -1,4 +1,5 @@
 import sys
+from dataclasses import dataclass
 
 from memray import AllocatorType
 from memray import FileReader
@@ -10,6 +11,15 @@ from tests.utils import MockAllocationRecord
 from tests.utils import filter_relevant_allocations
 
 
+@dataclass
+class NamedThreadMockAllocationRecord(MockAllocationRecord):
+    _thread_name: str = ""
+
+    @property
+    def thread_name(self):
+        return self._thread_name
+
+
 class TestFlameGraphReporter:
     def test_works_with_no_allocations(self):
         reporter = FlameGraphReporter.from_snapshot(
@@ -263,6 +273,51 @@ class TestFlameGraphReporter:
         child = reporter.data["children"][0]
         assert child["name"] == "            allocator.valloc(1024)\n"
 
+    def test_native_tree_matches_the_python_one(self, tmp_path):
+        # GIVEN
+        allocator = MemoryAllocator()
+        output = tmp_path / "test.bin"
+
+        def recurse(depth):
+            if depth == 0:
+                allocator.valloc(1024)
+            else:
+                recurse(depth - 1)
+
+        with Tracker(output):
+            for depth in (1, 5, 5, MAX_STACKS + 50):
+                recurse(depth)
+            allocator.valloc(2048)
+
+        reader = FileReader(output)
+        peak_allocations = list(
+            filter_relevant_allocations(reader.get_high_watermark_allocation_records())
+        )
+        mock_allocations = [
+            NamedThreadMockAllocationRecord(
+                tid=record.tid,
+                address=record.address,
+                size=record.size,
+                allocator=record.allocator,
+                stack_id=record.stack_id,
+                n_allocations=record.n_allocations,
+                _stack=record.stack_trace(),
+                _thread_name=record.thread_name,
+            )
+            for record in peak_allocations
+        ]
+
+        # WHEN
+        native_reporter = FlameGraphReporter.from_snapshot(
+            peak_allocations, memory_records=[], native_traces=False
+        )
+        python_reporter = FlameGraphReporter.from_snapshot(
+            mock_allocations, memory_records=[], native_traces=False
+        )
+
+        # THEN
+        assert native_reporter.data == python_reporter.data
+
     def test_works_with_multiple_stacks_from_same_caller_two_frames_above(self):
         # GIVEN
         peak_allocations = [
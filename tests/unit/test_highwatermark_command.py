@@ -9,6 +9,7 @@ import pytest
 
 from memray._errors import MemrayCommandError
 from memray.commands.common import HighWatermarkCommand
+from memray.commands.common import default_symbol_cache_dir
 
 
 class TestFilenameValidation:
@@ -162,7 +163,11 @@ class TestReportGeneration:
 
         # THEN
         calls = [
-            call(os.fspath(result_path)),
+            call(
+                os.fspath(result_path),
+                symbol_cache_dir=default_symbol_cache_dir(),
+                high_watermark_index=True,
+            ),
             call().get_high_watermark_allocation_records(merge_threads=merge_threads),
             call().get_memory_records(),
         ]
@@ -190,7 +195,11 @@ class TestReportGeneration:
 
         # THEN
         calls = [
-            call(os.fspath(result_path)),
+            call(
+                os.fspath(result_path),
+                symbol_cache_dir=default_symbol_cache_dir(),
+                high_watermark_index=True,
+            ),
             call().get_leaked_allocation_records(merge_threads=merge_threads),
             call().get_memory_records(),
         ]
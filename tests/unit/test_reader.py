@@ -1,7 +1,9 @@
 import os
+import struct
 
 import pytest
 
+from memray import AllocatorType
 from memray import FileReader
 from memray import Tracker
 from memray._memray import MemoryAllocator
@@ -48,6 +50,72 @@ def test_rejects_different_header_version(tmp_path):
         FileReader(output).get_allocation_records()
 
 
+def test_reads_version_6_files(tmp_path):
+    """Files from before the compact record format can still be read."""
+    # GIVEN
+    # A header followed by a frame, a push, an allocation, a pop and a free,
+    # all of them written the way version 6 of the format wrote them.
+    tid = 7
+    header = (
+        b"memray\0"
+        + struct.pack("=i?QQqq", 6, False, 2, 1, 1000, 2000)
+        + b"python\0"
+        + struct.pack("=ii", 1234, 3)
+    )
+    records = (
+        struct.pack("=iQ", 2, 1)
+        + b"func\0file.py\0"
+        + struct.pack("=i", 42)
+        + struct.pack("=iQQ", 3, 1, tid)
+        + struct.pack("=iQQQi4xQ", 1, tid, 0x1000, 1024, 7, 0)
+        + struct.pack("=iQB7x", 8, tid, 1)
+        + struct.pack("=iQQQi4xQ", 1, tid, 0x1000, 0, 2, 0)
+    )
+    output = tmp_path / "test.bin"
+    output.write_bytes(header + records)
+
+    # WHEN
+    reader = FileReader(output)
+    allocations = list(reader.get_allocation_records())
+
+    # THEN
+    assert reader.metadata.pid == 1234
+    assert reader.metadata.sample_rate == 0
+    assert [record.allocator for record in allocations] == [
+        AllocatorType.VALLOC,
+        AllocatorType.FREE,
+    ]
+    assert allocations[0].address == allocations[1].address == 0x1000
+    assert allocations[0].tid == allocations[1].tid
+    assert allocations[0].size == 1024
+    assert allocations[0].stack_trace() == [("func", "file.py", 42)]
+    assert allocations[1].stack_trace() == []
+
+
+def test_reads_stacks_of_threads_with_huge_ids(tmp_path):
+    """A thread id far beyond the others doesn't make the reader run out of memory."""
+    # GIVEN
+    # A version 7 header, with no tracker overhead, followed by a checkpoint
+    # with a one frame stack for a thread with a huge id.
+    header = (
+        b"memray\0"
+        + struct.pack("=i?QQqq", 7, False, 0, 0, 1000, 2000)
+        + b"python\0"
+        + struct.pack("=ii", 1234, 3)
+        + struct.pack("=QiQQ", 0, 1, 0, 0)
+        + struct.pack("=5QI", 0, 0, 0, 0, 0, 0)
+    )
+    records = struct.pack("=BQQQ", 17, 0, 0, 1) + struct.pack("=QQQ", 2**62, 1, 1)
+    output = tmp_path / "test.bin"
+    output.write_bytes(header + records)
+
+    # WHEN
+    allocations = list(FileReader(output).get_allocation_records())
+
+    # THEN
+    assert allocations == []
+
+
 def test_filereader_fails_to_open_file(tmp_path):
     """This checks that we throw in the FileSource C++ ctor when we fail to open the stream."""
     # GIVEN
@@ -77,3 +145,101 @@ def test_read_pid(tmp_path):
 
     # THEN
     assert FileReader(output).metadata.pid == os.getpid()
+
+
+@pytest.mark.parametrize("streaming", [False, True])
+def test_high_watermark_index_is_reused_until_the_file_changes(tmp_path, streaming):
+    # GIVEN
+    output = tmp_path / "test.bin"
+    index = tmp_path / ".test.bin.memray-index"
+    allocator = MemoryAllocator()
+    with Tracker(output):
+        allocator.valloc(1024)
+        allocator.free()
+    peak_memory = FileReader(output).metadata.peak_memory
+
+    # WHEN
+    first_reader = FileReader(output, streaming=streaming, high_watermark_index=True)
+
+    # THEN
+    assert first_reader.metadata.peak_memory == peak_memory
+    assert index.exists()
+
+    # WHEN
+    # Replace the peak memory, which is the last field of the index, to tell
+    # whether the next reader got it from there.
+    with index.open("rb+") as f:
+        f.seek(-8, os.SEEK_END)
+        f.write(struct.pack("=Q", 1))
+
+    # THEN
+    reader = FileReader(output, streaming=streaming, high_watermark_index=True)
+    assert reader.metadata.peak_memory == 1
+    assert FileReader(output, streaming=streaming).metadata.peak_memory == peak_memory
+
+    # WHEN
+    stat = output.stat()
+    os.utime(output, ns=(stat.st_atime_ns, stat.st_mtime_ns + 1_000_000_000))
+
+    # THEN
+    reader = FileReader(output, streaming=streaming, high_watermark_index=True)
+    assert reader.metadata.peak_memory == peak_memory
+
+
+def test_progress_callback_reports_each_phase_of_the_read(tmp_path):
+    # GIVEN
+    output = tmp_path / "test.bin"
+    allocator = MemoryAllocator()
+    with Tracker(output):
+        for _ in range(10_000):
+            allocator.valloc(1024)
+            allocator.free()
+    updates = []
+
+    # WHEN
+    reader = FileReader(output, max_workers=1, progress_callback=updates.append)
+    list(reader.get_high_watermark_allocation_records())
+
+    # THEN
+    parse_updates = [update for update in updates if update.phase == "parse"]
+    assert parse_updates
+    assert all(not update.finished for update in parse_updates[:-1])
+    last = parse_updates[-1]
+    assert last.finished
+    assert last.completed == last.total == output.stat().st_size
+    assert last.records > 20_000
+    assert last.records_per_second > 0
+    completed = [update.completed for update in parse_updates]
+    assert completed == sorted(completed)
+
+    high_watermark_updates = [
+        update for update in updates if update.phase == "high_watermark"
+    ]
+    last = high_watermark_updates[-1]
+    assert last.finished
+    assert last.completed == last.total >= 20_000
+    assert last.fraction == 1
+
+
+def test_exception_in_progress_callback_stops_the_read(tmp_path):
+    # GIVEN
+    output = tmp_path / "test.bin"
+    allocator = MemoryAllocator()
+    with Tracker(output):
+        for _ in range(10_000):
+            allocator.valloc(1024)
+            allocator.free()
+
+    class Cancelled(Exception):
+        pass
+
+    updates = []
+
+    def callback(update):
+        updates.append(update)
+        raise Cancelled
+
+    # WHEN/THEN
+    with pytest.raises(Cancelled):
+        FileReader(output, max_workers=1, progress_callback=callback)
+    assert len(updates) == 1
@@ -1,9 +1,11 @@
+from types import SimpleNamespace
 from typing import List
 from typing import Tuple
 
 import pytest
 
 from memray import AllocatorType as AT
+from memray.reporters.stats import draw_allocation_stats_histogram
 from memray.reporters.stats import draw_histogram
 from memray.reporters.stats import get_allocator_type_distribution
 from memray.reporters.stats import get_histogram_databins
@@ -367,3 +369,24 @@ def test_draw_histogram_invalid_input():
     # test#3 - Invalid hist_scale_factor value
     with pytest.raises(ValueError):
         _ = draw_histogram([100, 200, 300], bins=5, hist_scale_factor=0)
+
+
+def test_draw_allocation_stats_histogram():
+    # GIVEN
+    input_data = [2500, 11000, 11000, 12000, 60000, 800000, 1500000]
+    stats = SimpleNamespace(
+        num_sized_allocations=len(input_data),
+        min_size=min(input_data),
+        max_size=max(input_data),
+        size_histogram=lambda bins: get_histogram_databins(input_data, bins),
+    )
+
+    # WHEN
+    actual_output = draw_allocation_stats_histogram(stats, bins=5)
+
+    # THEN
+    assert actual_output == draw_histogram(input_data, bins=5)
+    no_sizes = SimpleNamespace(num_sized_allocations=0)
+    assert draw_allocation_stats_histogram(no_sizes, bins=5) == "<no data for histogram>"
+    with pytest.raises(ValueError):
+        _ = draw_allocation_stats_histogram(stats, bins=0)
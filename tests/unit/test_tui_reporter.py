@@ -1,4 +1,5 @@
 import datetime
+from dataclasses import replace
 from io import StringIO
 from unittest.mock import MagicMock
 from unittest.mock import patch
@@ -7,7 +8,9 @@ import pytest
 from rich import print as rprint
 
 from memray import AllocatorType
+from memray import LiveStats
 from memray.reporters.tui import TUI
+from memray.reporters.tui import IncrementalAggregate
 from memray.reporters.tui import Location
 from memray.reporters.tui import MemoryGraph
 from memray.reporters.tui import aggregate_allocations
@@ -370,6 +373,34 @@ class TestTUIHeader:
         actual = [line.rstrip() for line in output.getvalue().splitlines()]
         assert actual == expected
 
+    @pytest.mark.parametrize("n_reports", [0, 3])
+    def test_live_stats(self, n_reports):
+        # GIVEN
+        output = StringIO()
+        tui = make_tui()
+        stats = LiveStats(
+            n_allocations=100,
+            n_reports=n_reports,
+            sender_blocked_time_ns=250_000_000,
+            lag_ns=3_000_000,
+            max_lag_ns=5_000_000,
+        )
+
+        # WHEN
+        tui.update_snapshot([])
+        tui.update_live_stats(stats)
+        rprint(tui.get_header(), file=output)
+
+        # THEN
+        header = output.getvalue()
+        if n_reports:
+            assert "Blocked" in header and "0.25s" in header
+            assert "Lag" in header and "3ms" in header
+            assert tui.layout["header"].size == 8
+        else:
+            assert "Blocked" not in header
+            assert tui.layout["header"].size == 7
+
 
 class TestGraph:
     def test_empty(self):
@@ -1216,3 +1247,109 @@ class TestAggregateResults:
         assert me.own_memory == 40
         assert me.total_memory == 40
         assert me.n_allocations == 3
+
+
+class TestIncrementalAggregate:
+    def make_records(self):
+        return [
+            MockAllocationRecord(
+                tid=1,
+                address=0x1000000,
+                size=10,
+                allocator=AllocatorType.MALLOC,
+                stack_id=1,
+                n_allocations=2,
+                _stack=[
+                    ("me", "fun.py", 12),
+                    ("parent", "fun.py", 8),
+                    ("grandparent", "fun.py", 4),
+                ],
+            ),
+            MockAllocationRecord(
+                tid=2,
+                address=0x1000000,
+                size=20,
+                allocator=AllocatorType.MALLOC,
+                stack_id=2,
+                n_allocations=1,
+                _stack=[
+                    ("sibling", "fun.py", 16),
+                    ("parent", "fun.py", 8),
+                    ("grandparent", "fun.py", 4),
+                ],
+            ),
+            MockAllocationRecord(
+                tid=1,
+                address=0x1000000,
+                size=30,
+                allocator=AllocatorType.MALLOC,
+                stack_id=3,
+                n_allocations=1,
+                _stack=[],
+            ),
+        ]
+
+    def test_matches_aggregate_allocations(self):
+        # GIVEN
+        records = self.make_records()
+        aggregate = IncrementalAggregate()
+
+        # WHEN
+        aggregate.update(records)
+
+        # THEN
+        assert aggregate.entries == aggregate_allocations(records)
+        assert aggregate.total_memory == 60
+        assert aggregate.total_allocations == 4
+
+    def test_changed_and_removed_records(self):
+        # GIVEN
+        me, sibling, unknown = self.make_records()
+        aggregate = IncrementalAggregate()
+        aggregate.update([me, sibling, unknown])
+
+        # WHEN
+        grown_me = replace(me, size=100, n_allocations=5, _stack=None)
+        freed_sibling = replace(sibling, size=0, n_allocations=0, _stack=None)
+        aggregate.update([grown_me, freed_sibling])
+
+        # THEN
+        remaining = [replace(me, size=100, n_allocations=5), unknown]
+        assert aggregate.entries == aggregate_allocations(remaining)
+        assert Location(function="sibling", file="fun.py") not in aggregate.entries
+        parent = aggregate.entries[Location(function="parent", file="fun.py")]
+        assert parent.thread_ids == {1}
+        assert aggregate.total_memory == 130
+        assert aggregate.total_allocations == 6
+
+    def test_refreshed_stacks_replace_provisional_frames(self):
+        # GIVEN
+        record = MockAllocationRecord(
+            tid=1,
+            address=0x1000000,
+            size=10,
+            allocator=AllocatorType.MALLOC,
+            stack_id=1,
+            n_allocations=2,
+            _stack=[("me", "fun.py", 12)],
+            _hybrid_stack=[
+                ("libfoo.so+0x1234", "/lib/libfoo.so", 0),
+                ("me", "fun.py", 12),
+            ],
+        )
+        aggregate = IncrementalAggregate(native_traces=True)
+        aggregate.update([record])
+
+        # WHEN
+        record._hybrid_stack = [("compute", "foo.c", 42), ("me", "fun.py", 12)]
+        aggregate.refresh_stacks()
+
+        # THEN
+        assert aggregate.entries == aggregate_allocations([record], native_traces=True)
+        assert Location(function="compute", file="foo.c") in aggregate.entries
+        assert (
+            Location(function="libfoo.so+0x1234", file="/lib/libfoo.so")
+            not in aggregate.entries
+        )
+        assert aggregate.total_memory == 10
+        assert aggregate.total_allocations == 2